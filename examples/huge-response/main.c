@@ -27,41 +27,70 @@ static long getparam(struct mg_http_message *hm, const char *json_path) {
   return dv;
 }
 
-static size_t printdata(void (*out)(char, void *), void *ptr, va_list *ap) {
-  unsigned start = va_arg(*ap, unsigned);
-  unsigned max = start + CHUNK_SIZE;
-  const char *comma = "";
-  size_t n = 0;
-  if (max > DATA_SIZE) max = DATA_SIZE;
-  while (start < max) {
-    n += mg_rprintf(out, ptr, "%s%d", comma, s_data[start]);
-    comma = ",";
-    start++;
+// Response state, kept while the response is sent
+struct response {
+  long version;  // Data version requested by the client
+  long i, max;   // Next element to send, and the end
+  bool started;  // Response object is opened
+};
+
+// Write the next piece of the response. Called as the send buffer drains
+static bool gen(struct mg_json_writer *w, void *fn_data) {
+  struct response *r = fn_data;
+  if (w == NULL) {  // Connection is closed before the response is complete
+    free(r);
+    return false;
+  }
+  if (!r->started) {
+    r->started = true;
+    mg_json_begin_object(w);
+    mg_json_key(w, "version");
+    if (r->version > 0 && r->version != s_version) {
+      // Version mismatch: s_data has changed while client fetches it
+      // Tell client to restart
+      mg_json_int(w, r->version);
+      mg_json_key(w, "error");
+      mg_json_str(w, "wrong version");
+      mg_json_end_object(w);
+      free(r);
+      return false;
+    }
+    mg_json_int(w, s_version);
+    mg_json_key(w, "start");
+    mg_json_int(w, r->i);
+    mg_json_key(w, "data");
+    mg_json_begin_array(w);
+  } else if (r->i < r->max) {
+    mg_json_int(w, s_data[r->i++]);
+  } else {
+    mg_json_end_array(w);
+    mg_json_end_object(w);
+    free(r);
+    return false;
   }
-  return n;
+  return true;
 }
 
 static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
   if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = ev_data;
     if (mg_http_match_uri(hm, "/api/data")) {
-      long start = getparam(hm, "$.start");
-      long version = getparam(hm, "$.version");
-      char *response = NULL;
+      struct response *r = calloc(1, sizeof(*r));
       MG_INFO(("%.*s", (int) hm->body.len, hm->body.ptr));
-      if (version > 0 && version != s_version) {
-        // Version mismatch: s_data has changed while client fetches it
-        // Tell client to restart
-        response = mg_mprintf("{%Q:%Q, %Q:%ld}", "error", "wrong version",
-                              "version", version);
+      if (r == NULL) {
+        mg_http_reply(c, 500, "", "OOM\n");
       } else {
         // Return data, up to CHUNK_SIZE elements
-        response = mg_mprintf("{%Q:%ld,%Q:%ld,%Q:[%M]}", "version", s_version,
-                              "start", start, "data", printdata, start);
+        r->version = getparam(hm, "$.version");
+        r->i = getparam(hm, "$.start");
+        if (r->i < 0) r->i = 0;
+        r->max = r->i + CHUNK_SIZE > DATA_SIZE ? DATA_SIZE : r->i + CHUNK_SIZE;
+        // Stream JSON straight into the send buffer, as a chunked response
+        if (!mg_http_json_stream(c, 200, "Content-Type: text/json\r\n", gen,
+                                 r)) {
+          free(r);
+        }
       }
-      mg_http_reply(c, 200, "Content-Type: text/json\r\n", "%s", response);
-      MG_INFO(("%s", response));
-      free(response);
     } else {
       struct mg_http_serve_opts opts = {0};
       opts.root_dir = s_root_dir;
@@ -8,46 +8,48 @@
 static const char *s_listen_on = "ws://localhost:8000";
 static const char *s_web_root = "web_root";
 
-// RPC functions. Take string params, return (allocated) string result
+// RPC functions. Take the indexed request, return (allocated) string result
 
-static char *sum(struct mg_str params) {
+static char *sum(struct mg_json_index *idx) {
   double a = 0.0, b = 0.0;
-  mg_json_get_num(params, "$[0]", &a);
-  mg_json_get_num(params, "$[1]", &b);
+  mg_json_get_num(mg_json_index_get(idx, "$.params[0]"), "$", &a);
+  mg_json_get_num(mg_json_index_get(idx, "$.params[1]"), "$", &b);
   return mg_mprintf("%g", a + b);
 }
 
-static char *multiply(struct mg_str params) {
+static char *multiply(struct mg_json_index *idx) {
   double a = 0.0, b = 0.0;
-  mg_json_get_num(params, "$[0]", &a);
-  mg_json_get_num(params, "$[1]", &b);
+  mg_json_get_num(mg_json_index_get(idx, "$.params[0]"), "$", &a);
+  mg_json_get_num(mg_json_index_get(idx, "$.params[1]"), "$", &b);
   return mg_mprintf("%g", a * b);
 }
 
 static void process_json_message(struct mg_connection *c, struct mg_str frame) {
-  struct mg_str params = mg_str(""), id = mg_str("");
-  int params_off = 0, params_len = 0, id_off = 0, id_len = 0;
-  char *response = NULL;
+  struct mg_json_tok toks[32];
+  struct mg_json_index idx;
+  struct mg_str id = mg_str_n(NULL, 0), params = id;
+  char *method = NULL, *response = NULL;
 
   // Parse websocket message, which should be a JSON-RPC frame like this:
   // { "id": 3, "method": "sum", "params": [1,2] }
-  char *method = mg_json_get_str(frame, "$.method");
-  id_off = mg_json_get(frame.ptr, (int) frame.len, "$.id", &id_len);
-  params_off = mg_json_get(frame.ptr, (int) frame.len, "$.params", &params_len);
-  params = mg_str_n(frame.ptr + params_off, params_len);
-  id = mg_str_n(frame.ptr + id_off, id_len);
+  // Tokenise it once, then look fields up in the index
+  if (mg_json_index_init(&idx, frame, toks, 32) > 0) {
+    method = mg_json_get_str(mg_json_index_get(&idx, "$.method"), "$");
+    id = mg_json_index_get(&idx, "$.id");
+    params = mg_json_index_get(&idx, "$.params");
+  }
 
-  if (method == NULL || id_off < 0 || params_off < 0) {
+  if (method == NULL || id.ptr == NULL || params.ptr == NULL) {
     // Invalid frame. Return error and include this frame as error message
     response = mg_mprintf("{%Q:{%Q:%d,%Q:%.*Q}", "error", "code", -32700,
                           "message", (int) frame.len, frame.ptr);
   } else if (strcmp(method, "sum") == 0) {
-    char *result = sum(params);
+    char *result = sum(&idx);
     response = mg_mprintf("{%Q:%.*s, %Q:%s}", "id", (int) id.len, id.ptr,
                           "result", result);
     free(result);
   } else if (strcmp(method, "mul") == 0) {
-    char *result = multiply(params);
+    char *result = multiply(&idx);
     response = mg_mprintf("{%Q:%.*s, %Q:%s}", "id", (int) id.len, id.ptr,
                           "result", result);
     free(result);
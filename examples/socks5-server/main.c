@@ -59,36 +59,6 @@ static void handshake(struct mg_connection *c) {
   }
 }
 
-static void disband(struct mg_connection *c) {
-  struct mg_connection *c2 = (struct mg_connection *) c->fn_data;
-  if (c2 != NULL) {
-    c2->is_draining = 1;
-    c2->fn_data = NULL;
-  }
-  c->is_draining = 1;
-  c->fn_data = NULL;
-}
-
-static void exchange(struct mg_connection *c) {
-  struct mg_connection *c2 = (struct mg_connection *) c->fn_data;
-  if (c2 != NULL) {
-    mg_send(c2, c->recv.buf, c->recv.len);
-    mg_iobuf_del(&c->recv, 0, c->recv.len);
-  } else {
-    c->is_draining = 1;
-  }
-}
-
-static void fn2(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
-  if (ev == MG_EV_READ) {
-    exchange(c);
-  } else if (ev == MG_EV_CLOSE) {
-    disband(c);
-  }
-  (void) ev_data;
-  (void) fn_data;
-}
-
 //  Request, https://www.ietf.org/rfc/rfc1928.txt paragraph 4
 //  +----+-----+-------+------+----------+----------+
 //  |VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
@@ -97,6 +67,7 @@ static void fn2(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 //  +----+-----+-------+------+----------+----------+
 static void request(struct mg_connection *c) {
   struct mg_iobuf *r = &c->recv;
+  struct mg_connection *c2 = NULL;
   uint8_t *p = r->buf, addr_len = 4, reply = RESP_SUCCESS;
   int ver, cmd, atyp;
   char addr[1024];
@@ -114,7 +85,7 @@ static void request(struct mg_connection *c) {
     if (r->len < (size_t) addr_len + 6) return; /* return if not buffered */
     snprintf(addr, sizeof(addr), "tcp://%d.%d.%d.%d:%d", p[4], p[5], p[6], p[7],
              p[8] << 8 | p[9]);
-    c->fn_data = mg_connect(c->mgr, addr, fn2, c);
+    c2 = mg_connect(c->mgr, addr, NULL, NULL);
   } else if (atyp == ADDR_TYPE_IPV6) {
     addr_len = 16;
     if (r->len < (size_t) addr_len + 6) return; /* return if not buffered */
@@ -122,13 +93,13 @@ static void request(struct mg_connection *c) {
              p[4] << 8 | p[5], p[6] << 8 | p[7], p[8] << 8 | p[9],
              p[10] << 8 | p[11], p[12] << 8 | p[13], p[14] << 8 | p[15],
              p[16] << 8 | p[17], p[18] << 8 | p[19], p[20] << 8 | p[21]);
-    c->fn_data = mg_connect(c->mgr, addr, fn2, c);
+    c2 = mg_connect(c->mgr, addr, NULL, NULL);
   } else if (atyp == ADDR_TYPE_DOMAIN) {
     addr_len = p[4] + 1;
     if (r->len < (size_t) addr_len + 6) return; /* return if not buffered */
     snprintf(addr, sizeof(addr), "tcp://%.*s:%d", p[4], p + 5,
              p[4 + addr_len] << 8 | p[4 + addr_len + 1]);
-    c->fn_data = mg_connect(c->mgr, addr, fn2, c);
+    c2 = mg_connect(c->mgr, addr, NULL, NULL);
   } else {
     reply = RESP_ADDR_NOT_SUPPORTED;
   }
@@ -146,7 +117,11 @@ static void request(struct mg_connection *c) {
   }
   mg_send(c, r->buf + 3, addr_len + 1 + 2);
   mg_iobuf_del(r, 0, 6 + addr_len);  // Remove request from the input stream
-  c->label[0] = STATE_ESTABLISHED;   // Mark ourselves as connected
+  if (c2 != NULL && mg_bridge(c, c2, 0)) {
+    c->label[0] = STATE_ESTABLISHED;  // Bridge relays data from now on
+  } else {
+    c->is_draining = 1;
+  }
 }
 
 static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
@@ -154,9 +129,6 @@ static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
     // We use the first label byte as a state
     if (c->label[0] == STATE_HANDSHAKE) handshake(c);
     if (c->label[0] == STATE_REQUEST) request(c);
-    if (c->label[0] == STATE_ESTABLISHED) exchange(c);
-  } else if (ev == MG_EV_CLOSE) {
-    disband(c);
   }
   (void) fn_data;
   (void) ev_data;
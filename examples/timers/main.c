@@ -33,12 +33,10 @@ static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 
 static void timer_fn(void *arg) {
   struct mg_mgr *mgr = (struct mg_mgr *) arg;
-  // Broadcast "hi" message to all connected websocket clients.
-  // Traverse over all connections
-  for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
-    // Send only to marked connections
-    if (c->label[0] == 'W') mg_ws_send(c, "hi", 2, WEBSOCKET_OP_TEXT);
-  }
+  // Broadcast "hi" message to all marked websocket clients.
+  // The frame is built once and shared between connections
+  struct mg_ws_broadcast_opts opts = {"W", 0, MG_WS_DROP};
+  mg_ws_broadcast(mgr, "hi", 2, WEBSOCKET_OP_TEXT, &opts);
 }
 
 int main(void) {
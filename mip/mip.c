@@ -751,15 +751,27 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
   return true;
 }
 
+// Data queued by the protocol outside of c->send, see c->ppending
+static size_t pending(const struct mg_connection *c, const void **buf) {
+  return c->ppending == NULL ? 0 : c->ppending(c, buf);
+}
+
 static void write_conn(struct mg_connection *c) {
   struct mip_if *ifp = (struct mip_if *) c->mgr->priv;
   struct tcpstate *s = (struct tcpstate *) (c + 1);
   size_t sent, n = c->send.len, hdrlen = 14 + 24 /*max IP*/ + 60 /*max TCP*/;
+  const void *buf = c->send.buf, *q = NULL;
+  size_t qlen = pending(c, &q);  // E.g. WebSocket broadcast frames go first
+  if (qlen > 0) buf = q, n = qlen;
   if (n + hdrlen > ifp->tx.len) n = ifp->tx.len - hdrlen;
   sent = tx_tcp(ifp, c->rem.ip, TH_PUSH | TH_ACK, c->loc.port, c->rem.port,
-                mg_htonl(s->seq), mg_htonl(s->ack), c->send.buf, n);
+                mg_htonl(s->seq), mg_htonl(s->ack), buf, n);
   if (sent > 0) {
-    mg_iobuf_del(&c->send, 0, n);
+    if (qlen > 0) {
+      c->psent(c, n);
+    } else {
+      mg_iobuf_del(&c->send, 0, n);
+    }
     s->seq += (uint32_t) n;
     mg_call(c, MG_EV_WRITE, &n);
   }
@@ -779,8 +791,10 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   mg_timer_poll(&mgr->timers, now);
   for (c = mgr->conns; c != NULL; c = tmp) {
     tmp = c->next;
-    if (c->send.len > 0) write_conn(c);
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+    if (c->send.len > 0 || pending(c, NULL) > 0) write_conn(c);
+    if (c->is_draining && c->send.len == 0 && pending(c, NULL) == 0) {
+      c->is_closing = 1;
+    }
     if (c->is_closing) {
       if (c->is_udp == false && c->is_listening == false) fin_conn(c);
       mg_close_conn(c);
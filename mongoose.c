@@ -112,50 +112,1186 @@ int mg_base64_decode(const char *src, int n, char *dst) {
 #endif
 
 
+// Doubles are formatted with Grisu2 (Loitsch, "Printing Floating-Point
+// Numbers Quickly and Accurately with Integers", 2010), which produces the
+// shortest, or very nearly the shortest, digit string that parses back to
+// the same double. A fixed number of digits uses the counted variant of
+// Grisu from the same paper. Parsing uses the Eisel-Lemire algorithm (Lemire,
+// "Number Parsing at a Gigabyte per Second", 2021) with a Clinger fast path.
+// When the fast algorithms can't tell which way to round, exact big integer
+// arithmetic decides, so both directions are correctly rounded.
+
+union dbl_bits {
+  double f;
+  uint64_t u;
+};
+
+// 64x64 -> 128 bit multiplication
+static void mul128(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo) {
+  uint64_t a0 = a & 0xffffffff, a1 = a >> 32, b0 = b & 0xffffffff,
+           b1 = b >> 32;
+  uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+  uint64_t mid = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+  *lo = (mid << 32) | (p00 & 0xffffffff);
+  *hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
+
+// 128-bit approximations of 5^q, q = -342..308: high 64 bits, low 64 bits
+static const uint64_t s_pow5[] = {
+    0xEEF453D6923BD65A, 0x113FAA2906A13B3F,
+    0x9558B4661B6565F8, 0x4AC7CA59A424C507,
+    0xBAAEE17FA23EBF76, 0x5D79BCF00D2DF649,
+    0xE95A99DF8ACE6F53, 0xF4D82C2C107973DC,
+    0x91D8A02BB6C10594, 0x79071B9B8A4BE869,
+    0xB64EC836A47146F9, 0x9748E2826CDEE284,
+    0xE3E27A444D8D98B7, 0xFD1B1B2308169B25,
+    0x8E6D8C6AB0787F72, 0xFE30F0F5E50E20F7,
+    0xB208EF855C969F4F, 0xBDBD2D335E51A935,
+    0xDE8B2B66B3BC4723, 0xAD2C788035E61382,
+    0x8B16FB203055AC76, 0x4C3BCB5021AFCC31,
+    0xADDCB9E83C6B1793, 0xDF4ABE242A1BBF3D,
+    0xD953E8624B85DD78, 0xD71D6DAD34A2AF0D,
+    0x87D4713D6F33AA6B, 0x8672648C40E5AD68,
+    0xA9C98D8CCB009506, 0x680EFDAF511F18C2,
+    0xD43BF0EFFDC0BA48, 0x0212BD1B2566DEF2,
+    0x84A57695FE98746D, 0x014BB630F7604B57,
+    0xA5CED43B7E3E9188, 0x419EA3BD35385E2D,
+    0xCF42894A5DCE35EA, 0x52064CAC828675B9,
+    0x818995CE7AA0E1B2, 0x7343EFEBD1940993,
+    0xA1EBFB4219491A1F, 0x1014EBE6C5F90BF8,
+    0xCA66FA129F9B60A6, 0xD41A26E077774EF6,
+    0xFD00B897478238D0, 0x8920B098955522B4,
+    0x9E20735E8CB16382, 0x55B46E5F5D5535B0,
+    0xC5A890362FDDBC62, 0xEB2189F734AA831D,
+    0xF712B443BBD52B7B, 0xA5E9EC7501D523E4,
+    0x9A6BB0AA55653B2D, 0x47B233C92125366E,
+    0xC1069CD4EABE89F8, 0x999EC0BB696E840A,
+    0xF148440A256E2C76, 0xC00670EA43CA250D,
+    0x96CD2A865764DBCA, 0x380406926A5E5728,
+    0xBC807527ED3E12BC, 0xC605083704F5ECF2,
+    0xEBA09271E88D976B, 0xF7864A44C633682E,
+    0x93445B8731587EA3, 0x7AB3EE6AFBE0211D,
+    0xB8157268FDAE9E4C, 0x5960EA05BAD82964,
+    0xE61ACF033D1A45DF, 0x6FB92487298E33BD,
+    0x8FD0C16206306BAB, 0xA5D3B6D479F8E056,
+    0xB3C4F1BA87BC8696, 0x8F48A4899877186C,
+    0xE0B62E2929ABA83C, 0x331ACDABFE94DE87,
+    0x8C71DCD9BA0B4925, 0x9FF0C08B7F1D0B14,
+    0xAF8E5410288E1B6F, 0x07ECF0AE5EE44DD9,
+    0xDB71E91432B1A24A, 0xC9E82CD9F69D6150,
+    0x892731AC9FAF056E, 0xBE311C083A225CD2,
+    0xAB70FE17C79AC6CA, 0x6DBD630A48AAF406,
+    0xD64D3D9DB981787D, 0x092CBBCCDAD5B108,
+    0x85F0468293F0EB4E, 0x25BBF56008C58EA5,
+    0xA76C582338ED2621, 0xAF2AF2B80AF6F24E,
+    0xD1476E2C07286FAA, 0x1AF5AF660DB4AEE1,
+    0x82CCA4DB847945CA, 0x50D98D9FC890ED4D,
+    0xA37FCE126597973C, 0xE50FF107BAB528A0,
+    0xCC5FC196FEFD7D0C, 0x1E53ED49A96272C8,
+    0xFF77B1FCBEBCDC4F, 0x25E8E89C13BB0F7A,
+    0x9FAACF3DF73609B1, 0x77B191618C54E9AC,
+    0xC795830D75038C1D, 0xD59DF5B9EF6A2417,
+    0xF97AE3D0D2446F25, 0x4B0573286B44AD1D,
+    0x9BECCE62836AC577, 0x4EE367F9430AEC32,
+    0xC2E801FB244576D5, 0x229C41F793CDA73F,
+    0xF3A20279ED56D48A, 0x6B43527578C1110F,
+    0x9845418C345644D6, 0x830A13896B78AAA9,
+    0xBE5691EF416BD60C, 0x23CC986BC656D553,
+    0xEDEC366B11C6CB8F, 0x2CBFBE86B7EC8AA8,
+    0x94B3A202EB1C3F39, 0x7BF7D71432F3D6A9,
+    0xB9E08A83A5E34F07, 0xDAF5CCD93FB0CC53,
+    0xE858AD248F5C22C9, 0xD1B3400F8F9CFF68,
+    0x91376C36D99995BE, 0x23100809B9C21FA1,
+    0xB58547448FFFFB2D, 0xABD40A0C2832A78A,
+    0xE2E69915B3FFF9F9, 0x16C90C8F323F516C,
+    0x8DD01FAD907FFC3B, 0xAE3DA7D97F6792E3,
+    0xB1442798F49FFB4A, 0x99CD11CFDF41779C,
+    0xDD95317F31C7FA1D, 0x40405643D711D583,
+    0x8A7D3EEF7F1CFC52, 0x482835EA666B2572,
+    0xAD1C8EAB5EE43B66, 0xDA3243650005EECF,
+    0xD863B256369D4A40, 0x90BED43E40076A82,
+    0x873E4F75E2224E68, 0x5A7744A6E804A291,
+    0xA90DE3535AAAE202, 0x711515D0A205CB36,
+    0xD3515C2831559A83, 0x0D5A5B44CA873E03,
+    0x8412D9991ED58091, 0xE858790AFE9486C2,
+    0xA5178FFF668AE0B6, 0x626E974DBE39A872,
+    0xCE5D73FF402D98E3, 0xFB0A3D212DC8128F,
+    0x80FA687F881C7F8E, 0x7CE66634BC9D0B99,
+    0xA139029F6A239F72, 0x1C1FFFC1EBC44E80,
+    0xC987434744AC874E, 0xA327FFB266B56220,
+    0xFBE9141915D7A922, 0x4BF1FF9F0062BAA8,
+    0x9D71AC8FADA6C9B5, 0x6F773FC3603DB4A9,
+    0xC4CE17B399107C22, 0xCB550FB4384D21D3,
+    0xF6019DA07F549B2B, 0x7E2A53A146606A48,
+    0x99C102844F94E0FB, 0x2EDA7444CBFC426D,
+    0xC0314325637A1939, 0xFA911155FEFB5308,
+    0xF03D93EEBC589F88, 0x793555AB7EBA27CA,
+    0x96267C7535B763B5, 0x4BC1558B2F3458DE,
+    0xBBB01B9283253CA2, 0x9EB1AAEDFB016F16,
+    0xEA9C227723EE8BCB, 0x465E15A979C1CADC,
+    0x92A1958A7675175F, 0x0BFACD89EC191EC9,
+    0xB749FAED14125D36, 0xCEF980EC671F667B,
+    0xE51C79A85916F484, 0x82B7E12780E7401A,
+    0x8F31CC0937AE58D2, 0xD1B2ECB8B0908810,
+    0xB2FE3F0B8599EF07, 0x861FA7E6DCB4AA15,
+    0xDFBDCECE67006AC9, 0x67A791E093E1D49A,
+    0x8BD6A141006042BD, 0xE0C8BB2C5C6D24E0,
+    0xAECC49914078536D, 0x58FAE9F773886E18,
+    0xDA7F5BF590966848, 0xAF39A475506A899E,
+    0x888F99797A5E012D, 0x6D8406C952429603,
+    0xAAB37FD7D8F58178, 0xC8E5087BA6D33B83,
+    0xD5605FCDCF32E1D6, 0xFB1E4A9A90880A64,
+    0x855C3BE0A17FCD26, 0x5CF2EEA09A55067F,
+    0xA6B34AD8C9DFC06F, 0xF42FAA48C0EA481E,
+    0xD0601D8EFC57B08B, 0xF13B94DAF124DA26,
+    0x823C12795DB6CE57, 0x76C53D08D6B70858,
+    0xA2CB1717B52481ED, 0x54768C4B0C64CA6E,
+    0xCB7DDCDDA26DA268, 0xA9942F5DCF7DFD09,
+    0xFE5D54150B090B02, 0xD3F93B35435D7C4C,
+    0x9EFA548D26E5A6E1, 0xC47BC5014A1A6DAF,
+    0xC6B8E9B0709F109A, 0x359AB6419CA1091B,
+    0xF867241C8CC6D4C0, 0xC30163D203C94B62,
+    0x9B407691D7FC44F8, 0x79E0DE63425DCF1D,
+    0xC21094364DFB5636, 0x985915FC12F542E4,
+    0xF294B943E17A2BC4, 0x3E6F5B7B17B2939D,
+    0x979CF3CA6CEC5B5A, 0xA705992CEECF9C42,
+    0xBD8430BD08277231, 0x50C6FF782A838353,
+    0xECE53CEC4A314EBD, 0xA4F8BF5635246428,
+    0x940F4613AE5ED136, 0x871B7795E136BE99,
+    0xB913179899F68584, 0x28E2557B59846E3F,
+    0xE757DD7EC07426E5, 0x331AEADA2FE589CF,
+    0x9096EA6F3848984F, 0x3FF0D2C85DEF7621,
+    0xB4BCA50B065ABE63, 0x0FED077A756B53A9,
+    0xE1EBCE4DC7F16DFB, 0xD3E8495912C62894,
+    0x8D3360F09CF6E4BD, 0x64712DD7ABBBD95C,
+    0xB080392CC4349DEC, 0xBD8D794D96AACFB3,
+    0xDCA04777F541C567, 0xECF0D7A0FC5583A0,
+    0x89E42CAAF9491B60, 0xF41686C49DB57244,
+    0xAC5D37D5B79B6239, 0x311C2875C522CED5,
+    0xD77485CB25823AC7, 0x7D633293366B828B,
+    0x86A8D39EF77164BC, 0xAE5DFF9C02033197,
+    0xA8530886B54DBDEB, 0xD9F57F830283FDFC,
+    0xD267CAA862A12D66, 0xD072DF63C324FD7B,
+    0x8380DEA93DA4BC60, 0x4247CB9E59F71E6D,
+    0xA46116538D0DEB78, 0x52D9BE85F074E608,
+    0xCD795BE870516656, 0x67902E276C921F8B,
+    0x806BD9714632DFF6, 0x00BA1CD8A3DB53B6,
+    0xA086CFCD97BF97F3, 0x80E8A40ECCD228A4,
+    0xC8A883C0FDAF7DF0, 0x6122CD128006B2CD,
+    0xFAD2A4B13D1B5D6C, 0x796B805720085F81,
+    0x9CC3A6EEC6311A63, 0xCBE3303674053BB0,
+    0xC3F490AA77BD60FC, 0xBEDBFC4411068A9C,
+    0xF4F1B4D515ACB93B, 0xEE92FB5515482D44,
+    0x991711052D8BF3C5, 0x751BDD152D4D1C4A,
+    0xBF5CD54678EEF0B6, 0xD262D45A78A0635D,
+    0xEF340A98172AACE4, 0x86FB897116C87C34,
+    0x9580869F0E7AAC0E, 0xD45D35E6AE3D4DA0,
+    0xBAE0A846D2195712, 0x8974836059CCA109,
+    0xE998D258869FACD7, 0x2BD1A438703FC94B,
+    0x91FF83775423CC06, 0x7B6306A34627DDCF,
+    0xB67F6455292CBF08, 0x1A3BC84C17B1D542,
+    0xE41F3D6A7377EECA, 0x20CABA5F1D9E4A93,
+    0x8E938662882AF53E, 0x547EB47B7282EE9C,
+    0xB23867FB2A35B28D, 0xE99E619A4F23AA43,
+    0xDEC681F9F4C31F31, 0x6405FA00E2EC94D4,
+    0x8B3C113C38F9F37E, 0xDE83BC408DD3DD04,
+    0xAE0B158B4738705E, 0x9624AB50B148D445,
+    0xD98DDAEE19068C76, 0x3BADD624DD9B0957,
+    0x87F8A8D4CFA417C9, 0xE54CA5D70A80E5D6,
+    0xA9F6D30A038D1DBC, 0x5E9FCF4CCD211F4C,
+    0xD47487CC8470652B, 0x7647C3200069671F,
+    0x84C8D4DFD2C63F3B, 0x29ECD9F40041E073,
+    0xA5FB0A17C777CF09, 0xF468107100525890,
+    0xCF79CC9DB955C2CC, 0x7182148D4066EEB4,
+    0x81AC1FE293D599BF, 0xC6F14CD848405530,
+    0xA21727DB38CB002F, 0xB8ADA00E5A506A7C,
+    0xCA9CF1D206FDC03B, 0xA6D90811F0E4851C,
+    0xFD442E4688BD304A, 0x908F4A166D1DA663,
+    0x9E4A9CEC15763E2E, 0x9A598E4E043287FE,
+    0xC5DD44271AD3CDBA, 0x40EFF1E1853F29FD,
+    0xF7549530E188C128, 0xD12BEE59E68EF47C,
+    0x9A94DD3E8CF578B9, 0x82BB74F8301958CE,
+    0xC13A148E3032D6E7, 0xE36A52363C1FAF01,
+    0xF18899B1BC3F8CA1, 0xDC44E6C3CB279AC1,
+    0x96F5600F15A7B7E5, 0x29AB103A5EF8C0B9,
+    0xBCB2B812DB11A5DE, 0x7415D448F6B6F0E7,
+    0xEBDF661791D60F56, 0x111B495B3464AD21,
+    0x936B9FCEBB25C995, 0xCAB10DD900BEEC34,
+    0xB84687C269EF3BFB, 0x3D5D514F40EEA742,
+    0xE65829B3046B0AFA, 0x0CB4A5A3112A5112,
+    0x8FF71A0FE2C2E6DC, 0x47F0E785EABA72AB,
+    0xB3F4E093DB73A093, 0x59ED216765690F56,
+    0xE0F218B8D25088B8, 0x306869C13EC3532C,
+    0x8C974F7383725573, 0x1E414218C73A13FB,
+    0xAFBD2350644EEACF, 0xE5D1929EF90898FA,
+    0xDBAC6C247D62A583, 0xDF45F746B74ABF39,
+    0x894BC396CE5DA772, 0x6B8BBA8C328EB783,
+    0xAB9EB47C81F5114F, 0x066EA92F3F326564,
+    0xD686619BA27255A2, 0xC80A537B0EFEFEBD,
+    0x8613FD0145877585, 0xBD06742CE95F5F36,
+    0xA798FC4196E952E7, 0x2C48113823B73704,
+    0xD17F3B51FCA3A7A0, 0xF75A15862CA504C5,
+    0x82EF85133DE648C4, 0x9A984D73DBE722FB,
+    0xA3AB66580D5FDAF5, 0xC13E60D0D2E0EBBA,
+    0xCC963FEE10B7D1B3, 0x318DF905079926A8,
+    0xFFBBCFE994E5C61F, 0xFDF17746497F7052,
+    0x9FD561F1FD0F9BD3, 0xFEB6EA8BEDEFA633,
+    0xC7CABA6E7C5382C8, 0xFE64A52EE96B8FC0,
+    0xF9BD690A1B68637B, 0x3DFDCE7AA3C673B0,
+    0x9C1661A651213E2D, 0x06BEA10CA65C084E,
+    0xC31BFA0FE5698DB8, 0x486E494FCFF30A62,
+    0xF3E2F893DEC3F126, 0x5A89DBA3C3EFCCFA,
+    0x986DDB5C6B3A76B7, 0xF89629465A75E01C,
+    0xBE89523386091465, 0xF6BBB397F1135823,
+    0xEE2BA6C0678B597F, 0x746AA07DED582E2C,
+    0x94DB483840B717EF, 0xA8C2A44EB4571CDC,
+    0xBA121A4650E4DDEB, 0x92F34D62616CE413,
+    0xE896A0D7E51E1566, 0x77B020BAF9C81D17,
+    0x915E2486EF32CD60, 0x0ACE1474DC1D122E,
+    0xB5B5ADA8AAFF80B8, 0x0D819992132456BA,
+    0xE3231912D5BF60E6, 0x10E1FFF697ED6C69,
+    0x8DF5EFABC5979C8F, 0xCA8D3FFA1EF463C1,
+    0xB1736B96B6FD83B3, 0xBD308FF8A6B17CB2,
+    0xDDD0467C64BCE4A0, 0xAC7CB3F6D05DDBDE,
+    0x8AA22C0DBEF60EE4, 0x6BCDF07A423AA96B,
+    0xAD4AB7112EB3929D, 0x86C16C98D2C953C6,
+    0xD89D64D57A607744, 0xE871C7BF077BA8B7,
+    0x87625F056C7C4A8B, 0x11471CD764AD4972,
+    0xA93AF6C6C79B5D2D, 0xD598E40D3DD89BCF,
+    0xD389B47879823479, 0x4AFF1D108D4EC2C3,
+    0x843610CB4BF160CB, 0xCEDF722A585139BA,
+    0xA54394FE1EEDB8FE, 0xC2974EB4EE658828,
+    0xCE947A3DA6A9273E, 0x733D226229FEEA32,
+    0x811CCC668829B887, 0x0806357D5A3F525F,
+    0xA163FF802A3426A8, 0xCA07C2DCB0CF26F7,
+    0xC9BCFF6034C13052, 0xFC89B393DD02F0B5,
+    0xFC2C3F3841F17C67, 0xBBAC2078D443ACE2,
+    0x9D9BA7832936EDC0, 0xD54B944B84AA4C0D,
+    0xC5029163F384A931, 0x0A9E795E65D4DF11,
+    0xF64335BCF065D37D, 0x4D4617B5FF4A16D5,
+    0x99EA0196163FA42E, 0x504BCED1BF8E4E45,
+    0xC06481FB9BCF8D39, 0xE45EC2862F71E1D6,
+    0xF07DA27A82C37088, 0x5D767327BB4E5A4C,
+    0x964E858C91BA2655, 0x3A6A07F8D510F86F,
+    0xBBE226EFB628AFEA, 0x890489F70A55368B,
+    0xEADAB0ABA3B2DBE5, 0x2B45AC74CCEA842E,
+    0x92C8AE6B464FC96F, 0x3B0B8BC90012929D,
+    0xB77ADA0617E3BBCB, 0x09CE6EBB40173744,
+    0xE55990879DDCAABD, 0xCC420A6A101D0515,
+    0x8F57FA54C2A9EAB6, 0x9FA946824A12232D,
+    0xB32DF8E9F3546564, 0x47939822DC96ABF9,
+    0xDFF9772470297EBD, 0x59787E2B93BC56F7,
+    0x8BFBEA76C619EF36, 0x57EB4EDB3C55B65A,
+    0xAEFAE51477A06B03, 0xEDE622920B6B23F1,
+    0xDAB99E59958885C4, 0xE95FAB368E45ECED,
+    0x88B402F7FD75539B, 0x11DBCB0218EBB414,
+    0xAAE103B5FCD2A881, 0xD652BDC29F26A119,
+    0xD59944A37C0752A2, 0x4BE76D3346F0495F,
+    0x857FCAE62D8493A5, 0x6F70A4400C562DDB,
+    0xA6DFBD9FB8E5B88E, 0xCB4CCD500F6BB952,
+    0xD097AD07A71F26B2, 0x7E2000A41346A7A7,
+    0x825ECC24C873782F, 0x8ED400668C0C28C8,
+    0xA2F67F2DFA90563B, 0x728900802F0F32FA,
+    0xCBB41EF979346BCA, 0x4F2B40A03AD2FFB9,
+    0xFEA126B7D78186BC, 0xE2F610C84987BFA8,
+    0x9F24B832E6B0F436, 0x0DD9CA7D2DF4D7C9,
+    0xC6EDE63FA05D3143, 0x91503D1C79720DBB,
+    0xF8A95FCF88747D94, 0x75A44C6397CE912A,
+    0x9B69DBE1B548CE7C, 0xC986AFBE3EE11ABA,
+    0xC24452DA229B021B, 0xFBE85BADCE996168,
+    0xF2D56790AB41C2A2, 0xFAE27299423FB9C3,
+    0x97C560BA6B0919A5, 0xDCCD879FC967D41A,
+    0xBDB6B8E905CB600F, 0x5400E987BBC1C920,
+    0xED246723473E3813, 0x290123E9AAB23B68,
+    0x9436C0760C86E30B, 0xF9A0B6720AAF6521,
+    0xB94470938FA89BCE, 0xF808E40E8D5B3E69,
+    0xE7958CB87392C2C2, 0xB60B1D1230B20E04,
+    0x90BD77F3483BB9B9, 0xB1C6F22B5E6F48C2,
+    0xB4ECD5F01A4AA828, 0x1E38AEB6360B1AF3,
+    0xE2280B6C20DD5232, 0x25C6DA63C38DE1B0,
+    0x8D590723948A535F, 0x579C487E5A38AD0E,
+    0xB0AF48EC79ACE837, 0x2D835A9DF0C6D851,
+    0xDCDB1B2798182244, 0xF8E431456CF88E65,
+    0x8A08F0F8BF0F156B, 0x1B8E9ECB641B58FF,
+    0xAC8B2D36EED2DAC5, 0xE272467E3D222F3F,
+    0xD7ADF884AA879177, 0x5B0ED81DCC6ABB0F,
+    0x86CCBB52EA94BAEA, 0x98E947129FC2B4E9,
+    0xA87FEA27A539E9A5, 0x3F2398D747B36224,
+    0xD29FE4B18E88640E, 0x8EEC7F0D19A03AAD,
+    0x83A3EEEEF9153E89, 0x1953CF68300424AC,
+    0xA48CEAAAB75A8E2B, 0x5FA8C3423C052DD7,
+    0xCDB02555653131B6, 0x3792F412CB06794D,
+    0x808E17555F3EBF11, 0xE2BBD88BBEE40BD0,
+    0xA0B19D2AB70E6ED6, 0x5B6ACEAEAE9D0EC4,
+    0xC8DE047564D20A8B, 0xF245825A5A445275,
+    0xFB158592BE068D2E, 0xEED6E2F0F0D56712,
+    0x9CED737BB6C4183D, 0x55464DD69685606B,
+    0xC428D05AA4751E4C, 0xAA97E14C3C26B886,
+    0xF53304714D9265DF, 0xD53DD99F4B3066A8,
+    0x993FE2C6D07B7FAB, 0xE546A8038EFE4029,
+    0xBF8FDB78849A5F96, 0xDE98520472BDD033,
+    0xEF73D256A5C0F77C, 0x963E66858F6D4440,
+    0x95A8637627989AAD, 0xDDE7001379A44AA8,
+    0xBB127C53B17EC159, 0x5560C018580D5D52,
+    0xE9D71B689DDE71AF, 0xAAB8F01E6E10B4A6,
+    0x9226712162AB070D, 0xCAB3961304CA70E8,
+    0xB6B00D69BB55C8D1, 0x3D607B97C5FD0D22,
+    0xE45C10C42A2B3B05, 0x8CB89A7DB77C506A,
+    0x8EB98A7A9A5B04E3, 0x77F3608E92ADB242,
+    0xB267ED1940F1C61C, 0x55F038B237591ED3,
+    0xDF01E85F912E37A3, 0x6B6C46DEC52F6688,
+    0x8B61313BBABCE2C6, 0x2323AC4B3B3DA015,
+    0xAE397D8AA96C1B77, 0xABEC975E0A0D081A,
+    0xD9C7DCED53C72255, 0x96E7BD358C904A21,
+    0x881CEA14545C7575, 0x7E50D64177DA2E54,
+    0xAA242499697392D2, 0xDDE50BD1D5D0B9E9,
+    0xD4AD2DBFC3D07787, 0x955E4EC64B44E864,
+    0x84EC3C97DA624AB4, 0xBD5AF13BEF0B113E,
+    0xA6274BBDD0FADD61, 0xECB1AD8AEACDD58E,
+    0xCFB11EAD453994BA, 0x67DE18EDA5814AF2,
+    0x81CEB32C4B43FCF4, 0x80EACF948770CED7,
+    0xA2425FF75E14FC31, 0xA1258379A94D028D,
+    0xCAD2F7F5359A3B3E, 0x096EE45813A04330,
+    0xFD87B5F28300CA0D, 0x8BCA9D6E188853FC,
+    0x9E74D1B791E07E48, 0x775EA264CF55347E,
+    0xC612062576589DDA, 0x95364AFE032A819E,
+    0xF79687AED3EEC551, 0x3A83DDBD83F52205,
+    0x9ABE14CD44753B52, 0xC4926A9672793543,
+    0xC16D9A0095928A27, 0x75B7053C0F178294,
+    0xF1C90080BAF72CB1, 0x5324C68B12DD6339,
+    0x971DA05074DA7BEE, 0xD3F6FC16EBCA5E04,
+    0xBCE5086492111AEA, 0x88F4BB1CA6BCF585,
+    0xEC1E4A7DB69561A5, 0x2B31E9E3D06C32E6,
+    0x9392EE8E921D5D07, 0x3AFF322E62439FD0,
+    0xB877AA3236A4B449, 0x09BEFEB9FAD487C3,
+    0xE69594BEC44DE15B, 0x4C2EBE687989A9B4,
+    0x901D7CF73AB0ACD9, 0x0F9D37014BF60A11,
+    0xB424DC35095CD80F, 0x538484C19EF38C95,
+    0xE12E13424BB40E13, 0x2865A5F206B06FBA,
+    0x8CBCCC096F5088CB, 0xF93F87B7442E45D4,
+    0xAFEBFF0BCB24AAFE, 0xF78F69A51539D749,
+    0xDBE6FECEBDEDD5BE, 0xB573440E5A884D1C,
+    0x89705F4136B4A597, 0x31680A88F8953031,
+    0xABCC77118461CEFC, 0xFDC20D2B36BA7C3E,
+    0xD6BF94D5E57A42BC, 0x3D32907604691B4D,
+    0x8637BD05AF6C69B5, 0xA63F9A49C2C1B110,
+    0xA7C5AC471B478423, 0x0FCF80DC33721D54,
+    0xD1B71758E219652B, 0xD3C36113404EA4A9,
+    0x83126E978D4FDF3B, 0x645A1CAC083126EA,
+    0xA3D70A3D70A3D70A, 0x3D70A3D70A3D70A4,
+    0xCCCCCCCCCCCCCCCC, 0xCCCCCCCCCCCCCCCD,
+    0x8000000000000000, 0x0000000000000000,
+    0xA000000000000000, 0x0000000000000000,
+    0xC800000000000000, 0x0000000000000000,
+    0xFA00000000000000, 0x0000000000000000,
+    0x9C40000000000000, 0x0000000000000000,
+    0xC350000000000000, 0x0000000000000000,
+    0xF424000000000000, 0x0000000000000000,
+    0x9896800000000000, 0x0000000000000000,
+    0xBEBC200000000000, 0x0000000000000000,
+    0xEE6B280000000000, 0x0000000000000000,
+    0x9502F90000000000, 0x0000000000000000,
+    0xBA43B74000000000, 0x0000000000000000,
+    0xE8D4A51000000000, 0x0000000000000000,
+    0x9184E72A00000000, 0x0000000000000000,
+    0xB5E620F480000000, 0x0000000000000000,
+    0xE35FA931A0000000, 0x0000000000000000,
+    0x8E1BC9BF04000000, 0x0000000000000000,
+    0xB1A2BC2EC5000000, 0x0000000000000000,
+    0xDE0B6B3A76400000, 0x0000000000000000,
+    0x8AC7230489E80000, 0x0000000000000000,
+    0xAD78EBC5AC620000, 0x0000000000000000,
+    0xD8D726B7177A8000, 0x0000000000000000,
+    0x878678326EAC9000, 0x0000000000000000,
+    0xA968163F0A57B400, 0x0000000000000000,
+    0xD3C21BCECCEDA100, 0x0000000000000000,
+    0x84595161401484A0, 0x0000000000000000,
+    0xA56FA5B99019A5C8, 0x0000000000000000,
+    0xCECB8F27F4200F3A, 0x0000000000000000,
+    0x813F3978F8940984, 0x4000000000000000,
+    0xA18F07D736B90BE5, 0x5000000000000000,
+    0xC9F2C9CD04674EDE, 0xA400000000000000,
+    0xFC6F7C4045812296, 0x4D00000000000000,
+    0x9DC5ADA82B70B59D, 0xF020000000000000,
+    0xC5371912364CE305, 0x6C28000000000000,
+    0xF684DF56C3E01BC6, 0xC732000000000000,
+    0x9A130B963A6C115C, 0x3C7F400000000000,
+    0xC097CE7BC90715B3, 0x4B9F100000000000,
+    0xF0BDC21ABB48DB20, 0x1E86D40000000000,
+    0x96769950B50D88F4, 0x1314448000000000,
+    0xBC143FA4E250EB31, 0x17D955A000000000,
+    0xEB194F8E1AE525FD, 0x5DCFAB0800000000,
+    0x92EFD1B8D0CF37BE, 0x5AA1CAE500000000,
+    0xB7ABC627050305AD, 0xF14A3D9E40000000,
+    0xE596B7B0C643C719, 0x6D9CCD05D0000000,
+    0x8F7E32CE7BEA5C6F, 0xE4820023A2000000,
+    0xB35DBF821AE4F38B, 0xDDA2802C8A800000,
+    0xE0352F62A19E306E, 0xD50B2037AD200000,
+    0x8C213D9DA502DE45, 0x4526F422CC340000,
+    0xAF298D050E4395D6, 0x9670B12B7F410000,
+    0xDAF3F04651D47B4C, 0x3C0CDD765F114000,
+    0x88D8762BF324CD0F, 0xA5880A69FB6AC800,
+    0xAB0E93B6EFEE0053, 0x8EEA0D047A457A00,
+    0xD5D238A4ABE98068, 0x72A4904598D6D880,
+    0x85A36366EB71F041, 0x47A6DA2B7F864750,
+    0xA70C3C40A64E6C51, 0x999090B65F67D924,
+    0xD0CF4B50CFE20765, 0xFFF4B4E3F741CF6D,
+    0x82818F1281ED449F, 0xBFF8F10E7A8921A4,
+    0xA321F2D7226895C7, 0xAFF72D52192B6A0D,
+    0xCBEA6F8CEB02BB39, 0x9BF4F8A69F764490,
+    0xFEE50B7025C36A08, 0x02F236D04753D5B4,
+    0x9F4F2726179A2245, 0x01D762422C946590,
+    0xC722F0EF9D80AAD6, 0x424D3AD2B7B97EF5,
+    0xF8EBAD2B84E0D58B, 0xD2E0898765A7DEB2,
+    0x9B934C3B330C8577, 0x63CC55F49F88EB2F,
+    0xC2781F49FFCFA6D5, 0x3CBF6B71C76B25FB,
+    0xF316271C7FC3908A, 0x8BEF464E3945EF7A,
+    0x97EDD871CFDA3A56, 0x97758BF0E3CBB5AC,
+    0xBDE94E8E43D0C8EC, 0x3D52EEED1CBEA317,
+    0xED63A231D4C4FB27, 0x4CA7AAA863EE4BDD,
+    0x945E455F24FB1CF8, 0x8FE8CAA93E74EF6A,
+    0xB975D6B6EE39E436, 0xB3E2FD538E122B44,
+    0xE7D34C64A9C85D44, 0x60DBBCA87196B616,
+    0x90E40FBEEA1D3A4A, 0xBC8955E946FE31CD,
+    0xB51D13AEA4A488DD, 0x6BABAB6398BDBE41,
+    0xE264589A4DCDAB14, 0xC696963C7EED2DD1,
+    0x8D7EB76070A08AEC, 0xFC1E1DE5CF543CA2,
+    0xB0DE65388CC8ADA8, 0x3B25A55F43294BCB,
+    0xDD15FE86AFFAD912, 0x49EF0EB713F39EBE,
+    0x8A2DBF142DFCC7AB, 0x6E3569326C784337,
+    0xACB92ED9397BF996, 0x49C2C37F07965404,
+    0xD7E77A8F87DAF7FB, 0xDC33745EC97BE906,
+    0x86F0AC99B4E8DAFD, 0x69A028BB3DED71A3,
+    0xA8ACD7C0222311BC, 0xC40832EA0D68CE0C,
+    0xD2D80DB02AABD62B, 0xF50A3FA490C30190,
+    0x83C7088E1AAB65DB, 0x792667C6DA79E0FA,
+    0xA4B8CAB1A1563F52, 0x577001B891185938,
+    0xCDE6FD5E09ABCF26, 0xED4C0226B55E6F86,
+    0x80B05E5AC60B6178, 0x544F8158315B05B4,
+    0xA0DC75F1778E39D6, 0x696361AE3DB1C721,
+    0xC913936DD571C84C, 0x03BC3A19CD1E38E9,
+    0xFB5878494ACE3A5F, 0x04AB48A04065C723,
+    0x9D174B2DCEC0E47B, 0x62EB0D64283F9C76,
+    0xC45D1DF942711D9A, 0x3BA5D0BD324F8394,
+    0xF5746577930D6500, 0xCA8F44EC7EE36479,
+    0x9968BF6ABBE85F20, 0x7E998B13CF4E1ECB,
+    0xBFC2EF456AE276E8, 0x9E3FEDD8C321A67E,
+    0xEFB3AB16C59B14A2, 0xC5CFE94EF3EA101E,
+    0x95D04AEE3B80ECE5, 0xBBA1F1D158724A12,
+    0xBB445DA9CA61281F, 0x2A8A6E45AE8EDC97,
+    0xEA1575143CF97226, 0xF52D09D71A3293BD,
+    0x924D692CA61BE758, 0x593C2626705F9C56,
+    0xB6E0C377CFA2E12E, 0x6F8B2FB00C77836C,
+    0xE498F455C38B997A, 0x0B6DFB9C0F956447,
+    0x8EDF98B59A373FEC, 0x4724BD4189BD5EAC,
+    0xB2977EE300C50FE7, 0x58EDEC91EC2CB657,
+    0xDF3D5E9BC0F653E1, 0x2F2967B66737E3ED,
+    0x8B865B215899F46C, 0xBD79E0D20082EE74,
+    0xAE67F1E9AEC07187, 0xECD8590680A3AA11,
+    0xDA01EE641A708DE9, 0xE80E6F4820CC9495,
+    0x884134FE908658B2, 0x3109058D147FDCDD,
+    0xAA51823E34A7EEDE, 0xBD4B46F0599FD415,
+    0xD4E5E2CDC1D1EA96, 0x6C9E18AC7007C91A,
+    0x850FADC09923329E, 0x03E2CF6BC604DDB0,
+    0xA6539930BF6BFF45, 0x84DB8346B786151C,
+    0xCFE87F7CEF46FF16, 0xE612641865679A63,
+    0x81F14FAE158C5F6E, 0x4FCB7E8F3F60C07E,
+    0xA26DA3999AEF7749, 0xE3BE5E330F38F09D,
+    0xCB090C8001AB551C, 0x5CADF5BFD3072CC5,
+    0xFDCB4FA002162A63, 0x73D9732FC7C8F7F6,
+    0x9E9F11C4014DDA7E, 0x2867E7FDDCDD9AFA,
+    0xC646D63501A1511D, 0xB281E1FD541501B8,
+    0xF7D88BC24209A565, 0x1F225A7CA91A4226,
+    0x9AE757596946075F, 0x3375788DE9B06958,
+    0xC1A12D2FC3978937, 0x0052D6B1641C83AE,
+    0xF209787BB47D6B84, 0xC0678C5DBD23A49A,
+    0x9745EB4D50CE6332, 0xF840B7BA963646E0,
+    0xBD176620A501FBFF, 0xB650E5A93BC3D898,
+    0xEC5D3FA8CE427AFF, 0xA3E51F138AB4CEBE,
+    0x93BA47C980E98CDF, 0xC66F336C36B10137,
+    0xB8A8D9BBE123F017, 0xB80B0047445D4184,
+    0xE6D3102AD96CEC1D, 0xA60DC059157491E5,
+    0x9043EA1AC7E41392, 0x87C89837AD68DB2F,
+    0xB454E4A179DD1877, 0x29BABE4598C311FB,
+    0xE16A1DC9D8545E94, 0xF4296DD6FEF3D67A,
+    0x8CE2529E2734BB1D, 0x1899E4A65F58660C,
+    0xB01AE745B101E9E4, 0x5EC05DCFF72E7F8F,
+    0xDC21A1171D42645D, 0x76707543F4FA1F73,
+    0x899504AE72497EBA, 0x6A06494A791C53A8,
+    0xABFA45DA0EDBDE69, 0x0487DB9D17636892,
+    0xD6F8D7509292D603, 0x45A9D2845D3C42B6,
+    0x865B86925B9BC5C2, 0x0B8A2392BA45A9B2,
+    0xA7F26836F282B732, 0x8E6CAC7768D7141E,
+    0xD1EF0244AF2364FF, 0x3207D795430CD926,
+    0x8335616AED761F1F, 0x7F44E6BD49E807B8,
+    0xA402B9C5A8D3A6E7, 0x5F16206C9C6209A6,
+    0xCD036837130890A1, 0x36DBA887C37A8C0F,
+    0x802221226BE55A64, 0xC2494954DA2C9789,
+    0xA02AA96B06DEB0FD, 0xF2DB9BAA10B7BD6C,
+    0xC83553C5C8965D3D, 0x6F92829494E5ACC7,
+    0xFA42A8B73ABBF48C, 0xCB772339BA1F17F9,
+    0x9C69A97284B578D7, 0xFF2A760414536EFB,
+    0xC38413CF25E2D70D, 0xFEF5138519684ABA,
+    0xF46518C2EF5B8CD1, 0x7EB258665FC25D69,
+    0x98BF2F79D5993802, 0xEF2F773FFBD97A61,
+    0xBEEEFB584AFF8603, 0xAAFB550FFACFD8FA,
+    0xEEAABA2E5DBF6784, 0x95BA2A53F983CF38,
+    0x952AB45CFA97A0B2, 0xDD945A747BF26183,
+    0xBA756174393D88DF, 0x94F971119AEEF9E4,
+    0xE912B9D1478CEB17, 0x7A37CD5601AAB85D,
+    0x91ABB422CCB812EE, 0xAC62E055C10AB33A,
+    0xB616A12B7FE617AA, 0x577B986B314D6009,
+    0xE39C49765FDF9D94, 0xED5A7E85FDA0B80B,
+    0x8E41ADE9FBEBC27D, 0x14588F13BE847307,
+    0xB1D219647AE6B31C, 0x596EB2D8AE258FC8,
+    0xDE469FBD99A05FE3, 0x6FCA5F8ED9AEF3BB,
+    0x8AEC23D680043BEE, 0x25DE7BB9480D5854,
+    0xADA72CCC20054AE9, 0xAF561AA79A10AE6A,
+    0xD910F7FF28069DA4, 0x1B2BA1518094DA04,
+    0x87AA9AFF79042286, 0x90FB44D2F05D0842,
+    0xA99541BF57452B28, 0x353A1607AC744A53,
+    0xD3FA922F2D1675F2, 0x42889B8997915CE8,
+    0x847C9B5D7C2E09B7, 0x69956135FEBADA11,
+    0xA59BC234DB398C25, 0x43FAB9837E699095,
+    0xCF02B2C21207EF2E, 0x94F967E45E03F4BB,
+    0x8161AFB94B44F57D, 0x1D1BE0EEBAC278F5,
+    0xA1BA1BA79E1632DC, 0x6462D92A69731732,
+    0xCA28A291859BBF93, 0x7D7B8F7503CFDCFE,
+    0xFCB2CB35E702AF78, 0x5CDA735244C3D43E,
+    0x9DEFBF01B061ADAB, 0x3A0888136AFA64A7,
+    0xC56BAEC21C7A1916, 0x088AAA1845B8FDD0,
+    0xF6C69A72A3989F5B, 0x8AAD549E57273D45,
+    0x9A3C2087A63F6399, 0x36AC54E2F678864B,
+    0xC0CB28A98FCF3C7F, 0x84576A1BB416A7DD,
+    0xF0FDF2D3F3C30B9F, 0x656D44A2A11C51D5,
+    0x969EB7C47859E743, 0x9F644AE5A4B1B325,
+    0xBC4665B596706114, 0x873D5D9F0DDE1FEE,
+    0xEB57FF22FC0C7959, 0xA90CB506D155A7EA,
+    0x9316FF75DD87CBD8, 0x09A7F12442D588F2,
+    0xB7DCBF5354E9BECE, 0x0C11ED6D538AEB2F,
+    0xE5D3EF282A242E81, 0x8F1668C8A86DA5FA,
+    0x8FA475791A569D10, 0xF96E017D694487BC,
+    0xB38D92D760EC4455, 0x37C981DCC395A9AC,
+    0xE070F78D3927556A, 0x85BBE253F47B1417,
+    0x8C469AB843B89562, 0x93956D7478CCEC8E,
+    0xAF58416654A6BABB, 0x387AC8D1970027B2,
+    0xDB2E51BFE9D0696A, 0x06997B05FCC0319E,
+    0x88FCF317F22241E2, 0x441FECE3BDF81F03,
+    0xAB3C2FDDEEAAD25A, 0xD527E81CAD7626C3,
+    0xD60B3BD56A5586F1, 0x8A71E223D8D3B074,
+    0x85C7056562757456, 0xF6872D5667844E49,
+    0xA738C6BEBB12D16C, 0xB428F8AC016561DB,
+    0xD106F86E69D785C7, 0xE13336D701BEBA52,
+    0x82A45B450226B39C, 0xECC0024661173473,
+    0xA34D721642B06084, 0x27F002D7F95D0190,
+    0xCC20CE9BD35C78A5, 0x31EC038DF7B441F4,
+    0xFF290242C83396CE, 0x7E67047175A15271,
+    0x9F79A169BD203E41, 0x0F0062C6E984D386,
+    0xC75809C42C684DD1, 0x52C07B78A3E60868,
+    0xF92E0C3537826145, 0xA7709A56CCDF8A82,
+    0x9BBCC7A142B17CCB, 0x88A66076400BB691,
+    0xC2ABF989935DDBFE, 0x6ACFF893D00EA435,
+    0xF356F7EBF83552FE, 0x0583F6B8C4124D43,
+    0x98165AF37B2153DE, 0xC3727A337A8B704A,
+    0xBE1BF1B059E9A8D6, 0x744F18C0592E4C5C,
+    0xEDA2EE1C7064130C, 0x1162DEF06F79DF73,
+    0x9485D4D1C63E8BE7, 0x8ADDCB5645AC2BA8,
+    0xB9A74A0637CE2EE1, 0x6D953E2BD7173692,
+    0xE8111C87C5C1BA99, 0xC8FA8DB6CCDD0437,
+    0x910AB1D4DB9914A0, 0x1D9C9892400A22A2,
+    0xB54D5E4A127F59C8, 0x2503BEB6D00CAB4B,
+    0xE2A0B5DC971F303A, 0x2E44AE64840FD61D,
+    0x8DA471A9DE737E24, 0x5CEAECFED289E5D2,
+    0xB10D8E1456105DAD, 0x7425A83E872C5F47,
+    0xDD50F1996B947518, 0xD12F124E28F77719,
+    0x8A5296FFE33CC92F, 0x82BD6B70D99AAA6F,
+    0xACE73CBFDC0BFB7B, 0x636CC64D1001550B,
+    0xD8210BEFD30EFA5A, 0x3C47F7E05401AA4E,
+    0x8714A775E3E95C78, 0x65ACFAEC34810A71,
+    0xA8D9D1535CE3B396, 0x7F1839A741A14D0D,
+    0xD31045A8341CA07C, 0x1EDE48111209A050,
+    0x83EA2B892091E44D, 0x934AED0AAB460432,
+    0xA4E4B66B68B65D60, 0xF81DA84D5617853F,
+    0xCE1DE40642E3F4B9, 0x36251260AB9D668E,
+    0x80D2AE83E9CE78F3, 0xC1D72B7C6B426019,
+    0xA1075A24E4421730, 0xB24CF65B8612F81F,
+    0xC94930AE1D529CFC, 0xDEE033F26797B627,
+    0xFB9B7CD9A4A7443C, 0x169840EF017DA3B1,
+    0x9D412E0806E88AA5, 0x8E1F289560EE864E,
+    0xC491798A08A2AD4E, 0xF1A6F2BAB92A27E2,
+    0xF5B5D7EC8ACB58A2, 0xAE10AF696774B1DB,
+    0x9991A6F3D6BF1765, 0xACCA6DA1E0A8EF29,
+    0xBFF610B0CC6EDD3F, 0x17FD090A58D32AF3,
+    0xEFF394DCFF8A948E, 0xDDFC4B4CEF07F5B0,
+    0x95F83D0A1FB69CD9, 0x4ABDAF101564F98E,
+    0xBB764C4CA7A4440F, 0x9D6D1AD41ABE37F1,
+    0xEA53DF5FD18D5513, 0x84C86189216DC5ED,
+    0x92746B9BE2F8552C, 0x32FD3CF5B4E49BB4,
+    0xB7118682DBB66A77, 0x3FBC8C33221DC2A1,
+    0xE4D5E82392A40515, 0x0FABAF3FEAA5334A,
+    0x8F05B1163BA6832D, 0x29CB4D87F2A7400E,
+    0xB2C71D5BCA9023F8, 0x743E20E9EF511012,
+    0xDF78E4B2BD342CF6, 0x914DA9246B255416,
+    0x8BAB8EEFB6409C1A, 0x1AD089B6C2F7548E,
+    0xAE9672ABA3D0C320, 0xA184AC2473B529B1,
+    0xDA3C0F568CC4F3E8, 0xC9E5D72D90A2741E,
+    0x8865899617FB1871, 0x7E2FA67C7A658892,
+    0xAA7EEBFB9DF9DE8D, 0xDDBB901B98FEEAB7,
+    0xD51EA6FA85785631, 0x552A74227F3EA565,
+    0x8533285C936B35DE, 0xD53A88958F87275F,
+    0xA67FF273B8460356, 0x8A892ABAF368F137,
+    0xD01FEF10A657842C, 0x2D2B7569B0432D85,
+    0x8213F56A67F6B29B, 0x9C3B29620E29FC73,
+    0xA298F2C501F45F42, 0x8349F3BA91B47B8F,
+    0xCB3F2F7642717713, 0x241C70A936219A73,
+    0xFE0EFB53D30DD4D7, 0xED238CD383AA0110,
+    0x9EC95D1463E8A506, 0xF4363804324A40AA,
+    0xC67BB4597CE2CE48, 0xB143C6053EDCD0D5,
+    0xF81AA16FDC1B81DA, 0xDD94B7868E94050A,
+    0x9B10A4E5E9913128, 0xCA7CF2B4191C8326,
+    0xC1D4CE1F63F57D72, 0xFD1C2F611F63A3F0,
+    0xF24A01A73CF2DCCF, 0xBC633B39673C8CEC,
+    0x976E41088617CA01, 0xD5BE0503E085D813,
+    0xBD49D14AA79DBC82, 0x4B2D8644D8A74E18,
+    0xEC9C459D51852BA2, 0xDDF8E7D60ED1219E,
+    0x93E1AB8252F33B45, 0xCABB90E5C942B503,
+    0xB8DA1662E7B00A17, 0x3D6A751F3B936243,
+    0xE7109BFBA19C0C9D, 0x0CC512670A783AD4,
+    0x906A617D450187E2, 0x27FB2B80668B24C5,
+    0xB484F9DC9641E9DA, 0xB1F9F660802DEDF6,
+    0xE1A63853BBD26451, 0x5E7873F8A0396973,
+    0x8D07E33455637EB2, 0xDB0B487B6423E1E8,
+    0xB049DC016ABC5E5F, 0x91CE1A9A3D2CDA62,
+    0xDC5C5301C56B75F7, 0x7641A140CC7810FB,
+    0x89B9B3E11B6329BA, 0xA9E904C87FCB0A9D,
+    0xAC2820D9623BF429, 0x546345FA9FBDCD44,
+    0xD732290FBACAF133, 0xA97C177947AD4095,
+    0x867F59A9D4BED6C0, 0x49ED8EABCCCC485D,
+    0xA81F301449EE8C70, 0x5C68F256BFFF5A74,
+    0xD226FC195C6A2F8C, 0x73832EEC6FFF3111,
+    0x83585D8FD9C25DB7, 0xC831FD53C5FF7EAB,
+    0xA42E74F3D032F525, 0xBA3E7CA8B77F5E55,
+    0xCD3A1230C43FB26F, 0x28CE1BD2E55F35EB,
+    0x80444B5E7AA7CF85, 0x7980D163CF5B81B3,
+    0xA0555E361951C366, 0xD7E105BCC332621F,
+    0xC86AB5C39FA63440, 0x8DD9472BF3FEFAA7,
+    0xFA856334878FC150, 0xB14F98F6F0FEB951,
+    0x9C935E00D4B9D8D2, 0x6ED1BF9A569F33D3,
+    0xC3B8358109E84F07, 0x0A862F80EC4700C8,
+    0xF4A642E14C6262C8, 0xCD27BB612758C0FA,
+    0x98E7E9CCCFBD7DBD, 0x8038D51CB897789C,
+    0xBF21E44003ACDD2C, 0xE0470A63E6BD56C3,
+    0xEEEA5D5004981478, 0x1858CCFCE06CAC74,
+    0x95527A5202DF0CCB, 0x0F37801E0C43EBC8,
+    0xBAA718E68396CFFD, 0xD30560258F54E6BA,
+    0xE950DF20247C83FD, 0x47C6B82EF32A2069,
+    0x91D28B7416CDD27E, 0x4CDC331D57FA5441,
+    0xB6472E511C81471D, 0xE0133FE4ADF8E952,
+    0xE3D8F9E563A198E5, 0x58180FDDD97723A6,
+    0x8E679C2F5E44FF8F, 0x570F09EAA7EA7648,
+};
+
+// Eisel-Lemire: return IEEE754 bits of w * 10^q, -342 <= q <= 308, w != 0.
+// If the 128-bit product is too close to call, clear *exact: the result can
+// then be one below the correctly rounded one
+static uint64_t lemire(uint64_t w, int q, bool *exact) {
+  const uint64_t *t = &s_pow5[(q + 342) * 2];
+  uint64_t hi, lo, h2, l2, m;
+  int s, lz = 0, upper, shift, p2;
+  for (s = 32; s > 0; s >>= 1) {
+    if ((w >> (64 - s)) == 0) w <<= s, lz += s;
+  }
+  mul128(w, t[0], &hi, &lo);
+  if ((hi & 0x1ff) == 0x1ff) {
+    mul128(w, t[1], &h2, &l2);
+    lo += h2;
+    if (h2 > lo) hi++;
+    if ((hi & 0x1ff) == 0x1ff && lo == ~(uint64_t) 0 && (q < -27 || q > 55)) {
+      *exact = false;
+    }
+  }
+  upper = (int) (hi >> 63);
+  shift = upper + 9;
+  m = hi >> shift;
+  p2 = ((217706 * q) >> 16) + 63 + upper - lz + 1023;
+  if (p2 <= 0) {  // Subnormal
+    if (-p2 + 1 >= 64) return 0;
+    m >>= -p2 + 1;
+    m += m & 1;
+    m >>= 1;
+    return m | ((uint64_t) (m < ((uint64_t) 1 << 52) ? 0 : 1) << 52);
+  }
+  // Exact halfway case: round to even
+  if (lo <= 1 && q >= -4 && q <= 23 && (m & 3) == 1 && (m << shift) == hi) {
+    m &= ~(uint64_t) 1;
+  }
+  m += m & 1;
+  m >>= 1;
+  if (m >= ((uint64_t) 2 << 52)) m = (uint64_t) 1 << 52, p2++;
+  m &= ~((uint64_t) 1 << 52);
+  if (p2 >= 0x7ff) return (uint64_t) 0x7ff << 52;  // Infinity
+  return ((uint64_t) p2 << 52) | m;
+}
+
+// Unsigned big integer. Holds the exact value of any double, and any decimal
+// input mg_atod() compares with one
+#define BIG_LIMBS 100
+struct big {
+  uint32_t v[BIG_LIMBS];  // Little endian
+  int n;                  // Limbs in use
+};
+
+static void big_set(struct big *b, uint64_t x) {
+  b->v[0] = (uint32_t) x, b->v[1] = (uint32_t) (x >> 32);
+  b->n = b->v[1] != 0 ? 2 : b->v[0] != 0 ? 1 : 0;
+}
+
+// b = b * m + a
+static void big_muladd(struct big *b, uint32_t m, uint32_t a) {
+  uint64_t carry = a;
+  int i;
+  for (i = 0; i < b->n; i++) {
+    carry += (uint64_t) b->v[i] * m;
+    b->v[i] = (uint32_t) carry;
+    carry >>= 32;
+  }
+  if (carry > 0 && b->n < BIG_LIMBS) b->v[b->n++] = (uint32_t) carry;
+}
+
+// b = b / d, return the remainder
+static uint32_t big_div(struct big *b, uint32_t d) {
+  uint64_t r = 0;
+  int i;
+  for (i = b->n - 1; i >= 0; i--) {
+    r = r << 32 | b->v[i];
+    b->v[i] = (uint32_t) (r / d);
+    r %= d;
+  }
+  while (b->n > 0 && b->v[b->n - 1] == 0) b->n--;
+  return (uint32_t) r;
+}
+
+static void big_pow5(struct big *b, int k) {
+  static const uint32_t p5[] = {1,        5,         25,        125,
+                                625,      3125,      15625,     78125,
+                                390625,   1953125,   9765625,   48828125,
+                                244140625};
+  for (; k >= 13; k -= 13) big_muladd(b, 1220703125, 0);
+  big_muladd(b, p5[k], 0);
+}
+
+static void big_shl(struct big *b, int k) {
+  int limbs = k / 32;
+  big_muladd(b, (uint32_t) 1 << (k % 32), 0);
+  if (b->n > 0 && limbs > 0 && b->n + limbs <= BIG_LIMBS) {
+    memmove(b->v + limbs, b->v, (size_t) b->n * sizeof(b->v[0]));
+    memset(b->v, 0, (size_t) limbs * sizeof(b->v[0]));
+    b->n += limbs;
+  }
+}
+
+// Compare a * 10^e10 with b * 2^e2. Both a and b are modified
+static int big_cmp(struct big *a, int e10, struct big *b, int e2) {
+  int i;
+  big_pow5(e10 >= 0 ? a : b, e10 >= 0 ? e10 : -e10);
+  big_shl(e10 > e2 ? a : b, e10 > e2 ? e10 - e2 : e2 - e10);
+  if (a->n != b->n) return a->n < b->n ? -1 : 1;
+  for (i = a->n - 1; i >= 0; i--) {
+    if (a->v[i] != b->v[i]) return a->v[i] < b->v[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+static bool is_dec(int c) {
+  return c >= '0' && c <= '9';
+}
+
+// Input has nd significant digits starting at s, possibly with a dot among
+// them, and equals their integer value times 10^q. The correctly rounded
+// result is either r or the next double: compare the input with the halfway
+// point between the two. Digits past the 780th can't change the outcome
+// except when they are all zero, so they are folded into one sticky digit
+static uint64_t atod_exact(const char *s, int nd, int q, uint64_t r) {
+  struct big a, b;
+  uint64_t m = r & (((uint64_t) 1 << 52) - 1);
+  int i, k = 0, e = (int) (r >> 52), cmp;
+  bool sticky = false;
+  if (e > 0) m |= (uint64_t) 1 << 52;
+  e = e > 0 ? e - 1075 : -1074;
+  a.n = 0;
+  for (i = 0; k < nd; i++) {
+    if (!is_dec(s[i])) continue;
+    if (k++ < 780) {
+      big_muladd(&a, 10, (uint32_t) (s[i] - '0'));
+    } else {
+      sticky |= s[i] != '0', q++;
+    }
+  }
+  if (sticky) big_muladd(&a, 10, 1), q--;
+  big_set(&b, 2 * m + 1);
+  cmp = big_cmp(&a, q, &b, e - 1);
+  return cmp > 0 || (cmp == 0 && (m & 1)) ? r + 1 : r;
+}
+
+// Inputs longer than 19 significant digits are rounded correctly too: the
+// fast path parses the first 19, and atod_exact() settles close calls
 double mg_atod(const char *p, int len, int *numlen) {
-  double d = 0.0;
-  int i = 0, sign = 1;
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+  union dbl_bits r;
+  uint64_t w = 0;
+  const char *s = NULL;  // First significant digit
+  int i = 0, q = 0, nd = 0, all = 0, neg = 0;
+  bool cut = false;  // Nonzero digits past the 19th are dropped
 
   // Sign
-  if (i < len && *p == '-') {
-    sign = -1, i++;
-  } else if (i < len && *p == '+') {
+  if (i < len && p[i] == '-') {
+    neg = 1, i++;
+  } else if (i < len && p[i] == '+') {
     i++;
   }
 
-  // Decimal
-  for (; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
-    d *= 10.0;
-    d += p[i] - '0';
+  // Decimal. Leading zeroes do not count as significant digits
+  for (; i < len && is_dec(p[i]); i++) {
+    if (s == NULL && p[i] != '0') s = &p[i];
+    if (s != NULL) all++;
+    if (nd < 19) {
+      w = w * 10 + (uint64_t) (p[i] - '0');
+      if (w > 0) nd++;
+    } else {
+      q++;
+      if (p[i] != '0') cut = true;
+    }
   }
-  d *= sign;
 
   // Fractional
   if (i < len && p[i] == '.') {
-    double frac = 0.0, base = 0.1;
     i++;
-    for (; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
-      frac += base * (p[i] - '0');
-      base /= 10.0;
+    for (; i < len && is_dec(p[i]); i++) {
+      if (s == NULL && p[i] != '0') s = &p[i];
+      if (s != NULL) all++;
+      if (nd < 19) {
+        w = w * 10 + (uint64_t) (p[i] - '0');
+        if (w > 0) nd++;
+        q--;
+      } else if (p[i] != '0') {
+        cut = true;
+      }
     }
-    d += frac * sign;
   }
 
   // Exponential
   if (i < len && (p[i] == 'e' || p[i] == 'E')) {
-    int j, exp = 0, minus = 0;
+    int exp = 0, minus = 0;
     i++;
     if (i < len && p[i] == '-') minus = 1, i++;
     if (i < len && p[i] == '+') i++;
-    while (i < len && p[i] >= '0' && p[i] <= '9' && exp < 308)
-      exp = exp * 10 + (p[i++] - '0');
-    if (minus) exp = -exp;
-    for (j = 0; j < exp; j++) d *= 10.0;
-    for (j = 0; j < -exp; j++) d /= 10.0;
+    for (; i < len && is_dec(p[i]); i++) {
+      if (exp < 10000) exp = exp * 10 + (p[i] - '0');
+    }
+    q += minus ? -exp : exp;
   }
 
   if (numlen != NULL) *numlen = i;
-  return d;
+  if (w == 0 || q < -342) {
+    r.u = 0;
+  } else if (q > 308) {
+    r.u = (uint64_t) 0x7ff << 52;
+  } else if (q >= -22 && q <= 22 && w <= ((uint64_t) 1 << 53)) {
+    // Clinger: both w and 10^|q| are exact doubles, one rounding only
+    r.f = q < 0 ? (double) w / pow10[-q] : (double) w * pow10[q];
+  } else {
+    bool exact = true;
+    r.u = lemire(w, q, &exact);
+    // Dropped digits put the input between w and w + 1
+    if (cut && exact && lemire(w + 1, q, &exact) != r.u) exact = false;
+    if (!exact && (r.u >> 52) < 0x7ff) {
+      r.u = atod_exact(s, all, q - (all - nd), r.u);
+    }
+  }
+  if (neg) r.u |= (uint64_t) 1 << 63;
+  return r.f;
+}
+
+struct diyfp {
+  uint64_t f;
+  int e;
+};
+
+static struct diyfp diy_mul(struct diyfp x, struct diyfp y) {
+  struct diyfp r;
+  uint64_t lo;
+  mul128(x.f, y.f, &r.f, &lo);
+  r.f += lo >> 63;  // Round
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+static struct diyfp diy_norm(struct diyfp x) {
+  while ((x.f >> 63) == 0) x.f <<= 1, x.e--;
+  return x;
+}
+
+// Cached powers of ten: 10^k ~ f * 2^e, k = -300..324 step 8
+static const struct {
+  uint64_t f;
+  int e, k;
+} s_cached[] = {
+    {0xAB70FE17C79AC6CA, -1060, -300},
+    {0xFF77B1FCBEBCDC4F, -1034, -292},
+    {0xBE5691EF416BD60C, -1007, -284},
+    {0x8DD01FAD907FFC3C, -980, -276},
+    {0xD3515C2831559A83, -954, -268},
+    {0x9D71AC8FADA6C9B5, -927, -260},
+    {0xEA9C227723EE8BCB, -901, -252},
+    {0xAECC49914078536D, -874, -244},
+    {0x823C12795DB6CE57, -847, -236},
+    {0xC21094364DFB5637, -821, -228},
+    {0x9096EA6F3848984F, -794, -220},
+    {0xD77485CB25823AC7, -768, -212},
+    {0xA086CFCD97BF97F4, -741, -204},
+    {0xEF340A98172AACE5, -715, -196},
+    {0xB23867FB2A35B28E, -688, -188},
+    {0x84C8D4DFD2C63F3B, -661, -180},
+    {0xC5DD44271AD3CDBA, -635, -172},
+    {0x936B9FCEBB25C996, -608, -164},
+    {0xDBAC6C247D62A584, -582, -156},
+    {0xA3AB66580D5FDAF6, -555, -148},
+    {0xF3E2F893DEC3F126, -529, -140},
+    {0xB5B5ADA8AAFF80B8, -502, -132},
+    {0x87625F056C7C4A8B, -475, -124},
+    {0xC9BCFF6034C13053, -449, -116},
+    {0x964E858C91BA2655, -422, -108},
+    {0xDFF9772470297EBD, -396, -100},
+    {0xA6DFBD9FB8E5B88F, -369, -92},
+    {0xF8A95FCF88747D94, -343, -84},
+    {0xB94470938FA89BCF, -316, -76},
+    {0x8A08F0F8BF0F156B, -289, -68},
+    {0xCDB02555653131B6, -263, -60},
+    {0x993FE2C6D07B7FAC, -236, -52},
+    {0xE45C10C42A2B3B06, -210, -44},
+    {0xAA242499697392D3, -183, -36},
+    {0xFD87B5F28300CA0E, -157, -28},
+    {0xBCE5086492111AEB, -130, -20},
+    {0x8CBCCC096F5088CC, -103, -12},
+    {0xD1B71758E219652C, -77, -4},
+    {0x9C40000000000000, -50, 4},
+    {0xE8D4A51000000000, -24, 12},
+    {0xAD78EBC5AC620000, 3, 20},
+    {0x813F3978F8940984, 30, 28},
+    {0xC097CE7BC90715B3, 56, 36},
+    {0x8F7E32CE7BEA5C70, 83, 44},
+    {0xD5D238A4ABE98068, 109, 52},
+    {0x9F4F2726179A2245, 136, 60},
+    {0xED63A231D4C4FB27, 162, 68},
+    {0xB0DE65388CC8ADA8, 189, 76},
+    {0x83C7088E1AAB65DB, 216, 84},
+    {0xC45D1DF942711D9A, 242, 92},
+    {0x924D692CA61BE758, 269, 100},
+    {0xDA01EE641A708DEA, 295, 108},
+    {0xA26DA3999AEF774A, 322, 116},
+    {0xF209787BB47D6B85, 348, 124},
+    {0xB454E4A179DD1877, 375, 132},
+    {0x865B86925B9BC5C2, 402, 140},
+    {0xC83553C5C8965D3D, 428, 148},
+    {0x952AB45CFA97A0B3, 455, 156},
+    {0xDE469FBD99A05FE3, 481, 164},
+    {0xA59BC234DB398C25, 508, 172},
+    {0xF6C69A72A3989F5C, 534, 180},
+    {0xB7DCBF5354E9BECE, 561, 188},
+    {0x88FCF317F22241E2, 588, 196},
+    {0xCC20CE9BD35C78A5, 614, 204},
+    {0x98165AF37B2153DF, 641, 212},
+    {0xE2A0B5DC971F303A, 667, 220},
+    {0xA8D9D1535CE3B396, 694, 228},
+    {0xFB9B7CD9A4A7443C, 720, 236},
+    {0xBB764C4CA7A44410, 747, 244},
+    {0x8BAB8EEFB6409C1A, 774, 252},
+    {0xD01FEF10A657842C, 800, 260},
+    {0x9B10A4E5E9913129, 827, 268},
+    {0xE7109BFBA19C0C9D, 853, 276},
+    {0xAC2820D9623BF429, 880, 284},
+    {0x80444B5E7AA7CF85, 907, 292},
+    {0xBF21E44003ACDD2D, 933, 300},
+    {0x8E679C2F5E44FF8F, 960, 308},
+    {0xD433179D9C8CB841, 986, 316},
+    {0x9E19DB92B4E31BA9, 1013, 324},
+};
+
+// Grisu2 digit generation. On return, the value is dig * 10^(*k)
+static int grisu2(double d, char *dig, int *k) {
+  union dbl_bits u = {d};
+  uint64_t F = u.u & (((uint64_t) 1 << 52) - 1), delta, dist, p2, rest = 0,
+           ten = 0;
+  int E = (int) (u.u >> 52) & 0x7ff, n = 0, f, idx, ndig;
+  uint32_t p1, pow10;
+  struct diyfp v, mp, mm, c, w, wp, wm, one;
+
+  // Boundaries m- and m+ of the rounding interval around v
+  v.f = E == 0 ? F : F + ((uint64_t) 1 << 52);
+  v.e = E == 0 ? -1074 : E - 1075;
+  mp.f = 2 * v.f + 1, mp.e = v.e - 1;
+  if (F == 0 && E > 1) {
+    mm.f = 4 * v.f - 1, mm.e = v.e - 2;
+  } else {
+    mm.f = 2 * v.f - 1, mm.e = v.e - 1;
+  }
+  mp = diy_norm(mp);
+  mm.f <<= mm.e - mp.e, mm.e = mp.e;
+  v = diy_norm(v);
+
+  // Scale by a cached power of ten, so that the exponent is in [-60, -32]
+  f = -61 - mp.e;
+  idx = (300 + f * 78913 / (1 << 18) + (f > 0) + 7) / 8;
+  c.f = s_cached[idx].f, c.e = s_cached[idx].e;
+  *k = -s_cached[idx].k;
+  w = diy_mul(v, c), wp = diy_mul(mp, c), wm = diy_mul(mm, c);
+  wm.f++, wp.f--;
+
+  // Generate digits of wp until the interval [wm, wp] is reached
+  delta = wp.f - wm.f;
+  dist = wp.f - w.f;
+  one.f = (uint64_t) 1 << -wp.e, one.e = wp.e;
+  p1 = (uint32_t) (wp.f >> -one.e);
+  p2 = wp.f & (one.f - 1);
+  for (ndig = 10, pow10 = 1000000000; ndig > 1 && p1 < pow10; ndig--) {
+    pow10 /= 10;
+  }
+  while (ndig > 0) {
+    dig[n++] = (char) ('0' + p1 / pow10);
+    p1 %= pow10;
+    ndig--;
+    rest = ((uint64_t) p1 << -one.e) + p2;
+    if (rest <= delta) {
+      *k += ndig;
+      ten = (uint64_t) pow10 << -one.e;
+      break;
+    }
+    pow10 /= 10;
+  }
+  if (ten == 0) {  // Integral digits were not enough, continue with fraction
+    for (;;) {
+      p2 *= 10;
+      dig[n++] = (char) ('0' + (p2 >> -one.e));
+      p2 &= one.f - 1;
+      delta *= 10, dist *= 10;
+      (*k)--;
+      if (p2 <= delta) break;
+    }
+    rest = p2, ten = one.f;
+  }
+
+  // Round towards w
+  while (rest < dist && delta - rest >= ten &&
+         (rest + ten < dist || dist - rest > rest + ten - dist)) {
+    dig[n - 1]--;
+    rest += ten;
+  }
+  return n;
+}
+
+// Round digits up, last digit first. On overflow, 99 becomes 10 * 10^1
+static void round_up(char *dig, int n, int *k) {
+  while (n > 0 && ++dig[n - 1] > '9') dig[--n] = '0';
+  if (n == 0) dig[0] = '1', (*k)++;
+}
+
+// Counted Grisu: prec digits of d, rounded, as dig * 10^(*k). Return 0 if
+// the error of the 64-bit product does not allow to tell which way to round
+static int grisu_counted(double d, int prec, char *dig, int *k) {
+  union dbl_bits u = {d};
+  uint64_t F = u.u & (((uint64_t) 1 << 52) - 1), one, p2, rest, ten, unit = 1;
+  int E = (int) (u.u >> 52) & 0x7ff, n = 0, f, idx, kappa, sh;
+  uint32_t p1, pow10;
+  struct diyfp v, c, w;
+
+  v.f = E == 0 ? F : F + ((uint64_t) 1 << 52);
+  v.e = E == 0 ? -1074 : E - 1075;
+  v = diy_norm(v);
+  f = -61 - v.e;
+  idx = (300 + f * 78913 / (1 << 18) + (f > 0) + 7) / 8;
+  c.f = s_cached[idx].f, c.e = s_cached[idx].e;
+  *k = -s_cached[idx].k;
+  w = diy_mul(v, c);  // Off by at most one unit
+
+  sh = -w.e, one = (uint64_t) 1 << sh;
+  p1 = (uint32_t) (w.f >> sh);
+  p2 = w.f & (one - 1);
+  for (kappa = 10, pow10 = 1000000000; kappa > 1 && p1 < pow10; kappa--) {
+    pow10 /= 10;
+  }
+  while (kappa > 0) {
+    dig[n++] = (char) ('0' + p1 / pow10);
+    p1 %= pow10;
+    kappa--;
+    if (n == prec) break;
+    pow10 /= 10;
+  }
+  if (n == prec) {
+    rest = ((uint64_t) p1 << sh) + p2, ten = (uint64_t) pow10 << sh;
+  } else {
+    while (n < prec && p2 > unit) {
+      p2 *= 10, unit *= 10;
+      dig[n++] = (char) ('0' + (p2 >> sh));
+      p2 &= one - 1;
+      kappa--;
+    }
+    if (n < prec) return 0;
+    rest = p2, ten = one;
+  }
+  *k += kappa;
+
+  // The rest is in (rest - unit, rest + unit), round if both ends agree
+  if (unit >= ten || ten - unit <= unit) return 0;
+  if (ten - rest > rest && ten - 2 * rest >= 2 * unit) return n;
+  if (rest > unit && ten - (rest - unit) <= rest - unit) {
+    round_up(dig, n, k);
+    return n;
+  }
+  return 0;
+}
+
+// Exact prec digits of d as dig * 10^(*k): write out the value as a decimal
+// big integer, at most 767 digits, and round half to even
+static int dtoa_exact(double d, int prec, char *dig, int *k) {
+  union dbl_bits u = {d};
+  uint64_t m = u.u & (((uint64_t) 1 << 52) - 1);
+  uint32_t chunks[90];  // Base 10^9, least significant first
+  int i, j, n = 0, all = 0, nc = 0, e = (int) (u.u >> 52) & 0x7ff;
+  char c[9];
+  bool sticky = false, up;
+  struct big b;
+  if (e > 0) m |= (uint64_t) 1 << 52;
+  e = e > 0 ? e - 1075 : -1074;
+  big_set(&b, m);
+  if (e >= 0) {
+    big_shl(&b, e), *k = 0;
+  } else {
+    big_pow5(&b, -e), *k = e;  // m / 2^-e = m * 5^-e / 10^-e
+  }
+  while (b.n > 0) chunks[nc++] = big_div(&b, 1000000000);
+  for (i = nc - 1; i >= 0; i--) {
+    for (j = 8; j >= 0; j--) {
+      c[j] = (char) ('0' + chunks[i] % 10), chunks[i] /= 10;
+    }
+    for (j = 0; j < 9; j++) {
+      if (n == 0 && c[j] == '0') continue;  // Leading zeros
+      if (n <= prec) {
+        dig[n++] = c[j];
+      } else {
+        sticky |= c[j] != '0';
+      }
+      all++;
+    }
+  }
+  up = n > prec && (dig[prec] > '5' ||
+                    (dig[prec] == '5' && (sticky || (dig[prec - 1] & 1))));
+  if (n > prec) n = prec;
+  *k += all - n;
+  if (up) round_up(dig, n, k);
+  return n;
 }
 
 static int addexp(char *buf, int e, int sign) {
@@ -163,10 +1299,9 @@ static int addexp(char *buf, int e, int sign) {
   buf[n++] = 'e';
   buf[n++] = (char) sign;
   if (e > 400) return 0;
-  if (e < 10) buf[n++] = '0';
-  if (e >= 100) buf[n++] = (char) (e / 100 + '0'), e -= 100 * (e / 100);
-  if (e >= 10) buf[n++] = (char) (e / 10 + '0'), e -= 10 * (e / 10);
-  buf[n++] = (char) (e + '0');
+  if (e >= 100) buf[n++] = (char) (e / 100 + '0'), e %= 100;
+  buf[n++] = (char) (e / 10 + '0');
+  buf[n++] = (char) (e % 10 + '0');
   return n;
 }
 
@@ -189,61 +1324,483 @@ static int xisnan(double x) {
          0x7ff00000;
 }
 
+// Format like printf's %.*g, precision capped at 30. A width of 0 prints
+// a representation that round-trips through mg_atod(). It is nearly always
+// the shortest one, rarely a digit longer
 size_t mg_dtoa(char *dst, size_t dstlen, double d, int width) {
-  char buf[40];
-  int i, s = 0, n = 0, e = 0;
-  double t, mul, saved;
+  char buf[40], dig[32];
+  int i, e, k, n, s = 0, prec = width <= 0 ? 17 : width > 30 ? 30 : width;
   if (d == 0.0) return mg_snprintf(dst, dstlen, "%s", "0");
   if (xisinf(d)) return mg_snprintf(dst, dstlen, "%s", d > 0 ? "inf" : "-inf");
   if (xisnan(d)) return mg_snprintf(dst, dstlen, "%s", "nan");
   if (d < 0.0) d = -d, buf[s++] = '-';
 
-  // Round
-  saved = d;
-  mul = 1.0;
-  while (d >= 10.0 && d / mul >= 10.0) mul *= 10.0;
-  while (d <= 1.0 && d / mul <= 1.0) mul /= 10.0;
-  for (i = 0, t = mul * 5; i < width; i++) t /= 10.0;
-  d += t;
-  // Calculate exponent, and 'mul' for scientific representation
-  mul = 1.0;
-  while (d >= 10.0 && d / mul >= 10.0) mul *= 10.0, e++;
-  while (d < 1.0 && d / mul < 1.0) mul /= 10.0, e--;
-  // printf(" --> %g %d %g %g\n", saved, e, t, mul);
-
-  if (e >= width) {
-    n = (int) mg_dtoa(buf, sizeof(buf), saved / mul, width);
-    // printf(" --> %.*g %d [%.*s]\n", 10, d / t, e, n, buf);
-    n += addexp(buf + s + n, e, '+');
-    return mg_snprintf(dst, dstlen, "%.*s", n, buf);
-  } else if (e <= -width) {
-    n = (int) mg_dtoa(buf, sizeof(buf), saved / mul, width);
-    // printf(" --> %.*g %d [%.*s]\n", 10, d / mul, e, n, buf);
-    n += addexp(buf + s + n, -e, '-');
-    return mg_snprintf(dst, dstlen, "%.*s", n, buf);
+  if (width <= 0) {
+    n = grisu2(d, dig, &k);
+  } else if ((n = grisu_counted(d, prec, dig, &k)) == 0) {
+    n = dtoa_exact(d, prec, dig, &k);
+  }
+  while (n > 1 && dig[n - 1] == '0') n--, k++;  // Trim trailing zeros
+
+  e = n + k - 1;  // Exponent in scientific notation
+  if (e < -4 || e >= prec) {
+    buf[s++] = dig[0];
+    if (n > 1) buf[s++] = '.';
+    for (i = 1; i < n; i++) buf[s++] = dig[i];
+    s += addexp(buf + s, e < 0 ? -e : e, e < 0 ? '-' : '+');
+  } else if (e < 0) {
+    buf[s++] = '0', buf[s++] = '.';
+    for (i = 0; i < -e - 1; i++) buf[s++] = '0';
+    for (i = 0; i < n; i++) buf[s++] = dig[i];
+  } else {
+    for (i = 0; i <= e || i < n; i++) {
+      if (i == e + 1) buf[s++] = '.';
+      buf[s++] = i < n ? dig[i] : '0';
+    }
+  }
+  return mg_snprintf(dst, dstlen, "%.*s", s, buf);
+}
+
+#ifdef MG_ENABLE_LINES
+#line 1 "src/deflate.c"
+#endif
+
+
+
+
+#define MG_DEFLATE_HASH_BITS 12
+#define MG_DEFLATE_HASH_SIZE (1U << MG_DEFLATE_HASH_BITS)
+#define MG_DEFLATE_MAX_MATCH 258
+#define MG_DEFLATE_LOOKAHEAD (MG_DEFLATE_MAX_MATCH + 4)
+
+// Length and distance code tables, RFC1951 section 3.2.5
+static const uint16_t s_lbase[] = {3,  4,  5,  6,  7,  8,  9,  10,  11, 13,
+                                   15, 17, 19, 23, 27, 31, 35, 43,  51, 59,
+                                   67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t s_lext[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t s_dbase[] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const uint8_t s_dext[] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                 4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+bool mg_deflate_init(struct mg_deflate *d, int level, size_t wsize) {
+  // Max hash chain length and "good enough" match length, per level
+  static const uint16_t chains[] = {128, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+  static const uint16_t nices[] = {128, 8, 16, 32, 64, 128, 128, 258, 258, 258};
+  size_t w = 1024;
+  if (wsize == 0) wsize = 8192;
+  while (w < wsize && w < 32768) w <<= 1;  // Round up to a power of 2
+  if (level < 0 || level > 9) level = 0;
+  memset(d, 0, sizeof(*d));
+  d->wsize = w;
+  d->chain = chains[level];
+  d->nice = nices[level];
+  d->win = (uint8_t *) calloc(1, 2 * w);
+  d->head = (uint16_t *) calloc(MG_DEFLATE_HASH_SIZE, sizeof(d->head[0]));
+  d->prev = (uint16_t *) calloc(w, sizeof(d->prev[0]));
+  if (d->win == NULL || d->head == NULL || d->prev == NULL) {
+    MG_ERROR(("OOM %lu", (unsigned long) w));
+    mg_deflate_free(d);
+    return false;
+  }
+  return true;
+}
+
+// Start a new stream, keeping allocated memory
+void mg_deflate_reset(struct mg_deflate *d) {
+  if (d->head != NULL) {
+    memset(d->head, 0, MG_DEFLATE_HASH_SIZE * sizeof(d->head[0]));
+  }
+  if (d->prev != NULL) memset(d->prev, 0, d->wsize * sizeof(d->prev[0]));
+  d->pos = d->len = 0;
+  d->bits = d->nbits = 0;
+}
+
+void mg_deflate_free(struct mg_deflate *d) {
+  free(d->win);
+  free(d->head);
+  free(d->prev);
+  d->win = NULL, d->head = d->prev = NULL;
+}
+
+static void putbits(struct mg_deflate *d, struct mg_iobuf *io, uint32_t v,
+                    unsigned n) {
+  d->bits |= v << d->nbits;
+  d->nbits += n;
+  while (d->nbits >= 8) {
+    io->buf[io->len++] = (uint8_t) (d->bits & 255);
+    d->bits >>= 8;
+    d->nbits -= 8;
+  }
+}
+
+// Huffman codes are packed starting from the most significant bit
+static void putcode(struct mg_deflate *d, struct mg_iobuf *io, unsigned code,
+                    unsigned n) {
+  uint32_t v = 0;
+  unsigned i;
+  for (i = 0; i < n; i++) v = (v << 1) | ((code >> i) & 1);
+  putbits(d, io, v, n);
+}
+
+// Fixed Huffman literal/length codes, RFC1951 section 3.2.6
+static void putlit(struct mg_deflate *d, struct mg_iobuf *io, unsigned v) {
+  if (v < 144) {
+    putcode(d, io, 0x30 + v, 8);
+  } else if (v < 256) {
+    putcode(d, io, 0x190 + v - 144, 9);
+  } else if (v < 280) {
+    putcode(d, io, v - 256, 7);
+  } else {
+    putcode(d, io, 0xc0 + v - 280, 8);
+  }
+}
+
+static void putmatch(struct mg_deflate *d, struct mg_iobuf *io, size_t len,
+                     size_t dist) {
+  unsigned i = sizeof(s_lbase) / sizeof(s_lbase[0]) - 1;
+  while (s_lbase[i] > len) i--;
+  putlit(d, io, 257 + i);
+  putbits(d, io, (uint32_t) (len - s_lbase[i]), s_lext[i]);
+  i = sizeof(s_dbase) / sizeof(s_dbase[0]) - 1;
+  while (s_dbase[i] > dist) i--;
+  putcode(d, io, i, 5);
+  putbits(d, io, (uint32_t) (dist - s_dbase[i]), s_dext[i]);
+}
+
+static unsigned hash3(const uint8_t *p) {
+  uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+  return (unsigned) ((v * 2654435761U) >> (32 - MG_DEFLATE_HASH_BITS));
+}
+
+static void insert(struct mg_deflate *d, size_t pos) {
+  unsigned h = hash3(&d->win[pos]);
+  d->prev[pos & (d->wsize - 1)] = d->head[h];
+  d->head[h] = (uint16_t) pos;
+}
+
+// Find the longest match for the current position, walking the hash chain
+static size_t longest(struct mg_deflate *d, size_t *dist) {
+  size_t cur = d->pos, avail = d->len - cur, best = 0, last = cur;
+  size_t max = avail < MG_DEFLATE_MAX_MATCH ? avail : MG_DEFLATE_MAX_MATCH;
+  size_t cand = d->head[hash3(&d->win[cur])];
+  unsigned chain = d->chain;
+  const uint8_t *b = &d->win[cur];
+  insert(d, cur);
+  // Positions in the chain must strictly decrease. Stale entries are possible
+  // after the window slides, but they are filtered out by the byte comparison
+  while (chain-- > 0 && cand < last && cur - cand <= d->wsize && best < max) {
+    const uint8_t *a = &d->win[cand];
+    if (a[best] == b[best] && a[0] == b[0]) {
+      size_t n = 0;
+      while (n < max && a[n] == b[n]) n++;
+      if (n > best) {
+        best = n, *dist = cur - cand;
+        if (n >= d->nice) break;
+      }
+    }
+    last = cand;
+    cand = d->prev[cand & (d->wsize - 1)];
+  }
+  return best;
+}
+
+// Compress window data, leaving `keep` bytes of lookahead uncompressed
+static void compress(struct mg_deflate *d, struct mg_iobuf *io, size_t keep) {
+  while (d->pos + keep < d->len) {
+    size_t i, dist = 0, n = d->pos + 3 <= d->len ? longest(d, &dist) : 0;
+    if (n >= 3) {
+      putmatch(d, io, n, dist);
+      // On faster levels, skip hashing of the matched bytes
+      for (i = 1; d->chain >= 32 && i < n && d->pos + i + 3 <= d->len; i++) {
+        insert(d, d->pos + i);
+      }
+      d->pos += n;
+    } else {
+      putlit(d, io, d->win[d->pos++]);
+    }
+  }
+}
+
+static void slide(struct mg_deflate *d) {
+  size_t i, w = d->wsize;
+  memcpy(d->win, d->win + w, w);
+  d->pos -= w, d->len -= w;
+  for (i = 0; i < MG_DEFLATE_HASH_SIZE; i++) {
+    d->head[i] = (uint16_t) (d->head[i] >= w ? d->head[i] - w : 0);
+  }
+  for (i = 0; i < w; i++) {
+    d->prev[i] = (uint16_t) (d->prev[i] >= w ? d->prev[i] - w : 0);
+  }
+}
+
+// Compress data and append it to the `io`. Every call produces a complete
+// block: if `finish` is true, the final one, otherwise a block followed by
+// the empty stored block (sync flush), so the output is byte-aligned and the
+// peer can decode everything sent so far. Return number of appended bytes
+size_t mg_deflate(struct mg_deflate *d, const void *buf, size_t len,
+                  bool finish, struct mg_iobuf *io) {
+  const uint8_t *p = (const uint8_t *) buf;
+  // Worst case is 9 bits per byte, plus block headers and a flush marker
+  size_t old = io->len, need = io->len + len + len / 8 + 16;
+  if (d->win == NULL) return 0;
+  need += MG_IO_SIZE - need % MG_IO_SIZE;
+  if (need > io->size && !mg_iobuf_resize(io, need)) return 0;
+  putbits(d, io, finish ? 3 : 2, 3);  // BFINAL and BTYPE=01 - fixed Huffman
+  while (len > 0 || d->pos < d->len) {
+    size_t n = 2 * d->wsize - d->len;
+    if (n == 0) slide(d), n = d->wsize;
+    if (n > len) n = len;
+    memcpy(d->win + d->len, p, n);
+    d->len += n, p += n, len -= n;
+    compress(d, io, len > 0 ? MG_DEFLATE_LOOKAHEAD : 0);
+  }
+  putcode(d, io, 0, 7);  // End of block
+  if (!finish) putbits(d, io, 0, 3);  // Empty stored block
+  if (d->nbits > 0) putbits(d, io, 0, 8 - d->nbits);
+  if (!finish) {
+    memcpy(io->buf + io->len, "\x00\x00\xff\xff", 4);  // LEN and NLEN
+    io->len += 4;
+  }
+  return io->len - old;
+}
+
+bool mg_inflate_init(struct mg_inflate *inf, size_t wsize) {
+  memset(inf, 0, sizeof(*inf));
+  if (wsize > 0 && (inf->win = (uint8_t *) calloc(1, wsize)) == NULL) {
+    MG_ERROR(("OOM %lu", (unsigned long) wsize));
+    return false;
+  }
+  inf->wsize = wsize;
+  return true;
+}
+
+void mg_inflate_free(struct mg_inflate *inf) {
+  free(inf->win);
+  inf->win = NULL;
+  inf->wsize = inf->wlen = 0;
+}
+
+struct inf_bits {
+  const uint8_t *p;  // Input data
+  size_t len, pos;   // Input length, and read position
+  uint32_t buf;      // Bit buffer
+  unsigned cnt;      // Number of bits in the buffer
+};
+
+// Canonical Huffman code, decoded as in RFC1951 section 3.2.2
+struct inf_huff {
+  uint16_t count[16];  // Number of codes of each length
+  uint16_t sym[288];   // Symbols ordered by their codes
+};
+
+// Read n bits, return -1 if input is exhausted
+static int inf_get(struct inf_bits *b, unsigned n) {
+  int v;
+  while (b->cnt < n) {
+    if (b->pos >= b->len) return -1;
+    b->buf |= (uint32_t) b->p[b->pos++] << b->cnt;
+    b->cnt += 8;
+  }
+  v = (int) (b->buf & ((1U << n) - 1));
+  b->buf >>= n;
+  b->cnt -= n;
+  return v;
+}
+
+static bool inf_build(struct inf_huff *h, const uint8_t *lens, int n) {
+  uint16_t offs[16];
+  int i, left = 1;
+  memset(h->count, 0, sizeof(h->count));
+  for (i = 0; i < n; i++) h->count[lens[i]]++;
+  for (i = 1; i < 16; i++) {
+    left = (left << 1) - h->count[i];
+    if (left < 0) return false;  // Over-subscribed code
+  }
+  offs[1] = 0;
+  for (i = 1; i < 15; i++) offs[i + 1] = (uint16_t) (offs[i] + h->count[i]);
+  for (i = 0; i < n; i++) {
+    if (lens[i] != 0) h->sym[offs[lens[i]]++] = (uint16_t) i;
+  }
+  return true;
+}
+
+static int inf_decode(struct inf_bits *b, const struct inf_huff *h) {
+  int code = 0, first = 0, index = 0, len, bit;
+  for (len = 1; len < 16; len++) {
+    if ((bit = inf_get(b, 1)) < 0) return -1;
+    code |= bit;
+    if (code - first < h->count[len]) return h->sym[index + code - first];
+    index += h->count[len];
+    first = (first + h->count[len]) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+// Make room for n more output bytes. Return 0, or a negative error
+static int inf_room(struct mg_iobuf *io, size_t start, size_t max, size_t n) {
+  if (max > 0 && io->len - start + n > max) return -2;
+  if (io->len + n > io->size) {
+    size_t size = io->size * 2 + MG_IO_SIZE;
+    if (size < io->len + n) size = io->len + n + MG_IO_SIZE;
+    if (!mg_iobuf_resize(io, size)) return -1;
+  }
+  return 0;
+}
+
+static int inf_codes(struct mg_inflate *inf, struct inf_bits *b,
+                     struct mg_iobuf *io, size_t start, size_t max,
+                     const struct inf_huff *lh, const struct inf_huff *dh) {
+  for (;;) {
+    int sym = inf_decode(b, lh), e, r;
+    if (sym < 0) return -1;
+    if (sym < 256) {
+      if ((r = inf_room(io, start, max, 1)) < 0) return r;
+      io->buf[io->len++] = (uint8_t) sym;
+    } else if (sym == 256) {
+      return 0;
+    } else if ((sym -= 257) >= 29 || (e = inf_get(b, s_lext[sym])) < 0) {
+      return -1;
+    } else {
+      size_t i, n = (size_t) (s_lbase[sym] + e), dist;
+      if ((sym = inf_decode(b, dh)) < 0 || sym >= 30 ||
+          (e = inf_get(b, s_dext[sym])) < 0) {
+        return -1;
+      }
+      dist = (size_t) (s_dbase[sym] + e);
+      if (dist > io->len - start + inf->wlen) return -1;  // Too far back
+      if ((r = inf_room(io, start, max, n)) < 0) return r;
+      for (i = 0; i < n; i++, io->len++) {
+        size_t o = io->len - start;
+        io->buf[io->len] = dist <= o ? io->buf[io->len - dist]
+                                     : inf->win[inf->wlen - (dist - o)];
+      }
+    }
+  }
+}
+
+static int inf_fixed(struct mg_inflate *inf, struct inf_bits *b,
+                     struct mg_iobuf *io, size_t start, size_t max) {
+  struct inf_huff lh, dh;
+  uint8_t lens[288];
+  memset(lens, 8, 144);
+  memset(lens + 144, 9, 112);
+  memset(lens + 256, 7, 24);
+  memset(lens + 280, 8, 8);
+  inf_build(&lh, lens, 288);
+  memset(lens, 5, 30);
+  inf_build(&dh, lens, 30);
+  return inf_codes(inf, b, io, start, max, &lh, &dh);
+}
+
+static int inf_dynamic(struct mg_inflate *inf, struct inf_bits *b,
+                       struct mg_iobuf *io, size_t start, size_t max) {
+  static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                    11, 4,  12, 3, 13, 2, 14, 1, 15};
+  struct inf_huff lh, dh;
+  uint8_t lens[320];
+  int i, n = 0, nlen = inf_get(b, 5), ndist = inf_get(b, 5),
+         ncode = inf_get(b, 4);
+  if (nlen < 0 || ndist < 0 || ncode < 0) return -1;
+  nlen += 257, ndist += 1, ncode += 4;
+  if (nlen > 286 || ndist > 30) return -1;
+  memset(lens, 0, 19);
+  for (i = 0; i < ncode; i++) {
+    int v = inf_get(b, 3);
+    if (v < 0) return -1;
+    lens[order[i]] = (uint8_t) v;
+  }
+  if (!inf_build(&lh, lens, 19)) return -1;
+  while (n < nlen + ndist) {
+    int sym = inf_decode(b, &lh), rep, v = 0;
+    if (sym < 0) return -1;
+    if (sym < 16) {
+      lens[n++] = (uint8_t) sym;
+      continue;
+    }
+    if (sym == 16) {
+      if (n == 0) return -1;  // Nothing to repeat
+      v = lens[n - 1], rep = inf_get(b, 2), rep = rep < 0 ? -1 : rep + 3;
+    } else if (sym == 17) {
+      rep = inf_get(b, 3), rep = rep < 0 ? -1 : rep + 3;
+    } else {
+      rep = inf_get(b, 7), rep = rep < 0 ? -1 : rep + 11;
+    }
+    if (rep < 0 || n + rep > nlen + ndist) return -1;
+    while (rep-- > 0) lens[n++] = (uint8_t) v;
+  }
+  if (lens[256] == 0) return -1;  // No end of block code
+  if (!inf_build(&lh, lens, nlen) || !inf_build(&dh, lens + nlen, ndist)) {
+    return -1;
+  }
+  return inf_codes(inf, b, io, start, max, &lh, &dh);
+}
+
+// Remember the last output bytes, for back references from the next call
+static void inf_window(struct mg_inflate *inf, const uint8_t *p, size_t n) {
+  size_t w = inf->wsize, keep = inf->wlen;
+  if (w == 0 || n == 0) return;
+  if (n >= w) {
+    memcpy(inf->win, p + n - w, w);
+    inf->wlen = w;
   } else {
-    for (i = 0, t = mul; t >= 1.0 && s + n < (int) sizeof(buf); i++) {
-      int ch = (int) (d / t);
-      if (n > 0 || ch > 0) buf[s + n++] = (char) (ch + '0');
-      d -= ch * t;
-      t /= 10.0;
-    }
-    // printf(" --> [%g] -> %g %g (%d) [%.*s]\n", saved, d, t, n, s + n, buf);
-    if (n == 0) buf[s++] = '0';
-    while (t >= 1.0 && n + s < (int) sizeof(buf)) buf[n++] = '0', t /= 10.0;
-    if (s + n < (int) sizeof(buf)) buf[n + s++] = '.';
-    // printf(" 1--> [%g] -> [%.*s]\n", saved, s + n, buf);
-    for (i = 0, t = 0.1; s + n < (int) sizeof(buf) && n < width; i++) {
-      int ch = (int) (d / t);
-      buf[s + n++] = (char) (ch + '0');
-      d -= ch * t;
-      t /= 10.0;
-    }
-  }
-  while (n > 0 && buf[s + n - 1] == '0') n--;  // Trim trailing zeros
-  if (n > 0 && buf[s + n - 1] == '.') n--;     // Trim trailing dot
-  buf[s + n] = '\0';
-  return mg_snprintf(dst, dstlen, "%s", buf);
+    if (keep + n > w) keep = w - n;
+    memmove(inf->win, inf->win + inf->wlen - keep, keep);
+    memcpy(inf->win + keep, p, n);
+    inf->wlen = keep + n;
+  }
+}
+
+// Decompress blocks in buf and append data to io. Decoding stops after the
+// final block, or at the end of input on a block boundary. A stored block
+// header without LEN and NLEN at the end of input, as left by stripping a
+// sync flush marker, is accepted. Return the number of appended bytes, -1
+// on invalid data, or -2 if the output is larger than max (if max > 0)
+long mg_inflate(struct mg_inflate *inf, const void *buf, size_t len,
+                struct mg_iobuf *io, size_t max) {
+  struct inf_bits b;
+  size_t start = io->len;
+  int last = 0, r = 0;
+  memset(&b, 0, sizeof(b));
+  b.p = (const uint8_t *) buf, b.len = len;
+  while (r == 0 && !last && (b.pos < b.len || b.cnt >= 3)) {
+    int type;
+    last = inf_get(&b, 1), type = inf_get(&b, 2);
+    if (type == 0) {
+      size_t n;
+      b.buf = 0, b.cnt = 0;  // Skip to a byte boundary
+      if (b.pos == b.len) break;
+      if (b.pos + 4 > b.len) {
+        r = -1;
+        break;
+      }
+      n = (size_t) (b.p[b.pos] | b.p[b.pos + 1] << 8);
+      if ((n ^ 0xffff) != (size_t) (b.p[b.pos + 2] | b.p[b.pos + 3] << 8) ||
+          b.pos + 4 + n > b.len) {
+        r = -1;
+      } else if ((r = inf_room(io, start, max, n)) == 0) {
+        memcpy(io->buf + io->len, b.p + b.pos + 4, n);
+        io->len += n, b.pos += 4 + n;
+      }
+    } else if (type == 1) {
+      r = inf_fixed(inf, &b, io, start, max);
+    } else if (type == 2) {
+      r = inf_dynamic(inf, &b, io, start, max);
+    } else {
+      r = -1;
+    }
+  }
+  if (r < 0) {
+    io->len = start;
+    return r;
+  }
+  inf_window(inf, io->buf + start, io->len - start);
+  return (long) (io->len - start);
 }
 
 #ifdef MG_ENABLE_LINES
@@ -552,6 +2109,7 @@ void mg_error(struct mg_connection *c, const char *fmt, ...) {
 
 
 
+
 size_t mg_vasprintf(char **buf, size_t size, const char *fmt, va_list ap) {
   va_list ap_copy;
   size_t len;
@@ -598,6 +2156,15 @@ char *mg_mprintf(const char *fmt, ...) {
   return s;
 }
 
+size_t mg_wprintf(mg_pw_t fn, void *param, const char *fmt, ...) {
+  size_t len = 0;
+  va_list ap;
+  va_start(ap, fmt);
+  len = mg_vwprintf(fn, param, fmt, &ap);
+  va_end(ap);
+  return len;
+}
+
 size_t mg_rprintf(void (*out)(char, void *), void *ptr, const char *fmt, ...) {
   size_t len = 0;
   va_list ap;
@@ -615,6 +2182,15 @@ static void mg_putchar_iobuf_static(char ch, void *param) {
   }
 }
 
+static void write_iobuf_static(const char *buf, size_t len, void *param) {
+  struct mg_iobuf *io = (struct mg_iobuf *) param;
+  if (buf == NULL || io->len + 1 >= io->size) return;
+  if (len > io->size - io->len - 1) len = io->size - io->len - 1;
+  memcpy(io->buf + io->len, buf, len);
+  io->len += len;
+  io->buf[io->len] = 0;
+}
+
 void mg_putchar_iobuf(char ch, void *param) {
   struct mg_iobuf *io = (struct mg_iobuf *) param;
   if (io->len + 2 > io->size) mg_iobuf_resize(io, io->size + 64);
@@ -624,16 +2200,36 @@ void mg_putchar_iobuf(char ch, void *param) {
   }
 }
 
+// Grow in MG_IO_SIZE steps, so that a long printf resizes a few times
+// rather than once per 64 bytes. NULL buf is a hint: reserve len bytes
+void mg_write_iobuf(const char *buf, size_t len, void *param) {
+  struct mg_iobuf *io = (struct mg_iobuf *) param;
+  size_t need = io->len + len + 1;
+  if (need > io->size) {
+    mg_iobuf_resize(io, need + MG_IO_SIZE - need % MG_IO_SIZE);
+  }
+  if (buf != NULL && need <= io->size) {
+    memcpy(io->buf + io->len, buf, len);
+    io->len += len;
+    io->buf[io->len] = 0;
+  }
+}
+
 // We don't use realloc() in mongoose, so resort to inefficient calloc
 // Every new character reallocates the whole string
 void mg_putchar_realloc(char ch, void *param) {
-  char *s, *buf = *(char **) param;
-  size_t len = buf == NULL ? 0 : strlen(buf);
-  if ((s = (char *) calloc(1, len + 2)) != NULL) {
-    if (buf != NULL) memcpy(s, buf, len);
-    s[len] = ch;
-    s[len + 1] = '\0';
-    free(buf);
+  mg_write_realloc(&ch, 1, param);
+}
+
+// Same as above, but the whole span is appended with one reallocation
+void mg_write_realloc(const char *buf, size_t len, void *param) {
+  char *s, *old = *(char **) param;
+  size_t n = old == NULL ? 0 : strlen(old);
+  if (buf == NULL || len == 0) return;
+  if ((s = (char *) calloc(1, n + len + 1)) != NULL) {
+    if (old != NULL) memcpy(s, old, n);
+    memcpy(s + n, buf, len);
+    free(old);
     *(char **) param = s;
   }
 }
@@ -671,11 +2267,35 @@ size_t mg_lld(char *buf, int64_t val, bool is_signed, bool is_hex) {
   return n + s;
 }
 
-static size_t scpy(void (*out)(char, void *), void *ptr, char *buf,
-                   size_t len) {
+// Formatter output: spans go to `w`, and %M printers get the putchar `pc`.
+// When the caller has given us a putchar function, it is passed to %M
+// printers as is; otherwise `pc` is a shim that forwards to `w`
+struct mg_xout {
+  mg_pw_t w;
+  void *wp;
+  mg_pc_t pc;
+  void *pp;
+};
+
+static size_t wr(struct mg_xout *o, const char *buf, size_t len) {
+  if (len > 0) o->w(buf, len, o->wp);
+  return len;
+}
+
+static size_t wpad(struct mg_xout *o, char ch, size_t len) {
+  char tmp[16];
+  size_t n = 0;
+  memset(tmp, ch, sizeof(tmp));
+  while (n < len) {
+    n += wr(o, tmp, len - n > sizeof(tmp) ? sizeof(tmp) : len - n);
+  }
+  return n;
+}
+
+static size_t scpy(struct mg_xout *o, char *buf, size_t len) {
   size_t i = 0;
-  while (i < len && buf[i] != '\0') out(buf[i++], ptr);
-  return i;
+  while (i < len && buf[i] != '\0') i++;
+  return wr(o, buf, i);
 }
 
 static char mg_esc(int c, bool esc) {
@@ -690,46 +2310,61 @@ static char mg_escape(int c) {
   return mg_esc(c, true);
 }
 
-static size_t qcpy(void (*out)(char, void *), void *ptr, char *buf,
-                   size_t len) {
-  size_t i = 0, extra = 2;
-  out('"', ptr);
+// Unescaped runs are emitted as one span each
+static size_t qcpy(struct mg_xout *o, char *buf, size_t len) {
+  size_t i, start = 0, n = wr(o, "\"", 1);
   for (i = 0; i < len && buf[i] != '\0'; i++) {
     char c = mg_escape(buf[i]);
     if (c) {
-      out('\\', ptr), out(c, ptr), extra++;
-    } else {
-      out(buf[i], ptr);
+      char tmp[2] = {'\\', c};
+      n += wr(o, buf + start, i - start) + wr(o, tmp, sizeof(tmp));
+      start = i + 1;
     }
   }
-  out('"', ptr);
-  return i + extra;
+  n += wr(o, buf + start, i - start);
+  return n + wr(o, "\"", 1);
 }
 
-static size_t bcpy(void (*out)(char, void *), void *ptr, uint8_t *buf,
-                   size_t len) {
-  size_t i, n = 0;
+static size_t bcpy(struct mg_xout *o, uint8_t *buf, size_t len) {
+  size_t i, k = 0, n = 0;
   const char *t =
       "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-  out('"', ptr), n++;
+  char tmp[64];
+  tmp[k++] = '"';
   for (i = 0; i < len; i += 3) {
     uint8_t c1 = buf[i], c2 = i + 1 < len ? buf[i + 1] : 0,
             c3 = i + 2 < len ? buf[i + 2] : 0;
-    char tmp[4] = {t[c1 >> 2], t[(c1 & 3) << 4 | (c2 >> 4)], '=', '='};
-    if (i + 1 < len) tmp[2] = t[(c2 & 15) << 2 | (c3 >> 6)];
-    if (i + 2 < len) tmp[3] = t[c3 & 63];
-    n += scpy(out, ptr, tmp, sizeof(tmp));
+    if (k + 4 > sizeof(tmp)) n += wr(o, tmp, k), k = 0;
+    tmp[k++] = t[c1 >> 2];
+    tmp[k++] = t[(c1 & 3) << 4 | (c2 >> 4)];
+    tmp[k++] = i + 1 < len ? t[(c2 & 15) << 2 | (c3 >> 6)] : '=';
+    tmp[k++] = i + 2 < len ? t[c3 & 63] : '=';
   }
-  out('"', ptr), n++;
-  return n;
+  if (k + 1 > sizeof(tmp)) n += wr(o, tmp, k), k = 0;
+  tmp[k++] = '"';
+  return n + wr(o, tmp, k);
 }
 
-size_t mg_vrprintf(void (*out)(char, void *), void *param, const char *fmt,
-                   va_list *ap) {
+static size_t hcpy(struct mg_xout *o, uint8_t *buf, size_t len) {
+  const char *hex = "0123456789abcdef";
+  size_t i, k = 0, n = 0;
+  char tmp[64];
+  tmp[k++] = '"';
+  for (i = 0; i < len; i++) {
+    if (k + 2 > sizeof(tmp)) n += wr(o, tmp, k), k = 0;
+    tmp[k++] = hex[(buf[i] >> 4) & 15];
+    tmp[k++] = hex[buf[i] & 15];
+  }
+  if (k + 1 > sizeof(tmp)) n += wr(o, tmp, k), k = 0;
+  tmp[k++] = '"';
+  return n + wr(o, tmp, k);
+}
+
+static size_t xprintf(struct mg_xout *o, const char *fmt, va_list *ap) {
   size_t i = 0, n = 0;
   while (fmt[i] != '\0') {
     if (fmt[i] == '%') {
-      size_t j, k, x = 0, is_long = 0, w = 0 /* width */, pr = ~0U /* prec */;
+      size_t k, x = 0, is_long = 0, w = 0 /* width */, pr = ~0U /* prec */;
       char pad = ' ', minus = 0, c = fmt[++i];
       if (c == '#') x++, c = fmt[++i];
       if (c == '-') minus++, c = fmt[++i];
@@ -770,64 +2405,93 @@ size_t mg_vrprintf(void (*out)(char, void *), void *param, const char *fmt,
           int v = va_arg(*ap, int);
           k = mg_lld(tmp, s ? (int64_t) v : (int64_t) (unsigned) v, s, h);
         }
-        for (j = 0; j < xl && w > 0; j++) w--;
-        for (j = 0; pad == ' ' && !minus && k < w && j + k < w; j++)
-          n += scpy(out, param, &pad, 1);
-        n += scpy(out, param, (char *) "0x", xl);
-        for (j = 0; pad == '0' && k < w && j + k < w; j++)
-          n += scpy(out, param, &pad, 1);
-        n += scpy(out, param, tmp, k);
-        for (j = 0; pad == ' ' && minus && k < w && j + k < w; j++)
-          n += scpy(out, param, &pad, 1);
+        w = w > xl ? w - xl : 0;
+        if (pad == ' ' && !minus && k < w) n += wpad(o, pad, w - k);
+        n += wr(o, "0x", xl);
+        if (pad == '0' && k < w) n += wpad(o, pad, w - k);
+        n += wr(o, tmp, k);
+        if (pad == ' ' && minus && k < w) n += wpad(o, pad, w - k);
       } else if (c == 'M') {
         mg_pm_t f = va_arg(*ap, mg_pm_t);
-        n += f(out, param, ap);
+        n += f(o->pc, o->pp, ap);
       } else if (c == 'c') {
-        int ch = va_arg(*ap, int);
-        out((char) ch, param);
-        n++;
+        char ch = (char) va_arg(*ap, int);
+        n += wr(o, &ch, 1);
       } else if (c == 'H') {
         // Print hex-encoded double-quoted string
         size_t bl = (size_t) va_arg(*ap, int);
-        uint8_t *p = va_arg(*ap, uint8_t *), dquote = '"';
-        const char *hex = "0123456789abcdef";
-        n += scpy(out, param, (char *) &dquote, 1);
-        for (j = 0; j < bl; j++) {
-          n += scpy(out, param, (char *) &hex[(p[j] >> 4) & 15], 1);
-          n += scpy(out, param, (char *) &hex[p[j] & 15], 1);
-        }
-        n += scpy(out, param, (char *) &dquote, 1);
+        uint8_t *p = va_arg(*ap, uint8_t *);
+        n += hcpy(o, p, bl);
       } else if (c == 'V') {
         // Print base64-encoded double-quoted string
         size_t len = (size_t) va_arg(*ap, int);
         uint8_t *buf = va_arg(*ap, uint8_t *);
-        n += bcpy(out, param, buf, len);
+        n += bcpy(o, buf, len);
       } else if (c == 's' || c == 'Q') {
         char *p = va_arg(*ap, char *);
-        size_t (*f)(void (*)(char, void *), void *, char *, size_t) =
-            c == 's' ? scpy : qcpy;
         if (pr == ~0U) pr = p == NULL ? 0 : strlen(p);
-        for (j = 0; !minus && pr < w && j + pr < w; j++)
-          n += f(out, param, &pad, 1);
-        n += f(out, param, p, pr);
-        for (j = 0; minus && pr < w && j + pr < w; j++)
-          n += f(out, param, &pad, 1);
+        if (!minus && pr < w) n += wpad(o, pad, w - pr);
+        n += c == 's' ? scpy(o, p, pr) : qcpy(o, p, pr);
+        if (minus && pr < w) n += wpad(o, pad, w - pr);
       } else if (c == '%') {
-        out('%', param);
-        n++;
+        n += wr(o, "%", 1);
       } else {
-        out('%', param);
-        out(c, param);
-        n += 2;
+        char tmp[2] = {'%', c};
+        n += wr(o, tmp, sizeof(tmp));
       }
       i++;
     } else {
-      out(fmt[i], param), n++, i++;
+      // Emit a run of literal characters as one span
+      size_t j = i;
+      while (fmt[j] != '\0' && fmt[j] != '%') j++;
+      n += wr(o, fmt + i, j - i);
+      i = j;
     }
   }
   return n;
 }
 
+static void pw_putchar(char ch, void *param) {
+  struct mg_xout *o = (struct mg_xout *) param;
+  o->w(&ch, 1, o->wp);
+}
+
+static void pc_write(const char *buf, size_t len, void *param) {
+  struct mg_xout *o = (struct mg_xout *) param;
+  size_t i;
+  for (i = 0; buf != NULL && i < len; i++) o->pc(buf[i], o->pp);
+}
+
+size_t mg_vwprintf(mg_pw_t fn, void *param, const char *fmt, va_list *ap) {
+  struct mg_xout o = {fn, param, pw_putchar, NULL};
+  // %M printers call mg_rprintf(), give them a putchar that maps back to us
+  if (fn == mg_write_iobuf) {
+    o.pc = mg_putchar_iobuf, o.pp = param;
+  } else if (fn == mg_write_realloc) {
+    o.pc = mg_putchar_realloc, o.pp = param;
+  } else {
+    o.pp = &o;
+  }
+  fn(NULL, strlen(fmt), param);  // Size hint: at least the literal part
+  return xprintf(&o, fmt, ap);
+}
+
+size_t mg_vrprintf(void (*out)(char, void *), void *param, const char *fmt,
+                   va_list *ap) {
+  struct mg_xout o = {pc_write, NULL, out, param};
+  // Well-known putchar functions get their bulk counterparts
+  if (out == mg_putchar_iobuf) {
+    o.w = mg_write_iobuf, o.wp = param;
+  } else if (out == mg_putchar_realloc) {
+    o.w = mg_write_realloc, o.wp = param;
+  } else if (out == mg_putchar_iobuf_static) {
+    o.w = write_iobuf_static, o.wp = param;
+  } else {
+    o.wp = &o;
+  }
+  return xprintf(&o, fmt, ap);
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/fs.c"
 #endif
@@ -1424,6 +3088,11 @@ struct mg_fs mg_fs_posix = {p_stat,  p_list, p_open,   p_close,  p_read,
 
 
 
+
+
+
+
+
 // Multipart POST example:
 // --xyz
 // Content-Disposition: form-data; name="val"
@@ -1466,9 +3135,17 @@ size_t mg_http_next_multipart(struct mg_str body, size_t ofs,
     h1 = h2 = h2 + 2;
   }
   b1 = b2 = h2 + 2;
-  while (b2 + 2 + (b - ofs) + 2 < max && !(s[b2] == '\r' && s[b2 + 1] == '\n' &&
-                                           memcmp(&s[b2 + 2], s, b - ofs) == 0))
+  while (b2 + 2 + (b - ofs) + 2 < max) {
+    size_t limit = max - (b - ofs) - 4;
+    const char *p = (const char *) memchr(&s[b2], '\r', limit - b2);
+    if (p == NULL) {
+      b2 = limit;
+      break;
+    }
+    b2 = (size_t) (p - s);
+    if (s[b2 + 1] == '\n' && memcmp(&s[b2 + 2], s, b - ofs) == 0) break;
     b2++;
+  }
 
   if (b2 + 2 >= max) return 0;
   if (part != NULL) part->body = mg_str_n(&s[b1], b2 - b1);
@@ -1476,18 +3153,188 @@ size_t mg_http_next_multipart(struct mg_str body, size_t ofs,
   return b2 + 2;
 }
 
-void mg_http_bauth(struct mg_connection *c, const char *user,
-                   const char *pass) {
-  struct mg_str u = mg_str(user), p = mg_str(pass);
-  size_t need = c->send.len + 36 + (u.len + p.len) * 2;
-  if (c->send.size < need) mg_iobuf_resize(&c->send, need);
-  if (c->send.size >= need) {
-    int i, n = 0;
-    char *buf = (char *) &c->send.buf[c->send.len + 21];
-    memcpy(&buf[-21], "Authorization: Basic ", 21);  // DON'T use mg_send!
-    for (i = 0; i < (int) u.len; i++) {
-      n = mg_base64_update(((unsigned char *) u.ptr)[i], buf, n);
-    }
+enum { MP_PREAMBLE, MP_DELIM, MP_DASH, MP_CRLF, MP_HEADERS, MP_DATA, MP_DONE };
+
+bool mg_http_mp_init(struct mg_http_mp *mp, struct mg_http_message *hm,
+                     void (*fn)(struct mg_http_mp *, int,
+                                struct mg_http_part *),
+                     void *fn_data) {
+  struct mg_str *ct = mg_http_get_header(hm, "Content-Type"), b;
+  memset(mp, 0, sizeof(*mp));
+  mp->fn = fn, mp->fn_data = fn_data, mp->state = -1;
+  if (ct == NULL) return false;
+  b = mg_http_get_header_var(*ct, mg_str_n("boundary", 8));
+  if (b.len == 0 || b.len > 70 || memchr(b.ptr, '\r', b.len) != NULL ||
+      memchr(b.ptr, '\n', b.len) != NULL) {
+    return false;
+  }
+  memcpy(mp->delim, "\r\n--", 4);
+  memcpy(mp->delim + 4, b.ptr, b.len);
+  mp->dlen = b.len + 4;
+  // The body starts with a delimiter without leading CRLF. Pretend that the
+  // CRLF has been seen already
+  mp->match = 2;
+  mp->state = MP_PREAMBLE;
+  return true;
+}
+
+static void mp_call(struct mg_http_mp *mp, int ev, const char *p, size_t n) {
+  mp->part.body = mg_str_n(p, n);
+  if (ev == MG_HTTP_MP_DATA) mp->size += n;
+  if (mp->fn != NULL && (n > 0 || ev != MG_HTTP_MP_DATA)) {
+    mp->fn(mp, ev, &mp->part);
+  }
+}
+
+// Part headers are complete, find out name and filename
+static void mp_begin(struct mg_http_mp *mp) {
+  struct mg_str cd = mg_str_n("Content-Disposition", 19);
+  size_t i = 0, j;
+  mp->part.name = mp->part.filename = mg_str_n(NULL, 0);
+  while (i < mp->hlen) {
+    const char *h = &mp->hdrs[i];
+    for (j = i; j + 1 < mp->hlen && mp->hdrs[j] != '\r';) j++;
+    if (j - i > cd.len + 1 && h[cd.len] == ':' &&
+        mg_ncasecmp(h, cd.ptr, cd.len) == 0) {
+      struct mg_str v = mg_str_n(h + cd.len + 1, j - i - cd.len - 1);
+      mp->part.name = mg_http_get_header_var(v, mg_str_n("name", 4));
+      mp->part.filename = mg_http_get_header_var(v, mg_str_n("filename", 8));
+    }
+    i = j + 2;
+  }
+  mp->size = 0;
+  mp->state = MP_DATA;
+  mp_call(mp, MG_HTTP_MP_BEGIN, NULL, 0);
+}
+
+static void mp_delim(struct mg_http_mp *mp) {
+  if (mp->state == MP_DATA) mp_call(mp, MG_HTTP_MP_END, NULL, 0);
+  if (mp->state >= 0) mp->state = MP_DELIM;  // Callback may set an error
+  mp->match = 0;
+}
+
+// Scan data for the delimiter. Delimiter starts with CR, and boundary can't
+// contain CR, so memchr() finds all candidates, and a partially matched
+// delimiter can't overlap with the next one
+static size_t mp_scan(struct mg_http_mp *mp, const char *buf, size_t len) {
+  size_t i = 0, n;
+  int ev = mp->state == MP_DATA ? MG_HTTP_MP_DATA : -1;
+  if (mp->match > 0) {
+    n = mp->dlen - mp->match < len ? mp->dlen - mp->match : len;
+    if (memcmp(mp->delim + mp->match, buf, n) == 0) {
+      mp->match += n;
+      if (mp->match == mp->dlen) mp_delim(mp);
+      return n;
+    }
+    if (ev >= 0) mp_call(mp, ev, mp->delim, mp->match);  // It was data
+    mp->match = 0;
+  }
+  while (i < len) {
+    const char *p = (const char *) memchr(buf + i, '\r', len - i);
+    size_t k = p == NULL ? len : (size_t) (p - buf);
+    n = len - k < mp->dlen ? len - k : mp->dlen;
+    if (p == NULL || memcmp(p, mp->delim, n) == 0) {
+      if (ev >= 0) mp_call(mp, ev, buf, k);
+      if (n == mp->dlen) {
+        mp_delim(mp);
+      } else {
+        mp->match = n;
+      }
+      return k + n;
+    }
+    i = k + 1;
+  }
+  return len;
+}
+
+int mg_http_mp_feed(struct mg_http_mp *mp, struct mg_str data) {
+  size_t i = 0;
+  while (i < data.len && mp->state >= 0 && mp->state != MP_DONE) {
+    char ch = data.ptr[i];
+    if (mp->state == MP_PREAMBLE || mp->state == MP_DATA) {
+      i += mp_scan(mp, data.ptr + i, data.len - i);
+      continue;
+    }
+    i++;
+    if (mp->state == MP_DELIM) {  // After delimiter: "--", or padding, CRLF
+      mp->state = ch == '-'                ? MP_DASH
+                  : ch == '\r'             ? MP_CRLF
+                  : ch == ' ' || ch == '\t' ? MP_DELIM
+                                           : -1;
+    } else if (mp->state == MP_DASH) {
+      mp->state = ch == '-' ? MP_DONE : -1;
+    } else if (mp->state == MP_CRLF) {
+      mp->state = ch == '\n' ? MP_HEADERS : -1;
+      mp->hlen = 0;
+    } else if (mp->hlen + 1 >= sizeof(mp->hdrs)) {
+      mp->state = -1;  // Headers are too large
+    } else {
+      size_t n = ++mp->hlen;
+      mp->hdrs[n - 1] = ch;
+      if (n >= 2 && mp->hdrs[n - 2] == '\r' && ch == '\n' &&
+          (n == 2 || (n >= 4 && mp->hdrs[n - 4] == '\r' &&
+                      mp->hdrs[n - 3] == '\n'))) {
+        mp_begin(mp);
+      }
+    }
+  }
+  return mp->state < 0 ? -1 : mp->state == MP_DONE ? 1 : 0;
+}
+
+static void mp_path(struct mg_http_mp *mp, char *buf, size_t len) {
+  mg_snprintf(buf, len, "%s/%.*s", mp->dir == NULL ? "." : mp->dir,
+              (int) mp->part.filename.len, mp->part.filename.ptr);
+}
+
+// Save file parts to mp->dir. File names must not contain paths. On error,
+// a partially written file is deleted
+void mg_http_mp_save(struct mg_http_mp *mp, int ev, struct mg_http_part *p) {
+  struct mg_fs *fs = mp->fs == NULL ? &mg_fs_posix : mp->fs;
+  char path[MG_PATH_MAX];
+  if (ev == MG_HTTP_MP_BEGIN && p->filename.len > 0) {
+    mp_path(mp, path, sizeof(path));
+    if (memchr(p->filename.ptr, '/', p->filename.len) != NULL ||
+        memchr(p->filename.ptr, '\\', p->filename.len) != NULL ||
+        p->filename.ptr[0] == '.') {
+      MG_ERROR(("Bad file name [%.*s]", (int) p->filename.len,
+                p->filename.ptr));
+      mp->state = -1;
+    } else {
+      fs->rm(path);  // MG_FS_WRITE appends, so truncate first
+      if ((mp->fd = mg_fs_open(fs, path, MG_FS_WRITE)) == NULL) {
+        MG_ERROR(("open(%s): %d", path, errno));
+        mp->state = -1;
+      }
+    }
+  } else if (ev == MG_HTTP_MP_DATA && mp->fd != NULL) {
+    if ((mp->max_size > 0 && mp->size > mp->max_size) ||
+        fs->wr(mp->fd->fd, p->body.ptr, p->body.len) != p->body.len) {
+      MG_ERROR(("%.*s: failed at %lu bytes", (int) p->filename.len,
+                p->filename.ptr, (unsigned long) mp->size));
+      mg_fs_close(mp->fd);
+      mp->fd = NULL;
+      mp->state = -1;
+      mp_path(mp, path, sizeof(path));
+      fs->rm(path);
+    }
+  } else if (ev == MG_HTTP_MP_END) {
+    mg_fs_close(mp->fd);
+    mp->fd = NULL;
+  }
+}
+
+void mg_http_bauth(struct mg_connection *c, const char *user,
+                   const char *pass) {
+  struct mg_str u = mg_str(user), p = mg_str(pass);
+  size_t need = c->send.len + 36 + (u.len + p.len) * 2;
+  if (c->send.size < need) mg_iobuf_resize(&c->send, need);
+  if (c->send.size >= need) {
+    int i, n = 0;
+    char *buf = (char *) &c->send.buf[c->send.len + 21];
+    memcpy(&buf[-21], "Authorization: Basic ", 21);  // DON'T use mg_send!
+    for (i = 0; i < (int) u.len; i++) {
+      n = mg_base64_update(((unsigned char *) u.ptr)[i], buf, n);
+    }
     if (p.len > 0) {
       n = mg_base64_update(':', buf, n);
       for (i = 0; i < (int) p.len; i++) {
@@ -1668,9 +3515,11 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
     hm->message.len = (size_t) req_len;
   }
 
-  // The 204 (No content) responses also have 0 body length
+  // The 204 (No content) and 1xx (Informational) responses also have 0 body
+  // length
   if (hm->body.len == (size_t) ~0 && is_response &&
-      mg_vcasecmp(&hm->uri, "204") == 0) {
+      (mg_vcasecmp(&hm->uri, "204") == 0 ||
+       (hm->uri.len == 3 && hm->uri.ptr[0] == '1'))) {
     hm->body.len = 0;
     hm->message.len = (size_t) req_len;
   }
@@ -1678,13 +3527,125 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
   return req_len;
 }
 
+struct mg_gzip {
+  struct mg_deflate deflate;  // Compressor state
+  uint32_t crc;               // CRC32 of the uncompressed data
+  uint32_t size;              // Size of the uncompressed data, modulo 2^32
+  size_t min_size;            // Minimal mg_http_reply() body size to compress
+  size_t end;                 // c->send.len after the last compressed chunk
+  bool started;               // True if gzip header is already sent
+};
+
+// Free per-connection HTTP state, and WebSocket state of upgraded connections
+static void http_free(struct mg_connection *c) {
+  mg_http_gzip_free(c);
+  mg_http_pipeline_free(c);
+  mg_ws_free(c);
+}
+
+static bool accepts_gzip(struct mg_http_message *hm) {
+  struct mg_str k, v, *ae = mg_http_get_header(hm, "Accept-Encoding");
+  struct mg_str s = ae == NULL ? mg_str_n(NULL, 0) : *ae;
+  while (mg_commalist(&s, &k, &v)) {
+    size_t n = 0;
+    k = mg_strstrip(k);
+    while (n < k.len && k.ptr[n] != ';') n++;
+    if (n == 4 && mg_ncasecmp(k.ptr, "gzip", 4) == 0) {
+      return v.len == 0 || mg_atod(v.ptr, (int) v.len, NULL) > 0.0;  // q=0?
+    }
+  }
+  return false;
+}
+
+bool mg_http_gzip(struct mg_connection *c, struct mg_http_message *hm,
+                  const struct mg_http_gzip_opts *opts) {
+  struct mg_gzip *gz = NULL;
+  mg_http_gzip_free(c);
+  // A response to HEAD has no body to compress
+  if (accepts_gzip(hm) && mg_vcasecmp(&hm->method, "HEAD") != 0 &&
+      (gz = (struct mg_gzip *) calloc(1, sizeof(*gz))) != NULL) {
+    int level = opts == NULL ? 0 : opts->level;
+    if (mg_deflate_init(&gz->deflate, level, opts == NULL ? 0 : opts->wsize)) {
+      gz->min_size = opts == NULL ? 0 : opts->min_size;
+      c->gzip = gz;
+      c->pfree = http_free;
+    } else {
+      free(gz);
+    }
+  }
+  return c->gzip != NULL;
+}
+
+void mg_http_gzip_free(struct mg_connection *c) {
+  struct mg_gzip *gz = (struct mg_gzip *) c->gzip;
+  if (gz != NULL) mg_deflate_free(&gz->deflate);
+  free(gz);
+  c->gzip = NULL;
+}
+
+// Compress data straight into the send buffer, as a part of the gzip stream
+static size_t gzip_write(struct mg_connection *c, const char *buf, size_t len,
+                         bool finish) {
+  struct mg_gzip *gz = (struct mg_gzip *) c->gzip;
+  size_t old = c->send.len;
+  if (!gz->started) {
+    mg_send(c, "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);  // RFC1952
+    gz->started = true;
+  }
+  gz->crc = mg_crc32(gz->crc, buf, len);
+  gz->size += (uint32_t) len;
+  mg_deflate(&gz->deflate, buf, len, finish, &c->send);
+  if (finish) {
+    uint8_t trailer[8];  // CRC32 and size, little endian
+    int i;
+    for (i = 0; i < 4; i++) {
+      trailer[i] = (uint8_t) (gz->crc >> (i * 8));
+      trailer[i + 4] = (uint8_t) (gz->size >> (i * 8));
+    }
+    mg_send(c, trailer, sizeof(trailer));
+  }
+  return c->send.len - old;
+}
+
+// Compressed chunk. The chunk length is not known until data is compressed,
+// so reserve space for it and fill it in afterwards. Empty chunk finishes
+// the gzip stream, and the response
+static void gzip_chunk(struct mg_connection *c, const char *buf, size_t len) {
+  struct mg_gzip *gz = (struct mg_gzip *) c->gzip;
+  size_t n, ofs = c->send.len;
+  char tmp[10];
+  if (gz->started && c->send.len != gz->end) {
+    // Something was sent uncompressed after the previous chunk. Continuing
+    // would produce a corrupt stream that the client cannot decode
+    mg_error(c, "gzip: uncompressed data in a compressed response");
+    mg_http_gzip_free(c);
+    return;
+  }
+  mg_send(c, "00000000\r\n", 10);
+  n = gzip_write(c, buf, len, len == 0);
+  if (c->send.len >= ofs + 10 + n) {
+    mg_snprintf(tmp, sizeof(tmp), "%08lx", (unsigned long) n);
+    memcpy(c->send.buf + ofs, tmp, 8);
+  }
+  mg_send(c, "\r\n", 2);
+  gz->end = c->send.len;
+  if (len == 0) {
+    mg_send(c, "0\r\n\r\n", 5);
+    mg_http_gzip_free(c);
+  }
+}
+
+// Track compressed chunks leaving the send buffer, see gzip_chunk()
+static void gzip_sent(struct mg_connection *c, size_t n) {
+  struct mg_gzip *gz = (struct mg_gzip *) c->gzip;
+  gz->end = gz->end > n ? gz->end - n : 0;
+}
+
 static void mg_http_vprintf_chunk(struct mg_connection *c, const char *fmt,
                                   va_list ap) {
   char mem[256], *buf = mem;
   size_t len = mg_vasprintf(&buf, sizeof(mem), fmt, ap);
-  mg_printf(c, "%lx\r\n", (unsigned long) len);
-  mg_send(c, buf, len > 0 ? (size_t) len : 0);
-  mg_send(c, "\r\n", 2);
+  mg_http_write_chunk(c, buf, len);
   if (buf != mem) free(buf);
 }
 
@@ -1696,46 +3657,190 @@ void mg_http_printf_chunk(struct mg_connection *c, const char *fmt, ...) {
 }
 
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len) {
-  mg_printf(c, "%lx\r\n", (unsigned long) len);
-  mg_send(c, buf, len);
-  mg_send(c, "\r\n", 2);
+  if (c->gzip != NULL) {
+    gzip_chunk(c, buf, len);
+  } else {
+    mg_printf(c, "%lx\r\n", (unsigned long) len);
+    mg_send(c, buf, len);
+    mg_send(c, "\r\n", 2);
+  }
 }
 
+// Preformatted status lines, so that responses just copy them
 // clang-format off
-static const char *mg_http_status_code_str(int status_code) {
-  switch (status_code) {
-    case 100: return "Continue";
-    case 201: return "Created";
-    case 202: return "Accepted";
-    case 204: return "No Content";
-    case 206: return "Partial Content";
-    case 301: return "Moved Permanently";
-    case 302: return "Found";
-    case 304: return "Not Modified";
-    case 400: return "Bad Request";
-    case 401: return "Unauthorized";
-    case 403: return "Forbidden";
-    case 404: return "Not Found";
-    case 418: return "I'm a teapot";
-    case 500: return "Internal Server Error";
-    case 501: return "Not Implemented";
-    default: return "OK";
+static const struct mg_http_status {
+  int code;
+  struct mg_str line;
+} s_status_lines[] = {
+  {100, MG_C_STR("HTTP/1.1 100 Continue\r\n")},
+  {200, MG_C_STR("HTTP/1.1 200 OK\r\n")},
+  {201, MG_C_STR("HTTP/1.1 201 Created\r\n")},
+  {202, MG_C_STR("HTTP/1.1 202 Accepted\r\n")},
+  {204, MG_C_STR("HTTP/1.1 204 No Content\r\n")},
+  {206, MG_C_STR("HTTP/1.1 206 Partial Content\r\n")},
+  {301, MG_C_STR("HTTP/1.1 301 Moved Permanently\r\n")},
+  {302, MG_C_STR("HTTP/1.1 302 Found\r\n")},
+  {304, MG_C_STR("HTTP/1.1 304 Not Modified\r\n")},
+  {400, MG_C_STR("HTTP/1.1 400 Bad Request\r\n")},
+  {401, MG_C_STR("HTTP/1.1 401 Unauthorized\r\n")},
+  {403, MG_C_STR("HTTP/1.1 403 Forbidden\r\n")},
+  {404, MG_C_STR("HTTP/1.1 404 Not Found\r\n")},
+  {418, MG_C_STR("HTTP/1.1 418 I'm a teapot\r\n")},
+  {500, MG_C_STR("HTTP/1.1 500 Internal Server Error\r\n")},
+  {501, MG_C_STR("HTTP/1.1 501 Not Implemented\r\n")},
+};
+// clang-format on
+
+// Return status line for the given code. Unknown codes are formatted
+// into `buf`, with the "OK" reason
+static struct mg_str status_line(int code, char *buf, size_t len) {
+  size_t i, n = sizeof(s_status_lines) / sizeof(s_status_lines[0]);
+  for (i = 0; i < n; i++) {
+    if (s_status_lines[i].code == code) return s_status_lines[i].line;
+  }
+  return mg_str_n(buf, mg_snprintf(buf, len, "HTTP/1.1 %d OK\r\n", code));
+}
+
+// Convert days since epoch to a civil date, proleptic Gregorian calendar
+static void civil_date(int64_t days, int *y, unsigned *m, unsigned *d) {
+  int64_t z = days + 719468, era = (z >= 0 ? z : z - 146096) / 146097;
+  unsigned doe = (unsigned) (z - era * 146097);
+  unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (int) (yoe + era * 400 + (*m <= 2));
+}
+
+// Date header line, RFC9110 section 5.6.7. It is formatted at most once
+// per second
+static struct mg_str http_date(void) {
+  static const char *days[] = {"Thu", "Fri", "Sat", "Sun",
+                               "Mon", "Tue", "Wed"};
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  static char buf[48];
+  static size_t len;
+  static time_t last;
+  time_t now = time(NULL);
+  if (len == 0 || now != last) {
+    int64_t t = (int64_t) now, day = t / 86400, sec = t % 86400;
+    unsigned m, d;
+    int y;
+    if (sec < 0) sec += 86400, day--;
+    civil_date(day, &y, &m, &d);
+    len = mg_snprintf(buf, sizeof(buf),
+                      "Date: %s, %02u %s %d %02u:%02u:%02u GMT\r\n",
+                      days[((day % 7) + 7) % 7], d, months[m - 1], y,
+                      (unsigned) (sec / 3600), (unsigned) (sec / 60 % 60),
+                      (unsigned) (sec % 60));
+    last = now;
+  }
+  return mg_str_n(buf, len);
+}
+
+// Append a complete response to c->send: status line, headers, optional
+// Date, Content-Length and body. The output size is known upfront, so the
+// send buffer is resized at most once, and all parts are copied as is
+static void http_send(struct mg_connection *c, struct mg_str sl,
+                      struct mg_str hdrs, bool date, const void *body,
+                      size_t len) {
+  char cl[48];
+  size_t n = 16, total, need;
+  struct mg_str dl = date ? http_date() : mg_str_n("", 0);
+  unsigned char *p;
+  memcpy(cl, "Content-Length: ", n);
+  n += mg_lld(cl + n, (int64_t) len, false, false);
+  memcpy(cl + n, "\r\n\r\n", 4);
+  n += 4;
+  total = sl.len + hdrs.len + dl.len + n + len;
+  need = c->send.len + total;
+  if (need > c->send.size &&
+      !mg_iobuf_resize(&c->send, need + MG_IO_SIZE - need % MG_IO_SIZE)) {
+    mg_error(c, "OOM");
+    return;
+  }
+  p = c->send.buf + c->send.len;
+  memcpy(p, sl.ptr, sl.len), p += sl.len;
+  if (hdrs.len > 0) memcpy(p, hdrs.ptr, hdrs.len), p += hdrs.len;
+  if (dl.len > 0) memcpy(p, dl.ptr, dl.len), p += dl.len;
+  memcpy(p, cl, n), p += n;
+  if (len > 0) memcpy(p, body, len);
+  c->send.len += total;
+}
+
+// 1xx, 204 and 304 responses have no body, RFC 9112 6.3
+static bool has_body(struct mg_str sl) {
+  int code = sl.len > 12 ? atoi(sl.ptr + 9) : 0;
+  return code >= 200 && code != 204 && code != 304;
+}
+
+static void http_reply(struct mg_connection *c, struct mg_str sl,
+                       struct mg_str hdrs, bool date, const char *buf,
+                       size_t len) {
+  if (c->gzip != NULL && len > 0 && has_body(sl) &&
+      len >= ((struct mg_gzip *) c->gzip)->min_size) {
+    // Compress directly into the send buffer, then set the Content-Length
+    size_t n, ofs;
+    char tmp[10];
+    mg_printf(c,
+              "%.*s%.*s%.*sContent-Encoding: gzip\r\n"
+              "Vary: Accept-Encoding\r\nContent-Length:           \r\n\r\n",
+              (int) sl.len, sl.ptr, (int) hdrs.len, hdrs.ptr,
+              date ? (int) http_date().len : 0, date ? http_date().ptr : "");
+    ofs = c->send.len;
+    n = gzip_write(c, buf, len, true);
+    if (c->send.len >= ofs + n && ofs >= 14) {
+      size_t k = mg_snprintf(tmp, sizeof(tmp), "%lu", (unsigned long) n);
+      memcpy(c->send.buf + ofs - 14, tmp, k);
+    }
+  } else {
+    http_send(c, sl, hdrs, date, buf, len);
   }
+  mg_http_gzip_free(c);
+}
+
+static void http_vreply(struct mg_connection *c, int code,
+                        const char *headers, const char *fmt, va_list *ap) {
+  char mem[256], *buf = mem, tmp[32];
+  size_t len = mg_vasprintf(&buf, sizeof(mem), fmt, *ap);
+  http_reply(c, status_line(code, tmp, sizeof(tmp)),
+             mg_str(headers == NULL ? "" : headers), false, buf, len);
+  if (buf != mem) free(buf);
+}
+
+bool mg_http_tmpl_init(struct mg_http_tmpl *t, int code, const char *headers,
+                       bool date) {
+  char tmp[32];
+  struct mg_str sl = status_line(code, tmp, sizeof(tmp));
+  size_t n = headers == NULL ? 0 : strlen(headers);
+  t->date = date;
+  t->len = 0;
+  if ((t->buf = (char *) calloc(1, sl.len + n + 1)) == NULL) return false;
+  memcpy(t->buf, sl.ptr, sl.len);
+  if (n > 0) memcpy(t->buf + sl.len, headers, n);
+  t->len = sl.len + n;
+  return true;
+}
+
+void mg_http_tmpl_free(struct mg_http_tmpl *t) {
+  free(t->buf);
+  t->buf = NULL, t->len = 0;
+}
+
+void mg_http_tmpl_send(struct mg_connection *c, const struct mg_http_tmpl *t,
+                       const void *body, size_t len) {
+  http_reply(c, mg_str_n(t->buf, t->len), mg_str_n("", 0), t->date,
+             (const char *) body, len);
 }
-// clang-format on
 
 void mg_http_reply(struct mg_connection *c, int code, const char *headers,
                    const char *fmt, ...) {
-  char mem[256], *buf = mem;
   va_list ap;
-  size_t len;
   va_start(ap, fmt);
-  len = mg_vasprintf(&buf, sizeof(mem), fmt, ap);
+  http_vreply(c, code, headers, fmt, &ap);
   va_end(ap);
-  mg_printf(c, "HTTP/1.1 %d %s\r\n%sContent-Length: %d\r\n\r\n", code,
-            mg_http_status_code_str(code), headers == NULL ? "" : headers, len);
-  mg_send(c, buf, len > 0 ? len : 0);
-  if (buf != mem) free(buf);
 }
 
 static void http_cb(struct mg_connection *, int, void *, void *);
@@ -1751,6 +3856,40 @@ char *mg_http_etag(char *buf, size_t len, size_t size, time_t mtime) {
   return buf;
 }
 
+// A response to a pipelined request. Responses are queued until responses
+// to all previous requests are sent. A streamed response, like a static
+// file, is parked with its headers, and its handler is resumed in turn
+struct mg_http_resp {
+  struct mg_http_resp *next;
+  unsigned long id;          // Request ID
+  struct mg_iobuf buf;       // Response data
+  struct mg_http_stream st;  // Parked streamed response
+  bool deferred;             // Response is deferred with mg_http_defer()
+  bool done;                 // Response is complete
+};
+
+// Response queue, stored in c->pipeline
+struct pipeline {
+  struct mg_http_resp *head;  // Oldest first
+  struct mg_http_resp *cur;   // Request being handled
+  unsigned long last_id;      // ID of the last queued request
+  size_t count;               // Number of queued responses
+  bool stalled;               // Queue is full, requests are not parsed
+};
+
+static void pipeline_flush(struct mg_connection *c);
+
+// Streamed response is sent. Send responses queued behind it, and handle
+// pipelined requests received meanwhile
+static void http_resume(struct mg_connection *c) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  pipeline_flush(c);
+  if (c->pfn == http_cb && c->recv.len > 0 &&
+      (pl == NULL || pl->cur == NULL)) {
+    http_cb(c, MG_EV_READ, NULL, NULL);
+  }
+}
+
 static void static_cb(struct mg_connection *c, int ev, void *ev_data,
                       void *fn_data) {
   if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
@@ -1763,13 +3902,110 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data,
     n = fd->fs->rd(fd->fd, c->send.buf + c->send.len, space);
     c->send.len += n;
     *cl -= n;
-    if (n == 0) restore_http_cb(c);
+    if (n == 0) restore_http_cb(c), http_resume(c);
   } else if (ev == MG_EV_CLOSE) {
     restore_http_cb(c);
   }
   (void) ev_data;
 }
 
+// State of mg_http_json_stream(), stored in c->pfn_data
+struct json_stream {
+  struct mg_json_writer w;  // Writer, its output goes to json_write()
+  struct mg_connection *c;  // Connection to write to
+  mg_http_json_fn fn;       // Writes the next piece of the document
+  void *fn_data;            // Its parameter
+  size_t ofs;               // Open chunk offset in c->send
+  bool chunk;               // True if a chunk is open
+};
+
+// Output goes straight into c->send, after a fixed width chunk header that
+// is filled in when the chunk is closed
+static void json_write(const char *buf, size_t len, void *param) {
+  struct json_stream *js = (struct json_stream *) param;
+  struct mg_connection *c = js->c;
+  if (buf == NULL) return;  // Size hint
+  if (!js->chunk) {
+    js->ofs = c->send.len;
+    js->chunk = mg_send(c, "00000000\r\n", 10);
+  }
+  if (js->chunk) mg_write_iobuf(buf, len, &c->send);
+}
+
+static void json_chunk_end(struct json_stream *js) {
+  struct mg_connection *c = js->c;
+  size_t n;
+  if (!js->chunk) return;
+  js->chunk = false;
+  n = c->send.len - js->ofs - 10;
+  if (n == 0) {
+    c->send.len = js->ofs;  // Empty chunk would terminate the response
+  } else if (c->gzip != NULL) {
+    // Compressor output goes to c->send too, so move raw data out of it
+    char *tmp = (char *) malloc(n);
+    if (tmp != NULL) memcpy(tmp, c->send.buf + js->ofs + 10, n);
+    c->send.len = js->ofs;
+    if (tmp != NULL) mg_http_write_chunk(c, tmp, n);
+    free(tmp);
+  } else {
+    char tmp[10];
+    mg_snprintf(tmp, sizeof(tmp), "%08lx", (unsigned long) n);
+    memcpy(c->send.buf + js->ofs, tmp, 8);
+    mg_send(c, "\r\n", 2);
+  }
+}
+
+static void json_done(struct mg_connection *c, struct json_stream *js) {
+  free(js);
+  c->pfn_data = NULL;
+  restore_http_cb(c);
+}
+
+// Generate the document while the send buffer is short, and continue when
+// it is sent. Each round becomes one chunk
+static void json_cb(struct mg_connection *c, int ev, void *ev_data,
+                    void *fn_data) {
+  struct json_stream *js = (struct json_stream *) fn_data;
+  if (ev == MG_EV_WRITE && c->gzip != NULL) {
+    gzip_sent(c, (size_t) *(long *) ev_data);
+  }
+  if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+    bool more = true;
+    while (more && !js->w.failed && c->send.len < MG_IO_SIZE) {
+      more = js->fn(&js->w, js->fn_data);
+    }
+    json_chunk_end(js);
+    if (js->w.failed) {
+      mg_error(c, "JSON nesting is too deep");
+    } else if (!more) {
+      mg_http_write_chunk(c, "", 0);
+      json_done(c, js), http_resume(c);
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    js->fn(NULL, js->fn_data);  // Document is not complete, let it clean up
+    json_done(c, js);
+  }
+}
+
+bool mg_http_json_stream(struct mg_connection *c, int code,
+                         const char *headers, mg_http_json_fn fn,
+                         void *fn_data) {
+  struct json_stream *js = (struct json_stream *) calloc(1, sizeof(*js));
+  char tmp[32];
+  struct mg_str sl = status_line(code, tmp, sizeof(tmp));
+  if (js == NULL) {
+    mg_http_reply(c, 500, "", "OOM\n");
+    return false;
+  }
+  mg_printf(c, "%.*s%s%sTransfer-Encoding: chunked\r\n\r\n", (int) sl.len,
+            sl.ptr, headers == NULL ? "" : headers,
+            c->gzip == NULL ? "" : "Content-Encoding: gzip\r\n");
+  mg_json_writer_init(&js->w, json_write, js);
+  js->c = c, js->fn = fn, js->fn_data = fn_data;
+  c->pfn = json_cb, c->pfn_data = js;
+  return true;
+}
+
 // Known mime types. Keep it outside guess_content_type() function, since
 // some environments don't like it defined there.
 // clang-format off
@@ -1830,24 +4066,143 @@ static struct mg_str guess_content_type(struct mg_str path, const char *extra) {
   return mg_str("text/plain; charset=utf-8");
 }
 
-static int getrange(struct mg_str *s, int64_t *a, int64_t *b) {
-  size_t i, numparsed = 0;
-  // MG_INFO(("%.*s", (int) s->len, s->ptr));
-  for (i = 0; i + 6 < s->len; i++) {
-    if (memcmp(&s->ptr[i], "bytes=", 6) == 0) {
-      struct mg_str p = mg_str_n(s->ptr + i + 6, s->len - i - 6);
-      if (p.len > 0 && p.ptr[0] >= '0' && p.ptr[0] <= '9') numparsed++;
-      *a = mg_to64(p);
-      // MG_INFO(("PPP [%.*s] %d", (int) p.len, p.ptr, numparsed));
-      while (p.len && p.ptr[0] >= '0' && p.ptr[0] <= '9') p.ptr++, p.len--;
-      if (p.len && p.ptr[0] == '-') p.ptr++, p.len--;
-      *b = mg_to64(p);
-      if (p.len > 0 && p.ptr[0] >= '0' && p.ptr[0] <= '9') numparsed++;
-      // MG_INFO(("PPP [%.*s] %d", (int) p.len, p.ptr, numparsed));
-      break;
+// Parse Range header like "bytes=0-99,200-,-50" into pairs of first and last
+// byte offsets. Unsatisfiable ranges are skipped. Return number of ranges, or
+// -1 if the header is malformed or has too many ranges, and must be ignored
+static int getranges(struct mg_str *s, int64_t size, int64_t *r) {
+  struct mg_str k, v, p;
+  int n = 0, total = 0;
+  if (s->len < 6 || memcmp(s->ptr, "bytes=", 6) != 0) return -1;
+  p = mg_str_n(s->ptr + 6, s->len - 6);
+  while (mg_commalist(&p, &k, &v)) {
+    size_t i = 0, j;
+    int64_t a, b;
+    k = mg_strstrip(k);
+    while (i < k.len && k.ptr[i] >= '0' && k.ptr[i] <= '9') i++;
+    if (i >= k.len || k.ptr[i] != '-' || v.len > 0) return -1;
+    for (j = i + 1; j < k.len && k.ptr[j] >= '0' && k.ptr[j] <= '9';) j++;
+    if (j < k.len || (i == 0 && j == i + 1)) return -1;
+    if (++total > MG_MAX_HTTP_RANGES) return -1;
+    a = mg_to64(mg_str_n(k.ptr, i));
+    b = mg_to64(mg_str_n(k.ptr + i + 1, j - i - 1));
+    if (i == 0) {  // Suffix range "-N" - last N bytes
+      a = b == 0 ? size : b > size ? 0 : size - b;
+      b = size - 1;
+    } else if (j == i + 1) {  // Range "N-" - till the end
+      b = size - 1;
+    }
+    if (a <= b && b < size) r[n * 2] = a, r[n * 2 + 1] = b, n++;
+  }
+  return n;
+}
+
+// State of the multipart/byteranges response
+struct byteranges {
+  struct mg_fd *fd;                         // File being served
+  const char *mime;                         // Content type of the parts
+  int64_t size;                             // File size
+  int64_t left;                             // Bytes left in the current part
+  int i, n;                                 // Current part, number of parts
+  char boundary[20];                        // Multipart boundary
+  int64_t ranges[MG_MAX_HTTP_RANGES * 2];  // First and last offsets
+};
+
+static void nop(char ch, void *param) {
+  (void) ch, (void) param;
+}
+
+// Print header of the i-th part, or the closing delimiter if i == n
+static size_t part_hdr(void (*fn)(char, void *), void *param,
+                       struct byteranges *br, int i) {
+  if (i >= br->n) return mg_rprintf(fn, param, "\r\n--%s--\r\n", br->boundary);
+  return mg_rprintf(fn, param,
+                    "%s--%s\r\nContent-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    i == 0 ? "" : "\r\n", br->boundary, br->mime,
+                    br->ranges[i * 2], br->ranges[i * 2 + 1], br->size);
+}
+
+static void byteranges_done(struct mg_connection *c) {
+  struct byteranges *br = (struct byteranges *) c->pfn_data;
+  c->pfn_data = br->fd;
+  free(br);
+  restore_http_cb(c);
+}
+
+// Stream parts one after another, reading file data straight into the
+// send buffer, like static_cb() does
+static void byteranges_cb(struct mg_connection *c, int ev, void *ev_data,
+                          void *fn_data) {
+  struct byteranges *br = (struct byteranges *) fn_data;
+  if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+    if (c->send.size < MG_IO_SIZE) mg_iobuf_resize(&c->send, MG_IO_SIZE);
+    while (c->send.len < c->send.size && (br->left > 0 || br->i <= br->n)) {
+      size_t n, space = c->send.size - c->send.len;
+      if (br->left == 0) {
+        part_hdr(mg_putchar_iobuf, &c->send, br, br->i);
+        if (br->i < br->n) {
+          br->fd->fs->sk(br->fd->fd, (size_t) br->ranges[br->i * 2]);
+          br->left = br->ranges[br->i * 2 + 1] - br->ranges[br->i * 2] + 1;
+        }
+        br->i++;
+        continue;
+      }
+      if ((int64_t) space > br->left) space = (size_t) br->left;
+      n = br->fd->fs->rd(br->fd->fd, c->send.buf + c->send.len, space);
+      if (n == 0) {  // File has been truncated, give up
+        c->is_draining = 1;
+        br->left = 0, br->i = br->n + 1;
+        break;
+      }
+      c->send.len += n;
+      br->left -= (int64_t) n;
     }
+    if (br->left == 0 && br->i > br->n) byteranges_done(c), http_resume(c);
+  } else if (ev == MG_EV_CLOSE) {
+    byteranges_done(c);
+  }
+  (void) ev_data;
+}
+
+// Multipart/byteranges response for several ranges. Part headers are known
+// upfront, so Content-Length is too, and parts are streamed from the file
+static void serve_byteranges(struct mg_connection *c,
+                             struct mg_http_message *hm, struct mg_fd *fd,
+                             int64_t *ranges, int n, int64_t size,
+                             struct mg_str mime, const char *etag,
+                             const struct mg_http_serve_opts *opts) {
+  struct byteranges *br =
+      (struct byteranges *) calloc(1, sizeof(*br) + mime.len + 1);
+  int64_t cl = 0;
+  int i;
+  if (br == NULL) {
+    mg_http_reply(c, 500, opts->extra_headers, "OOM\n");
+    mg_fs_close(fd);
+    return;
+  }
+  br->fd = fd, br->size = size, br->n = n;
+  br->mime = (char *) (br + 1);
+  memcpy((char *) (br + 1), mime.ptr, mime.len);
+  memcpy(br->ranges, ranges, (size_t) n * 2 * sizeof(ranges[0]));
+  mg_random_str(br->boundary, sizeof(br->boundary));
+  for (i = 0; i <= n; i++) cl += (int64_t) part_hdr(nop, NULL, br, i);
+  for (i = 0; i < n; i++) cl += ranges[i * 2 + 1] - ranges[i * 2] + 1;
+  mg_printf(c,
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Type: multipart/byteranges; boundary=%s\r\n"
+            "Etag: %s\r\n"
+            "Content-Length: %lld\r\n"
+            "%s\r\n",
+            br->boundary, etag, cl,
+            opts->extra_headers ? opts->extra_headers : "");
+  if (mg_vcasecmp(&hm->method, "HEAD") == 0) {
+    c->is_draining = 1;
+    mg_fs_close(fd);
+    free(br);
+  } else {
+    c->pfn = byteranges_cb;
+    c->pfn_data = br;
   }
-  return (int) numparsed;
 }
 
 void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
@@ -1890,38 +4245,43 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
     mg_printf(c, "HTTP/1.1 304 Not Modified\r\n%sContent-Length: 0\r\n\r\n",
               opts->extra_headers ? opts->extra_headers : "");
   } else {
-    int n, status = 200;
-    char range[100];
-    int64_t r1 = 0, r2 = 0, cl = (int64_t) size;
+    int n = -1, status = 200;
+    char range[100], sbuf[32];
+    int64_t ranges[MG_MAX_HTTP_RANGES * 2], cl = (int64_t) size;
+    struct mg_str sl;
 
-    // Handle Range header
+    // Handle Range header. If-Range, if present, must match the current Etag
     struct mg_str *rh = mg_http_get_header(hm, "Range");
+    struct mg_str *ir = mg_http_get_header(hm, "If-Range");
     range[0] = '\0';
-    if (rh != NULL && (n = getrange(rh, &r1, &r2)) > 0 && r1 >= 0 && r2 >= 0) {
-      // If range is specified like "400-", set second limit to content len
-      if (n == 1) r2 = cl - 1;
-      if (r1 > r2 || r2 >= cl) {
-        status = 416;
-        cl = 0;
-        mg_snprintf(range, sizeof(range), "Content-Range: bytes */%lld\r\n",
-                    (int64_t) size);
-      } else {
-        status = 206;
-        cl = r2 - r1 + 1;
-        mg_snprintf(range, sizeof(range),
-                    "Content-Range: bytes %lld-%lld/%lld\r\n", r1, r1 + cl - 1,
-                    (int64_t) size);
-        fs->sk(fd->fd, (size_t) r1);
-      }
+    if (rh != NULL && (ir == NULL || mg_vcasecmp(ir, etag) == 0)) {
+      n = getranges(rh, cl, ranges);
+    }
+    if (n > 1) {
+      serve_byteranges(c, hm, fd, ranges, n, cl, mime, etag, opts);
+      return;
+    } else if (n == 0) {
+      status = 416;
+      cl = 0;
+      mg_snprintf(range, sizeof(range), "Content-Range: bytes */%lld\r\n",
+                  (int64_t) size);
+    } else if (n == 1) {
+      status = 206;
+      cl = ranges[1] - ranges[0] + 1;
+      mg_snprintf(range, sizeof(range),
+                  "Content-Range: bytes %lld-%lld/%lld\r\n", ranges[0],
+                  ranges[1], (int64_t) size);
+      fs->sk(fd->fd, (size_t) ranges[0]);
     }
+    sl = status_line(status, sbuf, sizeof(sbuf));
     mg_printf(c,
-              "HTTP/1.1 %d %s\r\n"
+              "%.*s"
               "Content-Type: %.*s\r\n"
               "Etag: %s\r\n"
               "Content-Length: %llu\r\n"
               "%s%s%s\r\n",
-              status, mg_http_status_code_str(status), (int) mime.len, mime.ptr,
-              etag, cl, gzip ? "Content-Encoding: gzip\r\n" : "", range,
+              (int) sl.len, sl.ptr, (int) mime.len, mime.ptr, etag, cl,
+              gzip ? "Content-Encoding: gzip\r\n" : "", range,
               opts->extra_headers ? opts->extra_headers : "");
     if (mg_vcasecmp(&hm->method, "HEAD") == 0) {
       c->is_draining = 1;
@@ -2194,45 +4554,51 @@ static size_t get_chunk_length(const char *buf, size_t len, size_t *ll) {
 }
 
 // Walk through all chunks in the chunked body. For each chunk, fire
-// an MG_EV_HTTP_CHUNK event.
+// an MG_EV_HTTP_CHUNK event, passing chunk data in place. Chunks deleted by
+// the user are cut out of the receive buffer afterwards, in one pass
 static bool walkchunks(struct mg_connection *c, struct mg_http_message *hm,
                        size_t reqlen) {
-  size_t off = 0, bl, ll;
-  while (off + reqlen < c->recv.len) {
-    char *buf = (char *) &c->recv.buf[reqlen];
-    size_t memo = c->recv.len;
-    size_t cl = get_chunk_length(&buf[off], memo - reqlen - off, &ll);
-    // MG_INFO(("len %zu off %zu cl %zu ll %zu", len, off, cl, ll));
-    if (cl == 0) break;
+  char *buf = (char *) &c->recv.buf[reqlen];
+  size_t off = 0, w = 0, bl = 0, cl, ll, len = c->recv.len - reqlen;
+  bool deleted = false, last = false;
+  while (off < len && !last) {
+    if ((cl = get_chunk_length(&buf[off], len - off, &ll)) == 0) break;
     hm->chunk = mg_str_n(&buf[off + ll], cl < ll + 2 ? 0 : cl - ll - 2);
+    c->is_chunk_del = 0;  // mg_http_delete_chunk() sets it
     mg_call(c, MG_EV_HTTP_CHUNK, hm);
-    // Increase offset only if user has not deleted this chunk
-    if (memo == c->recv.len) off += cl;
-    if (cl <= 5) {
-      // Zero chunk - last one. Prepare body - cut off chunk lengths
-      if (memo != c->recv.len) return true;  // Tell caller to cleanup
-      off = bl = 0;
-      while (off + reqlen < c->recv.len) {
-        char *buf2 = (char *) &c->recv.buf[reqlen];
-        size_t memo2 = c->recv.len;
-        size_t cl2 = get_chunk_length(&buf2[off], memo2 - reqlen - off, &ll);
-        size_t n = cl2 < ll + 2 ? 0 : cl2 - ll - 2;
-        memmove(buf2 + bl, buf2 + off + ll, n);
-        bl += n;
-        off += cl2;
-        if (cl2 <= 5) break;
-      }
-      // MG_INFO(("BL->%d del %d off %d", (int) bl, (int) del, (int) off));
-      c->recv.len -= off - bl;
-      // Set message length to indicate we've received
-      // everything, to fire MG_EV_HTTP_MSG
-      hm->message.len = bl + reqlen;
-      hm->body.len = bl;
-      // If user was deleting chunks, send nothing
-      break;
+    deleted = c->is_chunk_del;
+    c->is_chunk_del = 0;
+    if (!deleted) {  // Keep the chunk, moving it over the deleted ones
+      if (w != off) memmove(buf + w, buf + off, cl);
+      w += cl;
     }
+    off += cl;
+    last = cl <= 5;  // Zero chunk - last one
+  }
+  if (last && !deleted) {
+    // Prepare body - cut off chunk lengths
+    size_t i = 0;
+    while (i < w) {
+      size_t n;
+      cl = get_chunk_length(&buf[i], w - i, &ll);
+      n = cl < ll + 2 ? 0 : cl - ll - 2;
+      memmove(buf + bl, buf + i + ll, n);
+      bl += n;
+      i += cl;
+    }
+    // Set message length to indicate we've received
+    // everything, to fire MG_EV_HTTP_MSG
+    hm->message.len = bl + reqlen;
+    hm->body.len = bl;
+  } else {
+    bl = w;
   }
-  return false;
+  // Compact the buffer, moving unprocessed data right after what's kept
+  if (bl != off) {
+    memmove(buf + bl, buf + off, len - off);
+    c->recv.len -= off - bl;
+  }
+  return last && deleted;  // Tell caller to cleanup
 }
 
 static bool mg_is_chunked(struct mg_http_message *hm) {
@@ -2242,17 +4608,15 @@ static bool mg_is_chunked(struct mg_http_message *hm) {
 }
 
 void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm) {
-  struct mg_str ch = hm->chunk;
-  const char *end = (char *) &c->recv.buf[c->recv.len], *ce;
-  bool chunked = mg_is_chunked(hm);
-  if (chunked) {
-    ch.len += 4, ch.ptr -= 2;  // \r\n before and after the chunk
-    while (ch.ptr > hm->body.ptr && *ch.ptr != '\n') ch.ptr--, ch.len++;
+  if (mg_is_chunked(hm)) {
+    c->is_chunk_del = 1;  // Just mark it, walkchunks() does the deletion
+  } else {
+    struct mg_str ch = hm->chunk;
+    const char *end = (char *) &c->recv.buf[c->recv.len], *ce = &ch.ptr[ch.len];
+    if (ce < end) memmove((void *) ch.ptr, ce, (size_t) (end - ce));
+    c->recv.len -= ch.len;
+    if (c->pfn_data != NULL) c->pfn_data = (char *) c->pfn_data - ch.len;
   }
-  ce = &ch.ptr[ch.len];
-  if (ce < end) memmove((void *) ch.ptr, ce, (size_t) (end - ce));
-  c->recv.len -= ch.len;
-  if (c->pfn_data != NULL) c->pfn_data = (char *) c->pfn_data - ch.len;
 }
 
 long mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
@@ -2295,12 +4659,186 @@ int mg_http_status(const struct mg_http_message *hm) {
   return atoi(hm->uri.ptr);
 }
 
+static struct mg_http_resp *pipeline_add(struct pipeline *pl) {
+  struct mg_http_resp *r = (struct mg_http_resp *) calloc(1, sizeof(*r));
+  if (r != NULL) {
+    r->id = ++pl->last_id;
+    LIST_ADD_TAIL(struct mg_http_resp, &pl->head, r);
+    pl->count++;
+  }
+  return r;
+}
+
+// Send complete responses from the head of the queue. A parked streamed
+// response takes over the connection, the rest waits until it is sent
+static void pipeline_flush(struct mg_connection *c) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  struct mg_http_resp *r;
+  if (pl != NULL && (r = pl->cur) != NULL) {
+    if (!r->deferred) r->done = true;
+    pl->cur = NULL;
+  }
+  while (pl != NULL && (r = pl->head) != NULL && r->done &&
+         c->pfn == http_cb) {
+    mg_send(c, r->buf.buf, r->buf.len);
+    if (r->st.pfn != NULL) mg_http_unpark(c, &r->st);
+    pl->head = r->next;
+    pl->count--;
+    mg_iobuf_free(&r->buf);
+    free(r);
+  }
+}
+
+// Detach a streamed response, like a static file, from the connection,
+// so that it is sent later. Return false if the response is not streamed
+bool mg_http_park(struct mg_connection *c, struct mg_http_stream *st) {
+  if (c->pfn != static_cb && c->pfn != byteranges_cb && c->pfn != json_cb) {
+    return false;
+  }
+  st->pfn = c->pfn, st->pfn_data = c->pfn_data;
+  memcpy(&st->left, c->label, sizeof(st->left));
+  c->pfn = http_cb, c->pfn_data = NULL;
+  return true;
+}
+
+// Attach a parked streamed response back, it continues on MG_EV_WRITE
+void mg_http_unpark(struct mg_connection *c, struct mg_http_stream *st) {
+  c->pfn = st->pfn, c->pfn_data = st->pfn_data;
+  memcpy(c->label, &st->left, sizeof(st->left));
+  st->pfn = NULL;
+}
+
+// Read more of a parked streamed response into `io`, which grows to at
+// most `max` bytes. Return false when the response is complete
+bool mg_http_pull(struct mg_connection *c, struct mg_http_stream *st,
+                  struct mg_iobuf *io, size_t max) {
+  struct mg_iobuf send = c->send, recv = c->recv;
+  mg_event_handler_t pfn = c->pfn;
+  void *pfn_data = c->pfn_data;
+  char label[sizeof(c->label)];
+  if (st->pfn == NULL) return false;
+  memcpy(label, c->label, sizeof(label));
+  // The response sees its own send buffer, and nothing to parse on resume
+  c->send = *io;
+  memset(&c->recv, 0, sizeof(c->recv));
+  if (c->send.size < max) mg_iobuf_resize(&c->send, max);
+  mg_http_unpark(c, st);
+  c->pfn(c, MG_EV_POLL, NULL, c->pfn_data);
+  mg_http_park(c, st);
+  *io = c->send;
+  c->send = send, c->recv = recv;
+  c->pfn = pfn, c->pfn_data = pfn_data;
+  memcpy(c->label, label, sizeof(label));
+  return st->pfn != NULL;
+}
+
+// Free a parked streamed response, closing its file
+void mg_http_stream_free(struct mg_connection *c, struct mg_http_stream *st) {
+  mg_event_handler_t pfn = c->pfn;
+  void *pfn_data = c->pfn_data;
+  if (st->pfn == NULL) return;
+  mg_http_unpark(c, st);
+  c->pfn(c, MG_EV_CLOSE, NULL, c->pfn_data);
+  c->pfn = pfn, c->pfn_data = pfn_data;
+}
+
+// Handle request. If a response to the previous request is pending, capture
+// the response into the queue. Streamed responses are parked, not read
+static void http_msg(struct mg_connection *c, struct mg_http_message *hm) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  struct mg_http_resp *r = NULL;
+  if (pl == NULL || pl->head == NULL || (r = pipeline_add(pl)) == NULL) {
+    mg_call(c, MG_EV_HTTP_MSG, hm);
+  } else {
+    struct mg_iobuf send = c->send;
+    memset(&c->send, 0, sizeof(c->send));
+    pl->cur = r;
+    mg_call(c, MG_EV_HTTP_MSG, hm);
+    mg_http_park(c, &r->st);
+    r->buf = c->send, c->send = send;
+  }
+  pipeline_flush(c);
+}
+
+unsigned long mg_http_defer(struct mg_connection *c) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  if (pl == NULL) {
+    if ((pl = (struct pipeline *) calloc(1, sizeof(*pl))) == NULL) return 0;
+    c->pipeline = pl;
+    c->pfree = http_free;
+  }
+  if (pl->cur == NULL && (pl->cur = pipeline_add(pl)) == NULL) return 0;
+  pl->cur->deferred = true;
+  return pl->cur->id;
+}
+
+void mg_http_respond(struct mg_connection *c, unsigned long id, int code,
+                     const char *headers, const char *fmt, ...) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  struct mg_http_resp *r = pl == NULL ? NULL : pl->head;
+  va_list ap;
+  while (r != NULL && r->id != id) r = r->next;
+  if (r == NULL || r->done) {
+    MG_ERROR(("%lu: no pending response %lu", c->id, id));
+  } else if (r == pl->cur) {
+    // Called from the handler of that request, c->send is the right buffer
+    va_start(ap, fmt);
+    http_vreply(c, code, headers, fmt, &ap);
+    va_end(ap);
+    r->deferred = false;
+  } else {
+    struct mg_iobuf send = c->send;
+    c->send = r->buf;
+    va_start(ap, fmt);
+    http_vreply(c, code, headers, fmt, &ap);
+    va_end(ap);
+    r->buf = c->send, c->send = send;
+    r->done = true;
+    pipeline_flush(c);
+  }
+}
+
+void mg_http_pipeline_free(struct mg_connection *c) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  struct mg_http_resp *r;
+  if (pl == NULL) return;
+  while ((r = pl->head) != NULL) {
+    pl->head = r->next;
+    mg_http_stream_free(c, &r->st);
+    mg_iobuf_free(&r->buf);
+    free(r);
+  }
+  free(pl);
+  c->pipeline = NULL;
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
-  if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  if (ev == MG_EV_WRITE && c->gzip != NULL) {
+    gzip_sent(c, (size_t) *(long *) evd);
+  }
+  if (ev == MG_EV_POLL && pl != NULL && pl->stalled &&
+      pl->count < MG_MAX_HTTP_PIPELINE) {
+    pl->stalled = false;  // Queue has room, handle remaining requests
+    http_cb(c, MG_EV_READ, evd, fnd);
+  } else if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
     struct mg_http_message hm;
     while (c->recv.buf != NULL && c->recv.len > 0) {
-      int n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
-      bool is_chunked = n > 0 && mg_is_chunked(&hm);
+      int n;
+      bool is_chunked;
+#if MG_ENABLE_HTTP2
+      if (c->is_accepted && ev == MG_EV_READ && c->pfn_data == NULL &&
+          mg_http2_upgrade(c)) {
+        break;
+      }
+#endif
+      if ((pl = (struct pipeline *) c->pipeline) != NULL &&
+          pl->count >= MG_MAX_HTTP_PIPELINE && ev == MG_EV_READ) {
+        pl->stalled = true;
+        break;
+      }
+      n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
+      is_chunked = n > 0 && mg_is_chunked(&hm);
       if (ev == MG_EV_CLOSE) {
         hm.message.len = c->recv.len;
         hm.body.len = hm.message.len - (size_t) (hm.body.ptr - hm.message.ptr);
@@ -2316,8 +4854,9 @@ static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
         mg_error(c, "HTTP parse:\n%.*s", (int) c->recv.len, c->recv.buf);
         break;
       } else if (n > 0 && (size_t) c->recv.len >= hm.message.len) {
-        mg_call(c, MG_EV_HTTP_MSG, &hm);
+        http_msg(c, &hm);
         mg_iobuf_del(&c->recv, 0, hm.message.len);
+        if (c->pfn != http_cb) break;  // Response is streamed, or upgraded
       } else {
         if (n > 0 && !is_chunked) {
           hm.chunk =
@@ -2341,6 +4880,190 @@ static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
   (void) evd;
 }
 
+// A request waiting for a pooled connection
+struct mg_http_pool_req {
+  struct mg_http_pool_req *next;
+  mg_event_handler_t fn;  // User's event handler
+  void *fn_data;          // User's event handler data
+  char *url;              // Stored right after this struct
+};
+
+// State of a pooled connection, stored in c->fn_data
+struct pconn {
+  struct mg_http_pool *pool;  // Pool this connection belongs to, or NULL
+  mg_event_handler_t fn;      // Current request's handler. NULL when idle
+  void *fn_data;              // Current request's handler data
+  uint64_t idle_since;        // When the connection became idle
+  bool is_tls;                // Pool initialises TLS for https:// URLs
+  bool keep;                  // Response allows keep-alive
+  bool done;                  // Response is received
+  bool connect;               // Reused connection, fire MG_EV_CONNECT
+  char *key;                  // "scheme:host:port". Stored after this struct
+};
+
+static void pool_cb(struct mg_connection *, int, void *, void *);
+
+static size_t pool_key(const char *url, char *buf, size_t len) {
+  struct mg_str host = mg_url_host(url);
+  return mg_snprintf(buf, len, "%d:%.*s:%u", mg_url_is_ssl(url) ? 1 : 0,
+                     (int) host.len, host.ptr, (unsigned) mg_url_port(url));
+}
+
+static struct mg_http_pool_req *pool_dequeue(struct mg_http_pool *pool,
+                                             const char *key) {
+  struct mg_http_pool_req **p = &pool->queue, *r;
+  char buf[300];
+  for (r = *p; r != NULL; p = &r->next, r = r->next) {
+    pool_key(r->url, buf, sizeof(buf));
+    if (strcmp(buf, key) == 0) {
+      *p = r->next;
+      return r;
+    }
+  }
+  return NULL;
+}
+
+static struct mg_connection *pool_new(struct mg_http_pool *pool,
+                                      const char *url, mg_event_handler_t fn,
+                                      void *fn_data) {
+  size_t n = pool_key(url, NULL, 0);
+  struct pconn *pc = (struct pconn *) calloc(1, sizeof(*pc) + n + 1);
+  struct mg_connection *c = NULL;
+  if (pc != NULL) {
+    pc->pool = pool, pc->fn = fn, pc->fn_data = fn_data;
+    pc->is_tls = mg_url_is_ssl(url) != 0;
+    pc->key = (char *) (pc + 1);
+    pool_key(url, pc->key, n + 1);
+    if ((c = mg_http_connect(pool->mgr, url, pool_cb, pc)) == NULL) free(pc);
+  }
+  return c;
+}
+
+// Response is received. Reuse the connection for a waiting request, or
+// leave it idle
+static void pool_release(struct mg_connection *c, struct pconn *pc) {
+  struct mg_http_pool_req *r;
+  pc->fn = NULL, pc->fn_data = NULL, pc->done = false;
+  pc->idle_since = mg_millis();
+  if (!pc->keep || pc->pool == NULL) {
+    c->is_closing = 1;
+  } else if (!c->is_closing && !c->is_draining &&
+             (r = pool_dequeue(pc->pool, pc->key)) != NULL) {
+    pc->fn = r->fn, pc->fn_data = r->fn_data, pc->connect = true;
+    free(r);
+  }
+}
+
+static bool keepalive(struct mg_http_message *hm) {
+  struct mg_str *h = mg_http_get_header(hm, "Connection");
+  if (mg_vcasecmp(&hm->method, "HTTP/1.1") == 0) {
+    return h == NULL || mg_vcasecmp(h, "close") != 0;
+  }
+  return h != NULL && mg_vcasecmp(h, "keep-alive") == 0;
+}
+
+static void pool_cb(struct mg_connection *c, int ev, void *ev_data,
+                    void *fn_data) {
+  struct pconn *pc = (struct pconn *) fn_data;
+  mg_event_handler_t fn;
+  void *fnd;
+  if (ev == MG_EV_CONNECT && pc->is_tls && pc->pool != NULL) {
+    mg_tls_init(c, pc->pool->tls);
+  } else if (ev == MG_EV_POLL && pc->connect) {
+    pc->connect = false;
+    if (pc->fn != NULL) pc->fn(c, MG_EV_CONNECT, NULL, pc->fn_data);
+  } else if (ev == MG_EV_HTTP_MSG || ev == MG_EV_HTTP_CHUNK) {
+    pc->keep = keepalive((struct mg_http_message *) ev_data);
+  }
+  fn = pc->fn, fnd = pc->fn_data;
+  if (fn != NULL) fn(c, ev, ev_data, fnd);
+  if (pc->fn != fn || pc->fn_data != fnd) {
+    // Handler has released the connection with mg_http_pool_release()
+  } else if (ev == MG_EV_HTTP_MSG &&
+             mg_http_status((struct mg_http_message *) ev_data) / 100 == 1 &&
+             mg_http_status((struct mg_http_message *) ev_data) != 101) {
+    // Interim response, like 100 Continue. The final response follows
+  } else if (ev == MG_EV_HTTP_MSG) {
+    pool_release(c, pc);
+  } else if (ev == MG_EV_HTTP_CHUNK &&
+             ((struct mg_http_message *) ev_data)->chunk.len == 0) {
+    pc->done = true;  // MG_EV_HTTP_MSG may not follow, release on poll
+  } else if (ev == MG_EV_POLL && pc->done) {
+    pool_release(c, pc);
+  } else if (ev == MG_EV_POLL && pc->fn == NULL && pc->pool != NULL &&
+             mg_millis() - pc->idle_since > pc->pool->idle_ms) {
+    c->is_closing = 1;  // Idle for too long
+  }
+  if (ev == MG_EV_CLOSE) {
+    // The slot is free now, start a waiting request, if any
+    struct mg_http_pool_req *r;
+    if (pc->pool != NULL && (r = pool_dequeue(pc->pool, pc->key)) != NULL) {
+      if (pool_new(pc->pool, r->url, r->fn, r->fn_data) == NULL) {
+        MG_ERROR(("%s: connect failed", r->url));
+      }
+      free(r);
+    }
+    c->fn = NULL;
+    free(pc);
+  }
+}
+
+void mg_http_pool_release(struct mg_connection *c) {
+  if (c->fn == pool_cb) pool_release(c, (struct pconn *) c->fn_data);
+}
+
+void mg_http_pool_init(struct mg_http_pool *pool, struct mg_mgr *mgr,
+                       size_t max_conns, uint64_t idle_ms) {
+  memset(pool, 0, sizeof(*pool));
+  pool->mgr = mgr, pool->max_conns = max_conns, pool->idle_ms = idle_ms;
+}
+
+void mg_http_pool_free(struct mg_http_pool *pool) {
+  struct mg_connection *c;
+  struct mg_http_pool_req *r;
+  while ((r = pool->queue) != NULL) pool->queue = r->next, free(r);
+  for (c = pool->mgr->conns; c != NULL; c = c->next) {
+    struct pconn *pc = (struct pconn *) c->fn_data;
+    if (c->fn != pool_cb || pc->pool != pool) continue;
+    pc->pool = NULL;  // Detach, so closing connection won't touch the pool
+    if (pc->fn == NULL) c->is_closing = 1;  // Idle
+  }
+}
+
+bool mg_http_pool_connect(struct mg_http_pool *pool, const char *url,
+                          mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c, *idle = NULL;
+  size_t count = 0;
+  char key[300];
+  pool_key(url, key, sizeof(key));
+  for (c = pool->mgr->conns; c != NULL; c = c->next) {
+    struct pconn *pc = (struct pconn *) c->fn_data;
+    if (c->fn != pool_cb || pc->pool != pool || strcmp(pc->key, key) != 0) {
+      continue;
+    }
+    count++;
+    if (pc->fn == NULL && !c->is_closing && !c->is_draining) idle = c;
+  }
+  if (idle != NULL) {
+    struct pconn *pc = (struct pconn *) idle->fn_data;
+    pc->fn = fn, pc->fn_data = fn_data, pc->connect = true;
+    MG_DEBUG(("%lu reused for %s", idle->id, url));
+    return true;
+  } else if (pool->max_conns == 0 || count < pool->max_conns) {
+    return pool_new(pool, url, fn, fn_data) != NULL;
+  } else {
+    size_t n = strlen(url);
+    struct mg_http_pool_req *r =
+        (struct mg_http_pool_req *) calloc(1, sizeof(*r) + n + 1);
+    if (r == NULL) return false;
+    r->fn = fn, r->fn_data = fn_data, r->url = (char *) (r + 1);
+    memcpy(r->url, url, n);
+    LIST_ADD_TAIL(struct mg_http_pool_req, &pool->queue, r);
+    MG_DEBUG(("%s queued, %lu conns", url, (unsigned long) count));
+    return true;
+  }
+}
+
 struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
                                       mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = mg_connect(mgr, url, fn, fn_data);
@@ -2355,6 +5078,1043 @@ struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
+#ifdef MG_ENABLE_LINES
+#line 1 "src/http2.c"
+#endif
+
+
+
+
+
+#if MG_ENABLE_HTTP2
+// Frame types, RFC9113 section 6
+enum {
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION
+};
+
+// Error codes, RFC9113 section 7
+enum {
+  H2_NO_ERROR,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT,
+  H2_STREAM_CLOSED,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM
+};
+
+#define H2_END_STREAM 1
+#define H2_ACK 1
+#define H2_END_HEADERS 4
+#define H2_PADDED 8
+#define H2_PRIO 0x20
+
+#define H2_FRAME_SIZE 16384  // SETTINGS_MAX_FRAME_SIZE default
+#define H2_WINDOW 65535      // SETTINGS_INITIAL_WINDOW_SIZE default
+#define H2_MAX_WINDOW 0x7fffffffL
+#define H2_TABLE_SIZE 4096  // SETTINGS_HEADER_TABLE_SIZE default
+#define H2_SEND_LIMIT (2 * H2_FRAME_SIZE)  // Stop queueing DATA after that
+#define H2_WINDOW_BATCH (H2_WINDOW / 2)    // Min WINDOW_UPDATE increment
+
+static const char s_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// HPACK static table, RFC7541 appendix A
+// clang-format off
+static const char *s_hpack_static[][2] = {
+  {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+  {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+  {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+  {":status", "206"}, {":status", "304"}, {":status", "400"},
+  {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+  {"accept-ranges", ""}, {"accept", ""},
+  {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+  {"authorization", ""}, {"cache-control", ""},
+  {"content-disposition", ""}, {"content-encoding", ""},
+  {"content-language", ""}, {"content-length", ""},
+  {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+  {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+  {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+  {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+  {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+  {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+  {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+  {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+  {"set-cookie", ""}, {"strict-transport-security", ""},
+  {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+  {"via", ""}, {"www-authenticate", ""},
+};
+
+// HPACK Huffman code, RFC7541 appendix B. The code is canonical, so the
+// decoder needs only the number of codes of each length, and symbols sorted
+// by code
+static const uint32_t s_huff_code[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6,
+    0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea,
+    0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee, 0xfffffef,
+    0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3, 0xffffff4,
+    0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb, 0xf9,
+    0x7fb, 0xfa, 0x16, 0x17, 0x18, 0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21, 0x5d,
+    0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73, 0xfd,
+    0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22, 0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76, 0x2c,
+    0x8, 0x9, 0x2d, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd,
+    0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4,
+    0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd,
+    0x7fffde, 0xffffeb, 0x7fffdf, 0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0,
+    0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8,
+    0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde, 0x7fffea,
+    0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee,
+    0x7fffef, 0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5,
+    0x3fffe6, 0x7ffff1, 0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7,
+    0x7ffff2, 0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3, 0x3ffffe6,
+    0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2, 0x1fffe4, 0x1fffe5,
+    0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5, 0xfffec,
+    0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea,
+    0x7ffff4, 0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee,
+    0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+static const uint8_t s_huff_len[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28,
+    28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28, 6, 10, 10, 12, 13, 6, 8,
+    11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6,
+    12, 10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 8, 7, 8, 13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6,
+    6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20, 22, 20, 20,
+    22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23,
+    23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22,
+    22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23,
+    22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20,
+    21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27,
+    27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+static const uint8_t s_huff_cnt[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26,
+    29, 12, 4, 15, 19, 29, 0, 3,
+};
+static const uint8_t s_huff_sym[256] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53,
+    54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114,
+    117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82,
+    83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44,
+    59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93, 126,
+    94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226,
+    153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132,
+    133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181, 185,
+    186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140,
+    141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175,
+    180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171,
+    206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+    210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221,
+    222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29,
+    30, 31, 127, 220, 249, 10, 13, 22,
+};
+// clang-format on
+
+#define HPACK_STATIC_SIZE (sizeof(s_hpack_static) / sizeof(s_hpack_static[0]))
+
+// HPACK dynamic table. Entries are stored newest first, each entry is
+// a 2-byte name length, a 2-byte value length, a name and a value
+struct hpack {
+  struct mg_iobuf buf;  // Entries
+  size_t count;         // Number of entries
+  size_t size;          // Table size as defined by RFC7541 section 4.1
+  size_t max;           // Maximum table size
+};
+
+struct h2_stream {
+  struct h2_stream *next;
+  uint32_t id;               // Stream ID
+  struct mg_iobuf req;       // Request, reassembled as HTTP/1.1 message
+  size_t head_len;           // Length of the request line and headers in req
+  struct mg_iobuf resp;      // Response captured from the event handler
+  size_t ofs, end;           // Response body bytes to send, resp.buf[ofs..end)
+  struct mg_http_stream st;  // Streamed response body, like a static file
+  long window;               // Send window
+  size_t unacked;            // Received bytes not yet given back to the peer
+  uint64_t vtime;            // Virtual time, for the weighted scheduling
+  unsigned weight;           // Priority weight, 1..256
+  bool received;             // Request is received, END_STREAM seen
+  bool responded;            // Response headers are sent
+  bool chunked;              // Response body is chunked
+};
+
+// HTTP/2 connection state, stored in c->pfn_data
+struct h2conn {
+  struct h2_stream *streams;  // Active streams
+  size_t num_streams;         // Number of active streams
+  struct hpack dec, enc;      // Request decoder, response encoder
+  struct mg_iobuf block;      // Header block being received or sent
+  struct mg_iobuf fields;     // Decoded header block, "name\0value\0" pairs
+  uint32_t block_id;          // Stream that sends CONTINUATION frames
+  uint8_t block_flags;        // Flags of the HEADERS frame
+  unsigned block_weight;      // Priority weight of the HEADERS frame
+  uint32_t last_id;           // Largest stream ID seen
+  long window;                // Connection send window
+  size_t unacked;             // Received bytes not yet given back to the peer
+  long init_window;           // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+  size_t frame_size;          // Peer's SETTINGS_MAX_FRAME_SIZE
+  uint64_t vtime;             // Virtual time of the last sent DATA frame
+  bool table_update;          // Encoder must signal table size change
+  bool goaway;                // Peer sent GOAWAY
+};
+
+static uint32_t be32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | p[3];
+}
+
+static size_t entry_len(const uint8_t *p) {
+  return 4 + ((size_t) p[0] << 8 | p[1]) + ((size_t) p[2] << 8 | p[3]);
+}
+
+// Evict oldest entries until an entry of `need` bytes fits
+static void hpack_evict(struct hpack *t, size_t need) {
+  while (t->count > 0 && t->size + need > t->max) {
+    size_t i, ofs = 0, n = 0;
+    for (i = 0; i < t->count; i++) ofs += (n = entry_len(t->buf.buf + ofs));
+    t->size -= n - 4 + 32;
+    t->buf.len -= n;
+    t->count--;
+  }
+}
+
+static void hpack_add(struct hpack *t, const char *name, size_t nlen,
+                      const char *value, size_t vlen) {
+  size_t n = nlen + vlen + 32;
+  hpack_evict(t, n);
+  if (n > t->max) return;  // Does not fit at all, the table is now empty
+  if (mg_iobuf_add(&t->buf, 0, NULL, 4 + nlen + vlen, MG_IO_SIZE) == 0) {
+    return;
+  }
+  t->buf.buf[0] = (uint8_t) (nlen >> 8), t->buf.buf[1] = (uint8_t) nlen;
+  t->buf.buf[2] = (uint8_t) (vlen >> 8), t->buf.buf[3] = (uint8_t) vlen;
+  memcpy(t->buf.buf + 4, name, nlen);
+  memcpy(t->buf.buf + 4 + nlen, value, vlen);
+  t->size += n;
+  t->count++;
+}
+
+// Lookup an entry by its 1-based index, static entries first
+static bool hpack_get(struct hpack *t, size_t idx, struct mg_str *name,
+                      struct mg_str *value) {
+  if (idx == 0) return false;
+  if (idx <= HPACK_STATIC_SIZE) {
+    *name = mg_str(s_hpack_static[idx - 1][0]);
+    *value = mg_str(s_hpack_static[idx - 1][1]);
+  } else {
+    const uint8_t *p = t->buf.buf;
+    size_t nlen, i = idx - HPACK_STATIC_SIZE - 1;
+    if (i >= t->count) return false;
+    while (i-- > 0) p += entry_len(p);
+    nlen = (size_t) p[0] << 8 | p[1];
+    *name = mg_str_n((char *) p + 4, nlen);
+    *value = mg_str_n((char *) p + 4 + nlen, ((size_t) p[2] << 8 | p[3]));
+  }
+  return true;
+}
+
+// Find an entry. Return its index, and set `exact` if the value matches too
+static size_t hpack_find(struct hpack *t, struct mg_str name,
+                         struct mg_str value, bool *exact) {
+  size_t i, idx = 0;
+  struct mg_str n, v;
+  *exact = false;
+  for (i = 1; i <= HPACK_STATIC_SIZE + t->count; i++) {
+    hpack_get(t, i, &n, &v);
+    if (mg_strcmp(n, name) != 0) continue;
+    if (mg_strcmp(v, value) == 0) return *exact = true, i;
+    if (idx == 0) idx = i;
+  }
+  return idx;
+}
+
+// Decode an integer with an n-bit prefix. Return number of bytes used,
+// or 0 on error
+static size_t hpack_int(const uint8_t *p, size_t len, unsigned n, size_t *v) {
+  size_t i = 1, max = (1U << n) - 1;
+  unsigned shift = 0;
+  if (len == 0) return 0;
+  if ((*v = p[0] & max) < max) return 1;
+  for (; i < len && shift <= 21; i++, shift += 7) {
+    *v += (size_t) (p[i] & 127) << shift;
+    if ((p[i] & 128) == 0) return i + 1;
+  }
+  return 0;
+}
+
+static void hpack_put_int(struct mg_iobuf *io, uint8_t prefix, unsigned n,
+                          size_t v) {
+  uint8_t buf[8];
+  size_t i = 0, max = (1U << n) - 1;
+  if (v < max) {
+    buf[i++] = (uint8_t) (prefix | v);
+  } else {
+    buf[i++] = (uint8_t) (prefix | max);
+    for (v -= max; v >= 128; v >>= 7) buf[i++] = (uint8_t) (v | 128);
+    buf[i++] = (uint8_t) v;
+  }
+  mg_iobuf_add(io, io->len, buf, i, MG_IO_SIZE);
+}
+
+static bool huff_decode(const uint8_t *p, size_t len, struct mg_iobuf *io) {
+  uint32_t code = 0, first = 0, index = 0;
+  unsigned i, bits = 0, ones = 1;
+  // Shortest code is 5 bits long, so the output is at most 8/5 of the input
+  if (io->len + len * 8 / 5 + 1 > io->size &&
+      !mg_iobuf_resize(io, io->len + len * 8 / 5 + MG_IO_SIZE)) {
+    return false;
+  }
+  for (; len > 0; p++, len--) {
+    for (i = 8; i-- > 0;) {
+      unsigned bit = (unsigned) (*p >> i) & 1;
+      code |= bit, ones &= bit, bits++;
+      if (code < first + s_huff_cnt[bits]) {
+        io->buf[io->len++] = s_huff_sym[index + code - first];
+        code = first = index = bits = 0, ones = 1;
+      } else if (bits >= 30) {
+        return false;  // EOS, or a code that does not exist
+      } else {
+        index += s_huff_cnt[bits];
+        first = (first + s_huff_cnt[bits]) << 1;
+        code <<= 1;
+      }
+    }
+  }
+  return bits < 8 && ones;  // Padding is the EOS prefix, all ones
+}
+
+// Decode a string literal and append it to `io`. Return number of bytes
+// used, or 0 on error
+static size_t hpack_str(const uint8_t *p, size_t len, struct mg_iobuf *io) {
+  size_t n, slen;
+  if ((n = hpack_int(p, len, 7, &slen)) == 0 || slen > len - n) return 0;
+  if (p[0] & 128) {
+    if (!huff_decode(p + n, slen, io)) return 0;
+  } else if (mg_iobuf_add(io, io->len, p + n, slen, MG_IO_SIZE) != slen) {
+    return 0;
+  }
+  return n + slen;
+}
+
+static void hpack_put_str(struct mg_iobuf *io, struct mg_str s) {
+  size_t i, bits = 0, n;
+  for (i = 0; i < s.len; i++) bits += s_huff_len[(uint8_t) s.ptr[i]];
+  if ((n = (bits + 7) / 8) < s.len) {
+    uint64_t acc = 0;
+    uint8_t *p;
+    hpack_put_int(io, 128, 7, n);
+    if (mg_iobuf_add(io, io->len, NULL, n, MG_IO_SIZE) != n) return;
+    p = io->buf + io->len - n;
+    for (bits = i = 0; i < s.len; i++) {
+      uint8_t ch = (uint8_t) s.ptr[i];
+      acc = (acc << s_huff_len[ch]) | s_huff_code[ch];
+      for (bits += s_huff_len[ch]; bits >= 8; bits -= 8) {
+        *p++ = (uint8_t) (acc >> (bits - 8));
+      }
+    }
+    if (bits > 0) *p = (uint8_t) ((acc << (8 - bits)) | (0xff >> bits));
+  } else {
+    hpack_put_int(io, 0, 7, s.len);
+    mg_iobuf_add(io, io->len, s.ptr, s.len, MG_IO_SIZE);
+  }
+}
+
+// RFC 9113 8.2.1. Names are lowercase tokens, only pseudo-headers start
+// with ':'. Values have no CR, LF or NUL, and no whitespace around them
+static bool field_ok(struct mg_str name, struct mg_str value) {
+  size_t i;
+  if (name.len == 0) return false;
+  for (i = 0; i < name.len; i++) {
+    uint8_t ch = (uint8_t) name.ptr[i];
+    if (ch <= ' ' || ch >= 0x7f || (ch >= 'A' && ch <= 'Z') ||
+        (ch == ':' && i > 0)) {
+      return false;
+    }
+  }
+  for (i = 0; i < value.len; i++) {
+    char ch = value.ptr[i];
+    if (ch == '\0' || ch == '\r' || ch == '\n') return false;
+    if ((i == 0 || i + 1 == value.len) && (ch == ' ' || ch == '\t')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Decode a header block into "name\0value\0" pairs. Return false on
+// a decoding error, which is fatal for the connection. Fields with values
+// that are invalid in HTTP/2 are flagged by `malformed`
+static bool hpack_decode(struct hpack *t, const uint8_t *p, size_t len,
+                         struct mg_iobuf *out, bool *malformed) {
+  out->len = 0;
+  *malformed = false;
+  while (len > 0) {
+    size_t n, idx, ofs = out->len, nlen;
+    struct mg_str name, value;
+    bool add = (p[0] & 0xc0) == 0x40;
+    if (p[0] & 0x80) {  // Indexed field
+      if ((n = hpack_int(p, len, 7, &idx)) == 0) return false;
+      if (!hpack_get(t, idx, &name, &value)) return false;
+      mg_iobuf_add(out, out->len, name.ptr, name.len, MG_IO_SIZE);
+      mg_iobuf_add(out, out->len, "", 1, MG_IO_SIZE);
+      mg_iobuf_add(out, out->len, value.ptr, value.len, MG_IO_SIZE);
+      mg_iobuf_add(out, out->len, "", 1, MG_IO_SIZE);
+      if (!field_ok(name, value)) *malformed = true;
+      p += n, len -= n;
+      continue;
+    } else if ((p[0] & 0xe0) == 0x20) {  // Dynamic table size update
+      if ((n = hpack_int(p, len, 5, &idx)) == 0) return false;
+      if (idx > H2_TABLE_SIZE) return false;
+      t->max = idx;
+      hpack_evict(t, 0);
+      p += n, len -= n;
+      continue;
+    }
+    // Literal field, with, without or never indexed
+    if ((n = hpack_int(p, len, add ? 6 : 4, &idx)) == 0) return false;
+    p += n, len -= n;
+    if (idx > 0) {
+      if (!hpack_get(t, idx, &name, &value)) return false;
+      mg_iobuf_add(out, out->len, name.ptr, name.len, MG_IO_SIZE);
+    } else {
+      if ((n = hpack_str(p, len, out)) == 0) return false;
+      p += n, len -= n;
+    }
+    nlen = out->len - ofs;
+    mg_iobuf_add(out, out->len, "", 1, MG_IO_SIZE);
+    if ((n = hpack_str(p, len, out)) == 0) return false;
+    p += n, len -= n;
+    if (add) {
+      hpack_add(t, (char *) out->buf + ofs, nlen,
+                (char *) out->buf + ofs + nlen + 1, out->len - ofs - nlen - 1);
+    }
+    name = mg_str_n((char *) out->buf + ofs, nlen);
+    value = mg_str_n(name.ptr + nlen + 1, out->len - ofs - nlen - 1);
+    if (!field_ok(name, value)) *malformed = true;
+    mg_iobuf_add(out, out->len, "", 1, MG_IO_SIZE);
+  }
+  return true;
+}
+
+// Encode a response header. Headers that change on every response are
+// not added to the dynamic table, they would only evict useful entries
+static void hpack_encode(struct hpack *t, struct mg_iobuf *io,
+                         struct mg_str name, struct mg_str value) {
+  static const char *volatile_headers[] = {
+      "content-length", "date", "etag", "last-modified", "content-range",
+      "set-cookie", "expires", NULL};
+  bool exact, add = true;
+  size_t i, idx = hpack_find(t, name, value, &exact);
+  if (exact) {
+    hpack_put_int(io, 128, 7, idx);
+    return;
+  }
+  for (i = 0; volatile_headers[i] != NULL; i++) {
+    if (mg_vcmp(&name, volatile_headers[i]) == 0) add = false;
+  }
+  hpack_put_int(io, add ? 0x40 : 0, add ? 6 : 4, idx);
+  if (idx == 0) hpack_put_str(io, name);
+  hpack_put_str(io, value);
+  if (add) hpack_add(t, name.ptr, name.len, value.ptr, value.len);
+}
+
+static void h2_send(struct mg_connection *c, uint8_t type, uint8_t flags,
+                    uint32_t id, const void *buf, size_t len) {
+  uint8_t hdr[9] = {(uint8_t) (len >> 16), (uint8_t) (len >> 8), (uint8_t) len,
+                  type, flags, (uint8_t) (id >> 24), (uint8_t) (id >> 16),
+                  (uint8_t) (id >> 8), (uint8_t) id};
+  mg_send(c, hdr, sizeof(hdr));
+  if (len > 0) mg_send(c, buf, len);
+}
+
+static void h2_send32(struct mg_connection *c, uint8_t type, uint32_t id,
+                      uint32_t v1, uint32_t v2, size_t len) {
+  uint8_t b[8] = {(uint8_t) (v1 >> 24), (uint8_t) (v1 >> 16),
+                  (uint8_t) (v1 >> 8),  (uint8_t) v1,
+                  (uint8_t) (v2 >> 24), (uint8_t) (v2 >> 16),
+                  (uint8_t) (v2 >> 8),  (uint8_t) v2};
+  h2_send(c, type, 0, id, b, len);
+}
+
+// Connection error: send GOAWAY and close the connection
+static void h2_error(struct mg_connection *c, struct h2conn *h2,
+                     uint32_t code) {
+  MG_DEBUG(("%lu HTTP/2 error %lu", c->id, (unsigned long) code));
+  h2_send32(c, H2_GOAWAY, 0, h2->last_id, code, 8);
+  c->is_draining = 1;
+}
+
+static struct h2_stream *h2_find(struct h2conn *h2, uint32_t id) {
+  struct h2_stream *s;
+  for (s = h2->streams; s != NULL && s->id != id; s = s->next) (void) 0;
+  return s;
+}
+
+static void h2_close(struct mg_connection *c, struct h2conn *h2,
+                     struct h2_stream *s) {
+  LIST_DELETE(struct h2_stream, &h2->streams, s);
+  mg_http_stream_free(c, &s->st);
+  mg_iobuf_free(&s->req);
+  mg_iobuf_free(&s->resp);
+  free(s);
+  h2->num_streams--;
+}
+
+// Stream error: send RST_STREAM and forget the stream
+static void h2_reset(struct mg_connection *c, struct h2conn *h2, uint32_t id,
+                     uint32_t code) {
+  struct h2_stream *s = h2_find(h2, id);
+  MG_DEBUG(("%lu HTTP/2 stream %lu error %lu", c->id, (unsigned long) id,
+            (unsigned long) code));
+  h2_send32(c, H2_RST_STREAM, id, code, 0, 4);
+  if (s != NULL) h2_close(c, h2, s);
+}
+
+static bool is_connection_header(struct mg_str name) {
+  return mg_vcmp(&name, "connection") == 0 ||
+         mg_vcmp(&name, "keep-alive") == 0 ||
+         mg_vcmp(&name, "proxy-connection") == 0 ||
+         mg_vcmp(&name, "transfer-encoding") == 0 ||
+         mg_vcmp(&name, "upgrade") == 0;
+}
+
+// Iterate over "name\0value\0" pairs
+static bool next_field(struct mg_iobuf *io, size_t *ofs, struct mg_str *name,
+                       struct mg_str *value) {
+  char *p, *end, *q;
+  if (*ofs >= io->len) return false;
+  p = (char *) io->buf + *ofs, end = (char *) io->buf + io->len;
+  if ((q = (char *) memchr(p, 0, (size_t) (end - p))) == NULL) return false;
+  *name = mg_str_n(p, (size_t) (q - p));
+  p = q + 1;
+  if ((q = (char *) memchr(p, 0, (size_t) (end - p))) == NULL) return false;
+  *value = mg_str_n(p, (size_t) (q - p));
+  *ofs = (size_t) (q + 1 - (char *) io->buf);
+  return true;
+}
+
+// Convert decoded request headers into an HTTP/1.1 style request head
+static bool h2_request(struct h2conn *h2, struct h2_stream *s) {
+  struct mg_str method = mg_str_n(NULL, 0), path = method, host = method;
+  struct mg_str k, v;
+  size_t ofs = 0;
+  bool regular = false, cookie = false;
+  while (next_field(&h2->fields, &ofs, &k, &v)) {
+    if (k.len > 0 && k.ptr[0] == ':') {
+      if (regular) return false;  // Pseudo-headers must go first
+      if (mg_vcmp(&k, ":method") == 0) {
+        method = v;
+      } else if (mg_vcmp(&k, ":path") == 0) {
+        path = v;
+      } else if (mg_vcmp(&k, ":authority") == 0) {
+        host = v;
+      } else if (mg_vcmp(&k, ":scheme") != 0) {
+        return false;
+      }
+    } else {
+      if (is_connection_header(k)) return false;
+      regular = true;
+    }
+  }
+  if (method.len == 0 || path.len == 0) return false;
+  mg_rprintf(mg_putchar_iobuf, &s->req, "%.*s %.*s HTTP/2.0\r\n",
+             (int) method.len, method.ptr, (int) path.len, path.ptr);
+  if (host.len > 0) {
+    mg_rprintf(mg_putchar_iobuf, &s->req, "host: %.*s\r\n", (int) host.len,
+               host.ptr);
+  }
+  for (ofs = 0; next_field(&h2->fields, &ofs, &k, &v);) {
+    // Body length is known at the end of the stream, Content-Length is
+    // added then. Cookies may be split into several fields, join them
+    if (k.ptr[0] == ':' || mg_vcmp(&k, "content-length") == 0 ||
+        mg_vcmp(&k, "cookie") == 0 || mg_vcmp(&k, "host") == 0) {
+      continue;
+    }
+    mg_rprintf(mg_putchar_iobuf, &s->req, "%.*s: %.*s\r\n", (int) k.len,
+               k.ptr, (int) v.len, v.ptr);
+  }
+  for (ofs = 0; next_field(&h2->fields, &ofs, &k, &v);) {
+    if (mg_vcmp(&k, "cookie") != 0) continue;
+    mg_rprintf(mg_putchar_iobuf, &s->req, "%s%.*s", cookie ? "; " : "cookie: ",
+               (int) v.len, v.ptr);
+    cookie = true;
+  }
+  if (cookie) mg_rprintf(mg_putchar_iobuf, &s->req, "\r\n");
+  s->head_len = s->req.len;
+  return true;
+}
+
+static bool is_hex(int c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+         (c >= 'A' && c <= 'F');
+}
+
+// Decode complete chunks of the chunked body at io->buf[ofs..], in place,
+// dropping the rest. Return the end of the decoded data
+static size_t h2_dechunk(struct mg_iobuf *io, size_t ofs) {
+  size_t i = ofs, end = ofs;
+  while (i < io->len) {
+    size_t j = i, len;
+    while (j < io->len && is_hex(io->buf[j])) j++;
+    len = mg_unhexn((char *) io->buf + i, j - i);
+    while (j < io->len && io->buf[j] != '\n') j++;
+    if (len == 0 || j + 1 + len > io->len) break;
+    memmove(io->buf + end, io->buf + j + 1, len);
+    end += len;
+    i = j + 1 + len + 2;  // Skip CRLF after the chunk data
+  }
+  return io->len = end;
+}
+
+// Convert a captured HTTP/1.1 response into HEADERS, and queue the body
+static void h2_respond(struct mg_connection *c, struct h2conn *h2,
+                       struct h2_stream *s, bool is_head) {
+  struct mg_iobuf *io = &s->resp;
+  char *p = (char *) io->buf, *end, *eol;
+  int n = mg_http_get_request_len(io->buf, io->len), status;
+  size_t cl = (size_t) ~0, ofs;
+  char lower[64];
+  if (n <= 0 || mg_ncasecmp(p, "HTTP/1.", 7) != 0 || n < 13) {
+    MG_ERROR(("%lu stream %lu: no response", c->id, (unsigned long) s->id));
+    h2_reset(c, h2, s->id, H2_INTERNAL_ERROR);
+    return;
+  }
+  if ((status = atoi(p + 9)) < 200 || status > 999) {
+    MG_ERROR(("%lu stream %lu: status %d", c->id, (unsigned long) s->id,
+              status));
+    h2_reset(c, h2, s->id, H2_INTERNAL_ERROR);
+    return;
+  }
+  h2->block.len = 0;
+  if (h2->table_update) {
+    hpack_put_int(&h2->block, 0x20, 5, h2->enc.max);
+    h2->table_update = false;
+  }
+  mg_snprintf(lower, sizeof(lower), "%d", status);
+  hpack_encode(&h2->enc, &h2->block, mg_str(":status"), mg_str(lower));
+  end = p + n;
+  for (p = (char *) memchr(p, '\n', (size_t) n) + 1; p < end; p = eol + 1) {
+    struct mg_str k, v;
+    char *colon;
+    eol = (char *) memchr(p, '\n', (size_t) (end - p));
+    if ((colon = (char *) memchr(p, ':', (size_t) (eol - p))) == NULL) {
+      continue;
+    }
+    k = mg_strstrip(mg_str_n(p, (size_t) (colon - p)));
+    v = mg_strstrip(mg_str_n(colon + 1, (size_t) (eol - colon - 1)));
+    if (k.len == 0 || k.len >= sizeof(lower)) continue;
+    for (ofs = 0; ofs < k.len; ofs++) {
+      char ch = k.ptr[ofs];
+      lower[ofs] = (char) (ch >= 'A' && ch <= 'Z' ? ch + 'a' - 'A' : ch);
+    }
+    k = mg_str_n(lower, k.len);
+    if (mg_vcmp(&k, "transfer-encoding") == 0 &&
+        mg_vcasecmp(&v, "chunked") == 0) {
+      s->chunked = true;
+    } else if (mg_vcmp(&k, "content-length") == 0) {
+      cl = (size_t) mg_to64(v);
+    }
+    if (is_connection_header(k)) continue;
+    hpack_encode(&h2->enc, &h2->block, k, v);
+  }
+
+  // Extract the body. A chunked body is decoded in place
+  s->ofs = s->end = (size_t) n;
+  if (s->chunked) {
+    s->end = h2_dechunk(io, s->ofs);
+  } else {
+    s->end = cl < io->len - s->ofs ? s->ofs + cl : io->len;
+  }
+  if (is_head) s->end = s->ofs;
+
+  // Send HEADERS, and CONTINUATION if the header block is large
+  for (ofs = 0; ofs == 0 || ofs < h2->block.len;) {
+    size_t len = h2->block.len - ofs;
+    uint8_t flags = 0;
+    if (len > h2->frame_size) len = h2->frame_size;
+    if (ofs + len == h2->block.len) flags |= H2_END_HEADERS;
+    if (ofs == 0 && s->ofs == s->end && s->st.pfn == NULL) {
+      flags |= H2_END_STREAM;
+    }
+    h2_send(c, ofs == 0 ? H2_HEADERS : H2_CONTINUATION, flags, s->id,
+            h2->block.buf + ofs, len);
+    if ((ofs += len) == 0) break;
+  }
+  h2->block.len = 0;
+  s->responded = true;
+  s->vtime = h2->vtime;
+  if (s->ofs == s->end && s->st.pfn == NULL) h2_close(c, h2, s);
+}
+
+static void h2_cb(struct mg_connection *, int, void *, void *);
+
+// Request is complete. Pass it to the event handler, capturing the response
+static void h2_dispatch(struct mg_connection *c, struct h2conn *h2,
+                        struct h2_stream *s) {
+  struct mg_http_message hm;
+  struct mg_iobuf send = c->send, recv = c->recv;
+  char buf[40];
+  size_t n = mg_snprintf(buf, sizeof(buf), "content-length: %lu\r\n\r\n",
+                         (unsigned long) (s->req.len - s->head_len));
+  bool is_head;
+  s->received = true;
+  mg_iobuf_add(&s->req, s->head_len, buf, n, MG_IO_SIZE);
+  if (mg_http_parse((char *) s->req.buf, s->req.len, &hm) <= 0) {
+    h2_reset(c, h2, s->id, H2_PROTOCOL_ERROR);
+    return;
+  }
+  is_head = mg_vcasecmp(&hm.method, "HEAD") == 0;
+  // The handler sees an empty recv buffer, and its output is captured.
+  // Streamed responses, like static files, are parked and read by h2_flush()
+  memset(&c->send, 0, sizeof(c->send));
+  memset(&c->recv, 0, sizeof(c->recv));
+  mg_call(c, MG_EV_HTTP_MSG, &hm);
+  if (mg_http_park(c, &s->st) && is_head) mg_http_stream_free(c, &s->st);
+  s->resp = c->send;
+  c->send = send, c->recv = recv;
+  c->pfn = h2_cb, c->pfn_data = h2;  // Protocol upgrades are not supported
+  mg_iobuf_free(&s->req);
+  h2_respond(c, h2, s, is_head);
+}
+
+// Header block is complete, decode it
+static void h2_headers(struct mg_connection *c, struct h2conn *h2) {
+  uint32_t id = h2->block_id;
+  struct h2_stream *s = h2_find(h2, id);
+  bool malformed;
+  h2->block_id = 0;
+  if (!hpack_decode(&h2->dec, h2->block.buf, h2->block.len, &h2->fields,
+                    &malformed)) {
+    h2_error(c, h2, H2_COMPRESSION_ERROR);
+  } else if (s != NULL) {
+    // Trailers. They are decoded to keep HPACK state, and ignored
+    if (s->received) {
+      h2_reset(c, h2, id, H2_STREAM_CLOSED);
+    } else if (!(h2->block_flags & H2_END_STREAM)) {
+      h2_reset(c, h2, id, H2_PROTOCOL_ERROR);
+    } else {
+      h2_dispatch(c, h2, s);
+    }
+  } else if (id <= h2->last_id) {
+    h2_error(c, h2, H2_STREAM_CLOSED);
+  } else if (h2->last_id = id, h2->goaway) {
+    // Peer is going away, and should not start new streams. Ignore
+  } else if (h2->num_streams >= MG_HTTP2_MAX_STREAMS) {
+    h2_reset(c, h2, id, H2_REFUSED_STREAM);
+  } else if ((s = (struct h2_stream *) calloc(1, sizeof(*s))) == NULL) {
+    h2_reset(c, h2, id, H2_REFUSED_STREAM);
+  } else {
+    s->id = id;
+    s->window = h2->init_window;
+    s->weight = h2->block_weight;
+    LIST_ADD_TAIL(struct h2_stream, &h2->streams, s);
+    h2->num_streams++;
+    if (malformed || !h2_request(h2, s)) {
+      h2_reset(c, h2, id, H2_PROTOCOL_ERROR);
+    } else if (h2->block_flags & H2_END_STREAM) {
+      h2_dispatch(c, h2, s);
+    }
+  }
+  h2->block.len = 0;
+}
+
+static uint32_t h2_settings(struct mg_connection *c, struct h2conn *h2,
+                            const uint8_t *p, size_t len) {
+  struct h2_stream *s;
+  for (; len >= 6; p += 6, len -= 6) {
+    uint32_t v = be32(p + 2);
+    switch (p[1]) {
+      case 1:  // SETTINGS_HEADER_TABLE_SIZE
+        h2->enc.max = v < H2_TABLE_SIZE ? v : H2_TABLE_SIZE;
+        hpack_evict(&h2->enc, 0);
+        h2->table_update = true;
+        break;
+      case 2:  // SETTINGS_ENABLE_PUSH
+        if (v > 1) return H2_PROTOCOL_ERROR;
+        break;
+      case 4:  // SETTINGS_INITIAL_WINDOW_SIZE
+        if (v > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+        for (s = h2->streams; s != NULL; s = s->next) {
+          s->window += (long) v - h2->init_window;
+        }
+        h2->init_window = (long) v;
+        break;
+      case 5:  // SETTINGS_MAX_FRAME_SIZE
+        if (v < H2_FRAME_SIZE || v > 0xffffff) {
+          return H2_PROTOCOL_ERROR;
+        }
+        h2->frame_size = v;
+        break;
+    }
+  }
+  h2_send(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+  return 0;
+}
+
+static uint32_t h2_window_update(struct mg_connection *c, struct h2conn *h2,
+                                 uint32_t id, const uint8_t *p) {
+  long inc = (long) (be32(p) & 0x7fffffff);
+  struct h2_stream *s = h2_find(h2, id);
+  if (id == 0) {
+    if (inc == 0) return H2_PROTOCOL_ERROR;
+    if (h2->window > H2_MAX_WINDOW - inc) {
+      return H2_FLOW_CONTROL_ERROR;
+    }
+    h2->window += inc;
+  } else if (id > h2->last_id) {
+    return H2_PROTOCOL_ERROR;  // Idle stream
+  } else if (inc == 0) {
+    h2_reset(c, h2, id, H2_PROTOCOL_ERROR);
+  } else if (s != NULL && s->window > H2_MAX_WINDOW - inc) {
+    h2_reset(c, h2, id, H2_FLOW_CONTROL_ERROR);
+  } else if (s != NULL) {
+    s->window += inc;
+  }
+  return 0;
+}
+
+static uint32_t h2_data(struct mg_connection *c, struct h2conn *h2,
+                        uint8_t flags, uint32_t id, const uint8_t *p,
+                        size_t len) {
+  struct h2_stream *s = h2_find(h2, id);
+  size_t flen = len;  // Padding counts for flow control too
+  if (id == 0 || id > h2->last_id) return H2_PROTOCOL_ERROR;
+  if (flags & H2_PADDED) {
+    if (len == 0 || p[0] >= len) return H2_PROTOCOL_ERROR;
+    len -= 1 + (size_t) p[0], p++;
+  }
+  // The data is consumed right away: copied to the request, or dropped.
+  // Give the peer its window back in batches, not for every frame
+  if ((h2->unacked += flen) >= H2_WINDOW_BATCH) {
+    h2_send32(c, H2_WINDOW_UPDATE, 0, (uint32_t) h2->unacked, 0, 4);
+    h2->unacked = 0;
+  }
+  if (s == NULL || s->received) {
+    h2_reset(c, h2, id, H2_STREAM_CLOSED);
+  } else if (s->req.len + len > MG_MAX_RECV_SIZE) {
+    h2_reset(c, h2, id, H2_ENHANCE_YOUR_CALM);
+  } else {
+    mg_iobuf_add(&s->req, s->req.len, p, len, MG_IO_SIZE);
+    if (flags & H2_END_STREAM) {
+      h2_dispatch(c, h2, s);  // The stream window is not needed anymore
+    } else if ((s->unacked += flen) >= H2_WINDOW_BATCH) {
+      h2_send32(c, H2_WINDOW_UPDATE, id, (uint32_t) s->unacked, 0, 4);
+      s->unacked = 0;
+    }
+  }
+  return 0;
+}
+
+// Handle a frame. Return a connection error code, or 0
+static uint32_t h2_frame(struct mg_connection *c, struct h2conn *h2,
+                         uint8_t type, uint8_t flags, uint32_t id,
+                         const uint8_t *p, size_t len) {
+  struct h2_stream *s;
+  if (h2->block_id != 0 && (type != H2_CONTINUATION || id != h2->block_id)) {
+    return H2_PROTOCOL_ERROR;
+  }
+  switch (type) {
+    case H2_DATA:
+      return h2_data(c, h2, flags, id, p, len);
+    case H2_HEADERS:
+      if (id == 0 || (id & 1) == 0) return H2_PROTOCOL_ERROR;
+      if (flags & H2_PADDED) {
+        if (len == 0 || p[0] >= len) return H2_PROTOCOL_ERROR;
+        len -= 1 + (size_t) p[0], p++;
+      }
+      h2->block_weight = 16;
+      if (flags & H2_PRIO) {
+        if (len < 5) return H2_FRAME_SIZE_ERROR;
+        if ((be32(p) & 0x7fffffff) == id) {
+          return H2_PROTOCOL_ERROR;  // Depends on itself
+        }
+        h2->block_weight = (unsigned) p[4] + 1;
+        p += 5, len -= 5;
+      }
+      h2->block_id = id, h2->block_flags = flags, h2->block.len = 0;
+      // Fall through
+    case H2_CONTINUATION:
+      if (h2->block_id == 0) return H2_PROTOCOL_ERROR;
+      if (h2->block.len + len > MG_MAX_RECV_SIZE) {
+        return H2_ENHANCE_YOUR_CALM;
+      }
+      mg_iobuf_add(&h2->block, h2->block.len, p, len, MG_IO_SIZE);
+      if (flags & H2_END_HEADERS) h2_headers(c, h2);
+      break;
+    case H2_PRIORITY:
+      if (id == 0) return H2_PROTOCOL_ERROR;
+      if (len != 5) {
+        h2_reset(c, h2, id, H2_FRAME_SIZE_ERROR);
+      } else if ((s = h2_find(h2, id)) != NULL) {
+        s->weight = (unsigned) p[4] + 1;
+      }
+      break;
+    case H2_RST_STREAM:
+      if (len != 4) return H2_FRAME_SIZE_ERROR;
+      if (id == 0 || id > h2->last_id) {
+        return H2_PROTOCOL_ERROR;
+      }
+      if ((s = h2_find(h2, id)) != NULL) h2_close(c, h2, s);
+      break;
+    case H2_SETTINGS:
+      if (id != 0) return H2_PROTOCOL_ERROR;
+      if ((flags & H2_ACK) ? len != 0 : len % 6 != 0) {
+        return H2_FRAME_SIZE_ERROR;
+      }
+      if (!(flags & H2_ACK)) return h2_settings(c, h2, p, len);
+      break;
+    case H2_PING:
+      if (id != 0) return H2_PROTOCOL_ERROR;
+      if (len != 8) return H2_FRAME_SIZE_ERROR;
+      if (!(flags & H2_ACK)) h2_send(c, H2_PING, H2_ACK, 0, p, len);
+      break;
+    case H2_GOAWAY:
+      if (id != 0) return H2_PROTOCOL_ERROR;
+      h2->goaway = true;
+      break;
+    case H2_WINDOW_UPDATE:
+      if (len != 4) return H2_FRAME_SIZE_ERROR;
+      return h2_window_update(c, h2, id, p);
+    case H2_PUSH_PROMISE:  // Clients must not push
+      return H2_PROTOCOL_ERROR;
+    default:  // Unknown frame types must be ignored
+      break;
+  }
+  return 0;
+}
+
+// Body buffered so far is sent. Drop it, and read the next frame's worth
+// from the streamed response
+static void h2_pull(struct mg_connection *c, struct h2conn *h2,
+                    struct h2_stream *s) {
+  mg_iobuf_del(&s->resp, 0, s->end);
+  mg_http_pull(c, &s->st, &s->resp, h2->frame_size);
+  s->ofs = 0;
+  s->end = s->chunked ? h2_dechunk(&s->resp, 0) : s->resp.len;
+}
+
+// Send response bodies. Among the streams that are allowed to send, pick
+// the one that is the most behind in its share of the bandwidth, which is
+// proportional to the stream weight. Streamed bodies are read as they go,
+// at most a frame at a time, so a slow peer does not make them buffered
+static void h2_flush(struct mg_connection *c, struct h2conn *h2) {
+  while (c->send.len < H2_SEND_LIMIT && h2->window > 0 && !c->is_draining) {
+    struct h2_stream *s, *best = NULL;
+    size_t n;
+    bool fin;
+    for (s = h2->streams; s != NULL; s = s->next) {
+      if (!s->responded || s->window <= 0) continue;
+      if (best == NULL || s->vtime < best->vtime) best = s;
+    }
+    if ((s = best) == NULL) break;
+    if (s->ofs == s->end && s->st.pfn != NULL) h2_pull(c, h2, s);
+    n = s->end - s->ofs;
+    if (n > h2->frame_size) n = h2->frame_size;
+    if (n > (size_t) s->window) n = (size_t) s->window;
+    if (n > (size_t) h2->window) n = (size_t) h2->window;
+    fin = s->ofs + n == s->end && s->st.pfn == NULL;
+    if (n == 0 && !fin) break;  // Streamed response made no progress
+    h2_send(c, H2_DATA, fin ? H2_END_STREAM : 0, s->id, s->resp.buf + s->ofs,
+            n);
+    s->ofs += n, s->window -= (long) n, h2->window -= (long) n;
+    h2->vtime = s->vtime;
+    s->vtime += n * 256 / s->weight;
+    if (fin) h2_close(c, h2, s);
+  }
+  if (h2->goaway && h2->streams == NULL) c->is_draining = 1;
+}
+
+static void h2_free(struct mg_connection *c, struct h2conn *h2) {
+  while (h2->streams != NULL) h2_close(c, h2, h2->streams);
+  mg_iobuf_free(&h2->dec.buf);
+  mg_iobuf_free(&h2->enc.buf);
+  mg_iobuf_free(&h2->block);
+  mg_iobuf_free(&h2->fields);
+  free(h2);
+}
+
+static void h2_cb(struct mg_connection *c, int ev, void *ev_data,
+                  void *fn_data) {
+  struct h2conn *h2 = (struct h2conn *) fn_data;
+  if (ev == MG_EV_READ) {
+    size_t ofs = 0;
+    while (!c->is_draining && c->recv.len - ofs >= 9) {
+      const uint8_t *p = c->recv.buf + ofs;
+      size_t len = (size_t) p[0] << 16 | (size_t) p[1] << 8 | p[2];
+      if (len > H2_FRAME_SIZE) {
+        h2_error(c, h2, H2_FRAME_SIZE_ERROR);
+      } else if (c->recv.len - ofs >= 9 + len) {
+        uint32_t err =
+            h2_frame(c, h2, p[3], p[4], be32(p + 5) & 0x7fffffff, p + 9, len);
+        if (err != 0) h2_error(c, h2, err);
+        ofs += 9 + len;
+      } else {
+        break;
+      }
+    }
+    mg_iobuf_del(&c->recv, 0, ofs);
+    h2_flush(c, h2);
+  } else if (ev == MG_EV_POLL || ev == MG_EV_WRITE) {
+    h2_flush(c, h2);
+  } else if (ev == MG_EV_CLOSE) {
+    h2_free(c, h2);
+    c->pfn_data = NULL;
+  }
+  (void) ev_data;
+}
+
+// If the connection starts with the HTTP/2 connection preface, switch it
+// to HTTP/2. Return true if the received data is the preface or its part
+bool mg_http2_upgrade(struct mg_connection *c) {
+  size_t n = sizeof(s_preface) - 1;
+  struct h2conn *h2;
+  if (memcmp(c->recv.buf, s_preface, c->recv.len < n ? c->recv.len : n)) {
+    return false;
+  }
+  if (c->recv.len < n) return true;
+  if ((h2 = (struct h2conn *) calloc(1, sizeof(*h2))) == NULL) {
+    mg_error(c, "OOM");
+    return true;
+  }
+  h2->window = h2->init_window = H2_WINDOW;
+  h2->frame_size = H2_FRAME_SIZE;
+  h2->dec.max = h2->enc.max = H2_TABLE_SIZE;
+  mg_iobuf_del(&c->recv, 0, n);
+  // SETTINGS_MAX_CONCURRENT_STREAMS
+  h2_send32(c, H2_SETTINGS, 0, 3 << 16 | (MG_HTTP2_MAX_STREAMS >> 16),
+            (uint32_t) MG_HTTP2_MAX_STREAMS << 16, 6);
+  c->pfn = h2_cb, c->pfn_data = h2;
+  MG_DEBUG(("%lu switched to HTTP/2", c->id));
+  h2_cb(c, MG_EV_READ, NULL, h2);
+  return true;
+}
+#endif
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/iobuf.c"
 #endif
@@ -2437,6 +6197,7 @@ void mg_iobuf_free(struct mg_iobuf *io) {
 
 
 
+
 static const char *escapeseq(int esc) {
   return esc ? "\b\f\n\r\t\\\"" : "bfnrt\\\"";
 }
@@ -2449,14 +6210,128 @@ static char json_esc(int c, int esc) {
   return 0;
 }
 
+#if MG_ENABLE_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#define JSON_AVX2 1
+#elif MG_ENABLE_SIMD && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#elif MG_ENABLE_SIMD && MG_SIMD_NEON
+#include <arm_neon.h>
+#define JSON_NEON 1
+#endif
+
+#define JSON_IS_WS(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+#if defined(JSON_AVX2) || defined(JSON_SSE2)
+static int json_ctz(unsigned x) {
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  int n = 0;
+  while ((x & 1) == 0) x >>= 1, n++;
+  return n;
+#endif
+}
+#endif
+
+#if defined(JSON_NEON)
+// Narrow a 16-byte comparison result into 4 bits per byte
+static uint64_t json_neon_bits(uint8x16_t m) {
+  uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+#endif
+
+// Return the index of the first non-whitespace byte at or after i.
+// Most documents have single spaces, so look at two bytes before going wide
+static int json_skip_ws(const char *s, int i, int len) {
+  if (i < len && !JSON_IS_WS(s[i])) return i;
+  if (i + 1 < len && !JSON_IS_WS(s[i + 1])) return i + 1;
+#if defined(JSON_AVX2)
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    unsigned bits = ~(unsigned) _mm256_movemask_epi8(m);
+    if (bits != 0) return i + json_ctz(bits);
+  }
+#elif defined(JSON_SSE2)
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    unsigned bits = (unsigned) _mm_movemask_epi8(m) ^ 0xffffU;
+    if (bits != 0) return i + json_ctz(bits);
+  }
+#elif defined(JSON_NEON)
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) s + i);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                                     vceqq_u8(v, vdupq_n_u8('\t'))),
+                            vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                                     vceqq_u8(v, vdupq_n_u8('\r'))));
+    uint64_t bits = json_neon_bits(vmvnq_u8(m));
+    if (bits != 0) return i + __builtin_ctzll(bits) / 4;
+  }
+#endif
+  while (i < len && JSON_IS_WS(s[i])) i++;
+  return i;
+}
+
+// Return the index of the first quote, backslash or NUL, or len if none
+static int json_scan_str(const char *s, int len) {
+  int i = 0;
+#if defined(JSON_AVX2)
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+        _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    unsigned bits = (unsigned) _mm256_movemask_epi8(m);
+    if (bits != 0) return i + json_ctz(bits);
+  }
+#elif defined(JSON_SSE2)
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                     _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    unsigned bits = (unsigned) _mm_movemask_epi8(m);
+    if (bits != 0) return i + json_ctz(bits);
+  }
+#elif defined(JSON_NEON)
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) s + i);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                                     vceqq_u8(v, vdupq_n_u8('\\'))),
+                            vceqq_u8(v, vdupq_n_u8(0)));
+    uint64_t bits = json_neon_bits(m);
+    if (bits != 0) return i + __builtin_ctzll(bits) / 4;
+  }
+#endif
+  while (i < len && s[i] != '"' && s[i] != '\\' && s[i] != '\0') i++;
+  return i;
+}
+
 static int mg_pass_string(const char *s, int len) {
-  int i;
-  for (i = 0; i < len; i++) {
+  int i = 0;
+  while ((i += json_scan_str(s + i, len - i)) < len) {
     if (s[i] == '\\' && i + 1 < len && json_esc(s[i + 1], 1)) {
+      i += 2;
+    } else if (s[i] == '\\') {
       i++;
     } else if (s[i] == '\0') {
       return MG_JSON_INVALID;
-    } else if (s[i] == '"') {
+    } else {
       return i;
     }
   }
@@ -2504,7 +6379,10 @@ int mg_json_get(const char *s, int len, const char *path, int *toklen) {
 
   for (i = 0; i < len; i++) {
     unsigned char c = ((unsigned char *) s)[i];
-    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') continue;
+    if (JSON_IS_WS(c)) {
+      i = json_skip_ws(s, i, len) - 1;
+      continue;
+    }
     MG_DBGP('-');
     switch (expecting) {
       case S_VALUE:
@@ -2557,7 +6435,9 @@ int mg_json_get(const char *s, int len, const char *path, int *toklen) {
           if (n < 0) return n;
           // printf("K[%.*s] %d %d\n", n, &s[i + 1], depth, ed);
           if (depth == ed && path[pos - 1] == '.' &&
-              memcmp(&s[i + 1], &path[pos], (size_t) n) == 0) {
+              strncmp(&s[i + 1], &path[pos], (size_t) n) == 0 &&
+              (path[pos + n] == '\0' || path[pos + n] == '.' ||
+               path[pos + n] == '[')) {
             pos += n;
           }
           i += n + 1;
@@ -2592,9 +6472,143 @@ int mg_json_get(const char *s, int len, const char *path, int *toklen) {
         }
         break;
     }
-    MG_DBGP('E');
+    MG_DBGP('E');
+  }
+  return MG_JSON_NOT_FOUND;
+}
+
+// Return the length of a scalar value at s[0], or a negative error
+static int json_scalar(const char *s, int len, int *type) {
+  int n = 0;
+  if (s[0] == 't' && len > 3 && memcmp(s, "true", 4) == 0) {
+    *type = MG_JSON_TRUE, n = 4;
+  } else if (s[0] == 'f' && len > 4 && memcmp(s, "false", 5) == 0) {
+    *type = MG_JSON_FALSE, n = 5;
+  } else if (s[0] == 'n' && len > 3 && memcmp(s, "null", 4) == 0) {
+    *type = MG_JSON_NULL, n = 4;
+  } else if (s[0] == '-' || (s[0] >= '0' && s[0] <= '9')) {
+    mg_atod(s, len, &n);
+    *type = MG_JSON_NUMBER;
+  } else if (s[0] == '"') {
+    if ((n = mg_pass_string(s + 1, len - 1)) < 0) return n;
+    *type = MG_JSON_STRING, n += 2;
+  } else {
+    n = MG_JSON_INVALID;
+  }
+  return n;
+}
+
+int mg_json_index_init(struct mg_json_index *idx, struct mg_str json,
+                       struct mg_json_tok *toks, int max_toks) {
+  enum { S_VALUE, S_KEY, S_COLON, S_COMMA_OR_EOO } expecting = S_VALUE;
+  int stack[MG_JSON_MAX_DEPTH], last[MG_JSON_MAX_DEPTH];
+  int i, n = 0, depth = 0, kofs = 0, klen = 0, len = (int) json.len;
+  const char *s = json.ptr;
+
+  idx->json = json, idx->toks = toks, idx->num = 0;
+  for (i = 0; i < len; i++) {
+    unsigned char c = ((unsigned char *) s)[i];
+    if (JSON_IS_WS(c)) {
+      i = json_skip_ws(s, i, len) - 1;
+      continue;
+    }
+    if (expecting == S_VALUE && (c != ']' || depth == 0 ||
+                                 toks[stack[depth - 1]].size > 0)) {
+      struct mg_json_tok *t = &toks[n];
+      if (n > 0 && depth == 0) return MG_JSON_INVALID;  // Second root
+      if (n >= max_toks) return MG_JSON_TOO_MANY;
+      t->ofs = i, t->kofs = kofs, t->klen = klen;
+      t->parent = depth > 0 ? stack[depth - 1] : -1;
+      t->next = -1, t->size = 0;
+      kofs = klen = 0;
+      if (depth > 0) {
+        if (last[depth - 1] >= 0) toks[last[depth - 1]].next = n;
+        last[depth - 1] = n;
+        toks[stack[depth - 1]].size++;
+      }
+      if (c == '{' || c == '[') {
+        if (depth >= MG_JSON_MAX_DEPTH) return MG_JSON_TOO_DEEP;
+        t->type = c == '{' ? MG_JSON_OBJECT : MG_JSON_ARRAY;
+        last[depth] = -1, stack[depth++] = n++;
+        expecting = c == '{' ? S_KEY : S_VALUE;
+        continue;
+      }
+      if ((t->len = json_scalar(&s[i], len - i, &t->type)) < 0) return t->len;
+      i += t->len - 1, n++;
+      expecting = S_COMMA_OR_EOO;
+    } else if (expecting == S_KEY && c == '"') {
+      if ((klen = mg_pass_string(&s[i + 1], len - i - 1)) < 0) return klen;
+      kofs = i + 1, i += klen + 1;
+      expecting = S_COLON;
+    } else if (expecting == S_COLON && c == ':') {
+      expecting = S_VALUE;
+    } else if (expecting == S_COMMA_OR_EOO && depth > 0 && c == ',') {
+      expecting = toks[stack[depth - 1]].type == MG_JSON_OBJECT ? S_KEY
+                                                                : S_VALUE;
+    } else if (depth > 0 && (c == '}' || c == ']') &&
+               (expecting == S_COMMA_OR_EOO ||
+                (toks[stack[depth - 1]].size == 0 &&
+                 expecting == (c == '}' ? S_KEY : S_VALUE)))) {
+      struct mg_json_tok *t = &toks[stack[--depth]];
+      if (t->type != (c == '}' ? MG_JSON_OBJECT : MG_JSON_ARRAY)) {
+        return MG_JSON_INVALID;
+      }
+      t->len = i - t->ofs + 1;
+      expecting = S_COMMA_OR_EOO;
+    } else {
+      return MG_JSON_INVALID;
+    }
   }
-  return MG_JSON_NOT_FOUND;
+  if (n == 0 || depth > 0 || expecting != S_COMMA_OR_EOO) {
+    return MG_JSON_INVALID;
+  }
+  return idx->num = n;
+}
+
+// Walk down the token tree, one path component at a time
+int mg_json_index_find(const struct mg_json_index *idx, const char *path) {
+  const struct mg_json_tok *toks = idx->toks;
+  int i = 0, pos = 1;
+  if (path[0] != '$') return MG_JSON_INVALID;
+  if (idx->num <= 0) return MG_JSON_NOT_FOUND;
+  while (path[pos] != '\0') {
+    int child = toks[i].size > 0 ? i + 1 : -1;
+    if (path[pos] == '.') {
+      int n = 0;
+      pos++;
+      while (path[pos + n] != '\0' && path[pos + n] != '.' &&
+             path[pos + n] != '[') {
+        n++;
+      }
+      if (toks[i].type != MG_JSON_OBJECT) return MG_JSON_NOT_FOUND;
+      while (child >= 0 && (toks[child].klen != n ||
+                            memcmp(idx->json.ptr + toks[child].kofs,
+                                   &path[pos], (size_t) n) != 0)) {
+        child = toks[child].next;
+      }
+      pos += n;
+    } else if (path[pos] == '[') {
+      int k = 0;
+      for (pos++; path[pos] >= '0' && path[pos] <= '9'; pos++) {
+        k = k * 10 + path[pos] - '0';
+      }
+      if (path[pos++] != ']') return MG_JSON_INVALID;
+      if (toks[i].type != MG_JSON_ARRAY) return MG_JSON_NOT_FOUND;
+      while (child >= 0 && k-- > 0) child = toks[child].next;
+    } else {
+      return MG_JSON_INVALID;
+    }
+    if (child < 0) return MG_JSON_NOT_FOUND;
+    i = child;
+  }
+  return i;
+}
+
+struct mg_str mg_json_index_get(const struct mg_json_index *idx,
+                                const char *path) {
+  int i = mg_json_index_find(idx, path);
+  if (i < 0) return mg_str_n(NULL, 0);
+  return mg_str_n(idx->json.ptr + idx->toks[i].ofs, (size_t) idx->toks[i].len);
 }
 
 bool mg_json_get_num(struct mg_str json, const char *path, double *v) {
@@ -2689,6 +6703,124 @@ long mg_json_get_long(struct mg_str json, const char *path, long dflt) {
   return result;
 }
 
+void mg_json_writer_init(struct mg_json_writer *w, mg_pw_t fn, void *param) {
+  memset(w, 0, sizeof(*w));
+  w->fn = fn;
+  w->param = param;
+}
+
+// Once the writer has failed, nothing is written anymore
+static void jw(struct mg_json_writer *w, const char *buf, size_t len) {
+  if (!w->failed) w->fn(buf, len, w->param);
+}
+
+// Start a new value, putting a comma after the previous one
+static void jw_value(struct mg_json_writer *w) {
+  if (w->key) {
+    w->key = false;
+  } else if (w->depth > 0 && w->more[w->depth - 1]) {
+    jw(w, ",", 1);
+  }
+  if (w->depth > 0) w->more[w->depth - 1] = 1;
+}
+
+static void jw_quote(struct mg_json_writer *w, const char *s, size_t len) {
+  size_t i, j = 0;
+  char buf[8];
+  jw(w, "\"", 1);
+  for (i = 0; i < len; i++) {
+    unsigned char ch = (unsigned char) s[i];
+    if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+    if (i > j) jw(w, s + j, i - j);
+    if ((buf[1] = json_esc(ch, 1)) != 0) {
+      buf[0] = '\\';
+      jw(w, buf, 2);
+    } else {
+      jw(w, buf, mg_snprintf(buf, sizeof(buf), "\\u%04x", ch));
+    }
+    j = i + 1;
+  }
+  if (len > j) jw(w, s + j, len - j);
+  jw(w, "\"", 1);
+}
+
+// Too deep nesting fails the writer: commas can't be tracked past that
+static void jw_begin(struct mg_json_writer *w, const char *s) {
+  if (w->depth >= MG_JSON_MAX_DEPTH) w->failed = true;
+  jw_value(w);
+  jw(w, s, 1);
+  if (!w->failed) w->more[w->depth++] = 0;
+}
+
+static void jw_end(struct mg_json_writer *w, const char *s) {
+  if (w->depth > 0) w->depth--;
+  w->key = false;
+  jw(w, s, 1);
+}
+
+void mg_json_begin_object(struct mg_json_writer *w) {
+  jw_begin(w, "{");
+}
+
+void mg_json_end_object(struct mg_json_writer *w) {
+  jw_end(w, "}");
+}
+
+void mg_json_begin_array(struct mg_json_writer *w) {
+  jw_begin(w, "[");
+}
+
+void mg_json_end_array(struct mg_json_writer *w) {
+  jw_end(w, "]");
+}
+
+void mg_json_key(struct mg_json_writer *w, const char *key) {
+  jw_value(w);
+  jw_quote(w, key, strlen(key));
+  jw(w, ":", 1);
+  w->key = true;
+}
+
+void mg_json_strn(struct mg_json_writer *w, const char *str, size_t len) {
+  jw_value(w);
+  jw_quote(w, str, len);
+}
+
+void mg_json_str(struct mg_json_writer *w, const char *str) {
+  if (str == NULL) {
+    mg_json_null(w);
+  } else {
+    mg_json_strn(w, str, strlen(str));
+  }
+}
+
+static void jw_literal(struct mg_json_writer *w, const char *s, size_t len) {
+  jw_value(w);
+  jw(w, s, len);
+}
+
+void mg_json_num(struct mg_json_writer *w, double value) {
+  char buf[40];
+  if (value != value || value - value != 0.0) {
+    mg_json_null(w);  // NaN and infinities are not representable in JSON
+  } else {
+    jw_literal(w, buf, mg_dtoa(buf, sizeof(buf), value, 0));
+  }
+}
+
+void mg_json_int(struct mg_json_writer *w, int64_t value) {
+  char buf[24];
+  jw_literal(w, buf, mg_snprintf(buf, sizeof(buf), "%lld", value));
+}
+
+void mg_json_bool(struct mg_json_writer *w, bool value) {
+  jw_literal(w, value ? "true" : "false", value ? 4 : 5);
+}
+
+void mg_json_null(struct mg_json_writer *w) {
+  jw_literal(w, "null", 4);
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/log.c"
 #endif
@@ -2713,7 +6845,11 @@ static void logc(unsigned char c) {
 
 static void logs(const char *buf, size_t len) {
   size_t i;
-  for (i = 0; i < len; i++) logc(((unsigned char *) buf)[i]);
+  if (s_log_func == default_logger) {
+    fwrite(buf, 1, len, stdout);  // Default logger: write the whole span
+  } else {
+    for (i = 0; i < len; i++) logc(((unsigned char *) buf)[i]);
+  }
 }
 
 void mg_log_set(const char *spec) {
@@ -3282,6 +7418,402 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
+#define MQTT_MAX_LEVELS 64  // Subscription filter depth limit
+
+struct mg_mqtt_hent {
+  struct mg_mqtt_hent *next;  // Next entry in the same bucket
+  void *key;                  // Parent node for nodes, connection for peers
+  size_t hash;
+};
+
+struct mqtt_sub;
+
+// Trie node, one per distinct filter level. Level name follows the struct
+struct mqtt_node {
+  struct mg_mqtt_hent h;  // Must be first. Key is the parent node
+  struct mqtt_sub *subs;  // Subscriptions whose filter ends at this node
+  size_t kids;            // Number of child nodes
+  size_t len;             // Level name length
+};
+
+// Connection with at least one subscription
+struct mqtt_peer {
+  struct mg_mqtt_hent h;    // Must be first. Key is the connection
+  struct mqtt_sub *subs;    // All subscriptions of this connection
+  struct mqtt_peer *mnext;  // Next peer matching the current publish
+  uint64_t seq;             // Last publish that matched this connection
+  uint8_t qos;              // Max QoS of its subscriptions matching it
+};
+
+struct mqtt_sub {
+  struct mqtt_sub *next, *prev;  // Subscriptions at the same node
+  struct mqtt_sub *pnext;        // Subscriptions of the same peer
+  struct mqtt_node *node;
+  struct mqtt_peer *peer;
+  uint8_t qos;
+};
+
+static size_t mqtt_hash(void *key, const char *s, size_t n) {
+  uint64_t h = 14695981039346656037ULL;  // FNV-1a
+  const uint8_t *p = (const uint8_t *) &key;
+  size_t i;
+  for (i = 0; i < sizeof(key); i++) h = (h ^ p[i]) * 1099511628211ULL;
+  for (i = 0; i < n; i++) h = (h ^ (uint8_t) s[i]) * 1099511628211ULL;
+  return (size_t) (h ^ (h >> 32));
+}
+
+static bool mqtt_hadd(struct mg_mqtt_hent ***tab, size_t *size, size_t *count,
+                      struct mg_mqtt_hent *e) {
+  if (*count >= *size) {  // Keep load factor under 1, double on overflow
+    size_t i, n = *size == 0 ? 64 : *size * 2;
+    struct mg_mqtt_hent **t = (struct mg_mqtt_hent **) calloc(n, sizeof(*t));
+    if (t == NULL && *size == 0) return false;
+    for (i = 0; t != NULL && i < *size; i++) {
+      struct mg_mqtt_hent *x, *next;
+      for (x = (*tab)[i]; x != NULL; x = next) {
+        next = x->next;
+        x->next = t[x->hash & (n - 1)], t[x->hash & (n - 1)] = x;
+      }
+    }
+    if (t != NULL) free(*tab), *tab = t, *size = n;
+  }
+  e->next = (*tab)[e->hash & (*size - 1)];
+  (*tab)[e->hash & (*size - 1)] = e;
+  (*count)++;
+  return true;
+}
+
+static void mqtt_hdel(struct mg_mqtt_hent **tab, size_t size, size_t *count,
+                      struct mg_mqtt_hent *e) {
+  struct mg_mqtt_hent **p = &tab[e->hash & (size - 1)];
+  while (*p != NULL && *p != e) p = &(*p)->next;
+  if (*p != NULL) *p = e->next, (*count)--;
+}
+
+// Split topic at the first '/'. Return true if more levels follow
+static bool mqtt_level(struct mg_str *topic, struct mg_str *level) {
+  const char *s = (const char *) memchr(topic->ptr, '/', topic->len);
+  *level = *topic;
+  if (s == NULL) return false;
+  level->len = (size_t) (s - topic->ptr);
+  topic->ptr = s + 1, topic->len -= level->len + 1;
+  return true;
+}
+
+// Wildcards must take a whole level, and '#' must be the last level
+static bool mqtt_filter_ok(struct mg_str f) {
+  size_t i, levels = 1;
+  if (f.len == 0) return false;
+  for (i = 0; i < f.len; i++) {
+    bool start = i == 0 || f.ptr[i - 1] == '/';
+    bool end = i + 1 == f.len || f.ptr[i + 1] == '/';
+    if (f.ptr[i] == '/' && ++levels > MQTT_MAX_LEVELS) return false;
+    if (f.ptr[i] == '+' && (!start || !end)) return false;
+    if (f.ptr[i] == '#' && (!start || i + 1 != f.len)) return false;
+  }
+  return true;
+}
+
+static struct mqtt_node *mqtt_node_find(struct mg_mqtt_broker *b,
+                                        struct mqtt_node *parent,
+                                        struct mg_str name) {
+  struct mg_mqtt_hent *e;
+  size_t h;
+  if (b->nodes_count == 0) return NULL;
+  h = mqtt_hash(parent, name.ptr, name.len);
+  for (e = b->nodes[h & (b->nodes_size - 1)]; e != NULL; e = e->next) {
+    struct mqtt_node *n = (struct mqtt_node *) e;
+    if (e->hash == h && e->key == parent && n->len == name.len &&
+        memcmp(n + 1, name.ptr, name.len) == 0) {
+      return n;
+    }
+  }
+  return NULL;
+}
+
+static struct mqtt_node *mqtt_node_add(struct mg_mqtt_broker *b,
+                                       struct mqtt_node *parent,
+                                       struct mg_str name) {
+  struct mqtt_node *n = mqtt_node_find(b, parent, name);
+  if (n == NULL &&
+      (n = (struct mqtt_node *) calloc(1, sizeof(*n) + name.len)) != NULL) {
+    n->h.key = parent, n->h.hash = mqtt_hash(parent, name.ptr, name.len);
+    n->len = name.len;
+    memcpy(n + 1, name.ptr, name.len);
+    if (!mqtt_hadd(&b->nodes, &b->nodes_size, &b->nodes_count, &n->h)) {
+      free(n), n = NULL;
+    } else if (parent != NULL) {
+      parent->kids++;
+    }
+  }
+  return n;
+}
+
+// Remove nodes left with no subscriptions and no children, bottom up
+static void mqtt_node_prune(struct mg_mqtt_broker *b, struct mqtt_node *n) {
+  while (n != NULL && n->subs == NULL && n->kids == 0) {
+    struct mqtt_node *parent = (struct mqtt_node *) n->h.key;
+    mqtt_hdel(b->nodes, b->nodes_size, &b->nodes_count, &n->h);
+    free(n);
+    if (parent != NULL) parent->kids--;
+    n = parent;
+  }
+}
+
+static struct mqtt_peer *mqtt_peer_find(struct mg_mqtt_broker *b,
+                                        struct mg_connection *c) {
+  struct mg_mqtt_hent *e;
+  size_t h;
+  if (b->peers_count == 0) return NULL;
+  h = mqtt_hash(c, NULL, 0);
+  for (e = b->peers[h & (b->peers_size - 1)]; e != NULL; e = e->next) {
+    if (e->key == c) return (struct mqtt_peer *) e;
+  }
+  return NULL;
+}
+
+static struct mqtt_peer *mqtt_peer_add(struct mg_mqtt_broker *b,
+                                       struct mg_connection *c) {
+  struct mqtt_peer *p = mqtt_peer_find(b, c);
+  if (p == NULL && (p = (struct mqtt_peer *) calloc(1, sizeof(*p))) != NULL) {
+    p->h.key = c, p->h.hash = mqtt_hash(c, NULL, 0);
+    if (!mqtt_hadd(&b->peers, &b->peers_size, &b->peers_count, &p->h)) {
+      free(p), p = NULL;
+    }
+  }
+  return p;
+}
+
+static void mqtt_peer_prune(struct mg_mqtt_broker *b, struct mqtt_peer *p) {
+  if (p->subs != NULL) return;
+  mqtt_hdel(b->peers, b->peers_size, &b->peers_count, &p->h);
+  free(p);
+}
+
+static void mqtt_sub_del(struct mg_mqtt_broker *b, struct mqtt_sub *s) {
+  struct mqtt_sub **p = &s->peer->subs;
+  while (*p != s) p = &(*p)->pnext;
+  *p = s->pnext;
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    s->node->subs = s->next;
+  }
+  if (s->next != NULL) s->next->prev = s->prev;
+  mqtt_node_prune(b, s->node);
+  b->subs--;
+  free(s);
+}
+
+void mg_mqtt_broker_init(struct mg_mqtt_broker *b) {
+  memset(b, 0, sizeof(*b));
+}
+
+void mg_mqtt_broker_free(struct mg_mqtt_broker *b) {
+  size_t i;
+  for (i = 0; i < b->peers_size; i++) {
+    while (b->peers[i] != NULL) {
+      mg_mqtt_broker_drop(b, (struct mg_connection *) b->peers[i]->key);
+    }
+  }
+  free(b->nodes);
+  free(b->peers);
+  memset(b, 0, sizeof(*b));
+}
+
+bool mg_mqtt_broker_sub(struct mg_mqtt_broker *b, struct mg_connection *c,
+                        struct mg_str topic, int qos) {
+  struct mqtt_node *n = NULL, *parent = NULL;
+  struct mqtt_peer *peer = NULL;
+  struct mqtt_sub *s = NULL;
+  struct mg_str t = topic, level;
+  bool more = true;
+  if (!mqtt_filter_ok(topic)) return false;
+  while (more) {
+    more = mqtt_level(&t, &level);
+    if ((n = mqtt_node_add(b, parent, level)) == NULL) break;
+    parent = n;
+  }
+  if (n != NULL) peer = mqtt_peer_add(b, c);
+  if (peer != NULL) {
+    s = peer->subs;
+    while (s != NULL && s->node != n) s = s->pnext;  // Same filter replaces
+  }
+  if (peer != NULL && s == NULL &&
+      (s = (struct mqtt_sub *) calloc(1, sizeof(*s))) != NULL) {
+    s->node = n, s->peer = peer;
+    s->next = n->subs, s->pnext = peer->subs;
+    if (n->subs != NULL) n->subs->prev = s;
+    n->subs = s, peer->subs = s;
+    b->subs++;
+  }
+  if (s == NULL) {
+    if (peer != NULL) mqtt_peer_prune(b, peer);
+    mqtt_node_prune(b, parent);
+    return false;
+  }
+  s->qos = (uint8_t) (qos < 0 ? 0 : qos > 2 ? 2 : qos);
+  return true;
+}
+
+bool mg_mqtt_broker_unsub(struct mg_mqtt_broker *b, struct mg_connection *c,
+                          struct mg_str topic) {
+  struct mqtt_peer *peer = mqtt_peer_find(b, c);
+  struct mqtt_node *n = NULL;
+  struct mqtt_sub *s = NULL;
+  struct mg_str t = topic, level;
+  bool more = true;
+  while (peer != NULL && more) {
+    more = mqtt_level(&t, &level);
+    if ((n = mqtt_node_find(b, n, level)) == NULL) break;
+  }
+  if (n != NULL) {
+    s = peer->subs;
+    while (s != NULL && s->node != n) s = s->pnext;
+  }
+  if (s == NULL) return false;
+  mqtt_sub_del(b, s);
+  mqtt_peer_prune(b, peer);
+  return true;
+}
+
+void mg_mqtt_broker_drop(struct mg_mqtt_broker *b, struct mg_connection *c) {
+  struct mqtt_peer *peer = mqtt_peer_find(b, c);
+  if (peer == NULL) return;
+  while (peer->subs != NULL) mqtt_sub_del(b, peer->subs);
+  mqtt_peer_prune(b, peer);
+}
+
+// Add peers of subscriptions at node n to the match list, once per publish.
+// A peer matching several filters gets the highest of their QoS levels
+static void mqtt_match(struct mg_mqtt_broker *b, struct mqtt_node *n,
+                       struct mqtt_peer **list) {
+  struct mqtt_sub *s;
+  for (s = n == NULL ? NULL : n->subs; s != NULL; s = s->next) {
+    struct mqtt_peer *p = s->peer;
+    if (p->seq != b->seq) {
+      p->seq = b->seq, p->qos = s->qos;
+      p->mnext = *list, *list = p;
+    } else if (s->qos > p->qos) {
+      p->qos = s->qos;
+    }
+  }
+}
+
+// Match remaining topic levels against exact, '+' and '#' children of parent.
+// Every call visits a distinct node, so the cost is bounded by the trie size
+static void mqtt_route(struct mg_mqtt_broker *b, struct mqtt_node *parent,
+                       struct mg_str rest, struct mqtt_peer **list) {
+  struct mg_str level, plus = mg_str_n("+", 1), hash = mg_str_n("#", 1);
+  bool more = mqtt_level(&rest, &level);
+  // Wildcards at the first level do not match topics starting with '$'
+  bool wild = parent != NULL || level.len == 0 || level.ptr[0] != '$';
+  struct mqtt_node *n[2];
+  size_t i;
+  n[0] = mqtt_node_find(b, parent, level);
+  n[1] = wild ? mqtt_node_find(b, parent, plus) : NULL;
+  for (i = 0; i < 2; i++) {
+    if (n[i] == NULL) continue;
+    if (more) {
+      mqtt_route(b, n[i], rest, list);
+    } else {  // "a/#" matches "a" as well
+      mqtt_match(b, n[i], list);
+      mqtt_match(b, mqtt_node_find(b, n[i], hash), list);
+    }
+  }
+  if (wild) mqtt_match(b, mqtt_node_find(b, parent, hash), list);
+}
+
+size_t mg_mqtt_broker_pub(struct mg_mqtt_broker *b, struct mg_str topic,
+                          struct mg_str data, int qos) {
+  struct mqtt_peer *p, *list = NULL;
+  size_t count = 0;
+  if (topic.len == 0 || b->nodes_count == 0 ||
+      memchr(topic.ptr, '+', topic.len) != NULL ||
+      memchr(topic.ptr, '#', topic.len) != NULL) {
+    return 0;
+  }
+  if (qos < 0) qos = 0;
+  if (qos > 2) qos = 2;
+  b->seq++;
+  mqtt_route(b, NULL, topic, &list);
+  for (p = list; p != NULL; p = p->mnext) {
+    struct mg_connection *c = (struct mg_connection *) p->h.key;
+    if (c->is_closing) continue;
+    mg_mqtt_pub(c, topic, data, qos < p->qos ? qos : p->qos, false);
+    count++;
+  }
+  return count;
+}
+
+// Offset of the variable header, which follows the fixed header
+static size_t mqtt_vh_ofs(const struct mg_mqtt_message *mm) {
+  size_t i = 1;
+  while (i < mm->dgram.len && (((uint8_t) mm->dgram.ptr[i]) & 0x80)) i++;
+  return i + 1;
+}
+
+// SUBSCRIBE and UNSUBSCRIBE topics start after fixed header and message ID
+static size_t mqtt_topics_ofs(const struct mg_mqtt_message *mm) {
+  return mqtt_vh_ofs(mm) + 2;
+}
+
+// CONNECT variable header starts with protocol name and level, 3.1.2.1
+static bool mqtt_connect_ok(const struct mg_mqtt_message *mm) {
+  size_t ofs = mqtt_vh_ofs(mm);
+  return ofs + 7 <= mm->dgram.len &&
+         memcmp(mm->dgram.ptr + ofs, "\x00\x04MQTT\x04", 7) == 0;
+}
+
+void mg_mqtt_broker_handle(struct mg_mqtt_broker *b, struct mg_connection *c,
+                           int ev, void *ev_data) {
+  struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
+  struct mg_str topic;
+  size_t pos, n = 0;
+  uint8_t qos, resp[2] = {0, 0};
+  if (ev == MG_EV_CLOSE) mg_mqtt_broker_drop(b, c);
+  if (ev != MG_EV_MQTT_CMD) return;
+  switch (mm->cmd) {
+    case MQTT_CMD_CONNECT:
+      if (!mqtt_connect_ok(mm)) resp[1] = 1;  // Unacceptable version
+      mg_mqtt_send_header(c, MQTT_CMD_CONNACK, 0, sizeof(resp));
+      mg_send(c, resp, sizeof(resp));
+      if (resp[1] != 0) c->is_draining = 1;
+      break;
+    case MQTT_CMD_SUBSCRIBE:
+      for (pos = mqtt_topics_ofs(mm); pos > 0;) {
+        if ((pos = mg_mqtt_next_sub(mm, &topic, &qos, pos)) > 0) n++;
+      }
+      mg_mqtt_send_header(c, MQTT_CMD_SUBACK, 0, (uint32_t) (n + 2));
+      mg_send_u16(c, mg_htons(mm->id));
+      for (pos = mqtt_topics_ofs(mm); pos > 0;) {
+        if ((pos = mg_mqtt_next_sub(mm, &topic, &qos, pos)) == 0) break;
+        if (qos > 1) qos = 1;  // QoS 2 is granted as QoS 1
+        if (!mg_mqtt_broker_sub(b, c, topic, qos)) qos = 0x80;
+        mg_send(c, &qos, sizeof(qos));
+      }
+      break;
+    case MQTT_CMD_UNSUBSCRIBE:
+      for (pos = mqtt_topics_ofs(mm); pos > 0;) {
+        if ((pos = mg_mqtt_next_unsub(mm, &topic, pos)) > 0) {
+          mg_mqtt_broker_unsub(b, c, topic);
+        }
+      }
+      mg_mqtt_send_header(c, MQTT_CMD_UNSUBACK, 0, 2);
+      mg_send_u16(c, mg_htons(mm->id));
+      break;
+    case MQTT_CMD_PUBLISH:
+      mg_mqtt_broker_pub(b, mm->topic, mm->data, mm->qos);
+      break;
+    case MQTT_CMD_PINGREQ:
+      mg_mqtt_pong(c);
+      break;
+    case MQTT_CMD_DISCONNECT:
+      c->is_draining = 1;
+      break;
+  }
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/net.c"
 #endif
@@ -3296,7 +7828,7 @@ size_t mg_vprintf(struct mg_connection *c, const char *fmt, va_list ap) {
   size_t old = c->send.len;
   va_list tmp;
   va_copy(tmp, ap);
-  mg_vrprintf(mg_putchar_iobuf, &c->send, fmt, &tmp);
+  mg_vwprintf(mg_write_iobuf, &c->send, fmt, &tmp);
   return c->send.len - old;
 }
 
@@ -3425,6 +7957,55 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
          mg_aton6(str, addr);
 }
 
+// Relay data received by a bridged connection to its peer. Sockets-based
+// builds splice() plain TCP data instead, see sock.c
+static void bridge_cb(struct mg_connection *c, int ev, void *ev_data,
+                      void *fn_data) {
+  struct mg_bridge *br = (struct mg_bridge *) fn_data;
+  struct mg_connection *p = br == NULL ? NULL : br->peer;
+  if (br == NULL) {
+    // Bridge is gone
+  } else if (ev == MG_EV_READ && p != NULL) {
+    mg_send(p, c->recv.buf, c->recv.len);
+    c->recv.len = 0;
+    if (p->send.len >= br->max_pending) c->is_full = 1;
+  } else if ((ev == MG_EV_WRITE || ev == MG_EV_POLL) && p != NULL) {
+    struct mg_bridge *pb = (struct mg_bridge *) p->pfn_data;
+    if (!pb->eof && br->piped == 0 && c->send.len < br->max_pending) {
+      p->is_full = 0;
+    }
+  } else if (ev == MG_EV_POLL) {
+    c->is_draining = 1;  // Peer has gone, send what's left and close
+  } else if (ev == MG_EV_CLOSE) {
+    if (p != NULL) ((struct mg_bridge *) p->pfn_data)->peer = NULL;
+    c->pfn_data = NULL;
+    free(br);
+  }
+  (void) ev_data;
+}
+
+bool mg_bridge(struct mg_connection *a, struct mg_connection *b,
+               size_t max_pending) {
+  struct mg_bridge *ba = (struct mg_bridge *) calloc(1, sizeof(*ba));
+  struct mg_bridge *bb = (struct mg_bridge *) calloc(1, sizeof(*bb));
+  if (ba == NULL || bb == NULL) {
+    free(ba), free(bb);
+    return false;
+  }
+  if (max_pending == 0) max_pending = 32 * MG_IO_SIZE;
+  ba->peer = b, bb->peer = a;
+  ba->max_pending = bb->max_pending = max_pending;
+  ba->pipe[0] = ba->pipe[1] = bb->pipe[0] = bb->pipe[1] = -1;
+  a->pfn = b->pfn = bridge_cb;
+  a->pfn_data = ba, b->pfn_data = bb;
+  a->is_bridged = b->is_bridged = 1;
+  a->is_full = b->is_full = 0;
+  // Relay data that is already received
+  if (a->recv.len > 0) mg_send(b, a->recv.buf, a->recv.len), a->recv.len = 0;
+  if (b->recv.len > 0) mg_send(a, b->recv.buf, b->recv.len), b->recv.len = 0;
+  return true;
+}
+
 struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
   struct mg_connection *c =
       (struct mg_connection *) calloc(1, sizeof(*c) + mgr->extraconnsize);
@@ -3446,6 +8027,7 @@ void mg_close_conn(struct mg_connection *c) {
   MG_DEBUG(("%lu closed", c->id));
 
   mg_tls_free(c);
+  if (c->pfree != NULL) c->pfree(c);
   mg_iobuf_free(&c->recv);
   mg_iobuf_free(&c->send);
   memset(c, 0, sizeof(*c));
@@ -3545,6 +8127,387 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
 }
 
+#ifdef MG_ENABLE_LINES
+#line 1 "src/proxy.c"
+#endif
+
+
+
+
+// A request in flight, shared by the client and upstream connections
+struct session {
+  struct session *next;
+  struct mg_proxy *proxy;
+  struct mg_proxy_upstream *up;    // Chosen upstream
+  struct mg_connection *client;    // Client connection, NULL when closed
+  struct mg_connection *upstream;  // Upstream connection, NULL until opened
+  mg_event_handler_t fn;           // Client's handler, restored afterwards
+  void *fn_data;                   // Client's handler data
+  struct mg_iobuf out;             // Request data waiting for the upstream
+  uint64_t started;                // When the request was forwarded
+  size_t req_left;                 // Request body bytes yet to receive
+  size_t resp_left;                // Response body bytes yet to receive
+  bool http10;                     // Client speaks HTTP/1.0
+  bool head;                       // HEAD request
+  bool req_chunked;                // Request body is chunked
+  bool req_done;                   // Request body is fully received
+  bool resp_started;               // Response headers are sent to the client
+  bool resp_chunked;               // Response body is chunked
+  bool resp_eof;                   // Response body ends when upstream closes
+  bool close;                      // Close the client after the response
+};
+
+static bool hop_by_hop(struct mg_str name) {
+  static const char *names[] = {"Connection", "Keep-Alive", "Proxy-Connection",
+                                "TE",         "Trailer",    "Upgrade",
+                                "Transfer-Encoding"};
+  size_t i;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (mg_vcasecmp(&name, names[i]) == 0) return true;
+  }
+  return false;
+}
+
+// Iterate over header lines of the raw head, `*p` starts as NULL. Iterate
+// over the raw head rather than hm->headers, which holds MG_MAX_HTTP_HEADERS
+// only. Lines without a colon are skipped
+static bool next_header(struct mg_str head, const char **p, struct mg_str *line,
+                        struct mg_str *name) {
+  const char *end = head.ptr + head.len;
+  if (*p == NULL) {
+    *p = (const char *) memchr(head.ptr, '\n', head.len);
+    *p = *p == NULL ? end : *p + 1;
+  }
+  while (*p < end) {
+    const char *e = (const char *) memchr(*p, '\n', (size_t) (end - *p)), *le,
+               *x;
+    if (e == NULL) e = end;
+    le = e > *p && e[-1] == '\r' ? e - 1 : e;
+    if (le == *p) break;  // Empty line, end of headers
+    x = (const char *) memchr(*p, ':', (size_t) (le - *p));
+    *line = mg_str_n(*p, (size_t) (le - *p));
+    *p = e + 1;
+    if (x != NULL) {
+      *name = mg_strstrip(mg_str_n(line->ptr, (size_t) (x - line->ptr)));
+      return true;
+    }
+  }
+  return false;
+}
+
+// Headers named in the Connection header are hop-by-hop too
+static bool connection_listed(struct mg_str head, struct mg_str name) {
+  struct mg_str line, k, v, tok;
+  const char *p = NULL, *x;
+  while (next_header(head, &p, &line, &k)) {
+    if (mg_vcasecmp(&k, "Connection") != 0) continue;
+    x = (const char *) memchr(line.ptr, ':', line.len) + 1;
+    v = mg_str_n(x, line.len - (size_t) (x - line.ptr));
+    while (mg_commalist(&v, &tok, NULL)) {
+      tok = mg_strstrip(tok);
+      if (tok.len == name.len && mg_ncasecmp(tok.ptr, name.ptr, tok.len) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Copy header lines of the message, except hop-by-hop headers. When the
+// body is re-framed as chunked, Content-Length is dropped too: a message
+// with both is a smuggling vector, RFC 9112 6.3
+static void copy_headers(struct mg_iobuf *io, struct mg_str head,
+                         bool chunked) {
+  struct mg_str line, name;
+  const char *p = NULL;
+  while (next_header(head, &p, &line, &name)) {
+    if (hop_by_hop(name) || connection_listed(head, name)) continue;
+    if (chunked && mg_vcasecmp(&name, "Content-Length") == 0) continue;
+    mg_iobuf_add(io, io->len, line.ptr, line.len, MG_IO_SIZE);
+    mg_iobuf_add(io, io->len, "\r\n", 2, MG_IO_SIZE);
+  }
+}
+
+static uint32_t score(struct mg_connection *c, struct mg_proxy_upstream *u) {
+  uint32_t crc = c->rem.is_ip6
+                     ? mg_crc32(0, (char *) c->rem.ip6, sizeof(c->rem.ip6))
+                     : mg_crc32(0, (char *) &c->rem.ip, sizeof(c->rem.ip));
+  return mg_crc32(crc, u->url, strlen(u->url));
+}
+
+// Choose an upstream, skipping those marked down. If all upstreams are down,
+// try them anyway rather than fail every request. Hashing uses highest random
+// weight, so a client stays on the same upstream while it is up, and removing
+// an upstream moves only the clients that were on it
+static struct mg_proxy_upstream *choose(struct mg_proxy *p,
+                                        struct mg_connection *c) {
+  struct mg_proxy_upstream *best = NULL;
+  uint64_t now = mg_millis();
+  uint32_t best_score = 0;
+  size_t i, n = p->num_upstreams;
+  int pass;
+  for (pass = 0; pass < 2 && best == NULL; pass++) {
+    for (i = 0; i < n; i++) {
+      size_t idx = p->balance == MG_PROXY_ROUND_ROBIN ? (p->next + i) % n : i;
+      struct mg_proxy_upstream *u = &p->upstreams[idx];
+      if (pass == 0 && u->down_until > now) continue;
+      if (p->balance == MG_PROXY_LEAST_CONN) {
+        if (best == NULL || u->active < best->active) best = u;
+      } else if (p->balance == MG_PROXY_HASH) {
+        uint32_t s = score(c, u);
+        if (best == NULL || s > best_score) best = u, best_score = s;
+      } else {
+        p->next = idx + 1;
+        best = u;
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+// Request data goes directly to the upstream when it is opened, or waits
+static struct mg_iobuf *outbuf(struct session *s) {
+  return s->upstream == NULL ? &s->out : &s->upstream->send;
+}
+
+static void send_body(struct session *s, const char *buf, size_t len) {
+  struct mg_iobuf *io = outbuf(s);
+  if (s->req_chunked) {
+    mg_rprintf(mg_putchar_iobuf, io, "%lx\r\n", (unsigned long) len);
+  }
+  mg_iobuf_add(io, io->len, buf, len, MG_IO_SIZE);
+  if (s->req_chunked) mg_iobuf_add(io, io->len, "\r\n", 2, MG_IO_SIZE);
+  if (s->client != NULL && !s->req_done) {
+    s->client->is_full = io->len > s->proxy->max_pending;
+  }
+}
+
+static void finish(struct session *s, bool reuse) {
+  struct mg_connection *c = s->client, *u = s->upstream;
+  if (u != NULL) {
+    if (!reuse || !s->req_done) u->is_closing = 1;
+    u->is_full = 0;
+    mg_http_pool_release(u);
+  }
+  if (c != NULL) {
+    c->fn = s->fn, c->fn_data = s->fn_data, c->is_full = 0;
+    if (s->close || !s->req_done) c->is_draining = 1;
+  }
+  s->up->active--;
+  LIST_DELETE(struct session, (struct session **) &s->proxy->sessions, s);
+  mg_iobuf_free(&s->out);
+  free(s);
+}
+
+// Upstream has failed. Mark it down after too many failures in a row
+static void fail(struct session *s, int code, const char *reason) {
+  struct mg_proxy_upstream *u = s->up;
+  MG_ERROR(("%s: %s", u->url, reason));
+  if (++u->fails >= s->proxy->max_fails && s->proxy->max_fails > 0) {
+    u->down_until = mg_millis() + s->proxy->fail_ms;
+  }
+  if (s->client != NULL && s->resp_started) {
+    s->close = true;  // Response is cut short, client can see that
+  } else if (s->client != NULL) {
+    mg_http_reply(s->client, code, "", "%s\n", reason);
+  }
+  finish(s, false);
+}
+
+static bool rechunk(struct session *s) {
+  return s->resp_chunked && !s->http10;
+}
+
+// Status line and end-to-end headers of the upstream response
+static void relay_head(struct mg_connection *c, struct mg_http_message *hm,
+                       bool chunked) {
+  mg_printf(c, "HTTP/1.1 %d %.*s\r\n", mg_http_status(hm),
+            (int) hm->proto.len, hm->proto.ptr);
+  copy_headers(&c->send, hm->head, chunked);
+}
+
+static void send_head(struct session *s, struct mg_http_message *hm) {
+  struct mg_connection *c = s->client;
+  struct mg_str *te = mg_http_get_header(hm, "Transfer-Encoding");
+  struct mg_str *cl = mg_http_get_header(hm, "Content-Length");
+  s->resp_started = true;
+  s->up->fails = 0;
+  s->resp_chunked = te != NULL && mg_vcasecmp(te, "chunked") == 0;
+  s->resp_eof = !s->resp_chunked && cl == NULL;
+  s->resp_left = hm->body.len;
+  // HTTP/1.0 clients do not understand chunks: send raw body and close
+  if (s->resp_eof || (s->resp_chunked && s->http10)) s->close = true;
+  if (c == NULL) return;
+  relay_head(c, hm, s->resp_chunked);
+  mg_printf(c, "%s%s\r\n", rechunk(s) ? "Transfer-Encoding: chunked\r\n" : "",
+            s->close ? "Connection: close\r\n" : "");
+}
+
+// 1xx responses other than 101 Switching Protocols precede the final one
+static bool interim(void *ev_data) {
+  int status = mg_http_status((struct mg_http_message *) ev_data);
+  return status >= 100 && status < 200 && status != 101;
+}
+
+static void upstream_cb(struct mg_connection *c, int ev, void *ev_data,
+                        void *fn_data) {
+  struct session *s = (struct session *) fn_data;
+  if (ev == MG_EV_OPEN || ev == MG_EV_CONNECT) {
+    if (s->upstream == NULL) {
+      s->upstream = c;
+      mg_send(c, s->out.buf, s->out.len);
+      mg_iobuf_free(&s->out);
+    }
+    if (s->client == NULL) finish(s, false);  // Client has gone meanwhile
+  } else if (ev == MG_EV_HTTP_MSG && interim(ev_data)) {
+    // Interim response, like 100 Continue. Relay it, except to HTTP/1.0
+    // clients which do not expect it, and keep waiting for the final one
+    if (s->client != NULL && !s->http10) {
+      relay_head(s->client, (struct mg_http_message *) ev_data, false);
+      mg_send(s->client, "\r\n", 2);
+    }
+    s->started = mg_millis();
+  } else if (ev == MG_EV_HTTP_MSG || ev == MG_EV_HTTP_CHUNK) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_str body = ev == MG_EV_HTTP_MSG ? hm->body : hm->chunk;
+    int status = mg_http_status(hm);
+    bool nobody = s->head || status == 204 || status == 304 || status < 200;
+    bool last = ev == MG_EV_HTTP_MSG;
+    if (!s->resp_started) send_head(s, hm);
+    if (s->client != NULL && !nobody && body.len > 0) {
+      if (rechunk(s)) {
+        mg_http_write_chunk(s->client, body.ptr, body.len);
+      } else {
+        mg_send(s->client, body.ptr, body.len);
+      }
+    }
+    if (ev == MG_EV_HTTP_CHUNK) {
+      // Non-chunked body can start with an empty chunk, so count bytes
+      if (s->resp_chunked) {
+        last = body.len == 0;
+      } else if (!s->resp_eof) {
+        last = (s->resp_left -= body.len) == 0;
+      }
+      mg_http_delete_chunk(c, hm);
+    }
+    if (last) {
+      if (s->client != NULL && rechunk(s)) mg_send(s->client, "0\r\n\r\n", 5);
+      finish(s, true);
+    } else if (nobody || s->client == NULL) {
+      finish(s, false);  // Parser may still expect a body, do not reuse
+    } else {
+      c->is_full = s->client->send.len > s->proxy->max_pending;
+    }
+  } else if (ev == MG_EV_POLL && !s->resp_started && s->proxy->timeout_ms > 0 &&
+             mg_millis() - s->started > s->proxy->timeout_ms) {
+    fail(s, 504, "timeout");
+  } else if ((ev == MG_EV_POLL || ev == MG_EV_WRITE) && s->client != NULL &&
+             c->send.len <= s->proxy->max_pending && !s->req_done) {
+    s->client->is_full = 0;
+  } else if (ev == MG_EV_ERROR) {
+    fail(s, 502, (char *) ev_data);
+  } else if (ev == MG_EV_CLOSE && s->resp_started && s->resp_eof) {
+    finish(s, false);  // Body is delimited by close
+  } else if (ev == MG_EV_CLOSE) {
+    fail(s, 502, "upstream closed");
+  }
+}
+
+static void client_cb(struct mg_connection *c, int ev, void *ev_data,
+                      void *fn_data) {
+  struct session *s = (struct session *) fn_data;
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  if (ev == MG_EV_HTTP_CHUNK && !s->req_done) {
+    if (s->req_chunked) {
+      s->req_done = hm->chunk.len == 0;
+    } else {
+      s->req_done = (s->req_left -= hm->chunk.len) == 0;
+    }
+    send_body(s, hm->chunk.ptr, hm->chunk.len);
+    mg_http_delete_chunk(c, hm);
+  } else if (ev == MG_EV_HTTP_MSG && !s->req_done && !s->req_chunked) {
+    // Only empty chunks were seen, e.g. the client has waited for
+    // 100 Continue, and then the whole body has arrived at once
+    s->req_done = true;
+    send_body(s, hm->body.ptr, hm->body.len);
+  } else if (ev == MG_EV_HTTP_MSG ||
+             (ev == MG_EV_HTTP_CHUNK && hm->chunk.len > 0)) {
+    s->close = true;  // Pipelined request, we can't queue it
+  } else if ((ev == MG_EV_POLL || ev == MG_EV_WRITE) && s->upstream != NULL &&
+             c->send.len <= s->proxy->max_pending) {
+    s->upstream->is_full = 0;
+  } else if (ev == MG_EV_CLOSE) {
+    mg_event_handler_t fn = s->fn;
+    void *fnd = s->fn_data;
+    c->fn = fn, c->fn_data = fnd;
+    s->client = NULL;
+    // If the upstream is not opened yet, the session ends when it is
+    if (s->upstream != NULL) finish(s, false);
+    if (fn != NULL) fn(c, ev, ev_data, fnd);
+  }
+}
+
+void mg_proxy_init(struct mg_proxy *p, struct mg_mgr *mgr,
+                   struct mg_proxy_upstream *upstreams, size_t num_upstreams,
+                   int balance) {
+  memset(p, 0, sizeof(*p));
+  mg_http_pool_init(&p->pool, mgr, 0, 30000);
+  p->upstreams = upstreams, p->num_upstreams = num_upstreams;
+  p->balance = balance;
+  p->max_fails = 3, p->fail_ms = 10000;
+  p->max_pending = 16 * MG_IO_SIZE;
+}
+
+void mg_proxy_free(struct mg_proxy *p) {
+  while (p->sessions != NULL) finish((struct session *) p->sessions, false);
+  mg_http_pool_free(&p->pool);
+}
+
+bool mg_proxy_forward(struct mg_proxy *p, struct mg_connection *c, int ev,
+                      struct mg_http_message *hm) {
+  struct mg_proxy_upstream *up = choose(p, c);
+  struct mg_str *te = mg_http_get_header(hm, "Transfer-Encoding");
+  struct mg_str *conn = mg_http_get_header(hm, "Connection");
+  const char *end = hm->query.len > 0 ? hm->query.ptr + hm->query.len
+                                      : hm->uri.ptr + hm->uri.len;
+  struct session *s;
+  char ip[50];
+  if (up == NULL || (s = (struct session *) calloc(1, sizeof(*s))) == NULL) {
+    return false;
+  }
+  s->proxy = p, s->up = up, s->client = c;
+  s->fn = c->fn, s->fn_data = c->fn_data;
+  s->started = mg_millis();
+  s->http10 = mg_vcasecmp(&hm->proto, "HTTP/1.0") == 0;
+  s->head = mg_vcasecmp(&hm->method, "HEAD") == 0;
+  s->req_chunked = te != NULL && mg_vcasecmp(te, "chunked") == 0;
+  s->req_left = hm->body.len;
+  s->close = s->http10 ? conn == NULL || mg_vcasecmp(conn, "keep-alive") != 0
+                       : conn != NULL && mg_vcasecmp(conn, "close") == 0;
+  mg_rprintf(mg_putchar_iobuf, &s->out, "%.*s %.*s HTTP/1.1\r\n",
+             (int) hm->method.len, hm->method.ptr, (int) (end - hm->uri.ptr),
+             hm->uri.ptr);
+  copy_headers(&s->out, hm->head, s->req_chunked);
+  mg_rprintf(mg_putchar_iobuf, &s->out, "X-Forwarded-For: %s\r\n%s\r\n",
+             mg_ntoa(&c->rem, ip, sizeof(ip)),
+             s->req_chunked ? "Transfer-Encoding: chunked\r\n" : "");
+  c->fn = client_cb, c->fn_data = s;
+  LIST_ADD_HEAD(struct session, (struct session **) &p->sessions, s);
+  up->active++;
+  if (ev == MG_EV_HTTP_MSG) {
+    s->req_done = true;
+    send_body(s, hm->body.ptr, hm->body.len);
+    if (s->req_chunked) send_body(s, "", 0);
+  } else {
+    client_cb(c, ev, hm, s);  // Request body is streamed
+  }
+  if (!mg_http_pool_connect(&p->pool, up->url, upstream_cb, s)) {
+    fail(s, 502, "connect failed");
+  }
+  return true;
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/sha1.c"
 #endif
@@ -3865,6 +8828,9 @@ typedef unsigned long nfds_t;
 #ifndef SO_EXCLUSIVEADDRUSE
 #define SO_EXCLUSIVEADDRUSE ((int) (~SO_REUSEADDR))
 #endif
+#ifndef SHUT_WR
+#define SHUT_WR SD_SEND
+#endif
 #elif MG_ARCH == MG_ARCH_FREERTOS_TCP
 #define MG_SOCK_ERRNO errno
 typedef Socket_t SOCKET;
@@ -3892,6 +8858,13 @@ typedef int SOCKET;
 #define AF_INET6 10
 #endif
 
+#if MG_ENABLE_SPLICE && !defined(SPLICE_F_NONBLOCK)
+// <fcntl.h> declares splice() only if _GNU_SOURCE is defined
+extern ssize_t splice(int, void *, int, void *, size_t, unsigned int);
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#endif
+
 union usa {
   struct sockaddr sa;
   struct sockaddr_in sin;
@@ -4124,12 +9097,135 @@ static long mg_sock_recv(struct mg_connection *c, void *buf, size_t len) {
   return n == 0 ? -1 : n < 0 && mg_sock_would_block() ? 0 : n;
 }
 
+// Number of bytes in the splice() pipe of a bridged connection
+static size_t bridge_pending(const struct mg_connection *c) {
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  return c->is_bridged && br != NULL ? br->piped : 0;
+}
+
+// Send data from the pipe to the socket, bypassing user space
+static void bridge_write(struct mg_connection *c) {
+#if MG_ENABLE_SPLICE
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  long n = (long) splice(br->pipe[0], NULL, FD(c), NULL, br->piped,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n > 0) {
+    br->piped -= (size_t) n;
+    mg_call(c, MG_EV_WRITE, &n);
+  } else if (n < 0 && !mg_sock_would_block()) {
+    c->is_closing = 1;
+  }
+#else
+  (void) c;
+#endif
+}
+
+// Data queued by the protocol outside of c->send, see c->ppending
+static size_t pending(const struct mg_connection *c, const void **buf) {
+  return c->ppending == NULL ? 0 : c->ppending(c, buf);
+}
+
+static void write_conn(struct mg_connection *c) {
+  char *buf = (char *) c->send.buf;
+  size_t len = c->send.len, qlen;
+  const void *q = NULL;
+  long n;
+  if ((qlen = pending(c, &q)) > 0) {
+    // E.g. shared WebSocket broadcast frames: go first, without a copy
+    n = c->is_tls ? mg_tls_send(c, q, qlen) : mg_sock_send(c, q, qlen);
+    if (n < 0) c->is_closing = 1;
+    if (n > 0) {
+      c->psent(c, (size_t) n);
+      mg_call(c, MG_EV_WRITE, &n);
+    }
+  } else if (len == 0 && bridge_pending(c) > 0) {
+    bridge_write(c);
+  } else {
+    n = c->is_tls ? mg_tls_send(c, buf, len) : mg_sock_send(c, buf, len);
+    MG_DEBUG(("%lu %p %d:%d %ld err %d", c->id, c->fd, (int) c->send.len,
+              (int) c->recv.len, n, MG_SOCK_ERRNO));
+    iolog(c, buf, n, false);
+  }
+}
+
+// Read bridged plain TCP connection. On Linux, data goes to the peer through
+// a pipe with splice(), unless the connection has data buffered in user
+// space that must go first. Unlike read_conn(), EOF is not fatal: the peer
+// gets shut down for writing, and the other direction keeps working
+static void bridge_read(struct mg_connection *c) {
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  struct mg_connection *p = br->peer;
+  struct mg_bridge *pb = p == NULL ? NULL : (struct mg_bridge *) p->pfn_data;
+  bool spliced = false;
+  long n = 0;
+  if (pb == NULL) {
+    c->is_full = 1;  // Peer has gone, nowhere to relay
+    return;
+  }
+#if MG_ENABLE_SPLICE
+  if (c->recv.len == 0 && p->send.len == 0 && !p->is_tls && pb->piped == 0 &&
+      (pb->pipe[0] >= 0 || pipe(pb->pipe) == 0)) {
+    spliced = true;
+    n = (long) splice(FD(c), NULL, pb->pipe[1], NULL, pb->max_pending,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      pb->piped = (size_t) n;
+      if (!p->is_connecting) bridge_write(p);
+      if (pb->piped > 0) c->is_full = 1;  // Resume when the pipe is empty
+    }
+  }
+#endif
+  if (!spliced) {
+    char *buf;
+    if (c->recv.size <= c->recv.len &&
+        !mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE)) {
+      mg_error(c, "oom");
+      return;
+    }
+    buf = (char *) &c->recv.buf[c->recv.len];
+    n = recv(FD(c), buf, c->recv.size - c->recv.len, MSG_NONBLOCKING);
+    if (n > 0) iolog(c, buf, n, true);
+  }
+  if (n == 0) {
+    MG_DEBUG(("%lu EOF", c->id));
+    br->eof = true;
+    c->is_full = 1;
+  } else if (n < 0 && !mg_sock_would_block()) {
+    c->is_closing = 1;
+  }
+}
+
+// When everything the peer has sent is relayed and the peer got EOF, shut
+// down the connection for writing. Close it when both directions are done
+static void bridge_shut(struct mg_connection *c) {
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  struct mg_bridge *pb =
+      br->peer == NULL ? NULL : (struct mg_bridge *) br->peer->pfn_data;
+  if (pb != NULL && pb->eof && !br->shut && c->send.len == 0 &&
+      br->piped == 0 && !c->is_connecting) {
+    br->shut = true;
+#if MG_ARCH == MG_ARCH_FREERTOS_TCP
+    c->is_draining = 1;
+#else
+    if (c->is_tls) {
+      c->is_draining = 1;
+    } else {
+      shutdown(FD(c), SHUT_WR);
+    }
+#endif
+  }
+  if (br->shut && br->eof) c->is_closing = 1;
+}
+
 // NOTE(lsm): do only one iteration of reads, cause some systems
 // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
 static void read_conn(struct mg_connection *c) {
   long n = -1;
   if (c->recv.len >= MG_MAX_RECV_SIZE) {
     mg_error(c, "max_recv_buf_size reached");
+  } else if (c->is_bridged && c->pfn_data != NULL && !c->is_tls &&
+             !c->is_udp) {
+    bridge_read(c);
   } else if (c->recv.size <= c->recv.len &&
              !mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE)) {
     mg_error(c, "oom");
@@ -4143,16 +9239,15 @@ static void read_conn(struct mg_connection *c) {
   }
 }
 
-static void write_conn(struct mg_connection *c) {
-  char *buf = (char *) c->send.buf;
-  size_t len = c->send.len;
-  long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_sock_send(c, buf, len);
-  MG_DEBUG(("%lu %p %d:%d %ld err %d", c->id, c->fd, (int) c->send.len,
-            (int) c->recv.len, n, MG_SOCK_ERRNO));
-  iolog(c, buf, n, false);
-}
-
 static void close_conn(struct mg_connection *c) {
+#if MG_ENABLE_SPLICE
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  if (c->is_bridged && br != NULL && br->pipe[0] >= 0) {
+    close(br->pipe[0]);
+    close(br->pipe[1]);
+    br->pipe[0] = br->pipe[1] = -1;
+  }
+#endif
   if (FD(c) != INVALID_SOCKET) {
     closesocket(FD(c));
 #if MG_ARCH == MG_ARCH_FREERTOS_TCP
@@ -4223,11 +9318,11 @@ void mg_connect_resolved(struct mg_connection *c) {
   }
 }
 
-static SOCKET raccept(SOCKET sock, union usa *usa, socklen_t len) {
+static SOCKET raccept(SOCKET sock, union usa *usa, socklen_t *len) {
   SOCKET s = INVALID_SOCKET;
   do {
     memset(usa, 0, sizeof(*usa));
-    s = accept(sock, &usa->sa, &len);
+    s = accept(sock, &usa->sa, len);
   } while (s == INVALID_SOCKET && errno == EINTR);
   return s;
 }
@@ -4236,7 +9331,7 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   struct mg_connection *c = NULL;
   union usa usa;
   socklen_t sa_len = sizeof(usa);
-  SOCKET fd = raccept(FD(lsn), &usa, sa_len);
+  SOCKET fd = raccept(FD(lsn), &usa, &sa_len);
   if (fd == INVALID_SOCKET) {
 #if MG_ARCH == MG_ARCH_AZURERTOS
     // AzureRTOS, in non-block socket mode can mark listening socket readable
@@ -4301,7 +9396,7 @@ static bool mg_socketpair(SOCKET sp[2], union usa usa[2], bool udp) {
              getsockname(sock, &usa[0].sa, &n) == 0 &&
              (sp[0] = socket(AF_INET, SOCK_STREAM, 0)) != INVALID_SOCKET &&
              connect(sp[0], &usa[0].sa, n) == 0 &&
-             (sp[1] = raccept(sock, &usa[1], n)) != INVALID_SOCKET) {
+             (sp[1] = raccept(sock, &usa[1], &n)) != INVALID_SOCKET) {
     success = true;
   }
   if (success) {
@@ -4338,7 +9433,10 @@ static bool can_read(const struct mg_connection *c) {
 }
 
 static bool can_write(const struct mg_connection *c) {
-  return c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0);
+  return c->is_connecting ||
+         ((c->send.len > 0 || bridge_pending(c) > 0 ||
+           pending(c, NULL) > 0) &&
+          c->is_tls_hs == 0);
 }
 
 static bool skip_iotest(const struct mg_connection *c) {
@@ -4479,7 +9577,11 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
       if (c->is_writable) write_conn(c);
     }
 
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+    if (c->is_bridged && c->pfn_data != NULL) bridge_shut(c);
+    if (c->is_draining && c->send.len == 0 && bridge_pending(c) == 0 &&
+        pending(c, NULL) == 0) {
+      c->is_closing = 1;
+    }
     if (c->is_closing) close_conn(c);
   }
 }
@@ -5090,6 +10192,12 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
       goto fail;
     }
   }
+#if MG_ENABLE_HTTP2 && defined(MBEDTLS_SSL_ALPN)
+  if (!c->is_client) {
+    static const char *alpn[] = {"h2", "http/1.1", NULL};
+    mbedtls_ssl_conf_alpn_protocols(&tls->conf, alpn);
+  }
+#endif
   if ((rc = mbedtls_ssl_setup(&tls->ssl, &tls->conf)) != 0) {
     mg_error(c, "setup err %#x", -rc);
     goto fail;
@@ -5147,6 +10255,19 @@ static int mg_tls_err(struct mg_tls *tls, int res) {
   return err;
 }
 
+#if MG_ENABLE_HTTP2 && OPENSSL_VERSION_NUMBER > 0x10002000L
+// Prefer HTTP/2 if the client supports it
+static int alpn_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                   const unsigned char *in, unsigned int inlen, void *arg) {
+  static const unsigned char protos[] = "\x02h2\x08http/1.1";
+  int rc = SSL_select_next_proto((unsigned char **) out, outlen, protos,
+                                 sizeof(protos) - 1, in, inlen);
+  (void) ssl, (void) arg;
+  return rc == OPENSSL_NPN_NEGOTIATED ? SSL_TLSEXT_ERR_OK
+                                      : SSL_TLSEXT_ERR_NOACK;
+}
+#endif
+
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   struct mg_tls *tls = (struct mg_tls *) calloc(1, sizeof(*tls));
   const char *id = "mongoose";
@@ -5226,6 +10347,9 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   }
 #endif
   if (opts->ciphers != NULL) SSL_set_cipher_list(tls->ssl, opts->ciphers);
+#if MG_ENABLE_HTTP2 && OPENSSL_VERSION_NUMBER > 0x10002000L
+  if (!c->is_client) SSL_CTX_set_alpn_select_cb(tls->ctx, alpn_cb, NULL);
+#endif
   if (opts->srvname.len > 0) {
     char mem[128], *buf = mem;
     mg_asprintf(&buf, sizeof(mem), "%.*s", (int) opts->srvname.len,
@@ -5520,12 +10644,74 @@ uint64_t mg_millis(void) {
 
 
 
+
+#if MG_ENABLE_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#define WS_AVX2 1
+#elif MG_ENABLE_SIMD && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define WS_SSE2 1
+#elif MG_ENABLE_SIMD && MG_SIMD_NEON
+#include <arm_neon.h>
+#define WS_NEON 1
+#endif
+
 struct ws_msg {
   uint8_t flags;
   size_t header_len;
   size_t data_len;
 };
 
+#define WS_RSV1 0x40  // Frame flag: compressed message, RFC7692
+
+// Broadcast frame, shared by all connections that send it. Frame data,
+// header included, follows the structure
+struct ws_frame {
+  size_t refs;  // Number of connections that have it queued
+  size_t len;   // Frame length
+};
+
+// Broadcast frame queued on a connection
+struct ws_ref {
+  struct ws_ref *next;
+  struct ws_frame *frame;
+  size_t ofs;  // Number of bytes already sent
+};
+
+// WebSocket connection state, stored in c->ws
+struct ws_state {
+  struct mg_ws_deflate_opts opts;  // Options passed to mg_ws_deflate()
+  bool deflate;                    // permessage-deflate is negotiated
+  bool tx_reset, rx_reset;         // No context takeover: ours, peer's
+  int tx_bits, rx_bits;            // Window bits: ours, peer's
+  struct mg_deflate tx;            // Compressor, allocated on first use
+  struct mg_inflate rx;            // Decompressor, allocated on first use
+  struct mg_iobuf tbuf;            // Compressed outgoing message
+  struct mg_iobuf rbuf;            // Decompressed incoming message
+  struct ws_ref *queue, *last;     // Broadcast frames, sent before c->send
+  size_t queued;                   // Unsent bytes in the queue
+  struct mg_iobuf frag;            // Fragmented message being reassembled
+  size_t frags;                    // Number of frames in frag
+  uint8_t frag_flags;              // Flags of the first frame
+  bool stream;                     // Deliver data as MG_EV_WS_CHUNK
+  bool in_msg;                     // Streamed message is in progress
+  bool in_fin;                     // Current streamed frame is the last one
+  bool in_masked;                  // Current streamed frame is masked
+  uint8_t in_flags;                // Flags of the streamed message
+  uint8_t in_mask[4];              // Masking key, rotated to the next byte
+  size_t in_left;                  // Payload bytes of the frame yet to come
+  size_t in_ofs;                   // Bytes of the message delivered so far
+  size_t resv, resv_len;           // mg_ws_reserve(): header slot, max len
+  uint64_t ping_ms, timeout_ms;    // Keepalive ping interval, pong timeout
+  uint64_t next_ping;              // When ws_ping() has something to do
+  uint64_t ping_last;              // When the last ping was sent
+  uint64_t ping_sent;              // When the unanswered ping was sent, or 0
+  long rtt;                        // Last ping round trip time, ms, or -1
+  bool utf8;                       // Validate text messages
+  uint8_t utf8_tail[4];            // Streamed text: sequence cut by a slice
+  size_t utf8_len;                 // Number of bytes in utf8_tail
+};
+
 size_t mg_ws_vprintf(struct mg_connection *c, int op, const char *fmt,
                      va_list ap) {
   char mem[256], *buf = mem;
@@ -5571,40 +10757,440 @@ static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
     mg_printf(c, "Sec-WebSocket-Protocol: %.*s\r\n", (int) wsproto->len,
               wsproto->ptr);
   }
+  if (c->ws != NULL && ((struct ws_state *) c->ws)->deflate) {
+    struct ws_state *ws = (struct ws_state *) c->ws;
+    mg_printf(c, "Sec-WebSocket-Extensions: permessage-deflate%s%s",
+              ws->tx_reset ? "; server_no_context_takeover" : "",
+              ws->rx_reset ? "; client_no_context_takeover" : "");
+    if (ws->tx_bits < 15) {
+      mg_printf(c, "; server_max_window_bits=%d", ws->tx_bits);
+    }
+    if (ws->rx_bits < 15) {
+      mg_printf(c, "; client_max_window_bits=%d", ws->rx_bits);
+    }
+    mg_send(c, "\r\n", 2);
+  }
   mg_send(c, "\r\n", 2);
 }
 
-static size_t ws_process(uint8_t *buf, size_t len, struct ws_msg *msg) {
-  size_t i, n = 0, mask_len = 0;
+// XOR data with a 4-byte mask, RFC6455 5.3. Byte by byte until the data
+// is word aligned, then a word or a vector register at a time. The mask
+// is rotated to match the aligned position
+void mg_ws_mask(uint8_t *buf, size_t len, const uint8_t *mask) {
+  uint8_t m[4], r[4];
+  uint32_t m32;
+  uint64_t m64;
+  size_t i = 0, k;
+  memcpy(m, mask, sizeof(m));  // Mask can be right before buf, copy it
+  while (i < len && ((uintptr_t) (buf + i) & 7) != 0) buf[i] ^= m[i & 3], i++;
+  for (k = 0; k < 4; k++) r[k] = m[(i + k) & 3];
+  memcpy(&m32, r, sizeof(m32));
+  m64 = (uint64_t) m32 << 32 | m32;
+#if defined(WS_AVX2)
+  {
+    __m256i vm = _mm256_set1_epi32((int) m32);
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i *) (buf + i));
+      _mm256_storeu_si256((__m256i *) (buf + i), _mm256_xor_si256(v, vm));
+    }
+  }
+#elif defined(WS_SSE2)
+  {
+    __m128i vm = _mm_set1_epi32((int) m32);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i *) (buf + i));
+      _mm_storeu_si128((__m128i *) (buf + i), _mm_xor_si128(v, vm));
+    }
+  }
+#elif defined(WS_NEON)
+  {
+    uint8x16_t vm = vreinterpretq_u8_u32(vdupq_n_u32(m32));
+    for (; i + 16 <= len; i += 16) {
+      vst1q_u8(buf + i, veorq_u8(vld1q_u8(buf + i), vm));
+    }
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, buf + i, sizeof(v));
+    v ^= m64;
+    memcpy(buf + i, &v, sizeof(v));
+  }
+  for (; i < len; i++) buf[i] ^= m[i & 3];
+}
+
+// Length of the UTF-8 sequence at s, or 0 if it is invalid: overlong,
+// surrogate, or above U+10FFFF. A sequence cut short by the end of data is
+// checked as far as it goes, and its full length is returned
+static size_t ws_utf8_seq(const uint8_t *s, size_t n) {
+  uint8_t c = s[0], lo = 0x80, hi = 0xbf;
+  size_t i, len;
+  if (c < 0x80) return 1;
+  if (c < 0xc2) return 0;  // Continuation byte, or overlong 2-byte sequence
+  if (c < 0xe0) {
+    len = 2;
+  } else if (c < 0xf0) {
+    len = 3;
+    if (c == 0xe0) lo = 0xa0;  // Overlong
+    if (c == 0xed) hi = 0x9f;  // Surrogates
+  } else if (c < 0xf5) {
+    len = 4;
+    if (c == 0xf0) lo = 0x90;  // Overlong
+    if (c == 0xf4) hi = 0x8f;  // Above U+10FFFF
+  } else {
+    return 0;
+  }
+  for (i = 1; i < len && i < n; i++) {
+    if (s[i] < lo || s[i] > hi) return 0;
+    lo = 0x80, hi = 0xbf;
+  }
+  return len;
+}
+
+// Return the length of the longest prefix of s made of complete, valid
+// UTF-8 sequences. ASCII runs are skipped a vector or a word at a time
+static size_t ws_utf8(const uint8_t *s, size_t n) {
+  size_t i = 0, k;
+  uint64_t w;
+  while (i < n) {
+#if defined(WS_AVX2)
+    for (; i + 32 <= n; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i *) (s + i));
+      if (_mm256_movemask_epi8(v) != 0) break;
+    }
+#elif defined(WS_SSE2)
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i *) (s + i));
+      if (_mm_movemask_epi8(v) != 0) break;
+    }
+#elif defined(WS_NEON)
+    for (; i + 16 <= n; i += 16) {
+      uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8(s + i));
+      w = vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1);
+      if (w & 0x8080808080808080U) break;
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+      memcpy(&w, s + i, sizeof(w));
+      if (w & 0x8080808080808080U) break;
+    }
+    // Mixed text, a byte or a sequence at a time, until an ASCII word
+    while (i < n) {
+      if (s[i] < 0x80) {
+        if (i + 8 <= n) {
+          memcpy(&w, s + i, sizeof(w));
+          if (!(w & 0x8080808080808080U)) break;  // Back to the fast path
+        }
+        i++;
+      } else {
+        k = ws_utf8_seq(s + i, n - i);
+        if (k == 0 || i + k > n) return i;
+        i += k;
+      }
+    }
+  }
+  return i;
+}
+
+bool mg_ws_utf8_valid(const char *buf, size_t len) {
+  return ws_utf8((const uint8_t *) buf, len) == len;
+}
+
+// Parse frame header. Return header length, or 0 if it is incomplete
+static size_t ws_header(const uint8_t *buf, size_t len, struct ws_msg *msg) {
+  size_t n = 0, mask_len = 0;
   memset(msg, 0, sizeof(*msg));
   if (len >= 2) {
     n = buf[1] & 0x7f;                // Frame length
     mask_len = buf[1] & 128 ? 4 : 0;  // last bit is a mask bit
     msg->flags = buf[0];
-    if (n < 126 && len >= mask_len) {
+    if (n < 126 && len >= 2 + mask_len) {
       msg->data_len = n;
       msg->header_len = 2 + mask_len;
     } else if (n == 126 && len >= 4 + mask_len) {
       msg->header_len = 4 + mask_len;
-      msg->data_len = mg_ntohs(*(uint16_t *) &buf[2]);
+      msg->data_len = (size_t) buf[2] << 8 | buf[3];
     } else if (len >= 10 + mask_len) {
+      uint64_t v = 0;
+      size_t i;
+      for (i = 2; i < 10; i++) v = v << 8 | buf[i];
       msg->header_len = 10 + mask_len;
-      msg->data_len =
-          (size_t) (((uint64_t) mg_ntohl(*(uint32_t *) &buf[2])) << 32) +
-          mg_ntohl(*(uint32_t *) &buf[6]);
+      msg->data_len = (size_t) (v > 0x7fffffff ? 0x7fffffff : v);
     }
   }
   // Sanity check, and integer overflow protection for the boundary check below
   // data_len should not be larger than 1 Gb
   if (msg->data_len > 1024 * 1024 * 1024) return 0;
+  return msg->header_len;
+}
+
+static size_t ws_process(uint8_t *buf, size_t len, struct ws_msg *msg) {
+  if (ws_header(buf, len, msg) == 0) return 0;
   if (msg->header_len + msg->data_len > len) return 0;
-  if (mask_len > 0) {
-    uint8_t *p = buf + msg->header_len, *m = p - mask_len;
-    for (i = 0; i < msg->data_len; i++) p[i] ^= m[i & 3];
+  if (buf[1] & 128) {
+    uint8_t *p = buf + msg->header_len;
+    mg_ws_mask(p, msg->data_len, p - 4);
   }
   return msg->header_len + msg->data_len;
 }
 
+static void ws_unref(struct ws_state *ws) {
+  struct ws_ref *r = ws->queue;
+  ws->queue = r->next;
+  if (ws->queue == NULL) ws->last = NULL;
+  ws->queued -= r->frame->len - r->ofs;
+  if (--r->frame->refs == 0) free(r->frame);
+  free(r);
+}
+
+// Queued broadcast data: the unsent part of the first frame. This is the
+// c->ppending hook: the IO layer sends it before c->send
+static size_t ws_pending(const struct mg_connection *c, const void **buf) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  struct ws_ref *r = ws == NULL ? NULL : ws->queue;
+  if (r == NULL) return 0;
+  if (buf != NULL) *buf = (uint8_t *) (r->frame + 1) + r->ofs;
+  return r->frame->len - r->ofs;
+}
+
+static void ws_sent(struct mg_connection *c, size_t n) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  struct ws_ref *r = ws->queue;
+  r->ofs += n;
+  ws->queued -= n;
+  if (r->ofs >= r->frame->len) ws_unref(ws);
+}
+
+static struct ws_state *ws_state(struct mg_connection *c) {
+  if (c->ws == NULL && (c->ws = calloc(1, sizeof(struct ws_state))) != NULL) {
+    ((struct ws_state *) c->ws)->rtt = -1;
+    if (c->pfree == NULL) c->pfree = mg_ws_free;  // HTTP's frees it, too
+    c->ppending = ws_pending, c->psent = ws_sent;
+  }
+  return (struct ws_state *) c->ws;
+}
+
+void mg_ws_free(struct mg_connection *c) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  if (ws == NULL) return;
+  while (ws->queue != NULL) ws_unref(ws);
+  mg_deflate_free(&ws->tx);
+  mg_inflate_free(&ws->rx);
+  mg_iobuf_free(&ws->frag);
+  mg_iobuf_free(&ws->tbuf);
+  mg_iobuf_free(&ws->rbuf);
+  free(ws);
+  c->ws = NULL;
+}
+
+// Take the next sep-separated token from s
+static bool ws_token(struct mg_str *s, char sep, struct mg_str *tok) {
+  size_t n = 0;
+  if (s->len == 0) return false;
+  while (n < s->len && s->ptr[n] != sep) n++;
+  *tok = mg_strstrip(mg_str_n(s->ptr, n));
+  if (n < s->len) n++;
+  s->ptr += n, s->len -= n;
+  return true;
+}
+
+// Parse window bits value, 8 .. 15. Return 0 if it is missing or invalid
+static int ws_bits(struct mg_str v) {
+  int n = 0;
+  size_t i;
+  if (v.len > 1 && v.ptr[0] == '"' && v.ptr[v.len - 1] == '"') {
+    v.ptr++, v.len -= 2;
+  }
+  for (i = 0; i < v.len && i < 3; i++) {
+    if (v.ptr[i] < '0' || v.ptr[i] > '9') return 0;
+    n = n * 10 + v.ptr[i] - '0';
+  }
+  return v.len > 0 && n >= 8 && n <= 15 ? n : 0;
+}
+
+// Apply permessage-deflate parameters, RFC7692 section 7.1: the server
+// parses an offer, the client parses a response. Return false if the
+// parameters can't be accepted
+static bool ws_params(struct ws_state *ws, struct mg_str params,
+                      bool is_client) {
+  struct mg_str p, k;
+  bool limit = false;  // Client agrees to limit its window
+  while (ws_token(&params, ';', &p)) {
+    size_t n = 0;
+    int bits;
+    while (n < p.len && p.ptr[n] != '=') n++;
+    k = mg_strstrip(mg_str_n(p.ptr, n));
+    bits = ws_bits(
+        n < p.len ? mg_strstrip(mg_str_n(p.ptr + n + 1, p.len - n - 1))
+                  : mg_str_n(NULL, 0));
+    if (mg_vcasecmp(&k, "server_no_context_takeover") == 0) {
+      if (is_client) ws->rx_reset = true;
+      if (!is_client) ws->tx_reset = true;
+    } else if (mg_vcasecmp(&k, "client_no_context_takeover") == 0) {
+      if (is_client) ws->tx_reset = true;
+      if (!is_client) ws->rx_reset = true;
+    } else if (mg_vcasecmp(&k, "server_max_window_bits") == 0) {
+      if (bits == 0 || (!is_client && bits < 10)) return false;
+      if (is_client) ws->rx_bits = bits;
+      if (!is_client && bits < ws->tx_bits) ws->tx_bits = bits;
+    } else if (mg_vcasecmp(&k, "client_max_window_bits") == 0) {
+      if (is_client && bits < 10) return false;  // Our compressor can't
+      if (is_client && bits < ws->tx_bits) ws->tx_bits = bits;
+      if (!is_client && bits > 0 && bits < ws->rx_bits) ws->rx_bits = bits;
+      limit = true;
+    } else {
+      return false;
+    }
+  }
+  if (!is_client && !limit) ws->rx_bits = 15;
+  return true;
+}
+
+// Find a permessage-deflate offer or response we can accept
+static bool ws_negotiate(struct ws_state *ws, struct mg_http_message *hm,
+                         bool is_client) {
+  struct mg_str *h = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+  struct mg_str s = h == NULL ? mg_str_n(NULL, 0) : *h, e;
+  int bits = ws->opts.window_bits;
+  if (bits < 10 || bits > 15) bits = 15;
+  while (ws_token(&s, ',', &e)) {
+    struct mg_str params = e, name = mg_str_n(NULL, 0);
+    if (!ws_token(&params, ';', &name) || name.len == 0) continue;  // Empty
+    ws->tx_bits = bits, ws->rx_bits = is_client ? 15 : bits;
+    ws->tx_reset = ws->opts.no_context_takeover;
+    ws->rx_reset = is_client ? false : ws->opts.no_context_takeover;
+    if (mg_vcasecmp(&name, "permessage-deflate") == 0 &&
+        ws_params(ws, params, is_client)) {
+      return true;
+    }
+    if (is_client) return false;  // Server must respond with what we offered
+  }
+  return false;
+}
+
+bool mg_ws_deflate(struct mg_connection *c, struct mg_http_message *hm,
+                   const struct mg_ws_deflate_opts *opts) {
+  struct ws_state *ws = ws_state(c);
+  if (ws == NULL) return false;
+  if (opts != NULL) ws->opts = *opts;
+  if (c->is_client) {
+    // Add an offer to the handshake request, mg_ws_connect() has just
+    // put it into the send buffer
+    char buf[160];
+    int bits = ws->opts.window_bits;
+    size_t n = mg_snprintf(
+        buf, sizeof(buf),
+        "Sec-WebSocket-Extensions: permessage-deflate; "
+        "client_max_window_bits%s\r\n",
+        ws->opts.no_context_takeover
+            ? "; server_no_context_takeover; client_no_context_takeover"
+            : "");
+    if (bits >= 10 && bits < 15) {
+      n -= 2;
+      n += mg_snprintf(buf + n, sizeof(buf) - n,
+                       "; server_max_window_bits=%d\r\n", bits);
+    }
+    if (c->is_websocket || c->send.len < 4 ||
+        memcmp(c->send.buf + c->send.len - 4, "\r\n\r\n", 4) != 0 ||
+        mg_iobuf_add(&c->send, c->send.len - 2, buf, n, MG_IO_SIZE) == 0) {
+      mg_ws_free(c);
+    }
+  } else if (hm == NULL || !ws_negotiate(ws, hm, false)) {
+    mg_ws_free(c);
+  } else {
+    ws->deflate = true;
+  }
+  return c->ws != NULL;
+}
+
+// Send a close frame with a status code, RFC6455 section 7.4
+static void ws_close(struct mg_connection *c, uint16_t code) {
+  uint8_t buf[2];
+  buf[0] = (uint8_t) (code >> 8), buf[1] = (uint8_t) (code & 255);
+  mg_ws_send(c, (char *) buf, sizeof(buf), WEBSOCKET_OP_CLOSE);
+  c->is_draining = 1;
+}
+
+// Compress a message into ws->tbuf. Return false to send it as is
+static bool ws_compress(struct ws_state *ws, const char *buf, size_t len) {
+  if (ws->tx.win == NULL &&
+      !mg_deflate_init(&ws->tx, ws->opts.level, (size_t) 1 << ws->tx_bits)) {
+    return false;
+  }
+  ws->tbuf.len = 0;
+  if (mg_deflate(&ws->tx, buf, len, false, &ws->tbuf) < 4) return false;
+  ws->tbuf.len -= 4;  // Strip 00 00 ff ff, RFC7692 section 7.2.1
+  if (ws->tx_reset) mg_deflate_reset(&ws->tx);
+  return true;
+}
+
+// Deliver a complete message to the user, decompressing it if needed.
+// Decompressed size is limited like the size of a plain message
+static void ws_deliver(struct mg_connection *c, struct mg_ws_message *m) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  if (ws != NULL && ws->deflate && (m->flags & WS_RSV1)) {
+    size_t max = ws->opts.max_size > 0 ? ws->opts.max_size : MG_WS_MAX_MSG_SIZE;
+    long n = -1;
+    ws->rbuf.len = 0;
+    if (ws->rx.win != NULL || ws->rx_reset ||
+        mg_inflate_init(&ws->rx, (size_t) 1 << ws->rx_bits)) {
+      n = mg_inflate(&ws->rx, m->data.ptr, m->data.len, &ws->rbuf, max);
+    }
+    if (n < 0) {
+      MG_ERROR(("%lu inflate error %ld", c->id, n));
+      ws_close(c, n == -2 ? 1009 : 1007);
+      return;
+    }
+    m->data = n == 0 ? mg_str("") : mg_str_n((char *) ws->rbuf.buf, (size_t) n);
+    m->flags &= (uint8_t) ~WS_RSV1;
+  }
+  if (ws != NULL && ws->utf8 && (m->flags & 15) == WEBSOCKET_OP_TEXT &&
+      !mg_ws_utf8_valid(m->data.ptr, m->data.len)) {
+    MG_ERROR(("%lu invalid UTF-8", c->id));
+    ws_close(c, 1007);
+    return;
+  }
+  mg_call(c, MG_EV_WS_MSG, m);
+  if (ws != NULL && ws->rbuf.size > MG_IO_SIZE) mg_iobuf_free(&ws->rbuf);
+}
+
+// Append a frame to the fragmented message, deliver it on the last frame.
+// The buffer grows geometrically, so the reassembly is linear
+static void ws_fragment(struct mg_connection *c, struct mg_ws_message *m) {
+  struct ws_state *ws = ws_state(c);
+  size_t n = m->data.len;
+  if (ws == NULL) {
+    mg_error(c, "OOM");
+  } else if (((m->flags & 15) == WEBSOCKET_OP_CONTINUE) != (ws->frags > 0)) {
+    ws_close(c, 1002);  // Continuation without a start, or a nested start
+  } else if (ws->frags >= MG_WS_MAX_FRAGMENTS ||
+             n > MG_WS_MAX_MSG_SIZE - ws->frag.len) {
+    MG_ERROR(("%lu fragmented message too big", c->id));
+    ws_close(c, 1009);
+  } else {
+    struct mg_iobuf *io = &ws->frag;
+    if (ws->frags++ == 0) ws->frag_flags = m->flags;
+    if (io->len + n > io->size) {
+      size_t size = io->size * 2 < io->len + n ? io->len + n : io->size * 2;
+      if (size < MG_IO_SIZE) size = MG_IO_SIZE;
+      if (size > MG_WS_MAX_MSG_SIZE) size = MG_WS_MAX_MSG_SIZE;
+      if (!mg_iobuf_resize(io, size)) {
+        mg_error(c, "OOM");
+        return;
+      }
+    }
+    if (n > 0) memcpy(io->buf + io->len, m->data.ptr, n);
+    io->len += n;
+    if (m->flags & 128) {
+      struct mg_ws_message msg = {{(char *) io->buf, io->len}, ws->frag_flags};
+      if (io->len == 0) msg.data = mg_str("");
+      ws_deliver(c, &msg);
+      ws->frags = io->len = 0;
+      if (io->size > MG_IO_SIZE) mg_iobuf_free(io);
+    }
+  }
+}
+
 static size_t mkhdr(size_t len, int op, bool is_client, uint8_t *buf) {
   size_t n = 0;
   buf[0] = (uint8_t) (op | 128);
@@ -5633,31 +11219,349 @@ static size_t mkhdr(size_t len, int op, bool is_client, uint8_t *buf) {
   return n;
 }
 
-static void mg_ws_mask(struct mg_connection *c, size_t len) {
+static void ws_mask_send(struct mg_connection *c, size_t len) {
   if (c->is_client && c->send.buf != NULL) {
-    size_t i;
-    uint8_t *p = c->send.buf + c->send.len - len, *mask = p - 4;
-    for (i = 0; i < len; i++) p[i] ^= mask[i & 3];
+    uint8_t *p = c->send.buf + c->send.len - len;
+    mg_ws_mask(p, len, p - 4);
+  }
+}
+
+// Make room for a frame with len bytes of payload at the end of c->send.
+// Return the size of the header slot, the payload goes right after it
+static size_t ws_room(struct mg_connection *c, size_t len) {
+  size_t hlen = len < 126 ? 2 : len < 65536 ? 4 : 10, size;
+  if (c->is_client) hlen += 4;  // Masking key
+  size = c->send.len + hlen + len;
+  if (size > c->send.size) {
+    size += MG_IO_SIZE - size % MG_IO_SIZE;  // Align like mg_iobuf_add()
+    if (!mg_iobuf_resize(&c->send, size)) return 0;
   }
+  return hlen;
+}
+
+// Payload is in c->send after a header slot of hlen bytes. Write the header
+// in front of it and mask it in place. Return frame size
+static size_t ws_finish(struct mg_connection *c, size_t hlen, size_t len,
+                        int op) {
+  uint8_t header[14], *p = c->send.buf + c->send.len;
+  size_t n = mkhdr(len, op, c->is_client, header);
+  if (n < hlen) memmove(p + n, p + hlen, len);  // Shorter length encoding
+  memcpy(p, header, n);
+  c->send.len += n + len;
+  ws_mask_send(c, len);
+  return n + len;
+}
+
+static bool ws_compressible(struct ws_state *ws, size_t len, int op) {
+  return ws != NULL && ws->deflate &&
+         (op == WEBSOCKET_OP_TEXT || op == WEBSOCKET_OP_BINARY) &&
+         len >= ws->opts.min_size;
 }
 
 size_t mg_ws_send(struct mg_connection *c, const char *buf, size_t len,
                   int op) {
-  uint8_t header[14];
-  size_t header_len = mkhdr(len, op, c->is_client, header);
-  mg_send(c, header, header_len);
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  size_t hlen, n = 0;
   MG_VERBOSE(("WS out: %d [%.*s]", (int) len, (int) len, buf));
-  mg_send(c, buf, len);
-  mg_ws_mask(c, len);
-  return header_len + len;
+  if (ws_compressible(ws, len, op) && ws_compress(ws, buf, len)) {
+    buf = (char *) ws->tbuf.buf, len = ws->tbuf.len, op |= WS_RSV1;
+  }
+  if ((hlen = ws_room(c, len)) > 0) {
+    if (len > 0) memmove(c->send.buf + c->send.len + hlen, buf, len);
+    n = ws_finish(c, hlen, len, op);
+  }
+  if (ws != NULL && ws->tbuf.size > MG_IO_SIZE) mg_iobuf_free(&ws->tbuf);
+  return n;
+}
+
+void *mg_ws_reserve(struct mg_connection *c, size_t len) {
+  struct ws_state *ws = ws_state(c);
+  size_t hlen;
+  if (ws == NULL || (hlen = ws_room(c, len)) == 0) return NULL;
+  ws->resv = hlen, ws->resv_len = len;
+  return c->send.buf + c->send.len + hlen;
+}
+
+size_t mg_ws_commit(struct mg_connection *c, size_t len, int op) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  size_t hlen = ws == NULL ? 0 : ws->resv;
+  if (hlen == 0 || len > ws->resv_len ||
+      c->send.len + hlen + len > c->send.size) {
+    return 0;  // Nothing reserved, or c->send was changed since
+  }
+  ws->resv = 0;
+  if (ws_compressible(ws, len, op)) {
+    // Compressed frame is built anew, over the reserved space
+    return mg_ws_send(c, (char *) c->send.buf + c->send.len + hlen, len, op);
+  }
+  return ws_finish(c, hlen, len, op);
+}
+
+// Drop queued broadcast frames that are not started yet
+static void ws_coalesce(struct ws_state *ws) {
+  struct ws_ref *keep = ws->queue, *r;
+  if (keep != NULL && keep->ofs == 0) keep = NULL;
+  r = keep == NULL ? ws->queue : keep->next;
+  while (r != NULL) {
+    struct ws_ref *next = r->next;
+    ws->queued -= r->frame->len;
+    if (--r->frame->refs == 0) free(r->frame);
+    free(r);
+    r = next;
+  }
+  if (keep != NULL) keep->next = NULL;
+  ws->queue = ws->last = keep;
+}
+
+static bool ws_label(const struct mg_connection *c, const char *glob) {
+  size_t n = 0;
+  while (n < sizeof(c->label) && c->label[n] != '\0') n++;
+  return glob == NULL || mg_globmatch(glob, strlen(glob), c->label, n);
+}
+
+// Queue a broadcast frame on a connection
+static bool ws_enqueue(struct mg_connection *c, struct ws_frame *f) {
+  struct ws_state *ws = ws_state(c);
+  struct ws_ref *r;
+  if (ws == NULL || (r = (struct ws_ref *) calloc(1, sizeof(*r))) == NULL) {
+    return false;
+  }
+  r->frame = f;
+  f->refs++;
+  if (ws->last != NULL) ws->last->next = r;
+  if (ws->queue == NULL) ws->queue = r;
+  ws->last = r;
+  ws->queued += f->len;
+  return true;
+}
+
+size_t mg_ws_broadcast(struct mg_mgr *mgr, const char *buf, size_t len,
+                       int op, const struct mg_ws_broadcast_opts *opts) {
+  struct ws_frame *f = NULL;
+  struct mg_connection *c;
+  uint8_t header[14];
+  size_t count = 0, max = opts == NULL ? 0 : opts->max_backlog;
+  size_t hlen = mkhdr(len, op, false, header), flen = hlen + len;
+  int policy = opts == NULL ? MG_WS_DROP : opts->policy;
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    struct ws_state *ws = (struct ws_state *) c->ws;
+    if (!c->is_websocket || c->is_client || c->is_closing || c->is_draining ||
+        !ws_label(c, opts == NULL ? NULL : opts->label)) {
+      continue;
+    }
+    if (max > 0 && c->send.len + (ws == NULL ? 0 : ws->queued) + flen > max) {
+      if (policy == MG_WS_CLOSE) {
+        MG_DEBUG(("%lu slow consumer, closing", c->id));
+        c->is_closing = 1;
+        continue;
+      }
+      if (policy == MG_WS_COALESCE && ws != NULL) ws_coalesce(ws);
+      if (c->send.len + (ws == NULL ? 0 : ws->queued) + flen > max) continue;
+    }
+    if (ws != NULL && ws->deflate) {
+      mg_ws_send(c, buf, len, op);  // Compression state is per connection
+    } else {
+      if (f == NULL) {  // Build the frame once
+        if ((f = (struct ws_frame *) malloc(sizeof(*f) + flen)) == NULL) break;
+        f->refs = 0, f->len = flen;
+        memcpy(f + 1, header, hlen);
+        memcpy((uint8_t *) (f + 1) + hlen, buf, len);
+      }
+      if (c->send.len > 0) {
+        mg_send(c, f + 1, flen);  // Keep the order with data sent earlier
+      } else if (!ws_enqueue(c, f)) {
+        continue;
+      }
+    }
+    count++;
+  }
+  if (f != NULL && f->refs == 0) free(f);
+  return count;
+}
+
+// Reserved bits and control frame limits, RFC6455 section 5.2 and 5.5
+static bool ws_frame_ok(const struct ws_state *ws, const struct ws_msg *msg) {
+  uint8_t op = msg->flags & 15;
+  if (msg->flags & 0x30) return false;  // RSV2, RSV3: no extension uses them
+  if ((msg->flags & WS_RSV1) &&
+      (ws == NULL || !ws->deflate || op == WEBSOCKET_OP_CONTINUE ||
+       op > WEBSOCKET_OP_BINARY)) {
+    return false;  // Only the first frame of a compressed message
+  }
+  return op < 8 || ((msg->flags & 128) && msg->data_len <= 125);
+}
+
+bool mg_ws_check_utf8(struct mg_connection *c, bool on) {
+  struct ws_state *ws = ws_state(c);
+  if (ws != NULL) ws->utf8 = on;
+  return ws != NULL;
+}
+
+// Validate a slice of a streamed text message. A sequence cut at the end
+// of the slice is kept, and completed with the start of the next slice
+static bool ws_utf8_slice(struct ws_state *ws, const uint8_t *s, size_t n,
+                          bool final) {
+  size_t i = 0, k;
+  if (ws->utf8_len > 0) {
+    uint8_t *t = ws->utf8_tail;
+    size_t len = ws_utf8_seq(t, ws->utf8_len);
+    while (ws->utf8_len < len && i < n) t[ws->utf8_len++] = s[i++];
+    if (ws_utf8_seq(t, ws->utf8_len) == 0) return false;
+    if (ws->utf8_len < len) return !final;
+    ws->utf8_len = 0;
+  }
+  k = i + ws_utf8(s + i, n - i);
+  if (k < n) {
+    if (ws_utf8_seq(s + k, n - k) == 0) return false;  // Invalid, not cut
+    memcpy(ws->utf8_tail, s + k, n - k);               // At most 3 bytes
+    ws->utf8_len = n - k;
+  }
+  return !final || ws->utf8_len == 0;
+}
+
+bool mg_ws_stream(struct mg_connection *c, bool on) {
+  struct ws_state *ws = ws_state(c);
+  if (ws != NULL) ws->stream = on;
+  return ws != NULL;
+}
+
+// Deliver uncompressed data frames as MG_EV_WS_CHUNK slices, as they arrive.
+// Return false to process the frame at *ofs in full, like without streaming
+static bool ws_stream(struct mg_connection *c, struct ws_state *ws,
+                      size_t *ofs) {
+  uint8_t *buf = c->recv.buf + *ofs, tmp[4];
+  size_t i, n, len = c->recv.len - *ofs;
+  if (ws->in_left == 0) {  // New frame
+    struct ws_msg msg;
+    uint8_t op;
+    if (ws_header(buf, len, &msg) == 0) return false;
+    op = msg.flags & 15;
+    if (msg.flags & 0x30) return false;  // Bad frame, mg_ws_cb() fails it
+    if (op == WEBSOCKET_OP_CONTINUE ? !ws->in_msg
+                                     : (op > WEBSOCKET_OP_BINARY ||
+                                        (msg.flags & WS_RSV1) || ws->frags)) {
+      return false;  // Control frame, or a compressed message
+    }
+    if (op != WEBSOCKET_OP_CONTINUE) {
+      if (ws->in_msg) {
+        ws_close(c, 1002);  // New message inside of a fragmented one
+        return true;
+      }
+      ws->in_msg = true, ws->in_flags = msg.flags, ws->in_ofs = 0;
+      ws->utf8_len = 0;
+    }
+    ws->in_masked = buf[1] & 128 ? true : false;
+    if (ws->in_masked) memcpy(ws->in_mask, buf + msg.header_len - 4, 4);
+    ws->in_left = msg.data_len;
+    ws->in_fin = msg.flags & 128 ? true : false;
+    *ofs += msg.header_len, buf += msg.header_len, len -= msg.header_len;
+    if (ws->in_left > 0) return true;
+  }
+  n = len < ws->in_left ? len : ws->in_left;
+  if (ws->in_masked && n > 0) {
+    mg_ws_mask(buf, n, ws->in_mask);
+    for (i = 0; i < 4; i++) tmp[i] = ws->in_mask[(i + n) & 3];
+    memcpy(ws->in_mask, tmp, sizeof(tmp));
+  }
+  ws->in_left -= n;
+  *ofs += n;
+  if (n > 0 || (ws->in_fin && ws->in_left == 0)) {
+    struct mg_ws_chunk ch;
+    if (ws->utf8 && (ws->in_flags & 15) == WEBSOCKET_OP_TEXT &&
+        !ws_utf8_slice(ws, buf, n, ws->in_fin && ws->in_left == 0)) {
+      MG_ERROR(("%lu invalid UTF-8", c->id));
+      ws_close(c, 1007);
+      return true;
+    }
+    ch.data = n == 0 ? mg_str("") : mg_str_n((char *) buf, n);
+    ch.flags = ws->in_flags & 15;
+    ch.ofs = ws->in_ofs;
+    ch.final = ws->in_fin && ws->in_left == 0;
+    ws->in_ofs += n;
+    if (ch.final) ws->in_msg = false;
+    mg_call(c, MG_EV_WS_CHUNK, &ch);
+  }
+  return true;
+}
+
+// Send a ping, or fail the connection if the last one was not answered in
+// time. ws->next_ping skips ticks with nothing to do
+static void ws_ping(struct mg_connection *c, struct ws_state *ws) {
+  uint64_t now = mg_millis(), never = (uint64_t) -1;
+  if (ws->ping_ms == 0 || now < ws->next_ping) return;
+  if (!c->is_websocket || c->is_closing || c->is_draining) return;
+  if (ws->ping_sent > 0) {
+    if (ws->timeout_ms > 0 && now - ws->ping_sent >= ws->timeout_ms) {
+      mg_error(c, "WS ping timeout");  // Peer is dead, don't wait for TCP
+    } else {
+      ws->next_ping = ws->timeout_ms > 0 ? ws->ping_sent + ws->timeout_ms
+                                         : never;  // ws_pong() resets it
+    }
+  } else if (now - ws->ping_last >= ws->ping_ms) {
+    // Payload is the send timestamp, so that only our pong is matched
+    mg_ws_send(c, (char *) &now, sizeof(now), WEBSOCKET_OP_PING);
+    ws->ping_sent = ws->ping_last = now;
+    ws->next_ping = ws->timeout_ms > 0 ? now + ws->timeout_ms : never;
+  } else {
+    ws->next_ping = ws->ping_last + ws->ping_ms;
+  }
+}
+
+static void ws_pong(struct ws_state *ws, struct mg_str *data) {
+  if (ws->ping_sent > 0 && data->len == sizeof(ws->ping_sent) &&
+      memcmp(data->ptr, &ws->ping_sent, sizeof(ws->ping_sent)) == 0) {
+    ws->rtt = (long) (mg_millis() - ws->ping_sent);
+    ws->ping_sent = 0;
+    ws->next_ping = ws->ping_last + ws->ping_ms;
+  }
+}
+
+// Keepalive of all WebSocket connections of the manager is driven by one
+// timer. It lives as long as the manager, so that a connection neither
+// allocates nor frees timers, and mg_ws_keepalive() is safe to call from
+// a timer callback
+static void ws_timer(void *arg) {
+  struct mg_connection *c;
+  for (c = ((struct mg_mgr *) arg)->conns; c != NULL; c = c->next) {
+    if (c->ws != NULL) ws_ping(c, (struct ws_state *) c->ws);
+  }
+}
+
+// Start the manager's keepalive timer, or make it tick at least every `ms`
+static void ws_timer_add(struct mg_mgr *mgr, uint64_t ms) {
+  struct mg_timer *t = mgr->timers;
+  while (t != NULL && t->fn != ws_timer) t = t->next;
+  if (t == NULL) {
+    mg_timer_add(mgr, ms, MG_TIMER_REPEAT, ws_timer, mgr);
+  } else if (ms < t->period_ms) {
+    t->period_ms = ms, t->expire = 0;  // Rescheduled on the next poll
+  }
+}
+
+bool mg_ws_keepalive(struct mg_connection *c, unsigned ping_ms,
+                     unsigned timeout_ms) {
+  struct ws_state *ws = ws_state(c);
+  if (ws == NULL) return false;
+  ws->ping_ms = ping_ms, ws->timeout_ms = timeout_ms;
+  ws->ping_sent = 0, ws->ping_last = mg_millis();
+  ws->next_ping = ws->ping_last + ping_ms;
+  if (ping_ms > 0) {
+    ws_timer_add(c->mgr, timeout_ms > 0 && timeout_ms < ping_ms ? timeout_ms
+                                                                 : ping_ms);
+  }
+  return true;
+}
+
+long mg_ws_rtt(const struct mg_connection *c) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  return ws == NULL ? -1 : ws->rtt;
 }
 
 static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
                      void *fn_data) {
   struct ws_msg msg;
-  size_t ofs = (size_t) c->pfn_data;
+  size_t ofs = 0, len;
 
-  // assert(ofs < c->recv.len);
   if (ev == MG_EV_READ) {
     if (!c->is_websocket && c->is_client) {
       int n = mg_http_get_request_len(c->recv.buf, c->recv.len);
@@ -5669,7 +11573,16 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
           c->is_closing = 1;
         } else {
           struct mg_http_message hm;
+          struct ws_state *ws = (struct ws_state *) c->ws;
           mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
+          if (ws != NULL &&
+              mg_http_get_header(&hm, "Sec-WebSocket-Extensions") != NULL) {
+            if (ws_negotiate(ws, &hm, true)) {
+              ws->deflate = true;
+            } else {
+              mg_error(c, "WS extension negotiation error");
+            }
+          }
           c->is_websocket = 1;
           mg_call(c, MG_EV_WS_OPEN, &hm);
         }
@@ -5679,16 +11592,30 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
       }
     }
 
-    while (ws_process(c->recv.buf + ofs, c->recv.len - ofs, &msg) > 0) {
-      char *s = (char *) c->recv.buf + ofs + msg.header_len;
-      struct mg_ws_message m = {{s, msg.data_len}, msg.flags};
-      size_t len = msg.header_len + msg.data_len;
-      uint8_t final = msg.flags & 128, op = msg.flags & 15;
+    // Frames stay in c->recv until the loop ends, and are removed at once
+    while (!c->is_draining && !c->is_closing && ofs < c->recv.len) {
+      struct ws_state *ws = (struct ws_state *) c->ws;
+      struct mg_ws_message m;
+      uint8_t final, op;
+      char *s;
+      if (ws != NULL && ws->stream && ws_stream(c, ws, &ofs)) continue;
+      len = ws_process(c->recv.buf + ofs, c->recv.len - ofs, &msg);
+      if (len == 0) break;
+      if (!ws_frame_ok(ws, &msg)) {
+        MG_ERROR(("%lu bad WS frame %#x", c->id, msg.flags));
+        ws_close(c, 1002);
+        break;
+      }
+      s = (char *) c->recv.buf + ofs + msg.header_len;
+      m.data = mg_str_n(s, msg.data_len), m.flags = msg.flags;
+      final = msg.flags & 128, op = msg.flags & 15;
       // MG_VERBOSE ("fin %d op %d len %d [%.*s]", final, op,
       //                       (int) m.data.len, (int) m.data.len, m.data.ptr));
+      ofs += len;
       switch (op) {
         case WEBSOCKET_OP_CONTINUE:
           mg_call(c, MG_EV_WS_CTL, &m);
+          ws_fragment(c, &m);
           break;
         case WEBSOCKET_OP_PING:
           MG_DEBUG(("%s", "WS PONG"));
@@ -5696,45 +11623,32 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
           mg_call(c, MG_EV_WS_CTL, &m);
           break;
         case WEBSOCKET_OP_PONG:
+          if (ws != NULL) ws_pong(ws, &m.data);
           mg_call(c, MG_EV_WS_CTL, &m);
           break;
         case WEBSOCKET_OP_TEXT:
         case WEBSOCKET_OP_BINARY:
-          if (final) mg_call(c, MG_EV_WS_MSG, &m);
+          if (final && (ws == NULL || ws->frags == 0)) {
+            ws_deliver(c, &m);  // Single frame message, the common case
+          } else {
+            ws_fragment(c, &m);
+          }
           break;
         case WEBSOCKET_OP_CLOSE:
           MG_DEBUG(("%lu Got WS CLOSE", c->id));
           mg_call(c, MG_EV_WS_CTL, &m);
-          mg_ws_send(c, "", 0, WEBSOCKET_OP_CLOSE);
+          // Echo the status code, RFC6455 section 5.5.1
+          mg_ws_send(c, s, msg.data_len >= 2 ? 2 : 0, WEBSOCKET_OP_CLOSE);
           c->is_draining = 1;
           break;
         default:
           // Per RFC6455, close conn when an unknown op is recvd
-          mg_error(c, "unknown WS op %d", op);
+          MG_ERROR(("%lu unknown WS op %d", c->id, op));
+          ws_close(c, 1002);
           break;
       }
-
-      // Handle fragmented frames: strip header, keep in c->recv
-      if (final == 0 || op == 0) {
-        if (op) ofs++, len--, msg.header_len--;       // First frame
-        mg_iobuf_del(&c->recv, ofs, msg.header_len);  // Strip header
-        len -= msg.header_len;
-        ofs += len;
-        c->pfn_data = (void *) ofs;
-        // MG_INFO(("FRAG %d [%.*s]", (int) ofs, (int) ofs, c->recv.buf));
-      }
-      // Remove non-fragmented frame
-      if (final && op) mg_iobuf_del(&c->recv, ofs, len);
-      // Last chunk of the fragmented frame
-      if (final && !op) {
-        m.flags = c->recv.buf[0];
-        m.data = mg_str_n((char *) &c->recv.buf[1], (size_t) (ofs - 1));
-        mg_call(c, MG_EV_WS_MSG, &m);
-        mg_iobuf_del(&c->recv, 0, ofs);
-        ofs = 0;
-        c->pfn_data = NULL;
-      }
     }
+    if (ofs > 0) mg_iobuf_del(&c->recv, 0, ofs);
   }
   (void) fn_data;
   (void) ev_data;
@@ -5806,7 +11720,7 @@ size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
   p = &c->send.buf[c->send.len - len];         // p points to data
   memmove(p, p - header_len, len);             // Shift data
   memcpy(p - header_len, header, header_len);  // Prepend header
-  mg_ws_mask(c, len);                          // Mask data
+  ws_mask_send(c, len);                        // Mask data
 
   return c->send.len;
 }
@@ -6720,15 +12634,27 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
   return true;
 }
 
+// Data queued by the protocol outside of c->send, see c->ppending
+static size_t pending(const struct mg_connection *c, const void **buf) {
+  return c->ppending == NULL ? 0 : c->ppending(c, buf);
+}
+
 static void write_conn(struct mg_connection *c) {
   struct mip_if *ifp = (struct mip_if *) c->mgr->priv;
   struct tcpstate *s = (struct tcpstate *) (c + 1);
   size_t sent, n = c->send.len, hdrlen = 14 + 24 /*max IP*/ + 60 /*max TCP*/;
+  const void *buf = c->send.buf, *q = NULL;
+  size_t qlen = pending(c, &q);  // E.g. WebSocket broadcast frames go first
+  if (qlen > 0) buf = q, n = qlen;
   if (n + hdrlen > ifp->tx.len) n = ifp->tx.len - hdrlen;
   sent = tx_tcp(ifp, c->rem.ip, TH_PUSH | TH_ACK, c->loc.port, c->rem.port,
-                mg_htonl(s->seq), mg_htonl(s->ack), c->send.buf, n);
+                mg_htonl(s->seq), mg_htonl(s->ack), buf, n);
   if (sent > 0) {
-    mg_iobuf_del(&c->send, 0, n);
+    if (qlen > 0) {
+      c->psent(c, n);
+    } else {
+      mg_iobuf_del(&c->send, 0, n);
+    }
     s->seq += (uint32_t) n;
     mg_call(c, MG_EV_WRITE, &n);
   }
@@ -6748,8 +12674,10 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   mg_timer_poll(&mgr->timers, now);
   for (c = mgr->conns; c != NULL; c = tmp) {
     tmp = c->next;
-    if (c->send.len > 0) write_conn(c);
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+    if (c->send.len > 0 || pending(c, NULL) > 0) write_conn(c);
+    if (c->is_draining && c->send.len == 0 && pending(c, NULL) == 0) {
+      c->is_closing = 1;
+    }
     if (c->is_closing) {
       if (c->is_udp == false && c->is_listening == false) fin_conn(c);
       mg_close_conn(c);
@@ -81,6 +81,14 @@ extern "C" {
 
 
 
+// NEON intrinsics are available. Code paths using them also check
+// MG_ENABLE_SIMD
+#if defined(__ARM_NEON) && defined(__GNUC__)
+#define MG_SIMD_NEON 1
+#else
+#define MG_SIMD_NEON 0
+#endif
+
 
 #if MG_ARCH == MG_ARCH_AZURERTOS
 
@@ -439,6 +447,10 @@ extern int SockSet(SOCKET hSock, int Type, int Prop, void *pbuf, int size);
 #define MG_ENABLE_POLL 1
 #endif
 
+#if !defined(MG_ENABLE_SPLICE) && defined(__linux__)
+#define MG_ENABLE_SPLICE 1
+#endif
+
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
@@ -611,6 +623,10 @@ int sscanf(const char *, const char *, ...);
 #define MG_ENABLE_POLL 0
 #endif
 
+#ifndef MG_ENABLE_SPLICE
+#define MG_ENABLE_SPLICE 0
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -635,10 +651,19 @@ int sscanf(const char *, const char *, ...);
 #define MG_ENABLE_SSI 0
 #endif
 
+#ifndef MG_ENABLE_HTTP2
+#define MG_ENABLE_HTTP2 0
+#endif
+
 #ifndef MG_ENABLE_IPV6
 #define MG_ENABLE_IPV6 0
 #endif
 
+// Use SSE2/AVX2/NEON code paths when the compiler targets them
+#ifndef MG_ENABLE_SIMD
+#define MG_ENABLE_SIMD 1
+#endif
+
 #ifndef MG_ENABLE_MD5
 #define MG_ENABLE_MD5 0
 #endif
@@ -674,10 +699,31 @@ int sscanf(const char *, const char *, ...);
 #define MG_MAX_RECV_SIZE (3 * 1024 * 1024)
 #endif
 
+// Limits for a fragmented WebSocket message, reassembled outside of recv
+#ifndef MG_WS_MAX_MSG_SIZE
+#define MG_WS_MAX_MSG_SIZE MG_MAX_RECV_SIZE
+#endif
+
+#ifndef MG_WS_MAX_FRAGMENTS
+#define MG_WS_MAX_FRAGMENTS 1024
+#endif
+
 #ifndef MG_MAX_HTTP_HEADERS
 #define MG_MAX_HTTP_HEADERS 40
 #endif
 
+#ifndef MG_MAX_HTTP_RANGES
+#define MG_MAX_HTTP_RANGES 16  // Max ranges in the Range request header
+#endif
+
+#ifndef MG_MAX_HTTP_PIPELINE
+#define MG_MAX_HTTP_PIPELINE 32  // Max queued responses per connection
+#endif
+
+#ifndef MG_HTTP2_MAX_STREAMS
+#define MG_HTTP2_MAX_STREAMS 100  // Max concurrent HTTP/2 streams
+#endif
+
 #ifndef MG_HTTP_INDEX
 #define MG_HTTP_INDEX "index.html"
 #endif
@@ -754,6 +800,13 @@ typedef size_t (*mg_pm_t)(mg_pc_t, void *, va_list *);  // %M printer
 void mg_putchar_realloc(char ch, void *param);          // Print to malloced str
 void mg_putchar_iobuf(char ch, void *param);            // Print to iobuf
 
+// Bulk writer: appends len bytes. NULL buf means "expect len more bytes"
+typedef void (*mg_pw_t)(const char *buf, size_t len, void *param);
+void mg_write_iobuf(const char *buf, size_t len, void *param);
+void mg_write_realloc(const char *buf, size_t len, void *param);
+size_t mg_vwprintf(mg_pw_t, void *, const char *fmt, va_list *);
+size_t mg_wprintf(mg_pw_t, void *, const char *fmt, ...);
+
 size_t mg_vrprintf(void (*)(char, void *), void *, const char *fmt, va_list *);
 size_t mg_rprintf(void (*fn)(char, void *), void *, const char *fmt, ...);
 size_t mg_vsnprintf(char *buf, size_t len, const char *fmt, va_list *ap);
@@ -915,6 +968,46 @@ void mg_iobuf_free(struct mg_iobuf *);
 size_t mg_iobuf_add(struct mg_iobuf *, size_t, const void *, size_t, size_t);
 size_t mg_iobuf_del(struct mg_iobuf *, size_t ofs, size_t len);
 
+
+
+
+
+// Streaming DEFLATE (RFC1951) compressor. It uses fixed Huffman codes and a
+// bounded LZ77 window, so memory usage is known upfront: about 4 * wsize
+// bytes plus an 8Kb hash table
+struct mg_deflate {
+  uint8_t *win;     // Sliding window, 2 * wsize bytes
+  uint16_t *head;   // Hash chain heads
+  uint16_t *prev;   // Hash chain links, indexed by position & (wsize - 1)
+  size_t wsize;     // Window size, power of 2
+  size_t pos;       // Next position in the window to compress
+  size_t len;       // Number of bytes stored in the window
+  uint32_t bits;    // Pending output bits
+  unsigned nbits;   // Number of pending output bits
+  unsigned chain;   // Max hash chain length to walk, derived from level
+  unsigned nice;    // Stop searching when a match of that length is found
+};
+
+bool mg_deflate_init(struct mg_deflate *, int level, size_t wsize);
+void mg_deflate_reset(struct mg_deflate *);
+void mg_deflate_free(struct mg_deflate *);
+size_t mg_deflate(struct mg_deflate *, const void *buf, size_t len,
+                  bool finish, struct mg_iobuf *out);
+
+// DEFLATE decompressor. Input must contain whole blocks, and the output is
+// appended to an iobuf. The last wsize bytes of output are kept for back
+// references from the next call, wsize 0 means that every call is separate
+struct mg_inflate {
+  uint8_t *win;  // Last output bytes, oldest first
+  size_t wsize;  // Window size
+  size_t wlen;   // Number of bytes in the window
+};
+
+bool mg_inflate_init(struct mg_inflate *, size_t wsize);
+void mg_inflate_free(struct mg_inflate *);
+long mg_inflate(struct mg_inflate *, const void *buf, size_t len,
+                struct mg_iobuf *out, size_t max);
+
 int mg_base64_update(unsigned char p, char *to, int len);
 int mg_base64_final(char *to, int len);
 int mg_base64_encode(const unsigned char *p, int n, char *to);
@@ -972,6 +1065,7 @@ enum {
   MG_EV_MQTT_MSG,    // MQTT PUBLISH received        struct mg_mqtt_message *
   MG_EV_MQTT_OPEN,   // MQTT CONNACK received        int *connack_status_code
   MG_EV_SNTP_TIME,   // SNTP time received           uint64_t *milliseconds
+  MG_EV_WS_CHUNK,    // Websocket msg slice          struct mg_ws_chunk *
   MG_EV_USER,        // Starting ID for user events
 };
 
@@ -1027,6 +1121,12 @@ struct mg_connection {
   void *pfn_data;              // Protocol-specific function parameter
   char label[50];              // Arbitrary label
   void *tls;                   // TLS specific data
+  void *gzip;                  // Response compressor, see mg_http_gzip()
+  void *pipeline;              // Queued responses, see mg_http_defer()
+  void *ws;                    // WebSocket state, see mg_ws_deflate()
+  void (*pfree)(struct mg_connection *);  // Frees protocol state on close
+  size_t (*ppending)(const struct mg_connection *, const void **);  // Queued
+  void (*psent)(struct mg_connection *, size_t);  // Sent n ppending bytes
   unsigned is_listening : 1;   // Listening connection
   unsigned is_client : 1;      // Outbound (client) connection
   unsigned is_accepted : 1;    // Accepted (server) connection
@@ -1037,6 +1137,8 @@ struct mg_connection {
   unsigned is_udp : 1;         // UDP connection
   unsigned is_websocket : 1;   // WebSocket connection
   unsigned is_mqtt5 : 1;       // For MQTT connection, v5 indicator
+  unsigned is_bridged : 1;     // Bridged connection, see mg_bridge()
+  unsigned is_chunk_del : 1;   // Chunk deleted, see mg_http_delete_chunk()
   unsigned is_hexdumping : 1;  // Hexdump in/out traffic
   unsigned is_draining : 1;    // Send remaining data, then close and free
   unsigned is_closing : 1;     // Close and free the connection immediately
@@ -1064,6 +1166,19 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr);
 char *mg_ntoa(const struct mg_addr *addr, char *buf, size_t len);
 int mg_mkpipe(struct mg_mgr *, mg_event_handler_t, void *, bool udp);
 
+// State of a bridged connection, stored in c->pfn_data
+struct mg_bridge {
+  struct mg_connection *peer;  // Connection to relay data to, NULL if closed
+  size_t max_pending;          // Stop reading when peer has that much to send
+  int pipe[2];                 // Pipe for splice() to this connection, or -1
+  size_t piped;                // Number of bytes in the pipe
+  bool eof;                    // Got EOF, nothing more to read
+  bool shut;                   // Shut down for writing
+};
+
+bool mg_bridge(struct mg_connection *, struct mg_connection *,
+               size_t max_pending);
+
 // These functions are used to integrate with custom network stacks
 struct mg_connection *mg_alloc_conn(struct mg_mgr *);
 void mg_close_conn(struct mg_connection *c);
@@ -1102,6 +1217,13 @@ struct mg_http_serve_opts {
   struct mg_fs *fs;           // Filesystem implementation. Use NULL for POSIX
 };
 
+// Parameter for mg_http_gzip()
+struct mg_http_gzip_opts {
+  int level;        // Compression level, 1 (fastest) .. 9 (best), 0 - default
+  size_t wsize;     // Compression window size, 1024 .. 32768, 0 - default
+  size_t min_size;  // Don't compress mg_http_reply() bodies smaller than that
+};
+
 // Parameter for mg_http_next_multipart
 struct mg_http_part {
   struct mg_str name;      // Form field name
@@ -1109,13 +1231,70 @@ struct mg_http_part {
   struct mg_str body;      // Part contents
 };
 
+// Streaming multipart/form-data parser, see mg_http_mp_init()
+struct mg_http_mp {
+  void (*fn)(struct mg_http_mp *, int ev, struct mg_http_part *);  // Callback
+  void *fn_data;           // Arbitrary user data
+  struct mg_fs *fs;        // mg_http_mp_save(): filesystem to use
+  const char *dir;         // mg_http_mp_save(): directory to save files to
+  size_t max_size;         // mg_http_mp_save(): max file size, 0 - no limit
+  struct mg_fd *fd;        // mg_http_mp_save(): file being written
+  struct mg_http_part part;  // Current part. Name and filename are in hdrs
+  size_t size;             // Number of body bytes in the current part
+  int state;               // Parser state. Callback sets -1 to stop parsing
+  // Private parser state follows
+  size_t dlen;             // Delimiter length
+  size_t match;            // Delimiter bytes matched at the end of last data
+  size_t hlen;             // Length of the buffered part headers
+  char delim[76];          // Delimiter: CRLF, "--", boundary
+  char hdrs[1024];         // Part headers
+};
+
+// mg_http_mp callback events
+enum { MG_HTTP_MP_BEGIN, MG_HTTP_MP_DATA, MG_HTTP_MP_END };
+
+// Streamed response, like a static file, detached from its connection.
+// See mg_http_park()
+struct mg_http_stream {
+  mg_event_handler_t pfn;  // Protocol handler that streams it, or NULL
+  void *pfn_data;          // Its c->pfn_data
+  size_t left;             // Its c->label, where it keeps the length
+};
+
+struct mg_tls_opts;
+struct mg_http_pool_req;
+struct mg_json_writer;
+
+// Writes the next piece of a JSON document, see mg_http_json_stream()
+typedef bool (*mg_http_json_fn)(struct mg_json_writer *, void *fn_data);
+
+// HTTP client connection pool, see mg_http_pool_connect()
+struct mg_http_pool {
+  struct mg_mgr *mgr;               // Event manager
+  size_t max_conns;                 // Max connections per host, 0 - no limit
+  uint64_t idle_ms;                 // Close connections idle for that long
+  const struct mg_tls_opts *tls;    // TLS options for https:// URLs
+  struct mg_http_pool_req *queue;   // Requests waiting for a connection
+};
+
+// Preformatted status line and headers, see mg_http_tmpl_send()
+struct mg_http_tmpl {
+  char *buf;   // Status line and headers
+  size_t len;  // Length of buf
+  bool date;   // Add Date header
+};
+
 int mg_http_parse(const char *s, size_t len, struct mg_http_message *);
 int mg_http_get_request_len(const unsigned char *buf, size_t buf_len);
 void mg_http_printf_chunk(struct mg_connection *cnn, const char *fmt, ...);
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
+bool mg_http_json_stream(struct mg_connection *, int status_code,
+                         const char *headers, mg_http_json_fn fn,
+                         void *fn_data);
 void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm);
 struct mg_connection *mg_http_listen(struct mg_mgr *, const char *url,
                                      mg_event_handler_t fn, void *fn_data);
+void mg_http_pool_release(struct mg_connection *);
 struct mg_connection *mg_http_connect(struct mg_mgr *, const char *url,
                                       mg_event_handler_t fn, void *fn_data);
 void mg_http_serve_dir(struct mg_connection *, struct mg_http_message *hm,
@@ -1124,6 +1303,11 @@ void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
                         const char *path, const struct mg_http_serve_opts *);
 void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
                    const char *body_fmt, ...);
+bool mg_http_tmpl_init(struct mg_http_tmpl *, int status_code,
+                       const char *headers, bool date);
+void mg_http_tmpl_free(struct mg_http_tmpl *);
+void mg_http_tmpl_send(struct mg_connection *, const struct mg_http_tmpl *,
+                       const void *body, size_t len);
 struct mg_str *mg_http_get_header(struct mg_http_message *, const char *name);
 struct mg_str mg_http_var(struct mg_str buf, struct mg_str name);
 int mg_http_get_var(const struct mg_str *, const char *name, char *, size_t);
@@ -1136,7 +1320,37 @@ long mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
 void mg_http_bauth(struct mg_connection *, const char *user, const char *pass);
 struct mg_str mg_http_get_header_var(struct mg_str s, struct mg_str v);
 size_t mg_http_next_multipart(struct mg_str, size_t, struct mg_http_part *);
+bool mg_http_mp_init(struct mg_http_mp *, struct mg_http_message *,
+                     void (*fn)(struct mg_http_mp *, int,
+                                struct mg_http_part *),
+                     void *fn_data);
+int mg_http_mp_feed(struct mg_http_mp *, struct mg_str data);
+void mg_http_mp_save(struct mg_http_mp *, int ev, struct mg_http_part *);
 int mg_http_status(const struct mg_http_message *hm);
+bool mg_http_gzip(struct mg_connection *, struct mg_http_message *,
+                  const struct mg_http_gzip_opts *);
+void mg_http_gzip_free(struct mg_connection *);
+unsigned long mg_http_defer(struct mg_connection *);
+void mg_http_respond(struct mg_connection *, unsigned long id, int status_code,
+                     const char *headers, const char *body_fmt, ...);
+void mg_http_pipeline_free(struct mg_connection *);
+bool mg_http_park(struct mg_connection *, struct mg_http_stream *);
+void mg_http_unpark(struct mg_connection *, struct mg_http_stream *);
+bool mg_http_pull(struct mg_connection *, struct mg_http_stream *,
+                  struct mg_iobuf *, size_t max);
+void mg_http_stream_free(struct mg_connection *, struct mg_http_stream *);
+void mg_http_pool_init(struct mg_http_pool *, struct mg_mgr *,
+                       size_t max_conns, uint64_t idle_ms);
+void mg_http_pool_free(struct mg_http_pool *);
+bool mg_http_pool_connect(struct mg_http_pool *, const char *url,
+                          mg_event_handler_t fn, void *fn_data);
+
+
+
+
+
+
+bool mg_http2_upgrade(struct mg_connection *);
 
 
 void mg_http_serve_ssi(struct mg_connection *c, const char *root,
@@ -1212,6 +1426,33 @@ struct mg_ws_message {
   uint8_t flags;       // Websocket message flags
 };
 
+// A slice of a message, see mg_ws_stream()
+struct mg_ws_chunk {
+  struct mg_str data;  // Payload slice, unmasked
+  uint8_t flags;       // Message type: WEBSOCKET_OP_TEXT or WEBSOCKET_OP_BINARY
+  size_t ofs;          // Offset of data in the message
+  bool final;          // This is the last slice of the message
+};
+
+// Parameter for mg_ws_deflate()
+struct mg_ws_deflate_opts {
+  int level;                 // Compression level, 1 .. 9, 0 - default
+  int window_bits;           // Max LZ77 window bits, 10 .. 15, 0 - 15
+  size_t min_size;           // Don't compress messages smaller than that
+  size_t max_size;           // Max decompressed size, 0 - MG_WS_MAX_MSG_SIZE
+  bool no_context_takeover;  // Compress every message separately
+};
+
+// Slow consumer policy for mg_ws_broadcast()
+enum { MG_WS_DROP, MG_WS_COALESCE, MG_WS_CLOSE };
+
+// Parameter for mg_ws_broadcast()
+struct mg_ws_broadcast_opts {
+  const char *label;   // Only connections whose c->label matches this glob
+  size_t max_backlog;  // Max unsent bytes per connection, 0 - no limit
+  int policy;          // What to do when max_backlog is reached
+};
+
 struct mg_connection *mg_ws_connect(struct mg_mgr *, const char *url,
                                     mg_event_handler_t fn, void *fn_data,
                                     const char *fmt, ...);
@@ -1219,8 +1460,57 @@ void mg_ws_upgrade(struct mg_connection *, struct mg_http_message *,
                    const char *fmt, ...);
 size_t mg_ws_send(struct mg_connection *, const char *buf, size_t len, int op);
 size_t mg_ws_wrap(struct mg_connection *, size_t len, int op);
+void *mg_ws_reserve(struct mg_connection *, size_t len);
+size_t mg_ws_commit(struct mg_connection *, size_t len, int op);
 size_t mg_ws_printf(struct mg_connection *c, int op, const char *fmt, ...);
 size_t mg_ws_vprintf(struct mg_connection *c, int op, const char *fmt, va_list);
+void mg_ws_mask(uint8_t *buf, size_t len, const uint8_t *mask);
+bool mg_ws_utf8_valid(const char *buf, size_t len);
+bool mg_ws_deflate(struct mg_connection *, struct mg_http_message *,
+                   const struct mg_ws_deflate_opts *);
+void mg_ws_free(struct mg_connection *);
+bool mg_ws_stream(struct mg_connection *, bool on);
+bool mg_ws_check_utf8(struct mg_connection *, bool on);
+bool mg_ws_keepalive(struct mg_connection *, unsigned ping_ms,
+                     unsigned timeout_ms);
+long mg_ws_rtt(const struct mg_connection *);
+size_t mg_ws_broadcast(struct mg_mgr *, const char *buf, size_t len, int op,
+                       const struct mg_ws_broadcast_opts *);
+
+
+
+
+
+
+struct mg_proxy_upstream {
+  const char *url;      // Upstream URL, e.g. "http://10.0.0.1:8080"
+  size_t active;        // Number of requests in flight
+  unsigned fails;       // Number of consecutive failures
+  uint64_t down_until;  // Passive health check: skip it until that time
+};
+
+// Upstream balancing methods
+enum { MG_PROXY_ROUND_ROBIN, MG_PROXY_LEAST_CONN, MG_PROXY_HASH };
+
+struct mg_proxy {
+  struct mg_http_pool pool;             // Keep-alive upstream connections
+  struct mg_proxy_upstream *upstreams;  // Upstreams
+  size_t num_upstreams;                 // Number of upstreams
+  int balance;                          // Balancing method, MG_PROXY_*
+  unsigned max_fails;     // Consecutive failures that mark upstream down
+  uint64_t fail_ms;       // How long a failed upstream stays down
+  uint64_t timeout_ms;    // Response headers timeout, 0 - no timeout
+  size_t max_pending;     // Pause a side when its peer has that much to send
+  size_t next;            // Next upstream for round-robin
+  void *sessions;         // Requests in flight
+};
+
+void mg_proxy_init(struct mg_proxy *, struct mg_mgr *,
+                   struct mg_proxy_upstream *, size_t num_upstreams,
+                   int balance);
+void mg_proxy_free(struct mg_proxy *);
+bool mg_proxy_forward(struct mg_proxy *, struct mg_connection *, int ev,
+                      struct mg_http_message *);
 
 
 
@@ -1295,6 +1585,31 @@ void mg_mqtt_ping(struct mg_connection *);
 void mg_mqtt_pong(struct mg_connection *);
 void mg_mqtt_disconnect(struct mg_connection *);
 
+// Embedded broker. Subscriptions are kept in a topic trie whose edges are
+// hashed by (parent node, level), so routing a PUBLISH costs a few lookups
+// per topic level regardless of the number of subscriptions
+struct mg_mqtt_hent;
+struct mg_mqtt_broker {
+  struct mg_mqtt_hent **nodes;  // Trie nodes, hashed by parent and level
+  struct mg_mqtt_hent **peers;  // Subscribed connections, hashed by pointer
+  size_t nodes_size, nodes_count;  // Node table size and number of nodes
+  size_t peers_size, peers_count;  // Peer table size and number of peers
+  size_t subs;                     // Number of subscriptions
+  uint64_t seq;                    // Publish counter, for per-peer dedupe
+};
+
+void mg_mqtt_broker_init(struct mg_mqtt_broker *);
+void mg_mqtt_broker_free(struct mg_mqtt_broker *);
+bool mg_mqtt_broker_sub(struct mg_mqtt_broker *, struct mg_connection *,
+                        struct mg_str topic, int qos);
+bool mg_mqtt_broker_unsub(struct mg_mqtt_broker *, struct mg_connection *,
+                          struct mg_str topic);
+void mg_mqtt_broker_drop(struct mg_mqtt_broker *, struct mg_connection *);
+size_t mg_mqtt_broker_pub(struct mg_mqtt_broker *, struct mg_str topic,
+                          struct mg_str data, int qos);
+void mg_mqtt_broker_handle(struct mg_mqtt_broker *, struct mg_connection *,
+                           int ev, void *ev_data);
+
 
 
 
@@ -1342,9 +1657,45 @@ size_t mg_dns_parse_rr(const uint8_t *buf, size_t len, size_t ofs,
 #endif
 
 // Error return values - negative. Successful returns are >= 0
-enum { MG_JSON_TOO_DEEP = -1, MG_JSON_INVALID = -2, MG_JSON_NOT_FOUND = -3 };
+enum {
+  MG_JSON_TOO_DEEP = -1,
+  MG_JSON_INVALID = -2,
+  MG_JSON_NOT_FOUND = -3,
+  MG_JSON_TOO_MANY = -4
+};
 int mg_json_get(const char *buf, int len, const char *path, int *toklen);
 
+// JSON index: a document tokenised once, for many path lookups
+enum {
+  MG_JSON_OBJECT,
+  MG_JSON_ARRAY,
+  MG_JSON_STRING,
+  MG_JSON_NUMBER,
+  MG_JSON_TRUE,
+  MG_JSON_FALSE,
+  MG_JSON_NULL
+};
+
+struct mg_json_tok {
+  int ofs, len;    // Value location in the document, strings include quotes
+  int kofs, klen;  // Key location for object members, without quotes
+  int parent;      // Parent token, -1 for the root
+  int next;        // Next sibling token, -1 for the last one
+  int size;        // Number of children for objects and arrays, else 0
+  int type;        // MG_JSON_OBJECT, MG_JSON_ARRAY, ...
+};
+
+struct mg_json_index {
+  struct mg_str json;        // Indexed document
+  struct mg_json_tok *toks;  // Tokens in document order, root is toks[0]
+  int num;                   // Number of tokens
+};
+
+int mg_json_index_init(struct mg_json_index *, struct mg_str json,
+                       struct mg_json_tok *toks, int max_toks);
+int mg_json_index_find(const struct mg_json_index *, const char *path);
+struct mg_str mg_json_index_get(const struct mg_json_index *, const char *path);
+
 bool mg_json_get_num(struct mg_str json, const char *path, double *v);
 bool mg_json_get_bool(struct mg_str json, const char *path, bool *v);
 long mg_json_get_long(struct mg_str json, const char *path, long dflt);
@@ -1352,6 +1703,30 @@ char *mg_json_get_str(struct mg_str json, const char *path);
 char *mg_json_get_hex(struct mg_str json, const char *path, int *len);
 char *mg_json_get_b64(struct mg_str json, const char *path, int *len);
 
+// Streaming JSON writer. Output goes to fn() span by span, without building
+// the whole document in memory. Commas and string escaping are automatic
+struct mg_json_writer {
+  mg_pw_t fn;                             // Output function
+  void *param;                            // Output function parameter
+  bool key;                               // True if a key was just written
+  bool failed;                            // Too deep nesting, output stopped
+  int depth;                              // Current nesting level
+  unsigned char more[MG_JSON_MAX_DEPTH];  // Level has elements already
+};
+
+void mg_json_writer_init(struct mg_json_writer *, mg_pw_t fn, void *param);
+void mg_json_begin_object(struct mg_json_writer *);
+void mg_json_end_object(struct mg_json_writer *);
+void mg_json_begin_array(struct mg_json_writer *);
+void mg_json_end_array(struct mg_json_writer *);
+void mg_json_key(struct mg_json_writer *, const char *key);
+void mg_json_str(struct mg_json_writer *, const char *str);
+void mg_json_strn(struct mg_json_writer *, const char *str, size_t len);
+void mg_json_num(struct mg_json_writer *, double value);
+void mg_json_int(struct mg_json_writer *, int64_t value);
+void mg_json_bool(struct mg_json_writer *, bool value);
+void mg_json_null(struct mg_json_writer *);
+
 
 
 
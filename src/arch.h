@@ -53,3 +53,11 @@
 #include "arch_unix.h"
 #include "arch_win32.h"
 #include "arch_zephyr.h"
+
+// NEON intrinsics are available. Code paths using them also check
+// MG_ENABLE_SIMD
+#if defined(__ARM_NEON) && defined(__GNUC__)
+#define MG_SIMD_NEON 1
+#else
+#define MG_SIMD_NEON 0
+#endif
@@ -12,6 +12,10 @@
 #define MG_ENABLE_POLL 1
 #endif
 
+#if !defined(MG_ENABLE_SPLICE) && defined(__linux__)
+#define MG_ENABLE_SPLICE 1
+#endif
+
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
@@ -12,6 +12,10 @@
 #define MG_ENABLE_POLL 0
 #endif
 
+#ifndef MG_ENABLE_SPLICE
+#define MG_ENABLE_SPLICE 0
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -36,10 +40,19 @@
 #define MG_ENABLE_SSI 0
 #endif
 
+#ifndef MG_ENABLE_HTTP2
+#define MG_ENABLE_HTTP2 0
+#endif
+
 #ifndef MG_ENABLE_IPV6
 #define MG_ENABLE_IPV6 0
 #endif
 
+// Use SSE2/AVX2/NEON code paths when the compiler targets them
+#ifndef MG_ENABLE_SIMD
+#define MG_ENABLE_SIMD 1
+#endif
+
 #ifndef MG_ENABLE_MD5
 #define MG_ENABLE_MD5 0
 #endif
@@ -75,10 +88,31 @@
 #define MG_MAX_RECV_SIZE (3 * 1024 * 1024)
 #endif
 
+// Limits for a fragmented WebSocket message, reassembled outside of recv
+#ifndef MG_WS_MAX_MSG_SIZE
+#define MG_WS_MAX_MSG_SIZE MG_MAX_RECV_SIZE
+#endif
+
+#ifndef MG_WS_MAX_FRAGMENTS
+#define MG_WS_MAX_FRAGMENTS 1024
+#endif
+
 #ifndef MG_MAX_HTTP_HEADERS
 #define MG_MAX_HTTP_HEADERS 40
 #endif
 
+#ifndef MG_MAX_HTTP_RANGES
+#define MG_MAX_HTTP_RANGES 16  // Max ranges in the Range request header
+#endif
+
+#ifndef MG_MAX_HTTP_PIPELINE
+#define MG_MAX_HTTP_PIPELINE 32  // Max queued responses per connection
+#endif
+
+#ifndef MG_HTTP2_MAX_STREAMS
+#define MG_HTTP2_MAX_STREAMS 100  // Max concurrent HTTP/2 streams
+#endif
+
 #ifndef MG_HTTP_INDEX
 #define MG_HTTP_INDEX "index.html"
 #endif
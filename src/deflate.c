@@ -0,0 +1,438 @@
+#include "deflate.h"
+#include "config.h"
+#include "log.h"
+
+#define MG_DEFLATE_HASH_BITS 12
+#define MG_DEFLATE_HASH_SIZE (1U << MG_DEFLATE_HASH_BITS)
+#define MG_DEFLATE_MAX_MATCH 258
+#define MG_DEFLATE_LOOKAHEAD (MG_DEFLATE_MAX_MATCH + 4)
+
+// Length and distance code tables, RFC1951 section 3.2.5
+static const uint16_t s_lbase[] = {3,  4,  5,  6,  7,  8,  9,  10,  11, 13,
+                                   15, 17, 19, 23, 27, 31, 35, 43,  51, 59,
+                                   67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t s_lext[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t s_dbase[] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const uint8_t s_dext[] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                 4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+bool mg_deflate_init(struct mg_deflate *d, int level, size_t wsize) {
+  // Max hash chain length and "good enough" match length, per level
+  static const uint16_t chains[] = {128, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+  static const uint16_t nices[] = {128, 8, 16, 32, 64, 128, 128, 258, 258, 258};
+  size_t w = 1024;
+  if (wsize == 0) wsize = 8192;
+  while (w < wsize && w < 32768) w <<= 1;  // Round up to a power of 2
+  if (level < 0 || level > 9) level = 0;
+  memset(d, 0, sizeof(*d));
+  d->wsize = w;
+  d->chain = chains[level];
+  d->nice = nices[level];
+  d->win = (uint8_t *) calloc(1, 2 * w);
+  d->head = (uint16_t *) calloc(MG_DEFLATE_HASH_SIZE, sizeof(d->head[0]));
+  d->prev = (uint16_t *) calloc(w, sizeof(d->prev[0]));
+  if (d->win == NULL || d->head == NULL || d->prev == NULL) {
+    MG_ERROR(("OOM %lu", (unsigned long) w));
+    mg_deflate_free(d);
+    return false;
+  }
+  return true;
+}
+
+// Start a new stream, keeping allocated memory
+void mg_deflate_reset(struct mg_deflate *d) {
+  if (d->head != NULL) {
+    memset(d->head, 0, MG_DEFLATE_HASH_SIZE * sizeof(d->head[0]));
+  }
+  if (d->prev != NULL) memset(d->prev, 0, d->wsize * sizeof(d->prev[0]));
+  d->pos = d->len = 0;
+  d->bits = d->nbits = 0;
+}
+
+void mg_deflate_free(struct mg_deflate *d) {
+  free(d->win);
+  free(d->head);
+  free(d->prev);
+  d->win = NULL, d->head = d->prev = NULL;
+}
+
+static void putbits(struct mg_deflate *d, struct mg_iobuf *io, uint32_t v,
+                    unsigned n) {
+  d->bits |= v << d->nbits;
+  d->nbits += n;
+  while (d->nbits >= 8) {
+    io->buf[io->len++] = (uint8_t) (d->bits & 255);
+    d->bits >>= 8;
+    d->nbits -= 8;
+  }
+}
+
+// Huffman codes are packed starting from the most significant bit
+static void putcode(struct mg_deflate *d, struct mg_iobuf *io, unsigned code,
+                    unsigned n) {
+  uint32_t v = 0;
+  unsigned i;
+  for (i = 0; i < n; i++) v = (v << 1) | ((code >> i) & 1);
+  putbits(d, io, v, n);
+}
+
+// Fixed Huffman literal/length codes, RFC1951 section 3.2.6
+static void putlit(struct mg_deflate *d, struct mg_iobuf *io, unsigned v) {
+  if (v < 144) {
+    putcode(d, io, 0x30 + v, 8);
+  } else if (v < 256) {
+    putcode(d, io, 0x190 + v - 144, 9);
+  } else if (v < 280) {
+    putcode(d, io, v - 256, 7);
+  } else {
+    putcode(d, io, 0xc0 + v - 280, 8);
+  }
+}
+
+static void putmatch(struct mg_deflate *d, struct mg_iobuf *io, size_t len,
+                     size_t dist) {
+  unsigned i = sizeof(s_lbase) / sizeof(s_lbase[0]) - 1;
+  while (s_lbase[i] > len) i--;
+  putlit(d, io, 257 + i);
+  putbits(d, io, (uint32_t) (len - s_lbase[i]), s_lext[i]);
+  i = sizeof(s_dbase) / sizeof(s_dbase[0]) - 1;
+  while (s_dbase[i] > dist) i--;
+  putcode(d, io, i, 5);
+  putbits(d, io, (uint32_t) (dist - s_dbase[i]), s_dext[i]);
+}
+
+static unsigned hash3(const uint8_t *p) {
+  uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+  return (unsigned) ((v * 2654435761U) >> (32 - MG_DEFLATE_HASH_BITS));
+}
+
+static void insert(struct mg_deflate *d, size_t pos) {
+  unsigned h = hash3(&d->win[pos]);
+  d->prev[pos & (d->wsize - 1)] = d->head[h];
+  d->head[h] = (uint16_t) pos;
+}
+
+// Find the longest match for the current position, walking the hash chain
+static size_t longest(struct mg_deflate *d, size_t *dist) {
+  size_t cur = d->pos, avail = d->len - cur, best = 0, last = cur;
+  size_t max = avail < MG_DEFLATE_MAX_MATCH ? avail : MG_DEFLATE_MAX_MATCH;
+  size_t cand = d->head[hash3(&d->win[cur])];
+  unsigned chain = d->chain;
+  const uint8_t *b = &d->win[cur];
+  insert(d, cur);
+  // Positions in the chain must strictly decrease. Stale entries are possible
+  // after the window slides, but they are filtered out by the byte comparison
+  while (chain-- > 0 && cand < last && cur - cand <= d->wsize && best < max) {
+    const uint8_t *a = &d->win[cand];
+    if (a[best] == b[best] && a[0] == b[0]) {
+      size_t n = 0;
+      while (n < max && a[n] == b[n]) n++;
+      if (n > best) {
+        best = n, *dist = cur - cand;
+        if (n >= d->nice) break;
+      }
+    }
+    last = cand;
+    cand = d->prev[cand & (d->wsize - 1)];
+  }
+  return best;
+}
+
+// Compress window data, leaving `keep` bytes of lookahead uncompressed
+static void compress(struct mg_deflate *d, struct mg_iobuf *io, size_t keep) {
+  while (d->pos + keep < d->len) {
+    size_t i, dist = 0, n = d->pos + 3 <= d->len ? longest(d, &dist) : 0;
+    if (n >= 3) {
+      putmatch(d, io, n, dist);
+      // On faster levels, skip hashing of the matched bytes
+      for (i = 1; d->chain >= 32 && i < n && d->pos + i + 3 <= d->len; i++) {
+        insert(d, d->pos + i);
+      }
+      d->pos += n;
+    } else {
+      putlit(d, io, d->win[d->pos++]);
+    }
+  }
+}
+
+static void slide(struct mg_deflate *d) {
+  size_t i, w = d->wsize;
+  memcpy(d->win, d->win + w, w);
+  d->pos -= w, d->len -= w;
+  for (i = 0; i < MG_DEFLATE_HASH_SIZE; i++) {
+    d->head[i] = (uint16_t) (d->head[i] >= w ? d->head[i] - w : 0);
+  }
+  for (i = 0; i < w; i++) {
+    d->prev[i] = (uint16_t) (d->prev[i] >= w ? d->prev[i] - w : 0);
+  }
+}
+
+// Compress data and append it to the `io`. Every call produces a complete
+// block: if `finish` is true, the final one, otherwise a block followed by
+// the empty stored block (sync flush), so the output is byte-aligned and the
+// peer can decode everything sent so far. Return number of appended bytes
+size_t mg_deflate(struct mg_deflate *d, const void *buf, size_t len,
+                  bool finish, struct mg_iobuf *io) {
+  const uint8_t *p = (const uint8_t *) buf;
+  // Worst case is 9 bits per byte, plus block headers and a flush marker
+  size_t old = io->len, need = io->len + len + len / 8 + 16;
+  if (d->win == NULL) return 0;
+  need += MG_IO_SIZE - need % MG_IO_SIZE;
+  if (need > io->size && !mg_iobuf_resize(io, need)) return 0;
+  putbits(d, io, finish ? 3 : 2, 3);  // BFINAL and BTYPE=01 - fixed Huffman
+  while (len > 0 || d->pos < d->len) {
+    size_t n = 2 * d->wsize - d->len;
+    if (n == 0) slide(d), n = d->wsize;
+    if (n > len) n = len;
+    memcpy(d->win + d->len, p, n);
+    d->len += n, p += n, len -= n;
+    compress(d, io, len > 0 ? MG_DEFLATE_LOOKAHEAD : 0);
+  }
+  putcode(d, io, 0, 7);  // End of block
+  if (!finish) putbits(d, io, 0, 3);  // Empty stored block
+  if (d->nbits > 0) putbits(d, io, 0, 8 - d->nbits);
+  if (!finish) {
+    memcpy(io->buf + io->len, "\x00\x00\xff\xff", 4);  // LEN and NLEN
+    io->len += 4;
+  }
+  return io->len - old;
+}
+
+bool mg_inflate_init(struct mg_inflate *inf, size_t wsize) {
+  memset(inf, 0, sizeof(*inf));
+  if (wsize > 0 && (inf->win = (uint8_t *) calloc(1, wsize)) == NULL) {
+    MG_ERROR(("OOM %lu", (unsigned long) wsize));
+    return false;
+  }
+  inf->wsize = wsize;
+  return true;
+}
+
+void mg_inflate_free(struct mg_inflate *inf) {
+  free(inf->win);
+  inf->win = NULL;
+  inf->wsize = inf->wlen = 0;
+}
+
+struct inf_bits {
+  const uint8_t *p;  // Input data
+  size_t len, pos;   // Input length, and read position
+  uint32_t buf;      // Bit buffer
+  unsigned cnt;      // Number of bits in the buffer
+};
+
+// Canonical Huffman code, decoded as in RFC1951 section 3.2.2
+struct inf_huff {
+  uint16_t count[16];  // Number of codes of each length
+  uint16_t sym[288];   // Symbols ordered by their codes
+};
+
+// Read n bits, return -1 if input is exhausted
+static int inf_get(struct inf_bits *b, unsigned n) {
+  int v;
+  while (b->cnt < n) {
+    if (b->pos >= b->len) return -1;
+    b->buf |= (uint32_t) b->p[b->pos++] << b->cnt;
+    b->cnt += 8;
+  }
+  v = (int) (b->buf & ((1U << n) - 1));
+  b->buf >>= n;
+  b->cnt -= n;
+  return v;
+}
+
+static bool inf_build(struct inf_huff *h, const uint8_t *lens, int n) {
+  uint16_t offs[16];
+  int i, left = 1;
+  memset(h->count, 0, sizeof(h->count));
+  for (i = 0; i < n; i++) h->count[lens[i]]++;
+  for (i = 1; i < 16; i++) {
+    left = (left << 1) - h->count[i];
+    if (left < 0) return false;  // Over-subscribed code
+  }
+  offs[1] = 0;
+  for (i = 1; i < 15; i++) offs[i + 1] = (uint16_t) (offs[i] + h->count[i]);
+  for (i = 0; i < n; i++) {
+    if (lens[i] != 0) h->sym[offs[lens[i]]++] = (uint16_t) i;
+  }
+  return true;
+}
+
+static int inf_decode(struct inf_bits *b, const struct inf_huff *h) {
+  int code = 0, first = 0, index = 0, len, bit;
+  for (len = 1; len < 16; len++) {
+    if ((bit = inf_get(b, 1)) < 0) return -1;
+    code |= bit;
+    if (code - first < h->count[len]) return h->sym[index + code - first];
+    index += h->count[len];
+    first = (first + h->count[len]) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+// Make room for n more output bytes. Return 0, or a negative error
+static int inf_room(struct mg_iobuf *io, size_t start, size_t max, size_t n) {
+  if (max > 0 && io->len - start + n > max) return -2;
+  if (io->len + n > io->size) {
+    size_t size = io->size * 2 + MG_IO_SIZE;
+    if (size < io->len + n) size = io->len + n + MG_IO_SIZE;
+    if (!mg_iobuf_resize(io, size)) return -1;
+  }
+  return 0;
+}
+
+static int inf_codes(struct mg_inflate *inf, struct inf_bits *b,
+                     struct mg_iobuf *io, size_t start, size_t max,
+                     const struct inf_huff *lh, const struct inf_huff *dh) {
+  for (;;) {
+    int sym = inf_decode(b, lh), e, r;
+    if (sym < 0) return -1;
+    if (sym < 256) {
+      if ((r = inf_room(io, start, max, 1)) < 0) return r;
+      io->buf[io->len++] = (uint8_t) sym;
+    } else if (sym == 256) {
+      return 0;
+    } else if ((sym -= 257) >= 29 || (e = inf_get(b, s_lext[sym])) < 0) {
+      return -1;
+    } else {
+      size_t i, n = (size_t) (s_lbase[sym] + e), dist;
+      if ((sym = inf_decode(b, dh)) < 0 || sym >= 30 ||
+          (e = inf_get(b, s_dext[sym])) < 0) {
+        return -1;
+      }
+      dist = (size_t) (s_dbase[sym] + e);
+      if (dist > io->len - start + inf->wlen) return -1;  // Too far back
+      if ((r = inf_room(io, start, max, n)) < 0) return r;
+      for (i = 0; i < n; i++, io->len++) {
+        size_t o = io->len - start;
+        io->buf[io->len] = dist <= o ? io->buf[io->len - dist]
+                                     : inf->win[inf->wlen - (dist - o)];
+      }
+    }
+  }
+}
+
+static int inf_fixed(struct mg_inflate *inf, struct inf_bits *b,
+                     struct mg_iobuf *io, size_t start, size_t max) {
+  struct inf_huff lh, dh;
+  uint8_t lens[288];
+  memset(lens, 8, 144);
+  memset(lens + 144, 9, 112);
+  memset(lens + 256, 7, 24);
+  memset(lens + 280, 8, 8);
+  inf_build(&lh, lens, 288);
+  memset(lens, 5, 30);
+  inf_build(&dh, lens, 30);
+  return inf_codes(inf, b, io, start, max, &lh, &dh);
+}
+
+static int inf_dynamic(struct mg_inflate *inf, struct inf_bits *b,
+                       struct mg_iobuf *io, size_t start, size_t max) {
+  static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                    11, 4,  12, 3, 13, 2, 14, 1, 15};
+  struct inf_huff lh, dh;
+  uint8_t lens[320];
+  int i, n = 0, nlen = inf_get(b, 5), ndist = inf_get(b, 5),
+         ncode = inf_get(b, 4);
+  if (nlen < 0 || ndist < 0 || ncode < 0) return -1;
+  nlen += 257, ndist += 1, ncode += 4;
+  if (nlen > 286 || ndist > 30) return -1;
+  memset(lens, 0, 19);
+  for (i = 0; i < ncode; i++) {
+    int v = inf_get(b, 3);
+    if (v < 0) return -1;
+    lens[order[i]] = (uint8_t) v;
+  }
+  if (!inf_build(&lh, lens, 19)) return -1;
+  while (n < nlen + ndist) {
+    int sym = inf_decode(b, &lh), rep, v = 0;
+    if (sym < 0) return -1;
+    if (sym < 16) {
+      lens[n++] = (uint8_t) sym;
+      continue;
+    }
+    if (sym == 16) {
+      if (n == 0) return -1;  // Nothing to repeat
+      v = lens[n - 1], rep = inf_get(b, 2), rep = rep < 0 ? -1 : rep + 3;
+    } else if (sym == 17) {
+      rep = inf_get(b, 3), rep = rep < 0 ? -1 : rep + 3;
+    } else {
+      rep = inf_get(b, 7), rep = rep < 0 ? -1 : rep + 11;
+    }
+    if (rep < 0 || n + rep > nlen + ndist) return -1;
+    while (rep-- > 0) lens[n++] = (uint8_t) v;
+  }
+  if (lens[256] == 0) return -1;  // No end of block code
+  if (!inf_build(&lh, lens, nlen) || !inf_build(&dh, lens + nlen, ndist)) {
+    return -1;
+  }
+  return inf_codes(inf, b, io, start, max, &lh, &dh);
+}
+
+// Remember the last output bytes, for back references from the next call
+static void inf_window(struct mg_inflate *inf, const uint8_t *p, size_t n) {
+  size_t w = inf->wsize, keep = inf->wlen;
+  if (w == 0 || n == 0) return;
+  if (n >= w) {
+    memcpy(inf->win, p + n - w, w);
+    inf->wlen = w;
+  } else {
+    if (keep + n > w) keep = w - n;
+    memmove(inf->win, inf->win + inf->wlen - keep, keep);
+    memcpy(inf->win + keep, p, n);
+    inf->wlen = keep + n;
+  }
+}
+
+// Decompress blocks in buf and append data to io. Decoding stops after the
+// final block, or at the end of input on a block boundary. A stored block
+// header without LEN and NLEN at the end of input, as left by stripping a
+// sync flush marker, is accepted. Return the number of appended bytes, -1
+// on invalid data, or -2 if the output is larger than max (if max > 0)
+long mg_inflate(struct mg_inflate *inf, const void *buf, size_t len,
+                struct mg_iobuf *io, size_t max) {
+  struct inf_bits b;
+  size_t start = io->len;
+  int last = 0, r = 0;
+  memset(&b, 0, sizeof(b));
+  b.p = (const uint8_t *) buf, b.len = len;
+  while (r == 0 && !last && (b.pos < b.len || b.cnt >= 3)) {
+    int type;
+    last = inf_get(&b, 1), type = inf_get(&b, 2);
+    if (type == 0) {
+      size_t n;
+      b.buf = 0, b.cnt = 0;  // Skip to a byte boundary
+      if (b.pos == b.len) break;
+      if (b.pos + 4 > b.len) {
+        r = -1;
+        break;
+      }
+      n = (size_t) (b.p[b.pos] | b.p[b.pos + 1] << 8);
+      if ((n ^ 0xffff) != (size_t) (b.p[b.pos + 2] | b.p[b.pos + 3] << 8) ||
+          b.pos + 4 + n > b.len) {
+        r = -1;
+      } else if ((r = inf_room(io, start, max, n)) == 0) {
+        memcpy(io->buf + io->len, b.p + b.pos + 4, n);
+        io->len += n, b.pos += 4 + n;
+      }
+    } else if (type == 1) {
+      r = inf_fixed(inf, &b, io, start, max);
+    } else if (type == 2) {
+      r = inf_dynamic(inf, &b, io, start, max);
+    } else {
+      r = -1;
+    }
+  }
+  if (r < 0) {
+    io->len = start;
+    return r;
+  }
+  inf_window(inf, io->buf + start, io->len - start);
+  return (long) (io->len - start);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "arch.h"
+#include "iobuf.h"
+
+// Streaming DEFLATE (RFC1951) compressor. It uses fixed Huffman codes and a
+// bounded LZ77 window, so memory usage is known upfront: about 4 * wsize
+// bytes plus an 8Kb hash table
+struct mg_deflate {
+  uint8_t *win;     // Sliding window, 2 * wsize bytes
+  uint16_t *head;   // Hash chain heads
+  uint16_t *prev;   // Hash chain links, indexed by position & (wsize - 1)
+  size_t wsize;     // Window size, power of 2
+  size_t pos;       // Next position in the window to compress
+  size_t len;       // Number of bytes stored in the window
+  uint32_t bits;    // Pending output bits
+  unsigned nbits;   // Number of pending output bits
+  unsigned chain;   // Max hash chain length to walk, derived from level
+  unsigned nice;    // Stop searching when a match of that length is found
+};
+
+bool mg_deflate_init(struct mg_deflate *, int level, size_t wsize);
+void mg_deflate_reset(struct mg_deflate *);
+void mg_deflate_free(struct mg_deflate *);
+size_t mg_deflate(struct mg_deflate *, const void *buf, size_t len,
+                  bool finish, struct mg_iobuf *out);
+
+// DEFLATE decompressor. Input must contain whole blocks, and the output is
+// appended to an iobuf. The last wsize bytes of output are kept for back
+// references from the next call, wsize 0 means that every call is separate
+struct mg_inflate {
+  uint8_t *win;  // Last output bytes, oldest first
+  size_t wsize;  // Window size
+  size_t wlen;   // Number of bytes in the window
+};
+
+bool mg_inflate_init(struct mg_inflate *, size_t wsize);
+void mg_inflate_free(struct mg_inflate *);
+long mg_inflate(struct mg_inflate *, const void *buf, size_t len,
+                struct mg_iobuf *out, size_t max);
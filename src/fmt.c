@@ -1,3 +1,4 @@
+#include "config.h"
 #include "iobuf.h"
 #include "str.h"
 
@@ -47,6 +48,15 @@ char *mg_mprintf(const char *fmt, ...) {
   return s;
 }
 
+size_t mg_wprintf(mg_pw_t fn, void *param, const char *fmt, ...) {
+  size_t len = 0;
+  va_list ap;
+  va_start(ap, fmt);
+  len = mg_vwprintf(fn, param, fmt, &ap);
+  va_end(ap);
+  return len;
+}
+
 size_t mg_rprintf(void (*out)(char, void *), void *ptr, const char *fmt, ...) {
   size_t len = 0;
   va_list ap;
@@ -64,6 +74,15 @@ static void mg_putchar_iobuf_static(char ch, void *param) {
   }
 }
 
+static void write_iobuf_static(const char *buf, size_t len, void *param) {
+  struct mg_iobuf *io = (struct mg_iobuf *) param;
+  if (buf == NULL || io->len + 1 >= io->size) return;
+  if (len > io->size - io->len - 1) len = io->size - io->len - 1;
+  memcpy(io->buf + io->len, buf, len);
+  io->len += len;
+  io->buf[io->len] = 0;
+}
+
 void mg_putchar_iobuf(char ch, void *param) {
   struct mg_iobuf *io = (struct mg_iobuf *) param;
   if (io->len + 2 > io->size) mg_iobuf_resize(io, io->size + 64);
@@ -73,16 +92,36 @@ void mg_putchar_iobuf(char ch, void *param) {
   }
 }
 
+// Grow in MG_IO_SIZE steps, so that a long printf resizes a few times
+// rather than once per 64 bytes. NULL buf is a hint: reserve len bytes
+void mg_write_iobuf(const char *buf, size_t len, void *param) {
+  struct mg_iobuf *io = (struct mg_iobuf *) param;
+  size_t need = io->len + len + 1;
+  if (need > io->size) {
+    mg_iobuf_resize(io, need + MG_IO_SIZE - need % MG_IO_SIZE);
+  }
+  if (buf != NULL && need <= io->size) {
+    memcpy(io->buf + io->len, buf, len);
+    io->len += len;
+    io->buf[io->len] = 0;
+  }
+}
+
 // We don't use realloc() in mongoose, so resort to inefficient calloc
 // Every new character reallocates the whole string
 void mg_putchar_realloc(char ch, void *param) {
-  char *s, *buf = *(char **) param;
-  size_t len = buf == NULL ? 0 : strlen(buf);
-  if ((s = (char *) calloc(1, len + 2)) != NULL) {
-    if (buf != NULL) memcpy(s, buf, len);
-    s[len] = ch;
-    s[len + 1] = '\0';
-    free(buf);
+  mg_write_realloc(&ch, 1, param);
+}
+
+// Same as above, but the whole span is appended with one reallocation
+void mg_write_realloc(const char *buf, size_t len, void *param) {
+  char *s, *old = *(char **) param;
+  size_t n = old == NULL ? 0 : strlen(old);
+  if (buf == NULL || len == 0) return;
+  if ((s = (char *) calloc(1, n + len + 1)) != NULL) {
+    if (old != NULL) memcpy(s, old, n);
+    memcpy(s + n, buf, len);
+    free(old);
     *(char **) param = s;
   }
 }
@@ -120,11 +159,35 @@ size_t mg_lld(char *buf, int64_t val, bool is_signed, bool is_hex) {
   return n + s;
 }
 
-static size_t scpy(void (*out)(char, void *), void *ptr, char *buf,
-                   size_t len) {
+// Formatter output: spans go to `w`, and %M printers get the putchar `pc`.
+// When the caller has given us a putchar function, it is passed to %M
+// printers as is; otherwise `pc` is a shim that forwards to `w`
+struct mg_xout {
+  mg_pw_t w;
+  void *wp;
+  mg_pc_t pc;
+  void *pp;
+};
+
+static size_t wr(struct mg_xout *o, const char *buf, size_t len) {
+  if (len > 0) o->w(buf, len, o->wp);
+  return len;
+}
+
+static size_t wpad(struct mg_xout *o, char ch, size_t len) {
+  char tmp[16];
+  size_t n = 0;
+  memset(tmp, ch, sizeof(tmp));
+  while (n < len) {
+    n += wr(o, tmp, len - n > sizeof(tmp) ? sizeof(tmp) : len - n);
+  }
+  return n;
+}
+
+static size_t scpy(struct mg_xout *o, char *buf, size_t len) {
   size_t i = 0;
-  while (i < len && buf[i] != '\0') out(buf[i++], ptr);
-  return i;
+  while (i < len && buf[i] != '\0') i++;
+  return wr(o, buf, i);
 }
 
 static char mg_esc(int c, bool esc) {
@@ -139,46 +202,61 @@ static char mg_escape(int c) {
   return mg_esc(c, true);
 }
 
-static size_t qcpy(void (*out)(char, void *), void *ptr, char *buf,
-                   size_t len) {
-  size_t i = 0, extra = 2;
-  out('"', ptr);
+// Unescaped runs are emitted as one span each
+static size_t qcpy(struct mg_xout *o, char *buf, size_t len) {
+  size_t i, start = 0, n = wr(o, "\"", 1);
   for (i = 0; i < len && buf[i] != '\0'; i++) {
     char c = mg_escape(buf[i]);
     if (c) {
-      out('\\', ptr), out(c, ptr), extra++;
-    } else {
-      out(buf[i], ptr);
+      char tmp[2] = {'\\', c};
+      n += wr(o, buf + start, i - start) + wr(o, tmp, sizeof(tmp));
+      start = i + 1;
     }
   }
-  out('"', ptr);
-  return i + extra;
+  n += wr(o, buf + start, i - start);
+  return n + wr(o, "\"", 1);
 }
 
-static size_t bcpy(void (*out)(char, void *), void *ptr, uint8_t *buf,
-                   size_t len) {
-  size_t i, n = 0;
+static size_t bcpy(struct mg_xout *o, uint8_t *buf, size_t len) {
+  size_t i, k = 0, n = 0;
   const char *t =
       "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-  out('"', ptr), n++;
+  char tmp[64];
+  tmp[k++] = '"';
   for (i = 0; i < len; i += 3) {
     uint8_t c1 = buf[i], c2 = i + 1 < len ? buf[i + 1] : 0,
             c3 = i + 2 < len ? buf[i + 2] : 0;
-    char tmp[4] = {t[c1 >> 2], t[(c1 & 3) << 4 | (c2 >> 4)], '=', '='};
-    if (i + 1 < len) tmp[2] = t[(c2 & 15) << 2 | (c3 >> 6)];
-    if (i + 2 < len) tmp[3] = t[c3 & 63];
-    n += scpy(out, ptr, tmp, sizeof(tmp));
+    if (k + 4 > sizeof(tmp)) n += wr(o, tmp, k), k = 0;
+    tmp[k++] = t[c1 >> 2];
+    tmp[k++] = t[(c1 & 3) << 4 | (c2 >> 4)];
+    tmp[k++] = i + 1 < len ? t[(c2 & 15) << 2 | (c3 >> 6)] : '=';
+    tmp[k++] = i + 2 < len ? t[c3 & 63] : '=';
   }
-  out('"', ptr), n++;
-  return n;
+  if (k + 1 > sizeof(tmp)) n += wr(o, tmp, k), k = 0;
+  tmp[k++] = '"';
+  return n + wr(o, tmp, k);
 }
 
-size_t mg_vrprintf(void (*out)(char, void *), void *param, const char *fmt,
-                   va_list *ap) {
+static size_t hcpy(struct mg_xout *o, uint8_t *buf, size_t len) {
+  const char *hex = "0123456789abcdef";
+  size_t i, k = 0, n = 0;
+  char tmp[64];
+  tmp[k++] = '"';
+  for (i = 0; i < len; i++) {
+    if (k + 2 > sizeof(tmp)) n += wr(o, tmp, k), k = 0;
+    tmp[k++] = hex[(buf[i] >> 4) & 15];
+    tmp[k++] = hex[buf[i] & 15];
+  }
+  if (k + 1 > sizeof(tmp)) n += wr(o, tmp, k), k = 0;
+  tmp[k++] = '"';
+  return n + wr(o, tmp, k);
+}
+
+static size_t xprintf(struct mg_xout *o, const char *fmt, va_list *ap) {
   size_t i = 0, n = 0;
   while (fmt[i] != '\0') {
     if (fmt[i] == '%') {
-      size_t j, k, x = 0, is_long = 0, w = 0 /* width */, pr = ~0U /* prec */;
+      size_t k, x = 0, is_long = 0, w = 0 /* width */, pr = ~0U /* prec */;
       char pad = ' ', minus = 0, c = fmt[++i];
       if (c == '#') x++, c = fmt[++i];
       if (c == '-') minus++, c = fmt[++i];
@@ -219,60 +297,89 @@ size_t mg_vrprintf(void (*out)(char, void *), void *param, const char *fmt,
           int v = va_arg(*ap, int);
           k = mg_lld(tmp, s ? (int64_t) v : (int64_t) (unsigned) v, s, h);
         }
-        for (j = 0; j < xl && w > 0; j++) w--;
-        for (j = 0; pad == ' ' && !minus && k < w && j + k < w; j++)
-          n += scpy(out, param, &pad, 1);
-        n += scpy(out, param, (char *) "0x", xl);
-        for (j = 0; pad == '0' && k < w && j + k < w; j++)
-          n += scpy(out, param, &pad, 1);
-        n += scpy(out, param, tmp, k);
-        for (j = 0; pad == ' ' && minus && k < w && j + k < w; j++)
-          n += scpy(out, param, &pad, 1);
+        w = w > xl ? w - xl : 0;
+        if (pad == ' ' && !minus && k < w) n += wpad(o, pad, w - k);
+        n += wr(o, "0x", xl);
+        if (pad == '0' && k < w) n += wpad(o, pad, w - k);
+        n += wr(o, tmp, k);
+        if (pad == ' ' && minus && k < w) n += wpad(o, pad, w - k);
       } else if (c == 'M') {
         mg_pm_t f = va_arg(*ap, mg_pm_t);
-        n += f(out, param, ap);
+        n += f(o->pc, o->pp, ap);
       } else if (c == 'c') {
-        int ch = va_arg(*ap, int);
-        out((char) ch, param);
-        n++;
+        char ch = (char) va_arg(*ap, int);
+        n += wr(o, &ch, 1);
       } else if (c == 'H') {
         // Print hex-encoded double-quoted string
         size_t bl = (size_t) va_arg(*ap, int);
-        uint8_t *p = va_arg(*ap, uint8_t *), dquote = '"';
-        const char *hex = "0123456789abcdef";
-        n += scpy(out, param, (char *) &dquote, 1);
-        for (j = 0; j < bl; j++) {
-          n += scpy(out, param, (char *) &hex[(p[j] >> 4) & 15], 1);
-          n += scpy(out, param, (char *) &hex[p[j] & 15], 1);
-        }
-        n += scpy(out, param, (char *) &dquote, 1);
+        uint8_t *p = va_arg(*ap, uint8_t *);
+        n += hcpy(o, p, bl);
       } else if (c == 'V') {
         // Print base64-encoded double-quoted string
         size_t len = (size_t) va_arg(*ap, int);
         uint8_t *buf = va_arg(*ap, uint8_t *);
-        n += bcpy(out, param, buf, len);
+        n += bcpy(o, buf, len);
       } else if (c == 's' || c == 'Q') {
         char *p = va_arg(*ap, char *);
-        size_t (*f)(void (*)(char, void *), void *, char *, size_t) =
-            c == 's' ? scpy : qcpy;
         if (pr == ~0U) pr = p == NULL ? 0 : strlen(p);
-        for (j = 0; !minus && pr < w && j + pr < w; j++)
-          n += f(out, param, &pad, 1);
-        n += f(out, param, p, pr);
-        for (j = 0; minus && pr < w && j + pr < w; j++)
-          n += f(out, param, &pad, 1);
+        if (!minus && pr < w) n += wpad(o, pad, w - pr);
+        n += c == 's' ? scpy(o, p, pr) : qcpy(o, p, pr);
+        if (minus && pr < w) n += wpad(o, pad, w - pr);
       } else if (c == '%') {
-        out('%', param);
-        n++;
+        n += wr(o, "%", 1);
       } else {
-        out('%', param);
-        out(c, param);
-        n += 2;
+        char tmp[2] = {'%', c};
+        n += wr(o, tmp, sizeof(tmp));
       }
       i++;
     } else {
-      out(fmt[i], param), n++, i++;
+      // Emit a run of literal characters as one span
+      size_t j = i;
+      while (fmt[j] != '\0' && fmt[j] != '%') j++;
+      n += wr(o, fmt + i, j - i);
+      i = j;
     }
   }
   return n;
 }
+
+static void pw_putchar(char ch, void *param) {
+  struct mg_xout *o = (struct mg_xout *) param;
+  o->w(&ch, 1, o->wp);
+}
+
+static void pc_write(const char *buf, size_t len, void *param) {
+  struct mg_xout *o = (struct mg_xout *) param;
+  size_t i;
+  for (i = 0; buf != NULL && i < len; i++) o->pc(buf[i], o->pp);
+}
+
+size_t mg_vwprintf(mg_pw_t fn, void *param, const char *fmt, va_list *ap) {
+  struct mg_xout o = {fn, param, pw_putchar, NULL};
+  // %M printers call mg_rprintf(), give them a putchar that maps back to us
+  if (fn == mg_write_iobuf) {
+    o.pc = mg_putchar_iobuf, o.pp = param;
+  } else if (fn == mg_write_realloc) {
+    o.pc = mg_putchar_realloc, o.pp = param;
+  } else {
+    o.pp = &o;
+  }
+  fn(NULL, strlen(fmt), param);  // Size hint: at least the literal part
+  return xprintf(&o, fmt, ap);
+}
+
+size_t mg_vrprintf(void (*out)(char, void *), void *param, const char *fmt,
+                   va_list *ap) {
+  struct mg_xout o = {pc_write, NULL, out, param};
+  // Well-known putchar functions get their bulk counterparts
+  if (out == mg_putchar_iobuf) {
+    o.w = mg_write_iobuf, o.wp = param;
+  } else if (out == mg_putchar_realloc) {
+    o.w = mg_write_realloc, o.wp = param;
+  } else if (out == mg_putchar_iobuf_static) {
+    o.w = write_iobuf_static, o.wp = param;
+  } else {
+    o.wp = &o;
+  }
+  return xprintf(&o, fmt, ap);
+}
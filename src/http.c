@@ -1,9 +1,14 @@
 #include "http.h"
 #include "arch.h"
 #include "base64.h"
+#include "deflate.h"
+#include "http2.h"
+#include "json.h"
 #include "log.h"
 #include "net.h"
 #include "ssi.h"
+#include "tls.h"
+#include "url.h"
 #include "util.h"
 #include "version.h"
 #include "ws.h"
@@ -50,9 +55,17 @@ size_t mg_http_next_multipart(struct mg_str body, size_t ofs,
     h1 = h2 = h2 + 2;
   }
   b1 = b2 = h2 + 2;
-  while (b2 + 2 + (b - ofs) + 2 < max && !(s[b2] == '\r' && s[b2 + 1] == '\n' &&
-                                           memcmp(&s[b2 + 2], s, b - ofs) == 0))
+  while (b2 + 2 + (b - ofs) + 2 < max) {
+    size_t limit = max - (b - ofs) - 4;
+    const char *p = (const char *) memchr(&s[b2], '\r', limit - b2);
+    if (p == NULL) {
+      b2 = limit;
+      break;
+    }
+    b2 = (size_t) (p - s);
+    if (s[b2 + 1] == '\n' && memcmp(&s[b2 + 2], s, b - ofs) == 0) break;
     b2++;
+  }
 
   if (b2 + 2 >= max) return 0;
   if (part != NULL) part->body = mg_str_n(&s[b1], b2 - b1);
@@ -60,6 +73,176 @@ size_t mg_http_next_multipart(struct mg_str body, size_t ofs,
   return b2 + 2;
 }
 
+enum { MP_PREAMBLE, MP_DELIM, MP_DASH, MP_CRLF, MP_HEADERS, MP_DATA, MP_DONE };
+
+bool mg_http_mp_init(struct mg_http_mp *mp, struct mg_http_message *hm,
+                     void (*fn)(struct mg_http_mp *, int,
+                                struct mg_http_part *),
+                     void *fn_data) {
+  struct mg_str *ct = mg_http_get_header(hm, "Content-Type"), b;
+  memset(mp, 0, sizeof(*mp));
+  mp->fn = fn, mp->fn_data = fn_data, mp->state = -1;
+  if (ct == NULL) return false;
+  b = mg_http_get_header_var(*ct, mg_str_n("boundary", 8));
+  if (b.len == 0 || b.len > 70 || memchr(b.ptr, '\r', b.len) != NULL ||
+      memchr(b.ptr, '\n', b.len) != NULL) {
+    return false;
+  }
+  memcpy(mp->delim, "\r\n--", 4);
+  memcpy(mp->delim + 4, b.ptr, b.len);
+  mp->dlen = b.len + 4;
+  // The body starts with a delimiter without leading CRLF. Pretend that the
+  // CRLF has been seen already
+  mp->match = 2;
+  mp->state = MP_PREAMBLE;
+  return true;
+}
+
+static void mp_call(struct mg_http_mp *mp, int ev, const char *p, size_t n) {
+  mp->part.body = mg_str_n(p, n);
+  if (ev == MG_HTTP_MP_DATA) mp->size += n;
+  if (mp->fn != NULL && (n > 0 || ev != MG_HTTP_MP_DATA)) {
+    mp->fn(mp, ev, &mp->part);
+  }
+}
+
+// Part headers are complete, find out name and filename
+static void mp_begin(struct mg_http_mp *mp) {
+  struct mg_str cd = mg_str_n("Content-Disposition", 19);
+  size_t i = 0, j;
+  mp->part.name = mp->part.filename = mg_str_n(NULL, 0);
+  while (i < mp->hlen) {
+    const char *h = &mp->hdrs[i];
+    for (j = i; j + 1 < mp->hlen && mp->hdrs[j] != '\r';) j++;
+    if (j - i > cd.len + 1 && h[cd.len] == ':' &&
+        mg_ncasecmp(h, cd.ptr, cd.len) == 0) {
+      struct mg_str v = mg_str_n(h + cd.len + 1, j - i - cd.len - 1);
+      mp->part.name = mg_http_get_header_var(v, mg_str_n("name", 4));
+      mp->part.filename = mg_http_get_header_var(v, mg_str_n("filename", 8));
+    }
+    i = j + 2;
+  }
+  mp->size = 0;
+  mp->state = MP_DATA;
+  mp_call(mp, MG_HTTP_MP_BEGIN, NULL, 0);
+}
+
+static void mp_delim(struct mg_http_mp *mp) {
+  if (mp->state == MP_DATA) mp_call(mp, MG_HTTP_MP_END, NULL, 0);
+  if (mp->state >= 0) mp->state = MP_DELIM;  // Callback may set an error
+  mp->match = 0;
+}
+
+// Scan data for the delimiter. Delimiter starts with CR, and boundary can't
+// contain CR, so memchr() finds all candidates, and a partially matched
+// delimiter can't overlap with the next one
+static size_t mp_scan(struct mg_http_mp *mp, const char *buf, size_t len) {
+  size_t i = 0, n;
+  int ev = mp->state == MP_DATA ? MG_HTTP_MP_DATA : -1;
+  if (mp->match > 0) {
+    n = mp->dlen - mp->match < len ? mp->dlen - mp->match : len;
+    if (memcmp(mp->delim + mp->match, buf, n) == 0) {
+      mp->match += n;
+      if (mp->match == mp->dlen) mp_delim(mp);
+      return n;
+    }
+    if (ev >= 0) mp_call(mp, ev, mp->delim, mp->match);  // It was data
+    mp->match = 0;
+  }
+  while (i < len) {
+    const char *p = (const char *) memchr(buf + i, '\r', len - i);
+    size_t k = p == NULL ? len : (size_t) (p - buf);
+    n = len - k < mp->dlen ? len - k : mp->dlen;
+    if (p == NULL || memcmp(p, mp->delim, n) == 0) {
+      if (ev >= 0) mp_call(mp, ev, buf, k);
+      if (n == mp->dlen) {
+        mp_delim(mp);
+      } else {
+        mp->match = n;
+      }
+      return k + n;
+    }
+    i = k + 1;
+  }
+  return len;
+}
+
+int mg_http_mp_feed(struct mg_http_mp *mp, struct mg_str data) {
+  size_t i = 0;
+  while (i < data.len && mp->state >= 0 && mp->state != MP_DONE) {
+    char ch = data.ptr[i];
+    if (mp->state == MP_PREAMBLE || mp->state == MP_DATA) {
+      i += mp_scan(mp, data.ptr + i, data.len - i);
+      continue;
+    }
+    i++;
+    if (mp->state == MP_DELIM) {  // After delimiter: "--", or padding, CRLF
+      mp->state = ch == '-'                ? MP_DASH
+                  : ch == '\r'             ? MP_CRLF
+                  : ch == ' ' || ch == '\t' ? MP_DELIM
+                                           : -1;
+    } else if (mp->state == MP_DASH) {
+      mp->state = ch == '-' ? MP_DONE : -1;
+    } else if (mp->state == MP_CRLF) {
+      mp->state = ch == '\n' ? MP_HEADERS : -1;
+      mp->hlen = 0;
+    } else if (mp->hlen + 1 >= sizeof(mp->hdrs)) {
+      mp->state = -1;  // Headers are too large
+    } else {
+      size_t n = ++mp->hlen;
+      mp->hdrs[n - 1] = ch;
+      if (n >= 2 && mp->hdrs[n - 2] == '\r' && ch == '\n' &&
+          (n == 2 || (n >= 4 && mp->hdrs[n - 4] == '\r' &&
+                      mp->hdrs[n - 3] == '\n'))) {
+        mp_begin(mp);
+      }
+    }
+  }
+  return mp->state < 0 ? -1 : mp->state == MP_DONE ? 1 : 0;
+}
+
+static void mp_path(struct mg_http_mp *mp, char *buf, size_t len) {
+  mg_snprintf(buf, len, "%s/%.*s", mp->dir == NULL ? "." : mp->dir,
+              (int) mp->part.filename.len, mp->part.filename.ptr);
+}
+
+// Save file parts to mp->dir. File names must not contain paths. On error,
+// a partially written file is deleted
+void mg_http_mp_save(struct mg_http_mp *mp, int ev, struct mg_http_part *p) {
+  struct mg_fs *fs = mp->fs == NULL ? &mg_fs_posix : mp->fs;
+  char path[MG_PATH_MAX];
+  if (ev == MG_HTTP_MP_BEGIN && p->filename.len > 0) {
+    mp_path(mp, path, sizeof(path));
+    if (memchr(p->filename.ptr, '/', p->filename.len) != NULL ||
+        memchr(p->filename.ptr, '\\', p->filename.len) != NULL ||
+        p->filename.ptr[0] == '.') {
+      MG_ERROR(("Bad file name [%.*s]", (int) p->filename.len,
+                p->filename.ptr));
+      mp->state = -1;
+    } else {
+      fs->rm(path);  // MG_FS_WRITE appends, so truncate first
+      if ((mp->fd = mg_fs_open(fs, path, MG_FS_WRITE)) == NULL) {
+        MG_ERROR(("open(%s): %d", path, errno));
+        mp->state = -1;
+      }
+    }
+  } else if (ev == MG_HTTP_MP_DATA && mp->fd != NULL) {
+    if ((mp->max_size > 0 && mp->size > mp->max_size) ||
+        fs->wr(mp->fd->fd, p->body.ptr, p->body.len) != p->body.len) {
+      MG_ERROR(("%.*s: failed at %lu bytes", (int) p->filename.len,
+                p->filename.ptr, (unsigned long) mp->size));
+      mg_fs_close(mp->fd);
+      mp->fd = NULL;
+      mp->state = -1;
+      mp_path(mp, path, sizeof(path));
+      fs->rm(path);
+    }
+  } else if (ev == MG_HTTP_MP_END) {
+    mg_fs_close(mp->fd);
+    mp->fd = NULL;
+  }
+}
+
 void mg_http_bauth(struct mg_connection *c, const char *user,
                    const char *pass) {
   struct mg_str u = mg_str(user), p = mg_str(pass);
@@ -252,9 +435,11 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
     hm->message.len = (size_t) req_len;
   }
 
-  // The 204 (No content) responses also have 0 body length
+  // The 204 (No content) and 1xx (Informational) responses also have 0 body
+  // length
   if (hm->body.len == (size_t) ~0 && is_response &&
-      mg_vcasecmp(&hm->uri, "204") == 0) {
+      (mg_vcasecmp(&hm->uri, "204") == 0 ||
+       (hm->uri.len == 3 && hm->uri.ptr[0] == '1'))) {
     hm->body.len = 0;
     hm->message.len = (size_t) req_len;
   }
@@ -262,13 +447,125 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
   return req_len;
 }
 
+struct mg_gzip {
+  struct mg_deflate deflate;  // Compressor state
+  uint32_t crc;               // CRC32 of the uncompressed data
+  uint32_t size;              // Size of the uncompressed data, modulo 2^32
+  size_t min_size;            // Minimal mg_http_reply() body size to compress
+  size_t end;                 // c->send.len after the last compressed chunk
+  bool started;               // True if gzip header is already sent
+};
+
+// Free per-connection HTTP state, and WebSocket state of upgraded connections
+static void http_free(struct mg_connection *c) {
+  mg_http_gzip_free(c);
+  mg_http_pipeline_free(c);
+  mg_ws_free(c);
+}
+
+static bool accepts_gzip(struct mg_http_message *hm) {
+  struct mg_str k, v, *ae = mg_http_get_header(hm, "Accept-Encoding");
+  struct mg_str s = ae == NULL ? mg_str_n(NULL, 0) : *ae;
+  while (mg_commalist(&s, &k, &v)) {
+    size_t n = 0;
+    k = mg_strstrip(k);
+    while (n < k.len && k.ptr[n] != ';') n++;
+    if (n == 4 && mg_ncasecmp(k.ptr, "gzip", 4) == 0) {
+      return v.len == 0 || mg_atod(v.ptr, (int) v.len, NULL) > 0.0;  // q=0?
+    }
+  }
+  return false;
+}
+
+bool mg_http_gzip(struct mg_connection *c, struct mg_http_message *hm,
+                  const struct mg_http_gzip_opts *opts) {
+  struct mg_gzip *gz = NULL;
+  mg_http_gzip_free(c);
+  // A response to HEAD has no body to compress
+  if (accepts_gzip(hm) && mg_vcasecmp(&hm->method, "HEAD") != 0 &&
+      (gz = (struct mg_gzip *) calloc(1, sizeof(*gz))) != NULL) {
+    int level = opts == NULL ? 0 : opts->level;
+    if (mg_deflate_init(&gz->deflate, level, opts == NULL ? 0 : opts->wsize)) {
+      gz->min_size = opts == NULL ? 0 : opts->min_size;
+      c->gzip = gz;
+      c->pfree = http_free;
+    } else {
+      free(gz);
+    }
+  }
+  return c->gzip != NULL;
+}
+
+void mg_http_gzip_free(struct mg_connection *c) {
+  struct mg_gzip *gz = (struct mg_gzip *) c->gzip;
+  if (gz != NULL) mg_deflate_free(&gz->deflate);
+  free(gz);
+  c->gzip = NULL;
+}
+
+// Compress data straight into the send buffer, as a part of the gzip stream
+static size_t gzip_write(struct mg_connection *c, const char *buf, size_t len,
+                         bool finish) {
+  struct mg_gzip *gz = (struct mg_gzip *) c->gzip;
+  size_t old = c->send.len;
+  if (!gz->started) {
+    mg_send(c, "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);  // RFC1952
+    gz->started = true;
+  }
+  gz->crc = mg_crc32(gz->crc, buf, len);
+  gz->size += (uint32_t) len;
+  mg_deflate(&gz->deflate, buf, len, finish, &c->send);
+  if (finish) {
+    uint8_t trailer[8];  // CRC32 and size, little endian
+    int i;
+    for (i = 0; i < 4; i++) {
+      trailer[i] = (uint8_t) (gz->crc >> (i * 8));
+      trailer[i + 4] = (uint8_t) (gz->size >> (i * 8));
+    }
+    mg_send(c, trailer, sizeof(trailer));
+  }
+  return c->send.len - old;
+}
+
+// Compressed chunk. The chunk length is not known until data is compressed,
+// so reserve space for it and fill it in afterwards. Empty chunk finishes
+// the gzip stream, and the response
+static void gzip_chunk(struct mg_connection *c, const char *buf, size_t len) {
+  struct mg_gzip *gz = (struct mg_gzip *) c->gzip;
+  size_t n, ofs = c->send.len;
+  char tmp[10];
+  if (gz->started && c->send.len != gz->end) {
+    // Something was sent uncompressed after the previous chunk. Continuing
+    // would produce a corrupt stream that the client cannot decode
+    mg_error(c, "gzip: uncompressed data in a compressed response");
+    mg_http_gzip_free(c);
+    return;
+  }
+  mg_send(c, "00000000\r\n", 10);
+  n = gzip_write(c, buf, len, len == 0);
+  if (c->send.len >= ofs + 10 + n) {
+    mg_snprintf(tmp, sizeof(tmp), "%08lx", (unsigned long) n);
+    memcpy(c->send.buf + ofs, tmp, 8);
+  }
+  mg_send(c, "\r\n", 2);
+  gz->end = c->send.len;
+  if (len == 0) {
+    mg_send(c, "0\r\n\r\n", 5);
+    mg_http_gzip_free(c);
+  }
+}
+
+// Track compressed chunks leaving the send buffer, see gzip_chunk()
+static void gzip_sent(struct mg_connection *c, size_t n) {
+  struct mg_gzip *gz = (struct mg_gzip *) c->gzip;
+  gz->end = gz->end > n ? gz->end - n : 0;
+}
+
 static void mg_http_vprintf_chunk(struct mg_connection *c, const char *fmt,
                                   va_list ap) {
   char mem[256], *buf = mem;
   size_t len = mg_vasprintf(&buf, sizeof(mem), fmt, ap);
-  mg_printf(c, "%lx\r\n", (unsigned long) len);
-  mg_send(c, buf, len > 0 ? (size_t) len : 0);
-  mg_send(c, "\r\n", 2);
+  mg_http_write_chunk(c, buf, len);
   if (buf != mem) free(buf);
 }
 
@@ -280,46 +577,190 @@ void mg_http_printf_chunk(struct mg_connection *c, const char *fmt, ...) {
 }
 
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len) {
-  mg_printf(c, "%lx\r\n", (unsigned long) len);
-  mg_send(c, buf, len);
-  mg_send(c, "\r\n", 2);
+  if (c->gzip != NULL) {
+    gzip_chunk(c, buf, len);
+  } else {
+    mg_printf(c, "%lx\r\n", (unsigned long) len);
+    mg_send(c, buf, len);
+    mg_send(c, "\r\n", 2);
+  }
 }
 
+// Preformatted status lines, so that responses just copy them
 // clang-format off
-static const char *mg_http_status_code_str(int status_code) {
-  switch (status_code) {
-    case 100: return "Continue";
-    case 201: return "Created";
-    case 202: return "Accepted";
-    case 204: return "No Content";
-    case 206: return "Partial Content";
-    case 301: return "Moved Permanently";
-    case 302: return "Found";
-    case 304: return "Not Modified";
-    case 400: return "Bad Request";
-    case 401: return "Unauthorized";
-    case 403: return "Forbidden";
-    case 404: return "Not Found";
-    case 418: return "I'm a teapot";
-    case 500: return "Internal Server Error";
-    case 501: return "Not Implemented";
-    default: return "OK";
+static const struct mg_http_status {
+  int code;
+  struct mg_str line;
+} s_status_lines[] = {
+  {100, MG_C_STR("HTTP/1.1 100 Continue\r\n")},
+  {200, MG_C_STR("HTTP/1.1 200 OK\r\n")},
+  {201, MG_C_STR("HTTP/1.1 201 Created\r\n")},
+  {202, MG_C_STR("HTTP/1.1 202 Accepted\r\n")},
+  {204, MG_C_STR("HTTP/1.1 204 No Content\r\n")},
+  {206, MG_C_STR("HTTP/1.1 206 Partial Content\r\n")},
+  {301, MG_C_STR("HTTP/1.1 301 Moved Permanently\r\n")},
+  {302, MG_C_STR("HTTP/1.1 302 Found\r\n")},
+  {304, MG_C_STR("HTTP/1.1 304 Not Modified\r\n")},
+  {400, MG_C_STR("HTTP/1.1 400 Bad Request\r\n")},
+  {401, MG_C_STR("HTTP/1.1 401 Unauthorized\r\n")},
+  {403, MG_C_STR("HTTP/1.1 403 Forbidden\r\n")},
+  {404, MG_C_STR("HTTP/1.1 404 Not Found\r\n")},
+  {418, MG_C_STR("HTTP/1.1 418 I'm a teapot\r\n")},
+  {500, MG_C_STR("HTTP/1.1 500 Internal Server Error\r\n")},
+  {501, MG_C_STR("HTTP/1.1 501 Not Implemented\r\n")},
+};
+// clang-format on
+
+// Return status line for the given code. Unknown codes are formatted
+// into `buf`, with the "OK" reason
+static struct mg_str status_line(int code, char *buf, size_t len) {
+  size_t i, n = sizeof(s_status_lines) / sizeof(s_status_lines[0]);
+  for (i = 0; i < n; i++) {
+    if (s_status_lines[i].code == code) return s_status_lines[i].line;
   }
+  return mg_str_n(buf, mg_snprintf(buf, len, "HTTP/1.1 %d OK\r\n", code));
+}
+
+// Convert days since epoch to a civil date, proleptic Gregorian calendar
+static void civil_date(int64_t days, int *y, unsigned *m, unsigned *d) {
+  int64_t z = days + 719468, era = (z >= 0 ? z : z - 146096) / 146097;
+  unsigned doe = (unsigned) (z - era * 146097);
+  unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (int) (yoe + era * 400 + (*m <= 2));
+}
+
+// Date header line, RFC9110 section 5.6.7. It is formatted at most once
+// per second
+static struct mg_str http_date(void) {
+  static const char *days[] = {"Thu", "Fri", "Sat", "Sun",
+                               "Mon", "Tue", "Wed"};
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  static char buf[48];
+  static size_t len;
+  static time_t last;
+  time_t now = time(NULL);
+  if (len == 0 || now != last) {
+    int64_t t = (int64_t) now, day = t / 86400, sec = t % 86400;
+    unsigned m, d;
+    int y;
+    if (sec < 0) sec += 86400, day--;
+    civil_date(day, &y, &m, &d);
+    len = mg_snprintf(buf, sizeof(buf),
+                      "Date: %s, %02u %s %d %02u:%02u:%02u GMT\r\n",
+                      days[((day % 7) + 7) % 7], d, months[m - 1], y,
+                      (unsigned) (sec / 3600), (unsigned) (sec / 60 % 60),
+                      (unsigned) (sec % 60));
+    last = now;
+  }
+  return mg_str_n(buf, len);
+}
+
+// Append a complete response to c->send: status line, headers, optional
+// Date, Content-Length and body. The output size is known upfront, so the
+// send buffer is resized at most once, and all parts are copied as is
+static void http_send(struct mg_connection *c, struct mg_str sl,
+                      struct mg_str hdrs, bool date, const void *body,
+                      size_t len) {
+  char cl[48];
+  size_t n = 16, total, need;
+  struct mg_str dl = date ? http_date() : mg_str_n("", 0);
+  unsigned char *p;
+  memcpy(cl, "Content-Length: ", n);
+  n += mg_lld(cl + n, (int64_t) len, false, false);
+  memcpy(cl + n, "\r\n\r\n", 4);
+  n += 4;
+  total = sl.len + hdrs.len + dl.len + n + len;
+  need = c->send.len + total;
+  if (need > c->send.size &&
+      !mg_iobuf_resize(&c->send, need + MG_IO_SIZE - need % MG_IO_SIZE)) {
+    mg_error(c, "OOM");
+    return;
+  }
+  p = c->send.buf + c->send.len;
+  memcpy(p, sl.ptr, sl.len), p += sl.len;
+  if (hdrs.len > 0) memcpy(p, hdrs.ptr, hdrs.len), p += hdrs.len;
+  if (dl.len > 0) memcpy(p, dl.ptr, dl.len), p += dl.len;
+  memcpy(p, cl, n), p += n;
+  if (len > 0) memcpy(p, body, len);
+  c->send.len += total;
+}
+
+// 1xx, 204 and 304 responses have no body, RFC 9112 6.3
+static bool has_body(struct mg_str sl) {
+  int code = sl.len > 12 ? atoi(sl.ptr + 9) : 0;
+  return code >= 200 && code != 204 && code != 304;
+}
+
+static void http_reply(struct mg_connection *c, struct mg_str sl,
+                       struct mg_str hdrs, bool date, const char *buf,
+                       size_t len) {
+  if (c->gzip != NULL && len > 0 && has_body(sl) &&
+      len >= ((struct mg_gzip *) c->gzip)->min_size) {
+    // Compress directly into the send buffer, then set the Content-Length
+    size_t n, ofs;
+    char tmp[10];
+    mg_printf(c,
+              "%.*s%.*s%.*sContent-Encoding: gzip\r\n"
+              "Vary: Accept-Encoding\r\nContent-Length:           \r\n\r\n",
+              (int) sl.len, sl.ptr, (int) hdrs.len, hdrs.ptr,
+              date ? (int) http_date().len : 0, date ? http_date().ptr : "");
+    ofs = c->send.len;
+    n = gzip_write(c, buf, len, true);
+    if (c->send.len >= ofs + n && ofs >= 14) {
+      size_t k = mg_snprintf(tmp, sizeof(tmp), "%lu", (unsigned long) n);
+      memcpy(c->send.buf + ofs - 14, tmp, k);
+    }
+  } else {
+    http_send(c, sl, hdrs, date, buf, len);
+  }
+  mg_http_gzip_free(c);
+}
+
+static void http_vreply(struct mg_connection *c, int code,
+                        const char *headers, const char *fmt, va_list *ap) {
+  char mem[256], *buf = mem, tmp[32];
+  size_t len = mg_vasprintf(&buf, sizeof(mem), fmt, *ap);
+  http_reply(c, status_line(code, tmp, sizeof(tmp)),
+             mg_str(headers == NULL ? "" : headers), false, buf, len);
+  if (buf != mem) free(buf);
+}
+
+bool mg_http_tmpl_init(struct mg_http_tmpl *t, int code, const char *headers,
+                       bool date) {
+  char tmp[32];
+  struct mg_str sl = status_line(code, tmp, sizeof(tmp));
+  size_t n = headers == NULL ? 0 : strlen(headers);
+  t->date = date;
+  t->len = 0;
+  if ((t->buf = (char *) calloc(1, sl.len + n + 1)) == NULL) return false;
+  memcpy(t->buf, sl.ptr, sl.len);
+  if (n > 0) memcpy(t->buf + sl.len, headers, n);
+  t->len = sl.len + n;
+  return true;
+}
+
+void mg_http_tmpl_free(struct mg_http_tmpl *t) {
+  free(t->buf);
+  t->buf = NULL, t->len = 0;
+}
+
+void mg_http_tmpl_send(struct mg_connection *c, const struct mg_http_tmpl *t,
+                       const void *body, size_t len) {
+  http_reply(c, mg_str_n(t->buf, t->len), mg_str_n("", 0), t->date,
+             (const char *) body, len);
 }
-// clang-format on
 
 void mg_http_reply(struct mg_connection *c, int code, const char *headers,
                    const char *fmt, ...) {
-  char mem[256], *buf = mem;
   va_list ap;
-  size_t len;
   va_start(ap, fmt);
-  len = mg_vasprintf(&buf, sizeof(mem), fmt, ap);
+  http_vreply(c, code, headers, fmt, &ap);
   va_end(ap);
-  mg_printf(c, "HTTP/1.1 %d %s\r\n%sContent-Length: %d\r\n\r\n", code,
-            mg_http_status_code_str(code), headers == NULL ? "" : headers, len);
-  mg_send(c, buf, len > 0 ? len : 0);
-  if (buf != mem) free(buf);
 }
 
 static void http_cb(struct mg_connection *, int, void *, void *);
@@ -335,6 +776,40 @@ char *mg_http_etag(char *buf, size_t len, size_t size, time_t mtime) {
   return buf;
 }
 
+// A response to a pipelined request. Responses are queued until responses
+// to all previous requests are sent. A streamed response, like a static
+// file, is parked with its headers, and its handler is resumed in turn
+struct mg_http_resp {
+  struct mg_http_resp *next;
+  unsigned long id;          // Request ID
+  struct mg_iobuf buf;       // Response data
+  struct mg_http_stream st;  // Parked streamed response
+  bool deferred;             // Response is deferred with mg_http_defer()
+  bool done;                 // Response is complete
+};
+
+// Response queue, stored in c->pipeline
+struct pipeline {
+  struct mg_http_resp *head;  // Oldest first
+  struct mg_http_resp *cur;   // Request being handled
+  unsigned long last_id;      // ID of the last queued request
+  size_t count;               // Number of queued responses
+  bool stalled;               // Queue is full, requests are not parsed
+};
+
+static void pipeline_flush(struct mg_connection *c);
+
+// Streamed response is sent. Send responses queued behind it, and handle
+// pipelined requests received meanwhile
+static void http_resume(struct mg_connection *c) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  pipeline_flush(c);
+  if (c->pfn == http_cb && c->recv.len > 0 &&
+      (pl == NULL || pl->cur == NULL)) {
+    http_cb(c, MG_EV_READ, NULL, NULL);
+  }
+}
+
 static void static_cb(struct mg_connection *c, int ev, void *ev_data,
                       void *fn_data) {
   if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
@@ -347,13 +822,110 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data,
     n = fd->fs->rd(fd->fd, c->send.buf + c->send.len, space);
     c->send.len += n;
     *cl -= n;
-    if (n == 0) restore_http_cb(c);
+    if (n == 0) restore_http_cb(c), http_resume(c);
   } else if (ev == MG_EV_CLOSE) {
     restore_http_cb(c);
   }
   (void) ev_data;
 }
 
+// State of mg_http_json_stream(), stored in c->pfn_data
+struct json_stream {
+  struct mg_json_writer w;  // Writer, its output goes to json_write()
+  struct mg_connection *c;  // Connection to write to
+  mg_http_json_fn fn;       // Writes the next piece of the document
+  void *fn_data;            // Its parameter
+  size_t ofs;               // Open chunk offset in c->send
+  bool chunk;               // True if a chunk is open
+};
+
+// Output goes straight into c->send, after a fixed width chunk header that
+// is filled in when the chunk is closed
+static void json_write(const char *buf, size_t len, void *param) {
+  struct json_stream *js = (struct json_stream *) param;
+  struct mg_connection *c = js->c;
+  if (buf == NULL) return;  // Size hint
+  if (!js->chunk) {
+    js->ofs = c->send.len;
+    js->chunk = mg_send(c, "00000000\r\n", 10);
+  }
+  if (js->chunk) mg_write_iobuf(buf, len, &c->send);
+}
+
+static void json_chunk_end(struct json_stream *js) {
+  struct mg_connection *c = js->c;
+  size_t n;
+  if (!js->chunk) return;
+  js->chunk = false;
+  n = c->send.len - js->ofs - 10;
+  if (n == 0) {
+    c->send.len = js->ofs;  // Empty chunk would terminate the response
+  } else if (c->gzip != NULL) {
+    // Compressor output goes to c->send too, so move raw data out of it
+    char *tmp = (char *) malloc(n);
+    if (tmp != NULL) memcpy(tmp, c->send.buf + js->ofs + 10, n);
+    c->send.len = js->ofs;
+    if (tmp != NULL) mg_http_write_chunk(c, tmp, n);
+    free(tmp);
+  } else {
+    char tmp[10];
+    mg_snprintf(tmp, sizeof(tmp), "%08lx", (unsigned long) n);
+    memcpy(c->send.buf + js->ofs, tmp, 8);
+    mg_send(c, "\r\n", 2);
+  }
+}
+
+static void json_done(struct mg_connection *c, struct json_stream *js) {
+  free(js);
+  c->pfn_data = NULL;
+  restore_http_cb(c);
+}
+
+// Generate the document while the send buffer is short, and continue when
+// it is sent. Each round becomes one chunk
+static void json_cb(struct mg_connection *c, int ev, void *ev_data,
+                    void *fn_data) {
+  struct json_stream *js = (struct json_stream *) fn_data;
+  if (ev == MG_EV_WRITE && c->gzip != NULL) {
+    gzip_sent(c, (size_t) *(long *) ev_data);
+  }
+  if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+    bool more = true;
+    while (more && !js->w.failed && c->send.len < MG_IO_SIZE) {
+      more = js->fn(&js->w, js->fn_data);
+    }
+    json_chunk_end(js);
+    if (js->w.failed) {
+      mg_error(c, "JSON nesting is too deep");
+    } else if (!more) {
+      mg_http_write_chunk(c, "", 0);
+      json_done(c, js), http_resume(c);
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    js->fn(NULL, js->fn_data);  // Document is not complete, let it clean up
+    json_done(c, js);
+  }
+}
+
+bool mg_http_json_stream(struct mg_connection *c, int code,
+                         const char *headers, mg_http_json_fn fn,
+                         void *fn_data) {
+  struct json_stream *js = (struct json_stream *) calloc(1, sizeof(*js));
+  char tmp[32];
+  struct mg_str sl = status_line(code, tmp, sizeof(tmp));
+  if (js == NULL) {
+    mg_http_reply(c, 500, "", "OOM\n");
+    return false;
+  }
+  mg_printf(c, "%.*s%s%sTransfer-Encoding: chunked\r\n\r\n", (int) sl.len,
+            sl.ptr, headers == NULL ? "" : headers,
+            c->gzip == NULL ? "" : "Content-Encoding: gzip\r\n");
+  mg_json_writer_init(&js->w, json_write, js);
+  js->c = c, js->fn = fn, js->fn_data = fn_data;
+  c->pfn = json_cb, c->pfn_data = js;
+  return true;
+}
+
 // Known mime types. Keep it outside guess_content_type() function, since
 // some environments don't like it defined there.
 // clang-format off
@@ -414,24 +986,143 @@ static struct mg_str guess_content_type(struct mg_str path, const char *extra) {
   return mg_str("text/plain; charset=utf-8");
 }
 
-static int getrange(struct mg_str *s, int64_t *a, int64_t *b) {
-  size_t i, numparsed = 0;
-  // MG_INFO(("%.*s", (int) s->len, s->ptr));
-  for (i = 0; i + 6 < s->len; i++) {
-    if (memcmp(&s->ptr[i], "bytes=", 6) == 0) {
-      struct mg_str p = mg_str_n(s->ptr + i + 6, s->len - i - 6);
-      if (p.len > 0 && p.ptr[0] >= '0' && p.ptr[0] <= '9') numparsed++;
-      *a = mg_to64(p);
-      // MG_INFO(("PPP [%.*s] %d", (int) p.len, p.ptr, numparsed));
-      while (p.len && p.ptr[0] >= '0' && p.ptr[0] <= '9') p.ptr++, p.len--;
-      if (p.len && p.ptr[0] == '-') p.ptr++, p.len--;
-      *b = mg_to64(p);
-      if (p.len > 0 && p.ptr[0] >= '0' && p.ptr[0] <= '9') numparsed++;
-      // MG_INFO(("PPP [%.*s] %d", (int) p.len, p.ptr, numparsed));
-      break;
+// Parse Range header like "bytes=0-99,200-,-50" into pairs of first and last
+// byte offsets. Unsatisfiable ranges are skipped. Return number of ranges, or
+// -1 if the header is malformed or has too many ranges, and must be ignored
+static int getranges(struct mg_str *s, int64_t size, int64_t *r) {
+  struct mg_str k, v, p;
+  int n = 0, total = 0;
+  if (s->len < 6 || memcmp(s->ptr, "bytes=", 6) != 0) return -1;
+  p = mg_str_n(s->ptr + 6, s->len - 6);
+  while (mg_commalist(&p, &k, &v)) {
+    size_t i = 0, j;
+    int64_t a, b;
+    k = mg_strstrip(k);
+    while (i < k.len && k.ptr[i] >= '0' && k.ptr[i] <= '9') i++;
+    if (i >= k.len || k.ptr[i] != '-' || v.len > 0) return -1;
+    for (j = i + 1; j < k.len && k.ptr[j] >= '0' && k.ptr[j] <= '9';) j++;
+    if (j < k.len || (i == 0 && j == i + 1)) return -1;
+    if (++total > MG_MAX_HTTP_RANGES) return -1;
+    a = mg_to64(mg_str_n(k.ptr, i));
+    b = mg_to64(mg_str_n(k.ptr + i + 1, j - i - 1));
+    if (i == 0) {  // Suffix range "-N" - last N bytes
+      a = b == 0 ? size : b > size ? 0 : size - b;
+      b = size - 1;
+    } else if (j == i + 1) {  // Range "N-" - till the end
+      b = size - 1;
     }
+    if (a <= b && b < size) r[n * 2] = a, r[n * 2 + 1] = b, n++;
+  }
+  return n;
+}
+
+// State of the multipart/byteranges response
+struct byteranges {
+  struct mg_fd *fd;                         // File being served
+  const char *mime;                         // Content type of the parts
+  int64_t size;                             // File size
+  int64_t left;                             // Bytes left in the current part
+  int i, n;                                 // Current part, number of parts
+  char boundary[20];                        // Multipart boundary
+  int64_t ranges[MG_MAX_HTTP_RANGES * 2];  // First and last offsets
+};
+
+static void nop(char ch, void *param) {
+  (void) ch, (void) param;
+}
+
+// Print header of the i-th part, or the closing delimiter if i == n
+static size_t part_hdr(void (*fn)(char, void *), void *param,
+                       struct byteranges *br, int i) {
+  if (i >= br->n) return mg_rprintf(fn, param, "\r\n--%s--\r\n", br->boundary);
+  return mg_rprintf(fn, param,
+                    "%s--%s\r\nContent-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    i == 0 ? "" : "\r\n", br->boundary, br->mime,
+                    br->ranges[i * 2], br->ranges[i * 2 + 1], br->size);
+}
+
+static void byteranges_done(struct mg_connection *c) {
+  struct byteranges *br = (struct byteranges *) c->pfn_data;
+  c->pfn_data = br->fd;
+  free(br);
+  restore_http_cb(c);
+}
+
+// Stream parts one after another, reading file data straight into the
+// send buffer, like static_cb() does
+static void byteranges_cb(struct mg_connection *c, int ev, void *ev_data,
+                          void *fn_data) {
+  struct byteranges *br = (struct byteranges *) fn_data;
+  if (ev == MG_EV_WRITE || ev == MG_EV_POLL) {
+    if (c->send.size < MG_IO_SIZE) mg_iobuf_resize(&c->send, MG_IO_SIZE);
+    while (c->send.len < c->send.size && (br->left > 0 || br->i <= br->n)) {
+      size_t n, space = c->send.size - c->send.len;
+      if (br->left == 0) {
+        part_hdr(mg_putchar_iobuf, &c->send, br, br->i);
+        if (br->i < br->n) {
+          br->fd->fs->sk(br->fd->fd, (size_t) br->ranges[br->i * 2]);
+          br->left = br->ranges[br->i * 2 + 1] - br->ranges[br->i * 2] + 1;
+        }
+        br->i++;
+        continue;
+      }
+      if ((int64_t) space > br->left) space = (size_t) br->left;
+      n = br->fd->fs->rd(br->fd->fd, c->send.buf + c->send.len, space);
+      if (n == 0) {  // File has been truncated, give up
+        c->is_draining = 1;
+        br->left = 0, br->i = br->n + 1;
+        break;
+      }
+      c->send.len += n;
+      br->left -= (int64_t) n;
+    }
+    if (br->left == 0 && br->i > br->n) byteranges_done(c), http_resume(c);
+  } else if (ev == MG_EV_CLOSE) {
+    byteranges_done(c);
+  }
+  (void) ev_data;
+}
+
+// Multipart/byteranges response for several ranges. Part headers are known
+// upfront, so Content-Length is too, and parts are streamed from the file
+static void serve_byteranges(struct mg_connection *c,
+                             struct mg_http_message *hm, struct mg_fd *fd,
+                             int64_t *ranges, int n, int64_t size,
+                             struct mg_str mime, const char *etag,
+                             const struct mg_http_serve_opts *opts) {
+  struct byteranges *br =
+      (struct byteranges *) calloc(1, sizeof(*br) + mime.len + 1);
+  int64_t cl = 0;
+  int i;
+  if (br == NULL) {
+    mg_http_reply(c, 500, opts->extra_headers, "OOM\n");
+    mg_fs_close(fd);
+    return;
+  }
+  br->fd = fd, br->size = size, br->n = n;
+  br->mime = (char *) (br + 1);
+  memcpy((char *) (br + 1), mime.ptr, mime.len);
+  memcpy(br->ranges, ranges, (size_t) n * 2 * sizeof(ranges[0]));
+  mg_random_str(br->boundary, sizeof(br->boundary));
+  for (i = 0; i <= n; i++) cl += (int64_t) part_hdr(nop, NULL, br, i);
+  for (i = 0; i < n; i++) cl += ranges[i * 2 + 1] - ranges[i * 2] + 1;
+  mg_printf(c,
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Type: multipart/byteranges; boundary=%s\r\n"
+            "Etag: %s\r\n"
+            "Content-Length: %lld\r\n"
+            "%s\r\n",
+            br->boundary, etag, cl,
+            opts->extra_headers ? opts->extra_headers : "");
+  if (mg_vcasecmp(&hm->method, "HEAD") == 0) {
+    c->is_draining = 1;
+    mg_fs_close(fd);
+    free(br);
+  } else {
+    c->pfn = byteranges_cb;
+    c->pfn_data = br;
   }
-  return (int) numparsed;
 }
 
 void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
@@ -474,38 +1165,43 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
     mg_printf(c, "HTTP/1.1 304 Not Modified\r\n%sContent-Length: 0\r\n\r\n",
               opts->extra_headers ? opts->extra_headers : "");
   } else {
-    int n, status = 200;
-    char range[100];
-    int64_t r1 = 0, r2 = 0, cl = (int64_t) size;
+    int n = -1, status = 200;
+    char range[100], sbuf[32];
+    int64_t ranges[MG_MAX_HTTP_RANGES * 2], cl = (int64_t) size;
+    struct mg_str sl;
 
-    // Handle Range header
+    // Handle Range header. If-Range, if present, must match the current Etag
     struct mg_str *rh = mg_http_get_header(hm, "Range");
+    struct mg_str *ir = mg_http_get_header(hm, "If-Range");
     range[0] = '\0';
-    if (rh != NULL && (n = getrange(rh, &r1, &r2)) > 0 && r1 >= 0 && r2 >= 0) {
-      // If range is specified like "400-", set second limit to content len
-      if (n == 1) r2 = cl - 1;
-      if (r1 > r2 || r2 >= cl) {
-        status = 416;
-        cl = 0;
-        mg_snprintf(range, sizeof(range), "Content-Range: bytes */%lld\r\n",
-                    (int64_t) size);
-      } else {
-        status = 206;
-        cl = r2 - r1 + 1;
-        mg_snprintf(range, sizeof(range),
-                    "Content-Range: bytes %lld-%lld/%lld\r\n", r1, r1 + cl - 1,
-                    (int64_t) size);
-        fs->sk(fd->fd, (size_t) r1);
-      }
+    if (rh != NULL && (ir == NULL || mg_vcasecmp(ir, etag) == 0)) {
+      n = getranges(rh, cl, ranges);
+    }
+    if (n > 1) {
+      serve_byteranges(c, hm, fd, ranges, n, cl, mime, etag, opts);
+      return;
+    } else if (n == 0) {
+      status = 416;
+      cl = 0;
+      mg_snprintf(range, sizeof(range), "Content-Range: bytes */%lld\r\n",
+                  (int64_t) size);
+    } else if (n == 1) {
+      status = 206;
+      cl = ranges[1] - ranges[0] + 1;
+      mg_snprintf(range, sizeof(range),
+                  "Content-Range: bytes %lld-%lld/%lld\r\n", ranges[0],
+                  ranges[1], (int64_t) size);
+      fs->sk(fd->fd, (size_t) ranges[0]);
     }
+    sl = status_line(status, sbuf, sizeof(sbuf));
     mg_printf(c,
-              "HTTP/1.1 %d %s\r\n"
+              "%.*s"
               "Content-Type: %.*s\r\n"
               "Etag: %s\r\n"
               "Content-Length: %llu\r\n"
               "%s%s%s\r\n",
-              status, mg_http_status_code_str(status), (int) mime.len, mime.ptr,
-              etag, cl, gzip ? "Content-Encoding: gzip\r\n" : "", range,
+              (int) sl.len, sl.ptr, (int) mime.len, mime.ptr, etag, cl,
+              gzip ? "Content-Encoding: gzip\r\n" : "", range,
               opts->extra_headers ? opts->extra_headers : "");
     if (mg_vcasecmp(&hm->method, "HEAD") == 0) {
       c->is_draining = 1;
@@ -778,45 +1474,51 @@ static size_t get_chunk_length(const char *buf, size_t len, size_t *ll) {
 }
 
 // Walk through all chunks in the chunked body. For each chunk, fire
-// an MG_EV_HTTP_CHUNK event.
+// an MG_EV_HTTP_CHUNK event, passing chunk data in place. Chunks deleted by
+// the user are cut out of the receive buffer afterwards, in one pass
 static bool walkchunks(struct mg_connection *c, struct mg_http_message *hm,
                        size_t reqlen) {
-  size_t off = 0, bl, ll;
-  while (off + reqlen < c->recv.len) {
-    char *buf = (char *) &c->recv.buf[reqlen];
-    size_t memo = c->recv.len;
-    size_t cl = get_chunk_length(&buf[off], memo - reqlen - off, &ll);
-    // MG_INFO(("len %zu off %zu cl %zu ll %zu", len, off, cl, ll));
-    if (cl == 0) break;
+  char *buf = (char *) &c->recv.buf[reqlen];
+  size_t off = 0, w = 0, bl = 0, cl, ll, len = c->recv.len - reqlen;
+  bool deleted = false, last = false;
+  while (off < len && !last) {
+    if ((cl = get_chunk_length(&buf[off], len - off, &ll)) == 0) break;
     hm->chunk = mg_str_n(&buf[off + ll], cl < ll + 2 ? 0 : cl - ll - 2);
+    c->is_chunk_del = 0;  // mg_http_delete_chunk() sets it
     mg_call(c, MG_EV_HTTP_CHUNK, hm);
-    // Increase offset only if user has not deleted this chunk
-    if (memo == c->recv.len) off += cl;
-    if (cl <= 5) {
-      // Zero chunk - last one. Prepare body - cut off chunk lengths
-      if (memo != c->recv.len) return true;  // Tell caller to cleanup
-      off = bl = 0;
-      while (off + reqlen < c->recv.len) {
-        char *buf2 = (char *) &c->recv.buf[reqlen];
-        size_t memo2 = c->recv.len;
-        size_t cl2 = get_chunk_length(&buf2[off], memo2 - reqlen - off, &ll);
-        size_t n = cl2 < ll + 2 ? 0 : cl2 - ll - 2;
-        memmove(buf2 + bl, buf2 + off + ll, n);
-        bl += n;
-        off += cl2;
-        if (cl2 <= 5) break;
-      }
-      // MG_INFO(("BL->%d del %d off %d", (int) bl, (int) del, (int) off));
-      c->recv.len -= off - bl;
-      // Set message length to indicate we've received
-      // everything, to fire MG_EV_HTTP_MSG
-      hm->message.len = bl + reqlen;
-      hm->body.len = bl;
-      // If user was deleting chunks, send nothing
-      break;
+    deleted = c->is_chunk_del;
+    c->is_chunk_del = 0;
+    if (!deleted) {  // Keep the chunk, moving it over the deleted ones
+      if (w != off) memmove(buf + w, buf + off, cl);
+      w += cl;
     }
+    off += cl;
+    last = cl <= 5;  // Zero chunk - last one
   }
-  return false;
+  if (last && !deleted) {
+    // Prepare body - cut off chunk lengths
+    size_t i = 0;
+    while (i < w) {
+      size_t n;
+      cl = get_chunk_length(&buf[i], w - i, &ll);
+      n = cl < ll + 2 ? 0 : cl - ll - 2;
+      memmove(buf + bl, buf + i + ll, n);
+      bl += n;
+      i += cl;
+    }
+    // Set message length to indicate we've received
+    // everything, to fire MG_EV_HTTP_MSG
+    hm->message.len = bl + reqlen;
+    hm->body.len = bl;
+  } else {
+    bl = w;
+  }
+  // Compact the buffer, moving unprocessed data right after what's kept
+  if (bl != off) {
+    memmove(buf + bl, buf + off, len - off);
+    c->recv.len -= off - bl;
+  }
+  return last && deleted;  // Tell caller to cleanup
 }
 
 static bool mg_is_chunked(struct mg_http_message *hm) {
@@ -826,17 +1528,15 @@ static bool mg_is_chunked(struct mg_http_message *hm) {
 }
 
 void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm) {
-  struct mg_str ch = hm->chunk;
-  const char *end = (char *) &c->recv.buf[c->recv.len], *ce;
-  bool chunked = mg_is_chunked(hm);
-  if (chunked) {
-    ch.len += 4, ch.ptr -= 2;  // \r\n before and after the chunk
-    while (ch.ptr > hm->body.ptr && *ch.ptr != '\n') ch.ptr--, ch.len++;
+  if (mg_is_chunked(hm)) {
+    c->is_chunk_del = 1;  // Just mark it, walkchunks() does the deletion
+  } else {
+    struct mg_str ch = hm->chunk;
+    const char *end = (char *) &c->recv.buf[c->recv.len], *ce = &ch.ptr[ch.len];
+    if (ce < end) memmove((void *) ch.ptr, ce, (size_t) (end - ce));
+    c->recv.len -= ch.len;
+    if (c->pfn_data != NULL) c->pfn_data = (char *) c->pfn_data - ch.len;
   }
-  ce = &ch.ptr[ch.len];
-  if (ce < end) memmove((void *) ch.ptr, ce, (size_t) (end - ce));
-  c->recv.len -= ch.len;
-  if (c->pfn_data != NULL) c->pfn_data = (char *) c->pfn_data - ch.len;
 }
 
 long mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
@@ -879,12 +1579,186 @@ int mg_http_status(const struct mg_http_message *hm) {
   return atoi(hm->uri.ptr);
 }
 
+static struct mg_http_resp *pipeline_add(struct pipeline *pl) {
+  struct mg_http_resp *r = (struct mg_http_resp *) calloc(1, sizeof(*r));
+  if (r != NULL) {
+    r->id = ++pl->last_id;
+    LIST_ADD_TAIL(struct mg_http_resp, &pl->head, r);
+    pl->count++;
+  }
+  return r;
+}
+
+// Send complete responses from the head of the queue. A parked streamed
+// response takes over the connection, the rest waits until it is sent
+static void pipeline_flush(struct mg_connection *c) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  struct mg_http_resp *r;
+  if (pl != NULL && (r = pl->cur) != NULL) {
+    if (!r->deferred) r->done = true;
+    pl->cur = NULL;
+  }
+  while (pl != NULL && (r = pl->head) != NULL && r->done &&
+         c->pfn == http_cb) {
+    mg_send(c, r->buf.buf, r->buf.len);
+    if (r->st.pfn != NULL) mg_http_unpark(c, &r->st);
+    pl->head = r->next;
+    pl->count--;
+    mg_iobuf_free(&r->buf);
+    free(r);
+  }
+}
+
+// Detach a streamed response, like a static file, from the connection,
+// so that it is sent later. Return false if the response is not streamed
+bool mg_http_park(struct mg_connection *c, struct mg_http_stream *st) {
+  if (c->pfn != static_cb && c->pfn != byteranges_cb && c->pfn != json_cb) {
+    return false;
+  }
+  st->pfn = c->pfn, st->pfn_data = c->pfn_data;
+  memcpy(&st->left, c->label, sizeof(st->left));
+  c->pfn = http_cb, c->pfn_data = NULL;
+  return true;
+}
+
+// Attach a parked streamed response back, it continues on MG_EV_WRITE
+void mg_http_unpark(struct mg_connection *c, struct mg_http_stream *st) {
+  c->pfn = st->pfn, c->pfn_data = st->pfn_data;
+  memcpy(c->label, &st->left, sizeof(st->left));
+  st->pfn = NULL;
+}
+
+// Read more of a parked streamed response into `io`, which grows to at
+// most `max` bytes. Return false when the response is complete
+bool mg_http_pull(struct mg_connection *c, struct mg_http_stream *st,
+                  struct mg_iobuf *io, size_t max) {
+  struct mg_iobuf send = c->send, recv = c->recv;
+  mg_event_handler_t pfn = c->pfn;
+  void *pfn_data = c->pfn_data;
+  char label[sizeof(c->label)];
+  if (st->pfn == NULL) return false;
+  memcpy(label, c->label, sizeof(label));
+  // The response sees its own send buffer, and nothing to parse on resume
+  c->send = *io;
+  memset(&c->recv, 0, sizeof(c->recv));
+  if (c->send.size < max) mg_iobuf_resize(&c->send, max);
+  mg_http_unpark(c, st);
+  c->pfn(c, MG_EV_POLL, NULL, c->pfn_data);
+  mg_http_park(c, st);
+  *io = c->send;
+  c->send = send, c->recv = recv;
+  c->pfn = pfn, c->pfn_data = pfn_data;
+  memcpy(c->label, label, sizeof(label));
+  return st->pfn != NULL;
+}
+
+// Free a parked streamed response, closing its file
+void mg_http_stream_free(struct mg_connection *c, struct mg_http_stream *st) {
+  mg_event_handler_t pfn = c->pfn;
+  void *pfn_data = c->pfn_data;
+  if (st->pfn == NULL) return;
+  mg_http_unpark(c, st);
+  c->pfn(c, MG_EV_CLOSE, NULL, c->pfn_data);
+  c->pfn = pfn, c->pfn_data = pfn_data;
+}
+
+// Handle request. If a response to the previous request is pending, capture
+// the response into the queue. Streamed responses are parked, not read
+static void http_msg(struct mg_connection *c, struct mg_http_message *hm) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  struct mg_http_resp *r = NULL;
+  if (pl == NULL || pl->head == NULL || (r = pipeline_add(pl)) == NULL) {
+    mg_call(c, MG_EV_HTTP_MSG, hm);
+  } else {
+    struct mg_iobuf send = c->send;
+    memset(&c->send, 0, sizeof(c->send));
+    pl->cur = r;
+    mg_call(c, MG_EV_HTTP_MSG, hm);
+    mg_http_park(c, &r->st);
+    r->buf = c->send, c->send = send;
+  }
+  pipeline_flush(c);
+}
+
+unsigned long mg_http_defer(struct mg_connection *c) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  if (pl == NULL) {
+    if ((pl = (struct pipeline *) calloc(1, sizeof(*pl))) == NULL) return 0;
+    c->pipeline = pl;
+    c->pfree = http_free;
+  }
+  if (pl->cur == NULL && (pl->cur = pipeline_add(pl)) == NULL) return 0;
+  pl->cur->deferred = true;
+  return pl->cur->id;
+}
+
+void mg_http_respond(struct mg_connection *c, unsigned long id, int code,
+                     const char *headers, const char *fmt, ...) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  struct mg_http_resp *r = pl == NULL ? NULL : pl->head;
+  va_list ap;
+  while (r != NULL && r->id != id) r = r->next;
+  if (r == NULL || r->done) {
+    MG_ERROR(("%lu: no pending response %lu", c->id, id));
+  } else if (r == pl->cur) {
+    // Called from the handler of that request, c->send is the right buffer
+    va_start(ap, fmt);
+    http_vreply(c, code, headers, fmt, &ap);
+    va_end(ap);
+    r->deferred = false;
+  } else {
+    struct mg_iobuf send = c->send;
+    c->send = r->buf;
+    va_start(ap, fmt);
+    http_vreply(c, code, headers, fmt, &ap);
+    va_end(ap);
+    r->buf = c->send, c->send = send;
+    r->done = true;
+    pipeline_flush(c);
+  }
+}
+
+void mg_http_pipeline_free(struct mg_connection *c) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  struct mg_http_resp *r;
+  if (pl == NULL) return;
+  while ((r = pl->head) != NULL) {
+    pl->head = r->next;
+    mg_http_stream_free(c, &r->st);
+    mg_iobuf_free(&r->buf);
+    free(r);
+  }
+  free(pl);
+  c->pipeline = NULL;
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
-  if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
+  struct pipeline *pl = (struct pipeline *) c->pipeline;
+  if (ev == MG_EV_WRITE && c->gzip != NULL) {
+    gzip_sent(c, (size_t) *(long *) evd);
+  }
+  if (ev == MG_EV_POLL && pl != NULL && pl->stalled &&
+      pl->count < MG_MAX_HTTP_PIPELINE) {
+    pl->stalled = false;  // Queue has room, handle remaining requests
+    http_cb(c, MG_EV_READ, evd, fnd);
+  } else if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
     struct mg_http_message hm;
     while (c->recv.buf != NULL && c->recv.len > 0) {
-      int n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
-      bool is_chunked = n > 0 && mg_is_chunked(&hm);
+      int n;
+      bool is_chunked;
+#if MG_ENABLE_HTTP2
+      if (c->is_accepted && ev == MG_EV_READ && c->pfn_data == NULL &&
+          mg_http2_upgrade(c)) {
+        break;
+      }
+#endif
+      if ((pl = (struct pipeline *) c->pipeline) != NULL &&
+          pl->count >= MG_MAX_HTTP_PIPELINE && ev == MG_EV_READ) {
+        pl->stalled = true;
+        break;
+      }
+      n = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
+      is_chunked = n > 0 && mg_is_chunked(&hm);
       if (ev == MG_EV_CLOSE) {
         hm.message.len = c->recv.len;
         hm.body.len = hm.message.len - (size_t) (hm.body.ptr - hm.message.ptr);
@@ -900,8 +1774,9 @@ static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
         mg_error(c, "HTTP parse:\n%.*s", (int) c->recv.len, c->recv.buf);
         break;
       } else if (n > 0 && (size_t) c->recv.len >= hm.message.len) {
-        mg_call(c, MG_EV_HTTP_MSG, &hm);
+        http_msg(c, &hm);
         mg_iobuf_del(&c->recv, 0, hm.message.len);
+        if (c->pfn != http_cb) break;  // Response is streamed, or upgraded
       } else {
         if (n > 0 && !is_chunked) {
           hm.chunk =
@@ -925,6 +1800,190 @@ static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
   (void) evd;
 }
 
+// A request waiting for a pooled connection
+struct mg_http_pool_req {
+  struct mg_http_pool_req *next;
+  mg_event_handler_t fn;  // User's event handler
+  void *fn_data;          // User's event handler data
+  char *url;              // Stored right after this struct
+};
+
+// State of a pooled connection, stored in c->fn_data
+struct pconn {
+  struct mg_http_pool *pool;  // Pool this connection belongs to, or NULL
+  mg_event_handler_t fn;      // Current request's handler. NULL when idle
+  void *fn_data;              // Current request's handler data
+  uint64_t idle_since;        // When the connection became idle
+  bool is_tls;                // Pool initialises TLS for https:// URLs
+  bool keep;                  // Response allows keep-alive
+  bool done;                  // Response is received
+  bool connect;               // Reused connection, fire MG_EV_CONNECT
+  char *key;                  // "scheme:host:port". Stored after this struct
+};
+
+static void pool_cb(struct mg_connection *, int, void *, void *);
+
+static size_t pool_key(const char *url, char *buf, size_t len) {
+  struct mg_str host = mg_url_host(url);
+  return mg_snprintf(buf, len, "%d:%.*s:%u", mg_url_is_ssl(url) ? 1 : 0,
+                     (int) host.len, host.ptr, (unsigned) mg_url_port(url));
+}
+
+static struct mg_http_pool_req *pool_dequeue(struct mg_http_pool *pool,
+                                             const char *key) {
+  struct mg_http_pool_req **p = &pool->queue, *r;
+  char buf[300];
+  for (r = *p; r != NULL; p = &r->next, r = r->next) {
+    pool_key(r->url, buf, sizeof(buf));
+    if (strcmp(buf, key) == 0) {
+      *p = r->next;
+      return r;
+    }
+  }
+  return NULL;
+}
+
+static struct mg_connection *pool_new(struct mg_http_pool *pool,
+                                      const char *url, mg_event_handler_t fn,
+                                      void *fn_data) {
+  size_t n = pool_key(url, NULL, 0);
+  struct pconn *pc = (struct pconn *) calloc(1, sizeof(*pc) + n + 1);
+  struct mg_connection *c = NULL;
+  if (pc != NULL) {
+    pc->pool = pool, pc->fn = fn, pc->fn_data = fn_data;
+    pc->is_tls = mg_url_is_ssl(url) != 0;
+    pc->key = (char *) (pc + 1);
+    pool_key(url, pc->key, n + 1);
+    if ((c = mg_http_connect(pool->mgr, url, pool_cb, pc)) == NULL) free(pc);
+  }
+  return c;
+}
+
+// Response is received. Reuse the connection for a waiting request, or
+// leave it idle
+static void pool_release(struct mg_connection *c, struct pconn *pc) {
+  struct mg_http_pool_req *r;
+  pc->fn = NULL, pc->fn_data = NULL, pc->done = false;
+  pc->idle_since = mg_millis();
+  if (!pc->keep || pc->pool == NULL) {
+    c->is_closing = 1;
+  } else if (!c->is_closing && !c->is_draining &&
+             (r = pool_dequeue(pc->pool, pc->key)) != NULL) {
+    pc->fn = r->fn, pc->fn_data = r->fn_data, pc->connect = true;
+    free(r);
+  }
+}
+
+static bool keepalive(struct mg_http_message *hm) {
+  struct mg_str *h = mg_http_get_header(hm, "Connection");
+  if (mg_vcasecmp(&hm->method, "HTTP/1.1") == 0) {
+    return h == NULL || mg_vcasecmp(h, "close") != 0;
+  }
+  return h != NULL && mg_vcasecmp(h, "keep-alive") == 0;
+}
+
+static void pool_cb(struct mg_connection *c, int ev, void *ev_data,
+                    void *fn_data) {
+  struct pconn *pc = (struct pconn *) fn_data;
+  mg_event_handler_t fn;
+  void *fnd;
+  if (ev == MG_EV_CONNECT && pc->is_tls && pc->pool != NULL) {
+    mg_tls_init(c, pc->pool->tls);
+  } else if (ev == MG_EV_POLL && pc->connect) {
+    pc->connect = false;
+    if (pc->fn != NULL) pc->fn(c, MG_EV_CONNECT, NULL, pc->fn_data);
+  } else if (ev == MG_EV_HTTP_MSG || ev == MG_EV_HTTP_CHUNK) {
+    pc->keep = keepalive((struct mg_http_message *) ev_data);
+  }
+  fn = pc->fn, fnd = pc->fn_data;
+  if (fn != NULL) fn(c, ev, ev_data, fnd);
+  if (pc->fn != fn || pc->fn_data != fnd) {
+    // Handler has released the connection with mg_http_pool_release()
+  } else if (ev == MG_EV_HTTP_MSG &&
+             mg_http_status((struct mg_http_message *) ev_data) / 100 == 1 &&
+             mg_http_status((struct mg_http_message *) ev_data) != 101) {
+    // Interim response, like 100 Continue. The final response follows
+  } else if (ev == MG_EV_HTTP_MSG) {
+    pool_release(c, pc);
+  } else if (ev == MG_EV_HTTP_CHUNK &&
+             ((struct mg_http_message *) ev_data)->chunk.len == 0) {
+    pc->done = true;  // MG_EV_HTTP_MSG may not follow, release on poll
+  } else if (ev == MG_EV_POLL && pc->done) {
+    pool_release(c, pc);
+  } else if (ev == MG_EV_POLL && pc->fn == NULL && pc->pool != NULL &&
+             mg_millis() - pc->idle_since > pc->pool->idle_ms) {
+    c->is_closing = 1;  // Idle for too long
+  }
+  if (ev == MG_EV_CLOSE) {
+    // The slot is free now, start a waiting request, if any
+    struct mg_http_pool_req *r;
+    if (pc->pool != NULL && (r = pool_dequeue(pc->pool, pc->key)) != NULL) {
+      if (pool_new(pc->pool, r->url, r->fn, r->fn_data) == NULL) {
+        MG_ERROR(("%s: connect failed", r->url));
+      }
+      free(r);
+    }
+    c->fn = NULL;
+    free(pc);
+  }
+}
+
+void mg_http_pool_release(struct mg_connection *c) {
+  if (c->fn == pool_cb) pool_release(c, (struct pconn *) c->fn_data);
+}
+
+void mg_http_pool_init(struct mg_http_pool *pool, struct mg_mgr *mgr,
+                       size_t max_conns, uint64_t idle_ms) {
+  memset(pool, 0, sizeof(*pool));
+  pool->mgr = mgr, pool->max_conns = max_conns, pool->idle_ms = idle_ms;
+}
+
+void mg_http_pool_free(struct mg_http_pool *pool) {
+  struct mg_connection *c;
+  struct mg_http_pool_req *r;
+  while ((r = pool->queue) != NULL) pool->queue = r->next, free(r);
+  for (c = pool->mgr->conns; c != NULL; c = c->next) {
+    struct pconn *pc = (struct pconn *) c->fn_data;
+    if (c->fn != pool_cb || pc->pool != pool) continue;
+    pc->pool = NULL;  // Detach, so closing connection won't touch the pool
+    if (pc->fn == NULL) c->is_closing = 1;  // Idle
+  }
+}
+
+bool mg_http_pool_connect(struct mg_http_pool *pool, const char *url,
+                          mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c, *idle = NULL;
+  size_t count = 0;
+  char key[300];
+  pool_key(url, key, sizeof(key));
+  for (c = pool->mgr->conns; c != NULL; c = c->next) {
+    struct pconn *pc = (struct pconn *) c->fn_data;
+    if (c->fn != pool_cb || pc->pool != pool || strcmp(pc->key, key) != 0) {
+      continue;
+    }
+    count++;
+    if (pc->fn == NULL && !c->is_closing && !c->is_draining) idle = c;
+  }
+  if (idle != NULL) {
+    struct pconn *pc = (struct pconn *) idle->fn_data;
+    pc->fn = fn, pc->fn_data = fn_data, pc->connect = true;
+    MG_DEBUG(("%lu reused for %s", idle->id, url));
+    return true;
+  } else if (pool->max_conns == 0 || count < pool->max_conns) {
+    return pool_new(pool, url, fn, fn_data) != NULL;
+  } else {
+    size_t n = strlen(url);
+    struct mg_http_pool_req *r =
+        (struct mg_http_pool_req *) calloc(1, sizeof(*r) + n + 1);
+    if (r == NULL) return false;
+    r->fn = fn, r->fn_data = fn_data, r->url = (char *) (r + 1);
+    memcpy(r->url, url, n);
+    LIST_ADD_TAIL(struct mg_http_pool_req, &pool->queue, r);
+    MG_DEBUG(("%s queued, %lu conns", url, (unsigned long) count));
+    return true;
+  }
+}
+
 struct mg_connection *mg_http_connect(struct mg_mgr *mgr, const char *url,
                                       mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = mg_connect(mgr, url, fn, fn_data);
@@ -30,6 +30,13 @@ struct mg_http_serve_opts {
   struct mg_fs *fs;           // Filesystem implementation. Use NULL for POSIX
 };
 
+// Parameter for mg_http_gzip()
+struct mg_http_gzip_opts {
+  int level;        // Compression level, 1 (fastest) .. 9 (best), 0 - default
+  size_t wsize;     // Compression window size, 1024 .. 32768, 0 - default
+  size_t min_size;  // Don't compress mg_http_reply() bodies smaller than that
+};
+
 // Parameter for mg_http_next_multipart
 struct mg_http_part {
   struct mg_str name;      // Form field name
@@ -37,13 +44,70 @@ struct mg_http_part {
   struct mg_str body;      // Part contents
 };
 
+// Streaming multipart/form-data parser, see mg_http_mp_init()
+struct mg_http_mp {
+  void (*fn)(struct mg_http_mp *, int ev, struct mg_http_part *);  // Callback
+  void *fn_data;           // Arbitrary user data
+  struct mg_fs *fs;        // mg_http_mp_save(): filesystem to use
+  const char *dir;         // mg_http_mp_save(): directory to save files to
+  size_t max_size;         // mg_http_mp_save(): max file size, 0 - no limit
+  struct mg_fd *fd;        // mg_http_mp_save(): file being written
+  struct mg_http_part part;  // Current part. Name and filename are in hdrs
+  size_t size;             // Number of body bytes in the current part
+  int state;               // Parser state. Callback sets -1 to stop parsing
+  // Private parser state follows
+  size_t dlen;             // Delimiter length
+  size_t match;            // Delimiter bytes matched at the end of last data
+  size_t hlen;             // Length of the buffered part headers
+  char delim[76];          // Delimiter: CRLF, "--", boundary
+  char hdrs[1024];         // Part headers
+};
+
+// mg_http_mp callback events
+enum { MG_HTTP_MP_BEGIN, MG_HTTP_MP_DATA, MG_HTTP_MP_END };
+
+// Streamed response, like a static file, detached from its connection.
+// See mg_http_park()
+struct mg_http_stream {
+  mg_event_handler_t pfn;  // Protocol handler that streams it, or NULL
+  void *pfn_data;          // Its c->pfn_data
+  size_t left;             // Its c->label, where it keeps the length
+};
+
+struct mg_tls_opts;
+struct mg_http_pool_req;
+struct mg_json_writer;
+
+// Writes the next piece of a JSON document, see mg_http_json_stream()
+typedef bool (*mg_http_json_fn)(struct mg_json_writer *, void *fn_data);
+
+// HTTP client connection pool, see mg_http_pool_connect()
+struct mg_http_pool {
+  struct mg_mgr *mgr;               // Event manager
+  size_t max_conns;                 // Max connections per host, 0 - no limit
+  uint64_t idle_ms;                 // Close connections idle for that long
+  const struct mg_tls_opts *tls;    // TLS options for https:// URLs
+  struct mg_http_pool_req *queue;   // Requests waiting for a connection
+};
+
+// Preformatted status line and headers, see mg_http_tmpl_send()
+struct mg_http_tmpl {
+  char *buf;   // Status line and headers
+  size_t len;  // Length of buf
+  bool date;   // Add Date header
+};
+
 int mg_http_parse(const char *s, size_t len, struct mg_http_message *);
 int mg_http_get_request_len(const unsigned char *buf, size_t buf_len);
 void mg_http_printf_chunk(struct mg_connection *cnn, const char *fmt, ...);
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
+bool mg_http_json_stream(struct mg_connection *, int status_code,
+                         const char *headers, mg_http_json_fn fn,
+                         void *fn_data);
 void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm);
 struct mg_connection *mg_http_listen(struct mg_mgr *, const char *url,
                                      mg_event_handler_t fn, void *fn_data);
+void mg_http_pool_release(struct mg_connection *);
 struct mg_connection *mg_http_connect(struct mg_mgr *, const char *url,
                                       mg_event_handler_t fn, void *fn_data);
 void mg_http_serve_dir(struct mg_connection *, struct mg_http_message *hm,
@@ -52,6 +116,11 @@ void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
                         const char *path, const struct mg_http_serve_opts *);
 void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
                    const char *body_fmt, ...);
+bool mg_http_tmpl_init(struct mg_http_tmpl *, int status_code,
+                       const char *headers, bool date);
+void mg_http_tmpl_free(struct mg_http_tmpl *);
+void mg_http_tmpl_send(struct mg_connection *, const struct mg_http_tmpl *,
+                       const void *body, size_t len);
 struct mg_str *mg_http_get_header(struct mg_http_message *, const char *name);
 struct mg_str mg_http_var(struct mg_str buf, struct mg_str name);
 int mg_http_get_var(const struct mg_str *, const char *name, char *, size_t);
@@ -64,4 +133,27 @@ long mg_http_upload(struct mg_connection *c, struct mg_http_message *hm,
 void mg_http_bauth(struct mg_connection *, const char *user, const char *pass);
 struct mg_str mg_http_get_header_var(struct mg_str s, struct mg_str v);
 size_t mg_http_next_multipart(struct mg_str, size_t, struct mg_http_part *);
+bool mg_http_mp_init(struct mg_http_mp *, struct mg_http_message *,
+                     void (*fn)(struct mg_http_mp *, int,
+                                struct mg_http_part *),
+                     void *fn_data);
+int mg_http_mp_feed(struct mg_http_mp *, struct mg_str data);
+void mg_http_mp_save(struct mg_http_mp *, int ev, struct mg_http_part *);
 int mg_http_status(const struct mg_http_message *hm);
+bool mg_http_gzip(struct mg_connection *, struct mg_http_message *,
+                  const struct mg_http_gzip_opts *);
+void mg_http_gzip_free(struct mg_connection *);
+unsigned long mg_http_defer(struct mg_connection *);
+void mg_http_respond(struct mg_connection *, unsigned long id, int status_code,
+                     const char *headers, const char *body_fmt, ...);
+void mg_http_pipeline_free(struct mg_connection *);
+bool mg_http_park(struct mg_connection *, struct mg_http_stream *);
+void mg_http_unpark(struct mg_connection *, struct mg_http_stream *);
+bool mg_http_pull(struct mg_connection *, struct mg_http_stream *,
+                  struct mg_iobuf *, size_t max);
+void mg_http_stream_free(struct mg_connection *, struct mg_http_stream *);
+void mg_http_pool_init(struct mg_http_pool *, struct mg_mgr *,
+                       size_t max_conns, uint64_t idle_ms);
+void mg_http_pool_free(struct mg_http_pool *);
+bool mg_http_pool_connect(struct mg_http_pool *, const char *url,
+                          mg_event_handler_t fn, void *fn_data);
@@ -0,0 +1,1033 @@
+#include "http2.h"
+#include "http.h"
+#include "log.h"
+#include "util.h"
+
+#if MG_ENABLE_HTTP2
+// Frame types, RFC9113 section 6
+enum {
+  H2_DATA,
+  H2_HEADERS,
+  H2_PRIORITY,
+  H2_RST_STREAM,
+  H2_SETTINGS,
+  H2_PUSH_PROMISE,
+  H2_PING,
+  H2_GOAWAY,
+  H2_WINDOW_UPDATE,
+  H2_CONTINUATION
+};
+
+// Error codes, RFC9113 section 7
+enum {
+  H2_NO_ERROR,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT,
+  H2_STREAM_CLOSED,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM
+};
+
+#define H2_END_STREAM 1
+#define H2_ACK 1
+#define H2_END_HEADERS 4
+#define H2_PADDED 8
+#define H2_PRIO 0x20
+
+#define H2_FRAME_SIZE 16384  // SETTINGS_MAX_FRAME_SIZE default
+#define H2_WINDOW 65535      // SETTINGS_INITIAL_WINDOW_SIZE default
+#define H2_MAX_WINDOW 0x7fffffffL
+#define H2_TABLE_SIZE 4096  // SETTINGS_HEADER_TABLE_SIZE default
+#define H2_SEND_LIMIT (2 * H2_FRAME_SIZE)  // Stop queueing DATA after that
+#define H2_WINDOW_BATCH (H2_WINDOW / 2)    // Min WINDOW_UPDATE increment
+
+static const char s_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// HPACK static table, RFC7541 appendix A
+// clang-format off
+static const char *s_hpack_static[][2] = {
+  {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+  {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+  {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+  {":status", "206"}, {":status", "304"}, {":status", "400"},
+  {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+  {"accept-ranges", ""}, {"accept", ""},
+  {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+  {"authorization", ""}, {"cache-control", ""},
+  {"content-disposition", ""}, {"content-encoding", ""},
+  {"content-language", ""}, {"content-length", ""},
+  {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+  {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+  {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+  {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+  {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+  {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+  {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+  {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+  {"set-cookie", ""}, {"strict-transport-security", ""},
+  {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+  {"via", ""}, {"www-authenticate", ""},
+};
+
+// HPACK Huffman code, RFC7541 appendix B. The code is canonical, so the
+// decoder needs only the number of codes of each length, and symbols sorted
+// by code
+static const uint32_t s_huff_code[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6,
+    0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea,
+    0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee, 0xfffffef,
+    0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3, 0xffffff4,
+    0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb, 0xf9,
+    0x7fb, 0xfa, 0x16, 0x17, 0x18, 0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21, 0x5d,
+    0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73, 0xfd,
+    0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22, 0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76, 0x2c,
+    0x8, 0x9, 0x2d, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd,
+    0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4,
+    0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd,
+    0x7fffde, 0xffffeb, 0x7fffdf, 0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0,
+    0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8,
+    0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde, 0x7fffea,
+    0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee,
+    0x7fffef, 0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5,
+    0x3fffe6, 0x7ffff1, 0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7,
+    0x7ffff2, 0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3, 0x3ffffe6,
+    0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2, 0x1fffe4, 0x1fffe5,
+    0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5, 0xfffec,
+    0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea,
+    0x7ffff4, 0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee,
+    0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+static const uint8_t s_huff_len[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28,
+    28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28, 6, 10, 10, 12, 13, 6, 8,
+    11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6,
+    12, 10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 8, 7, 8, 13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6,
+    6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20, 22, 20, 20,
+    22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23,
+    23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22,
+    22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23,
+    22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20,
+    21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27,
+    27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+static const uint8_t s_huff_cnt[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26,
+    29, 12, 4, 15, 19, 29, 0, 3,
+};
+static const uint8_t s_huff_sym[256] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53,
+    54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114,
+    117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82,
+    83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44,
+    59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93, 126,
+    94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226,
+    153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129, 132,
+    133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181, 185,
+    186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140,
+    141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175,
+    180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171,
+    206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205,
+    210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221,
+    222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29,
+    30, 31, 127, 220, 249, 10, 13, 22,
+};
+// clang-format on
+
+#define HPACK_STATIC_SIZE (sizeof(s_hpack_static) / sizeof(s_hpack_static[0]))
+
+// HPACK dynamic table. Entries are stored newest first, each entry is
+// a 2-byte name length, a 2-byte value length, a name and a value
+struct hpack {
+  struct mg_iobuf buf;  // Entries
+  size_t count;         // Number of entries
+  size_t size;          // Table size as defined by RFC7541 section 4.1
+  size_t max;           // Maximum table size
+};
+
+struct h2_stream {
+  struct h2_stream *next;
+  uint32_t id;               // Stream ID
+  struct mg_iobuf req;       // Request, reassembled as HTTP/1.1 message
+  size_t head_len;           // Length of the request line and headers in req
+  struct mg_iobuf resp;      // Response captured from the event handler
+  size_t ofs, end;           // Response body bytes to send, resp.buf[ofs..end)
+  struct mg_http_stream st;  // Streamed response body, like a static file
+  long window;               // Send window
+  size_t unacked;            // Received bytes not yet given back to the peer
+  uint64_t vtime;            // Virtual time, for the weighted scheduling
+  unsigned weight;           // Priority weight, 1..256
+  bool received;             // Request is received, END_STREAM seen
+  bool responded;            // Response headers are sent
+  bool chunked;              // Response body is chunked
+};
+
+// HTTP/2 connection state, stored in c->pfn_data
+struct h2conn {
+  struct h2_stream *streams;  // Active streams
+  size_t num_streams;         // Number of active streams
+  struct hpack dec, enc;      // Request decoder, response encoder
+  struct mg_iobuf block;      // Header block being received or sent
+  struct mg_iobuf fields;     // Decoded header block, "name\0value\0" pairs
+  uint32_t block_id;          // Stream that sends CONTINUATION frames
+  uint8_t block_flags;        // Flags of the HEADERS frame
+  unsigned block_weight;      // Priority weight of the HEADERS frame
+  uint32_t last_id;           // Largest stream ID seen
+  long window;                // Connection send window
+  size_t unacked;             // Received bytes not yet given back to the peer
+  long init_window;           // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+  size_t frame_size;          // Peer's SETTINGS_MAX_FRAME_SIZE
+  uint64_t vtime;             // Virtual time of the last sent DATA frame
+  bool table_update;          // Encoder must signal table size change
+  bool goaway;                // Peer sent GOAWAY
+};
+
+static uint32_t be32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | p[3];
+}
+
+static size_t entry_len(const uint8_t *p) {
+  return 4 + ((size_t) p[0] << 8 | p[1]) + ((size_t) p[2] << 8 | p[3]);
+}
+
+// Evict oldest entries until an entry of `need` bytes fits
+static void hpack_evict(struct hpack *t, size_t need) {
+  while (t->count > 0 && t->size + need > t->max) {
+    size_t i, ofs = 0, n = 0;
+    for (i = 0; i < t->count; i++) ofs += (n = entry_len(t->buf.buf + ofs));
+    t->size -= n - 4 + 32;
+    t->buf.len -= n;
+    t->count--;
+  }
+}
+
+static void hpack_add(struct hpack *t, const char *name, size_t nlen,
+                      const char *value, size_t vlen) {
+  size_t n = nlen + vlen + 32;
+  hpack_evict(t, n);
+  if (n > t->max) return;  // Does not fit at all, the table is now empty
+  if (mg_iobuf_add(&t->buf, 0, NULL, 4 + nlen + vlen, MG_IO_SIZE) == 0) {
+    return;
+  }
+  t->buf.buf[0] = (uint8_t) (nlen >> 8), t->buf.buf[1] = (uint8_t) nlen;
+  t->buf.buf[2] = (uint8_t) (vlen >> 8), t->buf.buf[3] = (uint8_t) vlen;
+  memcpy(t->buf.buf + 4, name, nlen);
+  memcpy(t->buf.buf + 4 + nlen, value, vlen);
+  t->size += n;
+  t->count++;
+}
+
+// Lookup an entry by its 1-based index, static entries first
+static bool hpack_get(struct hpack *t, size_t idx, struct mg_str *name,
+                      struct mg_str *value) {
+  if (idx == 0) return false;
+  if (idx <= HPACK_STATIC_SIZE) {
+    *name = mg_str(s_hpack_static[idx - 1][0]);
+    *value = mg_str(s_hpack_static[idx - 1][1]);
+  } else {
+    const uint8_t *p = t->buf.buf;
+    size_t nlen, i = idx - HPACK_STATIC_SIZE - 1;
+    if (i >= t->count) return false;
+    while (i-- > 0) p += entry_len(p);
+    nlen = (size_t) p[0] << 8 | p[1];
+    *name = mg_str_n((char *) p + 4, nlen);
+    *value = mg_str_n((char *) p + 4 + nlen, ((size_t) p[2] << 8 | p[3]));
+  }
+  return true;
+}
+
+// Find an entry. Return its index, and set `exact` if the value matches too
+static size_t hpack_find(struct hpack *t, struct mg_str name,
+                         struct mg_str value, bool *exact) {
+  size_t i, idx = 0;
+  struct mg_str n, v;
+  *exact = false;
+  for (i = 1; i <= HPACK_STATIC_SIZE + t->count; i++) {
+    hpack_get(t, i, &n, &v);
+    if (mg_strcmp(n, name) != 0) continue;
+    if (mg_strcmp(v, value) == 0) return *exact = true, i;
+    if (idx == 0) idx = i;
+  }
+  return idx;
+}
+
+// Decode an integer with an n-bit prefix. Return number of bytes used,
+// or 0 on error
+static size_t hpack_int(const uint8_t *p, size_t len, unsigned n, size_t *v) {
+  size_t i = 1, max = (1U << n) - 1;
+  unsigned shift = 0;
+  if (len == 0) return 0;
+  if ((*v = p[0] & max) < max) return 1;
+  for (; i < len && shift <= 21; i++, shift += 7) {
+    *v += (size_t) (p[i] & 127) << shift;
+    if ((p[i] & 128) == 0) return i + 1;
+  }
+  return 0;
+}
+
+static void hpack_put_int(struct mg_iobuf *io, uint8_t prefix, unsigned n,
+                          size_t v) {
+  uint8_t buf[8];
+  size_t i = 0, max = (1U << n) - 1;
+  if (v < max) {
+    buf[i++] = (uint8_t) (prefix | v);
+  } else {
+    buf[i++] = (uint8_t) (prefix | max);
+    for (v -= max; v >= 128; v >>= 7) buf[i++] = (uint8_t) (v | 128);
+    buf[i++] = (uint8_t) v;
+  }
+  mg_iobuf_add(io, io->len, buf, i, MG_IO_SIZE);
+}
+
+static bool huff_decode(const uint8_t *p, size_t len, struct mg_iobuf *io) {
+  uint32_t code = 0, first = 0, index = 0;
+  unsigned i, bits = 0, ones = 1;
+  // Shortest code is 5 bits long, so the output is at most 8/5 of the input
+  if (io->len + len * 8 / 5 + 1 > io->size &&
+      !mg_iobuf_resize(io, io->len + len * 8 / 5 + MG_IO_SIZE)) {
+    return false;
+  }
+  for (; len > 0; p++, len--) {
+    for (i = 8; i-- > 0;) {
+      unsigned bit = (unsigned) (*p >> i) & 1;
+      code |= bit, ones &= bit, bits++;
+      if (code < first + s_huff_cnt[bits]) {
+        io->buf[io->len++] = s_huff_sym[index + code - first];
+        code = first = index = bits = 0, ones = 1;
+      } else if (bits >= 30) {
+        return false;  // EOS, or a code that does not exist
+      } else {
+        index += s_huff_cnt[bits];
+        first = (first + s_huff_cnt[bits]) << 1;
+        code <<= 1;
+      }
+    }
+  }
+  return bits < 8 && ones;  // Padding is the EOS prefix, all ones
+}
+
+// Decode a string literal and append it to `io`. Return number of bytes
+// used, or 0 on error
+static size_t hpack_str(const uint8_t *p, size_t len, struct mg_iobuf *io) {
+  size_t n, slen;
+  if ((n = hpack_int(p, len, 7, &slen)) == 0 || slen > len - n) return 0;
+  if (p[0] & 128) {
+    if (!huff_decode(p + n, slen, io)) return 0;
+  } else if (mg_iobuf_add(io, io->len, p + n, slen, MG_IO_SIZE) != slen) {
+    return 0;
+  }
+  return n + slen;
+}
+
+static void hpack_put_str(struct mg_iobuf *io, struct mg_str s) {
+  size_t i, bits = 0, n;
+  for (i = 0; i < s.len; i++) bits += s_huff_len[(uint8_t) s.ptr[i]];
+  if ((n = (bits + 7) / 8) < s.len) {
+    uint64_t acc = 0;
+    uint8_t *p;
+    hpack_put_int(io, 128, 7, n);
+    if (mg_iobuf_add(io, io->len, NULL, n, MG_IO_SIZE) != n) return;
+    p = io->buf + io->len - n;
+    for (bits = i = 0; i < s.len; i++) {
+      uint8_t ch = (uint8_t) s.ptr[i];
+      acc = (acc << s_huff_len[ch]) | s_huff_code[ch];
+      for (bits += s_huff_len[ch]; bits >= 8; bits -= 8) {
+        *p++ = (uint8_t) (acc >> (bits - 8));
+      }
+    }
+    if (bits > 0) *p = (uint8_t) ((acc << (8 - bits)) | (0xff >> bits));
+  } else {
+    hpack_put_int(io, 0, 7, s.len);
+    mg_iobuf_add(io, io->len, s.ptr, s.len, MG_IO_SIZE);
+  }
+}
+
+// RFC 9113 8.2.1. Names are lowercase tokens, only pseudo-headers start
+// with ':'. Values have no CR, LF or NUL, and no whitespace around them
+static bool field_ok(struct mg_str name, struct mg_str value) {
+  size_t i;
+  if (name.len == 0) return false;
+  for (i = 0; i < name.len; i++) {
+    uint8_t ch = (uint8_t) name.ptr[i];
+    if (ch <= ' ' || ch >= 0x7f || (ch >= 'A' && ch <= 'Z') ||
+        (ch == ':' && i > 0)) {
+      return false;
+    }
+  }
+  for (i = 0; i < value.len; i++) {
+    char ch = value.ptr[i];
+    if (ch == '\0' || ch == '\r' || ch == '\n') return false;
+    if ((i == 0 || i + 1 == value.len) && (ch == ' ' || ch == '\t')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Decode a header block into "name\0value\0" pairs. Return false on
+// a decoding error, which is fatal for the connection. Fields with values
+// that are invalid in HTTP/2 are flagged by `malformed`
+static bool hpack_decode(struct hpack *t, const uint8_t *p, size_t len,
+                         struct mg_iobuf *out, bool *malformed) {
+  out->len = 0;
+  *malformed = false;
+  while (len > 0) {
+    size_t n, idx, ofs = out->len, nlen;
+    struct mg_str name, value;
+    bool add = (p[0] & 0xc0) == 0x40;
+    if (p[0] & 0x80) {  // Indexed field
+      if ((n = hpack_int(p, len, 7, &idx)) == 0) return false;
+      if (!hpack_get(t, idx, &name, &value)) return false;
+      mg_iobuf_add(out, out->len, name.ptr, name.len, MG_IO_SIZE);
+      mg_iobuf_add(out, out->len, "", 1, MG_IO_SIZE);
+      mg_iobuf_add(out, out->len, value.ptr, value.len, MG_IO_SIZE);
+      mg_iobuf_add(out, out->len, "", 1, MG_IO_SIZE);
+      if (!field_ok(name, value)) *malformed = true;
+      p += n, len -= n;
+      continue;
+    } else if ((p[0] & 0xe0) == 0x20) {  // Dynamic table size update
+      if ((n = hpack_int(p, len, 5, &idx)) == 0) return false;
+      if (idx > H2_TABLE_SIZE) return false;
+      t->max = idx;
+      hpack_evict(t, 0);
+      p += n, len -= n;
+      continue;
+    }
+    // Literal field, with, without or never indexed
+    if ((n = hpack_int(p, len, add ? 6 : 4, &idx)) == 0) return false;
+    p += n, len -= n;
+    if (idx > 0) {
+      if (!hpack_get(t, idx, &name, &value)) return false;
+      mg_iobuf_add(out, out->len, name.ptr, name.len, MG_IO_SIZE);
+    } else {
+      if ((n = hpack_str(p, len, out)) == 0) return false;
+      p += n, len -= n;
+    }
+    nlen = out->len - ofs;
+    mg_iobuf_add(out, out->len, "", 1, MG_IO_SIZE);
+    if ((n = hpack_str(p, len, out)) == 0) return false;
+    p += n, len -= n;
+    if (add) {
+      hpack_add(t, (char *) out->buf + ofs, nlen,
+                (char *) out->buf + ofs + nlen + 1, out->len - ofs - nlen - 1);
+    }
+    name = mg_str_n((char *) out->buf + ofs, nlen);
+    value = mg_str_n(name.ptr + nlen + 1, out->len - ofs - nlen - 1);
+    if (!field_ok(name, value)) *malformed = true;
+    mg_iobuf_add(out, out->len, "", 1, MG_IO_SIZE);
+  }
+  return true;
+}
+
+// Encode a response header. Headers that change on every response are
+// not added to the dynamic table, they would only evict useful entries
+static void hpack_encode(struct hpack *t, struct mg_iobuf *io,
+                         struct mg_str name, struct mg_str value) {
+  static const char *volatile_headers[] = {
+      "content-length", "date", "etag", "last-modified", "content-range",
+      "set-cookie", "expires", NULL};
+  bool exact, add = true;
+  size_t i, idx = hpack_find(t, name, value, &exact);
+  if (exact) {
+    hpack_put_int(io, 128, 7, idx);
+    return;
+  }
+  for (i = 0; volatile_headers[i] != NULL; i++) {
+    if (mg_vcmp(&name, volatile_headers[i]) == 0) add = false;
+  }
+  hpack_put_int(io, add ? 0x40 : 0, add ? 6 : 4, idx);
+  if (idx == 0) hpack_put_str(io, name);
+  hpack_put_str(io, value);
+  if (add) hpack_add(t, name.ptr, name.len, value.ptr, value.len);
+}
+
+static void h2_send(struct mg_connection *c, uint8_t type, uint8_t flags,
+                    uint32_t id, const void *buf, size_t len) {
+  uint8_t hdr[9] = {(uint8_t) (len >> 16), (uint8_t) (len >> 8), (uint8_t) len,
+                  type, flags, (uint8_t) (id >> 24), (uint8_t) (id >> 16),
+                  (uint8_t) (id >> 8), (uint8_t) id};
+  mg_send(c, hdr, sizeof(hdr));
+  if (len > 0) mg_send(c, buf, len);
+}
+
+static void h2_send32(struct mg_connection *c, uint8_t type, uint32_t id,
+                      uint32_t v1, uint32_t v2, size_t len) {
+  uint8_t b[8] = {(uint8_t) (v1 >> 24), (uint8_t) (v1 >> 16),
+                  (uint8_t) (v1 >> 8),  (uint8_t) v1,
+                  (uint8_t) (v2 >> 24), (uint8_t) (v2 >> 16),
+                  (uint8_t) (v2 >> 8),  (uint8_t) v2};
+  h2_send(c, type, 0, id, b, len);
+}
+
+// Connection error: send GOAWAY and close the connection
+static void h2_error(struct mg_connection *c, struct h2conn *h2,
+                     uint32_t code) {
+  MG_DEBUG(("%lu HTTP/2 error %lu", c->id, (unsigned long) code));
+  h2_send32(c, H2_GOAWAY, 0, h2->last_id, code, 8);
+  c->is_draining = 1;
+}
+
+static struct h2_stream *h2_find(struct h2conn *h2, uint32_t id) {
+  struct h2_stream *s;
+  for (s = h2->streams; s != NULL && s->id != id; s = s->next) (void) 0;
+  return s;
+}
+
+static void h2_close(struct mg_connection *c, struct h2conn *h2,
+                     struct h2_stream *s) {
+  LIST_DELETE(struct h2_stream, &h2->streams, s);
+  mg_http_stream_free(c, &s->st);
+  mg_iobuf_free(&s->req);
+  mg_iobuf_free(&s->resp);
+  free(s);
+  h2->num_streams--;
+}
+
+// Stream error: send RST_STREAM and forget the stream
+static void h2_reset(struct mg_connection *c, struct h2conn *h2, uint32_t id,
+                     uint32_t code) {
+  struct h2_stream *s = h2_find(h2, id);
+  MG_DEBUG(("%lu HTTP/2 stream %lu error %lu", c->id, (unsigned long) id,
+            (unsigned long) code));
+  h2_send32(c, H2_RST_STREAM, id, code, 0, 4);
+  if (s != NULL) h2_close(c, h2, s);
+}
+
+static bool is_connection_header(struct mg_str name) {
+  return mg_vcmp(&name, "connection") == 0 ||
+         mg_vcmp(&name, "keep-alive") == 0 ||
+         mg_vcmp(&name, "proxy-connection") == 0 ||
+         mg_vcmp(&name, "transfer-encoding") == 0 ||
+         mg_vcmp(&name, "upgrade") == 0;
+}
+
+// Iterate over "name\0value\0" pairs
+static bool next_field(struct mg_iobuf *io, size_t *ofs, struct mg_str *name,
+                       struct mg_str *value) {
+  char *p, *end, *q;
+  if (*ofs >= io->len) return false;
+  p = (char *) io->buf + *ofs, end = (char *) io->buf + io->len;
+  if ((q = (char *) memchr(p, 0, (size_t) (end - p))) == NULL) return false;
+  *name = mg_str_n(p, (size_t) (q - p));
+  p = q + 1;
+  if ((q = (char *) memchr(p, 0, (size_t) (end - p))) == NULL) return false;
+  *value = mg_str_n(p, (size_t) (q - p));
+  *ofs = (size_t) (q + 1 - (char *) io->buf);
+  return true;
+}
+
+// Convert decoded request headers into an HTTP/1.1 style request head
+static bool h2_request(struct h2conn *h2, struct h2_stream *s) {
+  struct mg_str method = mg_str_n(NULL, 0), path = method, host = method;
+  struct mg_str k, v;
+  size_t ofs = 0;
+  bool regular = false, cookie = false;
+  while (next_field(&h2->fields, &ofs, &k, &v)) {
+    if (k.len > 0 && k.ptr[0] == ':') {
+      if (regular) return false;  // Pseudo-headers must go first
+      if (mg_vcmp(&k, ":method") == 0) {
+        method = v;
+      } else if (mg_vcmp(&k, ":path") == 0) {
+        path = v;
+      } else if (mg_vcmp(&k, ":authority") == 0) {
+        host = v;
+      } else if (mg_vcmp(&k, ":scheme") != 0) {
+        return false;
+      }
+    } else {
+      if (is_connection_header(k)) return false;
+      regular = true;
+    }
+  }
+  if (method.len == 0 || path.len == 0) return false;
+  mg_rprintf(mg_putchar_iobuf, &s->req, "%.*s %.*s HTTP/2.0\r\n",
+             (int) method.len, method.ptr, (int) path.len, path.ptr);
+  if (host.len > 0) {
+    mg_rprintf(mg_putchar_iobuf, &s->req, "host: %.*s\r\n", (int) host.len,
+               host.ptr);
+  }
+  for (ofs = 0; next_field(&h2->fields, &ofs, &k, &v);) {
+    // Body length is known at the end of the stream, Content-Length is
+    // added then. Cookies may be split into several fields, join them
+    if (k.ptr[0] == ':' || mg_vcmp(&k, "content-length") == 0 ||
+        mg_vcmp(&k, "cookie") == 0 || mg_vcmp(&k, "host") == 0) {
+      continue;
+    }
+    mg_rprintf(mg_putchar_iobuf, &s->req, "%.*s: %.*s\r\n", (int) k.len,
+               k.ptr, (int) v.len, v.ptr);
+  }
+  for (ofs = 0; next_field(&h2->fields, &ofs, &k, &v);) {
+    if (mg_vcmp(&k, "cookie") != 0) continue;
+    mg_rprintf(mg_putchar_iobuf, &s->req, "%s%.*s", cookie ? "; " : "cookie: ",
+               (int) v.len, v.ptr);
+    cookie = true;
+  }
+  if (cookie) mg_rprintf(mg_putchar_iobuf, &s->req, "\r\n");
+  s->head_len = s->req.len;
+  return true;
+}
+
+static bool is_hex(int c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+         (c >= 'A' && c <= 'F');
+}
+
+// Decode complete chunks of the chunked body at io->buf[ofs..], in place,
+// dropping the rest. Return the end of the decoded data
+static size_t h2_dechunk(struct mg_iobuf *io, size_t ofs) {
+  size_t i = ofs, end = ofs;
+  while (i < io->len) {
+    size_t j = i, len;
+    while (j < io->len && is_hex(io->buf[j])) j++;
+    len = mg_unhexn((char *) io->buf + i, j - i);
+    while (j < io->len && io->buf[j] != '\n') j++;
+    if (len == 0 || j + 1 + len > io->len) break;
+    memmove(io->buf + end, io->buf + j + 1, len);
+    end += len;
+    i = j + 1 + len + 2;  // Skip CRLF after the chunk data
+  }
+  return io->len = end;
+}
+
+// Convert a captured HTTP/1.1 response into HEADERS, and queue the body
+static void h2_respond(struct mg_connection *c, struct h2conn *h2,
+                       struct h2_stream *s, bool is_head) {
+  struct mg_iobuf *io = &s->resp;
+  char *p = (char *) io->buf, *end, *eol;
+  int n = mg_http_get_request_len(io->buf, io->len), status;
+  size_t cl = (size_t) ~0, ofs;
+  char lower[64];
+  if (n <= 0 || mg_ncasecmp(p, "HTTP/1.", 7) != 0 || n < 13) {
+    MG_ERROR(("%lu stream %lu: no response", c->id, (unsigned long) s->id));
+    h2_reset(c, h2, s->id, H2_INTERNAL_ERROR);
+    return;
+  }
+  if ((status = atoi(p + 9)) < 200 || status > 999) {
+    MG_ERROR(("%lu stream %lu: status %d", c->id, (unsigned long) s->id,
+              status));
+    h2_reset(c, h2, s->id, H2_INTERNAL_ERROR);
+    return;
+  }
+  h2->block.len = 0;
+  if (h2->table_update) {
+    hpack_put_int(&h2->block, 0x20, 5, h2->enc.max);
+    h2->table_update = false;
+  }
+  mg_snprintf(lower, sizeof(lower), "%d", status);
+  hpack_encode(&h2->enc, &h2->block, mg_str(":status"), mg_str(lower));
+  end = p + n;
+  for (p = (char *) memchr(p, '\n', (size_t) n) + 1; p < end; p = eol + 1) {
+    struct mg_str k, v;
+    char *colon;
+    eol = (char *) memchr(p, '\n', (size_t) (end - p));
+    if ((colon = (char *) memchr(p, ':', (size_t) (eol - p))) == NULL) {
+      continue;
+    }
+    k = mg_strstrip(mg_str_n(p, (size_t) (colon - p)));
+    v = mg_strstrip(mg_str_n(colon + 1, (size_t) (eol - colon - 1)));
+    if (k.len == 0 || k.len >= sizeof(lower)) continue;
+    for (ofs = 0; ofs < k.len; ofs++) {
+      char ch = k.ptr[ofs];
+      lower[ofs] = (char) (ch >= 'A' && ch <= 'Z' ? ch + 'a' - 'A' : ch);
+    }
+    k = mg_str_n(lower, k.len);
+    if (mg_vcmp(&k, "transfer-encoding") == 0 &&
+        mg_vcasecmp(&v, "chunked") == 0) {
+      s->chunked = true;
+    } else if (mg_vcmp(&k, "content-length") == 0) {
+      cl = (size_t) mg_to64(v);
+    }
+    if (is_connection_header(k)) continue;
+    hpack_encode(&h2->enc, &h2->block, k, v);
+  }
+
+  // Extract the body. A chunked body is decoded in place
+  s->ofs = s->end = (size_t) n;
+  if (s->chunked) {
+    s->end = h2_dechunk(io, s->ofs);
+  } else {
+    s->end = cl < io->len - s->ofs ? s->ofs + cl : io->len;
+  }
+  if (is_head) s->end = s->ofs;
+
+  // Send HEADERS, and CONTINUATION if the header block is large
+  for (ofs = 0; ofs == 0 || ofs < h2->block.len;) {
+    size_t len = h2->block.len - ofs;
+    uint8_t flags = 0;
+    if (len > h2->frame_size) len = h2->frame_size;
+    if (ofs + len == h2->block.len) flags |= H2_END_HEADERS;
+    if (ofs == 0 && s->ofs == s->end && s->st.pfn == NULL) {
+      flags |= H2_END_STREAM;
+    }
+    h2_send(c, ofs == 0 ? H2_HEADERS : H2_CONTINUATION, flags, s->id,
+            h2->block.buf + ofs, len);
+    if ((ofs += len) == 0) break;
+  }
+  h2->block.len = 0;
+  s->responded = true;
+  s->vtime = h2->vtime;
+  if (s->ofs == s->end && s->st.pfn == NULL) h2_close(c, h2, s);
+}
+
+static void h2_cb(struct mg_connection *, int, void *, void *);
+
+// Request is complete. Pass it to the event handler, capturing the response
+static void h2_dispatch(struct mg_connection *c, struct h2conn *h2,
+                        struct h2_stream *s) {
+  struct mg_http_message hm;
+  struct mg_iobuf send = c->send, recv = c->recv;
+  char buf[40];
+  size_t n = mg_snprintf(buf, sizeof(buf), "content-length: %lu\r\n\r\n",
+                         (unsigned long) (s->req.len - s->head_len));
+  bool is_head;
+  s->received = true;
+  mg_iobuf_add(&s->req, s->head_len, buf, n, MG_IO_SIZE);
+  if (mg_http_parse((char *) s->req.buf, s->req.len, &hm) <= 0) {
+    h2_reset(c, h2, s->id, H2_PROTOCOL_ERROR);
+    return;
+  }
+  is_head = mg_vcasecmp(&hm.method, "HEAD") == 0;
+  // The handler sees an empty recv buffer, and its output is captured.
+  // Streamed responses, like static files, are parked and read by h2_flush()
+  memset(&c->send, 0, sizeof(c->send));
+  memset(&c->recv, 0, sizeof(c->recv));
+  mg_call(c, MG_EV_HTTP_MSG, &hm);
+  if (mg_http_park(c, &s->st) && is_head) mg_http_stream_free(c, &s->st);
+  s->resp = c->send;
+  c->send = send, c->recv = recv;
+  c->pfn = h2_cb, c->pfn_data = h2;  // Protocol upgrades are not supported
+  mg_iobuf_free(&s->req);
+  h2_respond(c, h2, s, is_head);
+}
+
+// Header block is complete, decode it
+static void h2_headers(struct mg_connection *c, struct h2conn *h2) {
+  uint32_t id = h2->block_id;
+  struct h2_stream *s = h2_find(h2, id);
+  bool malformed;
+  h2->block_id = 0;
+  if (!hpack_decode(&h2->dec, h2->block.buf, h2->block.len, &h2->fields,
+                    &malformed)) {
+    h2_error(c, h2, H2_COMPRESSION_ERROR);
+  } else if (s != NULL) {
+    // Trailers. They are decoded to keep HPACK state, and ignored
+    if (s->received) {
+      h2_reset(c, h2, id, H2_STREAM_CLOSED);
+    } else if (!(h2->block_flags & H2_END_STREAM)) {
+      h2_reset(c, h2, id, H2_PROTOCOL_ERROR);
+    } else {
+      h2_dispatch(c, h2, s);
+    }
+  } else if (id <= h2->last_id) {
+    h2_error(c, h2, H2_STREAM_CLOSED);
+  } else if (h2->last_id = id, h2->goaway) {
+    // Peer is going away, and should not start new streams. Ignore
+  } else if (h2->num_streams >= MG_HTTP2_MAX_STREAMS) {
+    h2_reset(c, h2, id, H2_REFUSED_STREAM);
+  } else if ((s = (struct h2_stream *) calloc(1, sizeof(*s))) == NULL) {
+    h2_reset(c, h2, id, H2_REFUSED_STREAM);
+  } else {
+    s->id = id;
+    s->window = h2->init_window;
+    s->weight = h2->block_weight;
+    LIST_ADD_TAIL(struct h2_stream, &h2->streams, s);
+    h2->num_streams++;
+    if (malformed || !h2_request(h2, s)) {
+      h2_reset(c, h2, id, H2_PROTOCOL_ERROR);
+    } else if (h2->block_flags & H2_END_STREAM) {
+      h2_dispatch(c, h2, s);
+    }
+  }
+  h2->block.len = 0;
+}
+
+static uint32_t h2_settings(struct mg_connection *c, struct h2conn *h2,
+                            const uint8_t *p, size_t len) {
+  struct h2_stream *s;
+  for (; len >= 6; p += 6, len -= 6) {
+    uint32_t v = be32(p + 2);
+    switch (p[1]) {
+      case 1:  // SETTINGS_HEADER_TABLE_SIZE
+        h2->enc.max = v < H2_TABLE_SIZE ? v : H2_TABLE_SIZE;
+        hpack_evict(&h2->enc, 0);
+        h2->table_update = true;
+        break;
+      case 2:  // SETTINGS_ENABLE_PUSH
+        if (v > 1) return H2_PROTOCOL_ERROR;
+        break;
+      case 4:  // SETTINGS_INITIAL_WINDOW_SIZE
+        if (v > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+        for (s = h2->streams; s != NULL; s = s->next) {
+          s->window += (long) v - h2->init_window;
+        }
+        h2->init_window = (long) v;
+        break;
+      case 5:  // SETTINGS_MAX_FRAME_SIZE
+        if (v < H2_FRAME_SIZE || v > 0xffffff) {
+          return H2_PROTOCOL_ERROR;
+        }
+        h2->frame_size = v;
+        break;
+    }
+  }
+  h2_send(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+  return 0;
+}
+
+static uint32_t h2_window_update(struct mg_connection *c, struct h2conn *h2,
+                                 uint32_t id, const uint8_t *p) {
+  long inc = (long) (be32(p) & 0x7fffffff);
+  struct h2_stream *s = h2_find(h2, id);
+  if (id == 0) {
+    if (inc == 0) return H2_PROTOCOL_ERROR;
+    if (h2->window > H2_MAX_WINDOW - inc) {
+      return H2_FLOW_CONTROL_ERROR;
+    }
+    h2->window += inc;
+  } else if (id > h2->last_id) {
+    return H2_PROTOCOL_ERROR;  // Idle stream
+  } else if (inc == 0) {
+    h2_reset(c, h2, id, H2_PROTOCOL_ERROR);
+  } else if (s != NULL && s->window > H2_MAX_WINDOW - inc) {
+    h2_reset(c, h2, id, H2_FLOW_CONTROL_ERROR);
+  } else if (s != NULL) {
+    s->window += inc;
+  }
+  return 0;
+}
+
+static uint32_t h2_data(struct mg_connection *c, struct h2conn *h2,
+                        uint8_t flags, uint32_t id, const uint8_t *p,
+                        size_t len) {
+  struct h2_stream *s = h2_find(h2, id);
+  size_t flen = len;  // Padding counts for flow control too
+  if (id == 0 || id > h2->last_id) return H2_PROTOCOL_ERROR;
+  if (flags & H2_PADDED) {
+    if (len == 0 || p[0] >= len) return H2_PROTOCOL_ERROR;
+    len -= 1 + (size_t) p[0], p++;
+  }
+  // The data is consumed right away: copied to the request, or dropped.
+  // Give the peer its window back in batches, not for every frame
+  if ((h2->unacked += flen) >= H2_WINDOW_BATCH) {
+    h2_send32(c, H2_WINDOW_UPDATE, 0, (uint32_t) h2->unacked, 0, 4);
+    h2->unacked = 0;
+  }
+  if (s == NULL || s->received) {
+    h2_reset(c, h2, id, H2_STREAM_CLOSED);
+  } else if (s->req.len + len > MG_MAX_RECV_SIZE) {
+    h2_reset(c, h2, id, H2_ENHANCE_YOUR_CALM);
+  } else {
+    mg_iobuf_add(&s->req, s->req.len, p, len, MG_IO_SIZE);
+    if (flags & H2_END_STREAM) {
+      h2_dispatch(c, h2, s);  // The stream window is not needed anymore
+    } else if ((s->unacked += flen) >= H2_WINDOW_BATCH) {
+      h2_send32(c, H2_WINDOW_UPDATE, id, (uint32_t) s->unacked, 0, 4);
+      s->unacked = 0;
+    }
+  }
+  return 0;
+}
+
+// Handle a frame. Return a connection error code, or 0
+static uint32_t h2_frame(struct mg_connection *c, struct h2conn *h2,
+                         uint8_t type, uint8_t flags, uint32_t id,
+                         const uint8_t *p, size_t len) {
+  struct h2_stream *s;
+  if (h2->block_id != 0 && (type != H2_CONTINUATION || id != h2->block_id)) {
+    return H2_PROTOCOL_ERROR;
+  }
+  switch (type) {
+    case H2_DATA:
+      return h2_data(c, h2, flags, id, p, len);
+    case H2_HEADERS:
+      if (id == 0 || (id & 1) == 0) return H2_PROTOCOL_ERROR;
+      if (flags & H2_PADDED) {
+        if (len == 0 || p[0] >= len) return H2_PROTOCOL_ERROR;
+        len -= 1 + (size_t) p[0], p++;
+      }
+      h2->block_weight = 16;
+      if (flags & H2_PRIO) {
+        if (len < 5) return H2_FRAME_SIZE_ERROR;
+        if ((be32(p) & 0x7fffffff) == id) {
+          return H2_PROTOCOL_ERROR;  // Depends on itself
+        }
+        h2->block_weight = (unsigned) p[4] + 1;
+        p += 5, len -= 5;
+      }
+      h2->block_id = id, h2->block_flags = flags, h2->block.len = 0;
+      // Fall through
+    case H2_CONTINUATION:
+      if (h2->block_id == 0) return H2_PROTOCOL_ERROR;
+      if (h2->block.len + len > MG_MAX_RECV_SIZE) {
+        return H2_ENHANCE_YOUR_CALM;
+      }
+      mg_iobuf_add(&h2->block, h2->block.len, p, len, MG_IO_SIZE);
+      if (flags & H2_END_HEADERS) h2_headers(c, h2);
+      break;
+    case H2_PRIORITY:
+      if (id == 0) return H2_PROTOCOL_ERROR;
+      if (len != 5) {
+        h2_reset(c, h2, id, H2_FRAME_SIZE_ERROR);
+      } else if ((s = h2_find(h2, id)) != NULL) {
+        s->weight = (unsigned) p[4] + 1;
+      }
+      break;
+    case H2_RST_STREAM:
+      if (len != 4) return H2_FRAME_SIZE_ERROR;
+      if (id == 0 || id > h2->last_id) {
+        return H2_PROTOCOL_ERROR;
+      }
+      if ((s = h2_find(h2, id)) != NULL) h2_close(c, h2, s);
+      break;
+    case H2_SETTINGS:
+      if (id != 0) return H2_PROTOCOL_ERROR;
+      if ((flags & H2_ACK) ? len != 0 : len % 6 != 0) {
+        return H2_FRAME_SIZE_ERROR;
+      }
+      if (!(flags & H2_ACK)) return h2_settings(c, h2, p, len);
+      break;
+    case H2_PING:
+      if (id != 0) return H2_PROTOCOL_ERROR;
+      if (len != 8) return H2_FRAME_SIZE_ERROR;
+      if (!(flags & H2_ACK)) h2_send(c, H2_PING, H2_ACK, 0, p, len);
+      break;
+    case H2_GOAWAY:
+      if (id != 0) return H2_PROTOCOL_ERROR;
+      h2->goaway = true;
+      break;
+    case H2_WINDOW_UPDATE:
+      if (len != 4) return H2_FRAME_SIZE_ERROR;
+      return h2_window_update(c, h2, id, p);
+    case H2_PUSH_PROMISE:  // Clients must not push
+      return H2_PROTOCOL_ERROR;
+    default:  // Unknown frame types must be ignored
+      break;
+  }
+  return 0;
+}
+
+// Body buffered so far is sent. Drop it, and read the next frame's worth
+// from the streamed response
+static void h2_pull(struct mg_connection *c, struct h2conn *h2,
+                    struct h2_stream *s) {
+  mg_iobuf_del(&s->resp, 0, s->end);
+  mg_http_pull(c, &s->st, &s->resp, h2->frame_size);
+  s->ofs = 0;
+  s->end = s->chunked ? h2_dechunk(&s->resp, 0) : s->resp.len;
+}
+
+// Send response bodies. Among the streams that are allowed to send, pick
+// the one that is the most behind in its share of the bandwidth, which is
+// proportional to the stream weight. Streamed bodies are read as they go,
+// at most a frame at a time, so a slow peer does not make them buffered
+static void h2_flush(struct mg_connection *c, struct h2conn *h2) {
+  while (c->send.len < H2_SEND_LIMIT && h2->window > 0 && !c->is_draining) {
+    struct h2_stream *s, *best = NULL;
+    size_t n;
+    bool fin;
+    for (s = h2->streams; s != NULL; s = s->next) {
+      if (!s->responded || s->window <= 0) continue;
+      if (best == NULL || s->vtime < best->vtime) best = s;
+    }
+    if ((s = best) == NULL) break;
+    if (s->ofs == s->end && s->st.pfn != NULL) h2_pull(c, h2, s);
+    n = s->end - s->ofs;
+    if (n > h2->frame_size) n = h2->frame_size;
+    if (n > (size_t) s->window) n = (size_t) s->window;
+    if (n > (size_t) h2->window) n = (size_t) h2->window;
+    fin = s->ofs + n == s->end && s->st.pfn == NULL;
+    if (n == 0 && !fin) break;  // Streamed response made no progress
+    h2_send(c, H2_DATA, fin ? H2_END_STREAM : 0, s->id, s->resp.buf + s->ofs,
+            n);
+    s->ofs += n, s->window -= (long) n, h2->window -= (long) n;
+    h2->vtime = s->vtime;
+    s->vtime += n * 256 / s->weight;
+    if (fin) h2_close(c, h2, s);
+  }
+  if (h2->goaway && h2->streams == NULL) c->is_draining = 1;
+}
+
+static void h2_free(struct mg_connection *c, struct h2conn *h2) {
+  while (h2->streams != NULL) h2_close(c, h2, h2->streams);
+  mg_iobuf_free(&h2->dec.buf);
+  mg_iobuf_free(&h2->enc.buf);
+  mg_iobuf_free(&h2->block);
+  mg_iobuf_free(&h2->fields);
+  free(h2);
+}
+
+static void h2_cb(struct mg_connection *c, int ev, void *ev_data,
+                  void *fn_data) {
+  struct h2conn *h2 = (struct h2conn *) fn_data;
+  if (ev == MG_EV_READ) {
+    size_t ofs = 0;
+    while (!c->is_draining && c->recv.len - ofs >= 9) {
+      const uint8_t *p = c->recv.buf + ofs;
+      size_t len = (size_t) p[0] << 16 | (size_t) p[1] << 8 | p[2];
+      if (len > H2_FRAME_SIZE) {
+        h2_error(c, h2, H2_FRAME_SIZE_ERROR);
+      } else if (c->recv.len - ofs >= 9 + len) {
+        uint32_t err =
+            h2_frame(c, h2, p[3], p[4], be32(p + 5) & 0x7fffffff, p + 9, len);
+        if (err != 0) h2_error(c, h2, err);
+        ofs += 9 + len;
+      } else {
+        break;
+      }
+    }
+    mg_iobuf_del(&c->recv, 0, ofs);
+    h2_flush(c, h2);
+  } else if (ev == MG_EV_POLL || ev == MG_EV_WRITE) {
+    h2_flush(c, h2);
+  } else if (ev == MG_EV_CLOSE) {
+    h2_free(c, h2);
+    c->pfn_data = NULL;
+  }
+  (void) ev_data;
+}
+
+// If the connection starts with the HTTP/2 connection preface, switch it
+// to HTTP/2. Return true if the received data is the preface or its part
+bool mg_http2_upgrade(struct mg_connection *c) {
+  size_t n = sizeof(s_preface) - 1;
+  struct h2conn *h2;
+  if (memcmp(c->recv.buf, s_preface, c->recv.len < n ? c->recv.len : n)) {
+    return false;
+  }
+  if (c->recv.len < n) return true;
+  if ((h2 = (struct h2conn *) calloc(1, sizeof(*h2))) == NULL) {
+    mg_error(c, "OOM");
+    return true;
+  }
+  h2->window = h2->init_window = H2_WINDOW;
+  h2->frame_size = H2_FRAME_SIZE;
+  h2->dec.max = h2->enc.max = H2_TABLE_SIZE;
+  mg_iobuf_del(&c->recv, 0, n);
+  // SETTINGS_MAX_CONCURRENT_STREAMS
+  h2_send32(c, H2_SETTINGS, 0, 3 << 16 | (MG_HTTP2_MAX_STREAMS >> 16),
+            (uint32_t) MG_HTTP2_MAX_STREAMS << 16, 6);
+  c->pfn = h2_cb, c->pfn_data = h2;
+  MG_DEBUG(("%lu switched to HTTP/2", c->id));
+  h2_cb(c, MG_EV_READ, NULL, h2);
+  return true;
+}
+#endif
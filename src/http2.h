@@ -0,0 +1,7 @@
+#pragma once
+
+#include "arch.h"
+#include "config.h"
+#include "net.h"
+
+bool mg_http2_upgrade(struct mg_connection *);
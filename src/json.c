@@ -1,5 +1,6 @@
 #include "json.h"
 #include "base64.h"
+#include "config.h"
 
 static const char *escapeseq(int esc) {
   return esc ? "\b\f\n\r\t\\\"" : "bfnrt\\\"";
@@ -13,14 +14,128 @@ static char json_esc(int c, int esc) {
   return 0;
 }
 
+#if MG_ENABLE_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#define JSON_AVX2 1
+#elif MG_ENABLE_SIMD && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#elif MG_ENABLE_SIMD && MG_SIMD_NEON
+#include <arm_neon.h>
+#define JSON_NEON 1
+#endif
+
+#define JSON_IS_WS(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+#if defined(JSON_AVX2) || defined(JSON_SSE2)
+static int json_ctz(unsigned x) {
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  int n = 0;
+  while ((x & 1) == 0) x >>= 1, n++;
+  return n;
+#endif
+}
+#endif
+
+#if defined(JSON_NEON)
+// Narrow a 16-byte comparison result into 4 bits per byte
+static uint64_t json_neon_bits(uint8x16_t m) {
+  uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+#endif
+
+// Return the index of the first non-whitespace byte at or after i.
+// Most documents have single spaces, so look at two bytes before going wide
+static int json_skip_ws(const char *s, int i, int len) {
+  if (i < len && !JSON_IS_WS(s[i])) return i;
+  if (i + 1 < len && !JSON_IS_WS(s[i + 1])) return i + 1;
+#if defined(JSON_AVX2)
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    unsigned bits = ~(unsigned) _mm256_movemask_epi8(m);
+    if (bits != 0) return i + json_ctz(bits);
+  }
+#elif defined(JSON_SSE2)
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    unsigned bits = (unsigned) _mm_movemask_epi8(m) ^ 0xffffU;
+    if (bits != 0) return i + json_ctz(bits);
+  }
+#elif defined(JSON_NEON)
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) s + i);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                                     vceqq_u8(v, vdupq_n_u8('\t'))),
+                            vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                                     vceqq_u8(v, vdupq_n_u8('\r'))));
+    uint64_t bits = json_neon_bits(vmvnq_u8(m));
+    if (bits != 0) return i + __builtin_ctzll(bits) / 4;
+  }
+#endif
+  while (i < len && JSON_IS_WS(s[i])) i++;
+  return i;
+}
+
+// Return the index of the first quote, backslash or NUL, or len if none
+static int json_scan_str(const char *s, int len) {
+  int i = 0;
+#if defined(JSON_AVX2)
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+        _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    unsigned bits = (unsigned) _mm256_movemask_epi8(m);
+    if (bits != 0) return i + json_ctz(bits);
+  }
+#elif defined(JSON_SSE2)
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i m =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                     _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    unsigned bits = (unsigned) _mm_movemask_epi8(m);
+    if (bits != 0) return i + json_ctz(bits);
+  }
+#elif defined(JSON_NEON)
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) s + i);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                                     vceqq_u8(v, vdupq_n_u8('\\'))),
+                            vceqq_u8(v, vdupq_n_u8(0)));
+    uint64_t bits = json_neon_bits(m);
+    if (bits != 0) return i + __builtin_ctzll(bits) / 4;
+  }
+#endif
+  while (i < len && s[i] != '"' && s[i] != '\\' && s[i] != '\0') i++;
+  return i;
+}
+
 static int mg_pass_string(const char *s, int len) {
-  int i;
-  for (i = 0; i < len; i++) {
+  int i = 0;
+  while ((i += json_scan_str(s + i, len - i)) < len) {
     if (s[i] == '\\' && i + 1 < len && json_esc(s[i + 1], 1)) {
+      i += 2;
+    } else if (s[i] == '\\') {
       i++;
     } else if (s[i] == '\0') {
       return MG_JSON_INVALID;
-    } else if (s[i] == '"') {
+    } else {
       return i;
     }
   }
@@ -68,7 +183,10 @@ int mg_json_get(const char *s, int len, const char *path, int *toklen) {
 
   for (i = 0; i < len; i++) {
     unsigned char c = ((unsigned char *) s)[i];
-    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') continue;
+    if (JSON_IS_WS(c)) {
+      i = json_skip_ws(s, i, len) - 1;
+      continue;
+    }
     MG_DBGP('-');
     switch (expecting) {
       case S_VALUE:
@@ -121,7 +239,9 @@ int mg_json_get(const char *s, int len, const char *path, int *toklen) {
           if (n < 0) return n;
           // printf("K[%.*s] %d %d\n", n, &s[i + 1], depth, ed);
           if (depth == ed && path[pos - 1] == '.' &&
-              memcmp(&s[i + 1], &path[pos], (size_t) n) == 0) {
+              strncmp(&s[i + 1], &path[pos], (size_t) n) == 0 &&
+              (path[pos + n] == '\0' || path[pos + n] == '.' ||
+               path[pos + n] == '[')) {
             pos += n;
           }
           i += n + 1;
@@ -161,6 +281,140 @@ int mg_json_get(const char *s, int len, const char *path, int *toklen) {
   return MG_JSON_NOT_FOUND;
 }
 
+// Return the length of a scalar value at s[0], or a negative error
+static int json_scalar(const char *s, int len, int *type) {
+  int n = 0;
+  if (s[0] == 't' && len > 3 && memcmp(s, "true", 4) == 0) {
+    *type = MG_JSON_TRUE, n = 4;
+  } else if (s[0] == 'f' && len > 4 && memcmp(s, "false", 5) == 0) {
+    *type = MG_JSON_FALSE, n = 5;
+  } else if (s[0] == 'n' && len > 3 && memcmp(s, "null", 4) == 0) {
+    *type = MG_JSON_NULL, n = 4;
+  } else if (s[0] == '-' || (s[0] >= '0' && s[0] <= '9')) {
+    mg_atod(s, len, &n);
+    *type = MG_JSON_NUMBER;
+  } else if (s[0] == '"') {
+    if ((n = mg_pass_string(s + 1, len - 1)) < 0) return n;
+    *type = MG_JSON_STRING, n += 2;
+  } else {
+    n = MG_JSON_INVALID;
+  }
+  return n;
+}
+
+int mg_json_index_init(struct mg_json_index *idx, struct mg_str json,
+                       struct mg_json_tok *toks, int max_toks) {
+  enum { S_VALUE, S_KEY, S_COLON, S_COMMA_OR_EOO } expecting = S_VALUE;
+  int stack[MG_JSON_MAX_DEPTH], last[MG_JSON_MAX_DEPTH];
+  int i, n = 0, depth = 0, kofs = 0, klen = 0, len = (int) json.len;
+  const char *s = json.ptr;
+
+  idx->json = json, idx->toks = toks, idx->num = 0;
+  for (i = 0; i < len; i++) {
+    unsigned char c = ((unsigned char *) s)[i];
+    if (JSON_IS_WS(c)) {
+      i = json_skip_ws(s, i, len) - 1;
+      continue;
+    }
+    if (expecting == S_VALUE && (c != ']' || depth == 0 ||
+                                 toks[stack[depth - 1]].size > 0)) {
+      struct mg_json_tok *t = &toks[n];
+      if (n > 0 && depth == 0) return MG_JSON_INVALID;  // Second root
+      if (n >= max_toks) return MG_JSON_TOO_MANY;
+      t->ofs = i, t->kofs = kofs, t->klen = klen;
+      t->parent = depth > 0 ? stack[depth - 1] : -1;
+      t->next = -1, t->size = 0;
+      kofs = klen = 0;
+      if (depth > 0) {
+        if (last[depth - 1] >= 0) toks[last[depth - 1]].next = n;
+        last[depth - 1] = n;
+        toks[stack[depth - 1]].size++;
+      }
+      if (c == '{' || c == '[') {
+        if (depth >= MG_JSON_MAX_DEPTH) return MG_JSON_TOO_DEEP;
+        t->type = c == '{' ? MG_JSON_OBJECT : MG_JSON_ARRAY;
+        last[depth] = -1, stack[depth++] = n++;
+        expecting = c == '{' ? S_KEY : S_VALUE;
+        continue;
+      }
+      if ((t->len = json_scalar(&s[i], len - i, &t->type)) < 0) return t->len;
+      i += t->len - 1, n++;
+      expecting = S_COMMA_OR_EOO;
+    } else if (expecting == S_KEY && c == '"') {
+      if ((klen = mg_pass_string(&s[i + 1], len - i - 1)) < 0) return klen;
+      kofs = i + 1, i += klen + 1;
+      expecting = S_COLON;
+    } else if (expecting == S_COLON && c == ':') {
+      expecting = S_VALUE;
+    } else if (expecting == S_COMMA_OR_EOO && depth > 0 && c == ',') {
+      expecting = toks[stack[depth - 1]].type == MG_JSON_OBJECT ? S_KEY
+                                                                : S_VALUE;
+    } else if (depth > 0 && (c == '}' || c == ']') &&
+               (expecting == S_COMMA_OR_EOO ||
+                (toks[stack[depth - 1]].size == 0 &&
+                 expecting == (c == '}' ? S_KEY : S_VALUE)))) {
+      struct mg_json_tok *t = &toks[stack[--depth]];
+      if (t->type != (c == '}' ? MG_JSON_OBJECT : MG_JSON_ARRAY)) {
+        return MG_JSON_INVALID;
+      }
+      t->len = i - t->ofs + 1;
+      expecting = S_COMMA_OR_EOO;
+    } else {
+      return MG_JSON_INVALID;
+    }
+  }
+  if (n == 0 || depth > 0 || expecting != S_COMMA_OR_EOO) {
+    return MG_JSON_INVALID;
+  }
+  return idx->num = n;
+}
+
+// Walk down the token tree, one path component at a time
+int mg_json_index_find(const struct mg_json_index *idx, const char *path) {
+  const struct mg_json_tok *toks = idx->toks;
+  int i = 0, pos = 1;
+  if (path[0] != '$') return MG_JSON_INVALID;
+  if (idx->num <= 0) return MG_JSON_NOT_FOUND;
+  while (path[pos] != '\0') {
+    int child = toks[i].size > 0 ? i + 1 : -1;
+    if (path[pos] == '.') {
+      int n = 0;
+      pos++;
+      while (path[pos + n] != '\0' && path[pos + n] != '.' &&
+             path[pos + n] != '[') {
+        n++;
+      }
+      if (toks[i].type != MG_JSON_OBJECT) return MG_JSON_NOT_FOUND;
+      while (child >= 0 && (toks[child].klen != n ||
+                            memcmp(idx->json.ptr + toks[child].kofs,
+                                   &path[pos], (size_t) n) != 0)) {
+        child = toks[child].next;
+      }
+      pos += n;
+    } else if (path[pos] == '[') {
+      int k = 0;
+      for (pos++; path[pos] >= '0' && path[pos] <= '9'; pos++) {
+        k = k * 10 + path[pos] - '0';
+      }
+      if (path[pos++] != ']') return MG_JSON_INVALID;
+      if (toks[i].type != MG_JSON_ARRAY) return MG_JSON_NOT_FOUND;
+      while (child >= 0 && k-- > 0) child = toks[child].next;
+    } else {
+      return MG_JSON_INVALID;
+    }
+    if (child < 0) return MG_JSON_NOT_FOUND;
+    i = child;
+  }
+  return i;
+}
+
+struct mg_str mg_json_index_get(const struct mg_json_index *idx,
+                                const char *path) {
+  int i = mg_json_index_find(idx, path);
+  if (i < 0) return mg_str_n(NULL, 0);
+  return mg_str_n(idx->json.ptr + idx->toks[i].ofs, (size_t) idx->toks[i].len);
+}
+
 bool mg_json_get_num(struct mg_str json, const char *path, double *v) {
   int n, toklen, found = 0;
   if ((n = mg_json_get(json.ptr, (int) json.len, path, &toklen)) >= 0 &&
@@ -252,3 +506,121 @@ long mg_json_get_long(struct mg_str json, const char *path, long dflt) {
   if (mg_json_get_num(json, path, &dv)) result = (long) dv;
   return result;
 }
+
+void mg_json_writer_init(struct mg_json_writer *w, mg_pw_t fn, void *param) {
+  memset(w, 0, sizeof(*w));
+  w->fn = fn;
+  w->param = param;
+}
+
+// Once the writer has failed, nothing is written anymore
+static void jw(struct mg_json_writer *w, const char *buf, size_t len) {
+  if (!w->failed) w->fn(buf, len, w->param);
+}
+
+// Start a new value, putting a comma after the previous one
+static void jw_value(struct mg_json_writer *w) {
+  if (w->key) {
+    w->key = false;
+  } else if (w->depth > 0 && w->more[w->depth - 1]) {
+    jw(w, ",", 1);
+  }
+  if (w->depth > 0) w->more[w->depth - 1] = 1;
+}
+
+static void jw_quote(struct mg_json_writer *w, const char *s, size_t len) {
+  size_t i, j = 0;
+  char buf[8];
+  jw(w, "\"", 1);
+  for (i = 0; i < len; i++) {
+    unsigned char ch = (unsigned char) s[i];
+    if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+    if (i > j) jw(w, s + j, i - j);
+    if ((buf[1] = json_esc(ch, 1)) != 0) {
+      buf[0] = '\\';
+      jw(w, buf, 2);
+    } else {
+      jw(w, buf, mg_snprintf(buf, sizeof(buf), "\\u%04x", ch));
+    }
+    j = i + 1;
+  }
+  if (len > j) jw(w, s + j, len - j);
+  jw(w, "\"", 1);
+}
+
+// Too deep nesting fails the writer: commas can't be tracked past that
+static void jw_begin(struct mg_json_writer *w, const char *s) {
+  if (w->depth >= MG_JSON_MAX_DEPTH) w->failed = true;
+  jw_value(w);
+  jw(w, s, 1);
+  if (!w->failed) w->more[w->depth++] = 0;
+}
+
+static void jw_end(struct mg_json_writer *w, const char *s) {
+  if (w->depth > 0) w->depth--;
+  w->key = false;
+  jw(w, s, 1);
+}
+
+void mg_json_begin_object(struct mg_json_writer *w) {
+  jw_begin(w, "{");
+}
+
+void mg_json_end_object(struct mg_json_writer *w) {
+  jw_end(w, "}");
+}
+
+void mg_json_begin_array(struct mg_json_writer *w) {
+  jw_begin(w, "[");
+}
+
+void mg_json_end_array(struct mg_json_writer *w) {
+  jw_end(w, "]");
+}
+
+void mg_json_key(struct mg_json_writer *w, const char *key) {
+  jw_value(w);
+  jw_quote(w, key, strlen(key));
+  jw(w, ":", 1);
+  w->key = true;
+}
+
+void mg_json_strn(struct mg_json_writer *w, const char *str, size_t len) {
+  jw_value(w);
+  jw_quote(w, str, len);
+}
+
+void mg_json_str(struct mg_json_writer *w, const char *str) {
+  if (str == NULL) {
+    mg_json_null(w);
+  } else {
+    mg_json_strn(w, str, strlen(str));
+  }
+}
+
+static void jw_literal(struct mg_json_writer *w, const char *s, size_t len) {
+  jw_value(w);
+  jw(w, s, len);
+}
+
+void mg_json_num(struct mg_json_writer *w, double value) {
+  char buf[40];
+  if (value != value || value - value != 0.0) {
+    mg_json_null(w);  // NaN and infinities are not representable in JSON
+  } else {
+    jw_literal(w, buf, mg_dtoa(buf, sizeof(buf), value, 0));
+  }
+}
+
+void mg_json_int(struct mg_json_writer *w, int64_t value) {
+  char buf[24];
+  jw_literal(w, buf, mg_snprintf(buf, sizeof(buf), "%lld", value));
+}
+
+void mg_json_bool(struct mg_json_writer *w, bool value) {
+  jw_literal(w, value ? "true" : "false", value ? 4 : 5);
+}
+
+void mg_json_null(struct mg_json_writer *w) {
+  jw_literal(w, "null", 4);
+}
@@ -8,12 +8,72 @@
 #endif
 
 // Error return values - negative. Successful returns are >= 0
-enum { MG_JSON_TOO_DEEP = -1, MG_JSON_INVALID = -2, MG_JSON_NOT_FOUND = -3 };
+enum {
+  MG_JSON_TOO_DEEP = -1,
+  MG_JSON_INVALID = -2,
+  MG_JSON_NOT_FOUND = -3,
+  MG_JSON_TOO_MANY = -4
+};
 int mg_json_get(const char *buf, int len, const char *path, int *toklen);
 
+// JSON index: a document tokenised once, for many path lookups
+enum {
+  MG_JSON_OBJECT,
+  MG_JSON_ARRAY,
+  MG_JSON_STRING,
+  MG_JSON_NUMBER,
+  MG_JSON_TRUE,
+  MG_JSON_FALSE,
+  MG_JSON_NULL
+};
+
+struct mg_json_tok {
+  int ofs, len;    // Value location in the document, strings include quotes
+  int kofs, klen;  // Key location for object members, without quotes
+  int parent;      // Parent token, -1 for the root
+  int next;        // Next sibling token, -1 for the last one
+  int size;        // Number of children for objects and arrays, else 0
+  int type;        // MG_JSON_OBJECT, MG_JSON_ARRAY, ...
+};
+
+struct mg_json_index {
+  struct mg_str json;        // Indexed document
+  struct mg_json_tok *toks;  // Tokens in document order, root is toks[0]
+  int num;                   // Number of tokens
+};
+
+int mg_json_index_init(struct mg_json_index *, struct mg_str json,
+                       struct mg_json_tok *toks, int max_toks);
+int mg_json_index_find(const struct mg_json_index *, const char *path);
+struct mg_str mg_json_index_get(const struct mg_json_index *, const char *path);
+
 bool mg_json_get_num(struct mg_str json, const char *path, double *v);
 bool mg_json_get_bool(struct mg_str json, const char *path, bool *v);
 long mg_json_get_long(struct mg_str json, const char *path, long dflt);
 char *mg_json_get_str(struct mg_str json, const char *path);
 char *mg_json_get_hex(struct mg_str json, const char *path, int *len);
 char *mg_json_get_b64(struct mg_str json, const char *path, int *len);
+
+// Streaming JSON writer. Output goes to fn() span by span, without building
+// the whole document in memory. Commas and string escaping are automatic
+struct mg_json_writer {
+  mg_pw_t fn;                             // Output function
+  void *param;                            // Output function parameter
+  bool key;                               // True if a key was just written
+  bool failed;                            // Too deep nesting, output stopped
+  int depth;                              // Current nesting level
+  unsigned char more[MG_JSON_MAX_DEPTH];  // Level has elements already
+};
+
+void mg_json_writer_init(struct mg_json_writer *, mg_pw_t fn, void *param);
+void mg_json_begin_object(struct mg_json_writer *);
+void mg_json_end_object(struct mg_json_writer *);
+void mg_json_begin_array(struct mg_json_writer *);
+void mg_json_end_array(struct mg_json_writer *);
+void mg_json_key(struct mg_json_writer *, const char *key);
+void mg_json_str(struct mg_json_writer *, const char *str);
+void mg_json_strn(struct mg_json_writer *, const char *str, size_t len);
+void mg_json_num(struct mg_json_writer *, double value);
+void mg_json_int(struct mg_json_writer *, int64_t value);
+void mg_json_bool(struct mg_json_writer *, bool value);
+void mg_json_null(struct mg_json_writer *);
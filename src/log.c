@@ -19,7 +19,11 @@ static void logc(unsigned char c) {
 
 static void logs(const char *buf, size_t len) {
   size_t i;
-  for (i = 0; i < len; i++) logc(((unsigned char *) buf)[i]);
+  if (s_log_func == default_logger) {
+    fwrite(buf, 1, len, stdout);  // Default logger: write the whole span
+  } else {
+    for (i = 0; i < len; i++) logc(((unsigned char *) buf)[i]);
+  }
 }
 
 void mg_log_set(const char *spec) {
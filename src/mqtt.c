@@ -289,3 +289,399 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
   if (c != NULL) c->pfn = mqtt_cb, c->pfn_data = mgr;
   return c;
 }
+
+#define MQTT_MAX_LEVELS 64  // Subscription filter depth limit
+
+struct mg_mqtt_hent {
+  struct mg_mqtt_hent *next;  // Next entry in the same bucket
+  void *key;                  // Parent node for nodes, connection for peers
+  size_t hash;
+};
+
+struct mqtt_sub;
+
+// Trie node, one per distinct filter level. Level name follows the struct
+struct mqtt_node {
+  struct mg_mqtt_hent h;  // Must be first. Key is the parent node
+  struct mqtt_sub *subs;  // Subscriptions whose filter ends at this node
+  size_t kids;            // Number of child nodes
+  size_t len;             // Level name length
+};
+
+// Connection with at least one subscription
+struct mqtt_peer {
+  struct mg_mqtt_hent h;    // Must be first. Key is the connection
+  struct mqtt_sub *subs;    // All subscriptions of this connection
+  struct mqtt_peer *mnext;  // Next peer matching the current publish
+  uint64_t seq;             // Last publish that matched this connection
+  uint8_t qos;              // Max QoS of its subscriptions matching it
+};
+
+struct mqtt_sub {
+  struct mqtt_sub *next, *prev;  // Subscriptions at the same node
+  struct mqtt_sub *pnext;        // Subscriptions of the same peer
+  struct mqtt_node *node;
+  struct mqtt_peer *peer;
+  uint8_t qos;
+};
+
+static size_t mqtt_hash(void *key, const char *s, size_t n) {
+  uint64_t h = 14695981039346656037ULL;  // FNV-1a
+  const uint8_t *p = (const uint8_t *) &key;
+  size_t i;
+  for (i = 0; i < sizeof(key); i++) h = (h ^ p[i]) * 1099511628211ULL;
+  for (i = 0; i < n; i++) h = (h ^ (uint8_t) s[i]) * 1099511628211ULL;
+  return (size_t) (h ^ (h >> 32));
+}
+
+static bool mqtt_hadd(struct mg_mqtt_hent ***tab, size_t *size, size_t *count,
+                      struct mg_mqtt_hent *e) {
+  if (*count >= *size) {  // Keep load factor under 1, double on overflow
+    size_t i, n = *size == 0 ? 64 : *size * 2;
+    struct mg_mqtt_hent **t = (struct mg_mqtt_hent **) calloc(n, sizeof(*t));
+    if (t == NULL && *size == 0) return false;
+    for (i = 0; t != NULL && i < *size; i++) {
+      struct mg_mqtt_hent *x, *next;
+      for (x = (*tab)[i]; x != NULL; x = next) {
+        next = x->next;
+        x->next = t[x->hash & (n - 1)], t[x->hash & (n - 1)] = x;
+      }
+    }
+    if (t != NULL) free(*tab), *tab = t, *size = n;
+  }
+  e->next = (*tab)[e->hash & (*size - 1)];
+  (*tab)[e->hash & (*size - 1)] = e;
+  (*count)++;
+  return true;
+}
+
+static void mqtt_hdel(struct mg_mqtt_hent **tab, size_t size, size_t *count,
+                      struct mg_mqtt_hent *e) {
+  struct mg_mqtt_hent **p = &tab[e->hash & (size - 1)];
+  while (*p != NULL && *p != e) p = &(*p)->next;
+  if (*p != NULL) *p = e->next, (*count)--;
+}
+
+// Split topic at the first '/'. Return true if more levels follow
+static bool mqtt_level(struct mg_str *topic, struct mg_str *level) {
+  const char *s = (const char *) memchr(topic->ptr, '/', topic->len);
+  *level = *topic;
+  if (s == NULL) return false;
+  level->len = (size_t) (s - topic->ptr);
+  topic->ptr = s + 1, topic->len -= level->len + 1;
+  return true;
+}
+
+// Wildcards must take a whole level, and '#' must be the last level
+static bool mqtt_filter_ok(struct mg_str f) {
+  size_t i, levels = 1;
+  if (f.len == 0) return false;
+  for (i = 0; i < f.len; i++) {
+    bool start = i == 0 || f.ptr[i - 1] == '/';
+    bool end = i + 1 == f.len || f.ptr[i + 1] == '/';
+    if (f.ptr[i] == '/' && ++levels > MQTT_MAX_LEVELS) return false;
+    if (f.ptr[i] == '+' && (!start || !end)) return false;
+    if (f.ptr[i] == '#' && (!start || i + 1 != f.len)) return false;
+  }
+  return true;
+}
+
+static struct mqtt_node *mqtt_node_find(struct mg_mqtt_broker *b,
+                                        struct mqtt_node *parent,
+                                        struct mg_str name) {
+  struct mg_mqtt_hent *e;
+  size_t h;
+  if (b->nodes_count == 0) return NULL;
+  h = mqtt_hash(parent, name.ptr, name.len);
+  for (e = b->nodes[h & (b->nodes_size - 1)]; e != NULL; e = e->next) {
+    struct mqtt_node *n = (struct mqtt_node *) e;
+    if (e->hash == h && e->key == parent && n->len == name.len &&
+        memcmp(n + 1, name.ptr, name.len) == 0) {
+      return n;
+    }
+  }
+  return NULL;
+}
+
+static struct mqtt_node *mqtt_node_add(struct mg_mqtt_broker *b,
+                                       struct mqtt_node *parent,
+                                       struct mg_str name) {
+  struct mqtt_node *n = mqtt_node_find(b, parent, name);
+  if (n == NULL &&
+      (n = (struct mqtt_node *) calloc(1, sizeof(*n) + name.len)) != NULL) {
+    n->h.key = parent, n->h.hash = mqtt_hash(parent, name.ptr, name.len);
+    n->len = name.len;
+    memcpy(n + 1, name.ptr, name.len);
+    if (!mqtt_hadd(&b->nodes, &b->nodes_size, &b->nodes_count, &n->h)) {
+      free(n), n = NULL;
+    } else if (parent != NULL) {
+      parent->kids++;
+    }
+  }
+  return n;
+}
+
+// Remove nodes left with no subscriptions and no children, bottom up
+static void mqtt_node_prune(struct mg_mqtt_broker *b, struct mqtt_node *n) {
+  while (n != NULL && n->subs == NULL && n->kids == 0) {
+    struct mqtt_node *parent = (struct mqtt_node *) n->h.key;
+    mqtt_hdel(b->nodes, b->nodes_size, &b->nodes_count, &n->h);
+    free(n);
+    if (parent != NULL) parent->kids--;
+    n = parent;
+  }
+}
+
+static struct mqtt_peer *mqtt_peer_find(struct mg_mqtt_broker *b,
+                                        struct mg_connection *c) {
+  struct mg_mqtt_hent *e;
+  size_t h;
+  if (b->peers_count == 0) return NULL;
+  h = mqtt_hash(c, NULL, 0);
+  for (e = b->peers[h & (b->peers_size - 1)]; e != NULL; e = e->next) {
+    if (e->key == c) return (struct mqtt_peer *) e;
+  }
+  return NULL;
+}
+
+static struct mqtt_peer *mqtt_peer_add(struct mg_mqtt_broker *b,
+                                       struct mg_connection *c) {
+  struct mqtt_peer *p = mqtt_peer_find(b, c);
+  if (p == NULL && (p = (struct mqtt_peer *) calloc(1, sizeof(*p))) != NULL) {
+    p->h.key = c, p->h.hash = mqtt_hash(c, NULL, 0);
+    if (!mqtt_hadd(&b->peers, &b->peers_size, &b->peers_count, &p->h)) {
+      free(p), p = NULL;
+    }
+  }
+  return p;
+}
+
+static void mqtt_peer_prune(struct mg_mqtt_broker *b, struct mqtt_peer *p) {
+  if (p->subs != NULL) return;
+  mqtt_hdel(b->peers, b->peers_size, &b->peers_count, &p->h);
+  free(p);
+}
+
+static void mqtt_sub_del(struct mg_mqtt_broker *b, struct mqtt_sub *s) {
+  struct mqtt_sub **p = &s->peer->subs;
+  while (*p != s) p = &(*p)->pnext;
+  *p = s->pnext;
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    s->node->subs = s->next;
+  }
+  if (s->next != NULL) s->next->prev = s->prev;
+  mqtt_node_prune(b, s->node);
+  b->subs--;
+  free(s);
+}
+
+void mg_mqtt_broker_init(struct mg_mqtt_broker *b) {
+  memset(b, 0, sizeof(*b));
+}
+
+void mg_mqtt_broker_free(struct mg_mqtt_broker *b) {
+  size_t i;
+  for (i = 0; i < b->peers_size; i++) {
+    while (b->peers[i] != NULL) {
+      mg_mqtt_broker_drop(b, (struct mg_connection *) b->peers[i]->key);
+    }
+  }
+  free(b->nodes);
+  free(b->peers);
+  memset(b, 0, sizeof(*b));
+}
+
+bool mg_mqtt_broker_sub(struct mg_mqtt_broker *b, struct mg_connection *c,
+                        struct mg_str topic, int qos) {
+  struct mqtt_node *n = NULL, *parent = NULL;
+  struct mqtt_peer *peer = NULL;
+  struct mqtt_sub *s = NULL;
+  struct mg_str t = topic, level;
+  bool more = true;
+  if (!mqtt_filter_ok(topic)) return false;
+  while (more) {
+    more = mqtt_level(&t, &level);
+    if ((n = mqtt_node_add(b, parent, level)) == NULL) break;
+    parent = n;
+  }
+  if (n != NULL) peer = mqtt_peer_add(b, c);
+  if (peer != NULL) {
+    s = peer->subs;
+    while (s != NULL && s->node != n) s = s->pnext;  // Same filter replaces
+  }
+  if (peer != NULL && s == NULL &&
+      (s = (struct mqtt_sub *) calloc(1, sizeof(*s))) != NULL) {
+    s->node = n, s->peer = peer;
+    s->next = n->subs, s->pnext = peer->subs;
+    if (n->subs != NULL) n->subs->prev = s;
+    n->subs = s, peer->subs = s;
+    b->subs++;
+  }
+  if (s == NULL) {
+    if (peer != NULL) mqtt_peer_prune(b, peer);
+    mqtt_node_prune(b, parent);
+    return false;
+  }
+  s->qos = (uint8_t) (qos < 0 ? 0 : qos > 2 ? 2 : qos);
+  return true;
+}
+
+bool mg_mqtt_broker_unsub(struct mg_mqtt_broker *b, struct mg_connection *c,
+                          struct mg_str topic) {
+  struct mqtt_peer *peer = mqtt_peer_find(b, c);
+  struct mqtt_node *n = NULL;
+  struct mqtt_sub *s = NULL;
+  struct mg_str t = topic, level;
+  bool more = true;
+  while (peer != NULL && more) {
+    more = mqtt_level(&t, &level);
+    if ((n = mqtt_node_find(b, n, level)) == NULL) break;
+  }
+  if (n != NULL) {
+    s = peer->subs;
+    while (s != NULL && s->node != n) s = s->pnext;
+  }
+  if (s == NULL) return false;
+  mqtt_sub_del(b, s);
+  mqtt_peer_prune(b, peer);
+  return true;
+}
+
+void mg_mqtt_broker_drop(struct mg_mqtt_broker *b, struct mg_connection *c) {
+  struct mqtt_peer *peer = mqtt_peer_find(b, c);
+  if (peer == NULL) return;
+  while (peer->subs != NULL) mqtt_sub_del(b, peer->subs);
+  mqtt_peer_prune(b, peer);
+}
+
+// Add peers of subscriptions at node n to the match list, once per publish.
+// A peer matching several filters gets the highest of their QoS levels
+static void mqtt_match(struct mg_mqtt_broker *b, struct mqtt_node *n,
+                       struct mqtt_peer **list) {
+  struct mqtt_sub *s;
+  for (s = n == NULL ? NULL : n->subs; s != NULL; s = s->next) {
+    struct mqtt_peer *p = s->peer;
+    if (p->seq != b->seq) {
+      p->seq = b->seq, p->qos = s->qos;
+      p->mnext = *list, *list = p;
+    } else if (s->qos > p->qos) {
+      p->qos = s->qos;
+    }
+  }
+}
+
+// Match remaining topic levels against exact, '+' and '#' children of parent.
+// Every call visits a distinct node, so the cost is bounded by the trie size
+static void mqtt_route(struct mg_mqtt_broker *b, struct mqtt_node *parent,
+                       struct mg_str rest, struct mqtt_peer **list) {
+  struct mg_str level, plus = mg_str_n("+", 1), hash = mg_str_n("#", 1);
+  bool more = mqtt_level(&rest, &level);
+  // Wildcards at the first level do not match topics starting with '$'
+  bool wild = parent != NULL || level.len == 0 || level.ptr[0] != '$';
+  struct mqtt_node *n[2];
+  size_t i;
+  n[0] = mqtt_node_find(b, parent, level);
+  n[1] = wild ? mqtt_node_find(b, parent, plus) : NULL;
+  for (i = 0; i < 2; i++) {
+    if (n[i] == NULL) continue;
+    if (more) {
+      mqtt_route(b, n[i], rest, list);
+    } else {  // "a/#" matches "a" as well
+      mqtt_match(b, n[i], list);
+      mqtt_match(b, mqtt_node_find(b, n[i], hash), list);
+    }
+  }
+  if (wild) mqtt_match(b, mqtt_node_find(b, parent, hash), list);
+}
+
+size_t mg_mqtt_broker_pub(struct mg_mqtt_broker *b, struct mg_str topic,
+                          struct mg_str data, int qos) {
+  struct mqtt_peer *p, *list = NULL;
+  size_t count = 0;
+  if (topic.len == 0 || b->nodes_count == 0 ||
+      memchr(topic.ptr, '+', topic.len) != NULL ||
+      memchr(topic.ptr, '#', topic.len) != NULL) {
+    return 0;
+  }
+  if (qos < 0) qos = 0;
+  if (qos > 2) qos = 2;
+  b->seq++;
+  mqtt_route(b, NULL, topic, &list);
+  for (p = list; p != NULL; p = p->mnext) {
+    struct mg_connection *c = (struct mg_connection *) p->h.key;
+    if (c->is_closing) continue;
+    mg_mqtt_pub(c, topic, data, qos < p->qos ? qos : p->qos, false);
+    count++;
+  }
+  return count;
+}
+
+// Offset of the variable header, which follows the fixed header
+static size_t mqtt_vh_ofs(const struct mg_mqtt_message *mm) {
+  size_t i = 1;
+  while (i < mm->dgram.len && (((uint8_t) mm->dgram.ptr[i]) & 0x80)) i++;
+  return i + 1;
+}
+
+// SUBSCRIBE and UNSUBSCRIBE topics start after fixed header and message ID
+static size_t mqtt_topics_ofs(const struct mg_mqtt_message *mm) {
+  return mqtt_vh_ofs(mm) + 2;
+}
+
+// CONNECT variable header starts with protocol name and level, 3.1.2.1
+static bool mqtt_connect_ok(const struct mg_mqtt_message *mm) {
+  size_t ofs = mqtt_vh_ofs(mm);
+  return ofs + 7 <= mm->dgram.len &&
+         memcmp(mm->dgram.ptr + ofs, "\x00\x04MQTT\x04", 7) == 0;
+}
+
+void mg_mqtt_broker_handle(struct mg_mqtt_broker *b, struct mg_connection *c,
+                           int ev, void *ev_data) {
+  struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
+  struct mg_str topic;
+  size_t pos, n = 0;
+  uint8_t qos, resp[2] = {0, 0};
+  if (ev == MG_EV_CLOSE) mg_mqtt_broker_drop(b, c);
+  if (ev != MG_EV_MQTT_CMD) return;
+  switch (mm->cmd) {
+    case MQTT_CMD_CONNECT:
+      if (!mqtt_connect_ok(mm)) resp[1] = 1;  // Unacceptable version
+      mg_mqtt_send_header(c, MQTT_CMD_CONNACK, 0, sizeof(resp));
+      mg_send(c, resp, sizeof(resp));
+      if (resp[1] != 0) c->is_draining = 1;
+      break;
+    case MQTT_CMD_SUBSCRIBE:
+      for (pos = mqtt_topics_ofs(mm); pos > 0;) {
+        if ((pos = mg_mqtt_next_sub(mm, &topic, &qos, pos)) > 0) n++;
+      }
+      mg_mqtt_send_header(c, MQTT_CMD_SUBACK, 0, (uint32_t) (n + 2));
+      mg_send_u16(c, mg_htons(mm->id));
+      for (pos = mqtt_topics_ofs(mm); pos > 0;) {
+        if ((pos = mg_mqtt_next_sub(mm, &topic, &qos, pos)) == 0) break;
+        if (qos > 1) qos = 1;  // QoS 2 is granted as QoS 1
+        if (!mg_mqtt_broker_sub(b, c, topic, qos)) qos = 0x80;
+        mg_send(c, &qos, sizeof(qos));
+      }
+      break;
+    case MQTT_CMD_UNSUBSCRIBE:
+      for (pos = mqtt_topics_ofs(mm); pos > 0;) {
+        if ((pos = mg_mqtt_next_unsub(mm, &topic, pos)) > 0) {
+          mg_mqtt_broker_unsub(b, c, topic);
+        }
+      }
+      mg_mqtt_send_header(c, MQTT_CMD_UNSUBACK, 0, 2);
+      mg_send_u16(c, mg_htons(mm->id));
+      break;
+    case MQTT_CMD_PUBLISH:
+      mg_mqtt_broker_pub(b, mm->topic, mm->data, mm->qos);
+      break;
+    case MQTT_CMD_PINGREQ:
+      mg_mqtt_pong(c);
+      break;
+    case MQTT_CMD_DISCONNECT:
+      c->is_draining = 1;
+      break;
+  }
+}
@@ -63,3 +63,28 @@ size_t mg_mqtt_next_unsub(struct mg_mqtt_message *msg, struct mg_str *topic,
 void mg_mqtt_ping(struct mg_connection *);
 void mg_mqtt_pong(struct mg_connection *);
 void mg_mqtt_disconnect(struct mg_connection *);
+
+// Embedded broker. Subscriptions are kept in a topic trie whose edges are
+// hashed by (parent node, level), so routing a PUBLISH costs a few lookups
+// per topic level regardless of the number of subscriptions
+struct mg_mqtt_hent;
+struct mg_mqtt_broker {
+  struct mg_mqtt_hent **nodes;  // Trie nodes, hashed by parent and level
+  struct mg_mqtt_hent **peers;  // Subscribed connections, hashed by pointer
+  size_t nodes_size, nodes_count;  // Node table size and number of nodes
+  size_t peers_size, peers_count;  // Peer table size and number of peers
+  size_t subs;                     // Number of subscriptions
+  uint64_t seq;                    // Publish counter, for per-peer dedupe
+};
+
+void mg_mqtt_broker_init(struct mg_mqtt_broker *);
+void mg_mqtt_broker_free(struct mg_mqtt_broker *);
+bool mg_mqtt_broker_sub(struct mg_mqtt_broker *, struct mg_connection *,
+                        struct mg_str topic, int qos);
+bool mg_mqtt_broker_unsub(struct mg_mqtt_broker *, struct mg_connection *,
+                          struct mg_str topic);
+void mg_mqtt_broker_drop(struct mg_mqtt_broker *, struct mg_connection *);
+size_t mg_mqtt_broker_pub(struct mg_mqtt_broker *, struct mg_str topic,
+                          struct mg_str data, int qos);
+void mg_mqtt_broker_handle(struct mg_mqtt_broker *, struct mg_connection *,
+                           int ev, void *ev_data);
@@ -9,7 +9,7 @@ size_t mg_vprintf(struct mg_connection *c, const char *fmt, va_list ap) {
   size_t old = c->send.len;
   va_list tmp;
   va_copy(tmp, ap);
-  mg_vrprintf(mg_putchar_iobuf, &c->send, fmt, &tmp);
+  mg_vwprintf(mg_write_iobuf, &c->send, fmt, &tmp);
   return c->send.len - old;
 }
 
@@ -138,6 +138,55 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
          mg_aton6(str, addr);
 }
 
+// Relay data received by a bridged connection to its peer. Sockets-based
+// builds splice() plain TCP data instead, see sock.c
+static void bridge_cb(struct mg_connection *c, int ev, void *ev_data,
+                      void *fn_data) {
+  struct mg_bridge *br = (struct mg_bridge *) fn_data;
+  struct mg_connection *p = br == NULL ? NULL : br->peer;
+  if (br == NULL) {
+    // Bridge is gone
+  } else if (ev == MG_EV_READ && p != NULL) {
+    mg_send(p, c->recv.buf, c->recv.len);
+    c->recv.len = 0;
+    if (p->send.len >= br->max_pending) c->is_full = 1;
+  } else if ((ev == MG_EV_WRITE || ev == MG_EV_POLL) && p != NULL) {
+    struct mg_bridge *pb = (struct mg_bridge *) p->pfn_data;
+    if (!pb->eof && br->piped == 0 && c->send.len < br->max_pending) {
+      p->is_full = 0;
+    }
+  } else if (ev == MG_EV_POLL) {
+    c->is_draining = 1;  // Peer has gone, send what's left and close
+  } else if (ev == MG_EV_CLOSE) {
+    if (p != NULL) ((struct mg_bridge *) p->pfn_data)->peer = NULL;
+    c->pfn_data = NULL;
+    free(br);
+  }
+  (void) ev_data;
+}
+
+bool mg_bridge(struct mg_connection *a, struct mg_connection *b,
+               size_t max_pending) {
+  struct mg_bridge *ba = (struct mg_bridge *) calloc(1, sizeof(*ba));
+  struct mg_bridge *bb = (struct mg_bridge *) calloc(1, sizeof(*bb));
+  if (ba == NULL || bb == NULL) {
+    free(ba), free(bb);
+    return false;
+  }
+  if (max_pending == 0) max_pending = 32 * MG_IO_SIZE;
+  ba->peer = b, bb->peer = a;
+  ba->max_pending = bb->max_pending = max_pending;
+  ba->pipe[0] = ba->pipe[1] = bb->pipe[0] = bb->pipe[1] = -1;
+  a->pfn = b->pfn = bridge_cb;
+  a->pfn_data = ba, b->pfn_data = bb;
+  a->is_bridged = b->is_bridged = 1;
+  a->is_full = b->is_full = 0;
+  // Relay data that is already received
+  if (a->recv.len > 0) mg_send(b, a->recv.buf, a->recv.len), a->recv.len = 0;
+  if (b->recv.len > 0) mg_send(a, b->recv.buf, b->recv.len), b->recv.len = 0;
+  return true;
+}
+
 struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
   struct mg_connection *c =
       (struct mg_connection *) calloc(1, sizeof(*c) + mgr->extraconnsize);
@@ -159,6 +208,7 @@ void mg_close_conn(struct mg_connection *c) {
   MG_DEBUG(("%lu closed", c->id));
 
   mg_tls_free(c);
+  if (c->pfree != NULL) c->pfree(c);
   mg_iobuf_free(&c->recv);
   mg_iobuf_free(&c->send);
   memset(c, 0, sizeof(*c));
@@ -51,6 +51,12 @@ struct mg_connection {
   void *pfn_data;              // Protocol-specific function parameter
   char label[50];              // Arbitrary label
   void *tls;                   // TLS specific data
+  void *gzip;                  // Response compressor, see mg_http_gzip()
+  void *pipeline;              // Queued responses, see mg_http_defer()
+  void *ws;                    // WebSocket state, see mg_ws_deflate()
+  void (*pfree)(struct mg_connection *);  // Frees protocol state on close
+  size_t (*ppending)(const struct mg_connection *, const void **);  // Queued
+  void (*psent)(struct mg_connection *, size_t);  // Sent n ppending bytes
   unsigned is_listening : 1;   // Listening connection
   unsigned is_client : 1;      // Outbound (client) connection
   unsigned is_accepted : 1;    // Accepted (server) connection
@@ -61,6 +67,8 @@ struct mg_connection {
   unsigned is_udp : 1;         // UDP connection
   unsigned is_websocket : 1;   // WebSocket connection
   unsigned is_mqtt5 : 1;       // For MQTT connection, v5 indicator
+  unsigned is_bridged : 1;     // Bridged connection, see mg_bridge()
+  unsigned is_chunk_del : 1;   // Chunk deleted, see mg_http_delete_chunk()
   unsigned is_hexdumping : 1;  // Hexdump in/out traffic
   unsigned is_draining : 1;    // Send remaining data, then close and free
   unsigned is_closing : 1;     // Close and free the connection immediately
@@ -88,6 +96,19 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr);
 char *mg_ntoa(const struct mg_addr *addr, char *buf, size_t len);
 int mg_mkpipe(struct mg_mgr *, mg_event_handler_t, void *, bool udp);
 
+// State of a bridged connection, stored in c->pfn_data
+struct mg_bridge {
+  struct mg_connection *peer;  // Connection to relay data to, NULL if closed
+  size_t max_pending;          // Stop reading when peer has that much to send
+  int pipe[2];                 // Pipe for splice() to this connection, or -1
+  size_t piped;                // Number of bytes in the pipe
+  bool eof;                    // Got EOF, nothing more to read
+  bool shut;                   // Shut down for writing
+};
+
+bool mg_bridge(struct mg_connection *, struct mg_connection *,
+               size_t max_pending);
+
 // These functions are used to integrate with custom network stacks
 struct mg_connection *mg_alloc_conn(struct mg_mgr *);
 void mg_close_conn(struct mg_connection *c);
@@ -0,0 +1,377 @@
+#include "proxy.h"
+#include "log.h"
+#include "util.h"
+
+// A request in flight, shared by the client and upstream connections
+struct session {
+  struct session *next;
+  struct mg_proxy *proxy;
+  struct mg_proxy_upstream *up;    // Chosen upstream
+  struct mg_connection *client;    // Client connection, NULL when closed
+  struct mg_connection *upstream;  // Upstream connection, NULL until opened
+  mg_event_handler_t fn;           // Client's handler, restored afterwards
+  void *fn_data;                   // Client's handler data
+  struct mg_iobuf out;             // Request data waiting for the upstream
+  uint64_t started;                // When the request was forwarded
+  size_t req_left;                 // Request body bytes yet to receive
+  size_t resp_left;                // Response body bytes yet to receive
+  bool http10;                     // Client speaks HTTP/1.0
+  bool head;                       // HEAD request
+  bool req_chunked;                // Request body is chunked
+  bool req_done;                   // Request body is fully received
+  bool resp_started;               // Response headers are sent to the client
+  bool resp_chunked;               // Response body is chunked
+  bool resp_eof;                   // Response body ends when upstream closes
+  bool close;                      // Close the client after the response
+};
+
+static bool hop_by_hop(struct mg_str name) {
+  static const char *names[] = {"Connection", "Keep-Alive", "Proxy-Connection",
+                                "TE",         "Trailer",    "Upgrade",
+                                "Transfer-Encoding"};
+  size_t i;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (mg_vcasecmp(&name, names[i]) == 0) return true;
+  }
+  return false;
+}
+
+// Iterate over header lines of the raw head, `*p` starts as NULL. Iterate
+// over the raw head rather than hm->headers, which holds MG_MAX_HTTP_HEADERS
+// only. Lines without a colon are skipped
+static bool next_header(struct mg_str head, const char **p, struct mg_str *line,
+                        struct mg_str *name) {
+  const char *end = head.ptr + head.len;
+  if (*p == NULL) {
+    *p = (const char *) memchr(head.ptr, '\n', head.len);
+    *p = *p == NULL ? end : *p + 1;
+  }
+  while (*p < end) {
+    const char *e = (const char *) memchr(*p, '\n', (size_t) (end - *p)), *le,
+               *x;
+    if (e == NULL) e = end;
+    le = e > *p && e[-1] == '\r' ? e - 1 : e;
+    if (le == *p) break;  // Empty line, end of headers
+    x = (const char *) memchr(*p, ':', (size_t) (le - *p));
+    *line = mg_str_n(*p, (size_t) (le - *p));
+    *p = e + 1;
+    if (x != NULL) {
+      *name = mg_strstrip(mg_str_n(line->ptr, (size_t) (x - line->ptr)));
+      return true;
+    }
+  }
+  return false;
+}
+
+// Headers named in the Connection header are hop-by-hop too
+static bool connection_listed(struct mg_str head, struct mg_str name) {
+  struct mg_str line, k, v, tok;
+  const char *p = NULL, *x;
+  while (next_header(head, &p, &line, &k)) {
+    if (mg_vcasecmp(&k, "Connection") != 0) continue;
+    x = (const char *) memchr(line.ptr, ':', line.len) + 1;
+    v = mg_str_n(x, line.len - (size_t) (x - line.ptr));
+    while (mg_commalist(&v, &tok, NULL)) {
+      tok = mg_strstrip(tok);
+      if (tok.len == name.len && mg_ncasecmp(tok.ptr, name.ptr, tok.len) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Copy header lines of the message, except hop-by-hop headers. When the
+// body is re-framed as chunked, Content-Length is dropped too: a message
+// with both is a smuggling vector, RFC 9112 6.3
+static void copy_headers(struct mg_iobuf *io, struct mg_str head,
+                         bool chunked) {
+  struct mg_str line, name;
+  const char *p = NULL;
+  while (next_header(head, &p, &line, &name)) {
+    if (hop_by_hop(name) || connection_listed(head, name)) continue;
+    if (chunked && mg_vcasecmp(&name, "Content-Length") == 0) continue;
+    mg_iobuf_add(io, io->len, line.ptr, line.len, MG_IO_SIZE);
+    mg_iobuf_add(io, io->len, "\r\n", 2, MG_IO_SIZE);
+  }
+}
+
+static uint32_t score(struct mg_connection *c, struct mg_proxy_upstream *u) {
+  uint32_t crc = c->rem.is_ip6
+                     ? mg_crc32(0, (char *) c->rem.ip6, sizeof(c->rem.ip6))
+                     : mg_crc32(0, (char *) &c->rem.ip, sizeof(c->rem.ip));
+  return mg_crc32(crc, u->url, strlen(u->url));
+}
+
+// Choose an upstream, skipping those marked down. If all upstreams are down,
+// try them anyway rather than fail every request. Hashing uses highest random
+// weight, so a client stays on the same upstream while it is up, and removing
+// an upstream moves only the clients that were on it
+static struct mg_proxy_upstream *choose(struct mg_proxy *p,
+                                        struct mg_connection *c) {
+  struct mg_proxy_upstream *best = NULL;
+  uint64_t now = mg_millis();
+  uint32_t best_score = 0;
+  size_t i, n = p->num_upstreams;
+  int pass;
+  for (pass = 0; pass < 2 && best == NULL; pass++) {
+    for (i = 0; i < n; i++) {
+      size_t idx = p->balance == MG_PROXY_ROUND_ROBIN ? (p->next + i) % n : i;
+      struct mg_proxy_upstream *u = &p->upstreams[idx];
+      if (pass == 0 && u->down_until > now) continue;
+      if (p->balance == MG_PROXY_LEAST_CONN) {
+        if (best == NULL || u->active < best->active) best = u;
+      } else if (p->balance == MG_PROXY_HASH) {
+        uint32_t s = score(c, u);
+        if (best == NULL || s > best_score) best = u, best_score = s;
+      } else {
+        p->next = idx + 1;
+        best = u;
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+// Request data goes directly to the upstream when it is opened, or waits
+static struct mg_iobuf *outbuf(struct session *s) {
+  return s->upstream == NULL ? &s->out : &s->upstream->send;
+}
+
+static void send_body(struct session *s, const char *buf, size_t len) {
+  struct mg_iobuf *io = outbuf(s);
+  if (s->req_chunked) {
+    mg_rprintf(mg_putchar_iobuf, io, "%lx\r\n", (unsigned long) len);
+  }
+  mg_iobuf_add(io, io->len, buf, len, MG_IO_SIZE);
+  if (s->req_chunked) mg_iobuf_add(io, io->len, "\r\n", 2, MG_IO_SIZE);
+  if (s->client != NULL && !s->req_done) {
+    s->client->is_full = io->len > s->proxy->max_pending;
+  }
+}
+
+static void finish(struct session *s, bool reuse) {
+  struct mg_connection *c = s->client, *u = s->upstream;
+  if (u != NULL) {
+    if (!reuse || !s->req_done) u->is_closing = 1;
+    u->is_full = 0;
+    mg_http_pool_release(u);
+  }
+  if (c != NULL) {
+    c->fn = s->fn, c->fn_data = s->fn_data, c->is_full = 0;
+    if (s->close || !s->req_done) c->is_draining = 1;
+  }
+  s->up->active--;
+  LIST_DELETE(struct session, (struct session **) &s->proxy->sessions, s);
+  mg_iobuf_free(&s->out);
+  free(s);
+}
+
+// Upstream has failed. Mark it down after too many failures in a row
+static void fail(struct session *s, int code, const char *reason) {
+  struct mg_proxy_upstream *u = s->up;
+  MG_ERROR(("%s: %s", u->url, reason));
+  if (++u->fails >= s->proxy->max_fails && s->proxy->max_fails > 0) {
+    u->down_until = mg_millis() + s->proxy->fail_ms;
+  }
+  if (s->client != NULL && s->resp_started) {
+    s->close = true;  // Response is cut short, client can see that
+  } else if (s->client != NULL) {
+    mg_http_reply(s->client, code, "", "%s\n", reason);
+  }
+  finish(s, false);
+}
+
+static bool rechunk(struct session *s) {
+  return s->resp_chunked && !s->http10;
+}
+
+// Status line and end-to-end headers of the upstream response
+static void relay_head(struct mg_connection *c, struct mg_http_message *hm,
+                       bool chunked) {
+  mg_printf(c, "HTTP/1.1 %d %.*s\r\n", mg_http_status(hm),
+            (int) hm->proto.len, hm->proto.ptr);
+  copy_headers(&c->send, hm->head, chunked);
+}
+
+static void send_head(struct session *s, struct mg_http_message *hm) {
+  struct mg_connection *c = s->client;
+  struct mg_str *te = mg_http_get_header(hm, "Transfer-Encoding");
+  struct mg_str *cl = mg_http_get_header(hm, "Content-Length");
+  s->resp_started = true;
+  s->up->fails = 0;
+  s->resp_chunked = te != NULL && mg_vcasecmp(te, "chunked") == 0;
+  s->resp_eof = !s->resp_chunked && cl == NULL;
+  s->resp_left = hm->body.len;
+  // HTTP/1.0 clients do not understand chunks: send raw body and close
+  if (s->resp_eof || (s->resp_chunked && s->http10)) s->close = true;
+  if (c == NULL) return;
+  relay_head(c, hm, s->resp_chunked);
+  mg_printf(c, "%s%s\r\n", rechunk(s) ? "Transfer-Encoding: chunked\r\n" : "",
+            s->close ? "Connection: close\r\n" : "");
+}
+
+// 1xx responses other than 101 Switching Protocols precede the final one
+static bool interim(void *ev_data) {
+  int status = mg_http_status((struct mg_http_message *) ev_data);
+  return status >= 100 && status < 200 && status != 101;
+}
+
+static void upstream_cb(struct mg_connection *c, int ev, void *ev_data,
+                        void *fn_data) {
+  struct session *s = (struct session *) fn_data;
+  if (ev == MG_EV_OPEN || ev == MG_EV_CONNECT) {
+    if (s->upstream == NULL) {
+      s->upstream = c;
+      mg_send(c, s->out.buf, s->out.len);
+      mg_iobuf_free(&s->out);
+    }
+    if (s->client == NULL) finish(s, false);  // Client has gone meanwhile
+  } else if (ev == MG_EV_HTTP_MSG && interim(ev_data)) {
+    // Interim response, like 100 Continue. Relay it, except to HTTP/1.0
+    // clients which do not expect it, and keep waiting for the final one
+    if (s->client != NULL && !s->http10) {
+      relay_head(s->client, (struct mg_http_message *) ev_data, false);
+      mg_send(s->client, "\r\n", 2);
+    }
+    s->started = mg_millis();
+  } else if (ev == MG_EV_HTTP_MSG || ev == MG_EV_HTTP_CHUNK) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_str body = ev == MG_EV_HTTP_MSG ? hm->body : hm->chunk;
+    int status = mg_http_status(hm);
+    bool nobody = s->head || status == 204 || status == 304 || status < 200;
+    bool last = ev == MG_EV_HTTP_MSG;
+    if (!s->resp_started) send_head(s, hm);
+    if (s->client != NULL && !nobody && body.len > 0) {
+      if (rechunk(s)) {
+        mg_http_write_chunk(s->client, body.ptr, body.len);
+      } else {
+        mg_send(s->client, body.ptr, body.len);
+      }
+    }
+    if (ev == MG_EV_HTTP_CHUNK) {
+      // Non-chunked body can start with an empty chunk, so count bytes
+      if (s->resp_chunked) {
+        last = body.len == 0;
+      } else if (!s->resp_eof) {
+        last = (s->resp_left -= body.len) == 0;
+      }
+      mg_http_delete_chunk(c, hm);
+    }
+    if (last) {
+      if (s->client != NULL && rechunk(s)) mg_send(s->client, "0\r\n\r\n", 5);
+      finish(s, true);
+    } else if (nobody || s->client == NULL) {
+      finish(s, false);  // Parser may still expect a body, do not reuse
+    } else {
+      c->is_full = s->client->send.len > s->proxy->max_pending;
+    }
+  } else if (ev == MG_EV_POLL && !s->resp_started && s->proxy->timeout_ms > 0 &&
+             mg_millis() - s->started > s->proxy->timeout_ms) {
+    fail(s, 504, "timeout");
+  } else if ((ev == MG_EV_POLL || ev == MG_EV_WRITE) && s->client != NULL &&
+             c->send.len <= s->proxy->max_pending && !s->req_done) {
+    s->client->is_full = 0;
+  } else if (ev == MG_EV_ERROR) {
+    fail(s, 502, (char *) ev_data);
+  } else if (ev == MG_EV_CLOSE && s->resp_started && s->resp_eof) {
+    finish(s, false);  // Body is delimited by close
+  } else if (ev == MG_EV_CLOSE) {
+    fail(s, 502, "upstream closed");
+  }
+}
+
+static void client_cb(struct mg_connection *c, int ev, void *ev_data,
+                      void *fn_data) {
+  struct session *s = (struct session *) fn_data;
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  if (ev == MG_EV_HTTP_CHUNK && !s->req_done) {
+    if (s->req_chunked) {
+      s->req_done = hm->chunk.len == 0;
+    } else {
+      s->req_done = (s->req_left -= hm->chunk.len) == 0;
+    }
+    send_body(s, hm->chunk.ptr, hm->chunk.len);
+    mg_http_delete_chunk(c, hm);
+  } else if (ev == MG_EV_HTTP_MSG && !s->req_done && !s->req_chunked) {
+    // Only empty chunks were seen, e.g. the client has waited for
+    // 100 Continue, and then the whole body has arrived at once
+    s->req_done = true;
+    send_body(s, hm->body.ptr, hm->body.len);
+  } else if (ev == MG_EV_HTTP_MSG ||
+             (ev == MG_EV_HTTP_CHUNK && hm->chunk.len > 0)) {
+    s->close = true;  // Pipelined request, we can't queue it
+  } else if ((ev == MG_EV_POLL || ev == MG_EV_WRITE) && s->upstream != NULL &&
+             c->send.len <= s->proxy->max_pending) {
+    s->upstream->is_full = 0;
+  } else if (ev == MG_EV_CLOSE) {
+    mg_event_handler_t fn = s->fn;
+    void *fnd = s->fn_data;
+    c->fn = fn, c->fn_data = fnd;
+    s->client = NULL;
+    // If the upstream is not opened yet, the session ends when it is
+    if (s->upstream != NULL) finish(s, false);
+    if (fn != NULL) fn(c, ev, ev_data, fnd);
+  }
+}
+
+void mg_proxy_init(struct mg_proxy *p, struct mg_mgr *mgr,
+                   struct mg_proxy_upstream *upstreams, size_t num_upstreams,
+                   int balance) {
+  memset(p, 0, sizeof(*p));
+  mg_http_pool_init(&p->pool, mgr, 0, 30000);
+  p->upstreams = upstreams, p->num_upstreams = num_upstreams;
+  p->balance = balance;
+  p->max_fails = 3, p->fail_ms = 10000;
+  p->max_pending = 16 * MG_IO_SIZE;
+}
+
+void mg_proxy_free(struct mg_proxy *p) {
+  while (p->sessions != NULL) finish((struct session *) p->sessions, false);
+  mg_http_pool_free(&p->pool);
+}
+
+bool mg_proxy_forward(struct mg_proxy *p, struct mg_connection *c, int ev,
+                      struct mg_http_message *hm) {
+  struct mg_proxy_upstream *up = choose(p, c);
+  struct mg_str *te = mg_http_get_header(hm, "Transfer-Encoding");
+  struct mg_str *conn = mg_http_get_header(hm, "Connection");
+  const char *end = hm->query.len > 0 ? hm->query.ptr + hm->query.len
+                                      : hm->uri.ptr + hm->uri.len;
+  struct session *s;
+  char ip[50];
+  if (up == NULL || (s = (struct session *) calloc(1, sizeof(*s))) == NULL) {
+    return false;
+  }
+  s->proxy = p, s->up = up, s->client = c;
+  s->fn = c->fn, s->fn_data = c->fn_data;
+  s->started = mg_millis();
+  s->http10 = mg_vcasecmp(&hm->proto, "HTTP/1.0") == 0;
+  s->head = mg_vcasecmp(&hm->method, "HEAD") == 0;
+  s->req_chunked = te != NULL && mg_vcasecmp(te, "chunked") == 0;
+  s->req_left = hm->body.len;
+  s->close = s->http10 ? conn == NULL || mg_vcasecmp(conn, "keep-alive") != 0
+                       : conn != NULL && mg_vcasecmp(conn, "close") == 0;
+  mg_rprintf(mg_putchar_iobuf, &s->out, "%.*s %.*s HTTP/1.1\r\n",
+             (int) hm->method.len, hm->method.ptr, (int) (end - hm->uri.ptr),
+             hm->uri.ptr);
+  copy_headers(&s->out, hm->head, s->req_chunked);
+  mg_rprintf(mg_putchar_iobuf, &s->out, "X-Forwarded-For: %s\r\n%s\r\n",
+             mg_ntoa(&c->rem, ip, sizeof(ip)),
+             s->req_chunked ? "Transfer-Encoding: chunked\r\n" : "");
+  c->fn = client_cb, c->fn_data = s;
+  LIST_ADD_HEAD(struct session, (struct session **) &p->sessions, s);
+  up->active++;
+  if (ev == MG_EV_HTTP_MSG) {
+    s->req_done = true;
+    send_body(s, hm->body.ptr, hm->body.len);
+    if (s->req_chunked) send_body(s, "", 0);
+  } else {
+    client_cb(c, ev, hm, s);  // Request body is streamed
+  }
+  if (!mg_http_pool_connect(&p->pool, up->url, upstream_cb, s)) {
+    fail(s, 502, "connect failed");
+  }
+  return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "arch.h"
+#include "http.h"
+#include "net.h"
+
+struct mg_proxy_upstream {
+  const char *url;      // Upstream URL, e.g. "http://10.0.0.1:8080"
+  size_t active;        // Number of requests in flight
+  unsigned fails;       // Number of consecutive failures
+  uint64_t down_until;  // Passive health check: skip it until that time
+};
+
+// Upstream balancing methods
+enum { MG_PROXY_ROUND_ROBIN, MG_PROXY_LEAST_CONN, MG_PROXY_HASH };
+
+struct mg_proxy {
+  struct mg_http_pool pool;             // Keep-alive upstream connections
+  struct mg_proxy_upstream *upstreams;  // Upstreams
+  size_t num_upstreams;                 // Number of upstreams
+  int balance;                          // Balancing method, MG_PROXY_*
+  unsigned max_fails;     // Consecutive failures that mark upstream down
+  uint64_t fail_ms;       // How long a failed upstream stays down
+  uint64_t timeout_ms;    // Response headers timeout, 0 - no timeout
+  size_t max_pending;     // Pause a side when its peer has that much to send
+  size_t next;            // Next upstream for round-robin
+  void *sessions;         // Requests in flight
+};
+
+void mg_proxy_init(struct mg_proxy *, struct mg_mgr *,
+                   struct mg_proxy_upstream *, size_t num_upstreams,
+                   int balance);
+void mg_proxy_free(struct mg_proxy *);
+bool mg_proxy_forward(struct mg_proxy *, struct mg_connection *, int ev,
+                      struct mg_http_message *);
@@ -20,6 +20,9 @@ typedef unsigned long nfds_t;
 #ifndef SO_EXCLUSIVEADDRUSE
 #define SO_EXCLUSIVEADDRUSE ((int) (~SO_REUSEADDR))
 #endif
+#ifndef SHUT_WR
+#define SHUT_WR SD_SEND
+#endif
 #elif MG_ARCH == MG_ARCH_FREERTOS_TCP
 #define MG_SOCK_ERRNO errno
 typedef Socket_t SOCKET;
@@ -47,6 +50,13 @@ typedef int SOCKET;
 #define AF_INET6 10
 #endif
 
+#if MG_ENABLE_SPLICE && !defined(SPLICE_F_NONBLOCK)
+// <fcntl.h> declares splice() only if _GNU_SOURCE is defined
+extern ssize_t splice(int, void *, int, void *, size_t, unsigned int);
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#endif
+
 union usa {
   struct sockaddr sa;
   struct sockaddr_in sin;
@@ -279,12 +289,135 @@ static long mg_sock_recv(struct mg_connection *c, void *buf, size_t len) {
   return n == 0 ? -1 : n < 0 && mg_sock_would_block() ? 0 : n;
 }
 
+// Number of bytes in the splice() pipe of a bridged connection
+static size_t bridge_pending(const struct mg_connection *c) {
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  return c->is_bridged && br != NULL ? br->piped : 0;
+}
+
+// Send data from the pipe to the socket, bypassing user space
+static void bridge_write(struct mg_connection *c) {
+#if MG_ENABLE_SPLICE
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  long n = (long) splice(br->pipe[0], NULL, FD(c), NULL, br->piped,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n > 0) {
+    br->piped -= (size_t) n;
+    mg_call(c, MG_EV_WRITE, &n);
+  } else if (n < 0 && !mg_sock_would_block()) {
+    c->is_closing = 1;
+  }
+#else
+  (void) c;
+#endif
+}
+
+// Data queued by the protocol outside of c->send, see c->ppending
+static size_t pending(const struct mg_connection *c, const void **buf) {
+  return c->ppending == NULL ? 0 : c->ppending(c, buf);
+}
+
+static void write_conn(struct mg_connection *c) {
+  char *buf = (char *) c->send.buf;
+  size_t len = c->send.len, qlen;
+  const void *q = NULL;
+  long n;
+  if ((qlen = pending(c, &q)) > 0) {
+    // E.g. shared WebSocket broadcast frames: go first, without a copy
+    n = c->is_tls ? mg_tls_send(c, q, qlen) : mg_sock_send(c, q, qlen);
+    if (n < 0) c->is_closing = 1;
+    if (n > 0) {
+      c->psent(c, (size_t) n);
+      mg_call(c, MG_EV_WRITE, &n);
+    }
+  } else if (len == 0 && bridge_pending(c) > 0) {
+    bridge_write(c);
+  } else {
+    n = c->is_tls ? mg_tls_send(c, buf, len) : mg_sock_send(c, buf, len);
+    MG_DEBUG(("%lu %p %d:%d %ld err %d", c->id, c->fd, (int) c->send.len,
+              (int) c->recv.len, n, MG_SOCK_ERRNO));
+    iolog(c, buf, n, false);
+  }
+}
+
+// Read bridged plain TCP connection. On Linux, data goes to the peer through
+// a pipe with splice(), unless the connection has data buffered in user
+// space that must go first. Unlike read_conn(), EOF is not fatal: the peer
+// gets shut down for writing, and the other direction keeps working
+static void bridge_read(struct mg_connection *c) {
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  struct mg_connection *p = br->peer;
+  struct mg_bridge *pb = p == NULL ? NULL : (struct mg_bridge *) p->pfn_data;
+  bool spliced = false;
+  long n = 0;
+  if (pb == NULL) {
+    c->is_full = 1;  // Peer has gone, nowhere to relay
+    return;
+  }
+#if MG_ENABLE_SPLICE
+  if (c->recv.len == 0 && p->send.len == 0 && !p->is_tls && pb->piped == 0 &&
+      (pb->pipe[0] >= 0 || pipe(pb->pipe) == 0)) {
+    spliced = true;
+    n = (long) splice(FD(c), NULL, pb->pipe[1], NULL, pb->max_pending,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      pb->piped = (size_t) n;
+      if (!p->is_connecting) bridge_write(p);
+      if (pb->piped > 0) c->is_full = 1;  // Resume when the pipe is empty
+    }
+  }
+#endif
+  if (!spliced) {
+    char *buf;
+    if (c->recv.size <= c->recv.len &&
+        !mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE)) {
+      mg_error(c, "oom");
+      return;
+    }
+    buf = (char *) &c->recv.buf[c->recv.len];
+    n = recv(FD(c), buf, c->recv.size - c->recv.len, MSG_NONBLOCKING);
+    if (n > 0) iolog(c, buf, n, true);
+  }
+  if (n == 0) {
+    MG_DEBUG(("%lu EOF", c->id));
+    br->eof = true;
+    c->is_full = 1;
+  } else if (n < 0 && !mg_sock_would_block()) {
+    c->is_closing = 1;
+  }
+}
+
+// When everything the peer has sent is relayed and the peer got EOF, shut
+// down the connection for writing. Close it when both directions are done
+static void bridge_shut(struct mg_connection *c) {
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  struct mg_bridge *pb =
+      br->peer == NULL ? NULL : (struct mg_bridge *) br->peer->pfn_data;
+  if (pb != NULL && pb->eof && !br->shut && c->send.len == 0 &&
+      br->piped == 0 && !c->is_connecting) {
+    br->shut = true;
+#if MG_ARCH == MG_ARCH_FREERTOS_TCP
+    c->is_draining = 1;
+#else
+    if (c->is_tls) {
+      c->is_draining = 1;
+    } else {
+      shutdown(FD(c), SHUT_WR);
+    }
+#endif
+  }
+  if (br->shut && br->eof) c->is_closing = 1;
+}
+
 // NOTE(lsm): do only one iteration of reads, cause some systems
 // (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
 static void read_conn(struct mg_connection *c) {
   long n = -1;
   if (c->recv.len >= MG_MAX_RECV_SIZE) {
     mg_error(c, "max_recv_buf_size reached");
+  } else if (c->is_bridged && c->pfn_data != NULL && !c->is_tls &&
+             !c->is_udp) {
+    bridge_read(c);
   } else if (c->recv.size <= c->recv.len &&
              !mg_iobuf_resize(&c->recv, c->recv.size + MG_IO_SIZE)) {
     mg_error(c, "oom");
@@ -298,16 +431,15 @@ static void read_conn(struct mg_connection *c) {
   }
 }
 
-static void write_conn(struct mg_connection *c) {
-  char *buf = (char *) c->send.buf;
-  size_t len = c->send.len;
-  long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_sock_send(c, buf, len);
-  MG_DEBUG(("%lu %p %d:%d %ld err %d", c->id, c->fd, (int) c->send.len,
-            (int) c->recv.len, n, MG_SOCK_ERRNO));
-  iolog(c, buf, n, false);
-}
-
 static void close_conn(struct mg_connection *c) {
+#if MG_ENABLE_SPLICE
+  struct mg_bridge *br = (struct mg_bridge *) c->pfn_data;
+  if (c->is_bridged && br != NULL && br->pipe[0] >= 0) {
+    close(br->pipe[0]);
+    close(br->pipe[1]);
+    br->pipe[0] = br->pipe[1] = -1;
+  }
+#endif
   if (FD(c) != INVALID_SOCKET) {
     closesocket(FD(c));
 #if MG_ARCH == MG_ARCH_FREERTOS_TCP
@@ -378,11 +510,11 @@ void mg_connect_resolved(struct mg_connection *c) {
   }
 }
 
-static SOCKET raccept(SOCKET sock, union usa *usa, socklen_t len) {
+static SOCKET raccept(SOCKET sock, union usa *usa, socklen_t *len) {
   SOCKET s = INVALID_SOCKET;
   do {
     memset(usa, 0, sizeof(*usa));
-    s = accept(sock, &usa->sa, &len);
+    s = accept(sock, &usa->sa, len);
   } while (s == INVALID_SOCKET && errno == EINTR);
   return s;
 }
@@ -391,7 +523,7 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   struct mg_connection *c = NULL;
   union usa usa;
   socklen_t sa_len = sizeof(usa);
-  SOCKET fd = raccept(FD(lsn), &usa, sa_len);
+  SOCKET fd = raccept(FD(lsn), &usa, &sa_len);
   if (fd == INVALID_SOCKET) {
 #if MG_ARCH == MG_ARCH_AZURERTOS
     // AzureRTOS, in non-block socket mode can mark listening socket readable
@@ -456,7 +588,7 @@ static bool mg_socketpair(SOCKET sp[2], union usa usa[2], bool udp) {
              getsockname(sock, &usa[0].sa, &n) == 0 &&
              (sp[0] = socket(AF_INET, SOCK_STREAM, 0)) != INVALID_SOCKET &&
              connect(sp[0], &usa[0].sa, n) == 0 &&
-             (sp[1] = raccept(sock, &usa[1], n)) != INVALID_SOCKET) {
+             (sp[1] = raccept(sock, &usa[1], &n)) != INVALID_SOCKET) {
     success = true;
   }
   if (success) {
@@ -493,7 +625,10 @@ static bool can_read(const struct mg_connection *c) {
 }
 
 static bool can_write(const struct mg_connection *c) {
-  return c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0);
+  return c->is_connecting ||
+         ((c->send.len > 0 || bridge_pending(c) > 0 ||
+           pending(c, NULL) > 0) &&
+          c->is_tls_hs == 0);
 }
 
 static bool skip_iotest(const struct mg_connection *c) {
@@ -634,7 +769,11 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
       if (c->is_writable) write_conn(c);
     }
 
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+    if (c->is_bridged && c->pfn_data != NULL) bridge_shut(c);
+    if (c->is_draining && c->send.len == 0 && bridge_pending(c) == 0 &&
+        pending(c, NULL) == 0) {
+      c->is_closing = 1;
+    }
     if (c->is_closing) close_conn(c);
   }
 }
@@ -47,6 +47,13 @@ typedef size_t (*mg_pm_t)(mg_pc_t, void *, va_list *);  // %M printer
 void mg_putchar_realloc(char ch, void *param);          // Print to malloced str
 void mg_putchar_iobuf(char ch, void *param);            // Print to iobuf
 
+// Bulk writer: appends len bytes. NULL buf means "expect len more bytes"
+typedef void (*mg_pw_t)(const char *buf, size_t len, void *param);
+void mg_write_iobuf(const char *buf, size_t len, void *param);
+void mg_write_realloc(const char *buf, size_t len, void *param);
+size_t mg_vwprintf(mg_pw_t, void *, const char *fmt, va_list *);
+size_t mg_wprintf(mg_pw_t, void *, const char *fmt, ...);
+
 size_t mg_vrprintf(void (*)(char, void *), void *, const char *fmt, va_list *);
 size_t mg_rprintf(void (*fn)(char, void *), void *, const char *fmt, ...);
 size_t mg_vsnprintf(char *buf, size_t len, const char *fmt, va_list *ap);
@@ -175,6 +175,12 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
       goto fail;
     }
   }
+#if MG_ENABLE_HTTP2 && defined(MBEDTLS_SSL_ALPN)
+  if (!c->is_client) {
+    static const char *alpn[] = {"h2", "http/1.1", NULL};
+    mbedtls_ssl_conf_alpn_protocols(&tls->conf, alpn);
+  }
+#endif
   if ((rc = mbedtls_ssl_setup(&tls->ssl, &tls->conf)) != 0) {
     mg_error(c, "setup err %#x", -rc);
     goto fail;
@@ -19,6 +19,19 @@ static int mg_tls_err(struct mg_tls *tls, int res) {
   return err;
 }
 
+#if MG_ENABLE_HTTP2 && OPENSSL_VERSION_NUMBER > 0x10002000L
+// Prefer HTTP/2 if the client supports it
+static int alpn_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                   const unsigned char *in, unsigned int inlen, void *arg) {
+  static const unsigned char protos[] = "\x02h2\x08http/1.1";
+  int rc = SSL_select_next_proto((unsigned char **) out, outlen, protos,
+                                 sizeof(protos) - 1, in, inlen);
+  (void) ssl, (void) arg;
+  return rc == OPENSSL_NPN_NEGOTIATED ? SSL_TLSEXT_ERR_OK
+                                      : SSL_TLSEXT_ERR_NOACK;
+}
+#endif
+
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   struct mg_tls *tls = (struct mg_tls *) calloc(1, sizeof(*tls));
   const char *id = "mongoose";
@@ -98,6 +111,9 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   }
 #endif
   if (opts->ciphers != NULL) SSL_set_cipher_list(tls->ssl, opts->ciphers);
+#if MG_ENABLE_HTTP2 && OPENSSL_VERSION_NUMBER > 0x10002000L
+  if (!c->is_client) SSL_CTX_set_alpn_select_cb(tls->ctx, alpn_cb, NULL);
+#endif
   if (opts->srvname.len > 0) {
     char mem[128], *buf = mem;
     mg_asprintf(&buf, sizeof(mem), "%.*s", (int) opts->srvname.len,
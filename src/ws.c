@@ -1,18 +1,80 @@
 #include "ws.h"
 
 #include "base64.h"
+#include "deflate.h"
 #include "http.h"
 #include "log.h"
 #include "sha1.h"
 #include "url.h"
 #include "util.h"
 
+#if MG_ENABLE_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#define WS_AVX2 1
+#elif MG_ENABLE_SIMD && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define WS_SSE2 1
+#elif MG_ENABLE_SIMD && MG_SIMD_NEON
+#include <arm_neon.h>
+#define WS_NEON 1
+#endif
+
 struct ws_msg {
   uint8_t flags;
   size_t header_len;
   size_t data_len;
 };
 
+#define WS_RSV1 0x40  // Frame flag: compressed message, RFC7692
+
+// Broadcast frame, shared by all connections that send it. Frame data,
+// header included, follows the structure
+struct ws_frame {
+  size_t refs;  // Number of connections that have it queued
+  size_t len;   // Frame length
+};
+
+// Broadcast frame queued on a connection
+struct ws_ref {
+  struct ws_ref *next;
+  struct ws_frame *frame;
+  size_t ofs;  // Number of bytes already sent
+};
+
+// WebSocket connection state, stored in c->ws
+struct ws_state {
+  struct mg_ws_deflate_opts opts;  // Options passed to mg_ws_deflate()
+  bool deflate;                    // permessage-deflate is negotiated
+  bool tx_reset, rx_reset;         // No context takeover: ours, peer's
+  int tx_bits, rx_bits;            // Window bits: ours, peer's
+  struct mg_deflate tx;            // Compressor, allocated on first use
+  struct mg_inflate rx;            // Decompressor, allocated on first use
+  struct mg_iobuf tbuf;            // Compressed outgoing message
+  struct mg_iobuf rbuf;            // Decompressed incoming message
+  struct ws_ref *queue, *last;     // Broadcast frames, sent before c->send
+  size_t queued;                   // Unsent bytes in the queue
+  struct mg_iobuf frag;            // Fragmented message being reassembled
+  size_t frags;                    // Number of frames in frag
+  uint8_t frag_flags;              // Flags of the first frame
+  bool stream;                     // Deliver data as MG_EV_WS_CHUNK
+  bool in_msg;                     // Streamed message is in progress
+  bool in_fin;                     // Current streamed frame is the last one
+  bool in_masked;                  // Current streamed frame is masked
+  uint8_t in_flags;                // Flags of the streamed message
+  uint8_t in_mask[4];              // Masking key, rotated to the next byte
+  size_t in_left;                  // Payload bytes of the frame yet to come
+  size_t in_ofs;                   // Bytes of the message delivered so far
+  size_t resv, resv_len;           // mg_ws_reserve(): header slot, max len
+  uint64_t ping_ms, timeout_ms;    // Keepalive ping interval, pong timeout
+  uint64_t next_ping;              // When ws_ping() has something to do
+  uint64_t ping_last;              // When the last ping was sent
+  uint64_t ping_sent;              // When the unanswered ping was sent, or 0
+  long rtt;                        // Last ping round trip time, ms, or -1
+  bool utf8;                       // Validate text messages
+  uint8_t utf8_tail[4];            // Streamed text: sequence cut by a slice
+  size_t utf8_len;                 // Number of bytes in utf8_tail
+};
+
 size_t mg_ws_vprintf(struct mg_connection *c, int op, const char *fmt,
                      va_list ap) {
   char mem[256], *buf = mem;
@@ -58,40 +120,440 @@ static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
     mg_printf(c, "Sec-WebSocket-Protocol: %.*s\r\n", (int) wsproto->len,
               wsproto->ptr);
   }
+  if (c->ws != NULL && ((struct ws_state *) c->ws)->deflate) {
+    struct ws_state *ws = (struct ws_state *) c->ws;
+    mg_printf(c, "Sec-WebSocket-Extensions: permessage-deflate%s%s",
+              ws->tx_reset ? "; server_no_context_takeover" : "",
+              ws->rx_reset ? "; client_no_context_takeover" : "");
+    if (ws->tx_bits < 15) {
+      mg_printf(c, "; server_max_window_bits=%d", ws->tx_bits);
+    }
+    if (ws->rx_bits < 15) {
+      mg_printf(c, "; client_max_window_bits=%d", ws->rx_bits);
+    }
+    mg_send(c, "\r\n", 2);
+  }
   mg_send(c, "\r\n", 2);
 }
 
-static size_t ws_process(uint8_t *buf, size_t len, struct ws_msg *msg) {
-  size_t i, n = 0, mask_len = 0;
+// XOR data with a 4-byte mask, RFC6455 5.3. Byte by byte until the data
+// is word aligned, then a word or a vector register at a time. The mask
+// is rotated to match the aligned position
+void mg_ws_mask(uint8_t *buf, size_t len, const uint8_t *mask) {
+  uint8_t m[4], r[4];
+  uint32_t m32;
+  uint64_t m64;
+  size_t i = 0, k;
+  memcpy(m, mask, sizeof(m));  // Mask can be right before buf, copy it
+  while (i < len && ((uintptr_t) (buf + i) & 7) != 0) buf[i] ^= m[i & 3], i++;
+  for (k = 0; k < 4; k++) r[k] = m[(i + k) & 3];
+  memcpy(&m32, r, sizeof(m32));
+  m64 = (uint64_t) m32 << 32 | m32;
+#if defined(WS_AVX2)
+  {
+    __m256i vm = _mm256_set1_epi32((int) m32);
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i *) (buf + i));
+      _mm256_storeu_si256((__m256i *) (buf + i), _mm256_xor_si256(v, vm));
+    }
+  }
+#elif defined(WS_SSE2)
+  {
+    __m128i vm = _mm_set1_epi32((int) m32);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i *) (buf + i));
+      _mm_storeu_si128((__m128i *) (buf + i), _mm_xor_si128(v, vm));
+    }
+  }
+#elif defined(WS_NEON)
+  {
+    uint8x16_t vm = vreinterpretq_u8_u32(vdupq_n_u32(m32));
+    for (; i + 16 <= len; i += 16) {
+      vst1q_u8(buf + i, veorq_u8(vld1q_u8(buf + i), vm));
+    }
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, buf + i, sizeof(v));
+    v ^= m64;
+    memcpy(buf + i, &v, sizeof(v));
+  }
+  for (; i < len; i++) buf[i] ^= m[i & 3];
+}
+
+// Length of the UTF-8 sequence at s, or 0 if it is invalid: overlong,
+// surrogate, or above U+10FFFF. A sequence cut short by the end of data is
+// checked as far as it goes, and its full length is returned
+static size_t ws_utf8_seq(const uint8_t *s, size_t n) {
+  uint8_t c = s[0], lo = 0x80, hi = 0xbf;
+  size_t i, len;
+  if (c < 0x80) return 1;
+  if (c < 0xc2) return 0;  // Continuation byte, or overlong 2-byte sequence
+  if (c < 0xe0) {
+    len = 2;
+  } else if (c < 0xf0) {
+    len = 3;
+    if (c == 0xe0) lo = 0xa0;  // Overlong
+    if (c == 0xed) hi = 0x9f;  // Surrogates
+  } else if (c < 0xf5) {
+    len = 4;
+    if (c == 0xf0) lo = 0x90;  // Overlong
+    if (c == 0xf4) hi = 0x8f;  // Above U+10FFFF
+  } else {
+    return 0;
+  }
+  for (i = 1; i < len && i < n; i++) {
+    if (s[i] < lo || s[i] > hi) return 0;
+    lo = 0x80, hi = 0xbf;
+  }
+  return len;
+}
+
+// Return the length of the longest prefix of s made of complete, valid
+// UTF-8 sequences. ASCII runs are skipped a vector or a word at a time
+static size_t ws_utf8(const uint8_t *s, size_t n) {
+  size_t i = 0, k;
+  uint64_t w;
+  while (i < n) {
+#if defined(WS_AVX2)
+    for (; i + 32 <= n; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i *) (s + i));
+      if (_mm256_movemask_epi8(v) != 0) break;
+    }
+#elif defined(WS_SSE2)
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i *) (s + i));
+      if (_mm_movemask_epi8(v) != 0) break;
+    }
+#elif defined(WS_NEON)
+    for (; i + 16 <= n; i += 16) {
+      uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8(s + i));
+      w = vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1);
+      if (w & 0x8080808080808080U) break;
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+      memcpy(&w, s + i, sizeof(w));
+      if (w & 0x8080808080808080U) break;
+    }
+    // Mixed text, a byte or a sequence at a time, until an ASCII word
+    while (i < n) {
+      if (s[i] < 0x80) {
+        if (i + 8 <= n) {
+          memcpy(&w, s + i, sizeof(w));
+          if (!(w & 0x8080808080808080U)) break;  // Back to the fast path
+        }
+        i++;
+      } else {
+        k = ws_utf8_seq(s + i, n - i);
+        if (k == 0 || i + k > n) return i;
+        i += k;
+      }
+    }
+  }
+  return i;
+}
+
+bool mg_ws_utf8_valid(const char *buf, size_t len) {
+  return ws_utf8((const uint8_t *) buf, len) == len;
+}
+
+// Parse frame header. Return header length, or 0 if it is incomplete
+static size_t ws_header(const uint8_t *buf, size_t len, struct ws_msg *msg) {
+  size_t n = 0, mask_len = 0;
   memset(msg, 0, sizeof(*msg));
   if (len >= 2) {
     n = buf[1] & 0x7f;                // Frame length
     mask_len = buf[1] & 128 ? 4 : 0;  // last bit is a mask bit
     msg->flags = buf[0];
-    if (n < 126 && len >= mask_len) {
+    if (n < 126 && len >= 2 + mask_len) {
       msg->data_len = n;
       msg->header_len = 2 + mask_len;
     } else if (n == 126 && len >= 4 + mask_len) {
       msg->header_len = 4 + mask_len;
-      msg->data_len = mg_ntohs(*(uint16_t *) &buf[2]);
+      msg->data_len = (size_t) buf[2] << 8 | buf[3];
     } else if (len >= 10 + mask_len) {
+      uint64_t v = 0;
+      size_t i;
+      for (i = 2; i < 10; i++) v = v << 8 | buf[i];
       msg->header_len = 10 + mask_len;
-      msg->data_len =
-          (size_t) (((uint64_t) mg_ntohl(*(uint32_t *) &buf[2])) << 32) +
-          mg_ntohl(*(uint32_t *) &buf[6]);
+      msg->data_len = (size_t) (v > 0x7fffffff ? 0x7fffffff : v);
     }
   }
   // Sanity check, and integer overflow protection for the boundary check below
   // data_len should not be larger than 1 Gb
   if (msg->data_len > 1024 * 1024 * 1024) return 0;
+  return msg->header_len;
+}
+
+static size_t ws_process(uint8_t *buf, size_t len, struct ws_msg *msg) {
+  if (ws_header(buf, len, msg) == 0) return 0;
   if (msg->header_len + msg->data_len > len) return 0;
-  if (mask_len > 0) {
-    uint8_t *p = buf + msg->header_len, *m = p - mask_len;
-    for (i = 0; i < msg->data_len; i++) p[i] ^= m[i & 3];
+  if (buf[1] & 128) {
+    uint8_t *p = buf + msg->header_len;
+    mg_ws_mask(p, msg->data_len, p - 4);
   }
   return msg->header_len + msg->data_len;
 }
 
+static void ws_unref(struct ws_state *ws) {
+  struct ws_ref *r = ws->queue;
+  ws->queue = r->next;
+  if (ws->queue == NULL) ws->last = NULL;
+  ws->queued -= r->frame->len - r->ofs;
+  if (--r->frame->refs == 0) free(r->frame);
+  free(r);
+}
+
+// Queued broadcast data: the unsent part of the first frame. This is the
+// c->ppending hook: the IO layer sends it before c->send
+static size_t ws_pending(const struct mg_connection *c, const void **buf) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  struct ws_ref *r = ws == NULL ? NULL : ws->queue;
+  if (r == NULL) return 0;
+  if (buf != NULL) *buf = (uint8_t *) (r->frame + 1) + r->ofs;
+  return r->frame->len - r->ofs;
+}
+
+static void ws_sent(struct mg_connection *c, size_t n) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  struct ws_ref *r = ws->queue;
+  r->ofs += n;
+  ws->queued -= n;
+  if (r->ofs >= r->frame->len) ws_unref(ws);
+}
+
+static struct ws_state *ws_state(struct mg_connection *c) {
+  if (c->ws == NULL && (c->ws = calloc(1, sizeof(struct ws_state))) != NULL) {
+    ((struct ws_state *) c->ws)->rtt = -1;
+    if (c->pfree == NULL) c->pfree = mg_ws_free;  // HTTP's frees it, too
+    c->ppending = ws_pending, c->psent = ws_sent;
+  }
+  return (struct ws_state *) c->ws;
+}
+
+void mg_ws_free(struct mg_connection *c) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  if (ws == NULL) return;
+  while (ws->queue != NULL) ws_unref(ws);
+  mg_deflate_free(&ws->tx);
+  mg_inflate_free(&ws->rx);
+  mg_iobuf_free(&ws->frag);
+  mg_iobuf_free(&ws->tbuf);
+  mg_iobuf_free(&ws->rbuf);
+  free(ws);
+  c->ws = NULL;
+}
+
+// Take the next sep-separated token from s
+static bool ws_token(struct mg_str *s, char sep, struct mg_str *tok) {
+  size_t n = 0;
+  if (s->len == 0) return false;
+  while (n < s->len && s->ptr[n] != sep) n++;
+  *tok = mg_strstrip(mg_str_n(s->ptr, n));
+  if (n < s->len) n++;
+  s->ptr += n, s->len -= n;
+  return true;
+}
+
+// Parse window bits value, 8 .. 15. Return 0 if it is missing or invalid
+static int ws_bits(struct mg_str v) {
+  int n = 0;
+  size_t i;
+  if (v.len > 1 && v.ptr[0] == '"' && v.ptr[v.len - 1] == '"') {
+    v.ptr++, v.len -= 2;
+  }
+  for (i = 0; i < v.len && i < 3; i++) {
+    if (v.ptr[i] < '0' || v.ptr[i] > '9') return 0;
+    n = n * 10 + v.ptr[i] - '0';
+  }
+  return v.len > 0 && n >= 8 && n <= 15 ? n : 0;
+}
+
+// Apply permessage-deflate parameters, RFC7692 section 7.1: the server
+// parses an offer, the client parses a response. Return false if the
+// parameters can't be accepted
+static bool ws_params(struct ws_state *ws, struct mg_str params,
+                      bool is_client) {
+  struct mg_str p, k;
+  bool limit = false;  // Client agrees to limit its window
+  while (ws_token(&params, ';', &p)) {
+    size_t n = 0;
+    int bits;
+    while (n < p.len && p.ptr[n] != '=') n++;
+    k = mg_strstrip(mg_str_n(p.ptr, n));
+    bits = ws_bits(
+        n < p.len ? mg_strstrip(mg_str_n(p.ptr + n + 1, p.len - n - 1))
+                  : mg_str_n(NULL, 0));
+    if (mg_vcasecmp(&k, "server_no_context_takeover") == 0) {
+      if (is_client) ws->rx_reset = true;
+      if (!is_client) ws->tx_reset = true;
+    } else if (mg_vcasecmp(&k, "client_no_context_takeover") == 0) {
+      if (is_client) ws->tx_reset = true;
+      if (!is_client) ws->rx_reset = true;
+    } else if (mg_vcasecmp(&k, "server_max_window_bits") == 0) {
+      if (bits == 0 || (!is_client && bits < 10)) return false;
+      if (is_client) ws->rx_bits = bits;
+      if (!is_client && bits < ws->tx_bits) ws->tx_bits = bits;
+    } else if (mg_vcasecmp(&k, "client_max_window_bits") == 0) {
+      if (is_client && bits < 10) return false;  // Our compressor can't
+      if (is_client && bits < ws->tx_bits) ws->tx_bits = bits;
+      if (!is_client && bits > 0 && bits < ws->rx_bits) ws->rx_bits = bits;
+      limit = true;
+    } else {
+      return false;
+    }
+  }
+  if (!is_client && !limit) ws->rx_bits = 15;
+  return true;
+}
+
+// Find a permessage-deflate offer or response we can accept
+static bool ws_negotiate(struct ws_state *ws, struct mg_http_message *hm,
+                         bool is_client) {
+  struct mg_str *h = mg_http_get_header(hm, "Sec-WebSocket-Extensions");
+  struct mg_str s = h == NULL ? mg_str_n(NULL, 0) : *h, e;
+  int bits = ws->opts.window_bits;
+  if (bits < 10 || bits > 15) bits = 15;
+  while (ws_token(&s, ',', &e)) {
+    struct mg_str params = e, name = mg_str_n(NULL, 0);
+    if (!ws_token(&params, ';', &name) || name.len == 0) continue;  // Empty
+    ws->tx_bits = bits, ws->rx_bits = is_client ? 15 : bits;
+    ws->tx_reset = ws->opts.no_context_takeover;
+    ws->rx_reset = is_client ? false : ws->opts.no_context_takeover;
+    if (mg_vcasecmp(&name, "permessage-deflate") == 0 &&
+        ws_params(ws, params, is_client)) {
+      return true;
+    }
+    if (is_client) return false;  // Server must respond with what we offered
+  }
+  return false;
+}
+
+bool mg_ws_deflate(struct mg_connection *c, struct mg_http_message *hm,
+                   const struct mg_ws_deflate_opts *opts) {
+  struct ws_state *ws = ws_state(c);
+  if (ws == NULL) return false;
+  if (opts != NULL) ws->opts = *opts;
+  if (c->is_client) {
+    // Add an offer to the handshake request, mg_ws_connect() has just
+    // put it into the send buffer
+    char buf[160];
+    int bits = ws->opts.window_bits;
+    size_t n = mg_snprintf(
+        buf, sizeof(buf),
+        "Sec-WebSocket-Extensions: permessage-deflate; "
+        "client_max_window_bits%s\r\n",
+        ws->opts.no_context_takeover
+            ? "; server_no_context_takeover; client_no_context_takeover"
+            : "");
+    if (bits >= 10 && bits < 15) {
+      n -= 2;
+      n += mg_snprintf(buf + n, sizeof(buf) - n,
+                       "; server_max_window_bits=%d\r\n", bits);
+    }
+    if (c->is_websocket || c->send.len < 4 ||
+        memcmp(c->send.buf + c->send.len - 4, "\r\n\r\n", 4) != 0 ||
+        mg_iobuf_add(&c->send, c->send.len - 2, buf, n, MG_IO_SIZE) == 0) {
+      mg_ws_free(c);
+    }
+  } else if (hm == NULL || !ws_negotiate(ws, hm, false)) {
+    mg_ws_free(c);
+  } else {
+    ws->deflate = true;
+  }
+  return c->ws != NULL;
+}
+
+// Send a close frame with a status code, RFC6455 section 7.4
+static void ws_close(struct mg_connection *c, uint16_t code) {
+  uint8_t buf[2];
+  buf[0] = (uint8_t) (code >> 8), buf[1] = (uint8_t) (code & 255);
+  mg_ws_send(c, (char *) buf, sizeof(buf), WEBSOCKET_OP_CLOSE);
+  c->is_draining = 1;
+}
+
+// Compress a message into ws->tbuf. Return false to send it as is
+static bool ws_compress(struct ws_state *ws, const char *buf, size_t len) {
+  if (ws->tx.win == NULL &&
+      !mg_deflate_init(&ws->tx, ws->opts.level, (size_t) 1 << ws->tx_bits)) {
+    return false;
+  }
+  ws->tbuf.len = 0;
+  if (mg_deflate(&ws->tx, buf, len, false, &ws->tbuf) < 4) return false;
+  ws->tbuf.len -= 4;  // Strip 00 00 ff ff, RFC7692 section 7.2.1
+  if (ws->tx_reset) mg_deflate_reset(&ws->tx);
+  return true;
+}
+
+// Deliver a complete message to the user, decompressing it if needed.
+// Decompressed size is limited like the size of a plain message
+static void ws_deliver(struct mg_connection *c, struct mg_ws_message *m) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  if (ws != NULL && ws->deflate && (m->flags & WS_RSV1)) {
+    size_t max = ws->opts.max_size > 0 ? ws->opts.max_size : MG_WS_MAX_MSG_SIZE;
+    long n = -1;
+    ws->rbuf.len = 0;
+    if (ws->rx.win != NULL || ws->rx_reset ||
+        mg_inflate_init(&ws->rx, (size_t) 1 << ws->rx_bits)) {
+      n = mg_inflate(&ws->rx, m->data.ptr, m->data.len, &ws->rbuf, max);
+    }
+    if (n < 0) {
+      MG_ERROR(("%lu inflate error %ld", c->id, n));
+      ws_close(c, n == -2 ? 1009 : 1007);
+      return;
+    }
+    m->data = n == 0 ? mg_str("") : mg_str_n((char *) ws->rbuf.buf, (size_t) n);
+    m->flags &= (uint8_t) ~WS_RSV1;
+  }
+  if (ws != NULL && ws->utf8 && (m->flags & 15) == WEBSOCKET_OP_TEXT &&
+      !mg_ws_utf8_valid(m->data.ptr, m->data.len)) {
+    MG_ERROR(("%lu invalid UTF-8", c->id));
+    ws_close(c, 1007);
+    return;
+  }
+  mg_call(c, MG_EV_WS_MSG, m);
+  if (ws != NULL && ws->rbuf.size > MG_IO_SIZE) mg_iobuf_free(&ws->rbuf);
+}
+
+// Append a frame to the fragmented message, deliver it on the last frame.
+// The buffer grows geometrically, so the reassembly is linear
+static void ws_fragment(struct mg_connection *c, struct mg_ws_message *m) {
+  struct ws_state *ws = ws_state(c);
+  size_t n = m->data.len;
+  if (ws == NULL) {
+    mg_error(c, "OOM");
+  } else if (((m->flags & 15) == WEBSOCKET_OP_CONTINUE) != (ws->frags > 0)) {
+    ws_close(c, 1002);  // Continuation without a start, or a nested start
+  } else if (ws->frags >= MG_WS_MAX_FRAGMENTS ||
+             n > MG_WS_MAX_MSG_SIZE - ws->frag.len) {
+    MG_ERROR(("%lu fragmented message too big", c->id));
+    ws_close(c, 1009);
+  } else {
+    struct mg_iobuf *io = &ws->frag;
+    if (ws->frags++ == 0) ws->frag_flags = m->flags;
+    if (io->len + n > io->size) {
+      size_t size = io->size * 2 < io->len + n ? io->len + n : io->size * 2;
+      if (size < MG_IO_SIZE) size = MG_IO_SIZE;
+      if (size > MG_WS_MAX_MSG_SIZE) size = MG_WS_MAX_MSG_SIZE;
+      if (!mg_iobuf_resize(io, size)) {
+        mg_error(c, "OOM");
+        return;
+      }
+    }
+    if (n > 0) memcpy(io->buf + io->len, m->data.ptr, n);
+    io->len += n;
+    if (m->flags & 128) {
+      struct mg_ws_message msg = {{(char *) io->buf, io->len}, ws->frag_flags};
+      if (io->len == 0) msg.data = mg_str("");
+      ws_deliver(c, &msg);
+      ws->frags = io->len = 0;
+      if (io->size > MG_IO_SIZE) mg_iobuf_free(io);
+    }
+  }
+}
+
 static size_t mkhdr(size_t len, int op, bool is_client, uint8_t *buf) {
   size_t n = 0;
   buf[0] = (uint8_t) (op | 128);
@@ -120,31 +582,349 @@ static size_t mkhdr(size_t len, int op, bool is_client, uint8_t *buf) {
   return n;
 }
 
-static void mg_ws_mask(struct mg_connection *c, size_t len) {
+static void ws_mask_send(struct mg_connection *c, size_t len) {
   if (c->is_client && c->send.buf != NULL) {
-    size_t i;
-    uint8_t *p = c->send.buf + c->send.len - len, *mask = p - 4;
-    for (i = 0; i < len; i++) p[i] ^= mask[i & 3];
+    uint8_t *p = c->send.buf + c->send.len - len;
+    mg_ws_mask(p, len, p - 4);
   }
 }
 
+// Make room for a frame with len bytes of payload at the end of c->send.
+// Return the size of the header slot, the payload goes right after it
+static size_t ws_room(struct mg_connection *c, size_t len) {
+  size_t hlen = len < 126 ? 2 : len < 65536 ? 4 : 10, size;
+  if (c->is_client) hlen += 4;  // Masking key
+  size = c->send.len + hlen + len;
+  if (size > c->send.size) {
+    size += MG_IO_SIZE - size % MG_IO_SIZE;  // Align like mg_iobuf_add()
+    if (!mg_iobuf_resize(&c->send, size)) return 0;
+  }
+  return hlen;
+}
+
+// Payload is in c->send after a header slot of hlen bytes. Write the header
+// in front of it and mask it in place. Return frame size
+static size_t ws_finish(struct mg_connection *c, size_t hlen, size_t len,
+                        int op) {
+  uint8_t header[14], *p = c->send.buf + c->send.len;
+  size_t n = mkhdr(len, op, c->is_client, header);
+  if (n < hlen) memmove(p + n, p + hlen, len);  // Shorter length encoding
+  memcpy(p, header, n);
+  c->send.len += n + len;
+  ws_mask_send(c, len);
+  return n + len;
+}
+
+static bool ws_compressible(struct ws_state *ws, size_t len, int op) {
+  return ws != NULL && ws->deflate &&
+         (op == WEBSOCKET_OP_TEXT || op == WEBSOCKET_OP_BINARY) &&
+         len >= ws->opts.min_size;
+}
+
 size_t mg_ws_send(struct mg_connection *c, const char *buf, size_t len,
                   int op) {
-  uint8_t header[14];
-  size_t header_len = mkhdr(len, op, c->is_client, header);
-  mg_send(c, header, header_len);
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  size_t hlen, n = 0;
   MG_VERBOSE(("WS out: %d [%.*s]", (int) len, (int) len, buf));
-  mg_send(c, buf, len);
-  mg_ws_mask(c, len);
-  return header_len + len;
+  if (ws_compressible(ws, len, op) && ws_compress(ws, buf, len)) {
+    buf = (char *) ws->tbuf.buf, len = ws->tbuf.len, op |= WS_RSV1;
+  }
+  if ((hlen = ws_room(c, len)) > 0) {
+    if (len > 0) memmove(c->send.buf + c->send.len + hlen, buf, len);
+    n = ws_finish(c, hlen, len, op);
+  }
+  if (ws != NULL && ws->tbuf.size > MG_IO_SIZE) mg_iobuf_free(&ws->tbuf);
+  return n;
+}
+
+void *mg_ws_reserve(struct mg_connection *c, size_t len) {
+  struct ws_state *ws = ws_state(c);
+  size_t hlen;
+  if (ws == NULL || (hlen = ws_room(c, len)) == 0) return NULL;
+  ws->resv = hlen, ws->resv_len = len;
+  return c->send.buf + c->send.len + hlen;
+}
+
+size_t mg_ws_commit(struct mg_connection *c, size_t len, int op) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  size_t hlen = ws == NULL ? 0 : ws->resv;
+  if (hlen == 0 || len > ws->resv_len ||
+      c->send.len + hlen + len > c->send.size) {
+    return 0;  // Nothing reserved, or c->send was changed since
+  }
+  ws->resv = 0;
+  if (ws_compressible(ws, len, op)) {
+    // Compressed frame is built anew, over the reserved space
+    return mg_ws_send(c, (char *) c->send.buf + c->send.len + hlen, len, op);
+  }
+  return ws_finish(c, hlen, len, op);
+}
+
+// Drop queued broadcast frames that are not started yet
+static void ws_coalesce(struct ws_state *ws) {
+  struct ws_ref *keep = ws->queue, *r;
+  if (keep != NULL && keep->ofs == 0) keep = NULL;
+  r = keep == NULL ? ws->queue : keep->next;
+  while (r != NULL) {
+    struct ws_ref *next = r->next;
+    ws->queued -= r->frame->len;
+    if (--r->frame->refs == 0) free(r->frame);
+    free(r);
+    r = next;
+  }
+  if (keep != NULL) keep->next = NULL;
+  ws->queue = ws->last = keep;
+}
+
+static bool ws_label(const struct mg_connection *c, const char *glob) {
+  size_t n = 0;
+  while (n < sizeof(c->label) && c->label[n] != '\0') n++;
+  return glob == NULL || mg_globmatch(glob, strlen(glob), c->label, n);
+}
+
+// Queue a broadcast frame on a connection
+static bool ws_enqueue(struct mg_connection *c, struct ws_frame *f) {
+  struct ws_state *ws = ws_state(c);
+  struct ws_ref *r;
+  if (ws == NULL || (r = (struct ws_ref *) calloc(1, sizeof(*r))) == NULL) {
+    return false;
+  }
+  r->frame = f;
+  f->refs++;
+  if (ws->last != NULL) ws->last->next = r;
+  if (ws->queue == NULL) ws->queue = r;
+  ws->last = r;
+  ws->queued += f->len;
+  return true;
+}
+
+size_t mg_ws_broadcast(struct mg_mgr *mgr, const char *buf, size_t len,
+                       int op, const struct mg_ws_broadcast_opts *opts) {
+  struct ws_frame *f = NULL;
+  struct mg_connection *c;
+  uint8_t header[14];
+  size_t count = 0, max = opts == NULL ? 0 : opts->max_backlog;
+  size_t hlen = mkhdr(len, op, false, header), flen = hlen + len;
+  int policy = opts == NULL ? MG_WS_DROP : opts->policy;
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    struct ws_state *ws = (struct ws_state *) c->ws;
+    if (!c->is_websocket || c->is_client || c->is_closing || c->is_draining ||
+        !ws_label(c, opts == NULL ? NULL : opts->label)) {
+      continue;
+    }
+    if (max > 0 && c->send.len + (ws == NULL ? 0 : ws->queued) + flen > max) {
+      if (policy == MG_WS_CLOSE) {
+        MG_DEBUG(("%lu slow consumer, closing", c->id));
+        c->is_closing = 1;
+        continue;
+      }
+      if (policy == MG_WS_COALESCE && ws != NULL) ws_coalesce(ws);
+      if (c->send.len + (ws == NULL ? 0 : ws->queued) + flen > max) continue;
+    }
+    if (ws != NULL && ws->deflate) {
+      mg_ws_send(c, buf, len, op);  // Compression state is per connection
+    } else {
+      if (f == NULL) {  // Build the frame once
+        if ((f = (struct ws_frame *) malloc(sizeof(*f) + flen)) == NULL) break;
+        f->refs = 0, f->len = flen;
+        memcpy(f + 1, header, hlen);
+        memcpy((uint8_t *) (f + 1) + hlen, buf, len);
+      }
+      if (c->send.len > 0) {
+        mg_send(c, f + 1, flen);  // Keep the order with data sent earlier
+      } else if (!ws_enqueue(c, f)) {
+        continue;
+      }
+    }
+    count++;
+  }
+  if (f != NULL && f->refs == 0) free(f);
+  return count;
+}
+
+// Reserved bits and control frame limits, RFC6455 section 5.2 and 5.5
+static bool ws_frame_ok(const struct ws_state *ws, const struct ws_msg *msg) {
+  uint8_t op = msg->flags & 15;
+  if (msg->flags & 0x30) return false;  // RSV2, RSV3: no extension uses them
+  if ((msg->flags & WS_RSV1) &&
+      (ws == NULL || !ws->deflate || op == WEBSOCKET_OP_CONTINUE ||
+       op > WEBSOCKET_OP_BINARY)) {
+    return false;  // Only the first frame of a compressed message
+  }
+  return op < 8 || ((msg->flags & 128) && msg->data_len <= 125);
+}
+
+bool mg_ws_check_utf8(struct mg_connection *c, bool on) {
+  struct ws_state *ws = ws_state(c);
+  if (ws != NULL) ws->utf8 = on;
+  return ws != NULL;
+}
+
+// Validate a slice of a streamed text message. A sequence cut at the end
+// of the slice is kept, and completed with the start of the next slice
+static bool ws_utf8_slice(struct ws_state *ws, const uint8_t *s, size_t n,
+                          bool final) {
+  size_t i = 0, k;
+  if (ws->utf8_len > 0) {
+    uint8_t *t = ws->utf8_tail;
+    size_t len = ws_utf8_seq(t, ws->utf8_len);
+    while (ws->utf8_len < len && i < n) t[ws->utf8_len++] = s[i++];
+    if (ws_utf8_seq(t, ws->utf8_len) == 0) return false;
+    if (ws->utf8_len < len) return !final;
+    ws->utf8_len = 0;
+  }
+  k = i + ws_utf8(s + i, n - i);
+  if (k < n) {
+    if (ws_utf8_seq(s + k, n - k) == 0) return false;  // Invalid, not cut
+    memcpy(ws->utf8_tail, s + k, n - k);               // At most 3 bytes
+    ws->utf8_len = n - k;
+  }
+  return !final || ws->utf8_len == 0;
+}
+
+bool mg_ws_stream(struct mg_connection *c, bool on) {
+  struct ws_state *ws = ws_state(c);
+  if (ws != NULL) ws->stream = on;
+  return ws != NULL;
+}
+
+// Deliver uncompressed data frames as MG_EV_WS_CHUNK slices, as they arrive.
+// Return false to process the frame at *ofs in full, like without streaming
+static bool ws_stream(struct mg_connection *c, struct ws_state *ws,
+                      size_t *ofs) {
+  uint8_t *buf = c->recv.buf + *ofs, tmp[4];
+  size_t i, n, len = c->recv.len - *ofs;
+  if (ws->in_left == 0) {  // New frame
+    struct ws_msg msg;
+    uint8_t op;
+    if (ws_header(buf, len, &msg) == 0) return false;
+    op = msg.flags & 15;
+    if (msg.flags & 0x30) return false;  // Bad frame, mg_ws_cb() fails it
+    if (op == WEBSOCKET_OP_CONTINUE ? !ws->in_msg
+                                     : (op > WEBSOCKET_OP_BINARY ||
+                                        (msg.flags & WS_RSV1) || ws->frags)) {
+      return false;  // Control frame, or a compressed message
+    }
+    if (op != WEBSOCKET_OP_CONTINUE) {
+      if (ws->in_msg) {
+        ws_close(c, 1002);  // New message inside of a fragmented one
+        return true;
+      }
+      ws->in_msg = true, ws->in_flags = msg.flags, ws->in_ofs = 0;
+      ws->utf8_len = 0;
+    }
+    ws->in_masked = buf[1] & 128 ? true : false;
+    if (ws->in_masked) memcpy(ws->in_mask, buf + msg.header_len - 4, 4);
+    ws->in_left = msg.data_len;
+    ws->in_fin = msg.flags & 128 ? true : false;
+    *ofs += msg.header_len, buf += msg.header_len, len -= msg.header_len;
+    if (ws->in_left > 0) return true;
+  }
+  n = len < ws->in_left ? len : ws->in_left;
+  if (ws->in_masked && n > 0) {
+    mg_ws_mask(buf, n, ws->in_mask);
+    for (i = 0; i < 4; i++) tmp[i] = ws->in_mask[(i + n) & 3];
+    memcpy(ws->in_mask, tmp, sizeof(tmp));
+  }
+  ws->in_left -= n;
+  *ofs += n;
+  if (n > 0 || (ws->in_fin && ws->in_left == 0)) {
+    struct mg_ws_chunk ch;
+    if (ws->utf8 && (ws->in_flags & 15) == WEBSOCKET_OP_TEXT &&
+        !ws_utf8_slice(ws, buf, n, ws->in_fin && ws->in_left == 0)) {
+      MG_ERROR(("%lu invalid UTF-8", c->id));
+      ws_close(c, 1007);
+      return true;
+    }
+    ch.data = n == 0 ? mg_str("") : mg_str_n((char *) buf, n);
+    ch.flags = ws->in_flags & 15;
+    ch.ofs = ws->in_ofs;
+    ch.final = ws->in_fin && ws->in_left == 0;
+    ws->in_ofs += n;
+    if (ch.final) ws->in_msg = false;
+    mg_call(c, MG_EV_WS_CHUNK, &ch);
+  }
+  return true;
+}
+
+// Send a ping, or fail the connection if the last one was not answered in
+// time. ws->next_ping skips ticks with nothing to do
+static void ws_ping(struct mg_connection *c, struct ws_state *ws) {
+  uint64_t now = mg_millis(), never = (uint64_t) -1;
+  if (ws->ping_ms == 0 || now < ws->next_ping) return;
+  if (!c->is_websocket || c->is_closing || c->is_draining) return;
+  if (ws->ping_sent > 0) {
+    if (ws->timeout_ms > 0 && now - ws->ping_sent >= ws->timeout_ms) {
+      mg_error(c, "WS ping timeout");  // Peer is dead, don't wait for TCP
+    } else {
+      ws->next_ping = ws->timeout_ms > 0 ? ws->ping_sent + ws->timeout_ms
+                                         : never;  // ws_pong() resets it
+    }
+  } else if (now - ws->ping_last >= ws->ping_ms) {
+    // Payload is the send timestamp, so that only our pong is matched
+    mg_ws_send(c, (char *) &now, sizeof(now), WEBSOCKET_OP_PING);
+    ws->ping_sent = ws->ping_last = now;
+    ws->next_ping = ws->timeout_ms > 0 ? now + ws->timeout_ms : never;
+  } else {
+    ws->next_ping = ws->ping_last + ws->ping_ms;
+  }
+}
+
+static void ws_pong(struct ws_state *ws, struct mg_str *data) {
+  if (ws->ping_sent > 0 && data->len == sizeof(ws->ping_sent) &&
+      memcmp(data->ptr, &ws->ping_sent, sizeof(ws->ping_sent)) == 0) {
+    ws->rtt = (long) (mg_millis() - ws->ping_sent);
+    ws->ping_sent = 0;
+    ws->next_ping = ws->ping_last + ws->ping_ms;
+  }
+}
+
+// Keepalive of all WebSocket connections of the manager is driven by one
+// timer. It lives as long as the manager, so that a connection neither
+// allocates nor frees timers, and mg_ws_keepalive() is safe to call from
+// a timer callback
+static void ws_timer(void *arg) {
+  struct mg_connection *c;
+  for (c = ((struct mg_mgr *) arg)->conns; c != NULL; c = c->next) {
+    if (c->ws != NULL) ws_ping(c, (struct ws_state *) c->ws);
+  }
+}
+
+// Start the manager's keepalive timer, or make it tick at least every `ms`
+static void ws_timer_add(struct mg_mgr *mgr, uint64_t ms) {
+  struct mg_timer *t = mgr->timers;
+  while (t != NULL && t->fn != ws_timer) t = t->next;
+  if (t == NULL) {
+    mg_timer_add(mgr, ms, MG_TIMER_REPEAT, ws_timer, mgr);
+  } else if (ms < t->period_ms) {
+    t->period_ms = ms, t->expire = 0;  // Rescheduled on the next poll
+  }
+}
+
+bool mg_ws_keepalive(struct mg_connection *c, unsigned ping_ms,
+                     unsigned timeout_ms) {
+  struct ws_state *ws = ws_state(c);
+  if (ws == NULL) return false;
+  ws->ping_ms = ping_ms, ws->timeout_ms = timeout_ms;
+  ws->ping_sent = 0, ws->ping_last = mg_millis();
+  ws->next_ping = ws->ping_last + ping_ms;
+  if (ping_ms > 0) {
+    ws_timer_add(c->mgr, timeout_ms > 0 && timeout_ms < ping_ms ? timeout_ms
+                                                                 : ping_ms);
+  }
+  return true;
+}
+
+long mg_ws_rtt(const struct mg_connection *c) {
+  struct ws_state *ws = (struct ws_state *) c->ws;
+  return ws == NULL ? -1 : ws->rtt;
 }
 
 static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
                      void *fn_data) {
   struct ws_msg msg;
-  size_t ofs = (size_t) c->pfn_data;
+  size_t ofs = 0, len;
 
-  // assert(ofs < c->recv.len);
   if (ev == MG_EV_READ) {
     if (!c->is_websocket && c->is_client) {
       int n = mg_http_get_request_len(c->recv.buf, c->recv.len);
@@ -156,7 +936,16 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
           c->is_closing = 1;
         } else {
           struct mg_http_message hm;
+          struct ws_state *ws = (struct ws_state *) c->ws;
           mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
+          if (ws != NULL &&
+              mg_http_get_header(&hm, "Sec-WebSocket-Extensions") != NULL) {
+            if (ws_negotiate(ws, &hm, true)) {
+              ws->deflate = true;
+            } else {
+              mg_error(c, "WS extension negotiation error");
+            }
+          }
           c->is_websocket = 1;
           mg_call(c, MG_EV_WS_OPEN, &hm);
         }
@@ -166,16 +955,30 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
       }
     }
 
-    while (ws_process(c->recv.buf + ofs, c->recv.len - ofs, &msg) > 0) {
-      char *s = (char *) c->recv.buf + ofs + msg.header_len;
-      struct mg_ws_message m = {{s, msg.data_len}, msg.flags};
-      size_t len = msg.header_len + msg.data_len;
-      uint8_t final = msg.flags & 128, op = msg.flags & 15;
+    // Frames stay in c->recv until the loop ends, and are removed at once
+    while (!c->is_draining && !c->is_closing && ofs < c->recv.len) {
+      struct ws_state *ws = (struct ws_state *) c->ws;
+      struct mg_ws_message m;
+      uint8_t final, op;
+      char *s;
+      if (ws != NULL && ws->stream && ws_stream(c, ws, &ofs)) continue;
+      len = ws_process(c->recv.buf + ofs, c->recv.len - ofs, &msg);
+      if (len == 0) break;
+      if (!ws_frame_ok(ws, &msg)) {
+        MG_ERROR(("%lu bad WS frame %#x", c->id, msg.flags));
+        ws_close(c, 1002);
+        break;
+      }
+      s = (char *) c->recv.buf + ofs + msg.header_len;
+      m.data = mg_str_n(s, msg.data_len), m.flags = msg.flags;
+      final = msg.flags & 128, op = msg.flags & 15;
       // MG_VERBOSE ("fin %d op %d len %d [%.*s]", final, op,
       //                       (int) m.data.len, (int) m.data.len, m.data.ptr));
+      ofs += len;
       switch (op) {
         case WEBSOCKET_OP_CONTINUE:
           mg_call(c, MG_EV_WS_CTL, &m);
+          ws_fragment(c, &m);
           break;
         case WEBSOCKET_OP_PING:
           MG_DEBUG(("%s", "WS PONG"));
@@ -183,45 +986,32 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data,
           mg_call(c, MG_EV_WS_CTL, &m);
           break;
         case WEBSOCKET_OP_PONG:
+          if (ws != NULL) ws_pong(ws, &m.data);
           mg_call(c, MG_EV_WS_CTL, &m);
           break;
         case WEBSOCKET_OP_TEXT:
         case WEBSOCKET_OP_BINARY:
-          if (final) mg_call(c, MG_EV_WS_MSG, &m);
+          if (final && (ws == NULL || ws->frags == 0)) {
+            ws_deliver(c, &m);  // Single frame message, the common case
+          } else {
+            ws_fragment(c, &m);
+          }
           break;
         case WEBSOCKET_OP_CLOSE:
           MG_DEBUG(("%lu Got WS CLOSE", c->id));
           mg_call(c, MG_EV_WS_CTL, &m);
-          mg_ws_send(c, "", 0, WEBSOCKET_OP_CLOSE);
+          // Echo the status code, RFC6455 section 5.5.1
+          mg_ws_send(c, s, msg.data_len >= 2 ? 2 : 0, WEBSOCKET_OP_CLOSE);
           c->is_draining = 1;
           break;
         default:
           // Per RFC6455, close conn when an unknown op is recvd
-          mg_error(c, "unknown WS op %d", op);
+          MG_ERROR(("%lu unknown WS op %d", c->id, op));
+          ws_close(c, 1002);
           break;
       }
-
-      // Handle fragmented frames: strip header, keep in c->recv
-      if (final == 0 || op == 0) {
-        if (op) ofs++, len--, msg.header_len--;       // First frame
-        mg_iobuf_del(&c->recv, ofs, msg.header_len);  // Strip header
-        len -= msg.header_len;
-        ofs += len;
-        c->pfn_data = (void *) ofs;
-        // MG_INFO(("FRAG %d [%.*s]", (int) ofs, (int) ofs, c->recv.buf));
-      }
-      // Remove non-fragmented frame
-      if (final && op) mg_iobuf_del(&c->recv, ofs, len);
-      // Last chunk of the fragmented frame
-      if (final && !op) {
-        m.flags = c->recv.buf[0];
-        m.data = mg_str_n((char *) &c->recv.buf[1], (size_t) (ofs - 1));
-        mg_call(c, MG_EV_WS_MSG, &m);
-        mg_iobuf_del(&c->recv, 0, ofs);
-        ofs = 0;
-        c->pfn_data = NULL;
-      }
     }
+    if (ofs > 0) mg_iobuf_del(&c->recv, 0, ofs);
   }
   (void) fn_data;
   (void) ev_data;
@@ -293,7 +1083,7 @@ size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
   p = &c->send.buf[c->send.len - len];         // p points to data
   memmove(p, p - header_len, len);             // Shift data
   memcpy(p - header_len, header, header_len);  // Prepend header
-  mg_ws_mask(c, len);                          // Mask data
+  ws_mask_send(c, len);                        // Mask data
 
   return c->send.len;
 }
@@ -14,6 +14,33 @@ struct mg_ws_message {
   uint8_t flags;       // Websocket message flags
 };
 
+// A slice of a message, see mg_ws_stream()
+struct mg_ws_chunk {
+  struct mg_str data;  // Payload slice, unmasked
+  uint8_t flags;       // Message type: WEBSOCKET_OP_TEXT or WEBSOCKET_OP_BINARY
+  size_t ofs;          // Offset of data in the message
+  bool final;          // This is the last slice of the message
+};
+
+// Parameter for mg_ws_deflate()
+struct mg_ws_deflate_opts {
+  int level;                 // Compression level, 1 .. 9, 0 - default
+  int window_bits;           // Max LZ77 window bits, 10 .. 15, 0 - 15
+  size_t min_size;           // Don't compress messages smaller than that
+  size_t max_size;           // Max decompressed size, 0 - MG_WS_MAX_MSG_SIZE
+  bool no_context_takeover;  // Compress every message separately
+};
+
+// Slow consumer policy for mg_ws_broadcast()
+enum { MG_WS_DROP, MG_WS_COALESCE, MG_WS_CLOSE };
+
+// Parameter for mg_ws_broadcast()
+struct mg_ws_broadcast_opts {
+  const char *label;   // Only connections whose c->label matches this glob
+  size_t max_backlog;  // Max unsent bytes per connection, 0 - no limit
+  int policy;          // What to do when max_backlog is reached
+};
+
 struct mg_connection *mg_ws_connect(struct mg_mgr *, const char *url,
                                     mg_event_handler_t fn, void *fn_data,
                                     const char *fmt, ...);
@@ -21,5 +48,19 @@ void mg_ws_upgrade(struct mg_connection *, struct mg_http_message *,
                    const char *fmt, ...);
 size_t mg_ws_send(struct mg_connection *, const char *buf, size_t len, int op);
 size_t mg_ws_wrap(struct mg_connection *, size_t len, int op);
+void *mg_ws_reserve(struct mg_connection *, size_t len);
+size_t mg_ws_commit(struct mg_connection *, size_t len, int op);
 size_t mg_ws_printf(struct mg_connection *c, int op, const char *fmt, ...);
 size_t mg_ws_vprintf(struct mg_connection *c, int op, const char *fmt, va_list);
+void mg_ws_mask(uint8_t *buf, size_t len, const uint8_t *mask);
+bool mg_ws_utf8_valid(const char *buf, size_t len);
+bool mg_ws_deflate(struct mg_connection *, struct mg_http_message *,
+                   const struct mg_ws_deflate_opts *);
+void mg_ws_free(struct mg_connection *);
+bool mg_ws_stream(struct mg_connection *, bool on);
+bool mg_ws_check_utf8(struct mg_connection *, bool on);
+bool mg_ws_keepalive(struct mg_connection *, unsigned ping_ms,
+                     unsigned timeout_ms);
+long mg_ws_rtt(const struct mg_connection *);
+size_t mg_ws_broadcast(struct mg_mgr *, const char *buf, size_t len, int op,
+                       const struct mg_ws_broadcast_opts *);
@@ -0,0 +1,346 @@
+// Microbenchmarks: make bench
+// Compare with scalar code: make bench BENCH_OPTS="-O3 -DMG_ENABLE_SIMD=0"
+// Enable AVX2: make bench BENCH_OPTS="-O3 -mavx2"
+#include "mongoose.h"
+
+#include <time.h>
+
+static double now(void) {
+  return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, size_t count, double secs) {
+  printf("%-28s %10.1f Mops/s\n", name,
+         secs > 0 ? (double) count / secs / 1e6 : 0.0);
+}
+
+static uint64_t s_seed = 88172645463325252U;
+static uint64_t rnd(void) {
+  s_seed ^= s_seed << 13, s_seed ^= s_seed >> 7, s_seed ^= s_seed << 17;
+  return s_seed;
+}
+
+#define NUM_DOUBLES 4096
+#define ROUNDS 200
+
+static void bench_dbl(void) {
+  static double nums[NUM_DOUBLES];
+  static char strs[NUM_DOUBLES][32];
+  size_t i, r, n = (size_t) NUM_DOUBLES * ROUNDS, len = 0;
+  double t, sum = 0;
+  char buf[32];
+
+  // Telemetry-like values: a few significant digits, moderate exponents
+  for (i = 0; i < NUM_DOUBLES; i++) {
+    nums[i] = (double) (rnd() % 2000000) / 1000.0 - 1000.0;
+    if (i % 4 == 0) nums[i] *= 1e-5;
+    if (i % 8 == 0) nums[i] = (double) rnd() / 3.0;  // Full precision
+    mg_snprintf(strs[i], sizeof(strs[i]), "%.0g", nums[i]);
+  }
+
+  t = now();
+  for (r = 0; r < ROUNDS; r++) {
+    for (i = 0; i < NUM_DOUBLES; i++) {
+      len += mg_dtoa(buf, sizeof(buf), nums[i], 0);
+    }
+  }
+  report("mg_dtoa() shortest", n, now() - t);
+
+  t = now();
+  for (r = 0; r < ROUNDS; r++) {
+    for (i = 0; i < NUM_DOUBLES; i++) {
+      len += (size_t) snprintf(buf, sizeof(buf), "%.17g", nums[i]);
+    }
+  }
+  report("snprintf() %.17g", n, now() - t);
+
+  t = now();
+  for (r = 0; r < ROUNDS; r++) {
+    for (i = 0; i < NUM_DOUBLES; i++) {
+      len += mg_snprintf(buf, sizeof(buf), "%g", nums[i]);
+    }
+  }
+  report("mg_snprintf() %g", n, now() - t);
+
+  t = now();
+  for (r = 0; r < ROUNDS; r++) {
+    for (i = 0; i < NUM_DOUBLES; i++) {
+      len += (size_t) snprintf(buf, sizeof(buf), "%g", nums[i]);
+    }
+  }
+  report("snprintf() %g", n, now() - t);
+
+  t = now();
+  for (r = 0; r < ROUNDS; r++) {
+    for (i = 0; i < NUM_DOUBLES; i++) {
+      sum += mg_atod(strs[i], (int) strlen(strs[i]), NULL);
+    }
+  }
+  report("mg_atod()", n, now() - t);
+
+  t = now();
+  for (r = 0; r < ROUNDS; r++) {
+    for (i = 0; i < NUM_DOUBLES; i++) sum += strtod(strs[i], NULL);
+  }
+  report("strtod()", n, now() - t);
+
+  if (len == 0 || sum == 0) printf("\n");  // Keep the compiler honest
+}
+
+static void report_mbps(const char *name, size_t bytes, double secs) {
+  printf("%-28s %10.1f MB/s\n", name,
+         secs > 0 ? (double) bytes / secs / 1e6 : 0.0);
+}
+
+// Build a realistic payload: an array of telemetry records, optionally
+// pretty-printed, optionally carrying long string fields
+static char *make_json(int records, bool pretty, bool blobs) {
+  struct mg_iobuf io = {NULL, 0, 0};
+  const char *nl = pretty ? "\n    " : "", *sp = pretty ? " " : "";
+  int i, j;
+  mg_wprintf(mg_write_iobuf, &io, "[");
+  for (i = 0; i < records; i++) {
+    mg_wprintf(mg_write_iobuf, &io,
+               "%s%s{%s%Q:%s%d,%s%Q:%s%Q,%s%Q:%s%g,%s%Q:%s[", i ? "," : "",
+               nl, nl, "id", sp, i, nl, "name", sp, "sensor \"A\"", nl,
+               "temp", sp, (double) (rnd() % 10000) / 100.0, nl, "hist", sp);
+    for (j = 0; j < 8; j++) {
+      int v = (int) (rnd() % 999);
+      mg_wprintf(mg_write_iobuf, &io, "%s%d", j ? "," : "", v);
+    }
+    mg_wprintf(mg_write_iobuf, &io, "]");
+    if (blobs) {
+      char blob[300];
+      for (j = 0; j < (int) sizeof(blob); j++) blob[j] = (char) ('a' + j % 26);
+      mg_wprintf(mg_write_iobuf, &io, ",%s%Q:%s%V", nl, "blob", sp,
+                 (int) sizeof(blob), blob);
+    }
+    mg_wprintf(mg_write_iobuf, &io, "%s}", pretty ? "\n  " : "");
+  }
+  mg_wprintf(mg_write_iobuf, &io, "]");
+  return (char *) io.buf;
+}
+
+static void bench_json_doc(const char *name, char *json, int rounds) {
+  struct mg_str s = mg_str(json);
+  struct mg_json_tok *toks =
+      (struct mg_json_tok *) calloc(20000, sizeof(*toks));
+  struct mg_json_index idx;
+  char label[64];
+  double t;
+  int r, n, sum = 0;
+
+  t = now();
+  for (r = 0; r < rounds; r++) {
+    sum += mg_json_get(s.ptr, (int) s.len, "$[999]", &n);
+  }
+  mg_snprintf(label, sizeof(label), "mg_json_get() %s", name);
+  report_mbps(label, s.len * (size_t) rounds, now() - t);
+
+  t = now();
+  for (r = 0; r < rounds; r++) {
+    sum += mg_json_index_init(&idx, s, toks, 20000);
+  }
+  mg_snprintf(label, sizeof(label), "mg_json_index_init() %s", name);
+  report_mbps(label, s.len * (size_t) rounds, now() - t);
+
+  if (sum == 0) printf("\n");
+  free(toks);
+  free(json);
+}
+
+static void bench_json(void) {
+  printf("JSON scanning: %s\n",
+#if !MG_ENABLE_SIMD
+         "scalar"
+#elif defined(__AVX2__)
+         "AVX2"
+#elif defined(__SSE2__) || defined(_M_X64)
+         "SSE2"
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+         "NEON"
+#else
+         "scalar"
+#endif
+  );
+  bench_json_doc("compact", make_json(1000, false, false), 200);
+  bench_json_doc("pretty", make_json(1000, true, false), 200);
+  bench_json_doc("strings", make_json(1000, true, true), 200);
+}
+
+// Reference byte-at-a-time masking loop, as it was before mg_ws_mask()
+static void mask_bytes(uint8_t *buf, size_t len, const uint8_t *mask) {
+  size_t i;
+  for (i = 0; i < len; i++) buf[i] ^= mask[i & 3];
+}
+
+static void bench_ws_mask_size(size_t size) {
+  static uint8_t buf[65536 + 1];
+  uint8_t mask[4] = {1, 2, 3, 4};
+  size_t i, n = ((size_t) 256 << 20) / size;  // 256 MB per measurement
+  double t;
+  char name[40];
+  // Payloads follow a 2 to 14 byte frame header, so are rarely aligned
+  uint8_t *p = buf + 1;
+  mg_snprintf(name, sizeof(name), "bytes, %lu", (unsigned long) size);
+  t = now();
+  for (i = 0; i < n; i++) mask_bytes(p, size, mask), mask[0] ^= p[0];
+  printf("%-28s %10.1f MB/s\n", name, (double) (n * size) / (now() - t) / 1e6);
+  mg_snprintf(name, sizeof(name), "mg_ws_mask, %lu", (unsigned long) size);
+  t = now();
+  for (i = 0; i < n; i++) mg_ws_mask(p, size, mask), mask[0] ^= p[0];
+  printf("%-28s %10.1f MB/s\n", name, (double) (n * size) / (now() - t) / 1e6);
+}
+
+static void bench_ws_mask(void) {
+  printf("WebSocket masking\n");
+  bench_ws_mask_size(16);
+  bench_ws_mask_size(125);
+  bench_ws_mask_size(1400);
+  bench_ws_mask_size(65536);
+}
+
+// Build a 4 MB frame from generated payload, the way an application would
+static void bench_ws_frame(void) {
+  struct mg_connection c;
+  size_t i, size = 4 << 20, n = 300;
+  double t;
+  memset(&c, 0, sizeof(c));
+  printf("WebSocket framing, %lu bytes\n", (unsigned long) size);
+  t = now();
+  for (i = 0; i < n; i++) {
+    c.send.len = 0;
+    mg_iobuf_add(&c.send, 0, NULL, size, MG_IO_SIZE);
+    memset(c.send.buf, (int) i, size);
+    mg_ws_wrap(&c, size, WEBSOCKET_OP_BINARY);
+  }
+  printf("%-28s %10.1f MB/s\n", "mg_ws_wrap",
+         (double) (n * size) / (now() - t) / 1e6);
+  t = now();
+  for (i = 0; i < n; i++) {
+    c.send.len = 0;
+    memset(mg_ws_reserve(&c, size), (int) i, size);
+    mg_ws_commit(&c, size, WEBSOCKET_OP_BINARY);
+  }
+  printf("%-28s %10.1f MB/s\n", "mg_ws_reserve/commit",
+         (double) (n * size) / (now() - t) / 1e6);
+  mg_ws_free(&c);
+  mg_iobuf_free(&c.send);
+}
+
+// Reference byte-at-a-time validator, the kind each handler used to run
+static bool utf8_bytes(const uint8_t *s, size_t n) {
+  size_t i = 0, k, len;
+  while (i < n) {
+    uint8_t c = s[i], lo = 0x80, hi = 0xbf;
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+    if (c < 0xc2 || c > 0xf4) return false;
+    len = c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+    if (c == 0xe0) lo = 0xa0;
+    if (c == 0xed) hi = 0x9f;
+    if (c == 0xf0) lo = 0x90;
+    if (c == 0xf4) hi = 0x8f;
+    if (i + len > n) return false;
+    for (k = 1; k < len; k++, lo = 0x80, hi = 0xbf) {
+      if (s[i + k] < lo || s[i + k] > hi) return false;
+    }
+    i += len;
+  }
+  return true;
+}
+
+static void bench_utf8_text(const char *name, const char *unit) {
+  static char buf[65536];
+  size_t i, n = 4096, len = strlen(unit), ok = 0, size;
+  double t;
+  char label[40];
+  for (i = 0; i + len <= sizeof(buf); i += len) memcpy(buf + i, unit, len);
+  size = i;
+  mg_snprintf(label, sizeof(label), "bytes, %s", name);
+  t = now();
+  for (i = 0; i < n; i++) ok += utf8_bytes((uint8_t *) buf, size);
+  printf("%-28s %10.1f MB/s\n", label, (double) (n * size) / (now() - t) / 1e6);
+  mg_snprintf(label, sizeof(label), "mg_ws_utf8_valid, %s", name);
+  t = now();
+  for (i = 0; i < n; i++) ok += mg_ws_utf8_valid(buf, size);
+  printf("%-28s %10.1f MB/s\n", label, (double) (n * size) / (now() - t) / 1e6);
+  if (ok != 2 * n) printf("  validation mismatch!\n");
+}
+
+static void bench_utf8(void) {
+  printf("UTF-8 validation\n");
+  bench_utf8_text("ascii", "The quick brown fox jumps over the lazy dog. ");
+  bench_utf8_text("latin", "Fu\xc3\x9f\xc3\xa4nger \xc3\xa9t\xc3\xa9 ");
+  bench_utf8_text("cjk", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e");
+}
+
+// Route PUBLISH to 100k subscriptions from 10k connections, compared with
+// a list of filters matched one by one with mg_match()
+#define MQTT_CONNS 10000
+#define MQTT_SUBS 10
+
+static void bench_mqtt_route(void) {
+  struct mg_connection *cs =
+      (struct mg_connection *) calloc(MQTT_CONNS, sizeof(*cs));
+  struct mg_str *list =
+      (struct mg_str *) calloc(MQTT_CONNS * MQTT_SUBS, sizeof(*list));
+  struct mg_mqtt_broker b;
+  struct mg_mgr mgr;
+  char buf[40];
+  size_t i, j, n, count = 0;
+  double t;
+  memset(&mgr, 0, sizeof(mgr));
+  mg_mqtt_broker_init(&b);
+  for (i = 0; i < MQTT_CONNS; i++) {
+    cs[i].mgr = &mgr;
+    for (j = 0; j < MQTT_SUBS; j++) {
+      mg_snprintf(buf, sizeof(buf), "dev/%lu/%lu", (unsigned long) i,
+                  (unsigned long) j);
+      if (j < 2) buf[strlen(buf) - 1] = j == 0 ? '#' : '+';
+      mg_mqtt_broker_sub(&b, &cs[i], mg_str(buf), 0);
+      if (j == 1) buf[strlen(buf) - 1] = '*';  // mg_match() wildcard
+      list[i * MQTT_SUBS + j] = mg_strdup(mg_str(buf));
+    }
+  }
+  printf("MQTT routing, %lu subscriptions\n", (unsigned long) b.subs);
+  n = 200000, t = now();
+  for (i = 0; i < n; i++) {
+    size_t k = (size_t) (rnd() % MQTT_CONNS);
+    mg_snprintf(buf, sizeof(buf), "dev/%lu/%lu", (unsigned long) k,
+                (unsigned long) (rnd() % MQTT_SUBS));
+    count += mg_mqtt_broker_pub(&b, mg_str(buf), mg_str("hi"), 0);
+    cs[k].send.len = 0;
+  }
+  printf("%-28s %10.0f pub/s\n", "mg_mqtt_broker_pub",
+         (double) n / (now() - t));
+  n = 200, t = now();
+  for (i = 0; i < n; i++) {
+    size_t k = (size_t) (rnd() % MQTT_CONNS);
+    mg_snprintf(buf, sizeof(buf), "dev/%lu/%lu", (unsigned long) k,
+                (unsigned long) (rnd() % MQTT_SUBS));
+    for (j = 0; j < MQTT_CONNS * MQTT_SUBS; j++) {
+      if (mg_match(mg_str(buf), list[j], NULL)) count++;
+    }
+  }
+  printf("%-28s %10.0f pub/s\n", "list + mg_match",
+         (double) n / (now() - t));
+  for (i = 0; i < MQTT_CONNS * MQTT_SUBS; i++) free((void *) list[i].ptr);
+  for (i = 0; i < MQTT_CONNS; i++) mg_iobuf_free(&cs[i].send);
+  mg_mqtt_broker_free(&b);
+  free(list);
+  free(cs);
+  if (count == 0) printf("  no deliveries!\n");
+}
+
+int main(void) {
+  bench_dbl();
+  bench_json();
+  bench_ws_mask();
+  bench_ws_frame();
+  bench_utf8();
+  bench_mqtt_route();
+  return 0;
+}
@@ -441,6 +441,184 @@ static void test_mqtt(void) {
   test_mqtt_ver(4);
 }
 
+// Return a bitmask of fake connections that got data, and reset them
+static unsigned mqbd(struct mg_connection *cs, size_t n) {
+  unsigned i, mask = 0;
+  for (i = 0; i < n; i++) {
+    if (cs[i].send.len > 0) mask |= 1U << i;
+    mg_iobuf_free(&cs[i].send);
+  }
+  return mask;
+}
+
+// QoS of the PUBLISH a fake connection got
+static int mqbq(struct mg_connection *c) {
+  return c->send.len > 0 ? (c->send.buf[0] >> 1) & 3 : -1;
+}
+
+struct mqb {
+  int opened, ack, subacked, msgs;
+  char buf[40];
+};
+
+static void mqbs(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  mg_mqtt_broker_handle((struct mg_mqtt_broker *) fn_data, c, ev, ev_data);
+}
+
+static void mqbc(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct mqb *p = (struct mqb *) fn_data;
+  struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
+  if (ev == MG_EV_MQTT_OPEN) {
+    p->opened++;
+    p->ack = *(int *) ev_data;
+  } else if (ev == MG_EV_MQTT_CMD && mm->cmd == MQTT_CMD_SUBACK) {
+    p->subacked++;
+  } else if (ev == MG_EV_MQTT_MSG) {
+    p->msgs++;
+    mg_snprintf(p->buf, sizeof(p->buf), "%.*s %.*s", (int) mm->topic.len,
+                mm->topic.ptr, (int) mm->data.len, mm->data.ptr);
+  }
+  (void) c;
+}
+
+static void test_mqtt_broker(void) {
+  const char *url = "mqtt://127.0.0.1:12371";
+  struct mg_mqtt_broker b;
+  struct mg_connection cs[8], *many, *c1, *c2;
+  struct mg_str hi = mg_str("hi");
+  struct mg_mgr mgr;
+  struct mqb s1, s2;
+  struct mg_mqtt_opts opts;
+  char buf[40], id[200];
+  size_t i, j;
+
+  mg_mgr_init(&mgr);
+  mg_mqtt_broker_init(&b);
+  memset(cs, 0, sizeof(cs));
+  for (i = 0; i < 8; i++) cs[i].mgr = &mgr;
+
+  // Filter syntax
+  ASSERT(!mg_mqtt_broker_sub(&b, &cs[0], mg_str(""), 0));
+  ASSERT(!mg_mqtt_broker_sub(&b, &cs[0], mg_str("a/#/b"), 0));
+  ASSERT(!mg_mqtt_broker_sub(&b, &cs[0], mg_str("a+"), 0));
+  ASSERT(!mg_mqtt_broker_sub(&b, &cs[0], mg_str("a/b#"), 0));
+  ASSERT(b.subs == 0 && b.nodes_count == 0 && b.peers_count == 0);
+
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[0], mg_str("a/b"), 0));
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[1], mg_str("a/+"), 0));
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[2], mg_str("a/#"), 1));
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[3], mg_str("#"), 0));
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[4], mg_str("+/+/c"), 0));
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[5], mg_str("$SYS/#"), 0));
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[6], mg_str("+/b"), 0));
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[7], mg_str("/x"), 0));
+  ASSERT(b.subs == 8 && b.peers_count == 8);
+
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("a/b"), hi, 1) == 5);
+  ASSERT(mqbd(cs, 8) == 0x4f);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("a"), hi, 0) == 2);  // a/# matches a
+  ASSERT(mqbd(cs, 8) == 0x0c);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("$SYS/x"), hi, 0) == 1);
+  ASSERT(mqbd(cs, 8) == 0x20);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("x/y/c"), hi, 0) == 2);
+  ASSERT(mqbd(cs, 8) == 0x18);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("/x"), hi, 0) == 2);
+  ASSERT(mqbd(cs, 8) == 0x88);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("a/+"), hi, 0) == 0);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str(""), hi, 0) == 0);
+  ASSERT(mqbd(cs, 8) == 0);
+
+  // Overlapping filters deliver once, same filter replaces
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[0], mg_str("a/#"), 0));
+  ASSERT(mg_mqtt_broker_sub(&b, &cs[0], mg_str("a/#"), 1));
+  ASSERT(b.subs == 9);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("a/b"), hi, 0) == 5);
+  ASSERT(mqbd(cs, 8) == 0x4f);
+  // Peer gets the highest QoS of all its matching filters, capped by the
+  // QoS of the publish
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("a/b"), hi, 2) == 5);
+  ASSERT(mqbq(&cs[0]) == 1 && mqbq(&cs[1]) == 0 && mqbq(&cs[2]) == 1);
+  ASSERT(mqbd(cs, 8) == 0x4f);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("a/b"), hi, -1) == 5);
+  ASSERT(mqbq(&cs[0]) == 0 && mqbq(&cs[2]) == 0);
+  ASSERT(mqbd(cs, 8) == 0x4f);
+  ASSERT(mg_mqtt_broker_unsub(&b, &cs[0], mg_str("a/b")));
+  ASSERT(!mg_mqtt_broker_unsub(&b, &cs[0], mg_str("a/b")));
+  ASSERT(!mg_mqtt_broker_unsub(&b, &cs[0], mg_str("x/y")));
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("a/b"), hi, 0) == 5);
+  ASSERT(mqbd(cs, 8) == 0x4f);
+  ASSERT(mg_mqtt_broker_unsub(&b, &cs[0], mg_str("a/#")));
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("a/b"), hi, 0) == 4);
+  ASSERT(mqbd(cs, 8) == 0x4e);
+  ASSERT(b.subs == 7 && b.peers_count == 7);
+
+  // Dropping a connection prunes its subscriptions and unused nodes
+  mg_mqtt_broker_drop(&b, &cs[3]);
+  mg_mqtt_broker_drop(&b, &cs[3]);
+  ASSERT(b.subs == 6 && b.peers_count == 6);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("x/y/c"), hi, 0) == 1);
+  ASSERT(mqbd(cs, 8) == 0x10);
+  for (i = 0; i < 8; i++) mg_mqtt_broker_drop(&b, &cs[i]);
+  ASSERT(b.subs == 0 && b.nodes_count == 0 && b.peers_count == 0);
+
+  // 100k subscriptions from 10k connections
+  many = (struct mg_connection *) calloc(10000, sizeof(*many));
+  ASSERT(many != NULL);
+  for (i = 0; i < 10000; i++) {
+    many[i].mgr = &mgr;
+    for (j = 0; j < 10; j++) {
+      mg_snprintf(buf, sizeof(buf), "dev/%lu/%lu", (unsigned long) i,
+                  (unsigned long) j);
+      if (j < 2) buf[strlen(buf) - 1] = j == 0 ? '#' : '+';
+      mg_mqtt_broker_sub(&b, &many[i], mg_str(buf), 0);
+    }
+  }
+  ASSERT(b.subs == 100000 && b.peers_count == 10000);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("dev/1234/5"), hi, 0) == 1);
+  ASSERT(many[1234].send.len > 0);
+  mg_iobuf_free(&many[1234].send);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("dev/1234"), hi, 0) == 1);  // dev/1234/#
+  mg_iobuf_free(&many[1234].send);
+  ASSERT(mg_mqtt_broker_pub(&b, mg_str("dev/x/5"), hi, 0) == 0);
+  for (i = 0; i < 10000; i += 2) mg_mqtt_broker_drop(&b, &many[i]);
+  ASSERT(b.subs == 50000 && b.peers_count == 5000);
+  mg_mqtt_broker_free(&b);
+  ASSERT(b.subs == 0 && b.nodes == NULL && b.peers == NULL);
+  free(many);
+
+  // Loopback broker, clients connect one at a time
+  memset(&s1, 0, sizeof(s1));
+  memset(&s2, 0, sizeof(s2));
+  ASSERT(mg_mqtt_listen(&mgr, url, mqbs, &b) != NULL);
+  c1 = mg_mqtt_connect(&mgr, url, NULL, mqbc, &s1);
+  for (i = 0; i < 100 && s1.opened == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(s1.opened == 1);
+  mg_mqtt_sub(c1, mg_str("t/+"), 1);
+  for (i = 0; i < 100 && s1.subacked == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(s1.subacked == 1 && b.subs == 1);
+  // Long client ID takes a 2-byte remaining length
+  memset(&opts, 0, sizeof(opts));
+  memset(id, 'x', sizeof(id));
+  opts.client_id = mg_str_n(id, sizeof(id));
+  c2 = mg_mqtt_connect(&mgr, url, &opts, mqbc, &s2);
+  for (i = 0; i < 100 && s2.opened == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(s2.opened == 1 && s2.ack == 0);
+  mg_mqtt_pub(c2, mg_str("t/1"), hi, 1, false);
+  mg_mqtt_pub(c2, mg_str("u/1"), hi, 1, false);
+  mg_mqtt_pub(c2, mg_str("t/2"), mg_str("ho"), 0, false);
+  for (i = 0; i < 100 && s1.msgs < 2; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(s1.msgs == 2 && s2.msgs == 0);
+  ASSERT(strcmp(s1.buf, "t/2 ho") == 0);
+  c1->is_closing = 1;
+  for (i = 0; i < 100 && b.peers_count > 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(b.subs == 0 && b.peers_count == 0 && b.nodes_count == 0);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  mg_mqtt_broker_free(&b);
+}
+
 static void eh1(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
   struct mg_tls_opts *topts = (struct mg_tls_opts *) fn_data;
   if (ev == MG_EV_ACCEPT && topts != NULL) mg_tls_init(c, topts);
@@ -1210,7 +1388,8 @@ static void test_http_range(void) {
   struct mg_mgr mgr;
   const char *url = "http://127.0.0.1:12349";
   struct mg_http_message hm;
-  char buf[FETCH_BUF_SIZE];
+  struct mg_str *etag;
+  char buf[FETCH_BUF_SIZE], req[200];
 
   mg_mgr_init(&mgr);
   mg_http_listen(&mgr, url, ehr, NULL);
@@ -1247,6 +1426,52 @@ static void test_http_range(void) {
   ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
   ASSERT(mg_strcmp(hm.uri, mg_str("416")) == 0);
 
+  // Suffix range
+  fetch(&mgr, buf, url, "%s", "GET /range.txt HTTP/1.0\nRange: bytes=-5\n\n");
+  ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
+  ASSERT(mg_strcmp(hm.uri, mg_str("206")) == 0);
+  ASSERT(mg_strcmp(hm.body, mg_str("ase.\n")) == 0);
+
+  // Multiple ranges, unsatisfiable ones are skipped
+  fetch(&mgr, buf, url, "%s",
+        "GET /range.txt HTTP/1.0\nRange: bytes=5-10, 999-, -5\n\n");
+  ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
+  ASSERT(mg_strcmp(hm.uri, mg_str("206")) == 0);
+  ASSERT(mg_strstr(*mg_http_get_header(&hm, "Content-Type"),
+                   mg_str("multipart/byteranges; boundary=")) != NULL);
+  ASSERT(mg_http_get_header(&hm, "Content-Range") == NULL);
+  ASSERT(mg_to64(*mg_http_get_header(&hm, "Content-Length")) ==
+         (int64_t) hm.body.len);
+  ASSERT(mg_strstr(hm.body, mg_str("Content-Range: bytes 5-10/312\r\n\r\n"
+                                   " of co\r\n--")) != NULL);
+  ASSERT(mg_strstr(hm.body, mg_str("Content-Range: bytes 307-311/312\r\n\r\n"
+                                   "ase.\n\r\n--")) != NULL);
+  ASSERT(hm.body.len > 4 && memcmp(&hm.body.ptr[hm.body.len - 4], "--\r\n",
+                                   4) == 0);
+
+  // Too many ranges, Range header is ignored
+  fetch(&mgr, buf, url, "%s",
+        "GET /range.txt HTTP/1.0\nRange: bytes=1-1,2-2,3-3,4-4,5-5,6-6,7-7,"
+        "8-8,9-9,10-10,11-11,12-12,13-13,14-14,15-15,16-16,17-17\n\n");
+  ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
+  ASSERT(mg_strcmp(hm.uri, mg_str("200")) == 0);
+  ASSERT(hm.body.len == 312);
+
+  // If-Range does not match, send the whole file
+  fetch(&mgr, buf, url, "%s",
+        "GET /range.txt HTTP/1.0\nRange: bytes=5-10\nIf-Range: \"1.2\"\n\n");
+  ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
+  ASSERT(mg_strcmp(hm.uri, mg_str("200")) == 0);
+  ASSERT(hm.body.len == 312);
+  etag = mg_http_get_header(&hm, "Etag");
+  mg_snprintf(req, sizeof(req),
+              "GET /range.txt HTTP/1.0\nRange: bytes=5-10\nIf-Range: %.*s\n\n",
+              (int) etag->len, etag->ptr);
+  fetch(&mgr, buf, url, "%s", req);
+  ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
+  ASSERT(mg_strcmp(hm.uri, mg_str("206")) == 0);
+  ASSERT(mg_strcmp(hm.body, mg_str(" of co")) == 0);
+
   mg_mgr_free(&mgr);
   ASSERT(mgr.conns == NULL);
 }
@@ -1397,6 +1622,121 @@ static size_t pf2(void (*out)(char, void *), void *ptr, va_list *ap) {
   return n;
 }
 
+struct wcount {
+  char buf[200];
+  size_t len, calls, hint;
+};
+
+static void wcount(const char *buf, size_t len, void *param) {
+  struct wcount *w = (struct wcount *) param;
+  if (buf == NULL) {
+    w->hint += len;
+  } else {
+    ASSERT(w->len + len < sizeof(w->buf));
+    memcpy(w->buf + w->len, buf, len);
+    w->len += len, w->calls++;
+    w->buf[w->len] = '\0';
+  }
+}
+
+static void test_wprintf(void) {
+  struct mg_iobuf io = {NULL, 0, 0};
+  struct wcount w;
+  char *p = NULL, tmp[100];
+  size_t n;
+
+  // Literal runs and string arguments are emitted as whole spans
+  memset(&w, 0, sizeof(w));
+  n = mg_wprintf(wcount, &w, "hello, %s! %d", "world", 42);
+  ASSERT(n == 16 && w.len == 16 && w.calls == 4 && w.hint == 13);
+  ASSERT(strcmp(w.buf, "hello, world! 42") == 0);
+
+  // Output matches the per-character path for every conversion
+  memset(&w, 0, sizeof(w));
+  n = mg_wprintf(wcount, &w, "%-5s|%05d|%#x|%Q|%H|%V|%c|%M|%%", "a", 3, 255,
+                 "q\"\n", 2, "\x01\xff", 4, "abcd", 'z', pf1, 1, 2);
+  ASSERT(n == w.len);
+  mg_snprintf(tmp, sizeof(tmp), "%-5s|%05d|%#x|%Q|%H|%V|%c|%M|%%", "a", 3,
+              255, "q\"\n", 2, "\x01\xff", 4, "abcd", 'z', pf1, 1, 2);
+  ASSERT(strcmp(w.buf, tmp) == 0);
+  ASSERT(strcmp(tmp, "a    |00003|0xff|\"q\\\"\\n\"|\"01ff\"|"
+                     "\"YWJjZA==\"|z|3|%") == 0);
+
+  // Padding longer than the internal pad buffer
+  memset(&w, 0, sizeof(w));
+  n = mg_wprintf(wcount, &w, "%40s", "x");
+  ASSERT(n == 40 && w.len == 40 && w.buf[38] == ' ' && w.buf[39] == 'x');
+
+  // Iobuf writer grows in MG_IO_SIZE steps and keeps data NUL-terminated
+  n = mg_wprintf(mg_write_iobuf, &io, "%s-%M", "abc", pf2, 3);
+  ASSERT(n == 7 && io.len == 7 && io.size == MG_IO_SIZE);
+  ASSERT(strcmp((char *) io.buf, "abc-210") == 0);
+  mg_rprintf(mg_putchar_iobuf, &io, "%.*s", 3, "xyzw");
+  ASSERT(io.len == 10 && strcmp((char *) io.buf, "abc-210xyz") == 0);
+  mg_iobuf_free(&io);
+
+  // Realloc writer
+  mg_wprintf(mg_write_realloc, &p, "[%d", 1);
+  mg_wprintf(mg_write_realloc, &p, ",%M]", pf1, 1, 1);
+  ASSERT(p != NULL && strcmp(p, "[1,2]") == 0);
+  free(p);
+}
+
+static void test_dbl(void) {
+  union {
+    double f;
+    uint64_t u;
+  } a, b;
+  uint64_t x = 88172645463325252U;
+  char buf[40];
+  int i, n, bad = 0;
+
+  ASSERT(mg_atod("0.1", 3, NULL) == 0.1);
+  ASSERT(mg_atod("1e23", 4, NULL) == 1e23);
+  ASSERT(mg_atod("9007199254740993", 16, NULL) == 9007199254740992.0);
+  ASSERT(mg_atod("4.9e-324", 8, NULL) == 5e-324);
+  ASSERT(mg_atod("2.2250738585072011e-308", 23, NULL) ==
+         2.2250738585072011e-308);
+  ASSERT(mg_atod("1e-400", 6, NULL) == 0.0);
+  ASSERT(mg_atod("123456789012345678901234567890", 30, &n) ==
+         123456789012345678901234567890.0);
+  ASSERT(n == 30);
+  ASSERT(mg_atod("0.000000000000000000000000000001e30", 35, &n) == 1.0);
+  ASSERT(n == 35);
+  a.f = mg_atod("1e400", 5, NULL);
+  ASSERT(a.u == (uint64_t) 0x7ff << 52);
+  a.f = mg_atod("-0", 2, NULL);
+  ASSERT(a.u == (uint64_t) 1 << 63);
+
+  // More than 19 significant digits: the dropped ones decide the rounding
+  ASSERT(mg_atod("9007199254740993.0000000000000001", 33, NULL) ==
+         9007199254740994.0);
+  ASSERT(mg_atod("9007199254740992.9999999999999999", 33, NULL) ==
+         9007199254740992.0);
+  ASSERT(mg_atod("9007199254740993.0000000000000000", 33, NULL) ==
+         9007199254740992.0);
+  ASSERT(mg_atod("1.00000000000000011102230246251565404236316680908203125",
+                 55, NULL) == 1.0);  // Halfway, to even
+  ASSERT(mg_atod("1.00000000000000011102230246251565404236316680908203126",
+                 55, NULL) == 1.0000000000000002);
+
+  // Random doubles round-trip through the shortest representation, and
+  // print like printf() with a given precision
+  for (i = 0; i < 100000; i++) {
+    char ref[40];
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    a.u = x;
+    if (((a.u >> 52) & 0x7ff) == 0x7ff) continue;  // Skip inf and nan
+    n = (int) mg_dtoa(buf, sizeof(buf), a.f, 0);
+    b.f = mg_atod(buf, n, NULL);
+    if (a.f != 0.0 && (b.u != a.u || strtod(buf, NULL) != a.f)) bad++;
+    mg_dtoa(buf, sizeof(buf), a.f, 1 + i % 20);
+    snprintf(ref, sizeof(ref), "%.*g", 1 + i % 20, a.f);
+    if (strcmp(buf, ref) != 0) bad++;
+  }
+  ASSERT(bad == 0);
+}
+
 static void test_str(void) {
   {
     struct mg_str s = mg_strdup(mg_str("a"));
@@ -1560,6 +1900,27 @@ static void test_str(void) {
     TESTDOUBLE("%g", -600.1234, "-600.123");
     TESTDOUBLE("%g", 599.1234, "599.123");
     TESTDOUBLE("%g", -599.1234, "-599.123");
+    TESTDOUBLE("%g", 0.00001234, "1.234e-05");
+    TESTDOUBLE("%g", 1e200, "1e+200");
+    TESTDOUBLE("%g", 1.5e-105, "1.5e-105");
+    TESTDOUBLE("%.*g", DBLWIDTH(0, 0.1), "0.1");
+    TESTDOUBLE("%.*g", DBLWIDTH(0, 1.0 / 3), "0.3333333333333333");
+    TESTDOUBLE("%.*g", DBLWIDTH(0, 5e-324), "5e-324");
+    TESTDOUBLE("%.*g", DBLWIDTH(0, 1.7976931348623157e308),
+               "1.7976931348623157e+308");
+    TESTDOUBLE("%.*g", DBLWIDTH(0, 2.2250738585072014e-308),
+               "2.2250738585072014e-308");
+    TESTDOUBLE("%.*g", DBLWIDTH(0, 9007199254740993.0), "9007199254740992");
+    TESTDOUBLE("%.*g", DBLWIDTH(0, 123456789012345680.0),
+               "1.2345678901234568e+17");
+    TESTDOUBLE("%.*g", DBLWIDTH(17, 0.1), "0.10000000000000001");
+    TESTDOUBLE("%.*g", DBLWIDTH(17, 1.0 / 3), "0.33333333333333331");
+    TESTDOUBLE("%.*g", DBLWIDTH(17, 5e-324), "4.9406564584124654e-324");
+    TESTDOUBLE("%.*g", DBLWIDTH(16, 9.7420776436751006e+162),
+               "9.742077643675101e+162");
+    TESTDOUBLE("%.*g", DBLWIDTH(20, 0.1), "0.10000000000000000555");
+    TESTDOUBLE("%.*g", DBLWIDTH(1, 0.25), "0.2");
+    TESTDOUBLE("%.*g", DBLWIDTH(1, 0.35), "0.3");
 
 #ifndef _WIN32
     TESTDOUBLE("%g", (double) INFINITY, "inf");
@@ -1952,188 +2313,1294 @@ static void test_http_chunked(void) {
   ASSERT(mgr.conns == NULL);
 }
 
-static void test_invalid_listen_addr(void) {
+// Chunk server: delete chunks of /del requests, keep others and reply with
+// the body's CRC
+static void ehcm(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  uint32_t *crc = (uint32_t *) c->label;
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  if (ev == MG_EV_HTTP_CHUNK && mg_http_match_uri(hm, "/del")) {
+    *crc = mg_crc32(*crc, hm->chunk.ptr, hm->chunk.len);
+    mg_http_delete_chunk(c, hm);
+    if (hm->chunk.len == 0) {
+      mg_http_reply(c, 200, "", "%lx", (unsigned long) *crc);
+      *crc = 0;
+    }
+  } else if (ev == MG_EV_HTTP_MSG) {
+    mg_http_reply(c, 200, "", "%lx",
+                  (unsigned long) mg_crc32(0, hm->body.ptr, hm->body.len));
+  }
+  (void) fn_data;
+}
+
+// Raw client, collect everything that server sends
+static void ehcmc(struct mg_connection *c, int ev, void *ev_data,
+                  void *fn_data) {
+  if (ev == MG_EV_READ) {
+    char *buf = (char *) fn_data;
+    size_t n = strlen(buf);
+    mg_snprintf(buf + n, 2048 - n, "%.*s", (int) c->recv.len, c->recv.buf);
+    c->recv.len = 0;
+  }
+  (void) ev_data;
+}
+
+static void test_http_chunked_many(void) {
   struct mg_mgr mgr;
   struct mg_connection *c;
+  const char *url = "http://127.0.0.1:12354";
+  char buf[2048], data[4096], expected[100];
+  size_t i, n = 0, len = 0;
+  uint32_t crc = 0;
   mg_mgr_init(&mgr);
-  c = mg_http_listen(&mgr, "invalid:31:14", eh1, NULL);
-  ASSERT(c == NULL);
+  mg_http_listen(&mgr, url, ehcm, NULL);
+
+  // Many small chunks in a single read. Two pipelined requests
+  for (i = 0; i < 200; i++) {
+    char chunk[20];
+    size_t k = mg_snprintf(chunk, sizeof(chunk), "%lu,", (unsigned long) i);
+    crc = mg_crc32(crc, chunk, k);
+    n += mg_snprintf(data + n, sizeof(data) - n, "%lx\r\n%s\r\n",
+                     (unsigned long) k, chunk);
+  }
+  mg_snprintf(expected, sizeof(expected), "%lx", (unsigned long) crc);
+  len = strlen(expected);
+  buf[0] = '\0';
+  c = mg_connect(&mgr, url, ehcmc, buf);
+  mg_printf(c, "POST /del HTTP/1.1\r\n%s\r\n\r\n%s0\r\n\r\n",
+            "Transfer-Encoding: chunked", data);
+  mg_printf(c, "POST /keep HTTP/1.1\r\n%s\r\n\r\n%s0\r\n\r\n%s",
+            "Transfer-Encoding: chunked", data, "GET /x HTTP/1.1\r\n\r\n");
+  for (i = 0; i < 100 && strstr(buf, "\r\n\r\n0") == NULL; i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  // MG_INFO(("[%s]", buf));
+  ASSERT(strstr(buf, expected) != NULL);
+  ASSERT(strstr(strstr(buf, expected) + len, expected) != NULL);
+  ASSERT(strstr(buf, "\r\n\r\n0") != NULL);  // Empty body CRC for GET /x
+
   mg_mgr_free(&mgr);
   ASSERT(mgr.conns == NULL);
 }
 
-struct stream_status {
-  uint32_t polls;
-  size_t sent;
-  size_t received;
-  uint32_t send_crc;
-  uint32_t recv_crc;
-};
+#define GZIP_TEXT "Repetitive text compresses well. "
 
-// Consume recv buffer after letting it reach MG_MAX_RECV_SIZE
-static void eh8(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
-  struct stream_status *status = (struct stream_status *) fn_data;
-  if (c->is_listening) return;
+static int s_gzip_json;  // Number of strings written by gzip_json()
 
-  ASSERT(c->recv.len <= MG_MAX_RECV_SIZE);
+static bool gzip_json(struct mg_json_writer *w, void *fn_data) {
+  if (w == NULL) return false;
+  if (s_gzip_json == 0) mg_json_begin_array(w);
+  mg_json_str(w, GZIP_TEXT);
+  if (++s_gzip_json < 50) return true;
+  mg_json_end_array(w);
+  s_gzip_json = 0;
+  (void) fn_data;
+  return false;
+}
 
-  if (ev == MG_EV_ACCEPT) {
-    // Optimize recv buffer size near max to speed up test
-    mg_iobuf_resize(&c->recv, MG_MAX_RECV_SIZE - MG_IO_SIZE);
-    status->received = 0;
-    status->recv_crc = 0;
+static void ehgz(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    int i;
+    mg_http_gzip(c, hm, NULL);
+    if (mg_http_match_uri(hm, "/chunked")) {
+      mg_printf(c, "HTTP/1.1 200 OK\r\n%sTransfer-Encoding: chunked\r\n\r\n",
+                c->gzip == NULL ? "" : "Content-Encoding: gzip\r\n");
+      for (i = 0; i < 50; i++) mg_http_printf_chunk(c, "%d %s", i, GZIP_TEXT);
+      mg_http_printf_chunk(c, "");
+    } else if (mg_http_match_uri(hm, "/json")) {
+      mg_http_json_stream(c, 200, "", gzip_json, NULL);
+    } else {
+      mg_http_reply(c, 200, "", "%s%s%s%s", GZIP_TEXT, GZIP_TEXT, GZIP_TEXT,
+                    GZIP_TEXT);
+    }
   }
+  (void) fn_data;
+}
 
-  if (ev == MG_EV_CLOSE) {
-    ASSERT(status->received == status->sent);
-  }
+struct gzip_result {
+  const char *req;
+  char enc[20];
+  char body[4096];
+  size_t len;
+  bool done;
+};
 
-  // Let buffer fill up and start consuming after 10 full buffer poll events
-  if (status->polls >= 10 && ev == MG_EV_POLL) {
-    // consume at most a third of MG_MAX_RECV_SIZE on each poll
-    size_t consume;
-    if (MG_MAX_RECV_SIZE / 3 >= c->recv.len)
-      consume = c->recv.len;
-    else
-      consume = MG_MAX_RECV_SIZE / 3;
-    status->received += consume;
-    status->recv_crc =
-        mg_crc32(status->recv_crc, (const char *) c->recv.buf, consume);
-    mg_iobuf_del(&c->recv, 0, consume);
+// Save binary body, fetch() can't be used since it stops at the first NUL
+static void ehgzc(struct mg_connection *c, int ev, void *ev_data,
+                  void *fn_data) {
+  struct gzip_result *r = (struct gzip_result *) fn_data;
+  if (ev == MG_EV_CONNECT) {
+    mg_printf(c, "%s", r->req);
+  } else if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_str *enc = mg_http_get_header(hm, "Content-Encoding");
+    if (enc != NULL) {
+      mg_snprintf(r->enc, sizeof(r->enc), "%.*s", enc->len, enc->ptr);
+    }
+    r->len = hm->body.len < sizeof(r->body) ? hm->body.len : sizeof(r->body);
+    memcpy(r->body, hm->body.ptr, r->len);
+    r->done = true;
+    c->is_closing = 1;
   }
-
-  // count polls with full buffer to ensure c->is_full prevents reads
-  if (ev == MG_EV_POLL && c->recv.len == MG_MAX_RECV_SIZE) status->polls += 1;
-  (void) ev_data;
 }
 
-// Toggle c->is_full to prevent max_recv_buf_size reached read errors
-static void eh10(struct mg_connection *c, int ev, void *ev_data,
-                 void *fn_data) {
-  if (c->recv.len >= MG_MAX_RECV_SIZE && ev == MG_EV_READ) c->is_full = true;
+static void gzip_fetch(struct mg_mgr *mgr, struct gzip_result *r,
+                       const char *req) {
+  const char *url = "http://127.0.0.1:12344";
+  int i;
+  memset(r, 0, sizeof(*r));
+  r->req = req;
+  mg_http_connect(mgr, url, ehgzc, r);
+  for (i = 0; i < 50 && !r->done; i++) mg_mgr_poll(mgr, 1);
+  ASSERT(r->done);
+}
 
-  eh8(c, ev, ev_data, fn_data);
+// Check gzip framing: magic, trailer CRC32 and size of original data, and
+// that the payload inflates back to the original data
+static bool gzip_check(struct gzip_result *r, const char *data) {
+  const uint8_t *t = (uint8_t *) &r->body[r->len < 8 ? 0 : r->len - 8];
+  uint32_t crc = mg_crc32(0, data, strlen(data));
+  uint32_t crc2 = t[0] | (uint32_t) t[1] << 8 | (uint32_t) t[2] << 16 |
+                  (uint32_t) t[3] << 24;
+  uint32_t size = t[4] | (uint32_t) t[5] << 8 | (uint32_t) t[6] << 16 |
+                  (uint32_t) t[7] << 24;
+  struct mg_iobuf io = {0, 0, 0};
+  struct mg_inflate inf;
+  bool ok = r->len > 18 && r->len < strlen(data) &&
+            (uint8_t) r->body[0] == 0x1f && (uint8_t) r->body[1] == 0x8b &&
+            crc == crc2 && size == strlen(data) && mg_inflate_init(&inf, 0);
+  if (ok) {
+    long n = mg_inflate(&inf, r->body + 10, r->len - 18, &io, sizeof(r->body));
+    ok = n == (long) strlen(data) && memcmp(io.buf, data, io.len) == 0;
+    mg_inflate_free(&inf);
+  }
+  mg_iobuf_free(&io);
+  return ok;
+}
 
-  if (c->recv.len < MG_MAX_RECV_SIZE && ev == MG_EV_POLL) c->is_full = false;
+// Uncompressed data between compressed chunks is refused
+static void test_http_gzip_mixed(void) {
+  const char *req = "GET / HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n";
+  struct mg_http_message hm;
+  struct mg_connection c;
+  memset(&c, 0, sizeof(c));
+  ASSERT(mg_http_parse(req, strlen(req), &hm) == (int) strlen(req));
+  ASSERT(mg_http_gzip(&c, &hm, NULL) == true);
+  ASSERT(c.pfree != NULL);
+  mg_http_write_chunk(&c, GZIP_TEXT, strlen(GZIP_TEXT));
+  mg_http_write_chunk(&c, GZIP_TEXT, strlen(GZIP_TEXT));
+  ASSERT(c.is_closing == 0 && c.gzip != NULL);
+  mg_printf(&c, "raw");
+  mg_http_write_chunk(&c, GZIP_TEXT, strlen(GZIP_TEXT));
+  ASSERT(c.is_closing == 1 && c.gzip == NULL);
+  c.pfree(&c);
+  mg_iobuf_free(&c.send);
 }
 
-// Send buffer larger than MG_MAX_RECV_SIZE to server
-static void eh11(struct mg_connection *c, int ev, void *ev_data,
-                 void *fn_data) {
-  struct stream_status *status = (struct stream_status *) fn_data;
-  if (ev == MG_EV_CONNECT) {
-    size_t len = MG_MAX_RECV_SIZE * 2;
-    struct mg_iobuf buf = {NULL, 0, 0};
-    mg_iobuf_init(&buf, len);
-    mg_random(buf.buf, buf.size);
-    buf.len = buf.size;
-    mg_send(c, buf.buf, buf.len);
-    status->sent = buf.len;
-    status->send_crc = mg_crc32(0, (const char *) buf.buf, buf.len);
-    mg_iobuf_free(&buf);
+// Responses without a body are not compressed, HEAD gets no compressor
+static void test_http_gzip_nobody(void) {
+  const char *req = "GET / HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n";
+  const char *head = "HEAD / HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n";
+  static const int codes[] = {204, 304, 101, 200};
+  struct mg_http_message hm;
+  struct mg_connection c;
+  size_t i;
+  memset(&c, 0, sizeof(c));
+  ASSERT(mg_http_parse(req, strlen(req), &hm) == (int) strlen(req));
+  for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+    ASSERT(mg_http_gzip(&c, &hm, NULL) == true);
+    mg_http_reply(&c, codes[i], "", "%s", codes[i] == 200 ? "" : "x");
+    ASSERT(c.gzip == NULL);
+    ASSERT(mg_strstr(mg_str_n((char *) c.send.buf, c.send.len),
+                     mg_str("Content-Encoding")) == NULL);
+    c.send.len = 0;
   }
-  (void) ev_data;
-  (void) fn_data;
+  ASSERT(mg_http_parse(head, strlen(head), &hm) == (int) strlen(head));
+  ASSERT(mg_http_gzip(&c, &hm, NULL) == false);
+  mg_iobuf_free(&c.send);
 }
 
-static void test_http_stream_buffer(void) {
+static void test_http_gzip(void) {
   struct mg_mgr mgr;
-  const char *url = "tcp://127.0.0.1:12344";
-  uint32_t i;
-  struct stream_status status;
+  struct gzip_result r;
+  char data[4096];
+  size_t i, n = 0;
   mg_mgr_init(&mgr);
-  mg_listen(&mgr, url, eh10, &status);
+  mg_http_listen(&mgr, "http://127.0.0.1:12344", ehgz, NULL);
 
-  status.polls = 0;
-  mg_connect(&mgr, url, eh11, &status);
-  for (i = 0; i < (MG_MAX_RECV_SIZE / MG_IO_SIZE) * 50; i++) {
-    mg_mgr_poll(&mgr, 1);
-    if (status.polls >= 10 && status.sent == status.received) break;
+  gzip_fetch(&mgr, &r, "GET / HTTP/1.0\n\n");
+  ASSERT(r.enc[0] == '\0');
+  ASSERT(r.len == 4 * strlen(GZIP_TEXT));
+
+  gzip_fetch(&mgr, &r, "GET / HTTP/1.0\nAccept-Encoding: br;q=1, gzip;q=0\n\n");
+  ASSERT(r.enc[0] == '\0');
+
+  gzip_fetch(&mgr, &r, "GET / HTTP/1.0\nAccept-Encoding: deflate, gzip\n\n");
+  ASSERT(strcmp(r.enc, "gzip") == 0);
+  ASSERT(gzip_check(&r, GZIP_TEXT GZIP_TEXT GZIP_TEXT GZIP_TEXT));
+
+  gzip_fetch(&mgr, &r, "GET /chunked HTTP/1.0\nAccept-Encoding: gzip\n\n");
+  ASSERT(strcmp(r.enc, "gzip") == 0);
+  for (i = 0; i < 50; i++) {
+    n += mg_snprintf(data + n, sizeof(data) - n, "%d %s", (int) i, GZIP_TEXT);
+  }
+  ASSERT(gzip_check(&r, data));
+
+  gzip_fetch(&mgr, &r, "GET /json HTTP/1.0\nAccept-Encoding: gzip\n\n");
+  ASSERT(strcmp(r.enc, "gzip") == 0);
+  {
+    struct mg_iobuf io = {0, 0, 0};
+    struct mg_json_writer w;
+    mg_json_writer_init(&w, mg_write_iobuf, &io);
+    while (gzip_json(&w, NULL)) continue;
+    ASSERT(gzip_check(&r, (char *) io.buf));
+    mg_iobuf_free(&io);
   }
-  ASSERT(status.sent == status.received);
-  ASSERT(status.send_crc == status.recv_crc);
 
   mg_mgr_free(&mgr);
   ASSERT(mgr.conns == NULL);
+  test_http_gzip_mixed();
+  test_http_gzip_nobody();
 }
 
-static void test_multipart(void) {
-  struct mg_http_part part;
-  size_t ofs;
-  const char *s =
-      "--xyz\r\n"
-      "Content-Disposition: form-data; name=\"val\"\r\n"
-      "\r\n"
-      "abc\r\ndef\r\n"
-      "--xyz\r\n"
-      "Content-Disposition: form-data; name=\"foo\"; filename=\"a b.txt\"\r\n"
-      "Content-Type: text/plain\r\n"
-      "\r\n"
-      "hello world\r\n"
-      "\r\n"
-      "--xyz--\r\n";
-  ASSERT(mg_http_next_multipart(mg_str(""), 0, NULL) == 0);
-  ASSERT((ofs = mg_http_next_multipart(mg_str(s), 0, &part)) > 0);
-  ASSERT(mg_strcmp(part.name, mg_str("val")) == 0);
-  // MG_INFO(("--> [%.*s]", (int) part.body.len, part.body.ptr));
-  ASSERT(mg_strcmp(part.body, mg_str("abc\r\ndef")) == 0);
-  ASSERT(part.filename.len == 0);
-  ASSERT((ofs = mg_http_next_multipart(mg_str(s), ofs, &part)) > 0);
-  ASSERT(mg_strcmp(part.name, mg_str("foo")) == 0);
-  // MG_INFO(("--> [%.*s]", (int) part.filename.len, part.filename.ptr));
-  ASSERT(mg_strcmp(part.filename, mg_str("a b.txt")) == 0);
-  ASSERT(mg_strcmp(part.body, mg_str("hello world\r\n")) == 0);
-  ASSERT(mg_http_next_multipart(mg_str(s), ofs, &part) == 0);
-}
+struct pool_req {
+  unsigned long id;  // Connection used for the request
+  int status;        // Response status
+};
 
-static void eh7(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
-  if (ev == MG_EV_HTTP_MSG) {
-    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
-    struct mg_http_serve_opts sopts;
-    memset(&sopts, 0, sizeof(sopts));
-    sopts.root_dir = "/";
-    sopts.fs = &mg_fs_packed;
-    mg_http_serve_dir(c, hm, &sopts);
+static void ehpool(struct mg_connection *c, int ev, void *ev_data,
+                   void *fn_data) {
+  struct pool_req *r = (struct pool_req *) fn_data;
+  if (ev == MG_EV_CONNECT) {
+    mg_printf(c, "GET /foo/bar HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    r->id = c->id;
+  } else if (ev == MG_EV_HTTP_MSG) {
+    r->status = mg_http_status((struct mg_http_message *) ev_data);
   }
-  (void) fn_data;
 }
 
-static void test_packed(void) {
+static size_t pool_conns(struct mg_mgr *mgr) {
+  struct mg_connection *c;
+  size_t n = 0;
+  for (c = mgr->conns; c != NULL; c = c->next) n += c->is_client ? 1U : 0U;
+  return n;
+}
+
+static void test_http_pool(void) {
   struct mg_mgr mgr;
-  const char *url = "http://127.0.0.1:12351";
-  char buf[FETCH_BUF_SIZE],
-      *data = mg_file_read(&mg_fs_posix, "Makefile", NULL);
+  struct mg_http_pool pool;
+  struct pool_req reqs[5];
+  const char *url = "http://127.0.0.1:12355";
+  size_t i, j, done = 0;
+  memset(reqs, 0, sizeof(reqs));
   mg_mgr_init(&mgr);
-  mg_http_listen(&mgr, url, eh7, NULL);
-
-  // Load top level file directly
-  fetch(&mgr, buf, url, "GET /Makefile HTTP/1.0\n\n");
-  // printf("---> %s\n", buf);
-  ASSERT(fetch(&mgr, buf, url, "GET /Makefile HTTP/1.0\n\n") == 200);
-  ASSERT(cmpbody(buf, data) == 0);
-  free(data);
+  mg_http_listen(&mgr, url, eh1, NULL);
+  mg_http_pool_init(&pool, &mgr, 2, 100);
 
-  // Load file deeper in the FS tree directly
-  data = mg_file_read(&mg_fs_posix, "src/ssi.h", NULL);
-  ASSERT(fetch(&mgr, buf, url, "GET /src/ssi.h HTTP/1.0\n\n") == 200);
-  ASSERT(cmpbody(buf, data) == 0);
-  free(data);
+  // 5 requests, at most 2 connections. Others wait in the queue
+  for (i = 0; i < 5; i++) {
+    ASSERT(mg_http_pool_connect(&pool, url, ehpool, &reqs[i]) == true);
+  }
+  ASSERT(pool_conns(&mgr) == 2);
+  ASSERT(pool.queue != NULL);
+  for (i = 0; i < 100 && done < 5; i++) {
+    mg_mgr_poll(&mgr, 1);
+    ASSERT(pool_conns(&mgr) <= 2);
+    for (done = j = 0; j < 5; j++) done += reqs[j].status == 200 ? 1U : 0U;
+  }
+  ASSERT(done == 5);
+  ASSERT(pool.queue == NULL);
+  for (i = 0; i < 5; i++) {
+    ASSERT(reqs[i].id == reqs[0].id || reqs[i].id == reqs[1].id);
+  }
 
-  // List root dir
-  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
-  // printf("--------\n%s\n", buf);
+  // Idle connection is reused
+  memset(reqs, 0, sizeof(reqs));
+  ASSERT(mg_http_pool_connect(&pool, url, ehpool, &reqs[2]) == true);
+  for (i = 0; i < 50 && reqs[2].status == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(reqs[2].status == 200);
+  ASSERT(pool_conns(&mgr) == 2);
 
-  // List nested dir
-  ASSERT(fetch(&mgr, buf, url, "GET /test HTTP/1.0\n\n") == 301);
-  ASSERT(fetch(&mgr, buf, url, "GET /test/ HTTP/1.0\n\n") == 200);
-  // printf("--------\n%s\n", buf);
+  // Idle connections are closed
+  for (i = 0; i < 100 && pool_conns(&mgr) > 0; i++) mg_mgr_poll(&mgr, 10);
+  ASSERT(pool_conns(&mgr) == 0);
 
+  mg_http_pool_free(&pool);
   mg_mgr_free(&mgr);
   ASSERT(mgr.conns == NULL);
 }
 
-static void eh6(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
-  if (ev == MG_EV_READ) *(int *) fn_data = 1;
+static void ehraw(struct mg_connection *c, int ev, void *ev_data,
+                  void *fn_data) {
+  if (ev == MG_EV_READ) {
+    struct mg_iobuf *io = (struct mg_iobuf *) fn_data;
+    mg_iobuf_add(io, io->len, c->recv.buf, c->recv.len, 256);
+    c->recv.len = 0;
+  }
+  (void) ev_data;
+}
+
+// Upstream for the proxy test, replies with its name. Requests with
+// "Expect: 100-continue" get an interim response first
+static void ehup(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  if ((ev == MG_EV_HTTP_CHUNK || ev == MG_EV_HTTP_MSG) &&
+      mg_http_get_header(hm, "Expect") != NULL && c->label[0] == '\0') {
+    mg_printf(c, "HTTP/1.1 100 Continue\r\nX-Interim: 1\r\n\r\n");
+    c->label[0] = 'c';
+  }
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_str *xff = mg_http_get_header(hm, "X-Forwarded-For");
+    c->label[0] = '\0';
+    if (mg_http_match_uri(hm, "/chunked")) {
+      mg_printf(c, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+      mg_http_printf_chunk(c, "%s", (char *) fn_data);
+      mg_http_printf_chunk(c, "!");
+      mg_http_printf_chunk(c, "");
+    } else if (mg_http_match_uri(hm, "/clte")) {
+      mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n"
+                   "Transfer-Encoding: chunked\r\nConnection: X-Up\r\n"
+                   "X-Up: 1\r\n\r\n");
+      mg_http_printf_chunk(c, "%s", (char *) fn_data);
+      mg_http_printf_chunk(c, "");
+    } else if (mg_http_match_uri(hm, "/hdr")) {
+      // Which of Content-Length, Transfer-Encoding and X-Hop came through
+      mg_http_reply(c, 200, "", "%.*s:%d%d%d", (int) hm->body.len,
+                    hm->body.ptr,
+                    mg_http_get_header(hm, "Content-Length") != NULL,
+                    mg_http_get_header(hm, "Transfer-Encoding") != NULL,
+                    mg_http_get_header(hm, "X-Hop") != NULL);
+    } else {
+      mg_http_reply(c, 200, "", "%s:%.*s:%.*s", (char *) fn_data,
+                    (int) hm->body.len, hm->body.ptr, xff ? (int) xff->len : 0,
+                    xff ? xff->ptr : "");
+    }
+  }
+}
+
+static void ehproxy(struct mg_connection *c, int ev, void *ev_data,
+                    void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG || ev == MG_EV_HTTP_CHUNK) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    ASSERT(mg_proxy_forward((struct mg_proxy *) fn_data, c, ev, hm));
+  }
+}
+
+static void test_http_proxy(void) {
+  struct mg_mgr mgr;
+  struct mg_proxy proxy, proxy2;
+  struct mg_proxy_upstream ups[2], dead[1];
+  const char *url = "http://127.0.0.1:12358", *url2 = "http://127.0.0.1:12359";
+  char buf[FETCH_BUF_SIZE], first[10];
+  struct mg_iobuf io = {0, 0, 0};
+  struct mg_connection *c;
+  const char *p100, *p200;
+  int i;
+  memset(ups, 0, sizeof(ups));
+  memset(dead, 0, sizeof(dead));
+  ups[0].url = "http://127.0.0.1:12356";
+  ups[1].url = "http://127.0.0.1:12357";
+  dead[0].url = "http://127.0.0.1:12360";
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, ups[0].url, ehup, (void *) "a");
+  mg_http_listen(&mgr, ups[1].url, ehup, (void *) "b");
+  mg_proxy_init(&proxy, &mgr, ups, 2, MG_PROXY_ROUND_ROBIN);
+  mg_http_listen(&mgr, url, ehproxy, &proxy);
+
+  // Round-robin
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "a::127.0.0.1") == 0);
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "b::127.0.0.1") == 0);
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, "a::127.0.0.1") == 0);
+  ASSERT(ups[0].active == 0 && ups[1].active == 0);
+
+  // Request bodies, plain and chunked
+  ASSERT(fetch(&mgr, buf, url,
+               "POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello") == 200);
+  ASSERT(cmpbody(buf, "b:hello:127.0.0.1") == 0);
+  ASSERT(fetch(&mgr, buf, url,
+               "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+               "2\r\nhe\r\n3\r\nllo\r\n0\r\n\r\n") == 200);
+  ASSERT(cmpbody(buf, "a:hello:127.0.0.1") == 0);
+
+  // Content-Length is dropped when the body is chunked, and so are headers
+  // named in Connection, both ways
+  ASSERT(fetch(&mgr, buf, url,
+               "POST /hdr HTTP/1.1\r\nContent-Length: 5\r\n"
+               "Transfer-Encoding: chunked\r\nConnection: X-Hop\r\n"
+               "X-Hop: 1\r\n\r\n2\r\nhe\r\n3\r\nllo\r\n0\r\n\r\n") == 200);
+  ASSERT(cmpbody(buf, "hello:010") == 0);
+  ASSERT(fetch(&mgr, buf, url, "GET /clte HTTP/1.1\r\n\r\n") == 200);
+  ASSERT(cmpheader(buf, "Transfer-Encoding", "chunked"));
+  ASSERT(strstr(buf, "Content-Length") == NULL);
+  ASSERT(strstr(buf, "X-Up") == NULL);
+
+  // Chunked response is relayed to HTTP/1.1 and HTTP/1.0 clients
+  ASSERT(fetch(&mgr, buf, url, "GET /chunked HTTP/1.1\r\n\r\n") == 200);
+  ASSERT(cmpheader(buf, "Transfer-Encoding", "chunked"));
+  ASSERT(strstr(buf, "b!") != NULL);
+  ASSERT(fetch(&mgr, buf, url, "GET /chunked HTTP/1.0\r\n\r\n") == 200);
+  ASSERT(strstr(buf, "Transfer-Encoding") == NULL);
+  ASSERT(strstr(buf, "\r\n\r\na!") != NULL);
+
+  // Interim 100 Continue is relayed before the body is sent, then the final
+  // response follows
+  c = mg_connect(&mgr, url, ehraw, &io);
+  mg_printf(c, "POST / HTTP/1.1\r\nExpect: 100-continue\r\n"
+               "Content-Length: 5\r\n\r\n");
+  for (i = 0; i < 100 && io.len == 0; i++) mg_mgr_poll(&mgr, 1);
+  p100 = mg_strstr(mg_str_n((char *) io.buf, io.len), mg_str("100 Continue"));
+  ASSERT(p100 != NULL);
+  ASSERT(mg_strstr(mg_str_n((char *) io.buf, io.len), mg_str("X-Interim: 1")));
+  mg_send(c, "hello", 5);
+  for (i = 0; i < 100; i++) {
+    mg_mgr_poll(&mgr, 1);
+    if (mg_strstr(mg_str_n((char *) io.buf, io.len), mg_str(":hello:"))) break;
+  }
+  p100 = mg_strstr(mg_str_n((char *) io.buf, io.len), mg_str("100 Continue"));
+  p200 = mg_strstr(mg_str_n((char *) io.buf, io.len), mg_str("HTTP/1.1 200"));
+  ASSERT(p100 != NULL && p200 != NULL && p100 < p200);
+  ASSERT(mg_strstr(mg_str_n((char *) io.buf, io.len), mg_str(":hello:")));
+  c->is_closing = 1;
+  mg_iobuf_free(&io);
+  // HTTP/1.0 clients get the final response only
+  ASSERT(fetch(&mgr, buf, url,
+               "POST / HTTP/1.0\r\nExpect: 100-continue\r\n"
+               "Content-Length: 5\r\n\r\nhello") == 200);
+  ASSERT(strstr(buf, "100 Continue") == NULL);
+  ASSERT(strstr(buf, ":hello:") != NULL);
+  ASSERT(ups[0].active == 0 && ups[1].active == 0);
+
+  // Hashing keeps a client on the same upstream
+  proxy.balance = MG_PROXY_HASH;
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  mg_snprintf(first, sizeof(first), "%.1s", strstr(buf, "\r\n\r\n") + 4);
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  ASSERT(strstr(buf, "\r\n\r\n")[4] == first[0]);
+
+  // Failed upstream gets 502 and is marked down
+  mg_proxy_init(&proxy2, &mgr, dead, 1, MG_PROXY_LEAST_CONN);
+  proxy2.max_fails = 1;
+  mg_http_listen(&mgr, url2, ehproxy, &proxy2);
+  ASSERT(fetch(&mgr, buf, url2, "GET / HTTP/1.0\n\n") == 502);
+  ASSERT(dead[0].fails == 1);
+  ASSERT(dead[0].down_until > mg_millis());
+  ASSERT(dead[0].active == 0);
+  ASSERT(proxy.sessions == NULL && proxy2.sessions == NULL);
+
+  mg_proxy_free(&proxy);
+  mg_proxy_free(&proxy2);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+struct bridge_test {
+  size_t received;
+  uint32_t send_crc, recv_crc;
+  bool closed;
+};
+
+static void ehecho(struct mg_connection *c, int ev, void *ev_data,
+                   void *fn_data) {
+  if (ev == MG_EV_READ) {
+    mg_send(c, c->recv.buf, c->recv.len);
+    c->recv.len = 0;
+  }
+  (void) ev_data, (void) fn_data;
+}
+
+// Bridge accepted connection to the echo server
+static void ehbridge(struct mg_connection *c, int ev, void *ev_data,
+                     void *fn_data) {
+  if (ev == MG_EV_ACCEPT) {
+    struct mg_connection *u = mg_connect(c->mgr, (char *) fn_data, NULL, NULL);
+    ASSERT(u != NULL);
+    ASSERT(mg_bridge(c, u, 0));
+  }
+  (void) ev_data;
+}
+
+static void ehbclient(struct mg_connection *c, int ev, void *ev_data,
+                      void *fn_data) {
+  struct bridge_test *bt = (struct bridge_test *) fn_data;
+  if (ev == MG_EV_READ) {
+    bt->recv_crc = mg_crc32(bt->recv_crc, (char *) c->recv.buf, c->recv.len);
+    bt->received += c->recv.len;
+    c->recv.len = 0;
+  } else if (ev == MG_EV_CLOSE) {
+    bt->closed = true;
+  }
+  (void) ev_data;
+}
+
+static size_t count_conns(struct mg_mgr *mgr) {
+  struct mg_connection *c;
+  size_t n = 0;
+  for (c = mgr->conns; c != NULL; c = c->next) n++;
+  return n;
+}
+
+static void test_bridge(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  struct bridge_test bt;
+  const char *echo = "tcp://127.0.0.1:12361", *url = "tcp://127.0.0.1:12362";
+  char data[1000];
+  size_t i;
+  mg_mgr_init(&mgr);
+  mg_listen(&mgr, echo, ehecho, NULL);
+  mg_listen(&mgr, url, ehbridge, (void *) echo);
+
+  // Data goes through the bridge to the echo server and back
+  memset(&bt, 0, sizeof(bt));
+  c = mg_connect(&mgr, url, ehbclient, &bt);
+  ASSERT(c != NULL);
+  for (i = 0; i < 300; i++) {
+    mg_random(data, sizeof(data));
+    mg_send(c, data, sizeof(data));
+    bt.send_crc = mg_crc32(bt.send_crc, data, sizeof(data));
+  }
+  for (i = 0; i < 1000 && bt.received < 300 * sizeof(data); i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(bt.received == 300 * sizeof(data));
+  ASSERT(bt.recv_crc == bt.send_crc);
+#if MG_ENABLE_SPLICE
+  {
+    struct mg_connection *x;
+    for (i = 0, x = mgr.conns; x != NULL; x = x->next) {
+      if (x->is_bridged) {
+        ASSERT(((struct mg_bridge *) x->pfn_data)->pipe[0] >= 0);
+        i++;
+      }
+    }
+    ASSERT(i == 2);
+  }
+#endif
+
+  // Closing one side closes the other
+  c->is_closing = 1;
+  for (i = 0; i < 100 && count_conns(&mgr) > 2; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(count_conns(&mgr) == 2);
+
+#if MG_ARCH == MG_ARCH_UNIX
+  // Half-close: client's EOF is relayed, response still comes back
+  memset(&bt, 0, sizeof(bt));
+  c = mg_connect(&mgr, url, ehbclient, &bt);
+  ASSERT(c != NULL);
+  mg_send(c, "hello", 5);
+  for (i = 0; i < 100 && (c->is_connecting || c->send.len > 0); i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  shutdown((int) (size_t) c->fd, SHUT_WR);
+  for (i = 0; i < 100 && !bt.closed; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(bt.closed);
+  ASSERT(bt.received == 5);
+  ASSERT(count_conns(&mgr) == 2);
+#endif
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+static struct mg_connection *s_deferred_conn;
+static unsigned long s_deferred_id;
+
+static void ehpipeline(struct mg_connection *c, int ev, void *ev_data,
+                       void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    if (mg_http_match_uri(hm, "/slow")) {
+      s_deferred_conn = c;
+      s_deferred_id = mg_http_defer(c);
+    } else if (mg_http_match_uri(hm, "/file")) {
+      struct mg_http_serve_opts opts;
+      memset(&opts, 0, sizeof(opts));
+      mg_http_serve_file(c, hm, "./test/data/range.txt", &opts);
+    } else if (mg_http_match_uri(hm, "/big")) {
+      struct mg_http_serve_opts opts;
+      memset(&opts, 0, sizeof(opts));
+      mg_http_serve_file(c, hm, "./test/data/ca.pem", &opts);
+    } else {
+      mg_http_reply(c, 200, "", "%.*s", (int) hm->uri.len, hm->uri.ptr);
+    }
+  }
+  (void) fn_data;
+}
+
+static void test_http_defer(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  struct mg_iobuf io = {0, 0, 0};
+  const char *url = "http://127.0.0.1:12363";
+  char *a, *b, *f, *s, *g, *e;
+  size_t i, len;
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ehpipeline, NULL);
+  c = mg_connect(&mgr, "tcp://127.0.0.1:12363", ehraw, &io);
+  ASSERT(c != NULL);
+  mg_printf(c, "GET /a HTTP/1.1\r\n\r\nGET /slow HTTP/1.1\r\n\r\n"
+               "GET /b HTTP/1.1\r\n\r\nGET /file HTTP/1.1\r\n\r\n"
+               "GET /big HTTP/1.1\r\n\r\nGET /e HTTP/1.1\r\n\r\n");
+
+  // Responses after the deferred one are held, streamed ones are parked
+  for (i = 0; i < 50; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(s_deferred_id != 0);
+  ASSERT(io.len > 0 && io.len < 1000);
+  ASSERT(strstr((char *) io.buf, "/a") != NULL);
+  ASSERT(strstr((char *) io.buf, "/b") == NULL);
+  len = io.len;
+
+  // Deferred response unblocks the queue, the order is kept
+  mg_http_respond(s_deferred_conn, s_deferred_id, 200, "", "slow");
+  for (i = 0; i < 500 && strstr((char *) io.buf, "\r\n\r\n/e") == NULL;
+       i++) {
+    mg_mgr_poll(&mgr, 1);
+    mg_iobuf_add(&io, io.len, "", 1, 256), io.len--;
+  }
+  ASSERT(io.len > len + 30379);
+  a = strstr((char *) io.buf, "\r\n\r\n/a");
+  s = strstr((char *) io.buf, "\r\n\r\nslow");
+  b = strstr((char *) io.buf, "\r\n\r\n/b");
+  f = strstr((char *) io.buf, "\r\n\r\nFaith of consciousness");
+  g = strstr((char *) io.buf, "\r\n\r\nIssuer: C = US");
+  e = strstr((char *) io.buf, "\r\n\r\n/e");
+  ASSERT(a != NULL && s != NULL && b != NULL && f != NULL);
+  ASSERT(g != NULL && e != NULL);
+  ASSERT(a < s && s < b && b < f && f < g && g + 30379 < e);
+  ASSERT(strstr(g, "END CERTIFICATE-----\n\nHTTP/1.1 200") != NULL);
+
+  // Parked responses are freed with the connection
+  io.len = 0, s_deferred_id = 0;
+  c = mg_connect(&mgr, "tcp://127.0.0.1:12363", ehraw, &io);
+  mg_printf(c, "GET /slow HTTP/1.1\r\n\r\nGET /big HTTP/1.1\r\n\r\n"
+               "GET /file HTTP/1.1\r\n\r\n");
+  for (i = 0; i < 50 && s_deferred_id == 0; i++) mg_mgr_poll(&mgr, 1);
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(s_deferred_id != 0 && io.len == 0);
+
+  mg_iobuf_free(&io);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+// Write an array of 3000 objects, one per call
+static bool json_ids(struct mg_json_writer *w, void *fn_data) {
+  int *i = (int *) fn_data;
+  if (w == NULL) {
+    *i = -1;  // Response is not complete
+    return false;
+  }
+  if (*i == 0) mg_json_begin_array(w);
+  mg_json_begin_object(w);
+  mg_json_key(w, "id");
+  mg_json_int(w, *i);
+  mg_json_end_object(w);
+  if (++*i < 3000) return true;
+  mg_json_end_array(w);
+  return false;
+}
+
+#if MG_ENABLE_HTTP2
+static void ehh2(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_str *host = mg_http_get_header(hm, "Host");
+    struct mg_str *cc = mg_http_get_header(hm, "Cache-Control");
+    if (mg_http_match_uri(hm, "/file")) {
+      struct mg_http_serve_opts opts;
+      memset(&opts, 0, sizeof(opts));
+      mg_http_serve_file(c, hm, "./test/data/range.txt", &opts);
+    } else if (mg_http_match_uri(hm, "/big")) {
+      struct mg_http_serve_opts opts;
+      memset(&opts, 0, sizeof(opts));
+      mg_http_serve_file(c, hm, "./test/data/ca.pem", &opts);
+    } else if (mg_http_match_uri(hm, "/json")) {
+      static int s_ids;
+      s_ids = 0;
+      mg_http_json_stream(c, 200, "", json_ids, &s_ids);
+    } else {
+      mg_http_reply(c, 200, "", "%.*s %.*s %.*s %.*s", (int) hm->proto.len,
+                    hm->proto.ptr, (int) host->len, host->ptr,
+                    (int) hm->uri.len, hm->uri.ptr, cc ? (int) cc->len : 0,
+                    cc ? cc->ptr : "");
+    }
+  }
+  (void) fn_data;
+}
+
+// Parse frames received from the server. Collect DATA payloads per stream,
+// count frames by type, and remember the first byte of the last header block
+struct h2res {
+  char data[8][400];
+  size_t len[8];
+  int frames[10], end[8];
+  unsigned char status;
+};
+
+static void h2parse(struct mg_iobuf *io, struct h2res *r) {
+  size_t ofs = 0;
+  while (io->len - ofs >= 9) {
+    unsigned char *p = io->buf + ofs;
+    size_t len = (size_t) p[0] << 16 | (size_t) p[1] << 8 | p[2];
+    unsigned id = p[8], k = id / 2;
+    if (io->len - ofs < 9 + len) break;
+    if (p[3] < 10) r->frames[p[3]]++;
+    if (p[3] == 0 && k < 8) {
+      if (r->len[k] + len < sizeof(r->data[k])) {
+        strncat(r->data[k], (char *) p + 9, len);
+      }
+      r->len[k] += len;
+      if (p[4] & 1) r->end[k]++;
+    }
+    if (p[3] == 1) r->status = p[9];
+    ofs += 9 + len;
+  }
+  mg_iobuf_del(io, 0, ofs);
+}
+
+static void test_http2(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  struct mg_iobuf io = {0, 0, 0}, ref = {0, 0, 0};
+  struct h2res r;
+  const char *url = "http://127.0.0.1:12364";
+  // SETTINGS_INITIAL_WINDOW_SIZE = 10
+  static const char settings[] = "\x00\x00\x06\x04\x00\x00\x00\x00\x00"
+                                 "\x00\x04\x00\x00\x00\x0a";
+  // RFC7541 C.4.1 and C.4.2, the second block refers to the dynamic table
+  static const char req1[] = "\x00\x00\x11\x01\x05\x00\x00\x00\x01"
+                             "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a"
+                             "\x6b\xa0\xab\x90\xf4\xff";
+  static const char req2[] = "\x00\x00\x0c\x01\x05\x00\x00\x00\x03"
+                             "\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c"
+                             "\xbf";
+  // :path /file, with :authority from the dynamic table
+  static const char req3[] = "\x00\x00\x0a\x01\x05\x00\x00\x00\x05"
+                             "\x82\x86\xbf\x04\x05/file";
+  static const char wu[] = "\x00\x00\x04\x08\x00\x00\x00\x00\x01"
+                           "\x00\x01\x00\x00"
+                           "\x00\x00\x04\x08\x00\x00\x00\x00\x03"
+                           "\x00\x01\x00\x00"
+                           "\x00\x00\x04\x08\x00\x00\x00\x00\x05"
+                           "\x00\x01\x00\x00";
+  static const char ping[] = "\x00\x00\x08\x06\x00\x00\x00\x00\x00"
+                             "12345678";
+  // :path /big on stream 7, and a window for it
+  static const char req4[] = "\x00\x00\x09\x01\x05\x00\x00\x00\x07"
+                             "\x82\x86\xbf\x04\x04/big";
+  static const char wu4[] = "\x00\x00\x04\x08\x00\x00\x00\x00\x07"
+                            "\x00\x01\x00\x00";
+  // POST / on stream 9, the body follows in DATA frames
+  static const char req5[] = "\x00\x00\x04\x01\x04\x00\x00\x00\x09"
+                             "\x83\x86\x84\xbf";
+  // :path /json on stream 13, windows for it and for the connection
+  static const char req6[] = "\x00\x00\x0a\x01\x05\x00\x00\x00\x0d"
+                             "\x82\x86\xbf\x04\x05/json"
+                             "\x00\x00\x04\x08\x00\x00\x00\x00\x0d"
+                             "\x00\x01\x00\x00"
+                             "\x00\x00\x04\x08\x00\x00\x00\x00\x00"
+                             "\x00\x01\x00\x00";
+  unsigned char *data = (unsigned char *) calloc(1, 9 + 16384);
+  struct mg_json_writer w;
+  int i, j;
+
+  memset(&r, 0, sizeof(r));
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ehh2, NULL);
+  c = mg_connect(&mgr, url, ehraw, &io);
+  ASSERT(c != NULL);
+  mg_send(c, "PRI * HTTP/2.0\r\n\r\nSM", 20);  // Partial preface
+  for (i = 0; i < 10; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(io.len == 0);
+  mg_send(c, "\r\n\r\n", 4);
+  mg_send(c, settings, sizeof(settings) - 1);
+  mg_send(c, req1, sizeof(req1) - 1);
+  mg_send(c, req2, sizeof(req2) - 1);
+  mg_send(c, req3, sizeof(req3) - 1);
+  mg_send(c, ping, sizeof(ping) - 1);
+  for (i = 0; i < 20; i++) mg_mgr_poll(&mgr, 1);
+  h2parse(&io, &r);
+  ASSERT(r.frames[4] == 2);  // SETTINGS and SETTINGS ACK
+  ASSERT(r.frames[1] == 3);  // HEADERS
+  ASSERT(r.frames[6] == 1);  // PING ACK
+  ASSERT(r.status == 0x88);  // :status 200, indexed
+  // Flow control: 10 bytes per stream only
+  ASSERT(strcmp(r.data[0], "HTTP/2.0 w") == 0);
+  ASSERT(strcmp(r.data[1], "HTTP/2.0 w") == 0);
+  ASSERT(strcmp(r.data[2], "Faith of c") == 0);
+  ASSERT(r.end[0] == 0 && r.end[1] == 0);
+
+  mg_send(c, wu, sizeof(wu) - 1);
+  for (i = 0; i < 20; i++) mg_mgr_poll(&mgr, 1);
+  h2parse(&io, &r);
+  ASSERT(strcmp(r.data[0], "HTTP/2.0 www.example.com / ") == 0);
+  ASSERT(strcmp(r.data[1], "HTTP/2.0 www.example.com / no-cache") == 0);
+  ASSERT(strncmp(r.data[2], "Faith of consciousness", 22) == 0);
+  ASSERT(r.end[0] == 1 && r.end[1] == 1 && r.end[2] == 1);
+
+  // Static file is read as the window allows, a frame at a time
+  mg_send(c, req4, sizeof(req4) - 1);
+  for (i = 0; i < 20; i++) mg_mgr_poll(&mgr, 1);
+  h2parse(&io, &r);
+  ASSERT(r.len[3] == 10 && r.end[3] == 0);
+  ASSERT(strcmp(r.data[3], "Issuer: C ") == 0);
+  mg_send(c, wu4, sizeof(wu4) - 1);
+  for (i = 0; i < 100 && r.end[3] == 0; i++) {
+    mg_mgr_poll(&mgr, 1);
+    h2parse(&io, &r);
+  }
+  ASSERT(r.len[3] == 30379 && r.end[3] == 1);
+
+  // Received DATA is acknowledged in batches, not frame by frame
+  ASSERT(r.frames[8] == 0);
+  mg_send(c, req5, sizeof(req5) - 1);
+  data[1] = 0x40;  // 16384 bytes, DATA on stream 9
+  data[8] = 9;
+  for (j = 0; j < 3; j++) mg_send(c, data, 9 + 16384);
+  data[1] = 0, data[4] = 1;  // Empty, END_STREAM
+  mg_send(c, data, 9);
+  for (i = 0; i < 50; i++) mg_mgr_poll(&mgr, 1);
+  h2parse(&io, &r);
+  ASSERT(r.frames[8] == 2);  // Connection and stream, after 32K
+  free(data);
+
+  // Generated JSON is sent without the chunked framing
+  mg_send(c, req6, sizeof(req6) - 1);
+  for (i = 0; i < 100 && r.end[6] == 0; i++) {
+    mg_mgr_poll(&mgr, 1);
+    h2parse(&io, &r);
+  }
+  j = 0;
+  mg_json_writer_init(&w, mg_write_iobuf, &ref);
+  while (json_ids(&w, &j)) continue;
+  ASSERT(r.len[6] == ref.len && r.end[6] == 1);
+  mg_iobuf_free(&ref);
+
+  // Malformed fields reset the stream: CRLF in a value, in :path, and an
+  // uppercase name
+  ASSERT(r.frames[3] == 0);
+  mg_send(c, "\x00\x00\x0c\x01\x05\x00\x00\x00\x0f"
+             "\x82\x86\xbf\x84\x00\x01x\x04" "a\r\nb", 21);
+  mg_send(c, "\x00\x00\x09\x01\x05\x00\x00\x00\x11"
+             "\x82\x86\xbf\x04\x04/\r\nx", 18);
+  mg_send(c, "\x00\x00\x09\x01\x05\x00\x00\x00\x13"
+             "\x82\x86\xbf\x84\x00\x01X\x01y", 18);
+  for (i = 0; i < 20; i++) mg_mgr_poll(&mgr, 1);
+  h2parse(&io, &r);
+  ASSERT(r.frames[3] == 3);  // RST_STREAM
+  ASSERT(r.frames[7] == 0);  // Connection is fine
+
+  // Stream 21 gets /big, which is parked when the connection closes
+  mg_send(c, req4, 8);
+  mg_send(c, "\x15", 1);
+  mg_send(c, req4 + 9, sizeof(req4) - 10);
+
+  // Invalid frame: PING on a stream. Server sends GOAWAY and closes
+  mg_send(c, "\x00\x00\x08\x06\x00\x00\x00\x00\x01" "12345678", 17);
+  for (i = 0; i < 20; i++) mg_mgr_poll(&mgr, 1);
+  h2parse(&io, &r);
+  ASSERT(r.frames[7] == 1);
+
+  mg_iobuf_free(&io);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+#endif
+
+static void ehtmpl(struct mg_connection *c, int ev, void *ev_data,
+                   void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_http_tmpl *t = (struct mg_http_tmpl *) fn_data;
+    if (mg_http_match_uri(hm, "/tmpl")) {
+      mg_http_tmpl_send(c, t, "{\"ok\":true}", 11);
+    } else {
+      mg_http_reply(c, 299, "A: B\r\n", "%s", "hi");
+    }
+  }
+}
+
+static void test_http_tmpl(void) {
+  struct mg_mgr mgr;
+  struct mg_http_tmpl t;
+  struct mg_http_message hm;
+  struct mg_str *date;
+  const char *url = "http://127.0.0.1:12365";
+  char buf[FETCH_BUF_SIZE];
+  ASSERT(mg_http_tmpl_init(&t, 201, "Content-Type: application/json\r\n",
+                           true));
+  ASSERT(strncmp(t.buf, "HTTP/1.1 201 Created\r\n", 22) == 0);
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ehtmpl, &t);
+
+  ASSERT(fetch(&mgr, buf, url, "GET /tmpl HTTP/1.0\n\n") == 201);
+  ASSERT(cmpbody(buf, "{\"ok\":true}") == 0);
+  ASSERT(mg_http_parse(buf, strlen(buf), &hm) > 0);
+  ASSERT(mg_strcmp(*mg_http_get_header(&hm, "Content-Type"),
+                   mg_str("application/json")) == 0);
+  ASSERT(mg_strcmp(*mg_http_get_header(&hm, "Content-Length"),
+                   mg_str("11")) == 0);
+  ASSERT((date = mg_http_get_header(&hm, "Date")) != NULL);
+  ASSERT(date->len == 29);
+  ASSERT(date->ptr[3] == ',' && date->ptr[16] == ' ' && date->ptr[19] == ':');
+  ASSERT(mg_strstr(*date, mg_str(" GMT")) == date->ptr + 25);
+
+  ASSERT(fetch(&mgr, buf, url, "GET /reply HTTP/1.0\n\n") == 299);
+  ASSERT(strncmp(buf, "HTTP/1.1 299 OK\r\nA: B\r\nContent-Length: 2\r\n\r\nhi",
+                 46) == 0);
+
+  mg_mgr_free(&mgr);
+  mg_http_tmpl_free(&t);
+  ASSERT(mgr.conns == NULL);
+}
+
+static void test_invalid_listen_addr(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *c;
+  mg_mgr_init(&mgr);
+  c = mg_http_listen(&mgr, "invalid:31:14", eh1, NULL);
+  ASSERT(c == NULL);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+struct stream_status {
+  uint32_t polls;
+  size_t sent;
+  size_t received;
+  uint32_t send_crc;
+  uint32_t recv_crc;
+};
+
+// Consume recv buffer after letting it reach MG_MAX_RECV_SIZE
+static void eh8(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  struct stream_status *status = (struct stream_status *) fn_data;
+  if (c->is_listening) return;
+
+  ASSERT(c->recv.len <= MG_MAX_RECV_SIZE);
+
+  if (ev == MG_EV_ACCEPT) {
+    // Optimize recv buffer size near max to speed up test
+    mg_iobuf_resize(&c->recv, MG_MAX_RECV_SIZE - MG_IO_SIZE);
+    status->received = 0;
+    status->recv_crc = 0;
+  }
+
+  if (ev == MG_EV_CLOSE) {
+    ASSERT(status->received == status->sent);
+  }
+
+  // Let buffer fill up and start consuming after 10 full buffer poll events
+  if (status->polls >= 10 && ev == MG_EV_POLL) {
+    // consume at most a third of MG_MAX_RECV_SIZE on each poll
+    size_t consume;
+    if (MG_MAX_RECV_SIZE / 3 >= c->recv.len)
+      consume = c->recv.len;
+    else
+      consume = MG_MAX_RECV_SIZE / 3;
+    status->received += consume;
+    status->recv_crc =
+        mg_crc32(status->recv_crc, (const char *) c->recv.buf, consume);
+    mg_iobuf_del(&c->recv, 0, consume);
+  }
+
+  // count polls with full buffer to ensure c->is_full prevents reads
+  if (ev == MG_EV_POLL && c->recv.len == MG_MAX_RECV_SIZE) status->polls += 1;
+  (void) ev_data;
+}
+
+// Toggle c->is_full to prevent max_recv_buf_size reached read errors
+static void eh10(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  if (c->recv.len >= MG_MAX_RECV_SIZE && ev == MG_EV_READ) c->is_full = true;
+
+  eh8(c, ev, ev_data, fn_data);
+
+  if (c->recv.len < MG_MAX_RECV_SIZE && ev == MG_EV_POLL) c->is_full = false;
+}
+
+// Send buffer larger than MG_MAX_RECV_SIZE to server
+static void eh11(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct stream_status *status = (struct stream_status *) fn_data;
+  if (ev == MG_EV_CONNECT) {
+    size_t len = MG_MAX_RECV_SIZE * 2;
+    struct mg_iobuf buf = {NULL, 0, 0};
+    mg_iobuf_init(&buf, len);
+    mg_random(buf.buf, buf.size);
+    buf.len = buf.size;
+    mg_send(c, buf.buf, buf.len);
+    status->sent = buf.len;
+    status->send_crc = mg_crc32(0, (const char *) buf.buf, buf.len);
+    mg_iobuf_free(&buf);
+  }
+  (void) ev_data;
+  (void) fn_data;
+}
+
+static void test_http_stream_buffer(void) {
+  struct mg_mgr mgr;
+  const char *url = "tcp://127.0.0.1:12344";
+  uint32_t i;
+  struct stream_status status;
+  mg_mgr_init(&mgr);
+  mg_listen(&mgr, url, eh10, &status);
+
+  status.polls = 0;
+  mg_connect(&mgr, url, eh11, &status);
+  for (i = 0; i < (MG_MAX_RECV_SIZE / MG_IO_SIZE) * 50; i++) {
+    mg_mgr_poll(&mgr, 1);
+    if (status.polls >= 10 && status.sent == status.received) break;
+  }
+  ASSERT(status.sent == status.received);
+  ASSERT(status.send_crc == status.recv_crc);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+static void test_multipart(void) {
+  struct mg_http_part part;
+  size_t ofs;
+  const char *s =
+      "--xyz\r\n"
+      "Content-Disposition: form-data; name=\"val\"\r\n"
+      "\r\n"
+      "abc\r\ndef\r\n"
+      "--xyz\r\n"
+      "Content-Disposition: form-data; name=\"foo\"; filename=\"a b.txt\"\r\n"
+      "Content-Type: text/plain\r\n"
+      "\r\n"
+      "hello world\r\n"
+      "\r\n"
+      "--xyz--\r\n";
+  ASSERT(mg_http_next_multipart(mg_str(""), 0, NULL) == 0);
+  ASSERT((ofs = mg_http_next_multipart(mg_str(s), 0, &part)) > 0);
+  ASSERT(mg_strcmp(part.name, mg_str("val")) == 0);
+  // MG_INFO(("--> [%.*s]", (int) part.body.len, part.body.ptr));
+  ASSERT(mg_strcmp(part.body, mg_str("abc\r\ndef")) == 0);
+  ASSERT(part.filename.len == 0);
+  ASSERT((ofs = mg_http_next_multipart(mg_str(s), ofs, &part)) > 0);
+  ASSERT(mg_strcmp(part.name, mg_str("foo")) == 0);
+  // MG_INFO(("--> [%.*s]", (int) part.filename.len, part.filename.ptr));
+  ASSERT(mg_strcmp(part.filename, mg_str("a b.txt")) == 0);
+  ASSERT(mg_strcmp(part.body, mg_str("hello world\r\n")) == 0);
+  ASSERT(mg_http_next_multipart(mg_str(s), ofs, &part) == 0);
+}
+
+// Log streaming multipart parser events into a string
+static void mpcb(struct mg_http_mp *mp, int ev, struct mg_http_part *part) {
+  char *log = (char *) mp->fn_data;
+  size_t n = strlen(log);
+  if (ev == MG_HTTP_MP_BEGIN) {
+    mg_snprintf(log + n, 512 - n, "<%.*s:%.*s>", (int) part->name.len,
+                part->name.ptr, (int) part->filename.len, part->filename.ptr);
+  } else if (ev == MG_HTTP_MP_DATA) {
+    mg_snprintf(log + n, 512 - n, "%.*s", (int) part->body.len,
+                part->body.ptr);
+  } else if (ev == MG_HTTP_MP_END) {
+    mg_snprintf(log + n, 512 - n, "</>");
+  }
+}
+
+static void test_multipart_stream(void) {
+  struct mg_http_mp mp;
+  struct mg_http_message hm;
+  char log[512];
+  size_t i, j, step;
+  const char *req =
+      "POST / HTTP/1.1\r\n"
+      "Content-Type: multipart/form-data; boundary=\"xyz\"\r\n\r\n";
+  const char *s =
+      "preamble\r\n"
+      "--xyz\r\n"
+      "Content-Disposition: form-data; name=\"val\"\r\n"
+      "\r\n"
+      "abc\r\n--xy\r\n-\r\rdef\r\n"
+      "--xyz  \r\n"
+      "Content-Disposition: form-data; name=\"foo\"; filename=\"a b.txt\"\r\n"
+      "Content-Type: text/plain\r\n"
+      "\r\n"
+      "hello world\r\n"
+      "\r\n"
+      "--xyz--\r\n"
+      "epilogue";
+  const char *expected =
+      "<val:>abc\r\n--xy\r\n-\r\rdef</><foo:a b.txt>hello world\r\n</>";
+
+  ASSERT(mg_http_parse(req, strlen(req), &hm) > 0);
+  for (step = 1; step <= strlen(s); step++) {
+    int res = 0;
+    log[0] = '\0';
+    ASSERT(mg_http_mp_init(&mp, &hm, mpcb, log) == true);
+    for (i = 0; i < strlen(s); i += step) {
+      j = i + step > strlen(s) ? strlen(s) : i + step;
+      res = mg_http_mp_feed(&mp, mg_str_n(s + i, j - i));
+      ASSERT(res >= 0);
+    }
+    ASSERT(res == 1);
+    ASSERT(strcmp(log, expected) == 0);
+  }
+
+  // Malformed: garbage after the delimiter, and too large headers
+  log[0] = '\0';
+  ASSERT(mg_http_mp_init(&mp, &hm, mpcb, log) == true);
+  ASSERT(mg_http_mp_feed(&mp, mg_str("--xyzabc\r\n")) == -1);
+  ASSERT(mg_http_mp_init(&mp, &hm, mpcb, log) == true);
+  ASSERT(mg_http_mp_feed(&mp, mg_str("--xyz\r\n")) == 0);
+  for (i = 0; i < sizeof(mp.hdrs); i++) {
+    if (mg_http_mp_feed(&mp, mg_str("a")) != 0) break;
+  }
+  ASSERT(i < sizeof(mp.hdrs));
+  ASSERT(mg_http_mp_feed(&mp, mg_str("a")) == -1);
+
+  // No boundary
+  req = "POST / HTTP/1.1\r\nContent-Type: multipart/form-data\r\n\r\n";
+  ASSERT(mg_http_parse(req, strlen(req), &hm) > 0);
+  ASSERT(mg_http_mp_init(&mp, &hm, mpcb, log) == false);
+}
+
+// Stream uploaded files to disk as they arrive. Small requests may arrive
+// in full, as MG_EV_HTTP_MSG
+static void ehmp(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct mg_http_mp *mp = (struct mg_http_mp *) fn_data;
+  if (ev == MG_EV_HTTP_CHUNK || ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    int res;
+    if (mp->fn == NULL) {
+      mg_http_mp_init(mp, hm, mg_http_mp_save, NULL);
+      mp->dir = "./test";
+      mp->max_size = mg_http_match_uri(hm, "/nolimit") ? 0 : 100;
+    }
+    res = mg_http_mp_feed(mp, ev == MG_EV_HTTP_MSG ? hm->body : hm->chunk);
+    if (ev == MG_EV_HTTP_CHUNK) mg_http_delete_chunk(c, hm);
+    if (ev == MG_EV_HTTP_MSG || hm->chunk.len == 0) {
+      mg_http_reply(c, res == 1 ? 200 : 400, "", "%d", res);
+      mp->fn = NULL;
+    }
+  }
+}
+
+static void test_multipart_upload(void) {
+  struct mg_mgr mgr;
+  struct mg_http_mp mp;
+  const char *url = "http://127.0.0.1:12352";
+  char buf[FETCH_BUF_SIZE], *p;
+  const char *body =
+      "--123\r\n"
+      "Content-Disposition: form-data; name=\"a\"; filename=\"mp.txt\"\r\n"
+      "\r\n"
+      "hello\r\nworld\r\n"
+      "--123\r\n"
+      "Content-Disposition: form-data; name=\"b\"\r\n"
+      "\r\n"
+      "not a file\r\n"
+      "--123--\r\n";
+  const char *hdrs =
+      "POST /upload HTTP/1.0\n"
+      "Content-Type: multipart/form-data; boundary=123\n";
+
+  memset(&mp, 0, sizeof(mp));
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, ehmp, &mp);
+  ASSERT(fetch(&mgr, buf, url,
+               "%sTransfer-Encoding: chunked\n\n%x\r\n%.*s\r\n%x\r\n%s\r\n"
+               "0\r\n\r\n",
+               hdrs, 50, 50, body, (int) strlen(body) - 50, body + 50) == 200);
+  ASSERT((p = mg_file_read(&mg_fs_posix, "./test/mp.txt", NULL)) != NULL);
+  ASSERT(strcmp(p, "hello\r\nworld") == 0);
+  free(p);
+  remove("./test/mp.txt");
+
+  // Bad filename
+  body =
+      "--123\r\n"
+      "Content-Disposition: form-data; name=\"a\"; filename=\"../mp.txt\"\r\n"
+      "\r\n"
+      "hello\r\n"
+      "--123--\r\n";
+  ASSERT(fetch(&mgr, buf, url, "%sContent-Length: %d\n\n%s", hdrs,
+               (int) strlen(body), body) == 400);
+  ASSERT(mg_file_read(&mg_fs_posix, "./mp.txt", NULL) == NULL);
+
+  // Size limit, 0 means no limit
+  body =
+      "--123\r\n"
+      "Content-Disposition: form-data; name=\"a\"; filename=\"mp.txt\"\r\n"
+      "\r\n"
+      "0123456789012345678901234567890123456789012345678901234567890123456789"
+      "0123456789012345678901234567890123456789012345678901234567890123456789"
+      "\r\n--123--\r\n";
+  ASSERT(fetch(&mgr, buf, url, "%sContent-Length: %d\n\n%s", hdrs,
+               (int) strlen(body), body) == 400);
+  ASSERT(mg_file_read(&mg_fs_posix, "./test/mp.txt", NULL) == NULL);
+  ASSERT(fetch(&mgr, buf, url, "POST /nolimit%sContent-Length: %d\n\n%s",
+               hdrs + 12, (int) strlen(body), body) == 200);
+  ASSERT((p = mg_file_read(&mg_fs_posix, "./test/mp.txt", NULL)) != NULL);
+  ASSERT(strlen(p) == 140);
+  free(p);
+  remove("./test/mp.txt");
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+static void eh7(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_http_serve_opts sopts;
+    memset(&sopts, 0, sizeof(sopts));
+    sopts.root_dir = "/";
+    sopts.fs = &mg_fs_packed;
+    mg_http_serve_dir(c, hm, &sopts);
+  }
+  (void) fn_data;
+}
+
+static void test_packed(void) {
+  struct mg_mgr mgr;
+  const char *url = "http://127.0.0.1:12351";
+  char buf[FETCH_BUF_SIZE],
+      *data = mg_file_read(&mg_fs_posix, "Makefile", NULL);
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, url, eh7, NULL);
+
+  // Load top level file directly
+  fetch(&mgr, buf, url, "GET /Makefile HTTP/1.0\n\n");
+  // printf("---> %s\n", buf);
+  ASSERT(fetch(&mgr, buf, url, "GET /Makefile HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, data) == 0);
+  free(data);
+
+  // Load file deeper in the FS tree directly
+  data = mg_file_read(&mg_fs_posix, "src/ssi.h", NULL);
+  ASSERT(fetch(&mgr, buf, url, "GET /src/ssi.h HTTP/1.0\n\n") == 200);
+  ASSERT(cmpbody(buf, data) == 0);
+  free(data);
+
+  // List root dir
+  ASSERT(fetch(&mgr, buf, url, "GET / HTTP/1.0\n\n") == 200);
+  // printf("--------\n%s\n", buf);
+
+  // List nested dir
+  ASSERT(fetch(&mgr, buf, url, "GET /test HTTP/1.0\n\n") == 301);
+  ASSERT(fetch(&mgr, buf, url, "GET /test/ HTTP/1.0\n\n") == 200);
+  // printf("--------\n%s\n", buf);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+static void eh6(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+  if (ev == MG_EV_READ) *(int *) fn_data = 1;
   (void) c, (void) ev_data;
 }
 
@@ -2269,6 +3736,772 @@ static void test_ws_fragmentation(void) {
   ASSERT(mgr.conns == NULL);
 }
 
+struct wsf {
+  int mode, msgs, code;
+  size_t len;
+  bool ok;
+};
+
+static void wsf_send(struct mg_connection *c, const char *buf, size_t len,
+                     int op, bool fin) {
+  size_t ofs = c->send.len;
+  mg_ws_send(c, buf, len, op);
+  if (!fin) c->send.buf[ofs] &= 0x7f;  // Clear FIN flag
+}
+
+static void wsfs(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct wsf *p = (struct wsf *) fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    mg_ws_upgrade(c, (struct mg_http_message *) ev_data, NULL);
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    size_t i;
+    p->ok = p->msgs++ > 0 || (wm->flags & 15) == WEBSOCKET_OP_BINARY;
+    for (i = 0; i < wm->data.len; i++) {
+      if (wm->data.ptr[i] != (char) ('a' + (i / 300) % 26)) p->ok = false;
+    }
+    p->len += wm->data.len;
+  }
+}
+
+static void wsfc(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct wsf *p = (struct wsf *) fn_data;
+  char buf[300];
+  int i;
+  if (ev == MG_EV_WS_OPEN && p->mode == 0) {
+    // 1000 fragments, with pings in between, then a normal message
+    for (i = 0; i < 1000; i++) {
+      memset(buf, 'a' + i % 26, sizeof(buf));
+      wsf_send(c, buf, sizeof(buf),
+               i == 0 ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_CONTINUE, i == 999);
+      if (i % 100 == 0) mg_ws_send(c, "", 0, WEBSOCKET_OP_PING);
+    }
+    mg_ws_send(c, "a", 1, WEBSOCKET_OP_TEXT);
+  } else if (ev == MG_EV_WS_OPEN && p->mode == 1) {
+    // Too many fragments
+    for (i = 0; i <= MG_WS_MAX_FRAGMENTS; i++) {
+      wsf_send(c, "a", 1, i == 0 ? WEBSOCKET_OP_TEXT : WEBSOCKET_OP_CONTINUE,
+               i == MG_WS_MAX_FRAGMENTS);
+    }
+  } else if (ev == MG_EV_WS_OPEN && p->mode == 2) {
+    wsf_send(c, "a", 1, WEBSOCKET_OP_CONTINUE, true);  // Nothing to continue
+  } else if (ev == MG_EV_WS_CTL) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    if ((wm->flags & 15) == WEBSOCKET_OP_CLOSE && wm->data.len == 2) {
+      p->code = (uint8_t) wm->data.ptr[0] << 8 | (uint8_t) wm->data.ptr[1];
+    }
+  }
+}
+
+static void test_ws_reassembly(void) {
+  const char *url = "ws://127.0.0.1:12367/ws";
+  struct mg_mgr mgr;
+  struct wsf f;
+  int i;
+
+  mg_mgr_init(&mgr);
+  memset(&f, 0, sizeof(f));
+  ASSERT(mg_http_listen(&mgr, url, wsfs, &f) != NULL);
+  mg_ws_connect(&mgr, url, wsfc, &f, NULL);
+  for (i = 0; i < 500 && f.msgs < 2; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(f.msgs == 2);
+  ASSERT(f.len == 300001);
+  ASSERT(f.ok);
+  ASSERT(f.code == 0);
+
+  memset(&f, 0, sizeof(f));
+  f.mode = 1;
+  mg_ws_connect(&mgr, url, wsfc, &f, NULL);
+  for (i = 0; i < 500 && f.code == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(f.code == 1009);
+  ASSERT(f.msgs == 0);
+
+  memset(&f, 0, sizeof(f));
+  f.mode = 2;
+  mg_ws_connect(&mgr, url, wsfc, &f, NULL);
+  for (i = 0; i < 500 && f.code == 0; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(f.code == 1002);
+  ASSERT(f.msgs == 0);
+
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+struct wss {
+  size_t len, max_recv;
+  int msgs, chunks, finals;
+  bool ok;
+};
+
+static void wsss(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct wss *p = (struct wss *) fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    mg_ws_stream(c, true);
+    mg_ws_upgrade(c, (struct mg_http_message *) ev_data, NULL);
+  } else if (ev == MG_EV_WS_CHUNK) {
+    struct mg_ws_chunk *ch = (struct mg_ws_chunk *) ev_data;
+    size_t i;
+    int op = p->finals == 1 ? WEBSOCKET_OP_TEXT : WEBSOCKET_OP_BINARY;
+    if (ch->ofs != p->len) p->ok = false;
+    if (ch->flags != op) p->ok = false;
+    for (i = 0; i < ch->data.len; i++) {
+      if (ch->data.ptr[i] != (char) ((ch->ofs + i) % 251)) p->ok = false;
+    }
+    p->len = ch->final ? 0 : p->len + ch->data.len;
+    p->chunks++;
+    p->finals += ch->final;
+    if (c->recv.size > p->max_recv) p->max_recv = c->recv.size;
+  } else if (ev == MG_EV_WS_MSG) {
+    p->msgs++;
+  }
+}
+
+static void wssc(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  if (ev == MG_EV_WS_OPEN) {
+    size_t i, n = 1024 * 1024;
+    char *buf = (char *) malloc(n);
+    for (i = 0; i < n; i++) buf[i] = (char) (i % 251);
+    mg_ws_send(c, buf, n, WEBSOCKET_OP_BINARY);
+    // Fragmented text message with a ping in between, then an empty one
+    wsf_send(c, buf, 3, WEBSOCKET_OP_TEXT, false);
+    mg_ws_send(c, "", 0, WEBSOCKET_OP_PING);
+    wsf_send(c, buf + 3, 0, WEBSOCKET_OP_CONTINUE, false);
+    wsf_send(c, buf + 3, 7, WEBSOCKET_OP_CONTINUE, true);
+    mg_ws_send(c, "", 0, WEBSOCKET_OP_BINARY);
+    mg_ws_send(c, "x", 1, WEBSOCKET_OP_PING);
+    free(buf);
+  }
+  (void) ev_data, (void) fn_data;
+}
+
+static void test_ws_stream(void) {
+  const char *url = "ws://127.0.0.1:12368/ws";
+  struct mg_mgr mgr;
+  struct wss w;
+  int i;
+
+  mg_mgr_init(&mgr);
+  memset(&w, 0, sizeof(w));
+  w.ok = true;
+  ASSERT(mg_http_listen(&mgr, url, wsss, &w) != NULL);
+  mg_ws_connect(&mgr, url, wssc, NULL, NULL);
+  for (i = 0; i < 5000 && w.finals < 3; i++) mg_mgr_poll(&mgr, 0);
+  ASSERT(w.finals == 3);
+  ASSERT(w.ok);
+  ASSERT(w.msgs == 0);
+  ASSERT(w.chunks > 3);
+  ASSERT(w.max_recv < 1024 * 1024 / 8);  // Not buffered as a whole
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+struct wsk {
+  int opened, pongs, errors, closed;
+  long rtt;
+};
+
+static void wsks(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct wsk *p = (struct wsk *) fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    mg_ws_upgrade(c, (struct mg_http_message *) ev_data, NULL);
+    ASSERT(mg_ws_keepalive(c, 10, 50));
+  } else if (ev == MG_EV_WS_OPEN) {
+    p->opened++;
+  } else if (ev == MG_EV_WS_CTL) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    if ((wm->flags & 15) == WEBSOCKET_OP_PONG) {
+      p->pongs++, p->rtt = mg_ws_rtt(c);
+      ASSERT(mg_ws_keepalive(c, 10, 50));  // Reconfiguring from a handler
+    }
+  } else if (ev == MG_EV_ERROR) {
+    p->errors++;
+  } else if (ev == MG_EV_CLOSE && c->is_websocket) {
+    p->closed++;
+  }
+}
+
+// Completes the handshake, then ignores everything, like a dead peer
+static void wskdead(struct mg_connection *c, int ev, void *ev_data,
+                    void *fn_data) {
+  if (ev == MG_EV_CONNECT) {
+    mg_printf(c, "GET /ws HTTP/1.1\r\nUpgrade: websocket\r\n"
+                 "Connection: Upgrade\r\nSec-WebSocket-Version: 13\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n");
+  } else if (ev == MG_EV_CLOSE) {
+    *(int *) fn_data = 1;
+  }
+  (void) ev_data;
+}
+
+static void test_ws_keepalive(void) {
+  const char *url = "ws://127.0.0.1:12369/ws";
+  struct mg_connection *c;
+  struct mg_mgr mgr;
+  struct wsk k;
+  int i, dead = 0;
+
+  mg_mgr_init(&mgr);
+  memset(&k, 0, sizeof(k));
+  ASSERT(mg_http_listen(&mgr, url, wsks, &k) != NULL);
+  // Live peer answers pings, client side measures RTT too
+  c = mg_ws_connect(&mgr, url, NULL, NULL, NULL);
+  ASSERT(c != NULL && mg_ws_rtt(c) == -1);
+  ASSERT(mg_ws_keepalive(c, 20, 0));
+  for (i = 0; i < 500 && (k.pongs < 3 || mg_ws_rtt(c) < 0); i++) {
+    mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(k.pongs >= 3 && k.rtt >= 0 && k.rtt < 50);
+  ASSERT(mg_ws_rtt(c) >= 0);
+  ASSERT(k.errors == 0 && k.closed == 0);
+  ASSERT(mg_ws_keepalive(c, 0, 0));  // Disable
+  c->is_closing = 1;
+  for (i = 0; i < 100 && k.closed < 1; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(k.closed == 1 && k.errors == 0);
+
+  // Dead peer is closed after the pong timeout
+  mg_connect(&mgr, "tcp://127.0.0.1:12369", wskdead, &dead);
+  for (i = 0; i < 1000 && !dead; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(dead == 1);
+  ASSERT(k.opened == 2 && k.errors == 1 && k.closed == 2);
+  // One manager timer serves all connections, at the shortest interval
+  c = mg_ws_connect(&mgr, url, NULL, NULL, NULL);
+  ASSERT(mg_ws_keepalive(c, 10, 50));
+  for (i = 0; i < 100 && k.opened < 3; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(mgr.timers != NULL && mgr.timers->next == NULL);
+  ASSERT(mgr.timers->period_ms == 10);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+}
+
+struct wsu {
+  int opened, msgs, code;
+};
+
+static void wsus(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct wsu *p = (struct wsu *) fn_data;
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    mg_ws_check_utf8(c, true);
+    if (mg_vcmp(&hm->uri, "/stream") == 0) mg_ws_stream(c, true);
+    mg_ws_upgrade(c, hm, NULL);
+  } else if (ev == MG_EV_WS_MSG) {
+    p->msgs++;
+  } else if (ev == MG_EV_WS_CHUNK && ((struct mg_ws_chunk *) ev_data)->final) {
+    p->msgs++;
+  }
+}
+
+static void wsuc(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct wsu *p = (struct wsu *) fn_data;
+  if (ev == MG_EV_WS_OPEN) {
+    p->opened++;
+  } else if (ev == MG_EV_WS_CTL) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    if ((wm->flags & 15) == WEBSOCKET_OP_CLOSE && wm->data.len == 2) {
+      p->code = (uint8_t) wm->data.ptr[0] << 8 | (uint8_t) wm->data.ptr[1];
+    }
+  }
+  (void) c;
+}
+
+static void test_ws_utf8_close(void) {
+  const char *urls[] = {"ws://127.0.0.1:12370/ws",
+                        "ws://127.0.0.1:12370/stream"};
+  size_t i, j, n = 300000;
+  char *big = (char *) malloc(n);
+  struct mg_connection *c;
+  struct mg_mgr mgr;
+  struct wsu u;
+
+  // Large text, so that streamed slices cut multibyte sequences
+  for (i = 0; i + 5 <= n; i += 5) memcpy(big + i, "\xf0\x9f\x98\x80z", 5);
+  mg_mgr_init(&mgr);
+  ASSERT(mg_http_listen(&mgr, urls[0], wsus, &u) != NULL);
+  for (j = 0; j < 2; j++) {
+    memset(&u, 0, sizeof(u));
+    c = mg_ws_connect(&mgr, urls[j], wsuc, &u, NULL);
+    for (i = 0; i < 100 && u.opened == 0; i++) mg_mgr_poll(&mgr, 1);
+    ASSERT(u.opened == 1);
+    mg_ws_send(c, big, n, WEBSOCKET_OP_TEXT);
+    // Sequence split between fragments is fine
+    wsf_send(c, "\xce\xba\xe1", 3, WEBSOCKET_OP_TEXT, false);
+    wsf_send(c, "\xbd\xb9", 2, WEBSOCKET_OP_CONTINUE, true);
+    mg_ws_send(c, "\xff", 1, WEBSOCKET_OP_BINARY);  // Binary is not checked
+    for (i = 0; i < 1000 && u.msgs < 3; i++) mg_mgr_poll(&mgr, 1);
+    ASSERT(u.msgs == 3);
+    ASSERT(u.code == 0);
+    // Truncated sequence at the end of a message
+    mg_ws_send(c, big, 3, WEBSOCKET_OP_TEXT);
+    for (i = 0; i < 100 && u.code == 0; i++) mg_mgr_poll(&mgr, 1);
+    ASSERT(u.code == 1007);
+    ASSERT(u.msgs == 3);
+  }
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  free(big);
+}
+
+static void test_inflate(void) {
+  // zlib output, a fixed and a dynamic Huffman block. The second message
+  // refers to the first one
+  static const char fixed[] =
+      "\xf2\x48\xcd\xc9\xc9\x57\xc8\x40\x90\x3a\x0a\x05\xa9\x45\xb9\xa9\xc5"
+      "\xc5\x89\xe9\xa9\xba\x29\xa9\x69\x39\x89\x25\xa9\x8a\x0a\x1e\x54\x55"
+      "\xc6\xc0\xc8\xc4\xcc\xc2\xca\xc6\xce\xc1\xc9\xc5\xcd\xc3\xcb\xc7\x2f"
+      "\x20\x28\x24\x2c\x22\x2a\x26\x2e\x21\x29\x25\x2d\x23\x2b\x27\xaf\xa0"
+      "\xa8\xa4\xac\xa2\xaa\xa6\xae\xa1\xa9\xa5\xad\xa3\xab\xa7\x6f\x60\x68"
+      "\x64\x6c\x62\x6a\x66\x6e\x61\x69\x65\x6d\x63\x6b\x67\x0f\x00";
+  static const char dynamic[] =
+      "\x34\x50\x5b\x16\x44\x21\x08\xfa\x77\x15\x6c\x0d\xd4\xfd\x6f\xe1\x82"
+      "\xcd\xd4\x29\xf3\x05\x18\x29\xee\x6c\x93\xcb\x6e\x8e\xe8\x00\x59\x6c"
+      "\x6f\x70\xb6\xe2\x3b\xdc\x95\x8c\xd0\xa0\xb4\xe8\x57\xaf\x12\x07\x24"
+      "\x5a\xeb\x88\x8c\x83\xb4\xbb\x1f\xd2\x28\x96\x08\xda\xfa\x8d\x5e\xb5"
+      "\x9c\xd5\x1c\x07\x2b\x5c\x9c\x00\x1b\x3d\x8e\x02\x3f\xda\xf5\xb3\x0d"
+      "\x17\x4a\x77\xf3\xce\xc0\x2a\x30\xa6\x78\x29\xfe\xda\x8c\x19\xb4\x4b"
+      "\x24\x74\xe2\x84\xe8\x79\x45\x57\xdd\xa5\xf2\x38\x6f\x79\x2c\x59\xa1"
+      "\xc2\xbc\xf1\x6e\xe0\x33\x19\x54\x56\xfb\xff\x8b\x30\xe7\x9a\x0f";
+  struct mg_iobuf io = {0, 0, 0}, z = {0, 0, 0};
+  struct mg_inflate inf;
+  struct mg_deflate def;
+  char data[5000];
+  size_t i, n;
+  int bad = 0;
+
+  ASSERT(mg_inflate_init(&inf, 32768));
+  ASSERT(mg_inflate(&inf, fixed, sizeof(fixed) - 1, &io, 0) == 181);
+  ASSERT(memcmp(io.buf, "Hello hello hello, permessage-deflate! Hello", 44) ==
+         0);
+  ASSERT(io.buf[117] == 0 && io.buf[180] == 63);
+  io.len = 0;
+  ASSERT(mg_inflate(&inf, "\xc2\xb0\x06\x00", 4, &io, 0) == 17);
+  ASSERT(memcmp(io.buf, "Hello hello hello", 17) == 0);
+  io.len = 0;
+  ASSERT(mg_inflate(&inf, dynamic, sizeof(dynamic) - 1, &io, 0) == 300);
+  ASSERT(mg_crc32(0, (char *) io.buf, io.len) == 0x6ba19099);
+  io.len = 0;
+  ASSERT(mg_inflate(&inf, dynamic, sizeof(dynamic) - 1, &io, 299) == -2);
+  ASSERT(io.len == 0);
+  ASSERT(mg_inflate(&inf, dynamic, 20, &io, 0) == -1);
+  ASSERT(mg_inflate(&inf, "\x07", 1, &io, 0) == -1);  // Invalid block type
+  // Stored block, and a reference before the start of data
+  ASSERT(mg_inflate(&inf, "\x01\x03\x00\xfc\xff" "abc", 8, &io, 0) == 3);
+  mg_inflate_free(&inf);
+  ASSERT(mg_inflate_init(&inf, 0));
+  io.len = 0;
+  ASSERT(mg_inflate(&inf, "\xc2\xb0\x06\x00", 4, &io, 0) == -1);
+  mg_inflate_free(&inf);
+
+  // Round trip through our compressor, with and without context takeover
+  for (i = 0; i < sizeof(data); i++) {
+    data[i] = i % 7 == 0 ? (char) ('a' + i * 31 % 26) : " x\n"[i % 3];
+  }
+  for (n = 0; n < 2; n++) {
+    size_t len;
+    ASSERT(mg_deflate_init(&def, 0, 1024));
+    ASSERT(mg_inflate_init(&inf, n == 0 ? 1024 : 0));
+    for (len = 0; len <= sizeof(data); len += 1 + len / 3) {
+      z.len = io.len = 0;
+      mg_deflate(&def, data, len, false, &z);
+      if (mg_inflate(&inf, z.buf, z.len - 4, &io, 0) != (long) len ||
+          (len > 0 && memcmp(io.buf, data, len) != 0)) {
+        bad++;
+      }
+      if (n == 1) mg_deflate_reset(&def);
+    }
+    mg_deflate_free(&def);
+    mg_inflate_free(&inf);
+  }
+  ASSERT(bad == 0);
+  mg_iobuf_free(&io);
+  mg_iobuf_free(&z);
+}
+
+// Negotiate permessage-deflate for a request with the given offer, return
+// Sec-WebSocket-Extensions response header
+static bool wsdf_negotiate(const char *offer, struct mg_ws_deflate_opts *opts,
+                           const char *expected) {
+  struct mg_connection c;
+  struct mg_http_message hm, resp;
+  struct mg_str *h;
+  char req[300];
+  bool ok;
+  memset(&c, 0, sizeof(c));
+  mg_snprintf(req, sizeof(req),
+              "GET / HTTP/1.1\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+              "Sec-WebSocket-Extensions: %s\r\n\r\n",
+              offer);
+  mg_http_parse(req, strlen(req), &hm);
+  ok = mg_ws_deflate(&c, &hm, opts) == (expected != NULL);
+  mg_ws_upgrade(&c, &hm, NULL);
+  mg_http_parse((char *) c.send.buf, c.send.len, &resp);
+  h = mg_http_get_header(&resp, "Sec-WebSocket-Extensions");
+  if (expected == NULL) ok = ok && h == NULL;
+  if (expected != NULL) ok = ok && h != NULL && mg_vcmp(h, expected) == 0;
+  mg_ws_free(&c);
+  mg_iobuf_free(&c.send);
+  return ok;
+}
+
+struct wsdf {
+  size_t sent, echoed;  // Number of messages
+  size_t received;      // Bytes received by the client
+  int code;             // Close code sent by the server
+  bool negotiated;
+  bool closed;
+};
+
+static char *wsdf_msg(size_t i, size_t *len) {
+  static char buf[60000];
+  size_t j, n = i == 0 ? 2 : i == 1 ? sizeof(buf) : 1000 + i * 100;
+  for (j = 0; j < n; j++) {
+    buf[j] = (char) (i == 0 ? 'x' : '0' + (j * j % (i + 7)));
+  }
+  *len = n;
+  return buf;
+}
+
+static void wsdfs(struct mg_connection *c, int ev, void *ev_data,
+                  void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    mg_ws_deflate(c, hm, (struct mg_ws_deflate_opts *) fn_data);
+    mg_ws_upgrade(c, hm, NULL);
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    mg_ws_send(c, wm->data.ptr, wm->data.len, wm->flags & 15);
+  }
+}
+
+static void wsdfc(struct mg_connection *c, int ev, void *ev_data,
+                  void *fn_data) {
+  struct wsdf *p = (struct wsdf *) fn_data;
+  size_t len;
+  if (ev == MG_EV_WS_OPEN) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    p->negotiated = mg_http_get_header(hm, "Sec-WebSocket-Extensions") != NULL;
+    for (p->sent = 0; p->sent < 5; p->sent++) {
+      char *buf = wsdf_msg(p->sent, &len);
+      mg_ws_send(c, buf, len, WEBSOCKET_OP_BINARY);
+    }
+  } else if (ev == MG_EV_READ) {
+    p->received += ((struct mg_str *) ev_data)->len;
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    char *buf = wsdf_msg(p->echoed, &len);
+    if (wm->data.len == len && memcmp(wm->data.ptr, buf, len) == 0) {
+      p->echoed++;
+    }
+    if (p->echoed == p->sent) mg_ws_send(c, "", 0, WEBSOCKET_OP_CLOSE);
+  } else if (ev == MG_EV_CLOSE) {
+    p->closed = true;
+  }
+}
+
+// Send a message that is small compressed, but too big decompressed
+static void wsdfbomb(struct mg_connection *c, int ev, void *ev_data,
+                     void *fn_data) {
+  struct wsdf *p = (struct wsdf *) fn_data;
+  if (ev == MG_EV_WS_OPEN) {
+    size_t len = MG_WS_MAX_MSG_SIZE + 1;
+    char *buf = (char *) calloc(1, len);
+    ASSERT(buf != NULL);
+    mg_ws_send(c, buf, len, WEBSOCKET_OP_BINARY);
+    p->sent = c->send.len;
+    free(buf);
+  } else if (ev == MG_EV_WS_CTL) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    if ((wm->flags & 15) == WEBSOCKET_OP_CLOSE && wm->data.len == 2) {
+      p->code = (uint8_t) wm->data.ptr[0] << 8 | (uint8_t) wm->data.ptr[1];
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    p->closed = true;
+  }
+}
+
+static void test_ws_deflate(void) {
+  const char *url = "ws://127.0.0.1:12360/ws";
+  struct mg_ws_deflate_opts opts;
+  struct mg_connection *c;
+  struct mg_mgr mgr;
+  struct wsdf r;
+  int i, k;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.window_bits = 12;
+  ASSERT(wsdf_negotiate("permessage-deflate; client_max_window_bits", &opts,
+                        "permessage-deflate; server_max_window_bits=12; "
+                        "client_max_window_bits=12"));
+  ASSERT(wsdf_negotiate(
+      "x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=9, "
+      "permessage-deflate",
+      NULL, "permessage-deflate"));
+  ASSERT(wsdf_negotiate("permessage-deflate; foo", NULL, NULL));
+  ASSERT(wsdf_negotiate(",permessage-deflate", NULL, "permessage-deflate"));
+  ASSERT(wsdf_negotiate("permessage-deflate,", NULL, "permessage-deflate"));
+  ASSERT(wsdf_negotiate(" , ;x, permessage-deflate", NULL,
+                        "permessage-deflate"));
+  ASSERT(wsdf_negotiate(",", NULL, NULL));
+  ASSERT(wsdf_negotiate("permessage-deflate; server_max_window_bits", NULL,
+                        NULL));
+  ASSERT(wsdf_negotiate("permessage-deflate; server_max_window_bits=11; "
+                        "client_no_context_takeover",
+                        NULL,
+                        "permessage-deflate; client_no_context_takeover; "
+                        "server_max_window_bits=11"));
+  opts.window_bits = 0;
+  opts.no_context_takeover = true;
+  ASSERT(wsdf_negotiate("permessage-deflate", &opts,
+                        "permessage-deflate; server_no_context_takeover; "
+                        "client_no_context_takeover"));
+
+  // Echo messages: with context takeover, without it, and with a client that
+  // does not offer compression
+  mg_mgr_init(&mgr);
+  opts.window_bits = 10;
+  opts.min_size = 10;
+  for (k = 0; k < 3; k++) {
+    opts.no_context_takeover = k == 1;
+    ASSERT(mg_http_listen(&mgr, url, wsdfs, &opts) != NULL);
+    memset(&r, 0, sizeof(r));
+    c = mg_ws_connect(&mgr, url, wsdfc, &r, NULL);
+    ASSERT(c != NULL);
+    if (k < 2) ASSERT(mg_ws_deflate(c, NULL, &opts));
+    for (i = 0; i < 100 && !r.closed; i++) mg_mgr_poll(&mgr, 1);
+    ASSERT(r.closed);
+    ASSERT(r.echoed == 5);
+    ASSERT(r.negotiated == (k < 2));
+    ASSERT(k == 2 ? r.received > 60000 : r.received < 20000);
+    mg_mgr_free(&mgr);
+    ASSERT(mgr.conns == NULL);
+    mg_mgr_init(&mgr);
+  }
+
+  // Decompressed size is limited by MG_WS_MAX_MSG_SIZE when max_size is 0
+  opts.max_size = 0, opts.no_context_takeover = false;
+  ASSERT(mg_http_listen(&mgr, url, wsdfs, &opts) != NULL);
+  memset(&r, 0, sizeof(r));
+  c = mg_ws_connect(&mgr, url, wsdfbomb, &r, NULL);
+  ASSERT(c != NULL && mg_ws_deflate(c, NULL, &opts));
+  for (i = 0; i < 1000 && !r.closed; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(r.sent > 0 && r.sent < MG_WS_MAX_MSG_SIZE / 100);
+  ASSERT(r.closed && r.code == 1009);
+  mg_mgr_free(&mgr);
+}
+
+static void wsbs(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    c->label[0] = hm->uri.ptr[hm->uri.len - 1];  // Group: /ws/a or /ws/b
+    mg_ws_upgrade(c, hm, NULL);
+  }
+  (void) fn_data;
+}
+
+struct wsb {
+  int opened, got_a, got_big;
+};
+
+static void wsbc(struct mg_connection *c, int ev, void *ev_data,
+                 void *fn_data) {
+  struct wsb *p = (struct wsb *) fn_data;
+  if (ev == MG_EV_WS_OPEN) {
+    p->opened++;
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    if (mg_vcmp(&wm->data, "for a") == 0) p->got_a++;
+    if (wm->data.len == 100000 && wm->data.ptr[99999] == 'z') p->got_big++;
+  }
+  (void) c;
+}
+
+// Data queued outside c->send, as the IO layer sees it
+static size_t wsq(const struct mg_connection *c, const void **buf) {
+  return c->ppending == NULL ? 0 : c->ppending(c, buf);
+}
+
+static void test_ws_broadcast(void) {
+  const char *url = "ws://127.0.0.1:12361/ws/";
+  struct mg_ws_broadcast_opts opts;
+  struct mg_connection c[4];
+  struct mg_mgr mgr;
+  struct wsb r;
+  const void *q;
+  char *big = (char *) calloc(1, 100000), u[40];
+  int i, j;
+
+  // Policies, on fake connections
+  memset(&mgr, 0, sizeof(mgr));
+  memset(c, 0, sizeof(c));
+  memset(&opts, 0, sizeof(opts));
+  for (i = 0; i < 4; i++) {
+    c[i].is_websocket = 1, c[i].label[0] = 'a';
+    c[i].next = i < 3 ? &c[i + 1] : NULL;
+  }
+  mgr.conns = &c[0];
+  c[1].is_client = 1;
+  c[2].label[0] = 'b';
+  mg_send(&c[3], "x", 1);
+  opts.label = "a";
+  ASSERT(mg_ws_broadcast(&mgr, "hello", 5, WEBSOCKET_OP_TEXT, &opts) == 2);
+  ASSERT(wsq(&c[0], &q) == 7 && c[0].send.len == 0);
+  ASSERT(memcmp(q, "\x81\x05hello", 7) == 0);
+  ASSERT(wsq(&c[1], NULL) == 0 && c[1].send.len == 0);
+  ASSERT(wsq(&c[2], NULL) == 0 && c[2].send.len == 0);
+  ASSERT(wsq(&c[3], NULL) == 0 && c[3].send.len == 8);
+  opts.max_backlog = 10;
+  ASSERT(mg_ws_broadcast(&mgr, "hello", 5, WEBSOCKET_OP_TEXT, &opts) == 0);
+  ASSERT(wsq(&c[0], NULL) == 7 && c[3].send.len == 8);
+  opts.policy = MG_WS_COALESCE;
+  ASSERT(mg_ws_broadcast(&mgr, "hi", 2, WEBSOCKET_OP_TEXT, &opts) == 1);
+  ASSERT(wsq(&c[0], &q) == 4 && memcmp(q, "\x81\x02hi", 4) == 0);
+  c[0].psent(&c[0], 1);  // Started frames are not dropped
+  ASSERT(mg_ws_broadcast(&mgr, "ho", 2, WEBSOCKET_OP_TEXT, &opts) == 1);
+  ASSERT(wsq(&c[0], &q) == 3 && memcmp(q, "\x02hi", 3) == 0);
+  c[0].psent(&c[0], 3);
+  ASSERT(wsq(&c[0], &q) == 4 && memcmp(q, "\x81\x02ho", 4) == 0);
+  opts.policy = MG_WS_CLOSE;
+  ASSERT(mg_ws_broadcast(&mgr, "hello", 5, WEBSOCKET_OP_TEXT, &opts) == 0);
+  ASSERT(c[0].is_closing && c[3].is_closing);
+  for (i = 0; i < 4; i++) mg_ws_free(&c[i]), mg_iobuf_free(&c[i].send);
+
+  // Real connections, in two groups
+  mg_mgr_init(&mgr);
+  memset(&r, 0, sizeof(r));
+  ASSERT(mg_http_listen(&mgr, url, wsbs, NULL) != NULL);
+  for (i = 0; i < 6; i++) {
+    mg_snprintf(u, sizeof(u), "%s%c", url, i < 4 ? 'a' : 'b');
+    mg_ws_connect(&mgr, u, wsbc, &r, NULL);
+    // Listen backlog is small, so open clients one by one
+    for (j = 0; j < 100 && r.opened < i + 1; j++) mg_mgr_poll(&mgr, 1);
+  }
+  ASSERT(r.opened == 6);
+  for (i = 0; i < 5; i++) mg_mgr_poll(&mgr, 1);
+  memset(&opts, 0, sizeof(opts));
+  opts.label = "a";
+  ASSERT(mg_ws_broadcast(&mgr, "for a", 5, WEBSOCKET_OP_TEXT, &opts) == 4);
+  memset(big, 'z', 100000);
+  ASSERT(mg_ws_broadcast(&mgr, big, 100000, WEBSOCKET_OP_BINARY, NULL) == 6);
+  for (i = 0; i < 100 && r.got_big < 6; i++) mg_mgr_poll(&mgr, 1);
+  ASSERT(r.got_a == 4);
+  ASSERT(r.got_big == 6);
+  mg_mgr_free(&mgr);
+  ASSERT(mgr.conns == NULL);
+  free(big);
+}
+
+static void test_ws_mask(void) {
+  uint8_t buf[300], ref[300], mask[4] = {0x12, 0x34, 0x56, 0xf8};
+  size_t i, ofs, len;
+  int bad = 0;
+  for (ofs = 0; ofs < 33; ofs++) {
+    for (len = 0; ofs + len <= sizeof(buf); len += 1 + len / 8) {
+      for (i = 0; i < sizeof(buf); i++) buf[i] = ref[i] = (uint8_t) (i * 7);
+      for (i = 0; i < len; i++) ref[ofs + i] ^= mask[i & 3];
+      mg_ws_mask(buf + ofs, len, mask);
+      if (memcmp(buf, ref, sizeof(buf)) != 0) bad++;
+    }
+  }
+  ASSERT(bad == 0);
+  // Mask right before the data, as in a frame
+  for (i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t) i;
+  mg_ws_mask(buf + 4, 100, buf);
+  mg_ws_mask(buf + 4, 100, buf);
+  for (i = 0; i < sizeof(buf); i++) bad += buf[i] != (uint8_t) i;
+  ASSERT(bad == 0);
+}
+
+static void test_ws_reserve(void) {
+  struct mg_connection c;
+  uint8_t *p;
+  size_t i;
+  int bad = 0;
+
+  memset(&c, 0, sizeof(c));
+  mg_send(&c, "x", 1);
+  // Payload is written in place, header slot fits the reserved length
+  ASSERT((p = (uint8_t *) mg_ws_reserve(&c, 70000)) != NULL);
+  ASSERT(p == c.send.buf + 11 && c.send.len == 1);
+  for (i = 0; i < 70000; i++) p[i] = (uint8_t) i;
+  ASSERT(mg_ws_commit(&c, 70000, WEBSOCKET_OP_BINARY) == 70010);
+  ASSERT(c.send.len == 70011);
+  ASSERT(memcmp(c.send.buf, "x\x82\x7f\0\0\0\0\0\x01\x11\x70", 11) == 0);
+  for (i = 0; i < 70000; i++) bad += c.send.buf[11 + i] != (uint8_t) i;
+  ASSERT(bad == 0);
+  ASSERT(mg_ws_commit(&c, 1, WEBSOCKET_OP_BINARY) == 0);  // Not reserved
+
+  // Shorter message than reserved uses a shorter header
+  c.send.len = 0;
+  ASSERT((p = (uint8_t *) mg_ws_reserve(&c, 1000)) == c.send.buf + 4);
+  memcpy(p, "hello", 5);
+  ASSERT(mg_ws_commit(&c, 5, WEBSOCKET_OP_TEXT) == 7);
+  ASSERT(c.send.len == 7 && memcmp(c.send.buf, "\x81\x05hello", 7) == 0);
+
+  // Client frames are masked in place
+  c.send.len = 0, c.is_client = 1;
+  ASSERT((p = (uint8_t *) mg_ws_reserve(&c, 200)) == c.send.buf + 8);
+  memset(p, 'a', 200);
+  ASSERT(mg_ws_commit(&c, 200, WEBSOCKET_OP_TEXT) == 208);
+  ASSERT(c.send.buf[0] == 0x81 && c.send.buf[1] == (0x80 | 126));
+  mg_ws_mask(c.send.buf + 8, 200, c.send.buf + 4);
+  for (i = 0; i < 200; i++) bad += c.send.buf[8 + i] != 'a';
+  ASSERT(bad == 0);
+
+  // mg_ws_send() produces the same frame
+  c.send.len = 0, c.is_client = 0;
+  ASSERT(mg_ws_send(&c, "hello", 5, WEBSOCKET_OP_TEXT) == 7);
+  ASSERT(c.send.len == 7 && memcmp(c.send.buf, "\x81\x05hello", 7) == 0);
+  mg_ws_free(&c);
+  mg_iobuf_free(&c.send);
+}
+
+static void test_ws_utf8(void) {
+  static const char *good[] = {
+      "", "hello", "\xc2\x80", "\xdf\xbf", "\xe0\xa0\x80", "\xed\x9f\xbf",
+      "\xee\x80\x80", "\xef\xbf\xbf", "\xf0\x90\x80\x80",
+      "\xf4\x8f\xbf\xbf", "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5",
+      NULL};
+  static const char *bad[] = {
+      "\x80", "\xbf", "\xc0\x80", "\xc1\xbf", "\xc2", "\xc2\x41",
+      "\xe0\x80\x80", "\xe0\x9f\xbf", "\xed\xa0\x80", "\xed\xbf\xbf",
+      "\xe1\x80", "\xf0\x80\x80\x80", "\xf0\x8f\xbf\xbf",
+      "\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xff", "\xf0\x90\x80",
+      NULL};
+  char buf[200];
+  size_t i, j, len;
+  int n = 0;
+  for (i = 0; good[i] != NULL; i++) {
+    ASSERT(mg_ws_utf8_valid(good[i], strlen(good[i])));
+  }
+  for (i = 0; bad[i] != NULL; i++) {
+    ASSERT(!mg_ws_utf8_valid(bad[i], strlen(bad[i])));
+  }
+  // At every position in a long buffer, to cover vector and word paths
+  for (j = 0; bad[j] != NULL; j++) {
+    len = strlen(bad[j]);
+    for (i = 0; i + len <= sizeof(buf); i++) {
+      memset(buf, 'a', sizeof(buf));
+      memcpy(buf + i, bad[j], len);
+      if (i + len < sizeof(buf)) buf[i + len] = 'b';  // Not a continuation
+      n += mg_ws_utf8_valid(buf, sizeof(buf));
+    }
+  }
+  ASSERT(n == 0);
+  for (i = 0; i + 4 <= sizeof(buf); i++) {
+    memset(buf, 'a', sizeof(buf));
+    memcpy(buf + i, "\xf0\x9f\x98\x80", 4);
+    n += !mg_ws_utf8_valid(buf, sizeof(buf));
+  }
+  ASSERT(n == 0);
+}
+
 static void h7(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
   if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
@@ -2350,6 +4583,15 @@ static void test_json(void) {
   ASSERT(mg_json_get(s, (int) strlen(s), "$.a", &n) == 5);
   s = "{\"a\":{\"a\":[]}}";
   ASSERT(mg_json_get(s, (int) strlen(s), "$.a", &n) == 5);
+  // Keys match whole path components, and are not read past the path end
+  s = "{\"a\":{\"b\":1},\"ab\":2}";
+  ASSERT(mg_json_get(s, (int) strlen(s), "$.ab", &n) == 18 && n == 1);
+  ASSERT(mg_json_get(s, (int) strlen(s), "$.a.b", &n) == 10 && n == 1);
+  {
+    char path[4] = "$.a";
+    s = "{\"abc\":1}";
+    ASSERT(mg_json_get(s, (int) strlen(s), path, &n) == MG_JSON_NOT_FOUND);
+  }
 
   ASSERT(mg_json_get("[[1,[2,3]],4]", 13, "$", &n) == 0 && n == 13);
   ASSERT(mg_json_get("[[1,[2,3]],4]", 13, "$[0]", &n) == 1 && n == 9);
@@ -2422,13 +4664,263 @@ static void test_json(void) {
   }
 }
 
+// Index lookups must agree with mg_json_get()
+static bool jidx(const char *json, const char *path) {
+  struct mg_json_tok toks[20];
+  struct mg_json_index idx;
+  int n, len = (int) strlen(json), ofs = mg_json_get(json, len, path, &n);
+  int num = mg_json_index_init(&idx, mg_str(json), toks, 20);
+  int i = mg_json_index_find(&idx, path);
+  if (num <= 0) return false;
+  if (ofs < 0) return i == ofs;
+  return i >= 0 && toks[i].ofs == ofs && toks[i].len == n;
+}
+
+// Exercise vectorised scanners: long strings and whitespace runs, with
+// special characters at every position relative to 16/32-byte blocks
+static void test_json_scan(void) {
+  char buf[300];
+  int i, n, len, bad = 0;
+  for (i = 0; i < 80; i++) {
+    // Whitespace run of i bytes, then a string with an escape at i
+    memset(buf, 0, sizeof(buf));
+    memset(buf, ' ', (size_t) i);
+    buf[i % 3 == 0 ? 0 : i / 2] = i % 2 ? '\t' : '\n';
+    len = i;
+    buf[len++] = '"';
+    memset(buf + len, 'x', 81);
+    buf[len + i] = '\\', buf[len + i + 1] = '"';
+    len += 81;
+    buf[len++] = '"';
+    memset(buf + len, '\r', (size_t) i);
+    len += i;
+    if (mg_json_get(buf, len, "$", &n) != i || n != 83) bad++;
+    // A NUL inside the string makes it invalid
+    buf[i + 1 + (i + 40) % 80] = '\0';
+    if (mg_json_get(buf, len, "$", &n) != MG_JSON_INVALID) bad++;
+  }
+  ASSERT(bad == 0);
+}
+
+static void test_json_index(void) {
+  struct mg_json_tok toks[40];
+  struct mg_json_index idx;
+  const char *s1 = "{\"a\":{},\"b\":7,\"c\":[[],2]}";
+  const char *s2 = "{\"a\":{\"b1\":{}},\"c\":7}";
+  const char *s3 = "[[1,[2,3]],4]";
+  const char *s4 =
+      " { \"id\" : 3 , \"method\": \"sum\", \"params\" :[1, 2.5]} ";
+  double d = 0;
+  char *str;
+
+  ASSERT(jidx(s1, "$") && jidx(s1, "$.a") && jidx(s1, "$.b"));
+  ASSERT(jidx(s1, "$.c") && jidx(s1, "$.c[0]") && jidx(s1, "$.c[1]"));
+  ASSERT(jidx(s1, "$.c[3]") && jidx(s1, "$.d") && jidx(s1, "$[0]"));
+  ASSERT(jidx(s2, "$.a") && jidx(s2, "$.a.b1") && jidx(s2, "$.a.b2"));
+  ASSERT(jidx(s2, "$.a.b") && jidx(s2, "$.a1") && jidx(s2, "$.c"));
+  ASSERT(jidx(s3, "$[0]") && jidx(s3, "$[1]") && jidx(s3, "$[2]"));
+  ASSERT(jidx(s3, "$[0][1]") && jidx(s3, "$[0][1][1]") && jidx(s3, "$[0][2]"));
+  ASSERT(jidx(s4, "$") && jidx(s4, "$.id") && jidx(s4, "$.params[1]"));
+  ASSERT(jidx(" true ", "$") && jidx("\"a\\\"b\"", "$") && jidx("[ ]", "$"));
+
+  // Token tree: types, parent/next links, sizes and keys
+  ASSERT(mg_json_index_init(&idx, mg_str(s4), toks, 10) == 6);
+  ASSERT(toks[0].type == MG_JSON_OBJECT && toks[0].size == 3);
+  ASSERT(toks[0].parent == -1 && toks[0].next == -1);
+  ASSERT(toks[1].type == MG_JSON_NUMBER && toks[1].next == 2);
+  ASSERT(toks[1].klen == 2 && memcmp(s4 + toks[1].kofs, "id", 2) == 0);
+  ASSERT(toks[2].type == MG_JSON_STRING && toks[2].len == 5);
+  ASSERT(toks[3].type == MG_JSON_ARRAY && toks[3].size == 2);
+  ASSERT(toks[3].next == -1 && toks[4].parent == 3 && toks[5].next == -1);
+  ASSERT(mg_json_index_find(&idx, "$.params[1]") == 5);
+  ASSERT(mg_json_index_find(&idx, "$.params[2]") == MG_JSON_NOT_FOUND);
+  ASSERT(mg_json_index_find(&idx, "$.id[0]") == MG_JSON_NOT_FOUND);
+  ASSERT(mg_json_index_find(&idx, "$.params[1") == MG_JSON_INVALID);
+  ASSERT(mg_json_index_find(&idx, "x") == MG_JSON_INVALID);
+
+  // Existing helpers work on the values resolved through the index
+  ASSERT(mg_json_get_long(mg_json_index_get(&idx, "$.id"), "$", 0) == 3);
+  ASSERT(mg_json_get_num(mg_json_index_get(&idx, "$.params[1]"), "$", &d));
+  ASSERT(d == 2.5);
+  ASSERT(!mg_json_get_num(mg_json_index_get(&idx, "$.nope"), "$", &d));
+  str = mg_json_get_str(mg_json_index_get(&idx, "$.method"), "$");
+  ASSERT(str != NULL && strcmp(str, "sum") == 0);
+  free(str);
+
+  // Errors
+  ASSERT(mg_json_index_init(&idx, mg_str(s4), toks, 5) == MG_JSON_TOO_MANY);
+  ASSERT(mg_json_index_init(&idx, mg_str(""), toks, 10) == MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("[1,]"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("[1}"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("{\"a\":1"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("1 2"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("{\"a\" 1}"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("{\"a\":1,}"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("{\"a\"}"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("{\"a\":}"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("[{\"a\"]"), toks, 10) ==
+         MG_JSON_INVALID);
+  ASSERT(mg_json_index_init(&idx, mg_str("{\"a\":[]}"), toks, 10) == 2);
+  ASSERT(mg_json_index_init(&idx, mg_str("[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[]"
+                                         "]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]"),
+                            toks, 40) == MG_JSON_TOO_DEEP);
+  ASSERT(mg_json_index_find(&idx, "$") == MG_JSON_NOT_FOUND);
+}
+
+// Decode chunked body in place, return the number of chunks or -1
+static int dechunk(struct mg_iobuf *io) {
+  size_t i = 0, n = 0;
+  int num = 0;
+  for (;;) {
+    char *end;
+    unsigned long len = strtoul((char *) io->buf + i, &end, 16);
+    i = (size_t) (end - (char *) io->buf);
+    if (i + 2 + len + 2 > io->len || memcmp(io->buf + i, "\r\n", 2) != 0 ||
+        memcmp(io->buf + i + 2 + len, "\r\n", 2) != 0) {
+      return -1;
+    }
+    memmove(io->buf + n, io->buf + i + 2, len);
+    n += len, i += 2 + len + 2;
+    if (len == 0) break;
+    num++;
+  }
+  io->len = n;
+  return num;
+}
+
+// Nest arrays, never finish
+static bool json_deep(struct mg_json_writer *w, void *fn_data) {
+  int *i = (int *) fn_data;
+  if (w == NULL) {
+    *i = -1;
+    return false;
+  }
+  mg_json_begin_array(w);
+  (*i)++;
+  return true;
+}
+
+static void test_json_writer(void) {
+  struct mg_iobuf io = {0, 0, 0}, out = {0, 0, 0};
+  struct mg_json_writer w;
+  struct mg_connection c;
+  int i, n;
+  double d;
+  char *s;
+
+  mg_json_writer_init(&w, mg_write_iobuf, &io);
+  mg_json_begin_object(&w);
+  mg_json_key(&w, "a");
+  mg_json_int(&w, -12345678901LL);
+  mg_json_key(&w, "b\"");
+  mg_json_begin_array(&w);
+  mg_json_num(&w, 0.1);
+  mg_json_bool(&w, true);
+  mg_json_bool(&w, false);
+  mg_json_null(&w);
+  mg_json_begin_object(&w);
+  mg_json_end_object(&w);
+  mg_json_begin_array(&w);
+  mg_json_end_array(&w);
+  d = 0.0;
+  mg_json_num(&w, d / d);
+  mg_json_end_array(&w);
+  mg_json_key(&w, "c");
+  mg_json_str(&w, "x\"\\\n\t\x01y");
+  mg_json_key(&w, "d");
+  mg_json_strn(&w, "ab\0c", 4);
+  mg_json_end_object(&w);
+  ASSERT(io.len > 0);
+  ASSERT(strcmp((char *) io.buf,
+                "{\"a\":-12345678901,\"b\\\"\":[0.1,true,false,null,{},[],"
+                "null],\"c\":\"x\\\"\\\\\\n\\t\\u0001y\",\"d\":\"ab\\u0000c\""
+                "}") == 0);
+  s = mg_json_get_str(mg_str_n((char *) io.buf, io.len), "$.c");
+  ASSERT(s != NULL && strcmp(s, "x\"\\\n\t\x01y") == 0);
+  free(s);
+  ASSERT(mg_json_get_num(mg_str_n((char *) io.buf, io.len), "$.a", &d));
+  ASSERT(d == -12345678901.0);
+  mg_iobuf_free(&io);
+
+  // Streamed response, generated while the send buffer is short
+  memset(&c, 0, sizeof(c));
+  i = 0;
+  ASSERT(mg_http_json_stream(&c, 200, "Content-Type: application/json\r\n",
+                             json_ids, &i));
+  ASSERT(c.pfn != NULL && c.pfn_data != NULL);
+  n = mg_http_get_request_len(c.send.buf, c.send.len);
+  ASSERT(n > 0 && mg_strstr(mg_str_n((char *) c.send.buf, (size_t) n),
+                            mg_str("Transfer-Encoding: chunked")) != NULL);
+  mg_iobuf_del(&c.send, 0, (size_t) n);
+  for (n = 0; c.pfn_data != NULL; n++) {
+    c.pfn(&c, MG_EV_POLL, NULL, c.pfn_data);
+    ASSERT(c.send.len < MG_IO_SIZE + 100);
+    mg_iobuf_add(&out, out.len, c.send.buf, c.send.len, MG_IO_SIZE);
+    c.send.len = 0;
+  }
+  ASSERT(n > 2 && i == 3000);
+  ASSERT(dechunk(&out) == n);
+  i = 0;
+  mg_json_writer_init(&w, mg_write_iobuf, &io);
+  while (json_ids(&w, &i)) continue;
+  ASSERT(out.len == io.len && memcmp(out.buf, io.buf, io.len) == 0);
+  ASSERT(mg_json_get((char *) io.buf, (int) io.len, "$", &n) == 0);
+  ASSERT(n == (int) io.len);
+  ASSERT(mg_json_get((char *) io.buf, (int) io.len, "$[2999]", &n) > 0);
+  mg_iobuf_free(&c.send);
+  mg_iobuf_free(&out);
+  mg_iobuf_free(&io);
+
+  // Connection closed in the middle, the generator cleans up
+  memset(&c, 0, sizeof(c));
+  i = 0;
+  ASSERT(mg_http_json_stream(&c, 200, "", json_ids, &i));
+  c.pfn(&c, MG_EV_POLL, NULL, c.pfn_data);
+  ASSERT(i > 0 && i < 3000);
+  c.pfn(&c, MG_EV_CLOSE, NULL, c.pfn_data);
+  ASSERT(i == -1 && c.pfn_data == NULL);
+  mg_iobuf_free(&c.send);
+
+  // Nesting deeper than MG_JSON_MAX_DEPTH fails the writer
+  mg_json_writer_init(&w, mg_write_iobuf, &io);
+  for (i = 0; i < MG_JSON_MAX_DEPTH + 1; i++) mg_json_begin_array(&w);
+  ASSERT(w.failed && io.len == MG_JSON_MAX_DEPTH);
+  mg_json_int(&w, 1);
+  for (i = 0; i < MG_JSON_MAX_DEPTH + 1; i++) mg_json_end_array(&w);
+  ASSERT(io.len == MG_JSON_MAX_DEPTH);
+  mg_iobuf_free(&io);
+
+  // A streamed response with too deep nesting closes the connection
+  memset(&c, 0, sizeof(c));
+  i = 0;
+  ASSERT(mg_http_json_stream(&c, 200, "", json_deep, &i));
+  c.pfn(&c, MG_EV_POLL, NULL, c.pfn_data);
+  ASSERT(c.is_closing && c.pfn_data != NULL);
+  c.pfn(&c, MG_EV_CLOSE, NULL, c.pfn_data);
+  ASSERT(i == -1 && c.pfn_data == NULL);
+  mg_iobuf_free(&c.send);
+}
+
 int main(void) {
   const char *debug_level = getenv("V");
   if (debug_level == NULL) debug_level = "3";
   mg_log_set(debug_level);
 
   test_json();
+  test_json_index();
+  test_json_writer();
+  test_json_scan();
   test_str();
+  test_wprintf();
+  test_dbl();
   test_globmatch();
   test_get_header_var();
   test_rewrites();
@@ -2438,8 +4930,20 @@ int main(void) {
   test_packed();
   test_crc32();
   test_multipart();
+  test_multipart_stream();
+  test_multipart_upload();
   test_invalid_listen_addr();
+  test_bridge();
   test_http_chunked();
+  test_http_chunked_many();
+  test_http_pool();
+  test_http_defer();
+#if MG_ENABLE_HTTP2
+  test_http2();
+#endif
+  test_http_tmpl();
+  test_http_proxy();
+  test_http_gzip();
   test_http_upload();
   test_http_stream_buffer();
   test_http_parse();
@@ -2455,6 +4959,16 @@ int main(void) {
   test_tls();
   test_ws();
   test_ws_fragmentation();
+  test_ws_reassembly();
+  test_ws_stream();
+  test_ws_keepalive();
+  test_ws_utf8_close();
+  test_ws_mask();
+  test_ws_reserve();
+  test_ws_utf8();
+  test_inflate();
+  test_ws_deflate();
+  test_ws_broadcast();
   test_http_client();
   test_http_server();
   test_http_404();
@@ -2462,6 +4976,7 @@ int main(void) {
   test_http_pipeline();
   test_http_range();
   test_mqtt();
+  test_mqtt_broker();
   printf("SUCCESS. Total tests: %d\n", s_num_tests);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,376 @@
+// WebSocket benchmark and conformance harness: make ws_bench
+// A server and N clients echo messages over loopback, in one event manager:
+//   make ws_bench WS_BENCH_ARGS="-c 50 -s 1024 -n 2000 -w 8 -f 4 -t -u"
+// Run the conformance corpus against the frame parser:
+//   make ws_bench WS_BENCH_ARGS="-C"
+#include "mongoose.h"
+
+#include <time.h>
+
+static const char *s_url = "ws://127.0.0.1:12399/ws";
+
+static uint64_t usecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void server(struct mg_connection *c, int ev, void *ev_data,
+                   void *fn_data) {
+  if (ev == MG_EV_HTTP_MSG) {
+    if (fn_data != NULL) mg_ws_check_utf8(c, true);
+    mg_ws_upgrade(c, (struct mg_http_message *) ev_data, NULL);
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    mg_ws_send(c, wm->data.ptr, wm->data.len, wm->flags & 15);
+  }
+}
+
+// Benchmark parameters, see usage()
+static size_t s_conns = 10, s_size = 64, s_msgs = 10000, s_window = 16;
+static size_t s_frags = 1, s_rate = 0;
+static bool s_text, s_utf8;
+
+struct client {
+  struct mg_connection *c;
+  size_t sent, received;
+  uint64_t *stamps;  // Send time of every message, echoes come in order
+  uint64_t next;     // With a rate limit: when to send the next message
+};
+
+static char *s_payload;
+static uint64_t *s_lat;  // Latencies of all messages, usecs
+static size_t s_nlat, s_opened, s_bytes;
+
+static void send_msg(struct client *cl) {
+  struct mg_connection *c = cl->c;
+  size_t i, ofs, n = s_size / s_frags;
+  int op = s_text ? WEBSOCKET_OP_TEXT : WEBSOCKET_OP_BINARY;
+  cl->stamps[cl->sent++] = usecs();
+  for (i = 0; i < s_frags; i++) {
+    size_t len = i + 1 < s_frags ? n : s_size - n * i;
+    ofs = c->send.len;
+    mg_ws_send(c, s_payload + n * i, len, i == 0 ? op : WEBSOCKET_OP_CONTINUE);
+    if (i + 1 < s_frags) c->send.buf[ofs] &= 0x7f;  // Clear FIN flag
+  }
+}
+
+static void client(struct mg_connection *c, int ev, void *ev_data,
+                   void *fn_data) {
+  struct client *cl = (struct client *) fn_data;
+  if (ev == MG_EV_WS_OPEN) {
+    s_opened++;
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    s_lat[s_nlat++] = usecs() - cl->stamps[cl->received++];
+    s_bytes += wm->data.len;
+    if (s_rate == 0 && cl->sent < s_msgs) send_msg(cl);
+  } else if (ev == MG_EV_ERROR) {
+    printf("client error: %s\n", (char *) ev_data);
+  }
+  (void) c;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static uint64_t pct(double p) {
+  size_t i = (size_t) (p * (double) s_nlat);
+  return s_nlat == 0 ? 0 : s_lat[i < s_nlat ? i : s_nlat - 1];
+}
+
+static int bench(void) {
+  struct client *cls = (struct client *) calloc(s_conns, sizeof(*cls));
+  uint64_t start, last, now;
+  size_t i, j, done = 0, total = s_conns * s_msgs;
+  struct mg_mgr mgr;
+  double secs;
+
+  s_payload = (char *) malloc(s_size + 1);
+  s_lat = (uint64_t *) calloc(total + 1, sizeof(*s_lat));
+  memset(s_payload, 'a', s_size);
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, s_url, server, s_utf8 ? &mgr : NULL);
+  // Listen backlog is small, open clients one by one
+  for (i = 0; i < s_conns; i++) {
+    cls[i].stamps = (uint64_t *) calloc(s_msgs + 1, sizeof(uint64_t));
+    cls[i].c = mg_ws_connect(&mgr, s_url, client, &cls[i], NULL);
+    for (j = 0; j < 1000 && s_opened <= i; j++) mg_mgr_poll(&mgr, 1);
+  }
+  if (s_opened != s_conns) {
+    printf("only %lu of %lu clients connected\n", (unsigned long) s_opened,
+           (unsigned long) s_conns);
+    return 1;
+  }
+
+  start = last = usecs();
+  for (i = 0; i < s_conns; i++) {
+    cls[i].next = start;
+    while (s_rate == 0 && cls[i].sent < s_msgs && cls[i].sent < s_window) {
+      send_msg(&cls[i]);
+    }
+  }
+  while (s_nlat < total) {
+    now = usecs();
+    for (i = 0; s_rate > 0 && i < s_conns; i++) {
+      while (cls[i].sent < s_msgs && cls[i].next <= now) {
+        send_msg(&cls[i]);
+        cls[i].next += 1000000 / s_rate;
+      }
+    }
+    mg_mgr_poll(&mgr, 0);
+    if (s_nlat > done) done = s_nlat, last = now;
+    if (now - last > 5000000) break;  // No progress in 5 seconds
+  }
+  secs = (double) (usecs() - start) / 1e6;
+
+  qsort(s_lat, s_nlat, sizeof(*s_lat), cmp_u64);
+  printf("%lu clients, %lu byte %s messages in %lu fragment(s)",
+         (unsigned long) s_conns, (unsigned long) s_size,
+         s_text ? "text" : "binary", (unsigned long) s_frags);
+  if (s_rate > 0) {
+    printf(", %lu msgs/s per client\n", (unsigned long) s_rate);
+  } else {
+    printf(", window %lu\n", (unsigned long) s_window);
+  }
+  printf("%-12s %lu of %lu in %.2f s\n", "echoed", (unsigned long) s_nlat,
+         (unsigned long) total, secs);
+  printf("%-12s %.0f msgs/s, %.1f MB/s\n", "throughput",
+         (double) s_nlat / secs, (double) s_bytes / secs / 1e6);
+  printf("%-12s p50 %lu, p99 %lu, p999 %lu, max %lu\n", "latency, us",
+         (unsigned long) pct(0.5), (unsigned long) pct(0.99),
+         (unsigned long) pct(0.999), (unsigned long) pct(1.0));
+
+  mg_mgr_free(&mgr);
+  for (i = 0; i < s_conns; i++) free(cls[i].stamps);
+  free(cls), free(s_lat), free(s_payload);
+  return s_nlat == total ? 0 : 1;
+}
+
+// Conformance corpus. Frames are written unmasked, the harness masks them.
+// Generated cases have a header byte and a payload length instead.
+// Expected is what the server sends back: a token per frame (type letter
+// and payload length, or status code for close) and "." for a TCP close.
+// The harness always ends with a close frame, which adds "C ." if the
+// server is still open
+struct wscase {
+  const char *name;
+  const char *frames;
+  size_t len;
+  uint8_t gen_op;
+  size_t gen_len;
+  const char *expected;
+};
+
+#define CASE(name, frames, expected) \
+  { name, frames, sizeof(frames) - 1, 0, 0, expected }
+#define GEN(name, op, len, expected) \
+  { name, "", 0, op, len, expected }
+
+static const struct wscase s_cases[] = {
+    CASE("1.1 text", "\x81\x05hello", "T5 C ."),
+    CASE("1.2 empty binary", "\x82\x00", "B0 C ."),
+    GEN("1.3 text, 125 bytes", 0x81, 125, "T125 C ."),
+    GEN("1.4 text, 126 bytes", 0x81, 126, "T126 C ."),
+    GEN("1.5 binary, 65535 bytes", 0x82, 65535, "B65535 C ."),
+    GEN("1.6 binary, 65536 bytes", 0x82, 65536, "B65536 C ."),
+    GEN("1.7 binary, 1 MB", 0x82, 1048576, "B1048576 C ."),
+    CASE("2.1 ping", "\x89\x04ping", "P4 C ."),
+    GEN("2.2 ping, 125 bytes", 0x89, 125, "P125 C ."),
+    GEN("2.3 ping, 126 bytes", 0x89, 126, "C1002 ."),
+    CASE("2.4 fragmented ping", "\x09\x01\x61\x80\x01\x62", "C1002 ."),
+    CASE("2.5 unsolicited pong", "\x8a\x02hi", "C ."),
+    CASE("3.1 RSV1 without extension", "\xc1\x02hi", "C1002 ."),
+    CASE("3.2 RSV2", "\xa1\x02hi", "C1002 ."),
+    CASE("3.3 RSV3", "\x91\x02hi", "C1002 ."),
+    CASE("4.1 reserved data opcode", "\x83\x00", "C1002 ."),
+    CASE("4.2 reserved control opcode", "\x8b\x00", "C1002 ."),
+    CASE("5.1 fragments", "\x01\x03hel\x80\x02lo", "T5 C ."),
+    CASE("5.2 ping between fragments", "\x01\x03hel\x89\x00\x80\x02lo",
+         "P0 T5 C ."),
+    CASE("5.3 continuation first", "\x80\x02lo", "C1002 ."),
+    CASE("5.4 message inside fragments", "\x01\x03hel\x81\x02lo", "C1002 ."),
+    CASE("5.5 empty fragments", "\x01\x00\x00\x00\x80\x00", "T0 C ."),
+    CASE("6.1 valid UTF-8",
+         "\x81\x0b\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5", "T11 C ."),
+    CASE("6.2 invalid UTF-8", "\x81\x01\xff", "C1007 ."),
+    CASE("6.3 UTF-8 split by fragments", "\x01\x01\xce\x80\x01\xba", "T2 C ."),
+    CASE("6.4 truncated UTF-8", "\x81\x02\xce\xba\x81\x01\xce", "T2 C1007 ."),
+    CASE("6.5 surrogate", "\x81\x03\xed\xa0\x80", "C1007 ."),
+    CASE("7.1 close with code", "\x88\x02\x03\xe8", "C1000 ."),
+    CASE("7.2 close with reason", "\x88\x05\x03\xe8" "bye", "C1000 ."),
+    CASE("7.3 data after close", "\x88\x00\x81\x02hi", "C ."),
+};
+
+struct conf {
+  const struct wscase *tc;
+  char out[100];
+  bool upgraded, done;
+};
+
+static void conf_add(struct conf *p, const char *token) {
+  size_t n = strlen(p->out);
+  mg_snprintf(p->out + n, sizeof(p->out) - n, "%s%s", n > 0 ? " " : "", token);
+}
+
+// Send an unmasked frame masked, as a client must
+static void conf_send(struct mg_connection *c, uint8_t b0, const char *data,
+                      size_t len) {
+  uint8_t hdr[14] = {0, 0, 0, 0}, mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+  size_t n = 2, ofs;
+  hdr[0] = b0;
+  if (len < 126) {
+    hdr[1] = (uint8_t) len;
+  } else if (len < 65536) {
+    hdr[1] = 126, hdr[2] = (uint8_t) (len >> 8), hdr[3] = (uint8_t) len;
+    n = 4;
+  } else {
+    hdr[1] = 127, n = 10;
+    hdr[6] = (uint8_t) (len >> 24), hdr[7] = (uint8_t) (len >> 16);
+    hdr[8] = (uint8_t) (len >> 8), hdr[9] = (uint8_t) len;
+  }
+  hdr[1] |= 0x80;
+  memcpy(hdr + n, mask, sizeof(mask));
+  mg_send(c, hdr, n + 4);
+  ofs = c->send.len;
+  mg_send(c, data, len);
+  mg_ws_mask(c->send.buf + ofs, len, mask);
+}
+
+static void conf_fn(struct mg_connection *c, int ev, void *ev_data,
+                    void *fn_data) {
+  struct conf *p = (struct conf *) fn_data;
+  if (ev == MG_EV_CONNECT) {
+    mg_printf(c, "GET /ws HTTP/1.1\r\nUpgrade: websocket\r\n"
+                 "Connection: Upgrade\r\nSec-WebSocket-Version: 13\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n");
+  } else if (ev == MG_EV_READ && !p->upgraded) {
+    // Handshake is done, send the frames
+    const struct wscase *tc = p->tc;
+    int n = mg_http_get_request_len(c->recv.buf, c->recv.len);
+    size_t i = 0;
+    if (n <= 0) return;
+    p->upgraded = true, mg_iobuf_del(&c->recv, 0, (size_t) n);
+    if (tc->gen_len > 0) {
+      char *buf = (char *) malloc(tc->gen_len);
+      memset(buf, 'x', tc->gen_len);
+      conf_send(c, tc->gen_op, buf, tc->gen_len);
+      free(buf);
+    }
+    while (i + 2 <= tc->len) {
+      size_t len = (uint8_t) tc->frames[i + 1];
+      conf_send(c, (uint8_t) tc->frames[i], tc->frames + i + 2, len);
+      i += 2 + len;
+    }
+    conf_send(c, 0x88, "", 0);
+  }
+  if (ev == MG_EV_READ && p->upgraded) {
+    uint8_t *b = c->recv.buf;
+    while (c->recv.len >= 2) {
+      size_t hl = 2, len = b[1] & 0x7f;
+      char token[20];
+      if (len == 126) {
+        hl = 4, len = c->recv.len < 4 ? 0 : (size_t) b[2] << 8 | b[3];
+      } else if (len == 127) {
+        size_t i;
+        hl = 10, len = 0;
+        for (i = 2; i < 10 && c->recv.len >= 10; i++) len = len << 8 | b[i];
+      }
+      if (c->recv.len < hl || c->recv.len < hl + len) break;
+      switch (b[0] & 15) {
+        case WEBSOCKET_OP_TEXT: token[0] = 'T'; break;
+        case WEBSOCKET_OP_BINARY: token[0] = 'B'; break;
+        case WEBSOCKET_OP_PONG: token[0] = 'P'; break;
+        case WEBSOCKET_OP_CLOSE: token[0] = 'C'; break;
+        default: token[0] = '?'; break;
+      }
+      if (token[0] != 'C') {
+        mg_snprintf(token + 1, sizeof(token) - 1, "%lu", (unsigned long) len);
+      } else if (len >= 2) {
+        mg_snprintf(token + 1, sizeof(token) - 1, "%d", b[hl] << 8 | b[hl + 1]);
+      } else {
+        token[1] = '\0';
+      }
+      conf_add(p, token);
+      mg_iobuf_del(&c->recv, 0, hl + len);
+    }
+  } else if (ev == MG_EV_CLOSE) {
+    conf_add(p, ".");
+    p->done = true;
+  }
+  (void) ev_data;
+}
+
+static int conformance(void) {
+  size_t i, j, failed = 0, n = sizeof(s_cases) / sizeof(s_cases[0]);
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr);
+  mg_http_listen(&mgr, s_url, server, &mgr);  // With UTF-8 validation
+  for (i = 0; i < n; i++) {
+    struct conf conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.tc = &s_cases[i];
+    mg_connect(&mgr, "tcp://127.0.0.1:12399", conf_fn, &conf);
+    for (j = 0; j < 2000 && !conf.done; j++) mg_mgr_poll(&mgr, 1);
+    if (strcmp(conf.out, s_cases[i].expected) == 0) {
+      printf("PASS  %s\n", s_cases[i].name);
+    } else {
+      printf("FAIL  %s: got [%s], expected [%s]\n", s_cases[i].name, conf.out,
+             s_cases[i].expected);
+      failed++;
+    }
+  }
+  mg_mgr_free(&mgr);
+  printf("%lu of %lu cases passed\n", (unsigned long) (n - failed),
+         (unsigned long) n);
+  return failed == 0 ? 0 : 1;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [OPTIONS]\n"
+         "  -c N   number of clients, default: %lu\n"
+         "  -s N   message size, default: %lu\n"
+         "  -n N   messages per client, default: %lu\n"
+         "  -w N   messages in flight per client, default: %lu\n"
+         "  -r N   send N msgs/s per client instead, open loop\n"
+         "  -f N   send each message in N fragments, default: %lu\n"
+         "  -t     send text, default: binary\n"
+         "  -u     validate UTF-8 on the server\n"
+         "  -C     run the conformance corpus instead\n",
+         prog, (unsigned long) s_conns, (unsigned long) s_size,
+         (unsigned long) s_msgs, (unsigned long) s_window,
+         (unsigned long) s_frags);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int i;
+  mg_log_set("0");
+  for (i = 1; i < argc; i++) {
+    const char *arg = i + 1 < argc ? argv[i + 1] : "0";
+    size_t v = (size_t) atol(arg);
+    if (strcmp(argv[i], "-C") == 0) return conformance();
+    if (strcmp(argv[i], "-t") == 0) {
+      s_text = true;
+    } else if (strcmp(argv[i], "-u") == 0) {
+      s_utf8 = true;
+    } else if (strcmp(argv[i], "-c") == 0 && v > 0) {
+      s_conns = v, i++;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      s_size = v, i++;
+    } else if (strcmp(argv[i], "-n") == 0 && v > 0) {
+      s_msgs = v, i++;
+    } else if (strcmp(argv[i], "-w") == 0 && v > 0) {
+      s_window = v, i++;
+    } else if (strcmp(argv[i], "-r") == 0) {
+      s_rate = v, i++;
+    } else if (strcmp(argv[i], "-f") == 0 && v > 0) {
+      s_frags = v, i++;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  return bench();
+}